@@ -8,6 +8,11 @@
 // Example: rpicam-detect --post-process-file object_detect_tf.json --lores-width 400 --lores-height 300 -t 0 --object cat -o cat%03d.jpg
 
 #include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <queue>
+#include <thread>
 
 #include "core/rpicam_app.hpp"
 #include "core/still_options.hpp"
@@ -25,12 +30,16 @@ struct DetectOptions : public StillOptions
 			("object", value<std::string>(&object), "Name of object to detect")
 			("gap", value<unsigned int>(&gap)->default_value(30), "Smallest gap between captures in frames")
 			("timeformat", value<std::string>(&timeformat)->default_value("%m%d%H%M%S"), "Date/Time format string - see C++ strftime()")
+			("zsl-window", value<unsigned int>(&zsl_window)->default_value(0),
+			 "With --zsl, the number of frames after a detection to look through for the one where the object "
+			 "was detected with the most confidence")
 			;
 	}
 
 	std::string object;
 	unsigned int gap;
 	std::string timeformat;
+	unsigned int zsl_window;
 
 	virtual void Print() const override
 	{
@@ -38,6 +47,8 @@ struct DetectOptions : public StillOptions
 		std::cerr << "    object: " << object << std::endl;
 		std::cerr << "    gap: " << gap << std::endl;
 		std::cerr << "    timeformat: " << timeformat << std::endl;
+		if (Get().zsl)
+			std::cerr << "    zsl-window: " << zsl_window << std::endl;
 	}
 };
 
@@ -48,11 +59,280 @@ public:
 	DetectOptions *GetOptions() const { return static_cast<DetectOptions *>(RPiCamApp::GetOptions()); }
 };
 
+static std::string generate_filename(DetectOptions *options)
+{
+	char filename[128];
+	uint32_t framestart = options->Get().framestart;
+	if (options->Get().datetime)
+	{
+		std::time_t raw_time;
+		std::time(&raw_time);
+		char time_string[32];
+		std::tm *time_info = std::localtime(&raw_time);
+		std::strftime(time_string, sizeof(time_string), options->timeformat.c_str(), time_info);
+		snprintf(filename, sizeof(filename), "%s%s.%s", options->Get().output.c_str(), time_string,
+				 options->Get().encoding.c_str());
+	}
+	else if (options->Get().timestamp)
+		snprintf(filename, sizeof(filename), "%s%u.%s", options->Get().output.c_str(), (unsigned)time(NULL),
+				 options->Get().encoding.c_str());
+	else
+		snprintf(filename, sizeof(filename), options->Get().output.c_str(), framestart);
+	filename[sizeof(filename) - 1] = 0;
+	options->Set().framestart = framestart + 1;
+	return std::string(filename);
+}
+
+// In ZSL mode the camera never stops, so captures are saved on a background thread while detection carries
+// on. We hold on to one request at a time, and copy the still image out of any others so as not to starve
+// the camera of buffers. With a --save-queue of 0 images are saved before Save() returns.
+class DetectSaver
+{
+public:
+	DetectSaver(RPiCamDetectApp &app, unsigned int depth) : app_(app), depth_(depth)
+	{
+		if (depth_)
+			thread_ = std::thread(&DetectSaver::saveThread, this);
+	}
+
+	~DetectSaver()
+	{
+		try
+		{
+			Drain();
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: failed to save image: " << e.what());
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		cond_.notify_all();
+		if (thread_.joinable())
+			thread_.join();
+	}
+
+	void Save(CompletedRequestPtr &payload, std::string const &filename)
+	{
+		Job job;
+		job.filename = filename;
+		job.metadata = payload->metadata;
+		job.info = app_.GetStreamInfo(app_.StillStream());
+
+		if (!depth_)
+		{
+			job.request = payload;
+			save(job);
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		space_cond_.wait(lock, [this]() { return queue_.size() < depth_ || error_; });
+		rethrow();
+		bool hold = held_ == 0;
+		lock.unlock();
+
+		if (hold)
+			job.request = payload;
+		else
+		{
+			BufferReadSync r(&app_, payload->buffers[app_.StillStream()]);
+			libcamera::Span<uint8_t> const &mem = r.Get()[0];
+			job.copy.assign(mem.begin(), mem.end());
+		}
+		LOG(2, "Queued capture for saving" << (hold ? "" : " (copied)"));
+
+		lock.lock();
+		held_ += hold;
+		queue_.push(std::move(job));
+		cond_.notify_one();
+	}
+
+	// Wait for everything queued to be written, rethrowing the first error from the save thread.
+	void Drain()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		space_cond_.wait(lock, [this]() { return (queue_.empty() && !busy_) || error_; });
+		rethrow();
+	}
+
+private:
+	struct Job
+	{
+		CompletedRequestPtr request;
+		std::vector<uint8_t> copy;
+		StreamInfo info;
+		libcamera::ControlList metadata;
+		std::string filename;
+	};
+
+	void rethrow()
+	{
+		if (error_)
+			std::rethrow_exception(std::exchange(error_, nullptr));
+	}
+
+	void save(Job &job)
+	{
+		LOG(1, "Save image " << job.filename);
+		if (job.request)
+		{
+			BufferReadSync r(&app_, job.request->buffers[app_.StillStream()]);
+			jpeg_save(r.Get(), job.info, job.metadata, job.filename, app_.CameraModel(), app_.GetOptions());
+		}
+		else
+		{
+			std::vector<libcamera::Span<uint8_t>> mem = { libcamera::Span<uint8_t>(job.copy.data(),
+																				   job.copy.size()) };
+			jpeg_save(mem, job.info, job.metadata, job.filename, app_.CameraModel(), app_.GetOptions());
+		}
+	}
+
+	void saveThread()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true)
+		{
+			cond_.wait(lock, [this]() { return !queue_.empty() || abort_; });
+			if (queue_.empty())
+				return;
+
+			Job job = std::move(queue_.front());
+			queue_.pop();
+			busy_ = true;
+			lock.unlock();
+
+			std::exception_ptr error;
+			try
+			{
+				save(job);
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+			bool held = job.request != nullptr;
+			job = Job(); // give back any request before we say we're done
+
+			lock.lock();
+			held_ -= held;
+			busy_ = false;
+			if (error && !error_)
+				error_ = error;
+			space_cond_.notify_all();
+		}
+	}
+
+	RPiCamDetectApp &app_;
+	unsigned int depth_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::condition_variable space_cond_;
+	std::queue<Job> queue_;
+	unsigned int held_ = 0;
+	bool busy_ = false;
+	bool abort_ = false;
+	std::exception_ptr error_;
+	std::thread thread_;
+};
+
+// Return the highest confidence of any detection of the object we're looking for, or a negative number if
+// there weren't any.
+static float best_confidence(DetectOptions const *options, CompletedRequestPtr &completed_request)
+{
+	std::vector<Detection> detections;
+	float best = -1;
+	if (completed_request->post_process_metadata.Get("object_detect.results", detections) == 0)
+	{
+		for (auto const &d : detections)
+		{
+			if (d.name.find(options->object) != std::string::npos)
+				best = std::max(best, d.confidence);
+		}
+	}
+	return best;
+}
+
+// With ZSL every request carries a full resolution still alongside the viewfinder image the detector ran on,
+// so we can save the very frame the object was seen in without ever stopping the camera. If a window is
+// given, we look forward that many frames and save whichever one the object was detected in most confidently.
+
+static void event_loop_zsl(RPiCamDetectApp &app)
+{
+	DetectOptions *options = app.GetOptions();
+	app.OpenCamera();
+	app.ConfigureZsl();
+	app.StartCamera();
+	auto start_time = std::chrono::high_resolution_clock::now();
+	unsigned int last_capture_frame = 0;
+	// Depth 0 keeps saves synchronous, which would hold up the camera, so queue at least a couple.
+	DetectSaver saver(app, std::max(options->Get().save_queue, 2u));
+
+	CompletedRequestPtr best_request;
+	float best = -1;
+	unsigned int window_end = 0;
+
+	while (true)
+	{
+		RPiCamApp::Msg msg = app.Wait();
+		if (msg.type == RPiCamApp::MsgType::Timeout)
+		{
+			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+			app.StopCamera();
+			app.StartCamera();
+			continue;
+		}
+		if (msg.type == RPiCamApp::MsgType::Quit)
+			break;
+
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		auto now = std::chrono::high_resolution_clock::now();
+		if (options->Get().timeout && (now - start_time) > options->Get().timeout.value)
+			break;
+
+		app.ShowPreview(completed_request, app.ViewfinderStream());
+
+		unsigned int sequence = completed_request->sequence;
+		float confidence = best_confidence(options, completed_request);
+		if (best_request)
+		{
+			if (confidence > best)
+			{
+				best_request = completed_request;
+				best = confidence;
+			}
+		}
+		else if (confidence >= 0 && sequence - last_capture_frame >= options->gap)
+		{
+			LOG(1, options->object << " detected");
+			best_request = completed_request;
+			best = confidence;
+			window_end = sequence + options->zsl_window;
+		}
+
+		if (best_request && (int)(sequence - window_end) >= 0)
+		{
+			LOG(2, "Saving frame " << best_request->sequence << " with confidence " << best);
+			last_capture_frame = best_request->sequence;
+			saver.Save(best_request, generate_filename(options));
+			best_request.reset();
+		}
+	}
+
+	best_request.reset();
+	saver.Drain();
+}
+
 // The main even loop for the application.
 
 static void event_loop(RPiCamDetectApp &app)
 {
 	DetectOptions *options = app.GetOptions();
+	if (options->Get().zsl)
+		return event_loop_zsl(app);
+
 	app.OpenCamera();
 	app.ConfigureViewfinder();
 	app.StartCamera();
@@ -81,12 +361,8 @@ static void event_loop(RPiCamDetectApp &app)
 			if (options->Get().timeout && (now - start_time) > options->Get().timeout.value)
 				return;
 
-			std::vector<Detection> detections;
 			bool detected = completed_request->sequence - last_capture_frame >= options->gap &&
-							completed_request->post_process_metadata.Get("object_detect.results", detections) == 0 &&
-							std::find_if(detections.begin(), detections.end(), [options](const Detection &d)
-										 { return d.name.find(options->object) != std::string::npos; }) !=
-								detections.end();
+							best_confidence(options, completed_request) >= 0;
 
 			app.ShowPreview(completed_request, app.ViewfinderStream());
 
@@ -109,29 +385,10 @@ static void event_loop(RPiCamDetectApp &app)
 			libcamera::Stream *stream = app.StillStream(&info);
 			BufferReadSync r(&app, completed_request->buffers[stream]);
 			const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
-			uint32_t framestart = options->Get().framestart;
 
-			// Generate a filename for the output and save it.
-			char filename[128];
-			if (options->Get().datetime)
-			{
-				std::time_t raw_time;
-				std::time(&raw_time);
-				char time_string[32];
-				std::tm *time_info = std::localtime(&raw_time);
-				std::strftime(time_string, sizeof(time_string), options->timeformat.c_str(), time_info);
-				snprintf(filename, sizeof(filename), "%s%s.%s", options->Get().output.c_str(), time_string,
-						 options->Get().encoding.c_str());
-			}
-			else if (options->Get().timestamp)
-				snprintf(filename, sizeof(filename), "%s%u.%s", options->Get().output.c_str(), (unsigned)time(NULL),
-						 options->Get().encoding.c_str());
-			else
-				snprintf(filename, sizeof(filename), options->Get().output.c_str(), framestart);
-			filename[sizeof(filename) - 1] = 0;
-			options->Set().framestart = framestart + 1;
+			std::string filename = generate_filename(options);
 			LOG(1, "Save image " << filename);
-			jpeg_save(mem, info, completed_request->metadata, std::string(filename), app.CameraModel(), options);
+			jpeg_save(mem, info, completed_request->metadata, filename, app.CameraModel(), options);
 
 			// Restart camera in preview mode.
 			app.Teardown();
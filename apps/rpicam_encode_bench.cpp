@@ -0,0 +1,373 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rpicam_encode_bench.cpp - measure encoder throughput and latency without a camera.
+ */
+
+// Example: rpicam-encode-bench --codec libav --libav-video-codec libx264 --width 1920 --height 1080 --frames 600
+
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <libcamera/formats.h>
+
+#include "core/dma_heaps.hpp"
+#include "core/rpicam_app.hpp"
+#include "core/video_options.hpp"
+
+#include "encoder/encoder.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions : public VideoOptions
+{
+	BenchOptions() : VideoOptions()
+	{
+		using namespace boost::program_options;
+		// clang-format off
+		options_->add_options()
+			("pattern", value<std::string>(&pattern)->default_value("bars"),
+			 "Synthetic frames to encode when there is no --replay file, either bars (moving colour bars) "
+			 "or noise (random, the hardest case for the encoder)")
+			("replay", value<std::string>(&replay),
+			 "Encode frames read from this raw YUV420 file, of --width by --height with no padding, looping "
+			 "when it runs out. The frames are copied into the buffers, and that counts towards the CPU time")
+			("buffers", value<unsigned int>(&buffers)->default_value(4),
+			 "Number of DMA-heap buffers cycled through the encoder")
+			("json", value<std::string>(&json),
+			 "Also write the results to this file as JSON")
+			;
+		// clang-format on
+	}
+
+	std::string pattern;
+	std::string replay;
+	unsigned int buffers;
+	std::string json;
+
+	virtual bool Parse(int argc, char *argv[]) override
+	{
+		if (VideoOptions::Parse(argc, argv) == false)
+			return false;
+
+		if (pattern != "bars" && pattern != "noise")
+			throw std::runtime_error("unrecognised pattern " + pattern);
+		if (buffers < 1)
+			throw std::runtime_error("at least one buffer is needed");
+		return true;
+	}
+
+	virtual void Print() const override
+	{
+		VideoOptions::Print();
+		std::cerr << "    pattern: " << pattern << std::endl;
+		std::cerr << "    replay: " << replay << std::endl;
+		std::cerr << "    buffers: " << buffers << std::endl;
+		std::cerr << "    json: " << json << std::endl;
+	}
+};
+
+class RPiCamEncodeBench : public RPiCamApp
+{
+public:
+	RPiCamEncodeBench() : RPiCamApp(std::make_unique<BenchOptions>()) {}
+	BenchOptions *GetOptions() const { return static_cast<BenchOptions *>(RPiCamApp::GetOptions()); }
+};
+
+// Everything the encoder callbacks record, from whichever threads they run on.
+struct BenchState
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	// Encoders return buffers in the order they were given them, as RPiCamEncoder also assumes.
+	std::deque<std::pair<unsigned int, Clock::time_point>> in_flight;
+	std::vector<unsigned int> free_buffers;
+	std::map<int64_t, Clock::time_point> awaiting_output;
+	std::vector<double> release_us;
+	std::vector<double> output_us;
+	uint64_t output_bytes = 0;
+	Clock::time_point last_event;
+};
+
+static void sync_buffer(DmaHeapPool::Buffer const &buffer, uint64_t flags)
+{
+	struct dma_buf_sync dma_sync {};
+	dma_sync.flags = flags | DMA_BUF_SYNC_WRITE;
+	if (::ioctl(buffer.fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync))
+		LOG_ERROR("WARNING: failed to sync dma buf");
+}
+
+static void fill_bars(uint8_t *mem, StreamInfo const &info, unsigned int phase)
+{
+	// 75% colour bars as Y, U, V, scrolling sideways by a few pixels each frame.
+	static const uint8_t bars[8][3] = { { 180, 128, 128 }, { 162, 44, 142 }, { 131, 156, 44 }, { 112, 72, 58 },
+										{ 84, 184, 198 }, { 65, 100, 212 }, { 35, 212, 114 }, { 16, 128, 128 } };
+	unsigned int bar_width = std::max(info.width / 8, 1u);
+	unsigned int shift = phase * 8;
+	uint8_t *u = mem + info.stride * info.height;
+	uint8_t *v = u + (info.stride / 2) * (info.height / 2);
+
+	for (unsigned int y = 0; y < info.height; y++)
+	{
+		for (unsigned int x = 0; x < info.width; x++)
+		{
+			uint8_t const *bar = bars[((x + shift) / bar_width) % 8];
+			mem[y * info.stride + x] = bar[0];
+			if (!(x & 1) && !(y & 1))
+			{
+				u[(y / 2) * (info.stride / 2) + x / 2] = bar[1];
+				v[(y / 2) * (info.stride / 2) + x / 2] = bar[2];
+			}
+		}
+	}
+}
+
+static void fill_noise(uint8_t *mem, std::size_t size, std::mt19937 &rng)
+{
+	for (std::size_t i = 0; i + 4 <= size; i += 4)
+	{
+		uint32_t r = rng();
+		memcpy(mem + i, &r, 4);
+	}
+}
+
+// Copies the next frame of the replay file into the buffer, going back to the start at the end.
+static void fill_replay(uint8_t *mem, StreamInfo const &info, std::ifstream &file, std::string const &name)
+{
+	for (unsigned int pass = 0; pass < 2; pass++)
+	{
+		bool ok = true;
+		for (unsigned int y = 0; y < info.height && ok; y++)
+			ok = !!file.read((char *)mem + y * info.stride, info.width);
+		uint8_t *chroma = mem + info.stride * info.height;
+		for (unsigned int y = 0; y < info.height && ok; y++)
+			ok = !!file.read((char *)chroma + y * (info.stride / 2), info.width / 2);
+		if (ok)
+			return;
+		file.clear();
+		file.seekg(0);
+	}
+	throw std::runtime_error(name + " does not hold a whole frame of this size");
+}
+
+static double percentile(std::vector<double> &values, double p)
+{
+	if (values.empty())
+		return 0;
+	std::size_t index = std::min<std::size_t>(values.size() - 1, p / 100 * values.size());
+	std::nth_element(values.begin(), values.begin() + index, values.end());
+	return values[index];
+}
+
+static double cpu_seconds()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void run_bench(RPiCamEncodeBench &app)
+{
+	BenchOptions *options = app.GetOptions();
+
+	StreamInfo info;
+	info.width = options->Get().width ? options->Get().width : 1920;
+	info.height = options->Get().height ? options->Get().height : 1080;
+	info.width &= ~1;
+	info.height &= ~1;
+	// The same alignment the ISP gives its YUV420 output.
+	info.stride = (info.width + 63) & ~63;
+	info.pixel_format = libcamera::formats::YUV420;
+	info.colour_space = libcamera::ColorSpace::Rec709;
+	std::size_t frame_size = info.stride * info.height * 3 / 2;
+
+	unsigned int frames = options->Get().frames ? options->Get().frames : 300;
+	int64_t frame_us = 1e6 / options->Get().framerate.value_or(30);
+
+	DmaHeapPool pool;
+	if (!pool.isValid())
+		throw std::runtime_error("no dma-heap available");
+
+	BenchState state;
+	std::vector<DmaHeapPool::Buffer> buffers;
+	std::mt19937 rng(1);
+	for (unsigned int i = 0; i < options->buffers; i++)
+	{
+		buffers.push_back(pool.acquire("rpicam-bench", frame_size));
+		if (!buffers.back().mem)
+			throw std::runtime_error("failed to allocate dma-heap buffer");
+
+		sync_buffer(buffers.back(), DMA_BUF_SYNC_START);
+		if (options->pattern == "noise")
+			fill_noise((uint8_t *)buffers.back().mem, frame_size, rng);
+		else
+			fill_bars((uint8_t *)buffers.back().mem, info, i);
+		sync_buffer(buffers.back(), DMA_BUF_SYNC_END);
+		state.free_buffers.push_back(i);
+	}
+
+	std::ifstream replay;
+	if (!options->replay.empty())
+	{
+		replay.open(options->replay, std::ios::binary);
+		if (!replay)
+			throw std::runtime_error("failed to open " + options->replay);
+	}
+
+	std::unique_ptr<Encoder> encoder(Encoder::Create(options, info));
+	encoder->SetInputDoneCallback(
+		[&state](void *)
+		{
+			std::scoped_lock<std::mutex> lock(state.mutex);
+			if (state.in_flight.empty())
+				return;
+			auto [index, submitted] = state.in_flight.front();
+			state.in_flight.pop_front();
+			state.last_event = Clock::now();
+			state.release_us.push_back(std::chrono::duration<double, std::micro>(state.last_event - submitted).count());
+			state.free_buffers.push_back(index);
+			state.cv.notify_one();
+		});
+	encoder->SetOutputReadyCallback(
+		[&state, frame_us](void *, size_t size, int64_t timestamp_us, bool, bool partial)
+		{
+			std::scoped_lock<std::mutex> lock(state.mutex);
+			state.last_event = Clock::now();
+			state.output_bytes += size;
+			// A frame sent in slices is only done with the last one.
+			if (partial)
+				return;
+			// libav gives timestamps relative to the first frame, which we stamped as one frame time.
+			auto it = state.awaiting_output.find(timestamp_us);
+			if (it == state.awaiting_output.end())
+				it = state.awaiting_output.find(timestamp_us + frame_us);
+			if (it == state.awaiting_output.end())
+				return;
+			state.output_us.push_back(std::chrono::duration<double, std::micro>(state.last_event - it->second).count());
+			state.awaiting_output.erase(it);
+		});
+
+	std::string codec = options->Get().codec;
+	if (codec == "libav")
+		codec += ":" + options->Get().libav_video_codec;
+	LOG(1, "Encoding " << frames << " frames of " << info.width << "x" << info.height << " with " << codec);
+
+	double cpu_start = cpu_seconds();
+	Clock::time_point start = Clock::now();
+	for (unsigned int i = 0; i < frames; i++)
+	{
+		// Only pace the frames if asked for a framerate, otherwise go as fast as the encoder allows.
+		if (options->Get().framerate)
+			std::this_thread::sleep_until(start + std::chrono::microseconds(i * frame_us));
+
+		unsigned int index;
+		{
+			std::unique_lock<std::mutex> lock(state.mutex);
+			if (!state.cv.wait_for(lock, std::chrono::seconds(5), [&state] { return !state.free_buffers.empty(); }))
+				throw std::runtime_error("encoder stopped returning buffers");
+			index = state.free_buffers.back();
+			state.free_buffers.pop_back();
+		}
+
+		DmaHeapPool::Buffer const &buffer = buffers[index];
+		if (replay.is_open())
+		{
+			sync_buffer(buffer, DMA_BUF_SYNC_START);
+			fill_replay((uint8_t *)buffer.mem, info, replay, options->replay);
+			sync_buffer(buffer, DMA_BUF_SYNC_END);
+		}
+
+		int64_t timestamp_us = (i + 1) * frame_us;
+		{
+			std::scoped_lock<std::mutex> lock(state.mutex);
+			Clock::time_point now = Clock::now();
+			state.in_flight.emplace_back(index, now);
+			state.awaiting_output[timestamp_us] = now;
+		}
+		encoder->EncodeBuffer(buffer.fd.get(), frame_size, buffer.mem, info, timestamp_us);
+	}
+
+	// Deleting the encoder flushes out whatever it still holds.
+	encoder.reset();
+	double cpu = cpu_seconds() - cpu_start;
+
+	std::scoped_lock<std::mutex> lock(state.mutex);
+	double seconds = std::chrono::duration<double>(state.last_event - start).count();
+	double fps = seconds > 0 ? frames / seconds : 0;
+	double kbps = seconds > 0 ? state.output_bytes * 8 / seconds / 1000 : 0;
+	double cpu_percent = seconds > 0 ? 100 * cpu / seconds : 0;
+	// Percentiles reorder the samples, so take the count first.
+	std::size_t release_count = state.release_us.size(), output_count = state.output_us.size();
+	double release[4] = { percentile(state.release_us, 50), percentile(state.release_us, 90),
+						  percentile(state.release_us, 99), percentile(state.release_us, 100) };
+	double output[4] = { percentile(state.output_us, 50), percentile(state.output_us, 90),
+						 percentile(state.output_us, 99), percentile(state.output_us, 100) };
+
+	// Encoders that write their own output, such as libav to a container, never report packets.
+	std::printf("%u frames of %ux%u in %.3fs: %.2f fps, %.0f kbps, CPU %.3fs (%.1f%% of one core)\n", frames,
+				info.width, info.height, seconds, fps, kbps, cpu, cpu_percent);
+	std::printf("buffer release latency (ms, %zu frames): p50 %.2f p90 %.2f p99 %.2f max %.2f\n", release_count,
+				release[0] / 1000, release[1] / 1000, release[2] / 1000, release[3] / 1000);
+	if (output_count)
+		std::printf("encoded output latency (ms, %zu frames): p50 %.2f p90 %.2f p99 %.2f max %.2f\n", output_count,
+					output[0] / 1000, output[1] / 1000, output[2] / 1000, output[3] / 1000);
+
+	if (!options->json.empty())
+	{
+		FILE *fp = fopen(options->json.c_str(), "w");
+		if (!fp)
+			throw std::runtime_error("failed to open " + options->json);
+		fprintf(fp,
+				"{\"codec\":\"%s\",\"width\":%u,\"height\":%u,\"frames\":%u,\"seconds\":%.6f,\"fps\":%.3f,"
+				"\"kbps\":%.1f,\"cpu_seconds\":%.6f,\"cpu_percent\":%.2f,",
+				codec.c_str(), info.width, info.height, frames, seconds, fps, kbps, cpu, cpu_percent);
+		fprintf(fp, "\"release_latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},", release[0],
+				release[1], release[2], release[3]);
+		if (output_count)
+			fprintf(fp, "\"output_latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},", output[0],
+					output[1], output[2], output[3]);
+		fprintf(fp, "\"output_frames\":%zu}\n", output_count);
+		fclose(fp);
+	}
+
+	for (auto &buffer : buffers)
+		pool.discard(std::move(buffer));
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		RPiCamEncodeBench app;
+		BenchOptions *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			if (options->Get().verbose >= 2)
+				options->Print();
+
+			run_bench(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,458 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rpicam_pp_bench.cpp - measure a post-processing stage chain on recorded frames, without a camera.
+ */
+
+// Example: rpicam-pp-bench --post-process-file assets/motion_detect.json --replay clip.yuv --width 1920 --height 1080
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
+
+#include "core/buffer_sync.hpp"
+#include "core/rpicam_app.hpp"
+#include "core/video_options.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions : public VideoOptions
+{
+	BenchOptions() : VideoOptions()
+	{
+		using namespace boost::program_options;
+		// clang-format off
+		options_->add_options()
+			("pattern", value<std::string>(&pattern)->default_value("bars"),
+			 "Synthetic frames to use when there is no --replay, either bars (moving colour bars) or noise")
+			("replay", value<std::string>(&replay),
+			 "Use frames read from this raw YUV420 file, of --width by --height with no padding, looping when it "
+			 "runs out. If it's a directory, the files in it are read one after another in name order. Any lores "
+			 "stream gets these frames scaled down, as the ISP would")
+			("buffers", value<unsigned int>(&buffers)->default_value(4),
+			 "Number of requests' worth of buffers cycled through the stages")
+			("json", value<std::string>(&json),
+			 "Also write the results to this file as JSON")
+			;
+		// clang-format on
+	}
+
+	std::string pattern;
+	std::string replay;
+	unsigned int buffers;
+	std::string json;
+
+	virtual bool Parse(int argc, char *argv[]) override
+	{
+		if (VideoOptions::Parse(argc, argv) == false)
+			return false;
+
+		if (pattern != "bars" && pattern != "noise")
+			throw std::runtime_error("unrecognised pattern " + pattern);
+		if (buffers < 1)
+			throw std::runtime_error("at least one buffer is needed");
+		if (Get().post_process_file.empty())
+			throw std::runtime_error("a --post-process-file is needed");
+		return true;
+	}
+
+	virtual void Print() const override
+	{
+		VideoOptions::Print();
+		std::cerr << "    pattern: " << pattern << std::endl;
+		std::cerr << "    replay: " << replay << std::endl;
+		std::cerr << "    buffers: " << buffers << std::endl;
+		std::cerr << "    json: " << json << std::endl;
+	}
+};
+
+class RPiCamPpBench : public RPiCamApp
+{
+public:
+	RPiCamPpBench() : RPiCamApp(std::make_unique<BenchOptions>()) {}
+	BenchOptions *GetOptions() const { return static_cast<BenchOptions *>(RPiCamApp::GetOptions()); }
+};
+
+// Everything that finished requests record, from whichever threads they finish on.
+struct BenchState
+{
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<unsigned int> free_buffers;
+	std::map<unsigned int, Clock::time_point> submitted;
+	std::vector<double> output_us;
+	unsigned int returned = 0;
+	Clock::time_point last_event;
+};
+
+static void fill_bars(uint8_t *mem, StreamInfo const &info, unsigned int phase)
+{
+	// 75% colour bars as Y, U, V, scrolling sideways by a few pixels each frame.
+	static const uint8_t bars[8][3] = { { 180, 128, 128 }, { 162, 44, 142 }, { 131, 156, 44 }, { 112, 72, 58 },
+										{ 84, 184, 198 }, { 65, 100, 212 }, { 35, 212, 114 }, { 16, 128, 128 } };
+	unsigned int bar_width = std::max(info.width / 8, 1u);
+	unsigned int shift = phase * 8;
+	uint8_t *u = mem + info.stride * info.height;
+	uint8_t *v = u + (info.stride / 2) * (info.height / 2);
+
+	for (unsigned int y = 0; y < info.height; y++)
+	{
+		for (unsigned int x = 0; x < info.width; x++)
+		{
+			uint8_t const *bar = bars[((x + shift) / bar_width) % 8];
+			mem[y * info.stride + x] = bar[0];
+			if (!(x & 1) && !(y & 1))
+			{
+				u[(y / 2) * (info.stride / 2) + x / 2] = bar[1];
+				v[(y / 2) * (info.stride / 2) + x / 2] = bar[2];
+			}
+		}
+	}
+}
+
+static void fill_noise(uint8_t *mem, std::size_t size, std::mt19937 &rng)
+{
+	for (std::size_t i = 0; i + 4 <= size; i += 4)
+	{
+		uint32_t r = rng();
+		memcpy(mem + i, &r, 4);
+	}
+}
+
+// Reads frames from a file, or from each file in a directory in turn, going back to the start at the end.
+class ReplaySource
+{
+public:
+	ReplaySource(std::string const &path)
+	{
+		if (fs::is_directory(path))
+		{
+			for (auto const &entry : fs::directory_iterator(path))
+			{
+				if (entry.is_regular_file())
+					files_.push_back(entry.path().string());
+			}
+			std::sort(files_.begin(), files_.end());
+		}
+		else
+			files_.push_back(path);
+
+		if (files_.empty())
+			throw std::runtime_error("no files to replay in " + path);
+	}
+
+	void Read(uint8_t *mem, StreamInfo const &info)
+	{
+		// Give up if we get through every file without finding a whole frame.
+		for (std::size_t tries = 0; tries <= files_.size(); tries++)
+		{
+			if (!file_.is_open())
+			{
+				file_.open(files_[index_], std::ios::binary);
+				if (!file_)
+					throw std::runtime_error("failed to open " + files_[index_]);
+			}
+
+			bool ok = true;
+			for (unsigned int y = 0; y < info.height && ok; y++)
+				ok = !!file_.read((char *)mem + y * info.stride, info.width);
+			uint8_t *chroma = mem + info.stride * info.height;
+			for (unsigned int y = 0; y < info.height && ok; y++)
+				ok = !!file_.read((char *)chroma + y * (info.stride / 2), info.width / 2);
+			if (ok)
+				return;
+
+			file_.close();
+			index_ = (index_ + 1) % files_.size();
+		}
+		throw std::runtime_error("nothing to replay holds a whole frame of this size");
+	}
+
+private:
+	std::vector<std::string> files_;
+	std::size_t index_ = 0;
+	std::ifstream file_;
+};
+
+// Make the lores image from the main one, which is what the ISP would have done.
+static void fill_lores(uint8_t *dst, StreamInfo &lores_info, const uint8_t *src, StreamInfo &info)
+{
+	if (lores_info.pixel_format != libcamera::formats::YUV420)
+	{
+		PostProcessingStage::RgbConversion conversion;
+		conversion.resize = PostProcessingStage::RgbConversion::Resize::Scale;
+		// libcamera's RGB888 is stored B first.
+		conversion.bgr = lores_info.pixel_format == libcamera::formats::RGB888;
+		PostProcessingStage::Yuv420ToRgb(dst, src, info, lores_info, conversion);
+		return;
+	}
+
+	// Nearest neighbour scaling of each plane will do.
+	for (unsigned int plane = 0; plane < 3; plane++)
+	{
+		const unsigned int shift = plane ? 1 : 0;
+		const unsigned int src_stride = info.stride >> shift, dst_stride = lores_info.stride >> shift;
+		const unsigned int src_w = info.width >> shift, src_h = info.height >> shift;
+		const unsigned int dst_w = lores_info.width >> shift, dst_h = lores_info.height >> shift;
+		const uint8_t *src_plane = src + (plane ? info.stride * info.height : 0) +
+								   (plane == 2 ? src_stride * src_h : 0);
+		uint8_t *dst_plane = dst + (plane ? lores_info.stride * lores_info.height : 0) +
+							 (plane == 2 ? dst_stride * dst_h : 0);
+
+		for (unsigned int y = 0; y < dst_h; y++)
+		{
+			const uint8_t *src_row = src_plane + (y * src_h / dst_h) * src_stride;
+			uint8_t *dst_row = dst_plane + y * dst_stride;
+			for (unsigned int x = 0; x < dst_w; x++)
+				dst_row[x] = src_row[x * src_w / dst_w];
+		}
+	}
+}
+
+static double percentile(std::vector<double> &values, double p)
+{
+	if (values.empty())
+		return 0;
+	std::size_t index = std::min<std::size_t>(values.size() - 1, p / 100 * values.size());
+	std::nth_element(values.begin(), values.begin() + index, values.end());
+	return values[index];
+}
+
+static double cpu_seconds()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void run_bench(RPiCamPpBench &app)
+{
+	BenchOptions *options = app.GetOptions();
+
+	app.ConfigureOffline(options->buffers);
+
+	StreamInfo info, lores_info;
+	libcamera::Stream *stream = app.VideoStream(&info);
+	libcamera::Stream *lores_stream = app.LoresStream(&lores_info);
+	std::vector<libcamera::FrameBuffer *> buffers = app.GetBuffers(stream);
+	std::vector<libcamera::FrameBuffer *> lores_buffers;
+	if (lores_stream)
+		lores_buffers = app.GetBuffers(lores_stream);
+
+	unsigned int frames = options->Get().frames ? options->Get().frames : 300;
+	int64_t frame_us = 1e6 / options->Get().framerate.value_or(30);
+
+	BenchState state;
+	std::mt19937 rng(1);
+	for (unsigned int i = 0; i < buffers.size(); i++)
+	{
+		BufferWriteSync w(&app, buffers[i]);
+		libcamera::Span<uint8_t> mem = w.Get()[0];
+		if (options->pattern == "noise")
+			fill_noise(mem.data(), mem.size(), rng);
+		else
+			fill_bars(mem.data(), info, i);
+		state.free_buffers.push_back(i);
+	}
+
+	std::unique_ptr<ReplaySource> replay;
+	if (!options->replay.empty())
+		replay = std::make_unique<ReplaySource>(options->replay);
+
+	// Requests come back from the stages through the app's message queue, as they do from the camera.
+	std::thread collector(
+		[&app, &state]()
+		{
+			while (true)
+			{
+				RPiCamApp::Msg msg = app.Wait();
+				if (msg.type == RPiCamApp::MsgType::Quit)
+					return;
+				if (msg.type != RPiCamApp::MsgType::RequestComplete)
+					continue;
+
+				unsigned int sequence = std::get<CompletedRequestPtr>(msg.payload)->sequence;
+				std::scoped_lock<std::mutex> lock(state.mutex);
+				auto it = state.submitted.find(sequence);
+				if (it != state.submitted.end())
+				{
+					state.output_us.push_back(std::chrono::duration<double, std::micro>(Clock::now() - it->second).count());
+					state.submitted.erase(it);
+				}
+			}
+		});
+
+	app.GetPostProcessor().KeepStageSamples(true);
+	app.StartOffline();
+
+	LOG(1, "Running " << frames << " frames of " << info.width << "x" << info.height << " through "
+					  << options->Get().post_process_file);
+
+	const libcamera::Rectangle scaler_crop(0, 0, info.width, info.height);
+	double cpu_start = cpu_seconds();
+	Clock::time_point start = Clock::now();
+	for (unsigned int i = 0; i < frames; i++)
+	{
+		// Only pace the frames if asked for a framerate, otherwise go as fast as the stages allow.
+		if (options->Get().framerate)
+			std::this_thread::sleep_until(start + std::chrono::microseconds(i * frame_us));
+
+		unsigned int index;
+		{
+			std::unique_lock<std::mutex> lock(state.mutex);
+			if (!state.cv.wait_for(lock, std::chrono::seconds(10), [&state] { return !state.free_buffers.empty(); }))
+				throw std::runtime_error("post-processing stopped returning requests");
+			index = state.free_buffers.back();
+			state.free_buffers.pop_back();
+		}
+
+		if (replay || lores_stream)
+		{
+			BufferWriteSync w(&app, buffers[index]);
+			uint8_t *mem = w.Get()[0].data();
+			if (replay)
+				replay->Read(mem, info);
+			if (lores_stream)
+			{
+				BufferWriteSync lores_w(&app, lores_buffers[index]);
+				fill_lores(lores_w.Get()[0].data(), lores_info, mem, info);
+			}
+		}
+
+		// The request has no libcamera Request behind it. It comes back to us when everyone has let go.
+		CompletedRequest *r = new CompletedRequest(nullptr);
+		r->sequence = i;
+		r->buffers[stream] = buffers[index];
+		if (lores_stream)
+			r->buffers[lores_stream] = lores_buffers[index];
+		r->metadata = libcamera::ControlList(libcamera::controls::controls);
+		r->metadata.set(libcamera::controls::SensorTimestamp, (int64_t)(i + 1) * frame_us * 1000);
+		r->metadata.set(libcamera::controls::ScalerCrop, scaler_crop);
+		r->framerate = 1e6 / frame_us;
+		CompletedRequestPtr request(r,
+									[&state, index](CompletedRequest *cr)
+									{
+										delete cr;
+										std::scoped_lock<std::mutex> lock(state.mutex);
+										state.free_buffers.push_back(index);
+										state.returned++;
+										state.last_event = Clock::now();
+										state.cv.notify_one();
+									});
+
+		{
+			std::scoped_lock<std::mutex> lock(state.mutex);
+			state.submitted[i] = Clock::now();
+		}
+		app.ProcessOffline(request);
+	}
+
+	{
+		std::unique_lock<std::mutex> lock(state.mutex);
+		if (!state.cv.wait_for(lock, std::chrono::seconds(10), [&state, frames] { return state.returned == frames; }))
+			throw std::runtime_error("post-processing did not finish");
+	}
+	double cpu = cpu_seconds() - cpu_start;
+
+	RPiCamApp::MsgType quit = RPiCamApp::MsgType::Quit;
+	RPiCamApp::MsgPayload payload;
+	app.PostMessage(quit, payload);
+	collector.join();
+	app.StopOffline();
+
+	std::scoped_lock<std::mutex> lock(state.mutex);
+	double seconds = std::chrono::duration<double>(state.last_event - start).count();
+	double fps = seconds > 0 ? frames / seconds : 0;
+	double cpu_percent = seconds > 0 ? 100 * cpu / seconds : 0;
+	// Percentiles reorder the samples, so take the count first.
+	std::size_t output_count = state.output_us.size();
+	double output[4] = { percentile(state.output_us, 50), percentile(state.output_us, 90),
+						 percentile(state.output_us, 99), percentile(state.output_us, 100) };
+
+	std::printf("%u frames of %ux%u in %.3fs: %.2f fps, %zu delivered, CPU %.3fs (%.1f%% of one core)\n", frames,
+				info.width, info.height, seconds, fps, output_count, cpu, cpu_percent);
+	std::printf("end to end latency (ms, %zu frames): p50 %.2f p90 %.2f p99 %.2f max %.2f\n", output_count,
+				output[0] / 1000, output[1] / 1000, output[2] / 1000, output[3] / 1000);
+
+	auto timings = app.GetPostProcessor().GetStageTimings();
+	auto samples = app.GetPostProcessor().GetStageSamples();
+	std::vector<std::array<double, 4>> stage_latency;
+	for (unsigned int i = 0; i < timings.size(); i++)
+	{
+		std::size_t count = samples[i].size();
+		stage_latency.push_back({ percentile(samples[i], 50), percentile(samples[i], 90), percentile(samples[i], 99),
+								  percentile(samples[i], 100) });
+		std::array<double, 4> const &l = stage_latency.back();
+		std::printf("  %s (ms, %zu frames, %lu skipped): p50 %.2f p90 %.2f p99 %.2f max %.2f\n", timings[i].first,
+					count, (unsigned long)timings[i].second->skipped, l[0] / 1000, l[1] / 1000, l[2] / 1000,
+					l[3] / 1000);
+	}
+
+	if (!options->json.empty())
+	{
+		FILE *fp = fopen(options->json.c_str(), "w");
+		if (!fp)
+			throw std::runtime_error("failed to open " + options->json);
+		fprintf(fp,
+				"{\"width\":%u,\"height\":%u,\"frames\":%u,\"delivered\":%zu,\"seconds\":%.6f,\"fps\":%.3f,"
+				"\"cpu_seconds\":%.6f,\"cpu_percent\":%.2f,",
+				info.width, info.height, frames, output_count, seconds, fps, cpu, cpu_percent);
+		fprintf(fp, "\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},\"stages\":[", output[0],
+				output[1], output[2], output[3]);
+		for (unsigned int i = 0; i < timings.size(); i++)
+		{
+			std::array<double, 4> const &l = stage_latency[i];
+			fprintf(fp,
+					"%s{\"name\":\"%s\",\"count\":%lu,\"skipped\":%lu,"
+					"\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f}}",
+					i ? "," : "", timings[i].first, (unsigned long)timings[i].second->count,
+					(unsigned long)timings[i].second->skipped, l[0], l[1], l[2], l[3]);
+		}
+		fprintf(fp, "]}\n");
+		fclose(fp);
+	}
+
+	app.Teardown();
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		RPiCamPpBench app;
+		BenchOptions *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			if (options->Get().verbose >= 2)
+				options->Print();
+
+			run_bench(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
@@ -5,10 +5,24 @@
  * rpicam_raw.cpp - libcamera raw video record app.
  */
 
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include <chrono>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
 
 #include "core/rpicam_encoder.hpp"
 #include "encoder/null_encoder.hpp"
+#include "image/image.hpp"
+#include "core/thread_config.hpp"
 #include "output/output.hpp"
 
 using namespace std::placeholders;
@@ -23,17 +37,459 @@ protected:
 	void createEncoder() { encoder_ = std::unique_ptr<Encoder>(new NullEncoder(GetOptions())); }
 };
 
+// With --raw-headers, every frame is written as an .rpiraw record. The event loop, where the metadata
+// is to hand, queues it up to be matched with the frame as it comes out of the encoder.
+class RawHeaders
+{
+public:
+	explicit RawHeaders(Output *output) : output_(output) {}
+
+	void Start(StreamInfo const &info, std::string const &cam_model)
+	{
+		info_ = info;
+		cam_model_ = cam_model;
+	}
+
+	void Push(int64_t timestamp_us, libcamera::ControlList const &metadata)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		headers_.push_back({ timestamp_us, metadata });
+	}
+
+	// For a frame that the encoder never took.
+	void PopBack()
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		headers_.pop_back();
+	}
+
+	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe, bool partial)
+	{
+		libcamera::ControlList metadata;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			while (!headers_.empty() && headers_.front().first != timestamp_us)
+				headers_.pop_front();
+			if (headers_.empty())
+				throw std::runtime_error("no raw header for frame");
+			metadata = std::move(headers_.front().second);
+			headers_.pop_front();
+		}
+		// One buffer per frame, so that the outputs still see a single keyframe for each. The record
+		// buffer keeps its capacity, so it is only allocated once.
+		std::vector<uint8_t> header = rpiraw_header(info_, metadata, cam_model_, size);
+		record_.assign(header.begin(), header.end());
+		record_.resize(header.size() + size);
+		memcpy(record_.data() + header.size(), mem, size);
+		output_->OutputReady(record_.data(), record_.size(), timestamp_us, keyframe, partial);
+	}
+
+private:
+	Output *output_;
+	StreamInfo info_;
+	std::string cam_model_;
+	std::mutex mutex_;
+	std::deque<std::pair<int64_t, libcamera::ControlList>> headers_;
+	std::vector<uint8_t> record_;
+};
+
+// With --raw-write-behind, frames skip the encoder and output altogether and go to a thread of their own that
+// writes them to the file. We hold on to the request itself while its frame waits, unless that would leave
+// the camera short of buffers, in which case the frame is copied into one of a pool of buffers allocated up
+// front. When neither is possible, the frame is dropped and counted, so storage that can't keep up shows up
+// in the log rather than as frames quietly missing from the file.
+class RawWriter
+{
+public:
+	RawWriter(LibcameraRaw &app) : app_(app), options_(app.GetOptions()) {}
+	~RawWriter()
+	{
+		try
+		{
+			Stop();
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: " << e.what());
+		}
+	}
+
+	void Start()
+	{
+		stream_ = app_.RawStream();
+		info_ = app_.GetStreamInfo(stream_);
+		cam_model_ = app_.CameraModel();
+		frame_size_ = stream_->configuration().frameSize;
+		// Leave the camera at least a couple of buffers to carry on with.
+		unsigned int buffers = app_.GetBuffers(stream_).size();
+		max_held_ = buffers > 2 ? buffers - 2 : 0;
+
+		size_t pool_size = (frame_size_ + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+		for (unsigned int i = 0; i < options_->Get().raw_write_behind; i++)
+		{
+			void *mem;
+			if (posix_memalign(&mem, DIRECT_ALIGN, pool_size))
+				throw std::runtime_error("RawWriter: failed to allocate frame pool");
+			pool_.push_back(static_cast<uint8_t *>(mem));
+			free_.push_back(i);
+		}
+		if (posix_memalign((void **)&staging_, DIRECT_ALIGN, STAGING_SIZE))
+			throw std::runtime_error("RawWriter: failed to allocate staging buffer");
+
+		openFile();
+		abort_ = false;
+		start_time_ = last_report_time_ = std::chrono::steady_clock::now();
+		thread_ = std::thread(&RawWriter::writerThread, this);
+	}
+
+	// Called from the event loop, and never waits for the storage.
+	void Write(CompletedRequestPtr &completed_request)
+	{
+		libcamera::FrameBuffer *buffer = completed_request->buffers[stream_];
+		auto ts = completed_request->metadata.get(libcamera::controls::FrameWallClock);
+		Item item;
+		item.timestamp_us = (ts ? *ts : buffer->metadata().timestamp) / 1000;
+		if (options_->Get().raw_headers)
+			item.header = rpiraw_header(info_, completed_request->metadata, cam_model_, frame_size_);
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		if (!error_.empty())
+			throw std::runtime_error("RawWriter: " + error_);
+		if (queue_.size() >= options_->Get().raw_write_behind || (held_ >= max_held_ && free_.empty()))
+		{
+			if (!dropping_)
+				LOG_ERROR("WARNING: RawWriter: storage is not keeping up, dropping frames");
+			dropping_ = true;
+			dropped_++;
+			return;
+		}
+		dropping_ = false;
+
+		if (held_ < max_held_)
+		{
+			item.request = completed_request;
+			held_++;
+		}
+		else
+		{
+			item.pool_index = free_.back();
+			free_.pop_back();
+			lock.unlock();
+			BufferReadSync r(&app_, buffer);
+			memcpy(pool_[item.pool_index], r.Get()[0].data(), frame_size_);
+			lock.lock();
+			copied_++;
+		}
+		queue_.push_back(std::move(item));
+		lock.unlock();
+		cond_.notify_one();
+	}
+
+	// Write everything still queued, close the file and report how it went.
+	void Stop()
+	{
+		if (!thread_.joinable())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		cond_.notify_one();
+		thread_.join();
+
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time_).count();
+		LOG(1, "RawWriter: wrote " << frames_ << " frames, " << offset_ / 1000000 << "MB at "
+								   << (seconds > 0 ? offset_ / 1e6 / seconds : 0) << "MB/s, " << copied_
+								   << " copied, " << dropped_ << " dropped");
+		for (uint8_t *mem : pool_)
+			free(mem);
+		pool_.clear();
+		free_.clear();
+		free(staging_);
+		staging_ = nullptr;
+		if (!error_.empty())
+			throw std::runtime_error("RawWriter: " + error_);
+	}
+
+private:
+	struct Item
+	{
+		CompletedRequestPtr request;
+		int pool_index = -1;
+		int64_t timestamp_us;
+		std::vector<uint8_t> header;
+	};
+
+	// O_DIRECT writes must be whole, aligned blocks from aligned memory, so they go through the staging
+	// buffer. The camera buffers can't be used for this anyway, as direct I/O can't pin dmabuf mappings.
+	static constexpr size_t STAGING_SIZE = 8 << 20;
+	static constexpr size_t DIRECT_ALIGN = 4096;
+
+	void openFile()
+	{
+		std::string const &output = options_->Get().output;
+		if (output.empty())
+			throw std::runtime_error("RawWriter: --raw-write-behind needs an --output file");
+		if (output == "-")
+			fd_ = STDOUT_FILENO;
+		else
+		{
+			char filename[256];
+			snprintf(filename, sizeof(filename), output.c_str(), 0);
+			filename[sizeof(filename) - 1] = 0;
+			int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+			fd_ = -1;
+			if (options_->Get().direct_io)
+			{
+				fd_ = open(filename, flags | O_DIRECT, 0644);
+				if (fd_ < 0 && errno == EINVAL)
+					LOG_ERROR("WARNING: " << filename << " does not support direct I/O");
+			}
+			if (fd_ < 0)
+				fd_ = open(filename, flags, 0644);
+			if (fd_ < 0)
+				throw std::runtime_error("RawWriter: failed to open output file " + std::string(filename));
+			direct_ = fcntl(fd_, F_GETFL) & O_DIRECT;
+
+			if (options_->Get().raw_index)
+			{
+				std::string index_name = std::string(filename) + ".idx";
+				index_ = fopen(index_name.c_str(), "w");
+				if (!index_)
+					throw std::runtime_error("RawWriter: failed to open index file " + index_name);
+				fprintf(index_, "# frame offset size timestamp_us\n");
+			}
+			LOG(2, "RawWriter: writing to " << filename << (direct_ ? " with direct I/O" : ""));
+		}
+		offset_ = 0;
+		frames_ = 0;
+		staged_ = 0;
+	}
+
+	void closeFile()
+	{
+		// The last part-block of a direct file has to be written the ordinary way.
+		if (direct_)
+		{
+			fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+			direct_ = false;
+		}
+		writeAll(staging_, staged_);
+		staged_ = 0;
+		if (fd_ != STDOUT_FILENO)
+			close(fd_);
+		fd_ = -1;
+		if (index_)
+			fclose(index_);
+		index_ = nullptr;
+	}
+
+	void writeAll(uint8_t const *mem, size_t size)
+	{
+		while (size)
+		{
+			ssize_t ret = ::write(fd_, mem, size);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret < 0)
+				throw std::runtime_error("failed to write output bytes");
+			mem += ret;
+			size -= ret;
+		}
+	}
+
+	void stage(uint8_t const *mem, size_t size)
+	{
+		while (size)
+		{
+			size_t n = std::min(size, STAGING_SIZE - staged_);
+			memcpy(staging_ + staged_, mem, n);
+			staged_ += n;
+			mem += n;
+			size -= n;
+			if (staged_ == STAGING_SIZE)
+			{
+				writeAll(staging_, staged_);
+				staged_ = 0;
+			}
+		}
+	}
+
+	void writeFrame(Item const &item, uint8_t const *mem)
+	{
+		size_t size = item.header.size() + frame_size_;
+		if (index_)
+			fprintf(index_, "%u %" PRIu64 " %zu %" PRId64 "\n", frames_, offset_, size, item.timestamp_us);
+
+		if (direct_)
+		{
+			stage(item.header.data(), item.header.size());
+			stage(mem, frame_size_);
+		}
+		else
+		{
+			// Without direct I/O we can write straight from the camera buffer, header and all in one go.
+			iovec iov[2] = { { const_cast<uint8_t *>(item.header.data()), item.header.size() },
+							 { const_cast<uint8_t *>(mem), frame_size_ } };
+			int n = item.header.empty() ? 1 : 2;
+			iovec *v = item.header.empty() ? &iov[1] : iov;
+			size_t left = size;
+			while (left)
+			{
+				ssize_t ret = writev(fd_, v, n);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret < 0)
+					throw std::runtime_error("failed to write output bytes");
+				left -= ret;
+				while (n && (size_t)ret >= v->iov_len)
+				{
+					ret -= v->iov_len;
+					v++, n--;
+				}
+				if (n)
+				{
+					v->iov_base = static_cast<uint8_t *>(v->iov_base) + ret;
+					v->iov_len -= ret;
+				}
+			}
+		}
+		offset_ += size;
+		frames_++;
+	}
+
+	void report()
+	{
+		auto now = std::chrono::steady_clock::now();
+		double seconds = std::chrono::duration<double>(now - last_report_time_).count();
+		if (seconds < 1)
+			return;
+		uint64_t dropped;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			dropped = dropped_;
+		}
+		LOG(2, "RawWriter: " << (offset_ - last_report_offset_) / 1e6 / seconds << "MB/s, " << dropped
+							 << " frames dropped so far");
+		last_report_time_ = now;
+		last_report_offset_ = offset_;
+	}
+
+	void writerThread()
+	{
+		ThreadConfig::Get().Apply("file-writer");
+		bool failed = false;
+		while (true)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_.wait(lock, [this]() { return abort_ || !queue_.empty(); });
+			if (queue_.empty())
+				break;
+			Item item = std::move(queue_.front());
+			queue_.pop_front();
+			lock.unlock();
+
+			// After a failure we just let the frames go. The error comes out with the next one.
+			if (!failed)
+			{
+				try
+				{
+					if (item.request)
+					{
+						BufferReadSync r(&app_, item.request->buffers[stream_]);
+						writeFrame(item, r.Get()[0].data());
+					}
+					else
+						writeFrame(item, pool_[item.pool_index]);
+					report();
+				}
+				catch (std::exception const &e)
+				{
+					failed = true;
+					std::lock_guard<std::mutex> error_lock(mutex_);
+					error_ = e.what();
+				}
+			}
+
+			bool held = item.request != nullptr;
+			item.request.reset(); // give the buffer back to the camera
+			lock.lock();
+			if (held)
+				held_--;
+			else
+				free_.push_back(item.pool_index);
+		}
+
+		try
+		{
+			closeFile();
+		}
+		catch (std::exception const &e)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (error_.empty())
+				error_ = e.what();
+		}
+	}
+
+	LibcameraRaw &app_;
+	VideoOptions const *options_;
+	libcamera::Stream *stream_ = nullptr;
+	StreamInfo info_;
+	std::string cam_model_;
+	size_t frame_size_ = 0;
+	unsigned int max_held_ = 0;
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::deque<Item> queue_;
+	std::vector<uint8_t *> pool_;
+	std::vector<unsigned int> free_;
+	unsigned int held_ = 0;
+	bool dropping_ = false;
+	uint64_t dropped_ = 0;
+	uint64_t copied_ = 0;
+	bool abort_ = false;
+	std::string error_;
+	std::thread thread_;
+
+	// Everything below belongs to the writer thread once it has started.
+	int fd_ = -1;
+	bool direct_ = false;
+	FILE *index_ = nullptr;
+	uint8_t *staging_ = nullptr;
+	size_t staged_ = 0;
+	uint64_t offset_ = 0;
+	unsigned int frames_ = 0;
+	std::chrono::steady_clock::time_point start_time_, last_report_time_;
+	uint64_t last_report_offset_ = 0;
+};
+
 // The main even loop for the application.
 
 static void event_loop(LibcameraRaw &app)
 {
 	VideoOptions const *options = app.GetOptions();
-	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	bool write_behind = options->Get().raw_write_behind;
+	RawWriter raw_writer(app);
+	// The write-behind path does its own writing, so has no use for an Output.
+	std::unique_ptr<Output> output = std::unique_ptr<Output>(write_behind ? nullptr : Output::Create(options));
+	RawHeaders raw_headers(output.get());
+	if (output)
+	{
+		if (options->Get().raw_headers)
+			app.SetEncodeOutputReadyCallback(
+				std::bind(&RawHeaders::OutputReady, &raw_headers, _1, _2, _3, _4, _5));
+		else
+			app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4, _5));
+		app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1, _2));
+	}
 
 	app.OpenCamera();
 	app.ConfigureVideo(LibcameraRaw::FLAG_VIDEO_RAW);
+	raw_headers.Start(app.GetStreamInfo(app.RawStream()), app.CameraModel());
+	if (write_behind)
+		raw_writer.Start();
 	app.StartEncoder();
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
@@ -64,11 +520,39 @@ static void event_loop(LibcameraRaw &app)
 		{
 			app.StopCamera();
 			app.StopEncoder();
+			raw_writer.Stop();
 			return;
 		}
 
-		if (!app.EncodeBuffer(std::get<CompletedRequestPtr>(msg.payload), app.RawStream()))
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		if (write_behind)
+		{
+#ifndef DISABLE_RPI_FEATURES
+			// As EncodeBuffer would, wait for synchronisation with another camera before recording anything.
+			if (options->Get().sync &&
+				!completed_request->metadata.get(libcamera::controls::rpi::SyncReady).value_or(false))
+			{
+				start_time = now;
+				continue;
+			}
+#endif
+			raw_writer.Write(completed_request);
+			continue;
+		}
+
+		if (options->Get().raw_headers)
+		{
+			// Match the timestamp that EncodeBuffer gives the encoder.
+			libcamera::FrameBuffer *buffer = completed_request->buffers[app.RawStream()];
+			auto ts = completed_request->metadata.get(libcamera::controls::FrameWallClock);
+			int64_t timestamp_us = (ts ? *ts : buffer->metadata().timestamp) / 1000;
+			raw_headers.Push(timestamp_us, completed_request->metadata);
+		}
+
+		if (!app.EncodeBuffer(completed_request, app.RawStream()))
 		{
+			if (options->Get().raw_headers)
+				raw_headers.PopBack();
 			// Keep advancing our "start time" if we're still waiting to start recording (e.g.
 			// waiting for synchronisation with another camera).
 			start_time = now;
@@ -0,0 +1,68 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rpicam_raw2dng.cpp - convert .rpiraw files, from rpicam-still or rpicam-raw, to DNG.
+ */
+
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "image/image.hpp"
+
+// Any (possibly PiSP-compressed) records in the file are unpacked here, rather than on the camera.
+// The output name may include a printf directive such as %05d for the frame number, which is needed
+// when the file holds more than one frame.
+int main(int argc, char *argv[])
+{
+	try
+	{
+		if (argc < 2 || argc > 3)
+		{
+			LOG_ERROR("Usage: rpicam-raw2dng <input.rpiraw> [output.dng]");
+			return -1;
+		}
+
+		std::string input = argv[1];
+		std::string output = argc == 3 ? argv[2] : input.substr(0, input.rfind('.')) + ".dng";
+		bool pattern = output.find('%') != std::string::npos;
+
+		std::unique_ptr<FILE, int (*)(FILE *)> fp(fopen(input.c_str(), "r"), fclose);
+		if (!fp)
+			throw std::runtime_error("failed to open file " + input);
+
+		StreamInfo info;
+		libcamera::ControlList metadata;
+		std::string cam_model;
+		std::vector<uint8_t> payload;
+		unsigned int frame = 0;
+		for (; rpiraw_read(fp.get(), info, metadata, cam_model, payload); frame++)
+		{
+			if (frame && !pattern)
+				throw std::runtime_error(input + " holds more than one frame, give an output name such as out%05d.dng");
+
+			std::string filename = output;
+			if (pattern)
+			{
+				char name[256];
+				snprintf(name, sizeof(name), output.c_str(), frame);
+				filename = name;
+			}
+
+			std::vector<libcamera::Span<uint8_t>> mem = { libcamera::Span<uint8_t>(payload.data(), payload.size()) };
+			dng_save(mem, info, metadata, filename, cam_model, nullptr);
+			LOG(1, "Wrote " << filename);
+		}
+
+		if (!frame)
+			throw std::runtime_error("no frames in " + input);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
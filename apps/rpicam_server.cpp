@@ -0,0 +1,235 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rpicam_server.cpp - own the camera and serve its streams to other processes.
+ */
+
+// Only one process can have the camera, so rpicam-server takes it, runs the post-processing stages just
+// as the other apps would, and shares the results with any number of local clients through sockets in
+// the --server-dir:
+//
+//   video-main.sock, video-lores.sock
+//     The encoded main stream (--codec) and, if there is a lores stream, the encoded lores stream
+//     (--lores-codec), as byte streams. A new client starts at the latest keyframe.
+//   frames-main.sock, frames-lores.sock
+//     Raw frames, shared by passing their dmabuf fds, as described in core/frame_exporter.hpp. Each
+//     client chooses its own rate with "fps R", and can ask for the metadata alone with "metadata-only".
+//   control.sock
+//     The same commands as rpicam-vid's --control-socket, applied to the one camera for everyone.
+//
+// Every client sharing an encoded stream gets the same frames, as an encoder's output can't be thinned
+// out after the fact. Clients wanting another rate or format subscribe to the other stream, or take raw
+// frames and encode them themselves. The server runs until it is sent SIGINT or SIGTERM.
+
+#include <signal.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+
+#include "core/control_socket.hpp"
+#include "core/frame_exporter.hpp"
+#include "core/rpicam_encoder.hpp"
+#include "output/output.hpp"
+#include "output/stream_server.hpp"
+
+static volatile sig_atomic_t signal_received;
+static void default_signal_handler(int signal_number)
+{
+	signal_received = signal_number;
+}
+
+// Clients are given a second to hand each frame back before it is taken from them.
+static constexpr std::chrono::milliseconds HOLD_TIMEOUT(1000);
+static constexpr unsigned int MAX_FRAME_CLIENTS = 8;
+
+struct FrameSource
+{
+	std::string stream_name;
+	std::unique_ptr<FrameExporter> exporter;
+};
+
+static void publish_frame(RPiCamEncoder &app, FrameSource &source, CompletedRequestPtr &completed_request)
+{
+	if (!source.exporter->HasClients())
+		return;
+	StreamInfo info;
+	libcamera::Stream *stream = app.GetStream(source.stream_name, &info);
+	if (!stream)
+		return;
+	auto it = completed_request->buffers.find(stream);
+	if (it == completed_request->buffers.end())
+		return;
+
+	FrameExporter::Frame frame;
+	frame.fd = it->second->planes()[0].fd.get();
+	frame.size = stream->configuration().frameSize;
+	frame.info = info;
+	frame.sequence = completed_request->sequence;
+	frame.timestamp_us = completed_request->metadata.get(libcamera::controls::SensorTimestamp).value_or(0) / 1000;
+	std::stringbuf buf;
+	write_metadata(&buf, "json", completed_request->metadata, true);
+	frame.metadata_json = buf.str();
+	frame.hold = completed_request;
+	source.exporter->Publish(frame);
+}
+
+static std::string control_command(RPiCamEncoder &app, std::string const &cmd)
+{
+	std::istringstream words(cmd);
+	std::string verb, stage;
+	if (words >> verb >> stage && (verb == "enable" || verb == "disable"))
+	{
+		if (!app.EnablePostProcessingStage(stage, verb == "enable"))
+			return "error: no post processing stage " + stage;
+		return "ok";
+	}
+	try
+	{
+		if (verb == "roi" || verb == "lores-roi")
+		{
+			app.SetRoi(verb == "roi" ? "main" : "lores", stage);
+			return "ok";
+		}
+		return app.RequestReconfigure(cmd);
+	}
+	catch (std::exception const &e)
+	{
+		return std::string("error: ") + e.what();
+	}
+}
+
+static void event_loop(RPiCamEncoder &app)
+{
+	VideoOptions *options = app.GetOptions();
+	std::string const &dir = options->Get().server_dir;
+	if (options->Get().codec == "libav")
+		throw std::runtime_error("rpicam-server cannot use libav, which writes its own output");
+	if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+		throw std::runtime_error("unable to create server directory " + dir + ": " + strerror(errno));
+	// There's nobody to show a preview to.
+	options->Set().nopreview = true;
+	bool lores = options->Get().lores_width && options->Get().lores_height;
+
+	StreamServer video_server(dir + "/video-main.sock");
+	app.SetEncodeOutputReadyCallback([&](void *mem, size_t size, int64_t, bool keyframe, bool partial) {
+		video_server.Send(mem, size, keyframe, partial);
+		if (video_server.KeyframeWanted())
+			app.RequestKeyframe();
+	});
+
+	// The lores encoder can't be asked for a keyframe, so its new clients wait for the next one, which for
+	// the default mjpeg is every frame.
+	std::unique_ptr<StreamServer> lores_server;
+	if (lores)
+	{
+		lores_server = std::make_unique<StreamServer>(dir + "/video-lores.sock");
+		std::unique_ptr<VideoOptions> lores_options = options->Clone();
+		lores_options->Set().codec = options->Get().lores_codec;
+		lores_options->Set().bitrate = options->Get().lores_bitrate;
+		app.AddEncoder("lores", std::move(lores_options),
+					   [server = lores_server.get()](void *mem, size_t size, int64_t, bool keyframe, bool partial) {
+						   server->Send(mem, size, keyframe, partial);
+					   });
+	}
+
+	std::vector<FrameSource> frame_sources;
+	for (std::string name : { "video", "lores" })
+	{
+		if (name == "lores" && !lores)
+			continue;
+		std::string path = dir + "/frames-" + (name == "video" ? "main" : name) + ".sock";
+		frame_sources.push_back({ name, std::make_unique<FrameExporter>(path, options->Get().server_credits,
+																		HOLD_TIMEOUT, MAX_FRAME_CLIENTS) });
+	}
+
+	ControlSocket control_socket(dir + "/control.sock",
+								 [&app](std::string const &cmd) { return control_command(app, cmd); });
+
+	// Frames held by clients go back to the camera before it stops, rather than as it is stopping.
+	auto revoke_frames = [&frame_sources]() {
+		for (auto &source : frame_sources)
+			source.exporter->RevokeAll();
+	};
+
+	app.OpenCamera();
+	app.ConfigureVideo(RPiCamEncoder::FLAG_VIDEO_NONE);
+	app.StartEncoder();
+	app.StartCamera();
+	LOG(1, "Serving the camera in " << dir);
+
+	signal(SIGINT, default_signal_handler);
+	signal(SIGTERM, default_signal_handler);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (true)
+	{
+		RPiCamEncoder::Msg msg = app.Wait();
+		if (msg.type == RPiCamApp::MsgType::Reconfigure)
+		{
+			// A refused or undone request leaves the camera serving as before. Anything else means it couldn't
+			// be restarted, and ends the server.
+			try
+			{
+				revoke_frames();
+				app.Reconfigure(std::get<RPiCamApp::ReconfigureRequest>(msg.payload), RPiCamEncoder::FLAG_VIDEO_NONE);
+			}
+			catch (RPiCamEncoder::ReconfigureError const &e)
+			{
+				LOG_ERROR("ERROR: reconfiguration failed: " << e.what());
+			}
+			continue;
+		}
+		if (msg.type == RPiCamApp::MsgType::Timeout)
+		{
+			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+			revoke_frames();
+			app.StopCamera();
+			app.StartCamera();
+			continue;
+		}
+		if (msg.type == RPiCamEncoder::MsgType::Quit)
+			break;
+		else if (msg.type != RPiCamEncoder::MsgType::RequestComplete)
+			throw std::runtime_error("unrecognised message!");
+
+		if (signal_received)
+		{
+			LOG(1, "Received signal " << signal_received << ", stopping");
+			break;
+		}
+
+		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		app.EncodeBuffer(completed_request, app.VideoStream());
+		for (auto &source : frame_sources)
+			publish_frame(app, source, completed_request);
+	}
+
+	revoke_frames();
+	app.StopCamera();
+	app.StopEncoder();
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		RPiCamEncoder app;
+		VideoOptions *options = app.GetOptions();
+		if (options->Parse(argc, argv))
+		{
+			if (options->Get().verbose >= 2)
+				options->Get().Print();
+
+			event_loop(app);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
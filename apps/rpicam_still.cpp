@@ -4,14 +4,19 @@
  *
  * rpicam_still.cpp - libcamera stills capture app.
  */
+#include <algorithm>
 #include <chrono>
+#include <condition_variable>
+#include <exception>
 #include <filesystem>
+#include <mutex>
 #include <poll.h>
+#include <queue>
 #include <signal.h>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
-
-#include <chrono>
+#include <thread>
+#include <utility>
 
 #include "core/frame_info.hpp"
 #include "core/rpicam_app.hpp"
@@ -77,17 +82,17 @@ static void update_latest_link(std::string const &filename, StillOptions const *
 	}
 }
 
-static void save_image(RPiCamStillApp &app, CompletedRequestPtr &payload, Stream *stream,
-					   std::string const &filename)
+static void save_image(StillOptions const *options, std::string const &cam_model,
+					   std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+					   libcamera::ControlList const &metadata, std::string const &filename, bool raw,
+					   ThumbnailImage const *thumbnail)
 {
-	StillOptions const *options = app.GetOptions();
-	StreamInfo info = app.GetStreamInfo(stream);
-	BufferReadSync r(&app, payload->buffers[stream]);
-	const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
-	if (stream == app.RawStream())
-		dng_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
+	if (raw && options->Get().raw_format == "rpiraw")
+		rpiraw_save(mem, info, metadata, filename, cam_model);
+	else if (raw)
+		dng_save(mem, info, metadata, filename, cam_model, options);
 	else if (options->Get().encoding == "jpg")
-		jpeg_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
+		jpeg_save(mem, info, metadata, filename, cam_model, options, thumbnail);
 	else if (options->Get().encoding == "png")
 		png_save(mem, info, filename, options);
 	else if (options->Get().encoding == "bmp")
@@ -97,37 +102,344 @@ static void save_image(RPiCamStillApp &app, CompletedRequestPtr &payload, Stream
 	LOG(2, "Saved image " << info.width << " x " << info.height << " to file " << filename);
 }
 
-static void save_images(RPiCamStillApp &app, CompletedRequestPtr &payload)
+static void save_metadata(StillOptions const *options, libcamera::ControlList &metadata)
+{
+	std::streambuf *buf = std::cout.rdbuf();
+	std::ofstream of;
+	const std::string &filename = options->Get().metadata;
+
+	if (filename.compare("-"))
+	{
+		of.open(filename, std::ios::out | std::ios::binary);
+		buf = of.rdbuf();
+	}
+
+	if (options->Get().metadata_format == "bin")
+	{
+		auto timestamp = metadata.get(controls::SensorTimestamp);
+		BinaryMetadataWriter writer(buf);
+		writer.Write(metadata, timestamp ? *timestamp / 1000 : 0);
+	}
+	else
+		write_metadata(buf, options->Get().metadata_format, metadata, true);
+}
+
+// Everything needed to save one capture. The images are read either from the request, when it is
+// held for us, or from copies of its buffers.
+struct SaveJob
+{
+	struct Image
+	{
+		Stream *stream;
+		StreamInfo info;
+		std::string filename;
+		bool raw;
+		std::vector<uint8_t> copy;
+	};
+
+	CompletedRequestPtr request;
+	libcamera::ControlList metadata;
+	std::vector<Image> images;
+	// With ZSL the request also has the viewfinder's image of the same frame, which makes the thumbnail
+	// much more quickly than the full image.
+	Stream *thumb_stream = nullptr;
+	StreamInfo thumb_info;
+	std::vector<uint8_t> thumb_copy;
+};
+
+// Copies go into buffers from the spares when one is big enough, saving an allocation (and the page faults
+// that come with it) in the middle of a burst.
+static SaveJob make_save_job(RPiCamStillApp &app, CompletedRequestPtr &payload, bool hold,
+							 std::vector<std::vector<uint8_t>> &spares)
 {
 	StillOptions *options = app.GetOptions();
+	SaveJob job;
+	job.metadata = payload->metadata;
+
 	std::string filename = generate_filename(options);
-	save_image(app, payload, app.StillStream(), filename);
-	update_latest_link(filename, options);
+	job.images.push_back({ app.StillStream(), app.GetStreamInfo(app.StillStream()), filename, false, {} });
 	if (options->Get().raw)
 	{
-		filename = filename.substr(0, filename.rfind('.')) + ".dng";
-		save_image(app, payload, app.RawStream(), filename);
+		filename = filename.substr(0, filename.rfind('.')) + "." + options->Get().raw_format;
+		job.images.push_back({ app.RawStream(), app.GetStreamInfo(app.RawStream()), filename, true, {} });
 	}
 	options->Set().framestart++;
 	if (options->Get().wrap)
 		options->Set().framestart %= options->Get().wrap;
+
+	if (options->Get().encoding == "jpg" && options->Get().thumb_quality)
+	{
+		Stream *stream = app.ViewfinderStream(&job.thumb_info);
+		if (stream && payload->buffers.count(stream))
+			job.thumb_stream = stream;
+	}
+
+	if (hold)
+		job.request = payload;
+	else
+	{
+		if (job.thumb_stream)
+		{
+			BufferReadSync r(&app, payload->buffers[job.thumb_stream]);
+			job.thumb_copy.assign(r.Get()[0].begin(), r.Get()[0].end());
+		}
+		for (auto &image : job.images)
+		{
+			BufferReadSync r(&app, payload->buffers[image.stream]);
+			libcamera::Span<uint8_t> const &mem = r.Get()[0];
+			// The smallest that fits, so that a raw copy doesn't take a buffer meant for a processed image.
+			auto spare = spares.end();
+			for (auto it = spares.begin(); it != spares.end(); it++)
+			{
+				if (it->capacity() >= mem.size() && (spare == spares.end() || it->capacity() < spare->capacity()))
+					spare = it;
+			}
+			if (spare != spares.end())
+			{
+				image.copy = std::move(*spare);
+				spares.erase(spare);
+			}
+			image.copy.assign(mem.begin(), mem.end());
+		}
+	}
+
+	return job;
 }
 
-static void save_metadata(StillOptions const *options, libcamera::ControlList &metadata)
+static void save_job(RPiCamStillApp &app, SaveJob &job)
 {
-	std::streambuf *buf = std::cout.rdbuf();
-	std::ofstream of;
-	const std::string &filename = options->Get().metadata;
-
-	if (filename.compare("-"))
+	StillOptions const *options = app.GetOptions();
+	std::unique_ptr<BufferReadSync> thumb_sync;
+	std::unique_ptr<ThumbnailImage> thumbnail;
+	if (job.thumb_stream)
 	{
-		of.open(filename, std::ios::out);
-		buf = of.rdbuf();
+		thumbnail = std::make_unique<ThumbnailImage>();
+		thumbnail->info = job.thumb_info;
+		if (job.request)
+		{
+			thumb_sync = std::make_unique<BufferReadSync>(&app, job.request->buffers[job.thumb_stream]);
+			thumbnail->mem = thumb_sync->Get()[0];
+		}
+		else
+			thumbnail->mem = libcamera::Span<uint8_t>(job.thumb_copy.data(), job.thumb_copy.size());
 	}
 
-	write_metadata(buf, options->Get().metadata_format, metadata, true);
+	auto save = [&](SaveJob::Image &image)
+	{
+		if (job.request)
+		{
+			BufferReadSync r(&app, job.request->buffers.at(image.stream));
+			save_image(options, app.CameraModel(), r.Get(), image.info, job.metadata, image.filename, image.raw,
+					   thumbnail.get());
+		}
+		else
+		{
+			std::vector<libcamera::Span<uint8_t>> mem = { libcamera::Span<uint8_t>(
+				const_cast<uint8_t *>(image.copy.data()), image.copy.size()) };
+			save_image(options, app.CameraModel(), mem, image.info, job.metadata, image.filename, image.raw,
+					   thumbnail.get());
+		}
+		if (!image.raw)
+			update_latest_link(image.filename, options);
+	};
+
+	// Each format is written independently, so with --raw the DNG is written while the JPEG is encoded, and
+	// saving takes as long as the slower of the two rather than both together.
+	std::vector<std::exception_ptr> errors(job.images.size());
+	std::vector<std::thread> threads;
+	for (std::size_t i = 1; i < job.images.size(); i++)
+		threads.emplace_back(
+			[&, i]()
+			{
+				try
+				{
+					save(job.images[i]);
+				}
+				catch (...)
+				{
+					errors[i] = std::current_exception();
+				}
+			});
+	try
+	{
+		save(job.images[0]);
+	}
+	catch (...)
+	{
+		errors[0] = std::current_exception();
+	}
+	for (auto &thread : threads)
+		thread.join();
+	for (auto &error : errors)
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+	if (!options->Get().metadata.empty())
+		save_metadata(options, job.metadata);
 }
 
+// Saves captures on a background thread, so that the camera can go back to the viewfinder (or the next
+// timelapse or ZSL capture) while the image is encoded and written. Captures are saved in order on a
+// single thread, as the JPEG encoder already spreads itself over all the cores, though the formats of one
+// capture are written side by side. With a depth of 0 everything is saved before Save() returns, as before.
+class SaveQueue
+{
+public:
+	SaveQueue(RPiCamStillApp &app, unsigned int depth) : app_(app), depth_(depth), abort_(false)
+	{
+		if (depth_)
+			thread_ = std::thread(&SaveQueue::saveThread, this);
+	}
+
+	~SaveQueue()
+	{
+		try
+		{
+			Drain();
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: failed to save image: " << e.what());
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		cond_.notify_all();
+		if (thread_.joinable())
+			thread_.join();
+	}
+
+	// In ZSL mode the camera keeps running, so we can hold on to one request instead of copying it.
+	// Otherwise the camera is torn down straight after the capture, and takes the buffers with it.
+	void Save(CompletedRequestPtr &payload, bool camera_keeps_running)
+	{
+		if (!depth_)
+		{
+			std::vector<std::vector<uint8_t>> spares;
+			SaveJob job = make_save_job(app_, payload, true, spares);
+			save_job(app_, job);
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		space_cond_.wait(lock, [this]() { return queue_.size() < depth_ || error_; });
+		rethrow();
+		bool hold = camera_keeps_running && held_ == 0;
+		std::vector<std::vector<uint8_t>> spares = std::move(spares_);
+		lock.unlock();
+
+		SaveJob job = make_save_job(app_, payload, hold, spares);
+		LOG(2, "Queued capture for saving" << (hold ? "" : " (copied)"));
+
+		lock.lock();
+		held_ += hold;
+		queue_.push(std::move(job));
+		for (auto &spare : spares)
+			spares_.push_back(std::move(spare));
+		cond_.notify_one();
+	}
+
+	// Make sure there are at least count spare buffers of this size for copies, allocated and touched now
+	// rather than in the middle of a burst. They are used again by later bursts.
+	void Reserve(unsigned int count, std::size_t size)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		unsigned int have = std::count_if(spares_.begin(), spares_.end(),
+										  [size](auto const &buffer) { return buffer.capacity() == size; });
+		for (; have < count; have++)
+		{
+			spares_.emplace_back(size);
+			spares_wanted_++;
+		}
+	}
+
+	// Wait until no request is held for saving, so that the camera can be torn down.
+	void WaitForHeld()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		space_cond_.wait(lock, [this]() { return held_ == 0 || error_; });
+		rethrow();
+	}
+
+	// Wait for everything queued to be written, rethrowing the first error from the save thread.
+	void Drain()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		space_cond_.wait(lock, [this]() { return (queue_.empty() && !busy_) || error_; });
+		rethrow();
+	}
+
+private:
+	void rethrow()
+	{
+		if (error_)
+			std::rethrow_exception(std::exchange(error_, nullptr));
+	}
+
+	void saveThread()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true)
+		{
+			cond_.wait(lock, [this]() { return !queue_.empty() || abort_; });
+			if (queue_.empty())
+				return;
+
+			SaveJob job = std::move(queue_.front());
+			queue_.pop();
+			busy_ = true;
+			lock.unlock();
+
+			std::exception_ptr error;
+			try
+			{
+				save_job(app_, job);
+			}
+			catch (...)
+			{
+				error = std::current_exception();
+			}
+			bool held = job.request != nullptr;
+			std::vector<std::vector<uint8_t>> copies;
+			for (auto &image : job.images)
+			{
+				if (image.copy.capacity())
+					copies.push_back(std::move(image.copy));
+			}
+			job = SaveJob(); // give back any request before we say we're done
+
+			lock.lock();
+			held_ -= held;
+			// Only as many buffers are kept as bursts have asked for, so ordinary copies are still freed.
+			for (auto &copy : copies)
+			{
+				if (spares_wanted_ > spares_.size())
+					spares_.push_back(std::move(copy));
+			}
+			busy_ = false;
+			if (error && !error_)
+				error_ = error;
+			space_cond_.notify_all();
+		}
+	}
+
+	RPiCamStillApp &app_;
+	unsigned int depth_;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::condition_variable space_cond_;
+	std::queue<SaveJob> queue_;
+	unsigned int held_ = 0;
+	std::vector<std::vector<uint8_t>> spares_;
+	std::size_t spares_wanted_ = 0;
+	bool busy_ = false;
+	bool abort_;
+	std::exception_ptr error_;
+	std::thread thread_;
+};
+
 // Some keypress/signal handling.
 
 static int signal_received;
@@ -163,7 +475,7 @@ static int get_key_or_signal(StillOptions const *options, pollfd p[1])
 
 // The main even loop for the application.
 
-static void event_loop(RPiCamStillApp &app)
+static void event_loop(RPiCamStillApp &app, SaveQueue &save_queue)
 {
 	StillOptions const *options = app.GetOptions();
 	// output requested?
@@ -204,11 +516,34 @@ static void event_loop(RPiCamStillApp &app)
 		app.ConfigureZsl();
 	else
 		app.ConfigureViewfinder();
-	app.StartCamera();
+
 	auto start_time = std::chrono::high_resolution_clock::now();
 	auto timelapse_time = start_time;
 	int timelapse_frames = 0;
 	constexpr int TIMELAPSE_MIN_FRAMES = 6; // at least this many preview frames between captures
+
+	// With --timelapse-warmup the camera stays configured, with its buffers, but stops streaming between
+	// captures, starting again just in time for AE/AWB to settle before the next. Stopping and starting
+	// costs a few frames, so there's no point for short rests. Returns false if the timeout comes first.
+	bool low_power = options->Get().timelapse_warmup && !options->Get().immediate;
+	auto rest = [&]() {
+		constexpr auto MIN_REST = 1s;
+		auto now = std::chrono::high_resolution_clock::now();
+		auto wake = timelapse_time + options->Get().timelapse.value - options->Get().timelapse_warmup.value;
+		if (options->Get().timeout && wake > start_time + options->Get().timeout.value)
+			return false;
+		if (wake - now >= MIN_REST)
+		{
+			LOG(2, "Camera stopped for "
+					   << std::chrono::duration_cast<std::chrono::milliseconds>(wake - now).count() << "ms");
+			std::this_thread::sleep_until(wake);
+		}
+		return true;
+	};
+
+	if (low_power && !rest())
+		return;
+	app.StartCamera();
 	bool keypressed = false;
 	enum
 	{
@@ -218,6 +553,20 @@ static void event_loop(RPiCamStillApp &app)
 	} af_wait_state = AF_WAIT_NONE;
 	int af_wait_timeout = 0;
 
+	// A burst takes this many consecutive frames from the still stream, with the camera kept running.
+	unsigned int burst = std::max(options->Get().burst, 1u);
+	unsigned int burst_count = 0;
+	auto reserve_burst = [&]() {
+		if (burst < 2)
+			return;
+		// One frame of the burst can be held for saving, the rest are copied.
+		save_queue.Reserve(burst - 1, app.StillStream()->configuration().frameSize);
+		if (options->Get().raw)
+			save_queue.Reserve(burst - 1, app.RawStream()->configuration().frameSize);
+	};
+	if (options->Get().immediate || options->Get().zsl)
+		reserve_burst();
+
 	bool want_capture = options->Get().immediate;
 	for (unsigned int count = 0;; count++)
 	{
@@ -295,6 +644,7 @@ static void event_loop(RPiCamStillApp &app)
 					app.StopCamera();
 					app.Teardown();
 					app.ConfigureStill(still_flags);
+					reserve_burst();
 				}
 				if (options->Get().af_on_capture)
 				{
@@ -313,13 +663,22 @@ static void event_loop(RPiCamStillApp &app)
 		// otherwise quit.
 		else if (app.StillStream() && want_capture)
 		{
-			want_capture = false;
-			if (!options->Get().zsl)
+			bool burst_done = ++burst_count >= burst;
+			if (!options->Get().zsl && burst_done)
 				app.StopCamera();
-			LOG(1, "Still capture image received");
-			save_images(app, completed_request);
-			if (!options->Get().metadata.empty())
-				save_metadata(options, completed_request->metadata);
+			if (burst > 1)
+				LOG(1, "Still capture image received (" << burst_count << " of " << burst << ")");
+			else
+				LOG(1, "Still capture image received");
+			// A camera that's about to rest will re-use all its buffers when it starts again.
+			save_queue.Save(completed_request, (options->Get().zsl && !low_power) || !burst_done);
+			if (!burst_done)
+				continue;
+			want_capture = false;
+			burst_count = 0;
+			// A frame from earlier in the burst may still be waiting to be saved from the camera's buffer.
+			if (burst > 1 && (!options->Get().zsl || low_power))
+				save_queue.WaitForHeld();
 			timelapse_frames = 0;
 			if (!options->Get().immediate &&
 				(options->Get().timelapse || options->Get().signal || options->Get().keypress))
@@ -329,6 +688,15 @@ static void event_loop(RPiCamStillApp &app)
 					app.Teardown();
 					app.ConfigureViewfinder();
 				}
+				if (low_power)
+				{
+					if (options->Get().zsl)
+						app.StopCamera();
+					if (!rest())
+						return;
+				}
+				// Stopping the camera drops any controls still waiting to go, so these only go in once
+				// it's stopped for the last time, to be sent when it starts (or with the next request).
 				if (options->Get().af_on_capture && options->Get().afMode_index == -1)
 				{
 					libcamera::ControlList cl;
@@ -336,7 +704,7 @@ static void event_loop(RPiCamStillApp &app)
 					cl.set(libcamera::controls::AfTrigger, libcamera::controls::AfTriggerCancel);
 					app.SetControls(cl);
 				}
-				if (!options->Get().zsl)
+				if (low_power || !options->Get().zsl)
 					app.StartCamera();
 				af_wait_state = AF_WAIT_NONE;
 			}
@@ -364,7 +732,9 @@ int main(int argc, char *argv[])
 				LOG_ERROR("         rpicam-still --zsl -o " << options->Get().output);
 			}
 
-			event_loop(app);
+			SaveQueue save_queue(app, options->Get().save_queue);
+			event_loop(app, save_queue);
+			save_queue.Drain();
 		}
 	}
 	catch (std::exception const &e)
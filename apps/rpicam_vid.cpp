@@ -8,9 +8,11 @@
 #include <chrono>
 #include <poll.h>
 #include <signal.h>
+#include <sstream>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
 
+#include "core/control_socket.hpp"
 #include "core/rpicam_encoder.hpp"
 #include "output/output.hpp"
 
@@ -60,14 +62,93 @@ static int get_colourspace_flags(std::string const &codec)
 		return RPiCamEncoder::FLAG_VIDEO_NONE;
 }
 
+// Follows the output's congestion reports: a quarter off the bitrate after a few congested frames in a
+// row, to no less than a quarter of the requested rate, then a tenth back on for every second that
+// the congestion stays clear. Runs on the encoder's output thread.
+class BitrateAdapter
+{
+public:
+	BitrateAdapter(RPiCamEncoder &app, uint32_t bps)
+		: app_(app), max_bps_(bps), min_bps_(bps / 4), bps_(bps), congested_(0), clear_(0),
+		  clear_frames_(app.GetOptions()->Get().framerate.value_or(DEFAULT_FRAMERATE))
+	{
+	}
+
+	void Feedback(Output::Feedback feedback)
+	{
+		if (feedback == Output::Feedback::KeyframeNeeded)
+			app_.RequestKeyframe();
+		else if (feedback == Output::Feedback::Congested)
+		{
+			clear_ = 0;
+			if (++congested_ >= CongestedFrames && bps_ > min_bps_)
+				set(std::max(min_bps_, bps_ - bps_ / 4));
+		}
+		else
+		{
+			congested_ = 0;
+			if (++clear_ >= clear_frames_ && bps_ < max_bps_)
+				set(std::min(max_bps_, bps_ + max_bps_ / 10));
+		}
+	}
+
+private:
+	static constexpr unsigned int CongestedFrames = 3;
+
+	void set(uint32_t bps)
+	{
+		LOG(1, "Adapting bitrate from " << bps_ / 1000 << "kbps to " << bps / 1000 << "kbps");
+		bps_ = bps;
+		congested_ = clear_ = 0;
+		app_.RequestBitrate(bps);
+	}
+
+	RPiCamEncoder &app_;
+	uint32_t max_bps_;
+	uint32_t min_bps_;
+	uint32_t bps_;
+	unsigned int congested_;
+	unsigned int clear_;
+	unsigned int clear_frames_;
+};
+
 // The main even loop for the application.
 
 static void event_loop(RPiCamEncoder &app)
 {
 	VideoOptions const *options = app.GetOptions();
 	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4, _5));
+	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1, _2));
+	BitrateAdapter bitrate_adapter(app, options->Get().bitrate.bps());
+	if (options->Get().adaptive_bitrate)
+		output->SetFeedbackCallback(std::bind(&BitrateAdapter::Feedback, &bitrate_adapter, _1));
+	else
+		output->SetFeedbackCallback([&app](Output::Feedback feedback) {
+			if (feedback == Output::Feedback::KeyframeNeeded)
+				app.RequestKeyframe();
+		});
+
+	// The lores stream can be encoded at the same time, with its own codec, bitrate and output.
+	std::unique_ptr<Output> lores_output;
+	if (!options->Get().lores_output.empty())
+	{
+		std::unique_ptr<VideoOptions> lores_options = options->Clone();
+		lores_options->Set().output = options->Get().lores_output;
+		lores_options->Set().codec = options->Get().lores_codec;
+		lores_options->Set().bitrate = options->Get().lores_bitrate;
+		lores_options->Set().metadata.clear();
+		lores_options->Set().save_pts.clear();
+		lores_options->Set().circular = 0;
+		lores_options->Set().circular_file.clear();
+		lores_options->Set().clip_output.clear();
+		lores_options->Set().hls.clear();
+		lores_options->Set().tee_output.clear();
+		lores_options->Set().libav_audio = false;
+		lores_output = std::unique_ptr<Output>(Output::Create(lores_options.get()));
+		app.AddEncoder("lores", std::move(lores_options),
+					   std::bind(&Output::OutputReady, lores_output.get(), _1, _2, _3, _4, _5));
+	}
 
 	app.OpenCamera();
 	app.ConfigureVideo(get_colourspace_flags(options->Get().codec));
@@ -85,9 +166,62 @@ static void event_loop(RPiCamEncoder &app)
 	signal(SIGPIPE, default_signal_handler);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
 
+	// Commands from the control socket are handed to this thread to act on.
+	std::unique_ptr<ControlSocket> control_socket;
+	if (!options->Get().control_socket.empty())
+	{
+		auto handler = [&app, out = output.get()](std::string const &cmd) {
+			if (cmd == "clip")
+			{
+				out->Trigger();
+				return std::string("ok");
+			}
+			std::istringstream words(cmd);
+			std::string verb, stage;
+			if (words >> verb >> stage && (verb == "enable" || verb == "disable"))
+			{
+				if (!app.EnablePostProcessingStage(stage, verb == "enable"))
+					return "error: no post processing stage " + stage;
+				return std::string("ok");
+			}
+			try
+			{
+				if (verb == "roi" || verb == "lores-roi")
+				{
+					app.SetRoi(verb == "roi" ? "main" : "lores", stage);
+					return std::string("ok");
+				}
+				return app.RequestReconfigure(cmd);
+			}
+			catch (std::exception const &e)
+			{
+				return std::string("error: ") + e.what();
+			}
+		};
+		control_socket = std::make_unique<ControlSocket>(options->Get().control_socket, handler);
+	}
+
+	std::optional<MetadataTag> clip_tag;
+	if (!options->Get().clip_trigger.empty())
+		clip_tag.emplace(options->Get().clip_trigger);
+
 	for (unsigned int count = 0; ; count++)
 	{
 		RPiCamEncoder::Msg msg = app.Wait();
+		if (msg.type == RPiCamApp::MsgType::Reconfigure)
+		{
+			// Only a ReconfigureError leaves the camera running, anything else ends the recording.
+			try
+			{
+				app.Reconfigure(std::get<RPiCamApp::ReconfigureRequest>(msg.payload),
+								get_colourspace_flags(options->Get().codec));
+			}
+			catch (RPiCamEncoder::ReconfigureError const &e)
+			{
+				LOG_ERROR("ERROR: reconfiguration failed: " << e.what());
+			}
+			continue;
+		}
 		if (msg.type == RPiCamApp::MsgType::Timeout)
 		{
 			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
@@ -101,7 +235,11 @@ static void event_loop(RPiCamEncoder &app)
 			throw std::runtime_error("unrecognised message!");
 		int key = get_key_or_signal(options, p);
 		if (key == '\n')
+		{
 			output->Signal();
+			if (lores_output)
+				lores_output->Signal();
+		}
 
 		LOG(2, "Viewfinder frame " << count);
 		auto now = std::chrono::high_resolution_clock::now();
@@ -118,6 +256,14 @@ static void event_loop(RPiCamEncoder &app)
 			return;
 		}
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
+		if (clip_tag)
+		{
+			// Keep triggering for as long as the flag is set, so that the clip runs on until
+			// clip-post after it clears.
+			bool trigger = false;
+			if (completed_request->post_process_metadata.Get(*clip_tag, trigger) == 0 && trigger)
+				output->Trigger();
+		}
 		if (!app.EncodeBuffer(completed_request, app.VideoStream()))
 		{
 			// Keep advancing our "start time" if we're still waiting to start recording (e.g.
@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * bench.hpp - a small harness for timing the pixel and codec kernels.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Each benchmark runs one kernel on synthetic images of one of the standard sizes. Its Setup function
+// allocates and fills whatever the kernel needs and returns the function to be timed, so that only
+// one benchmark's images are in memory at a time. The harness times the kernel both warm, running it
+// over and over on the same data, and cold, with the caches flushed before every run.
+
+struct BenchSize
+{
+	char const *name;
+	unsigned int width;
+	unsigned int height;
+};
+
+// A typical lores stream, 1080p video and a full resolution 12MP still.
+static constexpr BenchSize BENCH_SIZES[] = {
+	{ "lores", 640, 480 },
+	{ "1080p", 1920, 1080 },
+	{ "12mp", 4056, 3040 },
+};
+
+struct Benchmark
+{
+	std::string kernel;
+	BenchSize size;
+	std::function<std::function<void()>(BenchSize const &size)> setup;
+};
+
+// Fill a buffer with a repeatable, not too compressible, pattern.
+void bench_fill(uint8_t *data, size_t size, uint32_t seed = 1);
+
+// Each file of benchmarks adds its own to the list, once for every size.
+void add_image_benchmarks(std::vector<Benchmark> &benchmarks);
+void add_hdr_benchmarks(std::vector<Benchmark> &benchmarks);
+void add_motion_detect_benchmarks(std::vector<Benchmark> &benchmarks);
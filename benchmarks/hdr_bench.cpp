@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * hdr_bench.cpp - benchmarks for the HDR stage's accumulate, low pass filter and tonemap kernels.
+ */
+
+// The kernels are private to the stage, which is normally built into a loadable module, so we build the
+// stage's source straight into this file. It can't share a file with any other stage's source because
+// each of them defines its own NAME, Create and reg.
+#include "post_processing_stages/hdr_stage.cpp"
+
+#include "benchmarks/bench.hpp"
+
+// The same settings as assets/hdr.json.
+static HdrConfig hdr_config()
+{
+	HdrConfig config;
+	config.num_frames = 8;
+	config.lp_filter.strength = 0.2;
+	config.lp_filter.threshold.Append(0, 10);
+	config.lp_filter.threshold.Append(2048, 205);
+	config.lp_filter.threshold.Append(4095, 205);
+	config.lp_filter.halo = 128;
+	config.global_tonemap.points = { { 0.1, 0.05, 0.15, 5.0, 0.5 },
+									 { 0.5, 0.05, 0.45, 5.0, 0.5 },
+									 { 0.8, 0.05, 0.7, 5.0, 0.5 } };
+	config.global_tonemap.strength = 1.0;
+	config.local_tonemap.pos_strength.Append(0, 6.0);
+	config.local_tonemap.pos_strength.Append(1024, 2.0);
+	config.local_tonemap.pos_strength.Append(4095, 2.0);
+	config.local_tonemap.neg_strength.Append(0, 4.0);
+	config.local_tonemap.neg_strength.Append(1024, 1.5);
+	config.local_tonemap.neg_strength.Append(4095, 1.5);
+	config.local_tonemap.colour_scale = 0.8;
+	return config;
+}
+
+static std::shared_ptr<std::vector<uint8_t>> yuv420_frame(BenchSize const &size, uint32_t seed)
+{
+	auto frame = std::make_shared<std::vector<uint8_t>>(size.width * size.height * 3 / 2);
+	bench_fill(frame->data(), frame->size(), seed);
+	return frame;
+}
+
+// An accumulator that has had all of its frames added, as the stage has it when it starts filtering.
+static std::shared_ptr<HdrImage> accumulated_image(BenchSize const &size, HdrConfig const &config)
+{
+	auto acc = std::make_shared<HdrImage>(size.width, size.height, size.width * size.height * 3 / 2);
+	acc->Clear();
+	for (unsigned int i = 0; i < config.num_frames; i++)
+		acc->Accumulate(yuv420_frame(size, i + 1)->data(), size.width);
+	return acc;
+}
+
+static std::function<void()> hdr_accumulate(BenchSize const &size)
+{
+	auto acc = std::make_shared<HdrImage>(size.width, size.height, size.width * size.height * 3 / 2);
+	auto frame = yuv420_frame(size, 1);
+	// Start again every num_frames, as the stage would, so that the sums never overflow.
+	auto count = std::make_shared<unsigned int>(0);
+	return [=]() {
+		if ((*count)++ % 8 == 0)
+		{
+			acc->Clear();
+			acc->dynamic_range = 0;
+		}
+		acc->Accumulate(frame->data(), size.width);
+	};
+}
+
+static std::function<void()> hdr_lp_filter(BenchSize const &size)
+{
+	HdrConfig config = hdr_config();
+	auto acc = accumulated_image(size, config);
+	// The stage keeps its tables from one capture to the next, and so do we.
+	auto luts = std::make_shared<LpFilterLuts>();
+	return [=]() { HdrImage lp = acc->LpFilter(config.lp_filter, *luts); };
+}
+
+static std::function<void()> hdr_tonemap(BenchSize const &size)
+{
+	HdrConfig config = hdr_config();
+	auto original = accumulated_image(size, config);
+	LpFilterLuts lp_luts;
+	auto lp = std::make_shared<HdrImage>(original->LpFilter(config.lp_filter, lp_luts));
+	auto acc = std::make_shared<HdrImage>();
+	auto luts = std::make_shared<TonemapLuts>();
+	// Tonemap works in place, so each run restarts from a copy of the accumulated image. The copy is
+	// a small part of the time taken.
+	return [=]() {
+		*acc = *original;
+		acc->Tonemap(*lp, config, *luts);
+	};
+}
+
+void add_hdr_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	for (auto const &size : BENCH_SIZES)
+	{
+		benchmarks.push_back({ "hdr_accumulate", size, hdr_accumulate });
+		benchmarks.push_back({ "hdr_lp_filter", size, hdr_lp_filter });
+		benchmarks.push_back({ "hdr_tonemap", size, hdr_tonemap });
+	}
+}
@@ -0,0 +1,128 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * image_bench.cpp - benchmarks for the YUV to RGB, JPEG and raw unpacking kernels.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <memory>
+
+#include <libcamera/color_space.h>
+#include <libcamera/formats.h>
+
+#include "image/image.hpp"
+#include "post_processing_stages/post_processing_stage.hpp"
+
+#include "benchmarks/bench.hpp"
+
+// YUV420 laid out as the ISP would give it to us, with the rows padded to a multiple of 64 bytes.
+static StreamInfo yuv420_info(BenchSize const &size)
+{
+	StreamInfo info;
+	info.width = size.width;
+	info.height = size.height;
+	info.stride = (size.width + 63) & ~63;
+	info.pixel_format = libcamera::formats::YUV420;
+	info.colour_space = libcamera::ColorSpace::Smpte170m;
+	return info;
+}
+
+static std::shared_ptr<std::vector<uint8_t>> yuv420_image(StreamInfo const &info)
+{
+	auto image = std::make_shared<std::vector<uint8_t>>(info.stride * info.height * 3 / 2);
+	bench_fill(image->data(), image->size());
+	return image;
+}
+
+static std::function<void()> rgb_conversion(BenchSize const &size)
+{
+	StreamInfo src_info = yuv420_info(size);
+	StreamInfo dst_info = src_info;
+	dst_info.stride = size.width * 3;
+	dst_info.pixel_format = libcamera::formats::RGB888;
+	auto src = yuv420_image(src_info);
+	auto dst = std::make_shared<std::vector<uint8_t>>(dst_info.stride * dst_info.height);
+	return [=]() mutable { PostProcessingStage::Yuv420ToRgb(dst->data(), src->data(), src_info, dst_info); };
+}
+
+// What the Qt preview does: point sampled, in the stream's own colour space, scaled to fit its window.
+static std::function<void()> preview_conversion(BenchSize const &size)
+{
+	StreamInfo src_info = yuv420_info(size);
+	StreamInfo dst_info;
+	dst_info.width = std::min(size.width, 1024u);
+	dst_info.height = std::min(size.height, 768u);
+	dst_info.stride = dst_info.width * 3;
+	dst_info.pixel_format = libcamera::formats::RGB888;
+	PostProcessingStage::RgbConversion conversion;
+	conversion.resize = PostProcessingStage::RgbConversion::Resize::Scale;
+	conversion.nearest = true;
+	conversion.use_colour_space = true;
+	auto src = yuv420_image(src_info);
+	auto dst = std::make_shared<std::vector<uint8_t>>(dst_info.stride * dst_info.height);
+	return [=]() mutable
+	{ PostProcessingStage::Yuv420ToRgb(dst->data(), src->data(), src_info, dst_info, conversion); };
+}
+
+static std::function<void()> jpeg_encode(BenchSize const &size)
+{
+	StreamInfo info = yuv420_info(size);
+	auto src = yuv420_image(info);
+	return [=]() {
+		uint8_t *jpeg_buffer = nullptr;
+		size_t jpeg_len = 0;
+		yuv420_to_jpeg(src->data(), info, 93, 0, jpeg_buffer, jpeg_len);
+		free(jpeg_buffer);
+	};
+}
+
+static std::function<void()> raw_unpack(BenchSize const &size, libcamera::PixelFormat format, unsigned int stride)
+{
+	StreamInfo info;
+	info.width = size.width;
+	info.height = size.height;
+	info.stride = (stride + 31) & ~31;
+	info.pixel_format = format;
+	auto src = std::make_shared<std::vector<uint8_t>>(info.stride * info.height);
+	bench_fill(src->data(), src->size());
+	auto dest = std::make_shared<std::vector<uint16_t>>();
+	return [=]() { dng_unpack(src->data(), info, *dest); };
+}
+
+// A segmentation mask, at the resolution the networks give them, blended over the middle of an RGB image.
+static std::function<void()> mask_blend(BenchSize const &size)
+{
+	unsigned int stride = size.width * 3;
+	auto image = std::make_shared<std::vector<uint8_t>>(stride * size.height);
+	auto mask = std::make_shared<std::vector<uint8_t>>(160 * 160);
+	bench_fill(image->data(), image->size());
+	bench_fill(mask->data(), mask->size(), 2);
+	libcamera::Rectangle rect(size.width / 4, size.height / 4, size.width / 2, size.height / 2);
+	return [=]() {
+		static const uint8_t colour[3] = { 255, 0, 0 };
+		PostProcessingStage::BlendMask(image->data(), stride, rect, mask->data(), 160, 160, 127, colour, 0.5);
+	};
+}
+
+void add_image_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	for (auto const &size : BENCH_SIZES)
+	{
+		benchmarks.push_back({ "yuv420_to_rgb", size, rgb_conversion });
+		benchmarks.push_back({ "yuv420_to_rgb_preview", size, preview_conversion });
+		benchmarks.push_back({ "yuv420_to_jpeg", size, jpeg_encode });
+		benchmarks.push_back({ "mask_blend", size, mask_blend });
+		benchmarks.push_back({ "unpack_10bit", size, [](BenchSize const &s) {
+								  return raw_unpack(s, libcamera::formats::SRGGB10_CSI2P, s.width * 5 / 4);
+							  } });
+		benchmarks.push_back({ "unpack_12bit", size, [](BenchSize const &s) {
+								  return raw_unpack(s, libcamera::formats::SRGGB12_CSI2P, s.width * 3 / 2);
+							  } });
+		// The PiSP compressed format takes 8 bytes for every 8 pixels.
+		benchmarks.push_back({ "uncompress", size, [](BenchSize const &s) {
+								  return raw_unpack(s, libcamera::formats::RGGB_PISP_COMP1, (s.width + 7) & ~7);
+							  } });
+	}
+}
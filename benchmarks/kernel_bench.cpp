@@ -0,0 +1,241 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * kernel_bench.cpp - time the pixel and codec kernels on the standard image sizes.
+ */
+
+// Example: rpicam-kernel-bench --filter yuv420 --sizes 1080p,12mp --output results.json
+//
+// The results go to stdout (or the --output file) as JSON, one entry for each kernel, size and cache state,
+// along with the compiler, CPU and build details needed to compare them across boards and builds. A table
+// of the same results goes to stderr.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "core/cpu_features.hpp"
+#include "core/version.hpp"
+
+#include "benchmarks/bench.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+void bench_fill(uint8_t *data, size_t size, uint32_t seed)
+{
+	// A simple LCG, mixed with a gradient so that the images aren't pure noise.
+	uint32_t state = seed * 2654435761u + 1;
+	for (size_t i = 0; i < size; i++)
+	{
+		state = state * 1664525u + 1013904223u;
+		data[i] = ((i & 0xff) + (state >> 27)) & 0xff;
+	}
+}
+
+struct Result
+{
+	std::string kernel;
+	BenchSize size;
+	bool cold;
+	unsigned int iterations;
+	double min_ms, median_ms, mean_ms;
+};
+
+// Touching more memory than any Pi's caches hold pushes everything else out of them.
+static void flush_caches()
+{
+	static std::vector<uint8_t> flush(32 << 20);
+	static uint8_t value = 0;
+	value++;
+	for (size_t i = 0; i < flush.size(); i += 64)
+		flush[i] = value;
+}
+
+static Result run(Benchmark const &benchmark, std::function<void()> const &fn, bool cold, double min_time,
+				  unsigned int max_iterations)
+{
+	std::vector<double> times;
+	auto start = Clock::now();
+	while (times.size() < 3 ||
+		   (times.size() < max_iterations && std::chrono::duration<double>(Clock::now() - start).count() < min_time))
+	{
+		if (cold)
+			flush_caches();
+		auto t0 = Clock::now();
+		fn();
+		times.push_back(std::chrono::duration<double, std::milli>(Clock::now() - t0).count());
+	}
+
+	Result result = { benchmark.kernel, benchmark.size, cold, (unsigned int)times.size(), 0, 0, 0 };
+	std::sort(times.begin(), times.end());
+	result.min_ms = times.front();
+	result.median_ms = times[times.size() / 2];
+	for (double t : times)
+		result.mean_ms += t / times.size();
+	return result;
+}
+
+static std::string cpu_model()
+{
+	std::ifstream f("/proc/cpuinfo");
+	std::string line, model;
+	while (std::getline(f, line))
+	{
+		// Raspberry Pis have a "Model" line naming the board, other machines a "model name".
+		if (line.rfind("Model", 0) == 0 || (model.empty() && line.rfind("model name", 0) == 0))
+			model = line.substr(line.find(':') + 2);
+	}
+	return model.empty() ? "unknown" : model;
+}
+
+static std::string json_string(std::string const &s)
+{
+	std::string out = "\"";
+	for (char c : s)
+	{
+		if (c == '"' || c == '\\')
+			out += '\\';
+		out += c;
+	}
+	return out + "\"";
+}
+
+static void write_json(std::ostream &os, std::vector<Result> const &results)
+{
+	os << std::fixed << std::setprecision(4);
+	os << "{\"version\":" << json_string(RPiCamAppsVersion());
+#if defined(__clang__)
+	os << ",\"compiler\":" << json_string("clang " __clang_version__);
+#elif defined(__GNUC__)
+	os << ",\"compiler\":" << json_string("gcc " __VERSION__);
+#endif
+#if defined(__ARM_NEON)
+	os << ",\"neon\":true";
+#else
+	os << ",\"neon\":false";
+#endif
+#if defined(__OPTIMIZE__)
+	os << ",\"optimised\":true";
+#else
+	os << ",\"optimised\":false";
+#endif
+	os << ",\"cpu\":" << json_string(cpu_model());
+	os << ",\"cpu_level\":" << json_string(CpuLevelName(GetCpuLevel()));
+	os << ",\"threads\":" << std::thread::hardware_concurrency();
+	os << ",\"results\":[";
+	for (unsigned int i = 0; i < results.size(); i++)
+	{
+		Result const &r = results[i];
+		double mpix_per_s = r.size.width * r.size.height / (r.median_ms * 1000);
+		os << (i ? "," : "") << "\n  {\"kernel\":" << json_string(r.kernel) << ",\"size\":" << json_string(r.size.name)
+		   << ",\"width\":" << r.size.width << ",\"height\":" << r.size.height
+		   << ",\"cache\":" << (r.cold ? "\"cold\"" : "\"warm\"") << ",\"iterations\":" << r.iterations
+		   << ",\"min_ms\":" << r.min_ms << ",\"median_ms\":" << r.median_ms << ",\"mean_ms\":" << r.mean_ms
+		   << ",\"mpix_per_s\":" << mpix_per_s << "}";
+	}
+	os << "\n]}" << std::endl;
+}
+
+static void usage()
+{
+	std::cerr << "Usage: rpicam-kernel-bench [--filter <text>] [--sizes <list>] [--min-time <seconds>] "
+				 "[--output <file>] [--list]\n"
+				 "  --filter    only run kernels whose names contain this\n"
+				 "  --sizes     comma separated list of lores, 1080p and 12mp (default all)\n"
+				 "  --min-time  keep repeating each kernel for this long (default 0.5)\n"
+				 "  --output    write the JSON results to this file rather than stdout\n"
+				 "  --list      just list the benchmarks" << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		std::string filter, sizes, output;
+		double min_time = 0.5;
+		bool list = false;
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			auto value = [&]() {
+				if (i + 1 >= argc)
+					throw std::runtime_error("missing value for " + arg);
+				return std::string(argv[++i]);
+			};
+			if (arg == "--filter")
+				filter = value();
+			else if (arg == "--sizes")
+				sizes = value();
+			else if (arg == "--min-time")
+				min_time = std::stod(value());
+			else if (arg == "--output")
+				output = value();
+			else if (arg == "--list")
+				list = true;
+			else
+			{
+				usage();
+				return arg == "--help" || arg == "-h" ? 0 : -1;
+			}
+		}
+
+		std::vector<Benchmark> benchmarks;
+		add_image_benchmarks(benchmarks);
+		add_hdr_benchmarks(benchmarks);
+		add_motion_detect_benchmarks(benchmarks);
+
+		std::vector<Result> results;
+		for (auto const &benchmark : benchmarks)
+		{
+			if (benchmark.kernel.find(filter) == std::string::npos)
+				continue;
+			if (!sizes.empty() && ("," + sizes + ",").find("," + std::string(benchmark.size.name) + ",") ==
+									  std::string::npos)
+				continue;
+			if (list)
+			{
+				std::cout << benchmark.kernel << " " << benchmark.size.name << std::endl;
+				continue;
+			}
+
+			std::function<void()> fn = benchmark.setup(benchmark.size);
+			fn(); // the first run can include one-off allocations
+			results.push_back(run(benchmark, fn, false, min_time, 1000));
+			// Cold runs are much slower per run, so fewer of them.
+			results.push_back(run(benchmark, fn, true, min_time, 50));
+
+			for (auto const &r : { results[results.size() - 2], results.back() })
+				std::cerr << std::left << std::setw(28) << r.kernel << std::setw(7) << r.size.name
+						  << (r.cold ? "cold " : "warm ") << std::right << std::fixed << std::setprecision(3)
+						  << std::setw(10) << r.median_ms << "ms median " << std::setw(10) << r.min_ms << "ms min ("
+						  << r.iterations << " runs)" << std::endl;
+		}
+
+		if (list)
+			return 0;
+		if (output.empty())
+			write_json(std::cout, results);
+		else
+		{
+			std::ofstream f(output);
+			if (!f)
+				throw std::runtime_error("failed to open " + output);
+			write_json(f, results);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * motion_detect_bench.cpp - benchmark for the motion detect stage's background comparison.
+ */
+
+// As in hdr_bench.cpp, the kernel is private to the stage, so the stage's source is built in here.
+#include "post_processing_stages/motion_detect_stage.cpp"
+
+#include "benchmarks/bench.hpp"
+
+// Compare every pixel of a Y plane against a background, with the stage's default difference_m,
+// difference_c and background_rate. The stage normally looks at a (much smaller) lores image, but
+// timing it at each size shows how it scales.
+static std::function<void()> motion_detect_compare(BenchSize const &size)
+{
+	unsigned int width = size.width, height = size.height;
+	auto image = std::make_shared<std::vector<uint8_t>>(width * height);
+	bench_fill(image->data(), image->size());
+	// The background holds pixel values with 7 fractional bits, here taken from a different image.
+	auto background = std::make_shared<std::vector<int16_t>>(width * height);
+	std::vector<uint8_t> start(width * height);
+	bench_fill(start.data(), start.size(), 2);
+	for (unsigned int i = 0; i < start.size(); i++)
+		(*background)[i] = start[i] << 7;
+
+	unsigned int m = std::lround(0.1 * 256), c = 10;
+	int shift = std::lround(-std::log2(0.25));
+	return [=]() {
+		uint32_t sad = 0;
+		unsigned int changed = 0;
+		for (unsigned int y = 0; y < height; y++)
+			changed += compare_pixels(image->data() + y * width, 1, background->data() + y * width, width, m, c,
+									  shift, sad);
+		// Stop the compiler from deciding the results aren't needed.
+		asm volatile("" : : "r"(changed), "r"(sad));
+	};
+}
+
+void add_motion_detect_benchmarks(std::vector<Benchmark> &benchmarks)
+{
+	for (auto const &size : BENCH_SIZES)
+		benchmarks.push_back({ "motion_detect_compare", size, motion_detect_compare });
+}
@@ -14,11 +14,12 @@
 #include "core/logging.hpp"
 
 BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
-	: fb_(fb)
+	: fb_(fb), deferred_(false)
 {
 	struct dma_buf_sync dma_sync {};
 	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
 
+	std::shared_lock<std::shared_mutex> lock(app->mapped_buffers_mutex_);
 	auto it = app->mapped_buffers_.find(fb_);
 	if (it == app->mapped_buffers_.end())
 	{
@@ -26,11 +27,19 @@ BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 		return;
 	}
 
-	int ret = ::ioctl(fb_->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-	if (ret)
+	// In the post-processing stages, only the first writer starts the access, and the PostProcessor ends it.
+	std::lock_guard<std::mutex> sync_lock(app->buffer_sync_mutex_);
+	deferred_ = app->deferred_write_buffers_.count(fb_);
+	if (!deferred_ || app->write_synced_buffers_.insert(fb_).second)
 	{
-		LOG_ERROR("failed to lock-sync-write dma buf");
-		return;
+		int ret = ::ioctl(fb_->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+		if (ret)
+		{
+			if (deferred_)
+				app->write_synced_buffers_.erase(fb_);
+			LOG_ERROR("failed to lock-sync-write dma buf");
+			return;
+		}
 	}
 
 	planes_ = it->second;
@@ -38,6 +47,9 @@ BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 
 BufferWriteSync::~BufferWriteSync()
 {
+	if (deferred_)
+		return;
+
 	struct dma_buf_sync dma_sync {};
 	dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
 
@@ -51,8 +63,26 @@ const std::vector<libcamera::Span<uint8_t>> &BufferWriteSync::Get() const
 	return planes_;
 }
 
+void BufferWriteSync::Flush(RPiCamApp *app, libcamera::FrameBuffer *fb)
+{
+	{
+		std::lock_guard<std::mutex> lock(app->buffer_sync_mutex_);
+		if (!app->write_synced_buffers_.erase(fb))
+			return;
+	}
+
+	// The buffer stays deferred, so that any later writer starts a new access.
+	struct dma_buf_sync dma_sync {};
+	dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+
+	int ret = ::ioctl(fb->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+	if (ret)
+		LOG_ERROR("failed to unlock-sync-write dma buf");
+}
+
 BufferReadSync::BufferReadSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 {
+	std::shared_lock<std::shared_mutex> mapped_lock(app->mapped_buffers_mutex_);
 	auto it = app->mapped_buffers_.find(fb);
 	if (it == app->mapped_buffers_.end())
 	{
@@ -60,8 +90,26 @@ BufferReadSync::BufferReadSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 		return;
 	}
 
-	// DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ happens when the request completes,
-	// so nothing to do here but cache the planes map.
+	// The DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ happens on the first CPU access to the buffer after
+	// the request completes. Buffers that only ever get passed on by fd (for example to the encoder
+	// or the preview) never pay for the cache maintenance.
+	{
+		std::lock_guard<std::mutex> lock(app->buffer_sync_mutex_);
+		if (app->read_synced_buffers_.insert(fb).second)
+		{
+			struct dma_buf_sync dma_sync {};
+			dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+
+			int ret = ::ioctl(fb->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+			if (ret)
+			{
+				app->read_synced_buffers_.erase(fb);
+				LOG_ERROR("failed to lock-sync-read dma buf");
+				return;
+			}
+		}
+	}
+
 	planes_ = it->second;
 }
 
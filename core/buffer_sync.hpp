@@ -11,6 +11,9 @@
 
 class RPiCamApp;
 
+// While a request is going through the post-processing stages, the DMA_BUF_SYNC_END that makes the writes
+// visible outside the CPU waits until the last stage has finished with it. That way a chain of stages that
+// all draw on the same buffer only pays for the cache maintenance once.
 class BufferWriteSync
 {
 public:
@@ -19,8 +22,13 @@ public:
 
 	const std::vector<libcamera::Span<uint8_t>> &Get() const;
 
+	// End any write access the post-processing stages have left open now, for example before the GPU
+	// reads the buffer.
+	static void Flush(RPiCamApp *app, libcamera::FrameBuffer *fb);
+
 private:
 	libcamera::FrameBuffer *fb_;
+	bool deferred_;
 	std::vector<libcamera::Span<uint8_t>> planes_;
 };
 
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * buffer_tuner.hpp - Choose the number of in-flight requests from how many are held downstream.
+ */
+
+#pragma once
+
+#include <algorithm>
+
+/*
+ * The number of requests the application holds at once (the encoder, preview and post-processing
+ * together) is the rate at which frames arrive times how long each one is held, so it follows
+ * the downstream latency directly. libcamera needs a couple more queued on top of those so
+ * that the sensor never runs short. We grow straight away whenever the peak gets too close to
+ * the number of requests we have, and shrink one at a time after several quiet windows, so that
+ * brief stalls don't make the count oscillate.
+ */
+class BufferTuner
+{
+public:
+	static constexpr unsigned int Headroom = 2;
+	static constexpr unsigned int Window = 60;
+	static constexpr unsigned int ShrinkWindows = 3;
+
+	BufferTuner(unsigned int min_count, unsigned int max_count)
+		: min_(std::max(min_count, Headroom + 1)), max_(std::max(max_count, min_)), frames_(0), peak_(0),
+		  window_peak_(0), quiet_windows_(0)
+	{
+	}
+
+	unsigned int Min() const { return min_; }
+	unsigned int Max() const { return max_; }
+	// The largest number of requests held downstream at once, since the start.
+	unsigned int Peak() const { return peak_; }
+
+	// Called as each request comes back, with the number that were held at that moment (including
+	// this one) and the number of requests that currently exist. Returns how many requests to
+	// add, or a negative number to retire that many.
+	int Update(unsigned int held, unsigned int current)
+	{
+		peak_ = std::max(peak_, held);
+		window_peak_ = std::max(window_peak_, held);
+
+		unsigned int target = std::clamp(window_peak_ + Headroom, min_, max_);
+		if (target > current)
+		{
+			quiet_windows_ = 0;
+			return target - current;
+		}
+
+		if (++frames_ < Window)
+			return 0;
+
+		frames_ = 0;
+		window_peak_ = 0;
+		if (target < current && ++quiet_windows_ >= ShrinkWindows)
+		{
+			quiet_windows_ = 0;
+			return -1;
+		}
+		else if (target >= current)
+			quiet_windows_ = 0;
+		return 0;
+	}
+
+private:
+	unsigned int min_;
+	unsigned int max_;
+	unsigned int frames_;
+	unsigned int peak_;
+	unsigned int window_peak_;
+	unsigned int quiet_windows_;
+};
@@ -25,6 +25,19 @@ struct CompletedRequest
 	{
 		r->reuse();
 	}
+	// For objects that are kept for the lifetime of their request, and re-filled by Fill()
+	// each time it completes.
+	explicit CompletedRequest(Request *r) : sequence(0), request(r), framerate(0) {}
+	void Fill(unsigned int seq)
+	{
+		// Assigning into the existing containers lets them re-use their nodes.
+		sequence = seq;
+		buffers = request->buffers();
+		metadata = request->metadata();
+		framerate = 0;
+		post_process_metadata.Clear();
+		request->reuse();
+	}
 	unsigned int sequence;
 	BufferMap buffers;
 	ControlList metadata;
@@ -0,0 +1,101 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * control_socket.cpp - Accept commands over a UNIX socket.
+ */
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/control_socket.hpp"
+#include "core/logging.hpp"
+#include "core/thread_config.hpp"
+
+ControlSocket::ControlSocket(std::string const &path, CommandHandler handler)
+	: path_(path), handler_(std::move(handler)), abort_(false)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path_.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("control socket path too long: " + path_);
+	strcpy(addr.sun_path, path_.c_str());
+
+	fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("unable to open control socket");
+
+	unlink(path_.c_str());
+	if (bind(fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd_, 4) < 0)
+	{
+		close(fd_);
+		throw std::runtime_error("unable to listen on control socket " + path_ + ": " + strerror(errno));
+	}
+
+	thread_ = std::thread(&ControlSocket::socketThread, this);
+	LOG(2, "Accepting commands on " << path_);
+}
+
+ControlSocket::~ControlSocket()
+{
+	abort_ = true;
+	thread_.join();
+	close(fd_);
+	unlink(path_.c_str());
+}
+
+void ControlSocket::socketThread()
+{
+	ThreadConfig::Get().Apply("server");
+	while (!abort_)
+	{
+		pollfd p = { fd_, POLLIN, 0 };
+		int ret = poll(&p, 1, 200);
+		if (ret <= 0 || !(p.revents & POLLIN))
+			continue;
+
+		int client = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client < 0)
+			continue;
+
+		serveClient(client);
+		close(client);
+	}
+}
+
+void ControlSocket::serveClient(int client)
+{
+	// Clients are served one at a time, so don't let one that goes quiet hold us up for long.
+	std::string pending;
+	while (!abort_)
+	{
+		pollfd p = { client, POLLIN, 0 };
+		if (poll(&p, 1, 1000) <= 0)
+			return;
+
+		char buf[256];
+		ssize_t n = recv(client, buf, sizeof(buf), 0);
+		if (n <= 0)
+			return;
+		pending.append(buf, n);
+
+		size_t end;
+		while ((end = pending.find('\n')) != std::string::npos)
+		{
+			std::string command = pending.substr(0, end);
+			pending.erase(0, end + 1);
+			if (command.empty())
+				continue;
+
+			std::string reply = handler_(command) + "\n";
+			if (send(client, reply.data(), reply.size(), MSG_NOSIGNAL) < 0)
+				return;
+		}
+	}
+}
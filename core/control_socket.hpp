@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * control_socket.hpp - Accept commands over a UNIX socket.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+// Listens on a UNIX stream socket. Each line that a client sends is passed to the handler, on
+// the socket's own thread, and whatever the handler returns is sent back as the reply.
+class ControlSocket
+{
+public:
+	using CommandHandler = std::function<std::string(std::string const &)>;
+
+	ControlSocket(std::string const &path, CommandHandler handler);
+	~ControlSocket();
+
+private:
+	void socketThread();
+	void serveClient(int client);
+
+	std::string path_;
+	CommandHandler handler_;
+	int fd_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+};
@@ -0,0 +1,87 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * cpu_features.cpp - Pick between the implementations of a kernel at runtime.
+ */
+
+#include <sys/auxv.h>
+
+#include <cstdlib>
+#include <cstring>
+
+#include "core/cpu_features.hpp"
+#include "core/logging.hpp"
+
+// HWCAP bits from the kernel's uapi headers, in case the C library doesn't have them.
+#if defined(__aarch64__)
+#ifndef HWCAP_ASIMD
+#define HWCAP_ASIMD (1 << 1)
+#endif
+#ifndef HWCAP_ASIMDDP
+#define HWCAP_ASIMDDP (1 << 20)
+#endif
+#elif defined(__arm__)
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+
+static CpuLevel detect_cpu_level()
+{
+	CpuLevel level = CpuLevel::Generic;
+#if defined(__aarch64__)
+	unsigned long hwcap = getauxval(AT_HWCAP);
+	if (hwcap & HWCAP_ASIMD)
+		level = (hwcap & HWCAP_ASIMDDP) ? CpuLevel::Dotprod : CpuLevel::Neon;
+#elif defined(__arm__)
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+		level = CpuLevel::Neon;
+#endif
+
+	// Don't claim more than we have kernels for.
+#if !defined(RPICAM_DOTPROD_KERNELS)
+	if (level > CpuLevel::Neon)
+		level = CpuLevel::Neon;
+#endif
+#if !defined(RPICAM_NEON_KERNELS)
+	level = CpuLevel::Generic;
+#endif
+
+	if (char const *cap = getenv("RPICAM_CPU_LEVEL"))
+	{
+		CpuLevel max_level = level;
+		if (!strcmp(cap, "generic"))
+			max_level = CpuLevel::Generic;
+		else if (!strcmp(cap, "neon"))
+			max_level = CpuLevel::Neon;
+		else if (!strcmp(cap, "dotprod"))
+			max_level = CpuLevel::Dotprod;
+		else
+			LOG_ERROR("WARNING: unrecognised RPICAM_CPU_LEVEL " << cap << " ignored");
+		if (max_level < level)
+			level = max_level;
+	}
+
+	return level;
+}
+
+CpuLevel GetCpuLevel()
+{
+	// Kernels are selected during static initialisation, so this must not rely on anything else being set up.
+	static CpuLevel level = detect_cpu_level();
+	return level;
+}
+
+char const *CpuLevelName(CpuLevel level)
+{
+	switch (level)
+	{
+	case CpuLevel::Neon:
+		return "neon";
+	case CpuLevel::Dotprod:
+		return "dotprod";
+	default:
+		return "generic";
+	}
+}
@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * cpu_features.hpp - Pick between the implementations of a kernel at runtime.
+ */
+
+#pragma once
+
+#include <initializer_list>
+#include <stdexcept>
+
+/*
+ * The vectorised kernels come in several versions, from plain C++ up to ones using the
+ * instructions of a particular architecture level, and the best one this CPU can run is
+ * picked when the program starts. So one build runs at full speed on, for example, the
+ * Cortex-A72 (Armv8.0) in a Pi 4 and the Cortex-A76 (Armv8.2, with the dot product
+ * instructions) in a Pi 5, and 32-bit builds no longer need NEON turned on at build time.
+ *
+ * Functions marked NEON_TARGET or DOTPROD_TARGET may use those instructions whatever the
+ * file is built for, but must only be called through SelectKernel (or from another function
+ * with the same mark). The RPICAM_NEON_KERNELS and RPICAM_DOTPROD_KERNELS macros say whether
+ * the compiler can build such functions at all.
+ *
+ * Setting RPICAM_CPU_LEVEL to "generic", "neon" or "dotprod" in the environment caps the
+ * level used, which is handy for comparing the versions with rpicam-kernel-bench.
+ */
+
+#if defined(__aarch64__)
+#define RPICAM_NEON_KERNELS 1
+#define NEON_TARGET
+#if defined(__clang__)
+#if __clang_major__ >= 16 || defined(__ARM_FEATURE_DOTPROD)
+#define RPICAM_DOTPROD_KERNELS 1
+#define DOTPROD_TARGET __attribute__((target("dotprod")))
+#endif
+#elif defined(__GNUC__) && __GNUC__ >= 8
+#define RPICAM_DOTPROD_KERNELS 1
+#define DOTPROD_TARGET __attribute__((target("+dotprod")))
+#endif
+#elif defined(__ARM_NEON)
+// 32-bit, built with NEON turned on anyway.
+#define RPICAM_NEON_KERNELS 1
+#define NEON_TARGET
+#elif defined(__arm__) && defined(__ARM_FP) && !defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 8
+// 32-bit hard float. GCC's arm_neon.h can be included without NEON, for use in functions that turn it on.
+#define RPICAM_NEON_KERNELS 1
+#define NEON_TARGET __attribute__((target("fpu=neon-fp-armv8")))
+#endif
+
+#if defined(RPICAM_NEON_KERNELS)
+#include <arm_neon.h>
+#endif
+
+enum class CpuLevel
+{
+	Generic, // plain C++, though the compiler may still vectorise it
+	Neon, // Armv8.0 Advanced SIMD, as on the Pi 3 and 4
+	Dotprod, // Armv8.2 with the dot product instructions, as on the Pi 5
+};
+
+// The highest level this CPU supports, capped by RPICAM_CPU_LEVEL if that's set.
+CpuLevel GetCpuLevel();
+char const *CpuLevelName(CpuLevel level);
+
+template <typename F>
+struct KernelVersion
+{
+	CpuLevel level;
+	F fn;
+};
+
+// Return the first of the versions (listed best first) that this CPU can run. There must always be a
+// Generic one.
+template <typename F>
+F SelectKernel(std::initializer_list<KernelVersion<F>> versions)
+{
+	CpuLevel level = GetCpuLevel();
+	for (auto const &version : versions)
+	{
+		if (version.level <= level)
+			return version.fn;
+	}
+	throw std::runtime_error("SelectKernel: no generic version");
+}
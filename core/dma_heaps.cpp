@@ -8,10 +8,12 @@
 #include "dma_heaps.hpp"
 
 #include <array>
+#include <iterator>
 #include <fcntl.h>
 #include <linux/dma-buf.h>
 #include <linux/dma-heap.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "core/logging.hpp"
@@ -77,3 +79,128 @@ libcamera::UniqueFD DmaHeap::alloc(const char *name, std::size_t size) const
 
 	return allocFd;
 }
+
+namespace
+{
+
+constexpr std::size_t kPageSize = 4096;
+
+/*
+ * Don't hand out a pooled buffer that is more than this fraction bigger than
+ * the request, the memory is better off being given back to the system.
+ */
+constexpr std::size_t kMaxWasteFraction = 4;
+
+} // namespace
+
+DmaHeapPool::DmaHeapPool()
+	: maxSize_(0), pooledSize_(0)
+{
+}
+
+DmaHeapPool::~DmaHeapPool()
+{
+	clear();
+}
+
+void DmaHeapPool::setMaxSize(std::size_t maxSize)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	maxSize_ = maxSize;
+
+	/* Trim the largest buffers first until we fit under the new limit. */
+	while (pooledSize_ > maxSize_ && !freeBuffers_.empty())
+	{
+		auto it = std::prev(freeBuffers_.end());
+		pooledSize_ -= it->second.size;
+		free(it->second);
+		freeBuffers_.erase(it);
+	}
+}
+
+DmaHeapPool::Buffer DmaHeapPool::acquire(const char *name, std::size_t size)
+{
+	/* Allocations are rounded up to whole pages, which serves as our bucket size. */
+	size = (size + kPageSize - 1) & ~(kPageSize - 1);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		auto it = freeBuffers_.lower_bound(size);
+		if (it != freeBuffers_.end() && it->first <= size + size / kMaxWasteFraction)
+		{
+			Buffer buffer = std::move(it->second);
+			pooledSize_ -= buffer.size;
+			freeBuffers_.erase(it);
+			LOG(2, "Reusing pooled dma-heap buffer of size " << buffer.size << " for " << name);
+			return buffer;
+		}
+	}
+
+	libcamera::UniqueFD fd = heap_.alloc(name, size);
+	if (!fd.isValid())
+	{
+		/* We may be holding on to memory that somebody else now needs, so give it all back and retry. */
+		clear();
+		fd = heap_.alloc(name, size);
+		if (!fd.isValid())
+			return {};
+	}
+
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+	if (mem == MAP_FAILED)
+	{
+		LOG_ERROR("dmaHeap mmap failure for " << name);
+		return {};
+	}
+
+	Buffer buffer;
+	buffer.fd = libcamera::SharedFD(std::move(fd));
+	buffer.size = size;
+	buffer.mem = mem;
+	return buffer;
+}
+
+void DmaHeapPool::release(Buffer &&buffer)
+{
+	if (!buffer.mem)
+		return;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (pooledSize_ + buffer.size > maxSize_)
+	{
+		free(buffer);
+		return;
+	}
+
+	pooledSize_ += buffer.size;
+	std::size_t size = buffer.size;
+	freeBuffers_.emplace(size, std::move(buffer));
+}
+
+void DmaHeapPool::discard(Buffer &&buffer)
+{
+	if (buffer.mem)
+		free(buffer);
+}
+
+void DmaHeapPool::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto &[size, buffer] : freeBuffers_)
+		free(buffer);
+	freeBuffers_.clear();
+	pooledSize_ = 0;
+}
+
+std::size_t DmaHeapPool::pooledSize()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return pooledSize_;
+}
+
+void DmaHeapPool::free(Buffer &buffer)
+{
+	munmap(buffer.mem, buffer.size);
+	buffer.mem = nullptr;
+	buffer.fd = libcamera::SharedFD();
+}
@@ -9,6 +9,10 @@
 
 #include <stddef.h>
 
+#include <map>
+#include <mutex>
+
+#include <libcamera/base/shared_fd.h>
 #include <libcamera/base/unique_fd.h>
 
 class DmaHeap
@@ -22,3 +26,40 @@ public:
 private:
 	libcamera::UniqueFD dmaHeapHandle_;
 };
+
+/*
+ * A pool of mmapped dma-heap buffers. Buffers that are released go back into the
+ * pool (up to a cap on the total pooled size) rather than being freed, so that
+ * reconfiguring the camera does not have to return to the allocator every time.
+ */
+class DmaHeapPool
+{
+public:
+	struct Buffer
+	{
+		libcamera::SharedFD fd;
+		std::size_t size = 0;
+		void *mem = nullptr;
+	};
+
+	DmaHeapPool();
+	~DmaHeapPool();
+	bool isValid() const { return heap_.isValid(); }
+	void setMaxSize(std::size_t maxSize);
+	Buffer acquire(const char *name, std::size_t size);
+	void release(Buffer &&buffer);
+	// Free the buffer straight away instead of returning it to the pool.
+	void discard(Buffer &&buffer);
+	void clear();
+	// The total size of the buffers sitting in the pool.
+	std::size_t pooledSize();
+
+private:
+	void free(Buffer &buffer);
+
+	DmaHeap heap_;
+	std::mutex mutex_;
+	std::size_t maxSize_;
+	std::size_t pooledSize_;
+	std::multimap<std::size_t, Buffer> freeBuffers_;
+};
@@ -0,0 +1,288 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_exporter.cpp - Share frames with other processes by passing their dmabuf fds.
+ */
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/frame_exporter.hpp"
+#include "core/logging.hpp"
+#include "core/thread_config.hpp"
+
+FrameExporter::FrameExporter(std::string const &path, unsigned int credits, std::chrono::milliseconds hold_timeout,
+							 unsigned int max_clients)
+	: path_(path), credits_(std::max(credits, 1u)), hold_timeout_(hold_timeout), max_clients_(max_clients),
+	  next_id_(0), abort_(false)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path_.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("frame export socket path too long: " + path_);
+	strcpy(addr.sun_path, path_.c_str());
+
+	fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("unable to open frame export socket");
+
+	// A socket left behind by an earlier run would stop us binding.
+	unlink(path_.c_str());
+	if (bind(fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd_, 4) < 0)
+	{
+		close(fd_);
+		throw std::runtime_error("unable to listen on frame export socket " + path_ + ": " + strerror(errno));
+	}
+
+	thread_ = std::thread(&FrameExporter::serverThread, this);
+	LOG(2, "Exporting frames on " << path_);
+}
+
+FrameExporter::~FrameExporter()
+{
+	abort_ = true;
+	thread_.join();
+	for (auto &client : clients_)
+		close(client->fd);
+	close(fd_);
+	unlink(path_.c_str());
+}
+
+bool FrameExporter::sendMessage(int fd, std::string const &message, int pass_fd)
+{
+	iovec iov = { const_cast<char *>(message.data()), message.size() };
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	if (pass_fd >= 0)
+	{
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+	}
+
+	// Never wait on a client: one that isn't reading just misses the frame.
+	return sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)message.size();
+}
+
+unsigned int FrameExporter::Publish(Frame const &frame)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	std::vector<Client *> ready;
+	for (auto &client : clients_)
+	{
+		if (client->dead)
+			continue;
+		// Allow a quarter of an interval of slack, or a client asking for half the camera's rate would
+		// only get a third of it whenever the frames come a microsecond early.
+		if (client->interval_us && client->last_sent_us >= 0 &&
+			frame.timestamp_us - client->last_sent_us < client->interval_us - client->interval_us / 4)
+			continue;
+		if (client->metadata_only || client->held.size() < credits_)
+			ready.push_back(client.get());
+		else
+			client->missed++;
+	}
+	if (ready.empty())
+		return 0;
+
+	uint64_t id = next_id_++;
+	std::stringstream message;
+	message << "{\"type\":\"frame\",\"id\":" << id << ",\"sequence\":" << frame.sequence
+			<< ",\"timestamp_us\":" << frame.timestamp_us << ",\"width\":" << frame.info.width
+			<< ",\"height\":" << frame.info.height << ",\"stride\":" << frame.info.stride << ",\"pixel_format\":\""
+			<< frame.info.pixel_format.toString() << "\",\"size\":" << frame.size;
+	if (!frame.metadata_json.empty())
+		message << ",\"metadata\":" << frame.metadata_json;
+	message << "}";
+
+	unsigned int sent = 0;
+	auto now = std::chrono::steady_clock::now();
+	for (Client *client : ready)
+	{
+		if (sendMessage(client->fd, message.str(), client->metadata_only ? -1 : frame.fd))
+		{
+			if (!client->metadata_only)
+				client->held[id] = { frame.hold, now };
+			client->last_sent_us = frame.timestamp_us;
+			sent++;
+		}
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			client->missed++;
+		else
+			client->dead = true;
+	}
+	return sent;
+}
+
+void FrameExporter::revoke(Client &client, uint64_t id, Released &released)
+{
+	release(client, id, released);
+	if (!sendMessage(client.fd, "{\"type\":\"revoke\",\"id\":" + std::to_string(id) + "}"))
+		client.dead = true;
+}
+
+void FrameExporter::release(Client &client, uint64_t id, Released &released)
+{
+	auto it = client.held.find(id);
+	if (it == client.held.end())
+		return;
+	released.push_back(std::move(it->second.hold));
+	client.held.erase(it);
+}
+
+std::vector<std::shared_ptr<void>> FrameExporter::RevokeAll()
+{
+	Released released;
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (auto &client : clients_)
+	{
+		while (!client->held.empty())
+			revoke(*client, client->held.begin()->first, released);
+	}
+	return released;
+}
+
+bool FrameExporter::HasClients()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return !clients_.empty();
+}
+
+void FrameExporter::revokeExpired(Released &released)
+{
+	auto now = std::chrono::steady_clock::now();
+	for (auto &client : clients_)
+	{
+		std::vector<uint64_t> expired;
+		for (auto const &[id, held] : client->held)
+		{
+			if (now - held.sent > hold_timeout_)
+				expired.push_back(id);
+		}
+		for (uint64_t id : expired)
+		{
+			LOG(1, "FrameExporter: client held frame " << id << " too long, revoking it");
+			revoke(*client, id, released);
+		}
+	}
+}
+
+void FrameExporter::handleMessage(Client &client, std::string const &message, Released &released)
+{
+	std::istringstream in(message);
+	std::string command;
+	uint64_t id;
+	float fps;
+	in >> command;
+	if (command == "release" && in >> id)
+		release(client, id, released);
+	else if (command == "fps" && in >> fps && fps >= 0)
+		client.interval_us = fps > 0 ? 1e6 / fps : 0;
+	else if (command == "metadata-only")
+	{
+		client.metadata_only = true;
+		while (!client.held.empty())
+			release(client, client.held.begin()->first, released);
+	}
+	else
+		LOG(1, "FrameExporter: unrecognised message \"" << message << "\"");
+}
+
+void FrameExporter::serverThread()
+{
+	ThreadConfig::Get().Apply("server");
+	while (!abort_)
+	{
+		// Giving a request back to the camera can wait on the camera stopping, which may be waiting on
+		// Publish, so the holds dropped while we have the lock are only let go of once it's released.
+		Released released;
+		std::vector<pollfd> fds = { { fd_, POLLIN, 0 } };
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (auto &client : clients_)
+				fds.push_back({ client->fd, POLLIN, 0 });
+		}
+
+		// Wake often enough to notice frames held past their timeout.
+		int timeout = std::clamp<int>(hold_timeout_.count() / 4, 10, 200);
+		int ret = poll(fds.data(), fds.size(), timeout);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (ret > 0)
+		{
+			// The clients can only have been added to since we polled, so the first ones still match.
+			for (unsigned int i = 1; i < fds.size(); i++)
+			{
+				Client &client = *clients_[i - 1];
+				if (fds[i].revents & (POLLERR | POLLHUP))
+					client.dead = true;
+				else if (fds[i].revents & POLLIN)
+				{
+					char buf[256];
+					ssize_t n = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+					if (n <= 0)
+						client.dead = true;
+					else
+						handleMessage(client, std::string(buf, n), released);
+				}
+			}
+
+			if (fds[0].revents & POLLIN)
+			{
+				int client = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+				if (client >= 0 && clients_.size() >= max_clients_)
+				{
+					LOG(1, "FrameExporter: too many clients, refusing another");
+					close(client);
+				}
+				else if (client >= 0)
+				{
+					std::string hello = "{\"type\":\"hello\",\"credits\":" + std::to_string(credits_) +
+										",\"hold_timeout_ms\":" + std::to_string(hold_timeout_.count()) + "}";
+					if (sendMessage(client, hello))
+					{
+						clients_.push_back(std::make_unique<Client>());
+						clients_.back()->fd = client;
+						LOG(2, "FrameExporter: client connected");
+					}
+					else
+						close(client);
+				}
+			}
+		}
+
+		revokeExpired(released);
+
+		// Dropping a client also drops its hold on every frame it had.
+		for (auto it = clients_.begin(); it != clients_.end();)
+		{
+			if ((*it)->dead)
+			{
+				LOG(2, "FrameExporter: client disconnected, having missed " << (*it)->missed << " frames");
+				close((*it)->fd);
+				for (auto &[id, held] : (*it)->held)
+					released.push_back(std::move(held.hold));
+				it = clients_.erase(it);
+			}
+			else
+				it++;
+		}
+	}
+}
@@ -0,0 +1,110 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_exporter.hpp - Share frames with other processes by passing their dmabuf fds.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/stream_info.hpp"
+
+/*
+ * Listens on a UNIX SOCK_SEQPACKET socket and offers each frame to every client that has a credit
+ * to spare, sending the frame's dmabuf fd (with SCM_RIGHTS) alongside a JSON description. Nothing
+ * is copied: the client maps the fd itself. Every message is a single packet.
+ *
+ * On connecting, a client is sent
+ *   {"type":"hello","credits":N,"hold_timeout_ms":T}
+ * and may then hold up to N frames at once. Each frame arrives as
+ *   {"type":"frame","id":I,"sequence":S,"timestamp_us":U,"width":W,"height":H,"stride":B,
+ *    "pixel_format":"YUV420","size":Z,"metadata":{...}}
+ * with the fd attached, which the client should close when it is done. The client hands the frame
+ * back, and gets its credit back, by sending
+ *   release I
+ * A client with no credits left simply misses frames, so capture never waits for it. A frame that
+ * a client holds for longer than the timeout is taken back anyway and the client is sent
+ *   {"type":"revoke","id":I}
+ * after which it must stop reading the buffer, as the camera will be writing into it again.
+ *
+ * A client may also send
+ *   fps R
+ * to be offered no more than about R frames a second (0 for all of them), and
+ *   metadata-only
+ * to be sent the frame messages without the fds, which then need no credits and no release.
+ */
+class FrameExporter
+{
+public:
+	struct Frame
+	{
+		int fd;
+		std::size_t size;
+		StreamInfo info;
+		uint64_t sequence;
+		int64_t timestamp_us;
+		std::string metadata_json;
+		// Keeps the buffer out of the camera's hands for as long as any client has the frame.
+		std::shared_ptr<void> hold;
+	};
+
+	FrameExporter(std::string const &path, unsigned int credits, std::chrono::milliseconds hold_timeout,
+				  unsigned int max_clients);
+	~FrameExporter();
+
+	// Offer the frame to every client with a credit to spare. Returns the number it was sent to.
+	unsigned int Publish(Frame const &frame);
+	// Take back every frame that clients are holding, as when the camera is about to stop. The holds are
+	// returned rather than dropped so that the caller can choose when the requests go back to the camera.
+	std::vector<std::shared_ptr<void>> RevokeAll();
+	// So that callers can skip building frames that nobody would be sent.
+	bool HasClients();
+
+private:
+	struct Held
+	{
+		std::shared_ptr<void> hold;
+		std::chrono::steady_clock::time_point sent;
+	};
+	struct Client
+	{
+		int fd;
+		std::map<uint64_t, Held> held;
+		bool dead = false;
+		uint64_t missed = 0;
+		// What the client has asked for.
+		int64_t interval_us = 0;
+		int64_t last_sent_us = -1;
+		bool metadata_only = false;
+	};
+
+	using Released = std::vector<std::shared_ptr<void>>;
+
+	void serverThread();
+	void handleMessage(Client &client, std::string const &message, Released &released);
+	void revokeExpired(Released &released);
+	void release(Client &client, uint64_t id, Released &released);
+	void revoke(Client &client, uint64_t id, Released &released);
+	static bool sendMessage(int fd, std::string const &message, int pass_fd = -1);
+
+	std::string path_;
+	unsigned int credits_;
+	std::chrono::milliseconds hold_timeout_;
+	unsigned int max_clients_;
+	int fd_;
+	std::mutex mutex_;
+	std::vector<std::unique_ptr<Client>> clients_;
+	uint64_t next_id_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+};
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_trace.cpp - Per-frame latency tracing with Chrome trace export.
+ */
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <stdexcept>
+
+#include "core/frame_trace.hpp"
+#include "core/logging.hpp"
+
+FrameTrace &FrameTrace::Get()
+{
+	static FrameTrace trace;
+	return trace;
+}
+
+bool FrameTrace::Start(std::string const &filename, std::size_t capacity)
+{
+	if (Enabled())
+		return false;
+
+	filename_ = filename;
+	events_.assign(capacity, Event {});
+	next_ = 0;
+	enabled_.store(true, std::memory_order_release);
+	LOG(2, "Frame tracing started, writing to " << filename_);
+	return true;
+}
+
+void FrameTrace::Stop()
+{
+	if (!Enabled())
+		return;
+
+	enabled_.store(false, std::memory_order_release);
+	write();
+	events_.clear();
+}
+
+void FrameTrace::Record(char const *name, char const *category, int64_t sequence, int64_t pts_us,
+						uint64_t start_ns, uint64_t end_ns, PerfSample const *perf)
+{
+	if (!Enabled())
+		return;
+
+	static thread_local uint32_t tid = syscall(SYS_gettid);
+	// Claiming a slot is the only synchronisation. Once the ring wraps, the oldest events are lost.
+	uint64_t index = next_.fetch_add(1, std::memory_order_relaxed);
+	events_[index % events_.size()] = { name, category, sequence, pts_us, start_ns, end_ns, tid, perf != nullptr,
+										perf ? *perf : PerfSample {} };
+}
+
+void FrameTrace::write()
+{
+	FILE *fp = fopen(filename_.c_str(), "w");
+	if (!fp)
+		throw std::runtime_error("failed to open trace file " + filename_);
+
+	uint64_t count = next_.load(std::memory_order_acquire);
+	uint64_t first = count > events_.size() ? count - events_.size() : 0;
+	int pid = getpid();
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for (uint64_t i = first; i < count; i++)
+	{
+		Event const &e = events_[i % events_.size()];
+		fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"pid\":%d,\"tid\":%" PRIu32 ",\"ts\":%.3f,", i == first ? "" : ",\n",
+				e.name, e.category, pid, e.tid, e.start_ns / 1000.0);
+		if (e.end_ns > e.start_ns)
+			fprintf(fp, "\"ph\":\"X\",\"dur\":%.3f,", (e.end_ns - e.start_ns) / 1000.0);
+		else
+			fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",");
+		fprintf(fp, "\"args\":{");
+		char const *sep = "";
+		if (e.sequence != NO_ID)
+		{
+			fprintf(fp, "\"sequence\":%" PRId64, e.sequence);
+			sep = ",";
+		}
+		if (e.pts_us != NO_ID)
+		{
+			fprintf(fp, "%s\"pts\":%" PRId64, sep, e.pts_us);
+			sep = ",";
+		}
+		if (e.has_perf)
+			fprintf(fp,
+					"%s\"cycles\":%" PRIu64 ",\"instructions\":%" PRIu64 ",\"cache_misses\":%" PRIu64
+					",\"context_switches\":%" PRIu64,
+					sep, e.perf.cycles, e.perf.instructions, e.perf.cache_misses, e.perf.context_switches);
+		fprintf(fp, "}}");
+	}
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+
+	LOG(1, "Wrote " << count - first << " trace events to " << filename_
+					<< (first ? " (" + std::to_string(first) + " older events were overwritten)" : ""));
+}
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_trace.hpp - Per-frame latency tracing with Chrome trace export.
+ */
+
+#pragma once
+
+#include <time.h>
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "core/perf_counters.hpp"
+
+/*
+ * Records timed events against individual frames into a fixed-size ring, overwriting the
+ * oldest events once it fills. The ring is written out as Chrome trace JSON (which Perfetto
+ * can also open) when tracing finishes. Events are identified by the request sequence number
+ * and/or the frame timestamp in microseconds, so that the stages which only see one of these
+ * can still be tied together. Event names must be string literals or otherwise outlive the trace.
+ * Spans may carry the performance counter deltas over them, which appear among the event's args.
+ */
+class FrameTrace
+{
+public:
+	static constexpr int64_t NO_ID = -1;
+
+	static FrameTrace &Get();
+
+	// Timestamps are in nanoseconds on the same clock as the libcamera SensorTimestamp.
+	static uint64_t Now()
+	{
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+
+	// Returns false if tracing was already running, in which case whoever started it stops it.
+	bool Start(std::string const &filename, std::size_t capacity = 65536);
+	void Stop();
+	bool Enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+	// A span from start_ns to end_ns, or an instant event when the two are equal.
+	void Record(char const *name, char const *category, int64_t sequence, int64_t pts_us, uint64_t start_ns,
+				uint64_t end_ns, PerfSample const *perf = nullptr);
+	void Record(char const *name, char const *category, int64_t sequence, int64_t pts_us)
+	{
+		uint64_t now = Now();
+		Record(name, category, sequence, pts_us, now, now);
+	}
+
+private:
+	struct Event
+	{
+		char const *name;
+		char const *category;
+		int64_t sequence;
+		int64_t pts_us;
+		uint64_t start_ns;
+		uint64_t end_ns;
+		uint32_t tid;
+		bool has_perf;
+		PerfSample perf;
+	};
+
+	FrameTrace() : enabled_(false), next_(0) {}
+	void write();
+
+	std::atomic<bool> enabled_;
+	std::atomic<uint64_t> next_;
+	std::vector<Event> events_;
+	std::string filename_;
+};
+
+// Records a span covering the lifetime of the object, when tracing is enabled. When the performance
+// counters are enabled too, the span carries the calling thread's counts over it, which are also added
+// to any totals given.
+class FrameTraceScope
+{
+public:
+	FrameTraceScope(char const *name, char const *category, int64_t sequence, int64_t pts_us = FrameTrace::NO_ID,
+					PerfTotals *totals = nullptr)
+		: name_(name), category_(category), sequence_(sequence), pts_us_(pts_us), totals_(totals),
+		  start_ns_(FrameTrace::Get().Enabled() ? FrameTrace::Now() : 0),
+		  counting_(PerfCounters::Enabled() && (start_ns_ || totals_))
+	{
+		if (counting_)
+			start_perf_ = PerfCounters::Read();
+	}
+	~FrameTraceScope()
+	{
+		PerfSample perf;
+		if (counting_)
+		{
+			perf = PerfCounters::Read() - start_perf_;
+			if (totals_)
+				totals_->Add(perf);
+		}
+		if (start_ns_)
+			FrameTrace::Get().Record(name_, category_, sequence_, pts_us_, start_ns_, FrameTrace::Now(),
+									 counting_ ? &perf : nullptr);
+	}
+
+private:
+	char const *name_;
+	char const *category_;
+	int64_t sequence_;
+	int64_t pts_us_;
+	PerfTotals *totals_;
+	uint64_t start_ns_;
+	bool counting_;
+	PerfSample start_perf_;
+};
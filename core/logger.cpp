@@ -0,0 +1,257 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * logger.cpp - Hand log messages to a background thread rather than write them on the caller's.
+ */
+
+#include <errno.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/frame_trace.hpp"
+#include "core/logger.hpp"
+#include "core/thread_config.hpp"
+
+std::atomic<bool> Logger::async_ = false;
+
+// How long the drain thread sleeps when nobody wakes it. Only errors, and a filling ring, wake it sooner.
+static constexpr std::chrono::milliseconds DRAIN_INTERVAL(20);
+static constexpr std::chrono::seconds REPEAT_INTERVAL(1);
+
+Logger &Logger::Get()
+{
+	static Logger logger;
+	return logger;
+}
+
+Logger::~Logger()
+{
+	Stop();
+}
+
+void Logger::Start(std::string const &sink, std::size_t capacity)
+{
+	if (Async())
+		return;
+
+	if (sink == "stderr")
+		sink_ = Sink::Stderr;
+	else if (sink == "syslog")
+	{
+		sink_ = Sink::Syslog;
+		openlog(program_invocation_short_name, LOG_PID, LOG_USER);
+	}
+	else if (sink.rfind("binary:", 0) == 0)
+	{
+		std::string filename = sink.substr(7);
+		file_ = fopen(filename.c_str(), "wb");
+		if (!file_)
+			throw std::runtime_error("Logger: failed to open " + filename);
+		sink_ = Sink::Binary;
+		fwrite(BINARY_MAGIC, sizeof(BINARY_MAGIC), 1, file_);
+	}
+	else
+		throw std::runtime_error("Logger: unrecognised log sink " + sink);
+
+	std::size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	slots_ = std::make_unique<Slot[]>(size);
+	for (std::size_t i = 0; i < size; i++)
+		slots_[i].sequence.store(i, std::memory_order_relaxed);
+	mask_ = size - 1;
+	head_ = tail_ = 0;
+	abort_ = false;
+
+	thread_ = std::thread(&Logger::drainThread, this);
+	async_.store(true, std::memory_order_release);
+}
+
+void Logger::Stop()
+{
+	if (!Async())
+		return;
+
+	async_.store(false, std::memory_order_release);
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_one();
+	thread_.join();
+	// Catch anything from a thread that saw us running just before we stopped.
+	drain();
+	flushRepeats(true);
+	flushSink();
+
+	if (sink_ == Sink::Syslog)
+		closelog();
+	else if (file_)
+	{
+		fclose(file_);
+		file_ = nullptr;
+	}
+}
+
+void Logger::Write(unsigned int level, std::string &&text)
+{
+	static thread_local uint32_t tid = syscall(SYS_gettid);
+	uint64_t now = FrameTrace::Now();
+
+	// The usual bounded multi-producer ring, where each slot's sequence number says whether it's free
+	// to be written (equal to the position claiming it) or ready to be read (one more than that).
+	std::size_t pos = head_.load(std::memory_order_relaxed);
+	Slot *slot;
+	while (true)
+	{
+		slot = &slots_[pos & mask_];
+		std::size_t sequence = slot->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+		if (diff == 0)
+		{
+			if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (diff < 0)
+		{
+			dropped_.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		else
+			pos = head_.load(std::memory_order_relaxed);
+	}
+
+	slot->timestamp_ns = now;
+	slot->tid = tid;
+	slot->level = level;
+	slot->text = std::move(text);
+	slot->sequence.store(pos + 1, std::memory_order_release);
+
+	// Waking the drain thread costs a syscall, so leave it to its timer unless this can't wait.
+	if (level == 0 || pos + 1 - tail_.load(std::memory_order_relaxed) > (mask_ + 1) / 2)
+		cond_.notify_one();
+}
+
+void Logger::drainThread()
+{
+	ThreadConfig::Get().Apply("log");
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!abort_)
+	{
+		lock.unlock();
+		if (drain())
+			flushSink();
+		flushRepeats(false);
+		lock.lock();
+		cond_.wait_for(lock, DRAIN_INTERVAL);
+	}
+}
+
+bool Logger::drain()
+{
+	bool any = false;
+	while (true)
+	{
+		std::size_t tail = tail_.load(std::memory_order_relaxed);
+		Slot &slot = slots_[tail & mask_];
+		if (slot.sequence.load(std::memory_order_acquire) != tail + 1)
+			break;
+
+		if (slot.text == last_text_ && slot.level == last_level_)
+			repeats_++;
+		else
+		{
+			flushRepeats(true);
+			emit(slot.timestamp_ns, slot.tid, slot.level, slot.text);
+			last_text_.swap(slot.text);
+			last_level_ = slot.level;
+			last_tid_ = slot.tid;
+			repeats_since_ = std::chrono::steady_clock::now();
+		}
+		slot.text.clear();
+		slot.sequence.store(tail + mask_ + 1, std::memory_order_release);
+		tail_.store(tail + 1, std::memory_order_relaxed);
+		any = true;
+	}
+
+	uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+	if (dropped != dropped_reported_)
+	{
+		emit(FrameTrace::Now(), 0, 0,
+			 "WARNING: " + std::to_string(dropped - dropped_reported_) + " log messages dropped");
+		dropped_reported_ = dropped;
+		any = true;
+	}
+	return any;
+}
+
+void Logger::flushRepeats(bool force)
+{
+	if (!repeats_ || (!force && std::chrono::steady_clock::now() - repeats_since_ < REPEAT_INTERVAL))
+		return;
+	emit(FrameTrace::Now(), last_tid_, last_level_, "(last message repeated " + std::to_string(repeats_) + " times)");
+	repeats_ = 0;
+	repeats_since_ = std::chrono::steady_clock::now();
+	flushSink();
+}
+
+void Logger::emit(uint64_t timestamp_ns, uint32_t tid, unsigned int level, std::string const &text)
+{
+	if (sink_ == Sink::Stderr)
+	{
+		char prefix[48];
+		snprintf(prefix, sizeof(prefix), "[%" PRIu64 ".%06" PRIu64 "] [%" PRIu32 "] ", timestamp_ns / 1000000000,
+				 (timestamp_ns / 1000) % 1000000, tid);
+		out_ += prefix;
+		out_ += text;
+		out_ += '\n';
+	}
+	else if (sink_ == Sink::Syslog)
+	{
+		int priority = LOG_INFO;
+		if (level == 0)
+		{
+			// LOG_ERROR is used for warnings too, which say so at the start.
+			std::size_t start = text.find_first_not_of("\n ");
+			bool warning = start != std::string::npos && text.compare(start, 7, "WARNING") == 0;
+			priority = warning ? LOG_WARNING : LOG_ERR;
+		}
+		else if (level >= 2)
+			priority = LOG_DEBUG;
+		syslog(priority, "%s", text.c_str());
+	}
+	else
+	{
+		Record record = { timestamp_ns, tid, (uint16_t)level, (uint16_t)std::min<std::size_t>(text.size(), UINT16_MAX) };
+		fwrite(&record, sizeof(record), 1, file_);
+		fwrite(text.data(), record.length, 1, file_);
+	}
+}
+
+void Logger::flushSink()
+{
+	if (sink_ == Sink::Stderr)
+	{
+		// One write for the whole batch, which is rather the point.
+		std::size_t done = 0;
+		while (done < out_.size())
+		{
+			ssize_t ret = write(STDERR_FILENO, out_.data() + done, out_.size() - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				break;
+			done += ret;
+		}
+		out_.clear();
+	}
+	else if (sink_ == Sink::Binary)
+		fflush(file_);
+}
@@ -0,0 +1,104 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * logger.hpp - Hand log messages to a background thread rather than write them on the caller's.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/*
+ * The LOG macros normally write straight to stderr. Once the Logger is started, they instead put each
+ * message into a bounded lock-free ring, which a background thread empties into the chosen sink, so that
+ * a thread logging every frame never waits on a write. The sinks are:
+ *   stderr         each line preceded by its time (on the FrameTrace clock) and the thread id
+ *   syslog         at LOG_ERR or LOG_WARNING for LOG_ERROR, and LOG_INFO or LOG_DEBUG for the rest
+ *   binary:<file>  a Record for each message followed by its text, for decoding offline
+ * A message repeated over and over is written once, and then a count of the repeats at most once a
+ * second. Should the ring fill, messages are dropped and counted rather than wait for space.
+ */
+class Logger
+{
+public:
+	// Each binary log starts with this, then has a Record and the text for every message.
+	static constexpr char BINARY_MAGIC[8] = { 'R', 'P', 'C', 'L', 'O', 'G', '0', '1' };
+	struct Record
+	{
+		uint64_t timestamp_ns;
+		uint32_t tid;
+		uint16_t level; // 0 for LOG_ERROR
+		uint16_t length;
+	};
+
+	static Logger &Get();
+	static bool Async() { return async_.load(std::memory_order_relaxed); }
+
+	// Throws std::runtime_error if the sink is not recognised or cannot be opened.
+	void Start(std::string const &sink, std::size_t capacity = 4096);
+	// Write out whatever is still queued, and go back to writing to stderr directly.
+	void Stop();
+
+	// May be called from any thread.
+	void Write(unsigned int level, std::string &&text);
+
+private:
+	enum class Sink
+	{
+		Stderr,
+		Syslog,
+		Binary
+	};
+
+	struct Slot
+	{
+		std::atomic<std::size_t> sequence;
+		uint64_t timestamp_ns;
+		uint32_t tid;
+		unsigned int level;
+		std::string text;
+	};
+
+	Logger() = default;
+	~Logger();
+
+	void drainThread();
+	// Write out everything in the ring, returning false if there was nothing.
+	bool drain();
+	void flushRepeats(bool force);
+	void emit(uint64_t timestamp_ns, uint32_t tid, unsigned int level, std::string const &text);
+	void flushSink();
+
+	static std::atomic<bool> async_;
+
+	Sink sink_ = Sink::Stderr;
+	FILE *file_ = nullptr;
+	std::unique_ptr<Slot[]> slots_;
+	std::size_t mask_ = 0;
+	alignas(64) std::atomic<std::size_t> head_ = 0; // claimed by the producers
+	alignas(64) std::atomic<std::size_t> tail_ = 0; // only advanced by the drain thread
+	std::atomic<uint64_t> dropped_ = 0;
+	uint64_t dropped_reported_ = 0;
+
+	// Only touched by the drain thread.
+	std::string out_;
+	std::string last_text_;
+	unsigned int last_level_ = 0;
+	uint32_t last_tid_ = 0;
+	uint64_t repeats_ = 0;
+	std::chrono::steady_clock::time_point repeats_since_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	bool abort_ = false;
+	std::thread thread_;
+};
@@ -1,9 +1,27 @@
+#include <iostream>
+#include <sstream>
+
+#include "core/logger.hpp"
 #include "core/rpicam_app.hpp"
 
+// Once the Logger is started (with --log-sink), messages go to its background thread instead.
+#define LOG_WRITE(level, text)                                                                                         \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		if (Logger::Async())                                                                                           \
+		{                                                                                                              \
+			std::ostringstream log_stream_;                                                                            \
+			log_stream_ << text;                                                                                       \
+			Logger::Get().Write(level, log_stream_.str());                                                             \
+		}                                                                                                              \
+		else                                                                                                           \
+			std::cerr << text << std::endl;                                                                            \
+	} while (0)
+
 #define LOG(level, text)                                                                                               \
 	do                                                                                                                 \
 	{                                                                                                                  \
 		if (RPiCamApp::GetVerbosity() >= level)                                                                     \
-			std::cerr << text << std::endl;                                                                            \
+			LOG_WRITE(level, text);                                                                                    \
 	} while (0)
-#define LOG_ERROR(text) std::cerr << text << std::endl
+#define LOG_ERROR(text) LOG_WRITE(0, text)
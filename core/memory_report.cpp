@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * memory_report.cpp - Itemise the big allocations made by each part of the pipeline.
+ */
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "core/memory_report.hpp"
+
+MemoryReport &MemoryReport::Get()
+{
+	static MemoryReport report;
+	return report;
+}
+
+void MemoryReport::update(Use &use, Kind kind, std::size_t bytes)
+{
+	Use &total = totals_[kind == Kind::Dma ? 0 : 1];
+	total.current = total.current - use.current + bytes;
+	total.peak = std::max(total.peak, total.current);
+	use.current = bytes;
+	use.peak = std::max(use.peak, use.current);
+}
+
+void MemoryReport::Add(std::string const &subsystem, Kind kind, std::size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Use &use = uses_[{ subsystem, kind }];
+	update(use, kind, use.current + bytes);
+}
+
+void MemoryReport::Remove(std::string const &subsystem, Kind kind, std::size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	Use &use = uses_[{ subsystem, kind }];
+	update(use, kind, use.current - std::min(use.current, bytes));
+}
+
+void MemoryReport::Set(std::string const &subsystem, Kind kind, std::size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	update(uses_[{ subsystem, kind }], kind, bytes);
+}
+
+std::size_t MemoryReport::Total(Kind kind) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	return totals_[kind == Kind::Dma ? 0 : 1].current;
+}
+
+static std::string megabytes(std::size_t bytes)
+{
+	std::ostringstream os;
+	os << std::fixed << std::setprecision(1) << bytes / (1024.0 * 1024.0) << "MB";
+	return os.str();
+}
+
+void MemoryReport::Write(std::ostream &os, char const *when) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	os << "Memory use " << when << " (now / peak):" << std::endl;
+	for (unsigned int k = 0; k < 2; k++)
+	{
+		Kind kind = k == 0 ? Kind::Dma : Kind::Heap;
+		os << "  " << (kind == Kind::Dma ? "dma-heap" : "heap") << std::endl;
+		for (auto const &[key, use] : uses_)
+		{
+			if (key.second == kind && use.peak)
+				os << "    " << std::left << std::setw(24) << key.first << std::right << std::setw(10)
+				   << megabytes(use.current) << " / " << megabytes(use.peak) << std::endl;
+		}
+		os << "    " << std::left << std::setw(24) << "total" << std::right << std::setw(10)
+		   << megabytes(totals_[k].current) << " / " << megabytes(totals_[k].peak) << std::endl;
+	}
+}
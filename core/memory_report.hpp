@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * memory_report.hpp - Itemise the big allocations made by each part of the pipeline.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <utility>
+
+/*
+ * The capture buffers, encoders, outputs and post-processing stages tell the MemoryReport how
+ * much they are holding, split into dma-heap (CMA) memory and ordinary heap memory. Only the
+ * large allocations (whole images, rings and the like) are counted. The report keeps what each
+ * one holds now and the most it has held, so that --memory-report can show where the memory went
+ * both once the camera is configured and when the application finishes.
+ */
+class MemoryReport
+{
+public:
+	enum class Kind
+	{
+		Dma,
+		Heap,
+	};
+
+	static MemoryReport &Get();
+
+	void Add(std::string const &subsystem, Kind kind, std::size_t bytes);
+	void Remove(std::string const &subsystem, Kind kind, std::size_t bytes);
+	// Replace whatever the subsystem holds with this amount.
+	void Set(std::string const &subsystem, Kind kind, std::size_t bytes);
+
+	std::size_t Total(Kind kind) const;
+	// Write out the current and peak use of everything, and the totals.
+	void Write(std::ostream &os, char const *when) const;
+
+private:
+	struct Use
+	{
+		std::size_t current = 0;
+		std::size_t peak = 0;
+	};
+
+	MemoryReport() = default;
+	void update(Use &use, Kind kind, std::size_t bytes);
+
+	mutable std::mutex mutex_;
+	std::map<std::pair<std::string, Kind>, Use> uses_;
+	Use totals_[2];
+};
+
+// Counts some memory against a subsystem in the report for as long as it exists.
+class MemoryUse
+{
+public:
+	MemoryUse() = default;
+	MemoryUse(char const *subsystem, MemoryReport::Kind kind, std::size_t bytes)
+		: subsystem_(subsystem), kind_(kind), bytes_(bytes)
+	{
+		MemoryReport::Get().Add(subsystem_, kind_, bytes_);
+	}
+	MemoryUse(MemoryUse &&other) { *this = std::move(other); }
+	MemoryUse &operator=(MemoryUse &&other)
+	{
+		if (this != &other)
+		{
+			reset();
+			subsystem_ = other.subsystem_;
+			kind_ = other.kind_;
+			bytes_ = std::exchange(other.bytes_, 0);
+		}
+		return *this;
+	}
+	MemoryUse(MemoryUse const &) = delete;
+	MemoryUse &operator=(MemoryUse const &) = delete;
+	~MemoryUse() { reset(); }
+
+	void reset()
+	{
+		if (bytes_)
+			MemoryReport::Get().Remove(subsystem_, kind_, bytes_);
+		bytes_ = 0;
+	}
+
+private:
+	char const *subsystem_ = nullptr;
+	MemoryReport::Kind kind_ = MemoryReport::Kind::Heap;
+	std::size_t bytes_ = 0;
+};
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * metadata.cpp - metadata tag interning
+ */
+
+#include <map>
+#include <shared_mutex>
+
+#include "core/metadata.hpp"
+
+unsigned int MetadataTag::intern(std::string_view name)
+{
+	// Tags are only ever added, so nearly every lookup takes the shared lock. The transparent
+	// comparator lets us search with the string_view without making a std::string.
+	static std::shared_mutex mutex;
+	static std::map<std::string, unsigned int, std::less<>> tags;
+
+	{
+		std::shared_lock lock(mutex);
+		auto it = tags.find(name);
+		if (it != tags.end())
+			return it->second;
+	}
+
+	std::unique_lock lock(mutex);
+	auto [it, inserted] = tags.try_emplace(std::string(name), tags.size());
+	return it->second;
+}
@@ -9,89 +9,308 @@
 // A simple class for carrying arbitrary metadata, for example about an image.
 
 #include <any>
-#include <map>
+#include <array>
+#include <cstddef>
 #include <mutex>
+#include <new>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+// A metadata tag name interned to a small integer. Stages that set or read the same tag on every
+// frame can hold one of these to skip looking the name up each time, for example
+//   static const MetadataTag results_tag("object_detect.results");
+class MetadataTag
+{
+public:
+	explicit MetadataTag(std::string_view name) : id_(intern(name)) {}
+	unsigned int Id() const { return id_; }
+
+private:
+	static unsigned int intern(std::string_view name);
+	unsigned int id_;
+};
+
+// Holds a single value of any copyable type. Values small enough are stored inline so that
+// setting them does not touch the allocator.
+class MetadataValue
+{
+public:
+	MetadataValue() : ops_(nullptr) {}
+
+	template <typename T, typename V = std::decay_t<T>,
+			  std::enable_if_t<!std::is_same_v<V, MetadataValue>, int> = 0>
+	explicit MetadataValue(T &&value) : ops_(nullptr)
+	{
+		Emplace(std::forward<T>(value));
+	}
+
+	MetadataValue(MetadataValue const &other) : ops_(nullptr) { *this = other; }
+	MetadataValue(MetadataValue &&other) : ops_(nullptr) { *this = std::move(other); }
+	~MetadataValue() { Reset(); }
+
+	MetadataValue &operator=(MetadataValue const &other)
+	{
+		if (this != &other)
+		{
+			Reset();
+			if (other.ops_)
+				other.ops_->copy(*this, other);
+			ops_ = other.ops_;
+		}
+		return *this;
+	}
+
+	MetadataValue &operator=(MetadataValue &&other)
+	{
+		if (this != &other)
+		{
+			Reset();
+			if (other.ops_)
+				other.ops_->move(*this, other);
+			ops_ = other.ops_;
+			other.ops_ = nullptr;
+		}
+		return *this;
+	}
+
+	// Re-uses the existing value when it already has this type.
+	template <typename T>
+	void Emplace(T &&value)
+	{
+		using V = std::decay_t<T>;
+		if (V *current = As<V>())
+		{
+			*current = std::forward<T>(value);
+			return;
+		}
+		Reset();
+		Handler<V>::create(*this, std::forward<T>(value));
+		ops_ = &Handler<V>::ops;
+	}
+
+	// Returns nullptr if the value is empty or holds a different type.
+	template <typename T>
+	T *As()
+	{
+		if (!ops_ || *ops_->type != typeid(T))
+			return nullptr;
+		return Handler<T>::get(*this);
+	}
+
+	template <typename T>
+	T const *As() const
+	{
+		return const_cast<MetadataValue *>(this)->As<T>();
+	}
+
+	bool HasValue() const { return ops_ != nullptr; }
+
+	void Reset()
+	{
+		if (ops_)
+			ops_->destroy(*this);
+		ops_ = nullptr;
+	}
+
+private:
+	static constexpr std::size_t InlineSize = 48;
+
+	struct Ops
+	{
+		std::type_info const *type;
+		void (*copy)(MetadataValue &dst, MetadataValue const &src);
+		void (*move)(MetadataValue &dst, MetadataValue &src);
+		void (*destroy)(MetadataValue &value);
+	};
+
+	template <typename V>
+	struct Handler
+	{
+		static constexpr bool Inline = sizeof(V) <= InlineSize && alignof(V) <= alignof(std::max_align_t) &&
+									   std::is_nothrow_move_constructible_v<V>;
+
+		static V *get(MetadataValue &v)
+		{
+			if constexpr (Inline)
+				return std::launder(reinterpret_cast<V *>(v.buf_));
+			else
+				return static_cast<V *>(v.heap_);
+		}
+
+		template <typename... Args>
+		static void create(MetadataValue &v, Args &&...args)
+		{
+			if constexpr (Inline)
+				new (v.buf_) V(std::forward<Args>(args)...);
+			else
+				v.heap_ = new V(std::forward<Args>(args)...);
+		}
+
+		static void copy(MetadataValue &dst, MetadataValue const &src)
+		{
+			create(dst, *get(const_cast<MetadataValue &>(src)));
+		}
+
+		static void move(MetadataValue &dst, MetadataValue &src)
+		{
+			if constexpr (Inline)
+			{
+				create(dst, std::move(*get(src)));
+				get(src)->~V();
+			}
+			else
+				dst.heap_ = src.heap_;
+		}
+
+		static void destroy(MetadataValue &v)
+		{
+			if constexpr (Inline)
+				get(v)->~V();
+			else
+				delete get(v);
+		}
+
+		static inline const Ops ops = { &typeid(V), copy, move, destroy };
+	};
+
+	union
+	{
+		alignas(std::max_align_t) unsigned char buf_[InlineSize];
+		void *heap_;
+	};
+	Ops const *ops_;
+};
 
 class Metadata
 {
 public:
-	Metadata() = default;
+	Metadata() : size_(0) {}
 
-	Metadata(Metadata const &other)
+	Metadata(Metadata const &other) : size_(0)
 	{
 		std::scoped_lock other_lock(other.mutex_);
-		data_ = other.data_;
+		copyFrom(other);
 	}
 
-	Metadata(Metadata &&other)
+	Metadata(Metadata &&other) : size_(0)
 	{
 		std::scoped_lock other_lock(other.mutex_);
-		data_ = std::move(other.data_);
-		other.data_.clear();
+		moveFrom(other);
 	}
 
 	template <typename T>
-	void Set(std::string const &tag, T &&value)
+	void Set(MetadataTag tag, T &&value)
 	{
 		std::scoped_lock lock(mutex_);
-		data_.insert_or_assign(tag, std::forward<T>(value));
+		SetLocked(tag, std::forward<T>(value));
+	}
+
+	template <typename T>
+	void Set(std::string_view tag, T &&value)
+	{
+		Set(MetadataTag(tag), std::forward<T>(value));
 	}
 
 	template <typename T>
-	int Get(std::string const &tag, T &value) const
+	int Get(MetadataTag tag, T &value) const
 	{
 		std::scoped_lock lock(mutex_);
-		auto it = data_.find(tag);
-		if (it == data_.end())
+		Entry const *entry = find(tag.Id());
+		if (!entry)
 			return -1;
-		value = std::any_cast<T>(it->second);
+		T const *v = entry->value.As<T>();
+		if (!v)
+			throw std::bad_any_cast();
+		value = *v;
 		return 0;
 	}
 
+	template <typename T>
+	int Get(std::string_view tag, T &value) const
+	{
+		return Get(MetadataTag(tag), value);
+	}
+
 	void Clear()
 	{
 		std::scoped_lock lock(mutex_);
-		data_.clear();
+		truncate(0);
 	}
 
 	Metadata &operator=(Metadata const &other)
 	{
 		std::scoped_lock lock(mutex_, other.mutex_);
-		data_ = other.data_;
+		truncate(0);
+		copyFrom(other);
 		return *this;
 	}
 
 	Metadata &operator=(Metadata &&other)
 	{
 		std::scoped_lock lock(mutex_, other.mutex_);
-		data_ = std::move(other.data_);
-		other.data_.clear();
+		truncate(0);
+		moveFrom(other);
 		return *this;
 	}
 
+	// As with std::map::merge, entries whose tags we already have are left behind in other.
 	void Merge(Metadata &other)
 	{
 		std::scoped_lock lock(mutex_, other.mutex_);
-		data_.merge(other.data_);
+		unsigned int kept = 0;
+		for (unsigned int i = 0; i < other.size_; i++)
+		{
+			Entry &entry = other.at(i);
+			if (find(entry.tag))
+			{
+				if (kept != i)
+				{
+					other.at(kept).tag = entry.tag;
+					other.at(kept).value = std::move(entry.value);
+				}
+				kept++;
+			}
+			else
+				append(entry.tag).value = std::move(entry.value);
+		}
+		other.truncate(kept);
 	}
 
 	template <typename T>
-	T *GetLocked(std::string const &tag)
+	T *GetLocked(MetadataTag tag)
 	{
 		// This allows in-place access to the Metadata contents,
 		// for which you should be holding the lock.
-		auto it = data_.find(tag);
-		if (it == data_.end())
+		Entry *entry = find(tag.Id());
+		if (!entry)
 			return nullptr;
-		return std::any_cast<T>(&it->second);
+		return entry->value.As<T>();
 	}
 
 	template <typename T>
-	void SetLocked(std::string const &tag, T &&value)
+	T *GetLocked(std::string_view tag)
+	{
+		return GetLocked<T>(MetadataTag(tag));
+	}
+
+	template <typename T>
+	void SetLocked(MetadataTag tag, T &&value)
 	{
 		// Use this only if you're holding the lock yourself.
-		data_.insert_or_assign(tag, std::forward<T>(value));
+		Entry *entry = find(tag.Id());
+		if (!entry)
+			entry = &append(tag.Id());
+		entry->value.Emplace(std::forward<T>(value));
+	}
+
+	template <typename T>
+	void SetLocked(std::string_view tag, T &&value)
+	{
+		SetLocked(MetadataTag(tag), std::forward<T>(value));
 	}
 
 	// Note: use of (lowercase) lock and unlock means you can create scoped
@@ -101,6 +320,63 @@ public:
 	void unlock() { mutex_.unlock(); }
 
 private:
+	// The first few entries live in the object itself, which covers what the stages normally
+	// exchange per frame. Any beyond that spill into a vector.
+	static constexpr unsigned int InlineEntries = 8;
+
+	struct Entry
+	{
+		unsigned int tag;
+		MetadataValue value;
+	};
+
+	Entry &at(unsigned int i) { return i < InlineEntries ? inline_[i] : overflow_[i - InlineEntries]; }
+	Entry const &at(unsigned int i) const { return i < InlineEntries ? inline_[i] : overflow_[i - InlineEntries]; }
+
+	Entry *find(unsigned int tag)
+	{
+		for (unsigned int i = 0; i < size_; i++)
+		{
+			if (at(i).tag == tag)
+				return &at(i);
+		}
+		return nullptr;
+	}
+
+	Entry const *find(unsigned int tag) const { return const_cast<Metadata *>(this)->find(tag); }
+
+	Entry &append(unsigned int tag)
+	{
+		if (size_ >= InlineEntries)
+			overflow_.emplace_back();
+		Entry &entry = at(size_++);
+		entry.tag = tag;
+		return entry;
+	}
+
+	void truncate(unsigned int size)
+	{
+		for (unsigned int i = size; i < size_ && i < InlineEntries; i++)
+			inline_[i].value.Reset();
+		overflow_.resize(size > InlineEntries ? size - InlineEntries : 0);
+		size_ = size;
+	}
+
+	void copyFrom(Metadata const &other)
+	{
+		for (unsigned int i = 0; i < other.size_; i++)
+			append(other.at(i).tag).value = other.at(i).value;
+	}
+
+	void moveFrom(Metadata &other)
+	{
+		for (unsigned int i = 0; i < other.size_; i++)
+			append(other.at(i).tag).value = std::move(other.at(i).value);
+		other.truncate(0);
+	}
+
 	mutable std::mutex mutex_;
-	std::map<std::string, std::any> data_;
+	std::array<Entry, InlineEntries> inline_;
+	std::vector<Entry> overflow_;
+	unsigned int size_;
 };
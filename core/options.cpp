@@ -19,7 +19,9 @@
 #include <libcamera/logging.h>
 #include <libcamera/property_ids.h>
 
+#include "core/logger.hpp"
 #include "core/options.hpp"
+#include "core/thread_config.hpp"
 
 namespace fs = std::filesystem;
 
@@ -237,12 +239,51 @@ Options::Options()
 			"Set the file name for configuring the post-processing")
 		("post-process-libs", value<std::string>(&v_->post_process_libs),
 			"Set a custom location for the post-processing library .so files")
+		("scratch-hugepages", value<bool>(&v_->scratch_hugepages)->default_value(false)->implicit_value(true),
+			"Ask for transparent huge pages for the post-processing stages' large scratch buffers")
+		("post-process-threads", value<unsigned int>(&v_->post_process_threads)->default_value(0),
+			"Number of worker threads used to run the post-processing stages (0 = one per CPU core)")
+		("queue-policy", value<std::string>(&v_->queue_policy_)->default_value("block"),
+			"What to do when a frame queue reaches its maximum depth (see --queue-depth): "
+			"block, drop-oldest or drop-newest")
+		("queue-depth", value<unsigned int>(&v_->queue_depth)->default_value(0),
+			"Maximum number of frames waiting at each handoff point - the application, the post-processor "
+			"and the encoder (0 = unlimited)")
+		("trace-file", value<std::string>(&v_->trace_file),
+			"Record the time each frame spends at every point in the pipeline, and write this to the given "
+			"file as Chrome trace JSON")
+		("log-sink", value<std::string>(&v_->log_sink),
+			"Write log messages from a background thread, so that verbose logging doesn't hold up the threads "
+			"doing it. Either stderr (each line timestamped and with its thread id), syslog or binary:<file>")
+		("stats-socket", value<std::string>(&v_->stats_socket),
+			"Publish live statistics as JSON to any client that connects to this UNIX socket")
+		("perf-counters", value<bool>(&v_->perf_counters)->default_value(false)->implicit_value(true),
+			"Count cycles, instructions, cache misses and context switches in each post-processing stage, "
+			"encoder and output thread, for the --stats-socket and --trace-file")
+		("thread", value<std::vector<std::string>>(&v_->thread),
+			"Set the CPU affinity, scheduling policy or name of a class of threads, e.g. "
+			"encoder-output:cpus=2,3:fifo=50. May be given more than once. The classes are event, callback, "
+			"preview, post-process, post-output, encoder, encoder-poll, encoder-output, tee-output, file-writer, "
+			"audio and server, and the fields are cpus=<list>, fifo=<priority>, rr=<priority>, nice=<value> and name=<name>")
+		("no-mode-cache", value<bool>(&v_->no_mode_cache)->default_value(false)->implicit_value(true),
+			"Always enumerate the sensor modes, rather than using the list cached from an earlier run")
+		("startup-profile", value<bool>(&v_->startup_profile)->default_value(false)->implicit_value(true),
+			"Report how long each step of start-up took, up to the first frame")
 		("nopreview,n", value<bool>(&v_->nopreview)->default_value(false)->implicit_value(true),
 			"Do not show a preview window")
 		("preview,p", value<std::string>(&v_->preview)->default_value("0,0,0,0"),
 			"Set the preview window dimensions, given as x,y,width,height e.g. 0,0,640,480")
 		("fullscreen,f", value<bool>(&v_->fullscreen)->default_value(false)->implicit_value(true),
 			"Use a fullscreen preview window")
+		("preview-fps", value<float>(&v_->preview_fps)->default_value(0),
+			"Show at most this many frames per second in the preview window (0 shows them all)")
+		("preview-lores", value<bool>(&v_->preview_lores)->default_value(false)->implicit_value(true),
+			"Feed the preview window from the low resolution stream, when there is one")
+		("preview-overlay", value<bool>(&v_->preview_overlay)->default_value(false)->implicit_value(true),
+			"Draw object detection boxes over the preview window only, rather than into the camera images")
+		("perf-hud", value<bool>(&v_->perf_hud)->default_value(false)->implicit_value(true),
+			"Show the frame rate, latency, dropped frames, CPU and CMA usage and post-processing times once a "
+			"second, in the preview window title or on stderr when there is no window")
 		("qt-preview", value<bool>(&v_->qt_preview)->default_value(false)->implicit_value(true),
 			"Use Qt-based preview window (WARNING: causes heavy CPU load, fullscreen not supported)")
 		("preview-libs", value<std::string>(&v_->preview_libs)->default_value(""),
@@ -297,12 +338,30 @@ Options::Options()
 			"Height of low resolution frames (use 0 to omit low resolution stream)")
 		("lores-par", value<bool>(&v_->lores_par)->default_value(false)->implicit_value(true),
 			"Preserve the pixel aspect ratio of the low res image (where possible) by applying a different crop on the stream.")
+		("lores-roi", value<std::string>(&v_->lores_roi)->default_value("0,0,0,0"),
+			"Set a region of interest for the low res stream alone, like --roi, so that it shows a different part of "
+			"the same capture. Needs an ISP that crops each output separately (Pi 5)")
 		("mode", value<std::string>(&v_->mode_string),
 			"Camera mode as W:H:bit-depth:packing, where packing is P (packed) or U (unpacked)")
 		("viewfinder-mode", value<std::string>(&v_->viewfinder_mode_string),
 			"Camera mode for preview as W:H:bit-depth:packing, where packing is P (packed) or U (unpacked)")
 		("buffer-count", value<unsigned int>(&v_->buffer_count)->default_value(0), "Number of in-flight requests (and buffers) configured for video, raw, and still.")
 		("viewfinder-buffer-count", value<unsigned int>(&v_->viewfinder_buffer_count)->default_value(0), "Number of in-flight requests (and buffers) configured for preview window.")
+		("buffer-pool-size", value<unsigned int>(&v_->buffer_pool_size)->default_value(128),
+			"Maximum size (in MB) of released capture buffers kept for reuse across camera reconfigurations (0 = no pooling)")
+		("adaptive-buffers", value<bool>(&v_->adaptive_buffers)->default_value(false)->implicit_value(true),
+			"Add and retire requests (and buffers) while running, to match how many the application actually holds. "
+			"Retired buffers are only freed when the camera stops")
+		("adaptive-buffers-min", value<unsigned int>(&v_->adaptive_buffers_min)->default_value(3),
+			"Fewest requests that --adaptive-buffers will shrink to")
+		("adaptive-buffers-max", value<unsigned int>(&v_->adaptive_buffers_max)->default_value(12),
+			"Most requests that --adaptive-buffers will grow to")
+		("low-memory", value<bool>(&v_->low_memory)->default_value(false)->implicit_value(true),
+			"Use as few capture buffers as possible (unless a buffer count is given) and keep no released buffers for reuse")
+		("memory-budget", value<unsigned int>(&v_->memory_budget)->default_value(0),
+			"Refuse to allocate more than this many MB of capture buffers (0 = no limit)")
+		("memory-report", value<bool>(&v_->memory_report)->default_value(false)->implicit_value(true),
+			"Itemise the capture buffer and other large allocations once the camera is configured, and at exit")
 		("no-raw", value<bool>(&v_->no_raw)->default_value(false)->implicit_value(true),
 			"Disable requesting of a RAW stream. Will override any manual mode reqest the mode choice when setting framerate.")
 		("autofocus-mode", value<std::string>(&v_->afMode)->default_value("default"),
@@ -322,7 +381,8 @@ Options::Options()
 		("metadata", value<std::string>(&v_->metadata),
 			"Save captured image metadata to a file or \"-\" for stdout")
 		("metadata-format", value<std::string>(&v_->metadata_format)->default_value("json"),
-			"Format to save the metadata in, either txt or json (requires --metadata)")
+			"Format to save the metadata in, either txt, json or bin (requires --metadata). The bin format is "
+			"compact and indexed by frame, and utils/metadata_to_json.py converts it to JSON")
 		("flicker-period", value<std::string>(&v_->flicker_period_)->default_value("0s"),
 			"Manual flicker correction period"
 			"\nSet to 10000us to cancel 50Hz flicker."
@@ -373,6 +433,10 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 	if (nopreview && vm["info-text"].defaulted())
 		info_text = "";
 
+	// Released buffers are given straight back in the low memory profile, unless asked otherwise.
+	if (low_memory && vm["buffer-pool-size"].defaulted())
+		buffer_pool_size = 0;
+
 	// lens_position is even more awkward, because we have two "default"
 	// behaviours: Either no lens movement at all (if option is not given),
 	// or libcamera's default control value (typically the hyperfocal).
@@ -589,6 +653,10 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 
 	if (sscanf(roi.c_str(), "%f,%f,%f,%f", &roi_x, &roi_y, &roi_width, &roi_height) != 4)
 		roi_x = roi_y = roi_width = roi_height = 0; // don't set digital zoom
+	if (sscanf(lores_roi.c_str(), "%f,%f,%f,%f", &lores_roi_x, &lores_roi_y, &lores_roi_width, &lores_roi_height) != 4)
+		lores_roi_x = lores_roi_y = lores_roi_width = lores_roi_height = 0; // lores follows the main crop
+	if (lores_roi_width != 0 && lores_roi_height != 0 && lores_par)
+		throw std::runtime_error("lores-roi and lores-par cannot be used together");
 
 	if (sscanf(afWindow.c_str(), "%f,%f,%f,%f", &afWindow_x, &afWindow_y, &afWindow_width, &afWindow_height) != 4)
 		afWindow_x = afWindow_y = afWindow_width = afWindow_height = 0; // don't set auto focus windows
@@ -671,9 +739,23 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 		metadata_format = "json";
 	else if (strcasecmp(metadata_format.c_str(), "txt") == 0)
 		metadata_format = "txt";
+	else if (strcasecmp(metadata_format.c_str(), "bin") == 0)
+		metadata_format = "bin";
 	else
 		throw std::runtime_error("unrecognised metadata format " + metadata_format);
 
+	std::map<std::string, QueuePolicy> queue_policy_table =
+		{ { "block", QueuePolicy::Block },
+			{ "drop-oldest", QueuePolicy::DropOldest },
+			{ "drop-newest", QueuePolicy::DropNewest } };
+	if (queue_policy_table.count(queue_policy_) == 0)
+		throw std::runtime_error("Invalid queue policy: " + queue_policy_);
+	queue_policy = queue_policy_table[queue_policy_];
+
+	ThreadConfig::Get().Configure(thread);
+	if (!log_sink.empty())
+		Logger::Get().Start(log_sink);
+
 	mode = Mode(mode_string);
 	viewfinder_mode = Mode(viewfinder_mode_string);
 
@@ -693,6 +775,22 @@ void OptsInternal::Print() const
 	std::cerr << "    output: " << output << std::endl;
 	std::cerr << "    post_process_file: " << post_process_file << std::endl;
 	std::cerr << "    post_process_libs: " << post_process_libs << std::endl;
+	std::cerr << "    scratch-hugepages: " << scratch_hugepages << std::endl;
+	std::cerr << "    post_process_threads: " << post_process_threads << std::endl;
+	if (queue_depth)
+		std::cerr << "    queue: " << queue_policy_ << " at depth " << queue_depth << std::endl;
+	else
+		std::cerr << "    queue: unlimited" << std::endl;
+	if (!trace_file.empty())
+		std::cerr << "    trace_file: " << trace_file << std::endl;
+	if (!stats_socket.empty())
+		std::cerr << "    stats_socket: " << stats_socket << std::endl;
+	if (perf_counters)
+		std::cerr << "    perf_counters: yes" << std::endl;
+	if (!log_sink.empty())
+		std::cerr << "    log_sink: " << log_sink << std::endl;
+	for (auto const &t : thread)
+		std::cerr << "    thread: " << t << std::endl;
 	if (nopreview)
 		std::cerr << "    preview: none" << std::endl;
 	else if (fullscreen)
@@ -702,6 +800,11 @@ void OptsInternal::Print() const
 	else
 		std::cerr << "    preview: " << preview_x << "," << preview_y << "," << preview_width << ","
 					<< preview_height << std::endl;
+	if (preview_fps)
+		std::cerr << "    preview-fps: " << preview_fps << std::endl;
+	std::cerr << "    preview-lores: " << preview_lores << std::endl;
+	std::cerr << "    preview-overlay: " << preview_overlay << std::endl;
+	std::cerr << "    perf-hud: " << perf_hud << std::endl;
 	std::cerr << "    qt-preview: " << qt_preview << std::endl;
 	std::cerr << "    transform: " << transformToString(transform) << std::endl;
 	if (roi_width == 0 || roi_height == 0)
@@ -734,6 +837,9 @@ void OptsInternal::Print() const
 	std::cerr << "    lores-width: " << lores_width << std::endl;
 	std::cerr << "    lores-height: " << lores_height << std::endl;
 	std::cerr << "    lores-par: " << lores_par << std::endl;
+	if (lores_roi_width != 0 && lores_roi_height != 0)
+		std::cerr << "    lores-roi: " << lores_roi_x << "," << lores_roi_y << "," << lores_roi_width << ","
+				  << lores_roi_height << std::endl;
 	if (afMode_index != -1)
 		std::cerr << "    autofocus-mode: " << afMode << std::endl;
 	if (afRange_index != -1)
@@ -754,6 +860,13 @@ void OptsInternal::Print() const
 		std::cerr << "    buffer-count: " << buffer_count << std::endl;
 	if (viewfinder_buffer_count > 0)
 		std::cerr << "    viewfinder-buffer-count: " << viewfinder_buffer_count << std::endl;
+	std::cerr << "    buffer-pool-size: " << buffer_pool_size << "MB" << std::endl;
+	if (adaptive_buffers)
+		std::cerr << "    adaptive-buffers: " << adaptive_buffers_min << " to " << adaptive_buffers_max << std::endl;
+	std::cerr << "    low-memory: " << low_memory << std::endl;
+	if (memory_budget)
+		std::cerr << "    memory-budget: " << memory_budget << "MB" << std::endl;
+	std::cerr << "    memory-report: " << memory_report << std::endl;
 	std::cerr << "    metadata: " << metadata << std::endl;
 	std::cerr << "    metadata-format: " << metadata_format << std::endl;
 }
@@ -762,6 +875,7 @@ bool OptsInternal::ParseVideo()
 {
 	bitrate.set(bitrate_);
 	av_sync.set(av_sync_);
+	audio_period.set(audio_period_);
 	audio_bitrate.set(audio_bitrate_);
 	if (width == 0)
 		width = 640;
@@ -777,6 +891,51 @@ bool OptsInternal::ParseVideo()
 		codec = "mjpeg";
 	else
 		throw std::runtime_error("unrecognised codec " + codec);
+	if (adaptive_bitrate && !bitrate)
+		throw std::runtime_error("--adaptive-bitrate needs a --bitrate to adapt from");
+	if (!tee_output.empty() && codec == "libav")
+		throw std::runtime_error("--tee-output cannot be used with libav, which writes its own output");
+	// rpicam-server encodes the lores stream without needing a --lores-output.
+	lores_bitrate.set(lores_bitrate_);
+	if (strcasecmp(lores_codec.c_str(), "mjpeg") == 0)
+		lores_codec = "mjpeg";
+	else if (strcasecmp(lores_codec.c_str(), "h264") == 0)
+		lores_codec = "h264";
+	else if (strcasecmp(lores_codec.c_str(), "yuv420") == 0)
+		lores_codec = "yuv420";
+	else
+		throw std::runtime_error("unrecognised lores codec " + lores_codec);
+	if (!lores_output.empty() && (!lores_width || !lores_height))
+		throw std::runtime_error("--lores-output needs a lores stream, set with --lores-width and --lores-height");
+	if (!server_credits)
+		throw std::runtime_error("--server-credits must be at least 1");
+	if (region_quality < 0 || region_quality > 1)
+		throw std::runtime_error("--region-quality must be between 0 and 1");
+	idle_hold.set(idle_hold_);
+	clip_pre.set(clip_pre_);
+	clip_post.set(clip_post_);
+	if (strcasecmp(pts_format.c_str(), "v2") == 0)
+		pts_format = "v2";
+	else if (strcasecmp(pts_format.c_str(), "txt") == 0)
+		pts_format = "txt";
+	else if (strcasecmp(pts_format.c_str(), "bin") == 0)
+		pts_format = "bin";
+	else
+		throw std::runtime_error("unrecognised pts format " + pts_format);
+	if (mtu < 100)
+		throw std::runtime_error("--mtu must be at least 100");
+	if (!hls.empty() && !segment)
+		throw std::runtime_error("--hls needs a --segment duration");
+	if (!hls.empty() && output.empty())
+		throw std::runtime_error("--hls needs an --output pattern for the segment files");
+	if (!circular_file.empty() && !circular)
+		throw std::runtime_error("--circular-file needs a --circular buffer size");
+	if (!clip_output.empty() && !circular)
+		throw std::runtime_error("--clip-output needs a --circular buffer to save clips from");
+	if (!clip_trigger.empty() && clip_output.empty())
+		throw std::runtime_error("--clip-trigger needs a --clip-output to save clips to");
+	if (!idle_key.empty() && idle_framerate <= 0)
+		throw std::runtime_error("--idle-framerate must be more than 0");
 	if (strcasecmp(initial.c_str(), "pause") == 0)
 		pause = true;
 	else if (strcasecmp(initial.c_str(), "record") == 0)
@@ -818,14 +977,63 @@ void OptsInternal::PrintVideo() const
 	std::cerr << "    intra: " << intra << std::endl;
 	std::cerr << "    inline: " << inline_headers << std::endl;
 	std::cerr << "    save-pts: " << save_pts << std::endl;
+	if (!save_pts.empty())
+		std::cerr << "    pts-format: " << pts_format << std::endl;
 	std::cerr << "    codec: " << codec << std::endl;
 	std::cerr << "    quality (for MJPEG): " << quality << std::endl;
+	if (mjpeg_slices)
+		std::cerr << "    mjpeg-slices: " << mjpeg_slices << std::endl;
+	if (h264_slices)
+		std::cerr << "    h264-slices: " << h264_slices << std::endl;
+	if (mjpeg_optimise)
+		std::cerr << "    mjpeg-optimise: " << mjpeg_optimise << std::endl;
 	std::cerr << "    keypress: " << keypress << std::endl;
 	std::cerr << "    signal: " << signal << std::endl;
 	std::cerr << "    initial: " << initial << std::endl;
 	std::cerr << "    split: " << split << std::endl;
 	std::cerr << "    segment: " << segment << std::endl;
+	if (output.rfind("rtp://", 0) == 0 || output.rfind("rtsp://", 0) == 0)
+		std::cerr << "    mtu: " << mtu << std::endl;
+	if (!hls.empty())
+		std::cerr << "    hls: " << hls << " (list size " << hls_list_size << ")" << std::endl;
+	std::cerr << "    write-buffer: " << write_buffer << "MB" << (direct_io ? " (direct I/O)" : "") << std::endl;
 	std::cerr << "    circular: " << circular << std::endl;
+	if (!circular_file.empty())
+		std::cerr << "    circular-file: " << circular_file << std::endl;
+	if (!clip_output.empty())
+	{
+		std::cerr << "    clip-output: " << clip_output << std::endl;
+		std::cerr << "    clip-pre: " << clip_pre.get() << "ms" << std::endl;
+		std::cerr << "    clip-post: " << clip_post.get() << "ms" << std::endl;
+		if (!clip_trigger.empty())
+			std::cerr << "    clip-trigger: " << clip_trigger << std::endl;
+	}
+	if (!control_socket.empty())
+		std::cerr << "    control-socket: " << control_socket << std::endl;
+	std::cerr << "    server-dir: " << server_dir << std::endl;
+	std::cerr << "    server-credits: " << server_credits << std::endl;
+	if (raw_headers)
+		std::cerr << "    raw-headers: " << raw_headers << std::endl;
+	if (raw_write_behind)
+		std::cerr << "    raw-write-behind: " << raw_write_behind << (raw_index ? " (with index)" : "") << std::endl;
+	if (adaptive_bitrate)
+		std::cerr << "    adaptive-bitrate: " << adaptive_bitrate << std::endl;
+	for (auto const &t : tee_output)
+		std::cerr << "    tee-output: " << t << std::endl;
+	if (!lores_output.empty())
+	{
+		std::cerr << "    lores-output: " << lores_output << std::endl;
+		std::cerr << "    lores-codec: " << lores_codec << std::endl;
+		std::cerr << "    lores-bitrate: " << lores_bitrate.kbps() << "kbps" << std::endl;
+	}
+	if (region_quality)
+		std::cerr << "    region-quality: " << region_quality << std::endl;
+	if (!idle_key.empty())
+	{
+		std::cerr << "    idle-key: " << idle_key << std::endl;
+		std::cerr << "    idle-framerate: " << idle_framerate << std::endl;
+		std::cerr << "    idle-hold: " << idle_hold.get() << "ms" << std::endl;
+	}
 #ifndef DISABLE_RPI_FEATURES
 	std::cerr << "    sync: " << sync << std::endl;
 #endif
@@ -834,9 +1042,19 @@ void OptsInternal::PrintVideo() const
 bool OptsInternal::ParseStill()
 {
 	timelapse.set(timelapse_);
+	timelapse_warmup.set(timelapse_warmup_);
 
 	if ((keypress || signal) && timelapse)
 		throw std::runtime_error("keypress/signal and timelapse options are mutually exclusive");
+	if (timelapse_warmup && !timelapse)
+		throw std::runtime_error("timelapse-warmup needs a timelapse interval");
+	if (burst > 1)
+	{
+		if (datetime || timestamp || output.find('%') == std::string::npos)
+			throw std::runtime_error("--burst needs an --output with a frame counter, such as burst%04d.jpg");
+		// The whole burst has to fit in the save queue, or the camera would wait on the saves.
+		save_queue = std::max(save_queue, burst);
+	}
 	if (strcasecmp(thumb.c_str(), "none") == 0)
 		thumb_quality = 0;
 	else if (sscanf(thumb.c_str(), "%u:%u:%u", &thumb_width, &thumb_height, &thumb_quality) != 3)
@@ -855,6 +1073,21 @@ bool OptsInternal::ParseStill()
 		encoding = "bmp";
 	else
 		throw std::runtime_error("invalid encoding format " + encoding);
+	static const std::vector<std::string> png_filters = { "none", "sub", "up", "avg", "paeth", "adaptive" };
+	std::transform(png_filter.begin(), png_filter.end(), png_filter.begin(), ::tolower);
+	if (std::find(png_filters.begin(), png_filters.end(), png_filter) == png_filters.end())
+		throw std::runtime_error("invalid png filter " + png_filter);
+	if (png_level < 0 || png_level > 9)
+		throw std::runtime_error("--png-level must be between 0 and 9");
+	std::transform(write_method.begin(), write_method.end(), write_method.begin(), ::tolower);
+	if (write_method != "copy" && write_method != "writev" && write_method != "mmap")
+		throw std::runtime_error("invalid write method " + write_method);
+	if (strcasecmp(raw_format.c_str(), "dng") == 0)
+		raw_format = "dng";
+	else if (strcasecmp(raw_format.c_str(), "rpiraw") == 0)
+		raw_format = "rpiraw";
+	else
+		throw std::runtime_error("invalid raw format " + raw_format);
 
 	return true;
 }
@@ -863,9 +1096,17 @@ void OptsInternal::PrintStill() const
 {
 	std::cerr << "    encoding: " << encoding << std::endl;
 	std::cerr << "    quality: " << quality << std::endl;
+	if (encoding == "png")
+		std::cerr << "    png: filter " << png_filter << " level " << png_level << std::endl;
+	else if (encoding == "yuv420" || encoding == "rgb24" || encoding == "rgb48")
+		std::cerr << "    write-method: " << write_method << std::endl;
 	std::cerr << "    raw: " << raw << std::endl;
+	if (raw)
+		std::cerr << "    raw-format: " << raw_format << std::endl;
 	std::cerr << "    restart: " << restart << std::endl;
 	std::cerr << "    timelapse: " << timelapse.get() << "ms" << std::endl;
+	if (timelapse_warmup)
+		std::cerr << "    timelapse-warmup: " << timelapse_warmup.get() << "ms" << std::endl;
 	std::cerr << "    framestart: " << framestart << std::endl;
 	std::cerr << "    datetime: " << datetime << std::endl;
 	std::cerr << "    timestamp: " << timestamp << std::endl;
@@ -876,6 +1117,10 @@ void OptsInternal::PrintStill() const
 	std::cerr << "    thumbnail quality: " << thumb_quality << std::endl;
 	std::cerr << "    latest: " << latest << std::endl;
 	std::cerr << "    immediate " << immediate << std::endl;
+	if (save_queue)
+		std::cerr << "    save-queue: " << save_queue << std::endl;
+	if (burst > 1)
+		std::cerr << "    burst: " << burst << std::endl;
 	std::cerr << "    AF on capture: " << af_on_capture << std::endl;
 	std::cerr << "    Zero shutter lag: " << zsl << std::endl;
 	for (auto &s : exif)
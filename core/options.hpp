@@ -21,6 +21,7 @@
 #include <libcamera/transform.h>
 
 #include "core/logging.hpp"
+#include "core/queue_stats.hpp"
 #include "core/version.hpp"
 
 static constexpr double DEFAULT_FRAMERATE = 30.0;
@@ -168,7 +169,7 @@ enum class Platform
 struct OptsInternal
 {
 	OptsInternal():
-		set_default_lens_position(false), af_on_capture(false)
+		set_default_lens_position(false), af_on_capture(false), burst(0)
 	{
 	}
 
@@ -190,12 +191,28 @@ struct OptsInternal
 	std::string output;
 	std::string post_process_file;
 	std::string post_process_libs;
+	bool scratch_hugepages;
+	unsigned int post_process_threads;
+	std::string queue_policy_;
+	QueuePolicy queue_policy;
+	unsigned int queue_depth;
+	std::string trace_file;
+	std::string stats_socket;
+	bool perf_counters;
+	std::string log_sink;
+	std::vector<std::string> thread;
+	bool no_mode_cache;
+	bool startup_profile;
 	unsigned int width;
 	unsigned int height;
 	bool nopreview;
 	std::string preview;
 	bool fullscreen;
 	unsigned int preview_x, preview_y, preview_width, preview_height;
+	float preview_fps;
+	bool preview_lores;
+	bool preview_overlay;
+	bool perf_hud;
 	libcamera::Transform transform;
 	std::string roi;
 	float roi_x, roi_y, roi_width, roi_height;
@@ -229,6 +246,8 @@ struct OptsInternal
 	unsigned int lores_width;
 	unsigned int lores_height;
 	bool lores_par;
+	std::string lores_roi;
+	float lores_roi_x, lores_roi_y, lores_roi_width, lores_roi_height;
 	unsigned int camera;
 	std::string mode_string;
 	Mode mode;
@@ -236,6 +255,13 @@ struct OptsInternal
 	Mode viewfinder_mode;
 	unsigned int buffer_count;
 	unsigned int viewfinder_buffer_count;
+	unsigned int buffer_pool_size;
+	bool adaptive_buffers;
+	unsigned int adaptive_buffers_min;
+	unsigned int adaptive_buffers_max;
+	bool low_memory;
+	unsigned int memory_budget;
+	bool memory_report;
 	std::string afMode;
 	int afMode_index;
 	std::string afRange;
@@ -278,23 +304,58 @@ struct OptsInternal
 	Bitrate audio_bitrate;
 	uint32_t audio_samplerate;
 	TimeVal<std::chrono::microseconds> av_sync;
+	TimeVal<std::chrono::microseconds> audio_period;
 	std::string save_pts;
+	std::string pts_format;
 	int quality;
+	unsigned int mjpeg_slices;
+	unsigned int h264_slices;
+	bool mjpeg_optimise;
 	bool listen;
+	unsigned int mtu;
 	bool keypress;
 	bool signal;
 	std::string initial;
 	bool pause;
 	bool split;
 	uint32_t segment;
+	std::string hls;
+	unsigned int hls_list_size;
 	size_t circular;
+	std::string circular_file;
+	size_t write_buffer;
+	bool direct_io;
 	uint32_t frames;
 	bool low_latency;
+	std::string control_socket;
+	std::string server_dir;
+	unsigned int server_credits;
+	bool raw_headers;
+	unsigned int raw_write_behind;
+	bool raw_index;
+	bool adaptive_bitrate;
+	std::string lores_output;
+	std::string lores_codec;
+	Bitrate lores_bitrate;
+	std::vector<std::string> tee_output;
+	float region_quality;
+	std::string idle_key;
+	float idle_framerate;
+	TimeVal<std::chrono::milliseconds> idle_hold;
+	std::string clip_output;
+	TimeVal<std::chrono::milliseconds> clip_pre;
+	TimeVal<std::chrono::milliseconds> clip_post;
+	std::string clip_trigger;
 #ifndef DISABLE_RPI_FEATURES
 	uint32_t sync;
 #endif
 	std::string bitrate_;
+	std::string lores_bitrate_;
+	std::string idle_hold_;
+	std::string clip_pre_;
+	std::string clip_post_;
 	std::string av_sync_;
+	std::string audio_period_;
 	std::string audio_bitrate_;
 #ifndef DISABLE_RPI_FEATURES
 	std::string sync_;
@@ -303,6 +364,7 @@ struct OptsInternal
 	//int quality;
 	std::vector<std::string> exif;
 	TimeVal<std::chrono::milliseconds> timelapse;
+	TimeVal<std::chrono::milliseconds> timelapse_warmup;
 	uint32_t framestart;
 	bool datetime;
 	bool timestamp;
@@ -312,11 +374,18 @@ struct OptsInternal
 	std::string thumb;
 	unsigned int thumb_width, thumb_height, thumb_quality;
 	std::string encoding;
+	std::string png_filter;
+	int png_level;
+	std::string write_method;
 	bool raw;
+	std::string raw_format;
 	std::string latest;
 	bool immediate;
 	bool zsl;
+	unsigned int save_queue;
+	unsigned int burst;
 	std::string timelapse_;
+	std::string timelapse_warmup_;
 
 	std::string preview_libs;
 	std::string encoder_libs;
@@ -337,6 +406,14 @@ struct Options
 	Platform GetPlatform() const { return platform_; };
 
 protected:
+	// Take on the values of another, already parsed, set of options.
+	void copyFrom(Options const &other)
+	{
+		*v_ = *other.v_;
+		app_ = other.app_;
+		platform_ = other.platform_;
+	}
+
 	std::unique_ptr<boost::program_options::options_description> options_;
 	std::unique_ptr<OptsInternal> v_ = std::make_unique<OptsInternal>();
 
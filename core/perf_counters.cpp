@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * perf_counters.cpp - Per-thread hardware performance counters.
+ */
+
+#include <linux/perf_event.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+
+#include "core/logging.hpp"
+#include "core/perf_counters.hpp"
+
+std::atomic<bool> PerfCounters::enabled_ = false;
+
+namespace
+{
+
+// The hardware counters are opened as one group, so a single read gets them all, measured over the same time.
+class ThreadCounters
+{
+public:
+	ThreadCounters()
+	{
+		static std::atomic<bool> warned = false;
+		static const uint64_t configs[] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+											PERF_COUNT_HW_CACHE_MISSES };
+		for (unsigned int i = 0; i < 3; i++)
+		{
+			int fd = openCounter(configs[i], fds_.empty() ? -1 : fds_[0]);
+			if (fd >= 0)
+			{
+				fds_.push_back(fd);
+				slots_.push_back(i);
+			}
+			else if (!warned.exchange(true))
+				LOG_ERROR("WARNING: performance counter unavailable (" << strerror(errno) << "), it will read as zero");
+		}
+	}
+	~ThreadCounters()
+	{
+		for (int fd : fds_)
+			close(fd);
+	}
+
+	PerfSample Read()
+	{
+		PerfSample sample;
+		if (!fds_.empty())
+		{
+			// With PERF_FORMAT_GROUP the leader reads as the number of counters and then their values.
+			uint64_t values[1 + 3];
+			if (read(fds_[0], values, sizeof(values)) >= (ssize_t)((1 + fds_.size()) * sizeof(uint64_t)))
+			{
+				uint64_t *counts[] = { &sample.cycles, &sample.instructions, &sample.cache_misses };
+				for (unsigned int i = 0; i < slots_.size(); i++)
+					*counts[slots_[i]] = values[1 + i];
+			}
+		}
+
+		rusage usage;
+		if (getrusage(RUSAGE_THREAD, &usage) == 0)
+			sample.context_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+		return sample;
+	}
+
+private:
+	static int openCounter(uint64_t config, int group_fd)
+	{
+		perf_event_attr attr = {};
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.config = config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		// User space only, which is all an unprivileged process gets anyway.
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+	}
+
+	std::vector<int> fds_;
+	// Which of the counters each fd is.
+	std::vector<unsigned int> slots_;
+};
+
+std::mutex totals_mutex;
+std::map<std::string, std::unique_ptr<PerfTotals>> totals;
+
+} // namespace
+
+PerfSample PerfCounters::Read()
+{
+	static thread_local ThreadCounters counters;
+	return counters.Read();
+}
+
+PerfTotals *PerfCounters::Totals(std::string const &name)
+{
+	std::lock_guard<std::mutex> lock(totals_mutex);
+	std::unique_ptr<PerfTotals> &entry = totals[name];
+	if (!entry)
+		entry = std::make_unique<PerfTotals>();
+	return entry.get();
+}
+
+std::vector<std::pair<std::string, PerfTotals const *>> PerfCounters::AllTotals()
+{
+	std::lock_guard<std::mutex> lock(totals_mutex);
+	std::vector<std::pair<std::string, PerfTotals const *>> all;
+	for (auto const &[name, entry] : totals)
+		all.emplace_back(name, entry.get());
+	return all;
+}
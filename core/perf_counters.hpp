@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * perf_counters.hpp - Per-thread hardware performance counters.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// One thread's counter readings, or the difference between two of them.
+struct PerfSample
+{
+	uint64_t cycles = 0;
+	uint64_t instructions = 0;
+	uint64_t cache_misses = 0;
+	uint64_t context_switches = 0;
+
+	PerfSample operator-(PerfSample const &other) const
+	{
+		return { cycles - other.cycles, instructions - other.instructions, cache_misses - other.cache_misses,
+				 context_switches - other.context_switches };
+	}
+};
+
+// Running totals for one thing being counted, safe to read from any thread.
+struct PerfTotals
+{
+	std::atomic<uint64_t> count { 0 };
+	std::atomic<uint64_t> cycles { 0 };
+	std::atomic<uint64_t> instructions { 0 };
+	std::atomic<uint64_t> cache_misses { 0 };
+	std::atomic<uint64_t> context_switches { 0 };
+
+	void Add(PerfSample const &sample)
+	{
+		count.fetch_add(1, std::memory_order_relaxed);
+		cycles.fetch_add(sample.cycles, std::memory_order_relaxed);
+		instructions.fetch_add(sample.instructions, std::memory_order_relaxed);
+		cache_misses.fetch_add(sample.cache_misses, std::memory_order_relaxed);
+		context_switches.fetch_add(sample.context_switches, std::memory_order_relaxed);
+	}
+};
+
+/*
+ * Counts cycles, instructions and cache misses (level 1 data refills, on the Cortex-A cores) in user
+ * space with perf_event_open, and context switches with getrusage, separately for each thread. A thread's
+ * counters are opened the first time it reads them and closed when it exits. Where the kernel won't give
+ * us the hardware counters, for example because of /proc/sys/kernel/perf_event_paranoid, they read as zero
+ * and only context switches are counted. A stage retiring few instructions per cycle while missing the cache
+ * often is waiting on memory rather than computing.
+ */
+class PerfCounters
+{
+public:
+	// Nothing is counted until this is called, as opening the counters costs a few syscalls on each thread.
+	static void Enable(bool enable) { enabled_.store(enable, std::memory_order_relaxed); }
+	static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+	// The calling thread's counts since its counters were opened.
+	static PerfSample Read();
+
+	// The totals kept under this name, created the first time it is asked for. They last until the program
+	// exits, so callers may keep the pointer.
+	static PerfTotals *Totals(std::string const &name);
+	static std::vector<std::pair<std::string, PerfTotals const *>> AllTotals();
+
+private:
+	static std::atomic<bool> enabled_;
+};
@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * perf_hud.cpp - One line summary of how well the pipeline is keeping up.
+ */
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include "core/frame_trace.hpp"
+#include "core/perf_hud.hpp"
+
+PerfHud::PerfHud(std::chrono::milliseconds interval) : interval_(interval)
+{
+}
+
+void PerfHud::FrameShown(uint64_t sequence, uint64_t sensor_timestamp_ns)
+{
+	last_sequence_ = sequence;
+
+	// The sensor timestamp is on the same clock that the frame trace uses.
+	uint64_t now = FrameTrace::Now();
+	if (sensor_timestamp_ns && now > sensor_timestamp_ns)
+	{
+		double latency_ms = (now - sensor_timestamp_ns) / 1e6;
+		latency_total_ms_ += latency_ms;
+		latency_max_ms_ = std::max(latency_max_ms_, latency_ms);
+		latency_count_++;
+	}
+}
+
+bool PerfHud::Update(Counters const &counters)
+{
+	auto now = std::chrono::steady_clock::now();
+	bool first = last_time_.time_since_epoch().count() == 0;
+	if (!first && now - last_time_ < interval_)
+		return false;
+	double elapsed = std::chrono::duration<double>(now - last_time_).count();
+	last_time_ = now;
+
+	std::stringstream os;
+	os << std::fixed << std::setprecision(1);
+
+	// Frames the camera produced, whether or not we displayed them, against what was asked for.
+	double fps = elapsed > 0 ? (last_sequence_ - report_sequence_) / elapsed : 0;
+	report_sequence_ = last_sequence_;
+	os << fps;
+	if (counters.requested_fps > 0)
+		os << "/" << counters.requested_fps;
+	os << "fps";
+	if (latency_count_)
+		os << " latency " << latency_total_ms_ / latency_count_ << "ms (max " << latency_max_ms_ << ")";
+	os << " dropped " << counters.dropped - last_dropped_;
+	last_dropped_ = counters.dropped;
+
+	cpuStats(os, elapsed);
+	cmaStats(os);
+
+	bool any_stage = false;
+	for (auto const &[name, timing] : counters.stages)
+	{
+		uint64_t count = timing->count.load(std::memory_order_relaxed);
+		uint64_t total_us = timing->total_us.load(std::memory_order_relaxed);
+		auto &last = stage_totals_[name];
+		if (count > last.first)
+		{
+			double average_ms = (total_us - last.second) / 1000.0 / (count - last.first);
+			os << (any_stage ? " " : " | stages ") << name << " " << average_ms << "ms";
+			any_stage = true;
+		}
+		last = { count, total_us };
+	}
+
+	latency_total_ms_ = latency_max_ms_ = 0;
+	latency_count_ = 0;
+
+	// The first time round we only have the starting values for everything.
+	if (first)
+		return false;
+	text_ = os.str();
+	return true;
+}
+
+void PerfHud::cpuStats(std::ostream &os, double elapsed)
+{
+	// Total up the user and system time of each thread, grouping threads with the same name together.
+	std::map<std::string, uint64_t> by_name;
+	std::map<pid_t, uint64_t> ticks;
+	DIR *dir = opendir("/proc/self/task");
+	if (!dir)
+		return;
+	while (dirent *entry = readdir(dir))
+	{
+		pid_t tid = atoi(entry->d_name);
+		if (tid <= 0)
+			continue;
+		std::ifstream f("/proc/self/task/" + std::string(entry->d_name) + "/stat");
+		std::string stat;
+		if (!std::getline(f, stat))
+			continue;
+		// The name is in brackets and may itself contain spaces or brackets, so look for the last ')'.
+		size_t open = stat.find('('), close = stat.rfind(')');
+		if (open == std::string::npos || close == std::string::npos)
+			continue;
+		std::string name = stat.substr(open + 1, close - open - 1);
+		// After the name come state, ppid, pgrp, session, tty_nr, tpgid, flags, minflt, cminflt, majflt,
+		// cmajflt, then utime and stime.
+		std::istringstream fields(stat.substr(close + 2));
+		std::string skip;
+		uint64_t utime = 0, stime = 0;
+		for (unsigned int i = 0; i < 11; i++)
+			fields >> skip;
+		fields >> utime >> stime;
+		ticks[tid] = utime + stime;
+		auto it = thread_ticks_.find(tid);
+		by_name[name] += utime + stime - (it != thread_ticks_.end() ? it->second : 0);
+	}
+	closedir(dir);
+	thread_ticks_ = std::move(ticks);
+
+	// Show the busiest few.
+	std::vector<std::pair<uint64_t, std::string>> busiest;
+	for (auto const &[name, delta] : by_name)
+		busiest.emplace_back(delta, name);
+	std::sort(busiest.rbegin(), busiest.rend());
+	double scale = elapsed > 0 ? 100.0 / (sysconf(_SC_CLK_TCK) * elapsed) : 0;
+	os << " | cpu";
+	for (unsigned int i = 0; i < busiest.size() && i < 4; i++)
+		os << " " << busiest[i].second << " " << std::setprecision(0) << busiest[i].first * scale << "%";
+	os << std::setprecision(1);
+}
+
+void PerfHud::cmaStats(std::ostream &os)
+{
+	std::ifstream f("/proc/meminfo");
+	std::string line;
+	uint64_t total = 0, free = 0;
+	while (std::getline(f, line))
+	{
+		if (line.rfind("CmaTotal:", 0) == 0)
+			total = strtoull(line.c_str() + strlen("CmaTotal:"), nullptr, 10);
+		else if (line.rfind("CmaFree:", 0) == 0)
+			free = strtoull(line.c_str() + strlen("CmaFree:"), nullptr, 10);
+	}
+	if (total)
+		os << " | CMA " << (total - free) / 1024 << "/" << total / 1024 << "MB";
+}
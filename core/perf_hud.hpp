@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * perf_hud.hpp - One line summary of how well the pipeline is keeping up.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "core/queue_stats.hpp"
+
+// The PerfHud is given every frame as it goes to the display, and about once a second turns what it has seen,
+// along with the pipeline's own counters, into a line of text. This shows the frame rate against the one asked
+// for, the time from the sensor to the display, frames dropped, the CPU time of each thread (grouped by name),
+// CMA usage and the average time each post-processing stage took. Everything it reads is either passed in or
+// comes from /proc, so it can be used from any thread.
+
+class PerfHud
+{
+public:
+	struct Counters
+	{
+		float requested_fps; // 0 if none was given
+		// Frames dropped anywhere since the camera started.
+		uint64_t dropped;
+		std::vector<std::pair<char const *, TimingHistogram const *>> stages;
+	};
+
+	PerfHud(std::chrono::milliseconds interval = std::chrono::milliseconds(1000));
+
+	// Called as each frame is displayed, with its sequence number and sensor timestamp in nanoseconds.
+	void FrameShown(uint64_t sequence, uint64_t sensor_timestamp_ns);
+
+	// Return true if it's time for a new report, in which case Text() has been updated.
+	bool Update(Counters const &counters);
+	std::string const &Text() const { return text_; }
+
+private:
+	void cpuStats(std::ostream &os, double elapsed);
+	void cmaStats(std::ostream &os);
+
+	std::chrono::milliseconds interval_;
+	std::chrono::steady_clock::time_point last_time_;
+	std::string text_;
+
+	// Since the last report.
+	uint64_t last_sequence_ = 0;
+	double latency_total_ms_ = 0, latency_max_ms_ = 0;
+	unsigned int latency_count_ = 0;
+
+	// As at the last report.
+	uint64_t report_sequence_ = 0;
+	uint64_t last_dropped_ = 0;
+	std::map<pid_t, uint64_t> thread_ticks_;
+	std::map<std::string, std::pair<uint64_t, uint64_t>> stage_totals_; // count and total_us
+};
@@ -5,14 +5,21 @@
  * post_processor.cpp - Post processor implementation.
  */
 
+#include <algorithm>
 #include <dlfcn.h>
 #include <filesystem>
 #include <iostream>
 #include <map>
+#include <numeric>
+#include <set>
+#include <sstream>
 
+#include "core/frame_trace.hpp"
 #include "core/options.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/post_processor.hpp"
+#include "core/startup_cache.hpp"
+#include "core/thread_config.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
 
@@ -38,21 +45,100 @@ PostProcessor::~PostProcessor()
 
 void PostProcessor::LoadModules(const std::string &lib_dir)
 {
-	static std::vector<DlLib> dynamic_stages_;
+	// The .so files in the postprocessing lib path register their stages with the factory when
+	// loaded. Rather than load them all now, createPostProcessingStage loads only those needed
+	// for the stages that the JSON file asks for.
+	lib_dir_ = !lib_dir.empty() ? lib_dir : POSTPROC_LIB_DIR;
+}
 
-	const fs::path path(!lib_dir.empty() ? lib_dir : POSTPROC_LIB_DIR);
-	const std::string ext(".so");
+static const std::string stage_index_cache = "post-processing-stages";
 
-	if (!fs::exists(path))
-		return;
+// The index is only a hint, and a library it names is only loaded from where we'd find it ourselves.
+static bool is_module_in(fs::path const &lib, fs::path const &dir)
+{
+	std::error_code ec;
+	fs::path abs_lib = fs::absolute(lib, ec).lexically_normal();
+	fs::path abs_dir = fs::absolute(dir, ec).lexically_normal();
+	if (ec || abs_lib.extension() != ".so" || !fs::is_regular_file(abs_lib, ec))
+		return false;
+	// The directory may or may not have a trailing slash, which leaves an empty last element.
+	if (!abs_dir.empty() && abs_dir.filename().empty())
+		abs_dir = abs_dir.parent_path();
+	auto [dir_it, lib_it] = std::mismatch(abs_dir.begin(), abs_dir.end(), abs_lib.begin(), abs_lib.end());
+	return dir_it == abs_dir.end() && lib_it != abs_lib.end();
+}
+
+bool PostProcessor::loadModuleFor(std::string const &name)
+{
+	// Loaded libraries stay loaded for the life of the process, as any PostProcessor may be using
+	// the stages they registered.
+	static std::mutex mutex;
+	static std::map<std::string, DlLib> loaded;
+
+	const fs::path path(lib_dir_);
+	if (lib_dir_.empty() || !fs::exists(path))
+		return false;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	auto load = [](std::string const &lib) { loaded.emplace(lib, DlLib(lib)); };
+
+	// The index remembers which library registered each stage on an earlier run.
+	std::map<std::string, std::string> index;
+	std::string contents;
+	if (startup_cache_read(stage_index_cache, contents))
+	{
+		std::istringstream in(contents);
+		std::string stage, lib;
+		while (in >> stage >> lib)
+			index[stage] = lib;
+	}
 
-	// Dynamically load all .so files from the system postprocessing lib path.
-	// This will automatically register the stages with the factory.
+	auto it = index.find(name);
+	if (it != index.end() && !loaded.count(it->second) && is_module_in(it->second, path))
+	{
+		load(it->second);
+		if (GetPostProcessingStages().count(name))
+			return true;
+	}
+
+	// Otherwise work through the libraries we haven't tried yet, remembering what each one registers.
+	bool found = false, changed = false;
 	for (auto const &p : fs::recursive_directory_iterator(path))
 	{
-		if (p.path().extension() == ext)
-			dynamic_stages_.emplace_back(p.path().string());
+		std::string lib = p.path().string();
+		if (p.path().extension() != ".so" || loaded.count(lib))
+			continue;
+
+		std::set<std::string> before;
+		for (auto const &stage : GetPostProcessingStages())
+			before.insert(stage.first);
+
+		load(lib);
+		for (auto const &stage : GetPostProcessingStages())
+		{
+			if (!before.count(stage.first))
+			{
+				index[stage.first] = lib;
+				changed = true;
+			}
+		}
+
+		if (GetPostProcessingStages().count(name))
+		{
+			found = true;
+			break;
+		}
+	}
+
+	if (changed)
+	{
+		std::ostringstream out;
+		for (auto const &[stage, lib] : index)
+			out << stage << " " << lib << std::endl;
+		startup_cache_write(stage_index_cache, out.str());
 	}
+
+	return found;
 }
 
 void PostProcessor::Read(std::string const &filename)
@@ -102,19 +188,103 @@ void PostProcessor::Read(std::string const &filename)
 				LOG(1, "Reading post processing stage \"" << key_and_value.first << "\"");
 				stage->Read(key_and_value.second);
 				stages_.push_back(StagePtr(stage));
+
+				StageSchedule schedule;
+				if (auto node = key_and_value.second.get_child_optional("schedule"))
+				{
+					schedule.enabled = node->get<bool>("enabled", true);
+					schedule.every_nth_frame = std::max(node->get<unsigned int>("every_nth_frame", 1), 1u);
+					schedule.fps = node->get<double>("fps", 0);
+					schedule.latency_budget =
+						std::chrono::microseconds((int64_t)(node->get<double>("latency_budget_ms", 0) * 1000));
+				}
+				schedules_.push_back(schedule);
 			}
 			else
 				LOG(1, "No post processing stage found for \"" << key_and_value.first << "\"");
 		}
 	}
+
+	negotiateLores();
+}
+
+void PostProcessor::negotiateLores()
+{
+	// Every stage gets at least the size it asked for, and those wanting less scale it down themselves. All
+	// the stages can take YUV420, so that's what they get unless those that mind agree on something else.
+	libcamera::Size size;
+	libcamera::PixelFormat format;
+	bool requested = false, format_conflict = false;
+	lores_packed_ = false;
+	lores_stride_alignment_ = 0;
+	for (auto &stage : stages_)
+	{
+		PostProcessingStage::LoresRequest request;
+		if (!stage->GetLoresRequest(request))
+			continue;
+		LOG(2, "Stage \"" << stage->Name() << "\" would like a lores stream of " << request.size.toString() << " "
+						  << request.format << (request.packed ? ", packed" : ""));
+		requested = true;
+		size.width = std::max(size.width, request.size.width);
+		size.height = std::max(size.height, request.size.height);
+		if (request.format.isValid())
+		{
+			if (!format.isValid())
+				format = request.format;
+			else if (format != request.format)
+				format_conflict = true;
+		}
+		lores_packed_ |= request.packed;
+		if (request.stride_alignment)
+			lores_stride_alignment_ = std::lcm(std::max(lores_stride_alignment_, 1u), request.stride_alignment);
+	}
+	if (format_conflict)
+	{
+		LOG(1, "Post processing stages want different lores formats, using YUV420");
+		format = libcamera::formats::YUV420;
+	}
+
+	OptsInternal &options = app_->GetOptions()->Set();
+	if (!requested || size.isNull() || (options.lores_width && options.lores_height))
+		return;
+
+	size.alignUpTo(2, 2);
+	options.lores_width = size.width;
+	options.lores_height = size.height;
+	if (format.isValid())
+		app_->lores_format_ = format;
+	app_->lores_auto_ = true;
+	LOG(1, "Lores stream chosen for the post processing stages: " << size.toString() << " " << app_->lores_format_);
 }
 
 PostProcessingStage *PostProcessor::createPostProcessingStage(char const *name)
 {
+	if (!GetPostProcessingStages().count(name))
+		loadModuleFor(name);
+
 	auto it = GetPostProcessingStages().find(std::string(name));
 	return it != GetPostProcessingStages().end() ? (*it->second)(app_) : nullptr;
 }
 
+bool PostProcessor::EnableStage(std::string const &name, bool enable)
+{
+	std::unique_lock<std::mutex> l(mutex_);
+	bool found = false;
+
+	for (unsigned int i = 0; i < stages_.size(); i++)
+	{
+		if (name == stages_[i]->Name())
+		{
+			schedules_[i].enabled = enable;
+			found = true;
+		}
+	}
+
+	if (found)
+		LOG(1, (enable ? "Enabled" : "Disabled") << " post processing stage \"" << name << "\"");
+	return found;
+}
+
 void PostProcessor::SetCallback(PostProcessorCallback callback)
 {
 	callback_ = callback;
@@ -126,10 +296,23 @@ void PostProcessor::AdjustConfig(std::string const &use_case, StreamConfiguratio
 	{
 		stage->AdjustConfig(use_case, config);
 	}
+
+	// Validation may still adjust the stride to something the ISP can produce.
+	if (use_case == "lores" && (lores_packed_ || lores_stride_alignment_))
+	{
+		const bool yuv = config->pixelFormat == libcamera::formats::YUV420;
+		const unsigned int min_stride = yuv ? config->size.width : config->size.width * 3;
+		if (lores_packed_)
+			config->stride = min_stride;
+		else
+			config->stride = (std::max(config->stride, min_stride) + lores_stride_alignment_ - 1) /
+							 lores_stride_alignment_ * lores_stride_alignment_;
+	}
 }
 
 void PostProcessor::Configure()
 {
+	scratch_pool_.SetHugePages(app_->GetOptions()->Get().scratch_hugepages);
 	for (auto &stage : stages_)
 	{
 		stage->Configure();
@@ -139,14 +322,48 @@ void PostProcessor::Configure()
 void PostProcessor::Start()
 {
 	quit_ = false;
+	pending_jobs_ = 0;
+	stats_.Reset();
+	stage_timings_ = std::make_unique<TimingHistogram[]>(stages_.size());
+	stage_perf_.clear();
+	for (auto &stage : stages_)
+		stage_perf_.push_back(PerfCounters::Totals(std::string("post-process/") + stage->Name()));
+	stage_busy_.assign(stages_.size(), 0);
+	stage_samples_.assign(stages_.size(), {});
+	for (auto &schedule : schedules_)
+		schedule.next_due = {};
 	output_thread_ = std::thread(&PostProcessor::outputThread, this);
 
+	if (!stages_.empty())
+	{
+		unsigned int num_workers = app_->GetOptions()->Get().post_process_threads;
+		if (!num_workers)
+			num_workers = std::max(std::thread::hardware_concurrency(), 1u);
+		for (unsigned int i = 0; i < num_workers; i++)
+			workers_.emplace_back(&PostProcessor::workerThread, this);
+		LOG(2, "Post-processing started with " << num_workers << " worker threads");
+	}
+
 	for (auto &stage : stages_)
 	{
 		stage->Start();
 	}
 }
 
+std::vector<std::pair<char const *, TimingHistogram const *>> PostProcessor::GetStageTimings() const
+{
+	std::vector<std::pair<char const *, TimingHistogram const *>> timings;
+	for (unsigned int i = 0; i < stages_.size() && stage_timings_; i++)
+		timings.emplace_back(stages_[i]->Name(), &stage_timings_[i]);
+	return timings;
+}
+
+std::vector<std::vector<double>> PostProcessor::GetStageSamples()
+{
+	std::unique_lock<std::mutex> l(mutex_);
+	return stage_samples_;
+}
+
 void PostProcessor::Process(CompletedRequestPtr &request)
 {
 	if (stages_.empty())
@@ -155,32 +372,182 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 		return;
 	}
 
-	std::unique_lock<std::mutex> l(mutex_);
-	requests_.push(std::move(request)); // caller has given us ownership of this reference
+	QueuePolicy policy = app_->GetOptions()->Get().queue_policy;
+	unsigned int max_depth = app_->GetOptions()->Get().queue_depth;
+	bool dropped_oldest = false;
 
-	std::promise<bool> promise;
-	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
-		bool drop_request = false;
-		for (auto &stage : stages_)
+	// The jobs_ queue preserves the order in which requests arrived, so the output thread can
+	// deliver them correctly however the workers happen to finish them.
+	{
+		std::unique_lock<std::mutex> l(mutex_);
+
+		if (max_depth && pending_jobs_ >= max_depth)
 		{
-			if (stage->Process(request))
+			if (policy == QueuePolicy::Block)
 			{
-				drop_request = true;
-				break;
+				stats_.blocked++;
+				space_cv_.wait(l, [this, max_depth] { return pending_jobs_ < max_depth || quit_; });
+			}
+			else if (policy == QueuePolicy::DropOldest)
+			{
+				// Only a request that no stage has started on can be dropped. The output thread
+				// discards it when it reaches the front of the queue.
+				auto it = std::find_if(jobs_.begin(), jobs_.end(),
+									   [](Job const &job) { return !job.done && !job.running && job.stage == 0; });
+				if (it != jobs_.end())
+				{
+					it->drop = true;
+					it->done = true;
+					pending_jobs_--;
+					dropped_oldest = true;
+				}
+			}
+
+			// Otherwise drop the new request, releasing it back to the camera outside the lock.
+			if (policy != QueuePolicy::Block)
+			{
+				stats_.dropped++;
+				if (!dropped_oldest)
+				{
+					l.unlock();
+					request.reset();
+					return;
+				}
 			}
 		}
-		promise.set_value(drop_request);
+
+		// Writes to the buffers stay open until the last stage is done, so they're only synced once.
+		app_->deferBufferWrites(request);
+		jobs_.emplace_back(std::move(request)); // caller has given us ownership of this reference
+		pending_jobs_++;
+		stats_.Depth(pending_jobs_);
+	}
+	work_cv_.notify_one();
+	if (dropped_oldest)
 		cv_.notify_one();
-	};
+}
+
+PostProcessor::Job *PostProcessor::nextJob()
+{
+	// Find the oldest request whose next stage is free to run it. Must be called with mutex_ held.
+	// We track the lowest stage that any older request has yet to complete, because an Ordered
+	// stage may only take a request once all the older ones have passed through it.
+	unsigned int pending_stage = stages_.size();
+
+	for (Job &job : jobs_)
+	{
+		if (job.done)
+			continue;
+
+		if (!job.running)
+		{
+			PostProcessingStage::Concurrency concurrency = stages_[job.stage]->GetConcurrency();
+
+			if (concurrency == PostProcessingStage::Concurrency::Reentrant)
+				return &job;
+			else if (!stage_busy_[job.stage] &&
+					 (concurrency == PostProcessingStage::Concurrency::Serial || pending_stage > job.stage))
+				return &job;
+		}
+
+		pending_stage = std::min(pending_stage, job.stage);
+	}
+
+	return nullptr;
+}
+
+bool PostProcessor::stageDue(unsigned int stage, Job const &job)
+{
+	// Must be called with mutex_ held.
+	StageSchedule &schedule = schedules_[stage];
+
+	if (!schedule.enabled || job.request->sequence % schedule.every_nth_frame)
+		return false;
+
+	const auto now = std::chrono::steady_clock::now();
+	if (schedule.latency_budget.count() && now - job.arrived > schedule.latency_budget)
+		return false;
+
+	if (schedule.fps > 0)
+	{
+		const auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			std::chrono::duration<double>(1.0 / schedule.fps));
+
+		// Allow half an interval's slack, or frame timing jitter would make us skip twice as many as we should.
+		if (now + interval / 2 < schedule.next_due)
+			return false;
+		schedule.next_due = std::max(schedule.next_due, now - interval / 2) + interval;
+	}
+
+	return true;
+}
+
+void PostProcessor::workerThread()
+{
+	ThreadConfig::Get().Apply("post-process");
+	while (true)
+	{
+		Job *job = nullptr;
+		unsigned int stage;
+		bool due;
+		{
+			std::unique_lock<std::mutex> l(mutex_);
+			work_cv_.wait(l, [this, &job] { return (job = nextJob()) || (quit_ && !pending_jobs_); });
+
+			// Any outstanding work is finished before we quit.
+			if (!job)
+				break;
+
+			stage = job->stage;
+			job->running = true;
+			stage_busy_[stage]++;
+			due = stageDue(stage, *job);
+		}
+
+		bool drop_request = false;
+		std::chrono::duration<double, std::micro> duration(0);
+		if (!due)
+			stage_timings_[stage].skipped.fetch_add(1, std::memory_order_relaxed);
+		else
+		{
+			FrameTraceScope trace(stages_[stage]->Name(), "post-process", job->request->sequence, FrameTrace::NO_ID,
+								  stage_perf_[stage]);
+			auto start_time = std::chrono::steady_clock::now();
+			drop_request = stages_[stage]->Process(job->request);
+			duration = std::chrono::steady_clock::now() - start_time;
+			stage_timings_[stage].Add(std::chrono::duration_cast<std::chrono::microseconds>(duration));
+		}
+
+		bool finished;
+		{
+			std::unique_lock<std::mutex> l(mutex_);
+			if (due && keep_stage_samples_)
+				stage_samples_[stage].push_back(duration.count());
+			job->running = false;
+			stage_busy_[stage]--;
+			job->stage++;
+			finished = drop_request || job->stage == stages_.size();
+			if (finished)
+			{
+				job->drop = drop_request;
+				job->done = true;
+				pending_jobs_--;
+			}
+		}
 
-	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
-	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
-	futures_.push(promise.get_future());
-	std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
+		// Completing a stage may allow another request to enter it, or this one to move on.
+		work_cv_.notify_all();
+		if (finished)
+		{
+			cv_.notify_one();
+			space_cv_.notify_one();
+		}
+	}
 }
 
 void PostProcessor::outputThread()
 {
+	ThreadConfig::Get().Apply("post-output");
 	while (true)
 	{
 		CompletedRequestPtr request;
@@ -189,21 +556,19 @@ void PostProcessor::outputThread()
 		{
 			std::unique_lock<std::mutex> l(mutex_);
 
-			cv_.wait(l, [this] {
-				return (quit_ && futures_.empty()) ||
-					   (!futures_.empty() && futures_.front().wait_for(0s) == std::future_status::ready);
-			});
+			cv_.wait(l, [this] { return (quit_ && jobs_.empty()) || (!jobs_.empty() && jobs_.front().done); });
 
-			// Only quit when the futures_ queue is empty.
-			if (quit_ && futures_.empty())
+			// Only quit when the jobs_ queue is empty.
+			if (quit_ && jobs_.empty())
 				break;
 
-			drop_request = futures_.front().get();
-			futures_.pop();
-			request = std::move(requests_.front()); // reuse as it's being dropped from the queue
-			requests_.pop();
+			drop_request = jobs_.front().drop;
+			request = std::move(jobs_.front().request); // reuse as it's being dropped from the queue
+			jobs_.pop_front();
 		}
 
+		app_->endBufferWrites(request);
+
 		if (!drop_request)
 			callback_(request); // callback can take over ownership from us
 	}
@@ -219,8 +584,14 @@ void PostProcessor::Stop()
 	{
 		std::unique_lock<std::mutex> l(mutex_);
 		quit_ = true;
-		cv_.notify_one();
 	}
+	work_cv_.notify_all();
+	cv_.notify_one();
+	space_cv_.notify_all();
+
+	for (auto &worker : workers_)
+		worker.join();
+	workers_.clear();
 
 	output_thread_.join();
 }
@@ -231,4 +602,6 @@ void PostProcessor::Teardown()
 	{
 		stage->Teardown();
 	}
+	// The next configuration may well have different sizes.
+	scratch_pool_.Trim();
 }
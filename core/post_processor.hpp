@@ -9,13 +9,18 @@
 
 #include <chrono>
 #include <condition_variable>
-#include <future>
+#include <deque>
 #include <mutex>
 #include <queue>
+#include <thread>
 
 #include "core/completed_request.hpp"
 #include "core/dl_lib.hpp"
 #include "core/logging.hpp"
+#include "core/perf_counters.hpp"
+#include "core/queue_stats.hpp"
+
+#include "post_processing_stages/scratch_pool.hpp"
 
 namespace libcamera
 {
@@ -55,19 +60,85 @@ public:
 
 	void Teardown();
 
+	// Turn every stage with this name on or off while running. Returns false if there are none.
+	bool EnableStage(std::string const &name, bool enable);
+
+	QueueStats const &GetQueueStats() const { return stats_; }
+	// How long each stage's Process() has taken, by stage name. Valid between Start() and Teardown().
+	std::vector<std::pair<char const *, TimingHistogram const *>> GetStageTimings() const;
+	// Also keep how long each stage's Process() took on every request, in microseconds, for tools that want
+	// exact percentiles. Takes effect from the next Start().
+	void KeepStageSamples(bool keep) { keep_stage_samples_ = keep; }
+	std::vector<std::vector<double>> GetStageSamples();
+	// Buffers that the stages' per-frame work reuses, rather than allocate afresh on every frame.
+	ScratchPool &GetScratchPool() { return scratch_pool_; }
+
 private:
 	PostProcessingStage *createPostProcessingStage(char const *name);
+	bool loadModuleFor(std::string const &name);
+	// Combine what the stages want of the lores stream, and make one to suit them if none was asked for.
+	void negotiateLores();
 
 	RPiCamApp *app_;
 	std::vector<StagePtr> stages_;
+	// How the stages between them want the lores rows laid out.
+	bool lores_packed_ = false;
+	unsigned int lores_stride_alignment_ = 0;
 	std::vector<DlLib> dynamic_stages_;
+	std::string lib_dir_;
 	void outputThread();
-
-	std::queue<CompletedRequestPtr> requests_;
-	std::queue<std::future<bool>> futures_;
+	void workerThread();
+
+	// Each request occupies a slot in the in-order jobs_ queue until the output thread hands it
+	// on. Requests pass through the stages in order, though different requests may be in
+	// different stages at the same time.
+	struct Job
+	{
+		Job(CompletedRequestPtr &&r)
+			: request(std::move(r)), arrived(std::chrono::steady_clock::now()), stage(0), running(false), done(false),
+			  drop(false)
+		{
+		}
+		CompletedRequestPtr request;
+		std::chrono::steady_clock::time_point arrived;
+		unsigned int stage;
+		bool running;
+		bool done;
+		bool drop;
+	};
+	Job *nextJob();
+
+	// Each stage may have a "schedule" in the JSON file that limits which requests it runs on. A request that
+	// a stage doesn't run on passes straight through it.
+	struct StageSchedule
+	{
+		bool enabled = true;
+		// Run only on requests whose sequence number is a multiple of this.
+		unsigned int every_nth_frame = 1;
+		// Run at no more than this rate, if non-zero.
+		double fps = 0;
+		// Skip requests that have already been in the post-processor for longer than this, if non-zero.
+		std::chrono::microseconds latency_budget { 0 };
+		std::chrono::steady_clock::time_point next_due;
+	};
+	bool stageDue(unsigned int stage, Job const &job);
+
+	std::vector<StageSchedule> schedules_;
+	std::deque<Job> jobs_;
+	unsigned int pending_jobs_;
+	std::vector<unsigned int> stage_busy_;
+	std::vector<std::thread> workers_;
 	std::thread output_thread_;
 	bool quit_;
 	PostProcessorCallback callback_;
 	std::mutex mutex_;
 	std::condition_variable cv_;
+	std::condition_variable work_cv_;
+	std::condition_variable space_cv_;
+	QueueStats stats_;
+	std::unique_ptr<TimingHistogram[]> stage_timings_;
+	std::vector<PerfTotals *> stage_perf_;
+	ScratchPool scratch_pool_;
+	bool keep_stage_samples_ = false;
+	std::vector<std::vector<double>> stage_samples_;
 };
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * queue_stats.hpp - Queue depth policy, backpressure counters and stage timings.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// What to do when a frame arrives at a handoff point whose queue is already at its maximum depth.
+enum class QueuePolicy
+{
+	Block, // wait for the consumer to make space
+	DropOldest, // discard the oldest frame that has not yet been started on
+	DropNewest, // discard the frame that has just arrived
+};
+
+// Counters kept by each handoff point, safe to read from any thread.
+struct QueueStats
+{
+	std::atomic<uint64_t> dropped { 0 };
+	std::atomic<uint64_t> blocked { 0 };
+	std::atomic<unsigned int> max_depth { 0 };
+
+	void Depth(unsigned int depth)
+	{
+		unsigned int current = max_depth.load(std::memory_order_relaxed);
+		while (depth > current && !max_depth.compare_exchange_weak(current, depth, std::memory_order_relaxed))
+			;
+	}
+
+	void Reset()
+	{
+		dropped = 0;
+		blocked = 0;
+		max_depth = 0;
+	}
+};
+
+// Distribution of how long something took, in power-of-two microsecond buckets. Bucket 0 counts
+// anything under 2us, bucket i counts [2^i, 2^(i+1)) us, and the last bucket takes everything longer.
+struct TimingHistogram
+{
+	static constexpr unsigned int NumBuckets = 20;
+
+	std::atomic<uint64_t> buckets[NumBuckets] = {};
+	std::atomic<uint64_t> count { 0 };
+	std::atomic<uint64_t> total_us { 0 };
+	// Times that it didn't run at all, and so took no time.
+	std::atomic<uint64_t> skipped { 0 };
+
+	void Add(std::chrono::microseconds duration)
+	{
+		uint64_t us = duration.count() > 0 ? duration.count() : 0;
+		unsigned int bucket = 0;
+		while (bucket < NumBuckets - 1 && (us >> (bucket + 1)))
+			bucket++;
+		buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		total_us.fetch_add(us, std::memory_order_relaxed);
+	}
+
+	void Reset()
+	{
+		for (auto &bucket : buckets)
+			bucket = 0;
+		count = 0;
+		total_us = 0;
+		skipped = 0;
+	}
+};
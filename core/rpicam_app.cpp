@@ -8,10 +8,19 @@
 #include "preview/preview.hpp"
 
 #include "core/frame_info.hpp"
+#include "core/frame_trace.hpp"
+#include "core/memory_report.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/options.hpp"
+#include "core/perf_counters.hpp"
+#include "core/perf_hud.hpp"
+#include "core/startup_cache.hpp"
+#include "core/stats_server.hpp"
+#include "core/thread_config.hpp"
+#include "post_processing_stages/object_detect.hpp"
 
 #include <cmath>
+#include <future>
 #include <fcntl.h>
 #include <stdlib.h>
 
@@ -26,6 +35,69 @@
 
 unsigned int RPiCamApp::verbosity = 1;
 
+// Allocates the shared_ptr control blocks for completed requests from a free list of fixed-size
+// blocks, so that handing a request to the application doesn't have to go to the heap. Blocks
+// are never given back, but there are only ever as many as there are requests in flight.
+template <typename T>
+struct BlockAllocator
+{
+	using value_type = T;
+
+	BlockAllocator() = default;
+	template <typename U>
+	BlockAllocator(BlockAllocator<U> const &) {}
+
+	T *allocate(std::size_t n)
+	{
+		if (n != 1)
+			return static_cast<T *>(::operator new(n * sizeof(T)));
+		FreeList &list = freeList();
+		std::lock_guard<std::mutex> lock(list.mutex);
+		if (list.blocks.empty())
+			return static_cast<T *>(::operator new(sizeof(T)));
+		void *block = list.blocks.back();
+		list.blocks.pop_back();
+		return static_cast<T *>(block);
+	}
+
+	void deallocate(T *p, std::size_t n)
+	{
+		if (n != 1)
+		{
+			::operator delete(p);
+			return;
+		}
+		FreeList &list = freeList();
+		std::lock_guard<std::mutex> lock(list.mutex);
+		list.blocks.push_back(p);
+	}
+
+	template <typename U>
+	bool operator==(BlockAllocator<U> const &) const { return true; }
+	template <typename U>
+	bool operator!=(BlockAllocator<U> const &) const { return false; }
+
+private:
+	struct FreeList
+	{
+		FreeList() { blocks.reserve(64); }
+		std::mutex mutex;
+		std::vector<void *> blocks;
+	};
+
+	static FreeList &freeList()
+	{
+		// Deliberately leaked, as applications may still be dropping requests during static destruction.
+		static FreeList *list = new FreeList;
+		return *list;
+	}
+};
+
+// Enough for one buffer to be with the application, one being filled and one queued behind it.
+static constexpr unsigned int LOW_MEMORY_BUFFER_COUNT = 3;
+// Still buffers for a burst, when no buffer count was given. The rest of a burst is copied out of them.
+static constexpr unsigned int BURST_BUFFER_COUNT = 4;
+
 static libcamera::PixelFormat mode_to_pixel_format(Mode const &mode)
 {
 	// The saving grace here is that we can ignore the Bayer order and return anything -
@@ -110,15 +182,103 @@ RPiCamApp::~RPiCamApp()
 	StopCamera();
 	Teardown();
 	CloseCamera();
+	// The trace is shared by every RPiCamApp in the process; only the one that started it stops it.
+	if (trace_started_)
+		FrameTrace::Get().Stop();
+	if (options_->Get().memory_report)
+		MemoryReport::Get().Write(std::cerr, "at exit");
 }
 
-void RPiCamApp::initCameraManager()
+// Turn a camera id into something that can be used in a cache file name.
+static std::string cache_name(std::string const &id)
 {
-	camera_manager_.reset();
-	camera_manager_ = std::make_unique<CameraManager>();
-	int ret = camera_manager_->start();
+	std::string name = id;
+	std::replace_if(name.begin(), name.end(), [](char c) { return !isalnum(c) && c != '-' && c != '.'; }, '_');
+	return name;
+}
+
+// Anything that could change the list of sensor modes, or their framerates. The imx708 has a different set of
+// modes with its HDR turned on, which --hdr "sensor" does.
+static std::string sensor_mode_cache_key(std::string const &hdr)
+{
+	std::string key = "libcamera " + libcamera::CameraManager::version() + " hdr " + hdr;
+	char const *tuning_file = getenv("LIBCAMERA_RPI_TUNING_FILE");
+	if (tuning_file && tuning_file[0])
+	{
+		struct stat info;
+		key += std::string(" tuning ") + tuning_file;
+		if (stat(tuning_file, &info) == 0)
+			key += " " + std::to_string(info.st_mtime);
+	}
+	return key;
+}
+
+static bool read_sensor_mode_cache(std::string const &name, std::string const &hdr, bool need_framerates,
+								   std::vector<RPiCamApp::SensorMode> &modes)
+{
+	std::string contents;
+	if (!startup_cache_read(name, contents))
+		return false;
+
+	std::istringstream in(contents);
+	std::string key, with_framerates;
+	if (!std::getline(in, key) || key != sensor_mode_cache_key(hdr) || !std::getline(in, with_framerates))
+		return false;
+	if (need_framerates && with_framerates != "framerates")
+		return false;
+
+	std::vector<RPiCamApp::SensorMode> cached;
+	uint32_t fourcc;
+	uint64_t modifier;
+	unsigned int width, height;
+	double fps;
+	while (in >> fourcc >> modifier >> width >> height >> fps)
+		cached.emplace_back(libcamera::Size(width, height), libcamera::PixelFormat(fourcc, modifier), fps);
+	if (cached.empty())
+		return false;
+
+	modes = std::move(cached);
+	return true;
+}
+
+static void write_sensor_mode_cache(std::string const &name, std::string const &hdr, bool with_framerates,
+									std::vector<RPiCamApp::SensorMode> const &modes)
+{
+	std::ostringstream out;
+	out << sensor_mode_cache_key(hdr) << std::endl << (with_framerates ? "framerates" : "no-framerates") << std::endl;
+	for (auto const &mode : modes)
+		out << mode.format.fourcc() << " " << mode.format.modifier() << " " << mode.size.width << " "
+			<< mode.size.height << " " << mode.fps << std::endl;
+	startup_cache_write(name, out.str());
+}
+
+// libcamera allows only one CameraManager per process, so every RPiCamApp in the process shares
+// it. This lets a single process drive several cameras, each through its own RPiCamApp.
+static std::shared_ptr<libcamera::CameraManager> acquire_camera_manager()
+{
+	static std::mutex mutex;
+	static std::weak_ptr<libcamera::CameraManager> shared_camera_manager;
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::shared_ptr<libcamera::CameraManager> camera_manager = shared_camera_manager.lock();
+	if (camera_manager)
+		return camera_manager;
+
+	camera_manager = std::make_shared<libcamera::CameraManager>();
+	int ret = camera_manager->start();
 	if (ret)
 		throw std::runtime_error("camera manager failed to start, code " + std::to_string(-ret));
+	shared_camera_manager = camera_manager;
+	return camera_manager;
+}
+
+void RPiCamApp::initCameraManager()
+{
+	// This only restarts the camera manager if no other RPiCamApp is using it.
+	camera_manager_.reset();
+	camera_manager_ = acquire_camera_manager();
+	if (camera_manager_.use_count() > 1)
+		LOG(2, "Sharing the camera manager with another camera");
 }
 
 std::string const &RPiCamApp::CameraId() const
@@ -133,11 +293,19 @@ std::string RPiCamApp::CameraModel() const
 
 void RPiCamApp::OpenCamera()
 {
-	// Make a preview window.
-	preview_ = std::unique_ptr<Preview>(make_preview(RPiCamApp::GetOptions()));
-	preview_->SetDoneCallback(std::bind(&RPiCamApp::previewDoneCallback, this, std::placeholders::_1));
+	ThreadConfig::Get().Apply("event");
+
+	// Make a preview window. This can take a while, so it happens while we open the camera.
+	std::atomic<double> preview_ms = 0;
+	std::future<std::unique_ptr<Preview>> preview_future = std::async(std::launch::async, [this, &preview_ms]() {
+		auto start = std::chrono::steady_clock::now();
+		std::unique_ptr<Preview> preview(make_preview(RPiCamApp::GetOptions()));
+		preview_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		return preview;
+	});
 
 	LOG(2, "Opening camera...");
+	startupMark("opening camera");
 
 	if (!camera_manager_)
 		initCameraManager();
@@ -159,19 +327,49 @@ void RPiCamApp::OpenCamera()
 	camera_acquired_ = true;
 
 	LOG(2, "Acquired camera " << cam_id);
+	startupMark("camera acquired");
 
 	if (!options_->Get().post_process_file.empty())
 	{
 		post_processor_.LoadModules(options_->Get().post_process_libs);
 		post_processor_.Read(options_->Get().post_process_file);
+		startupMark("post-processing loaded");
 	}
-	// The queue takes over ownership from the post-processor.
+	// The queue takes over ownership from the post-processor. Completed requests only ever arrive
+	// from one thread at a time, so they can use the lock-free path.
 	post_processor_.SetCallback(
-		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
+		[this](CompletedRequestPtr &r) { this->msg_queue_.PostLockFree(Msg(MsgType::RequestComplete, std::move(r))); });
 
 	// We're going to make a list of all the available sensor modes, but we only populate
 	// the framerate field if the user has requested a framerate (as this requires us actually
-	// to configure the sensor, which is otherwise best avoided).
+	// to configure the sensor, which is otherwise best avoided). Even so, the list is cached
+	// for each camera and tuning file because finding the framerates is slow.
+
+	std::string const mode_cache_name = "sensor-modes-" + cache_name(cam_id);
+	bool need_framerates = !!options_->Get().framerate;
+	if (!options_->Get().no_mode_cache &&
+		read_sensor_mode_cache(mode_cache_name, options_->Get().hdr, need_framerates, sensor_modes_))
+	{
+		LOG(2, "Using cached sensor modes");
+	}
+	else
+	{
+		enumerateSensorModes();
+		if (!options_->Get().no_mode_cache)
+			write_sensor_mode_cache(mode_cache_name, options_->Get().hdr, need_framerates, sensor_modes_);
+	}
+	startupMark("sensor modes");
+
+	preview_ = preview_future.get();
+	preview_->SetDoneCallback(std::bind(&RPiCamApp::previewDoneCallback, this, std::placeholders::_1));
+	startupMark("preview ready");
+	if (options_->Get().startup_profile)
+		LOG(1, "Preview took " << preview_ms << "ms to create (in parallel)");
+}
+
+void RPiCamApp::enumerateSensorModes()
+{
+	sensor_modes_.clear();
 
 	std::unique_ptr<CameraConfiguration> config = camera_->generateConfiguration({ libcamera::StreamRole::Raw });
 	const libcamera::StreamFormats &formats = config->at(0).formats();
@@ -333,7 +531,9 @@ void RPiCamApp::ConfigureViewfinder()
 	{
 		Size lores_size(options_->Get().lores_width, options_->Get().lores_height);
 		lores_size.alignDownTo(2, 2);
-		if (lores_size.width > size.width || lores_size.height > size.height)
+		if (lores_auto_)
+			lores_size.boundTo(size);
+		else if (lores_size.width > size.width || lores_size.height > size.height)
 			throw std::runtime_error("Low res image larger than viewfinder");
 		configuration_->at(lores_stream_num).pixelFormat = lores_format_;
 		configuration_->at(lores_stream_num).size = lores_size;
@@ -359,7 +559,7 @@ void RPiCamApp::ConfigureViewfinder()
 	post_processor_.AdjustConfig("viewfinder", &configuration_->at(0));
 
 	configureDenoise(options_->Get().denoise == "auto" ? "cdn_off" : options_->Get().denoise);
-	setupCapture();
+	setupCapture(have_lores_stream ? &configuration_->at(lores_stream_num) : nullptr);
 
 	streams_["viewfinder"] = configuration_->at(0).stream();
 	if (have_lores_stream)
@@ -418,9 +618,20 @@ void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 		configuration_->at(2).bufferCount = configuration_->at(0).bufferCount;
 	}
 
+	// Both ISP outputs are already in use, so when a lores size is given the viewfinder stream is made
+	// that size and doubles as the lores stream, for stages such as the object detectors. One chosen only
+	// to suit the stages, typically the size of a network's input, would make far too small a preview.
+	bool viewfinder_is_lores = options_->Get().lores_width && options_->Get().lores_height && !lores_auto_;
+
 	Size size(1280, 960);
 	auto area = camera_->properties().get(properties::PixelArrayActiveAreas);
-	if (options_->Get().viewfinder_width && options_->Get().viewfinder_height)
+	if (viewfinder_is_lores)
+	{
+		size = Size(options_->Get().lores_width, options_->Get().lores_height);
+		size.alignDownTo(2, 2);
+		LOG(2, "Viewfinder is the lores stream, size " << size.toString());
+	}
+	else if (options_->Get().viewfinder_width && options_->Get().viewfinder_height)
 		size = Size(options_->Get().viewfinder_width, options_->Get().viewfinder_height);
 	else if (area)
 	{
@@ -459,6 +670,8 @@ void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 
 	streams_["still"] = configuration_->at(0).stream();
 	streams_["viewfinder"] = configuration_->at(1).stream();
+	if (viewfinder_is_lores)
+		streams_["lores"] = configuration_->at(1).stream();
 	if (!options_->Get().no_raw)
 		streams_["raw"] = configuration_->at(2).stream();
 
@@ -498,6 +711,11 @@ void RPiCamApp::ConfigureStill(unsigned int flags)
 		configuration_->at(0).bufferCount = 3;
 	else if (options_->Get().buffer_count > 0)
 		configuration_->at(0).bufferCount = options_->Get().buffer_count;
+	else if (options_->Get().burst > 1)
+	{
+		// Enough for the camera to keep streaming while we hold one frame of a burst and copy another.
+		configuration_->at(0).bufferCount = std::min(options_->Get().burst, BURST_BUFFER_COUNT);
+	}
 	if (options_->Get().width)
 		configuration_->at(0).size.width = options_->Get().width;
 	if (options_->Get().height)
@@ -584,8 +802,10 @@ void RPiCamApp::ConfigureVideo(unsigned int flags)
 	{
 		Size lores_size(options_->Get().lores_width, options_->Get().lores_height);
 		lores_size.alignDownTo(2, 2);
-		if (lores_size.width > configuration_->at(0).size.width ||
-			lores_size.height > configuration_->at(0).size.height)
+		if (lores_auto_)
+			lores_size.boundTo(configuration_->at(0).size);
+		else if (lores_size.width > configuration_->at(0).size.width ||
+				 lores_size.height > configuration_->at(0).size.height)
 			throw std::runtime_error("Low res image larger than video");
 		configuration_->at(lores_index).pixelFormat = lores_format_;
 		configuration_->at(lores_index).size = lores_size;
@@ -595,7 +815,7 @@ void RPiCamApp::ConfigureVideo(unsigned int flags)
 	configuration_->orientation = libcamera::Orientation::Rotate0 * options_->Get().transform;
 
 	configureDenoise(options_->Get().denoise == "auto" ? "cdn_fast" : options_->Get().denoise);
-	setupCapture();
+	setupCapture(have_lores_stream ? &configuration_->at(lores_index) : nullptr);
 
 	streams_["video"] = configuration_->at(0).stream();
 	if (!options_->Get().no_raw)
@@ -617,20 +837,135 @@ void RPiCamApp::Teardown()
 	if (!options_->Get().help)
 		LOG(2, "Tearing down requests, buffers and configuration");
 
-	for (auto &iter : mapped_buffers_)
+	// The buffers go back into the pool, still mapped, ready for the next configuration.
 	{
-		// assert(iter.first->planes().size() == iter.second.size());
-		// for (unsigned i = 0; i < iter.first->planes().size(); i++)
-		for (auto &span : iter.second)
-			munmap(span.data(), span.size());
+		std::unique_lock<std::shared_mutex> lock(mapped_buffers_mutex_);
+		mapped_buffers_.clear();
 	}
-	mapped_buffers_.clear();
+	for (auto &buffer : dma_buffers_)
+		dma_heap_pool_.release(std::move(buffer));
+	dma_buffers_.clear();
+	read_synced_buffers_.clear();
+	deferred_write_buffers_.clear();
+	write_synced_buffers_.clear();
 
 	configuration_.reset();
 
-	frame_buffers_.clear();
+	{
+		std::lock_guard<std::mutex> lock(frame_buffers_mutex_);
+		frame_buffers_.clear();
+	}
 
 	streams_.clear();
+	offline_streams_.clear();
+	updateMemoryReport();
+}
+
+// Stands in for a camera's stream when there is no camera.
+class OfflineStream : public libcamera::Stream
+{
+public:
+	OfflineStream(libcamera::StreamConfiguration const &config) { configuration_ = config; }
+};
+
+void RPiCamApp::ConfigureOffline(unsigned int buffer_count)
+{
+	LOG(2, "Configuring offline streams...");
+
+	if (!options_->Get().post_process_file.empty())
+	{
+		post_processor_.LoadModules(options_->Get().post_process_libs);
+		post_processor_.Read(options_->Get().post_process_file);
+	}
+	post_processor_.SetCallback(
+		[this](CompletedRequestPtr &r) { this->msg_queue_.PostLockFree(Msg(MsgType::RequestComplete, std::move(r))); });
+
+	auto make_config = [buffer_count](libcamera::PixelFormat format, unsigned int width, unsigned int height) {
+		StreamConfiguration config;
+		config.pixelFormat = format;
+		config.size = Size(width & ~1, height & ~1);
+		config.bufferCount = buffer_count;
+		config.colorSpace = libcamera::ColorSpace::Rec709;
+		return config;
+	};
+
+	// The strides the ISP would give, unless a stage has asked for a stride of its own.
+	auto finish_config = [](StreamConfiguration &config) {
+		const bool yuv = config.pixelFormat == libcamera::formats::YUV420;
+		const unsigned int min_stride = yuv ? config.size.width : config.size.width * 3;
+		if (config.stride < min_stride)
+			config.stride = (min_stride + 63) & ~63;
+		config.frameSize = yuv ? config.stride * config.size.height * 3 / 2 : config.stride * config.size.height;
+	};
+
+	std::vector<std::pair<std::string, StreamConfiguration>> configs;
+	const unsigned int width = options_->Get().width ? options_->Get().width : 1920;
+	const unsigned int height = options_->Get().height ? options_->Get().height : 1080;
+	configs.emplace_back("video", make_config(libcamera::formats::YUV420, width, height));
+	post_processor_.AdjustConfig("video", &configs.back().second);
+	if (options_->Get().lores_width && options_->Get().lores_height)
+	{
+		configs.emplace_back("lores",
+							 make_config(lores_format_, options_->Get().lores_width, options_->Get().lores_height));
+		post_processor_.AdjustConfig("lores", &configs.back().second);
+	}
+
+	for (auto &[name, config] : configs)
+	{
+		finish_config(config);
+		offline_streams_.push_back(std::make_unique<OfflineStream>(config));
+		streams_[name] = offline_streams_.back().get();
+		allocateBuffers(offline_streams_.back().get(), config);
+		LOG(2, "Offline " << name << " stream: " << config.toString() << " stride " << config.stride);
+	}
+
+	post_processor_.Configure();
+
+	LOG(2, "Offline streams configured");
+}
+
+void RPiCamApp::StartOffline()
+{
+	msg_queue_stats_.Reset();
+	msg_queue_.SetLimit(options_->Get().queue_policy, options_->Get().queue_depth, &msg_queue_stats_);
+	msg_queue_.SetAbort(false);
+
+	post_processor_.Start();
+}
+
+void RPiCamApp::ProcessOffline(CompletedRequestPtr &request)
+{
+	post_processor_.Process(request);
+}
+
+void RPiCamApp::StopOffline()
+{
+	msg_queue_.SetAbort(true);
+	post_processor_.Stop();
+	msg_queue_.Clear();
+}
+
+std::vector<libcamera::FrameBuffer *> RPiCamApp::GetBuffers(Stream *stream) const
+{
+	std::vector<FrameBuffer *> buffers;
+	std::lock_guard<std::mutex> lock(frame_buffers_mutex_);
+	auto it = frame_buffers_.find(stream);
+	if (it != frame_buffers_.end())
+	{
+		for (auto const &fb : it->second)
+			buffers.push_back(fb.get());
+	}
+	return buffers;
+}
+
+// A region of interest as fractions of the sensor area, as --roi gives them, in sensor pixels.
+static libcamera::Rectangle roi_to_crop(float x, float y, float width, float height,
+										libcamera::Rectangle const &sensor_area)
+{
+	libcamera::Rectangle crop(x * sensor_area.width, y * sensor_area.height, width * sensor_area.width,
+							  height * sensor_area.height);
+	crop.translateBy(sensor_area.topLeft());
+	return crop;
 }
 
 void RPiCamApp::StartCamera()
@@ -638,40 +973,73 @@ void RPiCamApp::StartCamera()
 	// This makes all the Request objects that we shall need.
 	makeRequests();
 
+	retired_requests_.clear();
+	active_requests_ = requests_.size();
+	if (options_->Get().adaptive_buffers)
+	{
+		buffer_tuner_ = std::make_unique<BufferTuner>(options_->Get().adaptive_buffers_min,
+													  options_->Get().adaptive_buffers_max);
+		// requestComplete looks up the pool without a lock, so it must never reallocate as we grow.
+		completed_request_pool_.reserve(std::max<std::size_t>(buffer_tuner_->Max(), requests_.size()));
+		LOG(2, "Adaptive buffers: starting with " << requests_.size() << ", between " << buffer_tuner_->Min()
+												 << " and " << buffer_tuner_->Max());
+	}
+	else
+		buffer_tuner_.reset();
+
+	// By now the encoder and post-processing stages have been configured too. Only the first start is reported,
+	// so that timelapses and mode switches don't repeat it.
+	if (options_->Get().memory_report && !memory_reported_)
+	{
+		MemoryReport::Get().Write(std::cerr, "once configured");
+		memory_reported_ = true;
+	}
+
 	// Build a list of initial controls that we must set in the camera before starting it.
 	// We don't overwrite anything the application may have set before calling us.
-	if (!controls_.get(controls::ScalerCrop) && !controls_.get(controls::rpi::ScalerCrops))
+	// SetRoi() may be changing the crops from the control socket's thread.
 	{
-		const Rectangle sensor_area = camera_->controls().at(&controls::ScalerCrop).max().get<Rectangle>();
-		const Rectangle default_crop = camera_->controls().at(&controls::ScalerCrop).def().get<Rectangle>();
-		std::vector<Rectangle> crops;
-
-		if (options_->Get().roi_width != 0 && options_->Get().roi_height != 0)
-		{
-			int x = options_->Get().roi_x * sensor_area.width;
-			int y = options_->Get().roi_y * sensor_area.height;
-			unsigned int w = options_->Get().roi_width * sensor_area.width;
-			unsigned int h = options_->Get().roi_height * sensor_area.height;
-			crops.push_back({ x, y, w, h });
-			crops.back().translateBy(sensor_area.topLeft());
-		}
-		else
+		std::lock_guard<std::mutex> lock(control_mutex_);
+		crops_.clear();
+		if (!controls_.get(controls::ScalerCrop) && !controls_.get(controls::rpi::ScalerCrops))
 		{
-			crops.push_back(default_crop);
-		}
+			const Rectangle sensor_area = camera_->controls().at(&controls::ScalerCrop).max().get<Rectangle>();
+			const Rectangle default_crop = camera_->controls().at(&controls::ScalerCrop).def().get<Rectangle>();
+			OptsInternal const &options = options_->Get();
 
-		LOG(2, "Using crop (main) " << crops.back().toString());
+			if (options.roi_width != 0 && options.roi_height != 0)
+				crops_.push_back(roi_to_crop(options.roi_x, options.roi_y, options.roi_width, options.roi_height,
+											 sensor_area));
+			else
+				crops_.push_back(default_crop);
 
-		if (options_->Get().lores_width != 0 && options_->Get().lores_height != 0 && !options_->Get().lores_par)
-		{
-			crops.push_back(crops.back());
-			LOG(2, "Using crop (lores) " << crops.back().toString());
-		}
+			LOG(2, "Using crop (main) " << crops_.back().toString());
 
-		if (options_->GetPlatform() == Platform::VC4)
-			controls_.set(controls::ScalerCrop, crops[0]);
-		else
-			controls_.set(controls::rpi::ScalerCrops, libcamera::Span<const Rectangle>(crops.data(), crops.size()));
+			bool lores_roi = options.lores_roi_width != 0 && options.lores_roi_height != 0;
+			lores_follows_main_ = !lores_roi;
+			if (options.lores_width != 0 && options.lores_height != 0 && !options.lores_par)
+			{
+				if (lores_roi && options_->GetPlatform() == Platform::VC4)
+				{
+					LOG_ERROR("WARNING: lores-roi ignored, this ISP applies one crop to every stream");
+					lores_follows_main_ = true;
+				}
+				if (lores_follows_main_)
+					crops_.push_back(crops_.back());
+				else
+					crops_.push_back(roi_to_crop(options.lores_roi_x, options.lores_roi_y, options.lores_roi_width,
+												 options.lores_roi_height, sensor_area));
+				LOG(2, "Using crop (lores) " << crops_.back().toString());
+			}
+			else if (lores_roi)
+				LOG_ERROR("WARNING: lores-roi ignored, as there is no lores stream with its own crop");
+
+			if (options_->GetPlatform() == Platform::VC4)
+				controls_.set(controls::ScalerCrop, crops_[0]);
+			else
+				controls_.set(controls::rpi::ScalerCrops,
+							  libcamera::Span<const Rectangle>(crops_.data(), crops_.size()));
+		}
 	}
 
 	if (!controls_.get(controls::AfWindows) && !controls_.get(controls::AfMetering) &&
@@ -803,9 +1171,28 @@ void RPiCamApp::StartCamera()
 	controls_.clear();
 	camera_started_ = true;
 	last_timestamp_ = 0;
+	last_sensor_sequence_.reset();
+	sensor_frames_dropped_ = 0;
+
+	if (!options_->Get().trace_file.empty() && FrameTrace::Get().Start(options_->Get().trace_file))
+		trace_started_ = true;
+	PerfCounters::Enable(options_->Get().perf_counters);
+
+	msg_queue_stats_.Reset();
+	msg_queue_.SetLimit(options_->Get().queue_policy, options_->Get().queue_depth, &msg_queue_stats_);
+	msg_queue_.SetAbort(false);
 
 	post_processor_.Start();
 
+	if (!options_->Get().stats_socket.empty())
+		stats_server_ = std::make_unique<StatsServer>(options_->Get().stats_socket, [this]() {
+			std::stringstream ss;
+			ss << "{";
+			writeStats(ss);
+			ss << "}" << std::endl;
+			return ss.str();
+		});
+
 	camera_->requestCompleted.connect(this, &RPiCamApp::requestComplete);
 
 	for (std::unique_ptr<Request> &request : requests_)
@@ -815,10 +1202,26 @@ void RPiCamApp::StartCamera()
 	}
 
 	LOG(2, "Camera started!");
+	startupMark("camera started");
 }
 
 void RPiCamApp::StopCamera()
 {
+	// Nothing will drain the message queue while we stop, so don't let anyone block on it.
+	msg_queue_.SetAbort(true);
+	stopStatsServer();
+
+	if (camera_started_ && buffer_tuner_)
+		LOG(1, "Adaptive buffers: finished with " << active_requests_ << " requests, at most "
+												   << buffer_tuner_->Peak() << " were held at once");
+
+	if (camera_started_ && options_->Get().queue_depth)
+	{
+		for (auto const &[name, stats] : GetQueueStats())
+			LOG(1, "Queue " << name << ": dropped " << stats->dropped << ", blocked " << stats->blocked
+							<< ", max depth " << stats->max_depth);
+	}
+
 	{
 		// We don't want QueueRequest to run asynchronously while we stop the camera.
 		std::lock_guard<std::mutex> lock(camera_stop_mutex_);
@@ -838,11 +1241,23 @@ void RPiCamApp::StopCamera()
 
 	// An application might be holding a CompletedRequest, so queueRequest will get
 	// called to delete it later, but we need to know not to try and re-queue it.
-	completed_requests_.clear();
+	// Those objects leave the pool and become queueRequest's to delete.
+	{
+		std::lock_guard<std::mutex> stop_lock(camera_stop_mutex_);
+		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
+		for (auto &completed_request : completed_request_pool_)
+		{
+			if (completed_requests_.count(completed_request.get()))
+				completed_request.release();
+		}
+		completed_request_pool_.clear();
+		completed_requests_.clear();
+	}
 
 	msg_queue_.Clear();
 
 	requests_.clear();
+	retired_requests_.clear();
 
 	controls_.clear(); // no need for mutex here
 
@@ -850,15 +1265,96 @@ void RPiCamApp::StopCamera()
 		LOG(2, "Camera stopped!");
 }
 
+std::vector<std::pair<std::string, QueueStats const *>> RPiCamApp::GetQueueStats() const
+{
+	return { { "post-processor", &post_processor_.GetQueueStats() }, { "application", &msg_queue_stats_ } };
+}
+
+void RPiCamApp::writeStats(std::ostream &os) const
+{
+	os << "\"framerate\":" << framerate_.load(std::memory_order_relaxed);
+	os << ",\"requests\":" << active_requests_.load(std::memory_order_relaxed);
+
+	os << ",\"queues\":{";
+	bool first = true;
+	for (auto const &[name, stats] : GetQueueStats())
+	{
+		os << (first ? "" : ",") << "\"" << name << "\":{\"dropped\":" << stats->dropped
+		   << ",\"blocked\":" << stats->blocked << ",\"max_depth\":" << stats->max_depth << "}";
+		first = false;
+	}
+	os << "}";
+
+	os << ",\"stages\":{";
+	first = true;
+	for (auto const &[name, timing] : post_processor_.GetStageTimings())
+	{
+		os << (first ? "" : ",") << "\"" << name << "\":{\"count\":" << timing->count
+		   << ",\"total_us\":" << timing->total_us << ",\"skipped\":" << timing->skipped
+		   << ",\"histogram_log2_us\":[";
+		for (unsigned int i = 0; i < TimingHistogram::NumBuckets; i++)
+			os << (i ? "," : "") << timing->buckets[i];
+		os << "]}";
+		first = false;
+	}
+	os << "}";
+
+	if (PerfCounters::Enabled())
+	{
+		os << ",\"perf\":{";
+		first = true;
+		for (auto const &[name, totals] : PerfCounters::AllTotals())
+		{
+			os << (first ? "" : ",") << "\"" << name << "\":{\"count\":" << totals->count
+			   << ",\"cycles\":" << totals->cycles << ",\"instructions\":" << totals->instructions
+			   << ",\"cache_misses\":" << totals->cache_misses
+			   << ",\"context_switches\":" << totals->context_switches << "}";
+			first = false;
+		}
+		os << "}";
+	}
+}
+
+void RPiCamApp::stopStatsServer()
+{
+	stats_server_.reset();
+}
+
 RPiCamApp::Msg RPiCamApp::Wait()
 {
-	return msg_queue_.Wait();
+	Msg msg = msg_queue_.Wait();
+	if (!startup_reported_ && msg.type == MsgType::RequestComplete)
+		reportStartup();
+	return msg;
 }
 
-void RPiCamApp::queueRequest(CompletedRequest *completed_request)
+void RPiCamApp::startupMark(char const *what)
 {
-	BufferMap buffers(std::move(completed_request->buffers));
+	if (!startup_reported_ && options_->Get().startup_profile)
+		startup_marks_.emplace_back(what, std::chrono::steady_clock::now());
+}
+
+void RPiCamApp::reportStartup()
+{
+	startupMark("first frame");
+	startup_reported_ = true;
+	if (!options_->Get().startup_profile)
+		return;
 
+	using ms = std::chrono::duration<double, std::milli>;
+	auto previous = startup_time_;
+	LOG(1, "Startup profile:");
+	for (auto const &[what, when] : startup_marks_)
+	{
+		LOG(1, "    " << what << ": " << ms(when - startup_time_).count() << "ms (+" << ms(when - previous).count()
+						<< "ms)");
+		previous = when;
+	}
+	startup_marks_.clear();
+}
+
+void RPiCamApp::queueRequest(CompletedRequest *completed_request)
+{
 	// This function may run asynchronously so needs protection from the
 	// camera stopping at the same time.
 	std::lock_guard<std::mutex> stop_lock(camera_stop_mutex_);
@@ -866,8 +1362,10 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 	// An application could be holding a CompletedRequest while it stops and re-starts
 	// the camera, after which we don't want to queue another request now.
 	bool request_found;
+	unsigned int held;
 	{
 		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
+		held = completed_requests_.size();
 		auto it = completed_requests_.find(completed_request);
 		if (it != completed_requests_.end())
 		{
@@ -878,30 +1376,70 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 			request_found = false;
 	}
 
+	// Anything not found was still held when the camera stopped, and is no longer in the pool.
+	if (!request_found)
+	{
+		delete completed_request;
+		return;
+	}
+
 	Request *request = completed_request->request;
-	delete completed_request;
 	assert(request);
 
-	if (!camera_started_ || !request_found)
+	if (!camera_started_)
 		return;
 
-	for (auto const &p : buffers)
+	// Growing happens here, rather than in requestComplete, so that everything that changes the set of
+	// requests and buffers is serialised by the camera_stop_mutex_.
+	bool retire = false;
+	if (buffer_tuner_)
+	{
+		int change = buffer_tuner_->Update(held, active_requests_);
+		if (change < 0)
+			retire = true;
+		for (int i = 0; i < change; i++)
+			addRequest();
+		if (change > 0)
+			LOG(1, "Adaptive buffers: grew to " << active_requests_ << " requests");
+	}
+
+	for (auto const &p : completed_request->buffers)
 	{
-		struct dma_buf_sync dma_sync {};
-		dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+		{
+			std::shared_lock<std::shared_mutex> lock(mapped_buffers_mutex_);
+			if (!mapped_buffers_.count(p.second))
+				throw std::runtime_error("failed to identify queue request buffer");
+		}
+
+		// Only end a CPU read access if one was actually started on this buffer.
+		bool read_synced;
+		{
+			std::lock_guard<std::mutex> lock(buffer_sync_mutex_);
+			read_synced = read_synced_buffers_.erase(p.second);
+		}
 
-		auto it = mapped_buffers_.find(p.second);
-		if (it == mapped_buffers_.end())
-			throw std::runtime_error("failed to identify queue request buffer");
+		if (read_synced)
+		{
+			struct dma_buf_sync dma_sync {};
+			dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
 
-		int ret = ::ioctl(p.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-		if (ret)
-			throw std::runtime_error("failed to sync dma buf on queue request");
+			int ret = ::ioctl(p.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+			if (ret)
+				throw std::runtime_error("failed to sync dma buf on queue request");
+		}
 
-		if (request->addBuffer(p.first, p.second) < 0)
+		if (!retire && request->addBuffer(p.first, p.second) < 0)
 			throw std::runtime_error("failed to add buffer to request in QueueRequest");
 	}
 
+	// Any pending controls stay where they are, for the next request to pick up.
+	if (retire)
+	{
+		retireRequest(request, completed_request->buffers);
+		LOG(1, "Adaptive buffers: shrank to " << active_requests_ << " requests");
+		return;
+	}
+
 	{
 		std::lock_guard<std::mutex> lock(control_mutex_);
 		request->controls() = std::move(controls_);
@@ -916,6 +1454,23 @@ void RPiCamApp::PostMessage(MsgType &t, MsgPayload &p)
 	msg_queue_.Post(Msg(t, std::move(p)));
 }
 
+std::string RPiCamApp::RequestReconfigure(std::string const &command)
+{
+	// Restarting the camera takes a while, but the event loop might be gone altogether.
+	static constexpr std::chrono::seconds REPLY_TIMEOUT(10);
+
+	ReconfigureRequest request = ReconfigureRequest::Parse(command);
+	request.reply = std::make_shared<std::promise<std::string>>();
+	std::future<std::string> reply = request.reply->get_future();
+	MsgType type = MsgType::Reconfigure;
+	MsgPayload payload = std::move(request);
+	PostMessage(type, payload);
+	if (reply.wait_for(REPLY_TIMEOUT) != std::future_status::ready)
+		return "error: timed out waiting for the reconfiguration";
+	// A request dropped unanswered, as the camera stopped, reads as a broken promise.
+	return reply.get();
+}
+
 libcamera::Stream *RPiCamApp::GetStream(std::string const &name, StreamInfo *info) const
 {
 	auto it = streams_.find(name);
@@ -972,6 +1527,15 @@ const libcamera::CameraManager *RPiCamApp::GetCameraManager()
 
 void RPiCamApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *stream)
 {
+	// The lores stream keeps the cost of the preview the same whatever size the main stream is.
+	if (options_->Get().preview_lores)
+	{
+		Stream *lores = LoresStream();
+		if (lores && lores != stream && lores->configuration().pixelFormat == libcamera::formats::YUV420 &&
+			completed_request->buffers.count(lores))
+			stream = lores;
+	}
+
 	std::lock_guard<std::mutex> lock(preview_item_mutex_);
 	if (!preview_item_.stream)
 		preview_item_ = PreviewItem(completed_request, stream); // copy the shared_ptr here
@@ -980,6 +1544,88 @@ void RPiCamApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *stre
 	preview_cond_var_.notify_one();
 }
 
+void RPiCamApp::SetFramerate(float framerate)
+{
+	if (framerate <= 0)
+		throw std::runtime_error("invalid framerate " + std::to_string(framerate));
+
+	options_->Set().framerate = framerate;
+	int64_t frame_time = 1000000 / framerate; // in us
+	ControlList controls;
+	controls.set(controls::FrameDurationLimits, libcamera::Span<const int64_t, 2>({ frame_time, frame_time }));
+	SetControls(controls);
+}
+
+RPiCamApp::ReconfigureRequest RPiCamApp::ReconfigureRequest::Parse(std::string const &command)
+{
+	auto parse_size = [](std::string const &s) {
+		unsigned int width, height;
+		char x;
+		std::istringstream in(s);
+		if (!(in >> width >> x >> height) || x != 'x')
+			throw std::runtime_error("bad size " + s);
+		return libcamera::Size(width, height);
+	};
+
+	ReconfigureRequest request;
+	std::istringstream in(command);
+	std::string what, value;
+	while (in >> what)
+	{
+		if (!(in >> value))
+			throw std::runtime_error("missing value for " + what);
+
+		if (what == "resolution")
+			request.size = parse_size(value);
+		else if (what == "lores")
+			request.lores_size = value == "off" ? libcamera::Size(0, 0) : parse_size(value);
+		else if (what == "framerate")
+			request.framerate = std::stof(value);
+		else
+			throw std::runtime_error("unknown setting " + what);
+	}
+	return request;
+}
+
+void RPiCamApp::SetRoi(std::string const &stream_name, std::string const &roi)
+{
+	float x, y, width, height;
+	if (sscanf(roi.c_str(), "%f,%f,%f,%f", &x, &y, &width, &height) != 4 || width <= 0 || height <= 0 || x < 0 ||
+		y < 0 || x + width > 1 || y + height > 1)
+		throw std::runtime_error("RPiCamApp: bad region of interest " + roi);
+
+	bool vc4 = options_->GetPlatform() == Platform::VC4;
+	const Rectangle sensor_area = camera_->controls().at(&controls::ScalerCrop).max().get<Rectangle>();
+	// StartCamera() sets the crops up afresh, under the same lock.
+	std::lock_guard<std::mutex> lock(control_mutex_);
+	if (crops_.empty())
+		throw std::runtime_error("RPiCamApp: the crop is not under our control");
+
+	unsigned int index;
+	if (stream_name == "video" || stream_name == "main")
+		index = 0;
+	else if (stream_name == "lores")
+	{
+		if (vc4 || crops_.size() < 2)
+			throw std::runtime_error("RPiCamApp: the lores stream has no crop of its own");
+		index = 1;
+	}
+	else
+		throw std::runtime_error("RPiCamApp: no crop for stream " + stream_name);
+
+	crops_[index] = roi_to_crop(x, y, width, height, sensor_area);
+	if (index == 1)
+		lores_follows_main_ = false;
+	else if (crops_.size() > 1 && lores_follows_main_)
+		crops_[1] = crops_[0];
+	LOG(2, "Using crop (" << (index ? "lores" : "main") << ") " << crops_[index].toString());
+
+	if (vc4)
+		controls_.set(controls::ScalerCrop, crops_[0]);
+	else
+		controls_.set(controls::rpi::ScalerCrops, libcamera::Span<const Rectangle>(crops_.data(), crops_.size()));
+}
+
 void RPiCamApp::SetControls(const ControlList &controls)
 {
 	std::lock_guard<std::mutex> lock(control_mutex_);
@@ -1003,18 +1649,36 @@ StreamInfo RPiCamApp::GetStreamInfo(Stream const *stream) const
 	return info;
 }
 
-void RPiCamApp::setupCapture()
+void RPiCamApp::setupCapture(StreamConfiguration *lores_config)
 {
 	// First finish setting up the configuration.
 
 	for (auto &config : *configuration_)
 		config.stride = 0;
+	// In the low memory profile, streams get as few buffers as will keep them running, unless a count was given.
+	if (options_->Get().low_memory && !options_->Get().buffer_count && !options_->Get().viewfinder_buffer_count)
+	{
+		for (auto &config : *configuration_)
+			config.bufferCount = std::min(config.bufferCount, LOW_MEMORY_BUFFER_COUNT);
+	}
+	// Stages may want a particular lores stride, perhaps so that an accelerator can read the buffers
+	// without any copying. Validation may still adjust it.
+	if (lores_config)
+		post_processor_.AdjustConfig("lores", lores_config);
 	CameraConfiguration::Status validation = configuration_->validate();
 	if (validation == CameraConfiguration::Invalid)
 		throw std::runtime_error("failed to valid stream configurations");
 	else if (validation == CameraConfiguration::Adjusted)
 		LOG(1, "Stream configuration adjusted");
 
+	std::size_t capture_bytes = 0;
+	for (StreamConfiguration const &config : *configuration_)
+		capture_bytes += static_cast<std::size_t>(config.bufferCount) * config.frameSize;
+	std::size_t budget = static_cast<std::size_t>(options_->Get().memory_budget) << 20;
+	if (budget && capture_bytes > budget)
+		throw std::runtime_error("capture buffers would need " + std::to_string(capture_bytes >> 20) +
+								 "MB, more than the memory budget of " + std::to_string(budget >> 20) + "MB");
+
 	if (camera_->configure(configuration_.get()) < 0)
 		throw std::runtime_error("failed to configure streams");
 	LOG(2, "Camera streams configured");
@@ -1023,35 +1687,16 @@ void RPiCamApp::setupCapture()
 	for (auto const &[id, info] : camera_->controls())
 		LOG(2, "    " << id->name() << " : " << info.toString());
 
-	// Next allocate all the buffers we need, mmap them and store them on a free list.
-
-	for (StreamConfiguration &config : *configuration_)
-	{
-		Stream *stream = config.stream();
-		std::vector<std::unique_ptr<FrameBuffer>> fb;
-
-		for (unsigned int i = 0; i < config.bufferCount; i++)
-		{
-			std::string name("rpicam-apps" + std::to_string(i));
-			libcamera::UniqueFD fd = dma_heap_.alloc(name.c_str(), config.frameSize);
-
-			if (!fd.isValid())
-				throw std::runtime_error("failed to allocate capture buffers for stream");
-
-			std::vector<FrameBuffer::Plane> plane(1);
-			plane[0].fd = libcamera::SharedFD(std::move(fd));
-			plane[0].offset = 0;
-			plane[0].length = config.frameSize;
+	// Next get all the buffers we need, already mmapped, and store them on a free list. Buffers
+	// left over from a previous configuration are reused where possible.
 
-			fb.push_back(std::make_unique<FrameBuffer>(plane));
-			void *memory = mmap(NULL, config.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, plane[0].fd.get(), 0);
-			mapped_buffers_[fb.back().get()].push_back(
-						libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), config.frameSize));
-		}
+	dma_heap_pool_.setMaxSize(static_cast<std::size_t>(options_->Get().buffer_pool_size) << 20);
 
-		frame_buffers_[stream] = std::move(fb);
-	}
+	for (StreamConfiguration &config : *configuration_)
+		allocateBuffers(config.stream(), config);
 	LOG(2, "Buffers allocated and mapped");
+	updateMemoryReport();
+	startupMark("camera configured");
 
 	startPreview();
 
@@ -1062,11 +1707,14 @@ void RPiCamApp::makeRequests()
 {
 	std::map<Stream *, std::queue<FrameBuffer *>> free_buffers;
 
-	for (auto &kv : frame_buffers_)
 	{
-		free_buffers[kv.first] = {};
-		for (auto &b : kv.second)
-			free_buffers[kv.first].push(b.get());
+		std::lock_guard<std::mutex> lock(frame_buffers_mutex_);
+		for (auto &kv : frame_buffers_)
+		{
+			free_buffers[kv.first] = {};
+			for (auto &b : kv.second)
+				free_buffers[kv.first].push(b.get());
+		}
 	}
 
 	while (true)
@@ -1081,9 +1729,11 @@ void RPiCamApp::makeRequests()
 					LOG(2, "Requests created");
 					return;
 				}
-				std::unique_ptr<Request> request = camera_->createRequest();
+				// The cookie tells requestComplete which pooled CompletedRequest belongs to this request.
+				std::unique_ptr<Request> request = camera_->createRequest(requests_.size());
 				if (!request)
 					throw std::runtime_error("failed to make request");
+				completed_request_pool_.push_back(std::make_unique<CompletedRequest>(request.get()));
 				requests_.push_back(std::move(request));
 			}
 			else if (free_buffers[stream].empty())
@@ -1097,8 +1747,97 @@ void RPiCamApp::makeRequests()
 	}
 }
 
+void RPiCamApp::addRequest()
+{
+	if (!retired_requests_.empty())
+	{
+		// Its buffers were never freed, so there's nothing more to allocate.
+		auto [request, buffers] = std::move(retired_requests_.back());
+		retired_requests_.pop_back();
+		for (auto const &[stream, fb] : buffers)
+		{
+			if (request->addBuffer(stream, fb) < 0)
+				throw std::runtime_error("failed to add buffer to request");
+		}
+		if (camera_->queueRequest(request) < 0)
+			throw std::runtime_error("failed to queue request");
+		active_requests_++;
+		return;
+	}
+	else if (requests_.size() == completed_request_pool_.capacity())
+		return;
+
+	std::size_t budget = static_cast<std::size_t>(options_->Get().memory_budget) << 20;
+	if (budget)
+	{
+		std::size_t request_bytes = 0;
+		for (StreamConfiguration const &config : *configuration_)
+			request_bytes += config.frameSize;
+		if (captureBufferBytes() + request_bytes > budget)
+		{
+			LOG(2, "Not adding a request, as its buffers would go over the memory budget");
+			return;
+		}
+	}
+
+	std::unique_ptr<Request> new_request = camera_->createRequest(requests_.size());
+	if (!new_request)
+		throw std::runtime_error("failed to make request");
+	completed_request_pool_.push_back(std::make_unique<CompletedRequest>(new_request.get()));
+	Request *request = new_request.get();
+	requests_.push_back(std::move(new_request));
+
+	for (StreamConfiguration &config : *configuration_)
+	{
+		std::string name("rpicam-apps" + std::to_string(request->cookie()));
+		DmaHeapPool::Buffer buffer = dma_heap_pool_.acquire(name.c_str(), config.frameSize);
+		if (!buffer.mem)
+			throw std::runtime_error("failed to allocate capture buffers for stream");
+
+		std::vector<FrameBuffer::Plane> plane(1);
+		plane[0].fd = buffer.fd;
+		plane[0].offset = 0;
+		plane[0].length = config.frameSize;
+
+		std::unique_ptr<FrameBuffer> fb = std::make_unique<FrameBuffer>(plane);
+		{
+			std::unique_lock<std::shared_mutex> lock(mapped_buffers_mutex_);
+			mapped_buffers_[fb.get()].push_back(
+				libcamera::Span<uint8_t>(static_cast<uint8_t *>(buffer.mem), config.frameSize));
+		}
+		if (request->addBuffer(config.stream(), fb.get()) < 0)
+			throw std::runtime_error("failed to add buffer to request");
+		{
+			std::lock_guard<std::mutex> lock(frame_buffers_mutex_);
+			frame_buffers_[config.stream()].push_back(std::move(fb));
+		}
+		dma_buffers_.push_back(std::move(buffer));
+	}
+
+	if (camera_->queueRequest(request) < 0)
+		throw std::runtime_error("failed to queue request");
+	active_requests_++;
+	updateMemoryReport();
+}
+
+void RPiCamApp::retireRequest(Request *request, CompletedRequest::BufferMap const &buffers)
+{
+	// The request just isn't queued again. Freeing its buffers now would leave the previews and GL stages
+	// with stale imports of them, which a new buffer could be mistaken for, should it reuse the fd or address.
+	retired_requests_.emplace_back(request, buffers);
+	active_requests_--;
+}
+
 void RPiCamApp::requestComplete(Request *request)
 {
+	// This runs on libcamera's own thread, so there's no earlier point at which we could set it up.
+	static thread_local bool thread_configured = false;
+	if (!thread_configured)
+	{
+		ThreadConfig::Get().Apply("callback");
+		thread_configured = true;
+	}
+
 	if (request->status() == Request::RequestCancelled)
 	{
 		// If the request is cancelled while the camera is still running, it indicates
@@ -1109,28 +1848,21 @@ void RPiCamApp::requestComplete(Request *request)
 		return;
 	}
 
-	struct dma_buf_sync dma_sync {};
-	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
-	for (auto const &buffer_map : request->buffers())
-	{
-		auto it = mapped_buffers_.find(buffer_map.second);
-		if (it == mapped_buffers_.end())
-			throw std::runtime_error("failed to identify request complete buffer");
-
-		int ret = ::ioctl(buffer_map.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-		if (ret)
-			throw std::runtime_error("failed to sync dma buf on request complete");
-	}
+	// Cache synchronisation for any CPU reads is deferred until the first BufferReadSync on each buffer.
 
-	CompletedRequest *r = new CompletedRequest(sequence_++, request);
-	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
+	CompletedRequest *r = completed_request_pool_[request->cookie()].get();
+	r->Fill(sequence_++);
+	CompletedRequestPtr payload(
+		r, [this](CompletedRequest *cr) { this->queueRequest(cr); }, BlockAllocator<CompletedRequest>());
 	{
 		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
 		completed_requests_.insert(r);
 	}
 
-	// Framebuffer reports possibly being in a startup or error state, ignore these.
-	if (r->buffers.begin()->second->metadata().status != libcamera::FrameMetadata::FrameSuccess)
+	// Framebuffer reports possibly being in a startup or error state, ignore these. A request with no
+	// buffers at all tells us nothing about the frame, and everything below reads the first one.
+	if (r->buffers.empty() ||
+		r->buffers.begin()->second->metadata().status != libcamera::FrameMetadata::FrameSuccess)
 		return;
 
 	// We calculate the instantaneous framerate in case anyone wants it.
@@ -1143,10 +1875,105 @@ void RPiCamApp::requestComplete(Request *request)
 	else
 		payload->framerate = 1e9 / (timestamp - last_timestamp_);
 	last_timestamp_ = timestamp;
+	framerate_.store(payload->framerate, std::memory_order_relaxed);
+
+	uint32_t sensor_sequence = payload->buffers.begin()->second->metadata().sequence;
+	if (last_sensor_sequence_ && sensor_sequence - *last_sensor_sequence_ > 1)
+		sensor_frames_dropped_.fetch_add(sensor_sequence - *last_sensor_sequence_ - 1, std::memory_order_relaxed);
+	last_sensor_sequence_ = sensor_sequence;
+
+	if (FrameTrace::Get().Enabled() && ts)
+		FrameTrace::Get().Record("capture", "camera", payload->sequence, FrameTrace::NO_ID, *ts, FrameTrace::Now());
 
 	post_processor_.Process(payload); // post-processor can re-use our shared_ptr
 }
 
+void RPiCamApp::allocateBuffers(Stream *stream, StreamConfiguration const &config)
+{
+	std::vector<std::unique_ptr<FrameBuffer>> fb;
+
+	for (unsigned int i = 0; i < config.bufferCount; i++)
+	{
+		std::string name("rpicam-apps" + std::to_string(i));
+		DmaHeapPool::Buffer buffer = dma_heap_pool_.acquire(name.c_str(), config.frameSize);
+
+		if (!buffer.mem)
+			throw std::runtime_error("failed to allocate capture buffers for stream");
+
+		std::vector<FrameBuffer::Plane> plane(1);
+		plane[0].fd = buffer.fd;
+		plane[0].offset = 0;
+		plane[0].length = config.frameSize;
+
+		fb.push_back(std::make_unique<FrameBuffer>(plane));
+		mapped_buffers_[fb.back().get()].push_back(
+					libcamera::Span<uint8_t>(static_cast<uint8_t *>(buffer.mem), config.frameSize));
+		dma_buffers_.push_back(std::move(buffer));
+	}
+
+	std::lock_guard<std::mutex> lock(frame_buffers_mutex_);
+	frame_buffers_[stream] = std::move(fb);
+}
+
+std::size_t RPiCamApp::captureBufferBytes() const
+{
+	std::size_t bytes = 0;
+	std::lock_guard<std::mutex> lock(frame_buffers_mutex_);
+	for (auto const &[stream, buffers] : frame_buffers_)
+		bytes += buffers.size() * stream->configuration().frameSize;
+	return bytes;
+}
+
+void RPiCamApp::updateMemoryReport()
+{
+	// A stream can go by more than one name (the ZSL viewfinder is also the lores stream), but is only counted once.
+	std::set<Stream const *> counted;
+	std::lock_guard<std::mutex> lock(frame_buffers_mutex_);
+	for (char const *name : { "still", "video", "viewfinder", "lores", "raw" })
+	{
+		std::size_t bytes = 0;
+		auto it = streams_.find(name);
+		if (it != streams_.end() && counted.insert(it->second).second)
+		{
+			auto buffers = frame_buffers_.find(it->second);
+			if (buffers != frame_buffers_.end())
+				bytes = buffers->second.size() * it->second->configuration().frameSize;
+		}
+		MemoryReport::Get().Set(std::string("capture ") + name, MemoryReport::Kind::Dma, bytes);
+	}
+	MemoryReport::Get().Set("capture pool (idle)", MemoryReport::Kind::Dma, dma_heap_pool_.pooledSize());
+}
+
+void RPiCamApp::deferBufferWrites(CompletedRequestPtr const &completed_request)
+{
+	std::lock_guard<std::mutex> lock(buffer_sync_mutex_);
+	for (auto const &p : completed_request->buffers)
+		deferred_write_buffers_.insert(p.second);
+}
+
+void RPiCamApp::endBufferWrites(CompletedRequestPtr const &completed_request)
+{
+	for (auto const &p : completed_request->buffers)
+	{
+		bool write_synced;
+		{
+			std::lock_guard<std::mutex> lock(buffer_sync_mutex_);
+			deferred_write_buffers_.erase(p.second);
+			write_synced = write_synced_buffers_.erase(p.second);
+		}
+
+		if (write_synced)
+		{
+			struct dma_buf_sync dma_sync {};
+			dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
+
+			int ret = ::ioctl(p.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+			if (ret)
+				LOG_ERROR("failed to unlock-sync-write dma buf");
+		}
+	}
+}
+
 void RPiCamApp::previewDoneCallback(int fd)
 {
 	std::lock_guard<std::mutex> lock(preview_mutex_);
@@ -1158,6 +1985,28 @@ void RPiCamApp::previewDoneCallback(int fd)
 
 void RPiCamApp::startPreview()
 {
+	// Let the preview get ready for the buffers it will most likely be shown.
+	Stream *stream = GetMainStream();
+	if (options_->Get().preview_lores && LoresStream())
+		stream = LoresStream();
+	unsigned int max_width = 0, max_height = 0;
+	preview_->MaxImageSize(max_width, max_height);
+	StreamInfo info = stream ? GetStreamInfo(stream) : StreamInfo();
+	if (stream && stream->configuration().pixelFormat == libcamera::formats::YUV420 &&
+		(!max_width || info.width <= max_width) && (!max_height || info.height <= max_height))
+	{
+		std::shared_lock<std::shared_mutex> lock(mapped_buffers_mutex_);
+		for (FrameBuffer *buffer : GetBuffers(stream))
+		{
+			auto it = mapped_buffers_.find(buffer);
+			if (it != mapped_buffers_.end() && !it->second.empty())
+				preview_->Prepare(buffer->planes()[0].fd.get(), it->second[0].size(), info);
+		}
+	}
+
+	if (options_->Get().perf_hud)
+		perf_hud_ = std::make_unique<PerfHud>();
+
 	preview_abort_ = false;
 	preview_thread_ = std::thread(&RPiCamApp::previewThread, this);
 }
@@ -1179,6 +2028,7 @@ void RPiCamApp::stopPreview()
 
 void RPiCamApp::previewThread()
 {
+	ThreadConfig::Get().Apply("preview");
 	while (true)
 	{
 		PreviewItem item;
@@ -1199,6 +2049,24 @@ void RPiCamApp::previewThread()
 		if (item.stream->configuration().pixelFormat != libcamera::formats::YUV420)
 			throw std::runtime_error("Preview windows only support YUV420");
 
+		// Drop frames that come too soon, releasing them straight away. Allowing each frame to be half an
+		// interval early stops jitter from dropping the ones that are meant to be shown.
+		if (options_->Get().preview_fps > 0)
+		{
+			auto interval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+				std::chrono::duration<double>(1.0 / options_->Get().preview_fps));
+			auto now = std::chrono::steady_clock::now();
+			if (now + interval / 2 < preview_next_due_)
+			{
+				std::lock_guard<std::mutex> lock(preview_item_mutex_);
+				preview_frames_dropped_++;
+				continue;
+			}
+			if (now - preview_next_due_ > interval)
+				preview_next_due_ = now;
+			preview_next_due_ += interval;
+		}
+
 		StreamInfo info = GetStreamInfo(item.stream);
 		FrameBuffer *buffer = item.completed_request->buffers[item.stream];
 		BufferReadSync r(this, buffer);
@@ -1207,6 +2075,24 @@ void RPiCamApp::previewThread()
 		// Fill the frame info with the ControlList items and ancillary bits.
 		FrameInfo frame_info(item.completed_request);
 
+		if (options_->Get().preview_overlay)
+		{
+			// Detections are in main stream pixels.
+			std::vector<Detection> detections;
+			PreviewOverlay overlay;
+			StreamInfo main_info = GetMainStream() ? GetStreamInfo(GetMainStream()) : StreamInfo();
+			if (!item.completed_request->post_process_metadata.Get("object_detect.results", detections) &&
+				main_info.width && main_info.height)
+			{
+				for (auto const &d : detections)
+					overlay.boxes.push_back({ (float)d.box.x / main_info.width, (float)d.box.y / main_info.height,
+											  (float)d.box.width / main_info.width,
+											  (float)d.box.height / main_info.height });
+			}
+			preview_->SetOverlay(overlay);
+		}
+
+		auto sensor_ts = item.completed_request->metadata.get(controls::SensorTimestamp);
 		int fd = buffer->planes()[0].fd.get();
 		{
 			std::lock_guard<std::mutex> lock(preview_mutex_);
@@ -1220,11 +2106,36 @@ void RPiCamApp::previewThread()
 		}
 		preview_frames_displayed_++;
 		preview_->Show(fd, span, info);
+
+		// The HUD goes where the info text goes, or to stderr instead if that can't be seen.
+		bool hud_updated = false;
+		if (perf_hud_)
+		{
+			perf_hud_->FrameShown(frame_info.sequence, sensor_ts ? *sensor_ts : 0);
+			PerfHud::Counters counters;
+			counters.requested_fps = options_->Get().framerate.value_or(0);
+			counters.dropped = sensor_frames_dropped_.load(std::memory_order_relaxed);
+			{
+				std::lock_guard<std::mutex> lock(preview_item_mutex_);
+				counters.dropped += preview_frames_dropped_;
+			}
+			for (auto const &[name, stats] : GetQueueStats())
+				counters.dropped += stats->dropped;
+			counters.stages = post_processor_.GetStageTimings();
+			hud_updated = perf_hud_->Update(counters);
+			if (hud_updated && !preview_->ShowsInfoText())
+				LOG(1, perf_hud_->Text());
+		}
+
 		if (!options_->Get().info_text.empty())
 		{
 			std::string s = frame_info.ToString(options_->Get().info_text);
+			if (perf_hud_ && !perf_hud_->Text().empty())
+				s += " | " + perf_hud_->Text();
 			preview_->SetInfoText(s);
 		}
+		else if (hud_updated)
+			preview_->SetInfoText(perf_hud_->Text());
 	}
 }
 
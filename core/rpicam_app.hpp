@@ -9,12 +9,17 @@
 
 #include <sys/mman.h>
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <future>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -31,14 +36,20 @@
 #include <libcamera/property_ids.h>
 
 #include "core/buffer_sync.hpp"
+#include "core/buffer_tuner.hpp"
 #include "core/completed_request.hpp"
 #include "core/dma_heaps.hpp"
 #include "core/post_processor.hpp"
+#include "core/queue_stats.hpp"
+#include "core/spsc_ring.hpp"
 #include "core/stream_info.hpp"
 
 struct Options;
 class Preview;
+class PerfHud;
+class StatsServer;
 struct Mode;
+class OfflineStream;
 
 namespace controls = libcamera::controls;
 namespace properties = libcamera::properties;
@@ -64,9 +75,22 @@ public:
 	{
 		RequestComplete,
 		Timeout,
-		Quit
+		Quit,
+		Reconfigure
 	};
-	typedef std::variant<CompletedRequestPtr> MsgPayload;
+	// A change to make to the running camera, for example from a control socket. Anything left
+	// unset stays as it is, and a lores size of 0x0 removes the lores stream.
+	struct ReconfigureRequest
+	{
+		std::optional<libcamera::Size> size;
+		std::optional<libcamera::Size> lores_size;
+		std::optional<float> framerate;
+		// Given "ok" or "error: ..." once the request has been acted on, if anyone is waiting to hear.
+		std::shared_ptr<std::promise<std::string>> reply;
+		// Parses commands such as "resolution 1280x720 framerate 15" or "lores off".
+		static ReconfigureRequest Parse(std::string const &command);
+	};
+	typedef std::variant<CompletedRequestPtr, ReconfigureRequest> MsgPayload;
 	struct Msg
 	{
 		Msg(MsgType const &t) : type(t) {}
@@ -140,12 +164,26 @@ public:
 	void ConfigureVideo(unsigned int flags = FLAG_VIDEO_NONE);
 	void ConfigureZsl(unsigned int still_flags = FLAG_STILL_NONE);
 
+	// For tools that put frames from somewhere other than the camera through the post-processing stages.
+	// ConfigureOffline() loads the stages and makes a video stream, and a lores one if asked for, with their
+	// buffers but no camera. Requests passed to ProcessOffline() come back from Wait() just as the camera's
+	// do, and Teardown() undoes it all.
+	void ConfigureOffline(unsigned int buffer_count);
+	void StartOffline();
+	void ProcessOffline(CompletedRequestPtr &request);
+	void StopOffline();
+	std::vector<FrameBuffer *> GetBuffers(Stream *stream) const;
+	PostProcessor &GetPostProcessor() { return post_processor_; }
+
 	void Teardown();
 	void StartCamera();
 	void StopCamera();
 
 	Msg Wait();
 	void PostMessage(MsgType &t, MsgPayload &p);
+	// Parse a reconfiguration command and post it to the event loop, then wait for the reply, which is
+	// what a control socket hands back to its client.
+	std::string RequestReconfigure(std::string const &command);
 
 	Stream *GetStream(std::string const &name, StreamInfo *info = nullptr) const;
 	Stream *ViewfinderStream(StreamInfo *info = nullptr) const;
@@ -164,12 +202,26 @@ public:
 	void ShowPreview(CompletedRequestPtr &completed_request, Stream *stream);
 
 	void SetControls(const ControlList &controls);
+	// Move the crop of the "main" (or "video") or "lores" stream while running, given as fractions of the sensor
+	// area like --roi, for virtual pan and zoom. Only the PiSP ISP can crop the lores stream separately.
+	// Throws std::runtime_error if the region or stream is no good.
+	void SetRoi(std::string const &stream_name, std::string const &roi);
+	// Takes effect on the running camera, without reconfiguring it.
+	void SetFramerate(float framerate);
+	// Turn the post-processing stages with this name on or off while running. Returns false if there are none.
+	bool EnablePostProcessingStage(std::string const &name, bool enable)
+	{
+		return post_processor_.EnableStage(name, enable);
+	}
 	StreamInfo GetStreamInfo(Stream const *stream) const;
 	const ControlList &GetProperties() const
 	{
 		return camera_->properties();
 	}
 
+	// Backpressure counters for each handoff point that frames pass through, by name.
+	virtual std::vector<std::pair<std::string, QueueStats const *>> GetQueueStats() const;
+
 	static unsigned int verbosity;
 	static unsigned int GetVerbosity() { return verbosity; }
 
@@ -190,6 +242,11 @@ public:
 	friend struct OptsInternal;
 
 protected:
+	// Write the live statistics as the members of a JSON object, without the enclosing braces.
+	// This runs on the stats server thread. Derived classes may append their own members.
+	virtual void writeStats(std::ostream &os) const;
+	void stopStatsServer();
+
 	std::unique_ptr<Options> options_;
 
 private:
@@ -197,31 +254,139 @@ private:
 	class MessageQueue
 	{
 	public:
+		// The ring only ever holds completed requests, so it is sized well beyond the number
+		// of requests that can be in flight and should never fill up.
+		MessageQueue() : ring_(64), policy_(QueuePolicy::Block), max_depth_(0), stats_(nullptr), aborting_(false) {}
+		// Bound the number of completed requests waiting for the application. Only messages
+		// posted through PostLockFree count towards the limit.
+		void SetLimit(QueuePolicy policy, unsigned int max_depth, QueueStats *stats)
+		{
+			policy_ = policy;
+			max_depth_ = std::min<std::size_t>(max_depth, ring_.Capacity());
+			stats_ = stats;
+		}
+		// Release any producer blocked on a full queue, and stop it blocking until cleared again.
+		void SetAbort(bool abort)
+		{
+			aborting_.store(abort, std::memory_order_relaxed);
+			if (abort)
+				space_.Notify();
+		}
+		// For the single thread that delivers completed requests. This path takes no locks.
+		template <typename U>
+		void PostLockFree(U &&msg)
+		{
+			if (max_depth_)
+			{
+				std::size_t depth = ring_.Size();
+				if (depth >= max_depth_)
+				{
+					// Dropping the newest simply lets the message, and the request it holds, go out of
+					// scope. The oldest are dropped by the consumer when it next waits for a message.
+					if (policy_ == QueuePolicy::DropNewest)
+					{
+						stats_->dropped++;
+						return;
+					}
+					else if (policy_ == QueuePolicy::Block)
+					{
+						stats_->blocked++;
+						waitForSpace();
+					}
+				}
+				stats_->Depth(depth + 1);
+			}
+
+			if (!ring_.TryPush(std::forward<U>(msg)))
+			{
+				Post(std::forward<U>(msg));
+				return;
+			}
+			notifier_.Notify();
+		}
+		// May be used from any thread.
 		template <typename U>
 		void Post(U &&msg)
 		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			queue_.push(std::forward<U>(msg));
-			cond_.notify_one();
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				queue_.push(std::forward<U>(msg));
+			}
+			notifier_.Notify();
 		}
 		T Wait()
 		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			cond_.wait(lock, [this] { return !queue_.empty(); });
-			T msg = std::move(queue_.front());
-			queue_.pop();
-			return msg;
+			if (max_depth_ && policy_ == QueuePolicy::DropOldest)
+			{
+				while (ring_.Size() > max_depth_ && ring_.TryPop())
+					stats_->dropped++;
+			}
+
+			while (true)
+			{
+				std::optional<T> msg = pop();
+				if (msg)
+					return std::move(*msg);
+
+				notifier_.PrepareWait();
+				msg = pop();
+				if (msg)
+				{
+					notifier_.CancelWait();
+					return std::move(*msg);
+				}
+				notifier_.Wait();
+			}
 		}
 		void Clear()
 		{
+			while (ring_.TryPop())
+				;
 			std::unique_lock<std::mutex> lock(mutex_);
 			queue_ = {};
 		}
 
 	private:
+		std::optional<T> pop()
+		{
+			std::optional<T> msg = ring_.TryPop();
+			if (msg)
+			{
+				if (max_depth_)
+					space_.Notify();
+				return msg;
+			}
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (queue_.empty())
+				return std::nullopt;
+			msg = std::move(queue_.front());
+			queue_.pop();
+			return msg;
+		}
+		void waitForSpace()
+		{
+			while (ring_.Size() >= max_depth_ && !aborting_.load(std::memory_order_relaxed))
+			{
+				space_.PrepareWait();
+				if (ring_.Size() < max_depth_ || aborting_.load(std::memory_order_relaxed))
+				{
+					space_.CancelWait();
+					break;
+				}
+				space_.Wait();
+			}
+		}
+
+		SpscRing<T> ring_;
+		EventNotifier notifier_;
 		std::queue<T> queue_;
 		std::mutex mutex_;
-		std::condition_variable cond_;
+		QueuePolicy policy_;
+		std::size_t max_depth_;
+		QueueStats *stats_;
+		// Lets the producer sleep while the ring is full under the blocking policy.
+		EventNotifier space_;
+		std::atomic<bool> aborting_;
 	};
 	struct PreviewItem
 	{
@@ -239,8 +404,19 @@ private:
 	};
 
 	void initCameraManager();
-	void setupCapture();
+	void enumerateSensorModes();
+	void startupMark(char const *what);
+	void reportStartup();
+	void setupCapture(StreamConfiguration *lores_config = nullptr);
+	void allocateBuffers(Stream *stream, StreamConfiguration const &config);
+	std::size_t captureBufferBytes() const;
+	void updateMemoryReport();
+	// Called by the PostProcessor as requests go into the stages and come out again.
+	void deferBufferWrites(CompletedRequestPtr const &completed_request);
+	void endBufferWrites(CompletedRequestPtr const &completed_request);
 	void makeRequests();
+	void addRequest();
+	void retireRequest(Request *request, CompletedRequest::BufferMap const &buffers);
 	void queueRequest(CompletedRequest *completed_request);
 	void requestComplete(Request *request);
 	void previewDoneCallback(int fd);
@@ -250,20 +426,54 @@ private:
 	void configureDenoise(const std::string &denoise_mode);
 	Mode selectMode(const Mode &mode) const;
 
-	std::unique_ptr<CameraManager> camera_manager_;
+	std::shared_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
 	bool camera_acquired_ = false;
 	std::unique_ptr<CameraConfiguration> configuration_;
 	std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
+	// Only needed because --adaptive-buffers adds and removes buffers while the camera runs.
+	std::shared_mutex mapped_buffers_mutex_;
+	// Buffers for which a CPU read access has been started since the request completed.
+	std::mutex buffer_sync_mutex_;
+	std::set<FrameBuffer *> read_synced_buffers_;
+	// Buffers of requests in the post-processing stages, and those of them with a write access started.
+	std::set<FrameBuffer *> deferred_write_buffers_;
+	std::set<FrameBuffer *> write_synced_buffers_;
 	std::map<std::string, Stream *> streams_;
-	DmaHeap dma_heap_;
+	// Made by ConfigureOffline(), in place of the camera's.
+	std::vector<std::unique_ptr<OfflineStream>> offline_streams_;
+	DmaHeapPool dma_heap_pool_;
+	bool memory_reported_ = false;
+	std::vector<DmaHeapPool::Buffer> dma_buffers_;
+	// Buffers are added (by --adaptive-buffers) while the camera runs, so anyone may be reading this as it changes.
+	mutable std::mutex frame_buffers_mutex_;
 	std::map<Stream *, std::vector<std::unique_ptr<FrameBuffer>>> frame_buffers_;
 	std::vector<std::unique_ptr<Request>> requests_;
 	std::mutex completed_requests_mutex_;
 	std::set<CompletedRequest *> completed_requests_;
+	// One CompletedRequest per Request, indexed by the request cookie.
+	std::vector<std::unique_ptr<CompletedRequest>> completed_request_pool_;
+	// For --adaptive-buffers. Retired requests keep their buffers, and are re-used first when we grow
+	// again. The buffers are only freed when the camera stops, as the previews and GL stages keep their
+	// imports of them (by fd or FrameBuffer) until they're torn down.
+	std::unique_ptr<BufferTuner> buffer_tuner_;
+	std::vector<std::pair<Request *, CompletedRequest::BufferMap>> retired_requests_;
+	std::atomic<unsigned int> active_requests_ = 0;
 	bool camera_started_ = false;
+	bool trace_started_ = false;
 	std::mutex camera_stop_mutex_;
 	MessageQueue<Msg> msg_queue_;
+	QueueStats msg_queue_stats_;
+	std::unique_ptr<StatsServer> stats_server_;
+	std::atomic<float> framerate_ = 0;
+	// Gaps in the sensor's frame sequence numbers, for the --perf-hud.
+	std::atomic<uint64_t> sensor_frames_dropped_ = 0;
+	std::optional<uint32_t> last_sensor_sequence_;
+	std::unique_ptr<PerfHud> perf_hud_;
+	// For --startup-profile, which reports how long each step of start-up took.
+	std::chrono::steady_clock::time_point startup_time_ = std::chrono::steady_clock::now();
+	std::vector<std::pair<char const *, std::chrono::steady_clock::time_point>> startup_marks_;
+	bool startup_reported_ = false;
 	std::vector<SensorMode> sensor_modes_;
 	// Related to the preview window.
 	std::unique_ptr<Preview> preview_;
@@ -275,13 +485,19 @@ private:
 	bool preview_abort_ = false;
 	uint32_t preview_frames_displayed_ = 0;
 	uint32_t preview_frames_dropped_ = 0;
+	std::chrono::steady_clock::time_point preview_next_due_;
 	std::thread preview_thread_;
 	// For setting camera controls.
 	std::mutex control_mutex_;
 	ControlList controls_;
+	// The crops we set at startup, main and then lores, unless the application set its own.
+	std::vector<Rectangle> crops_;
+	bool lores_follows_main_ = true;
 	// Other:
 	uint64_t last_timestamp_;
 	uint64_t sequence_ = 0;
 	PostProcessor post_processor_;
 	libcamera::PixelFormat lores_format_ = libcamera::formats::YUV420;
+	// The lores size was chosen by the post-processor for its stages, rather than asked for.
+	bool lores_auto_ = false;
 };
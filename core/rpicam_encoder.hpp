@@ -7,14 +7,17 @@
 
 #pragma once
 
+#include "core/frame_trace.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
 #include "encoder/encoder.hpp"
 
-typedef std::function<void(void *, size_t, int64_t, bool)> EncodeOutputReadyCallback;
-typedef std::function<void(libcamera::ControlList &)> MetadataReadyCallback;
+#include "post_processing_stages/object_detect.hpp"
+
+typedef std::function<void(void *, size_t, int64_t, bool, bool)> EncodeOutputReadyCallback;
+typedef std::function<void(libcamera::ControlList &, unsigned int)> MetadataReadyCallback;
 
 class RPiCamEncoder : public RPiCamApp
 {
@@ -22,13 +25,27 @@ public:
 	using Stream = libcamera::Stream;
 	using FrameBuffer = libcamera::FrameBuffer;
 
-	RPiCamEncoder() : RPiCamApp(std::make_unique<VideoOptions>()) {}
+	RPiCamEncoder() : RPiCamApp(std::make_unique<VideoOptions>()), encode_buffer_queue_(64) {}
+	// The stats server reads our counters, so must be gone before they are.
+	~RPiCamEncoder() { stopStatsServer(); }
 
 	void StartEncoder()
 	{
+		for (auto &extra : extra_encoders_)
+			startExtraEncoder(*extra);
 		createEncoder();
+		encode_queue_stats_.Reset();
+		if (!GetOptions()->Get().idle_key.empty())
+			idle_tag_.emplace(GetOptions()->Get().idle_key);
+		active_ = false;
+		idle_ = false;
+		last_active_ns_ = last_idle_frame_ns_ = -1;
 		encoder_->SetInputDoneCallback(std::bind(&RPiCamEncoder::encodeBufferDone, this, std::placeholders::_1));
-		encoder_->SetOutputReadyCallback(encode_output_ready_callback_);
+		encoder_->SetOutputReadyCallback([this](void *mem, size_t size, int64_t timestamp_us, bool keyframe,
+												bool partial) {
+			output_bytes_.fetch_add(size, std::memory_order_relaxed);
+			encode_output_ready_callback_(mem, size, timestamp_us, keyframe, partial);
+		});
 
 #ifndef DISABLE_RPI_FEATURES
 		// Set up the encode function to wait for synchronisation with another camera system,
@@ -44,9 +61,23 @@ public:
 		SetControls(cl);
 #endif
 	}
+	// Encode another stream of the same requests alongside the main one, for example the lores stream
+	// at a low bitrate for live viewing. It has its own options, usually a modified Clone() of ours,
+	// and its own output callback. These encoders start and stop along with the main one.
+	void AddEncoder(std::string const &stream_name, std::unique_ptr<VideoOptions> options,
+					EncodeOutputReadyCallback callback)
+	{
+		extra_encoders_.push_back(std::make_unique<ExtraEncoder>(stream_name, std::move(options), callback));
+	}
 	// This is callback when the encoder gives you the encoded output data.
 	void SetEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { encode_output_ready_callback_ = callback; }
 	void SetMetadataReadyCallback(MetadataReadyCallback callback) { metadata_ready_callback_ = callback; }
+	// Changes to the main encoder that may be asked for from any thread, such as an output's. They
+	// are passed on by EncodeBuffer with the next frame, so the encoder is never touched as it is
+	// being replaced.
+	void RequestBitrate(uint32_t bps) { requested_bitrate_ = bps; }
+	void RequestQpRange(unsigned int min_qp, unsigned int max_qp) { requested_qp_range_ = (max_qp << 8) | min_qp; }
+	void RequestKeyframe() { keyframe_requested_ = true; }
 	bool EncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
 		assert(encoder_);
@@ -58,6 +89,33 @@ public:
 			return false;
 #endif
 
+		// While nothing is happening, only the occasional frame goes on to the encoders. The rest
+		// count as encoded, so our caller carries on as normal.
+		if (idle_tag_ && skipIdleFrame(completed_request, stream))
+			return true;
+
+		for (auto &extra : extra_encoders_)
+			encodeExtraBuffer(*extra, completed_request);
+
+		unsigned int max_depth = GetOptions()->Get().queue_depth;
+		if (max_depth)
+		{
+			std::size_t depth = encode_buffer_queue_.Size();
+			if (depth >= max_depth)
+			{
+				// Frames already handed to the codec can't be recalled, so either drop policy means
+				// skipping this one. Our caller still treats it as encoded.
+				if (GetOptions()->Get().queue_policy != QueuePolicy::Block)
+				{
+					encode_queue_stats_.dropped++;
+					return true;
+				}
+				encode_queue_stats_.blocked++;
+				waitForEncodeSpace(max_depth);
+			}
+			encode_queue_stats_.Depth(depth + 1);
+		}
+
 		StreamInfo info = GetStreamInfo(stream);
 		FrameBuffer *buffer = completed_request->buffers[stream];
 		BufferReadSync r(this, buffer);
@@ -67,19 +125,84 @@ public:
 			throw std::runtime_error("no buffer to encode");
 		auto ts = completed_request->metadata.get(controls::FrameWallClock);
 		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
-		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
-		}
+		// Only this thread pushes to the queue and only the encoder's thread pops from it.
+		if (!encode_buffer_queue_.TryPush(completed_request)) // creates a new reference
+			throw std::runtime_error("encode buffer queue full");
+		if (FrameTrace::Get().Enabled())
+			FrameTrace::Get().Record("encode-queue", "encoder", completed_request->sequence, timestamp_ns / 1000);
+		applyEncoderRequests();
+		if (GetOptions()->Get().region_quality)
+			applyEncoderRegions(completed_request, info);
 		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 
 		// Tell our caller that encoding is underway.
 		return true;
 	}
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(RPiCamApp::GetOptions()); }
-	void StopEncoder() { encoder_.reset(); }
+	void StopEncoder()
+	{
+		encoder_.reset();
+		for (auto &extra : extra_encoders_)
+			stopExtraEncoder(*extra);
+	}
+	// Thrown by Reconfigure() when a request is refused, or fails, but the camera is running just as it was.
+	struct ReconfigureError : public std::runtime_error
+	{
+		using std::runtime_error::runtime_error;
+	};
+	// Apply a ReconfigureRequest to the running camera. A framerate change happens live. Changing
+	// the streams means restarting the camera, though the buffers go back to the pool and are
+	// picked up by the new configuration where they are big enough. The encoder is only recreated
+	// if the video stream itself changed, and the output and post-processing stages carry on.
+	// Should the new streams fail to configure or start, the old ones are put back and the request
+	// is answered with a ReconfigureError. Any other exception means the camera could not be
+	// restarted at all. Either way, the request's reply is given the outcome.
+	void Reconfigure(ReconfigureRequest const &request, unsigned int video_flags)
+	{
+		try
+		{
+			reconfigure(request, video_flags);
+		}
+		catch (std::exception const &e)
+		{
+			if (request.reply)
+				request.reply->set_value(std::string("error: ") + e.what());
+			throw;
+		}
+		if (request.reply)
+			request.reply->set_value("ok");
+	}
+	std::vector<std::pair<std::string, QueueStats const *>> GetQueueStats() const override
+	{
+		std::vector<std::pair<std::string, QueueStats const *>> stats = RPiCamApp::GetQueueStats();
+		stats.emplace_back("encoder", &encode_queue_stats_);
+		for (auto const &extra : extra_encoders_)
+			stats.emplace_back("encoder-" + extra->stream_name, &extra->stats);
+		return stats;
+	}
 
 protected:
+	void writeStats(std::ostream &os) const override
+	{
+		RPiCamApp::writeStats(os);
+
+		// The rate is worked out over the time since the previous snapshot.
+		auto now = std::chrono::steady_clock::now();
+		uint64_t bytes = output_bytes_.load(std::memory_order_relaxed);
+		double rate = 0;
+		if (last_stats_time_.time_since_epoch().count())
+		{
+			std::chrono::duration<double> elapsed = now - last_stats_time_;
+			if (elapsed.count() > 0)
+				rate = (bytes - last_stats_bytes_) / elapsed.count();
+		}
+		last_stats_time_ = now;
+		last_stats_bytes_ = bytes;
+
+		os << ",\"encoder_in_flight\":" << encode_buffer_queue_.Size() << ",\"output_bytes\":" << bytes
+		   << ",\"output_bytes_per_second\":" << (uint64_t)rate;
+	}
+
 	virtual void createEncoder()
 	{
 		StreamInfo info;
@@ -91,6 +214,284 @@ protected:
 	std::unique_ptr<Encoder> encoder_;
 
 private:
+	void reconfigure(ReconfigureRequest const &request, unsigned int video_flags)
+	{
+		VideoOptions *options = GetOptions();
+		StreamInfo info;
+		VideoStream(&info);
+
+		// Refuse what we can see will fail before stopping anything.
+		auto check_size = [](libcamera::Size const &size, char const *what) {
+			if (!size.width || !size.height || (size.width & 1) || (size.height & 1))
+				throw ReconfigureError(std::string(what) + " size " + size.toString() +
+									   " must be even and non-zero");
+		};
+		libcamera::Size size = request.size.value_or(libcamera::Size(info.width, info.height));
+		if (request.size)
+			check_size(*request.size, "video");
+		if (request.lores_size && !request.lores_size->isNull())
+		{
+			check_size(*request.lores_size, "lores");
+			if (request.lores_size->width > size.width || request.lores_size->height > size.height)
+				throw ReconfigureError("lores size " + request.lores_size->toString() + " larger than video size " +
+									   size.toString());
+		}
+		bool streams = request.size || request.lores_size;
+		// The libav encoder writes the output itself, and would start a new file.
+		bool libav = options->Get().codec == "libav" ||
+					 (options->Get().codec == "h264" && options->GetPlatform() != Platform::VC4);
+		if (request.size && libav)
+			throw ReconfigureError("cannot change the resolution while encoding with libav");
+
+		if (request.framerate)
+		{
+			try
+			{
+				SetFramerate(*request.framerate);
+			}
+			catch (std::exception const &e)
+			{
+				throw ReconfigureError(e.what());
+			}
+		}
+		if (!streams)
+			return;
+
+		std::vector<StreamInfo> extra_info(extra_encoders_.size());
+		for (std::size_t i = 0; i < extra_encoders_.size(); i++)
+			GetStream(extra_encoders_[i]->stream_name, &extra_info[i]);
+		unsigned int old_width = options->Get().width, old_height = options->Get().height;
+		unsigned int old_lores_width = options->Get().lores_width, old_lores_height = options->Get().lores_height;
+		auto old_mode = options->Get().mode;
+
+		StopCamera();
+		Teardown();
+		if (request.size)
+		{
+			options->Set().width = request.size->width;
+			options->Set().height = request.size->height;
+		}
+		if (request.lores_size)
+		{
+			options->Set().lores_width = request.lores_size->width;
+			options->Set().lores_height = request.lores_size->height;
+		}
+
+		try
+		{
+			restartVideo(video_flags, info, extra_info);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("WARNING: reconfiguration failed (" << e.what() << "), going back to the previous streams");
+			StopCamera();
+			Teardown();
+			options->Set().width = old_width;
+			options->Set().height = old_height;
+			options->Set().lores_width = old_lores_width;
+			options->Set().lores_height = old_lores_height;
+			options->Set().mode = old_mode;
+			// If this fails too, there's no camera left to carry on with, which the caller must treat as fatal.
+			restartVideo(video_flags, info, extra_info);
+			throw ReconfigureError(e.what());
+		}
+
+		LOG(1, "Reconfigured video to " << info.width << "x" << info.height);
+	}
+	// Configure and start the camera once more, restarting any encoder whose stream has changed from the
+	// one it was made for, which encoder_info and extra_info say, and are updated to match.
+	void restartVideo(unsigned int video_flags, StreamInfo &encoder_info, std::vector<StreamInfo> &extra_info)
+	{
+		ConfigureVideo(video_flags);
+
+		auto changed = [](StreamInfo const &a, StreamInfo const &b) {
+			return a.width != b.width || a.height != b.height || a.stride != b.stride;
+		};
+		StreamInfo info;
+		VideoStream(&info);
+		std::vector<StreamInfo> new_extra_info(extra_encoders_.size());
+		for (std::size_t i = 0; i < extra_encoders_.size(); i++)
+			GetStream(extra_encoders_[i]->stream_name, &new_extra_info[i]);
+		if (encoder_ && changed(info, encoder_info))
+		{
+			StopEncoder();
+			StartEncoder();
+		}
+		else if (encoder_)
+		{
+			for (std::size_t i = 0; i < extra_encoders_.size(); i++)
+			{
+				if (changed(new_extra_info[i], extra_info[i]))
+				{
+					stopExtraEncoder(*extra_encoders_[i]);
+					startExtraEncoder(*extra_encoders_[i]);
+				}
+			}
+		}
+		encoder_info = info;
+		extra_info = new_extra_info;
+
+		StartCamera();
+	}
+	// Only a couple of frames may wait for one of these, as the requests they hold are not available
+	// to the camera. Any more are dropped rather than let a live view hold up the main encoder.
+	static constexpr std::size_t ExtraQueueDepth = 2;
+
+	struct ExtraEncoder
+	{
+		ExtraEncoder(std::string const &name, std::unique_ptr<VideoOptions> opts, EncodeOutputReadyCallback cb)
+			: stream_name(name), options(std::move(opts)), callback(cb), queue(ExtraQueueDepth + 1)
+		{
+		}
+
+		std::string stream_name;
+		std::unique_ptr<VideoOptions> options;
+		EncodeOutputReadyCallback callback;
+		std::unique_ptr<Encoder> encoder;
+		// As with the main encoder, requests go back in order as the codec finishes with them.
+		SpscRing<CompletedRequestPtr> queue;
+		QueueStats stats;
+	};
+
+	void applyEncoderRequests()
+	{
+		if (uint32_t bps = requested_bitrate_.exchange(0); bps && !encoder_->SetBitrate(bps))
+			LOG(2, "Encoder cannot change its bitrate");
+		if (unsigned int qp = requested_qp_range_.exchange(0); qp && !encoder_->SetQpRange(qp & 0xff, qp >> 8))
+			LOG(2, "Encoder cannot change its QP range");
+		if (keyframe_requested_.exchange(false) && !encoder_->RequestKeyframe())
+			LOG(2, "Encoder cannot make a keyframe on request");
+	}
+
+	bool skipIdleFrame(CompletedRequestPtr &completed_request, Stream *stream)
+	{
+		// Stages such as motion_detect don't look at every frame, so their last answer stands until
+		// the next one.
+		try
+		{
+			bool active;
+			if (completed_request->post_process_metadata.Get(*idle_tag_, active) == 0)
+				active_ = active;
+		}
+		catch (std::bad_any_cast const &)
+		{
+			throw std::runtime_error("--idle-key " + GetOptions()->Get().idle_key + " is not a true/false value");
+		}
+
+		int64_t now_ns = completed_request->buffers[stream]->metadata().timestamp;
+		if (active_ || last_active_ns_ < 0)
+			last_active_ns_ = now_ns;
+		if (now_ns - last_active_ns_ <= GetOptions()->Get().idle_hold.get<std::chrono::nanoseconds>())
+		{
+			if (idle_)
+				LOG(1, "Activity resumed, encoding at the full rate");
+			idle_ = false;
+			return false;
+		}
+
+		if (!idle_)
+		{
+			LOG(1, "No activity, encoding at " << GetOptions()->Get().idle_framerate << " fps");
+			idle_ = true;
+			last_idle_frame_ns_ = -1;
+		}
+		// The frames we keep have their real timestamps, so these only ever increase.
+		int64_t interval_ns = 1e9 / GetOptions()->Get().idle_framerate;
+		if (last_idle_frame_ns_ < 0 || now_ns - last_idle_frame_ns_ >= interval_ns)
+		{
+			last_idle_frame_ns_ = now_ns;
+			return false;
+		}
+		return true;
+	}
+
+	// The detection stages give their regions in the coordinates of the main (video) image.
+	void applyEncoderRegions(CompletedRequestPtr &completed_request, StreamInfo const &info)
+	{
+		static const MetadataTag detect_tag("object_detect.results");
+		static const MetadataTag motion_tag("motion_detect.regions");
+		float quality = GetOptions()->Get().region_quality;
+		libcamera::Rectangle frame(0, 0, info.width, info.height);
+
+		std::vector<Detection> detections;
+		std::vector<libcamera::Rectangle> motion;
+		completed_request->post_process_metadata.Get(detect_tag, detections);
+		completed_request->post_process_metadata.Get(motion_tag, motion);
+
+		regions_.clear();
+		for (auto const &detection : detections)
+			motion.push_back(detection.box);
+		for (auto const &box : motion)
+		{
+			libcamera::Rectangle bounded = box.boundedTo(frame);
+			if (!bounded.isNull())
+				regions_.push_back({ bounded, -quality });
+		}
+		if (regions_.empty())
+			return;
+		// The whole frame goes last, so that it only covers the background.
+		regions_.push_back({ frame, quality });
+
+		if (!encoder_->SetRegions(regions_) && !regions_warned_)
+		{
+			LOG_ERROR("WARNING: this encoder cannot encode regions at a different quality");
+			regions_warned_ = true;
+		}
+	}
+
+	void startExtraEncoder(ExtraEncoder &extra)
+	{
+		StreamInfo info;
+		if (!GetStream(extra.stream_name, &info))
+		{
+			LOG_ERROR("WARNING: no " << extra.stream_name << " stream to encode");
+			return;
+		}
+		extra.options->Set().width = info.width;
+		extra.options->Set().height = info.height;
+		extra.encoder = std::unique_ptr<Encoder>(Encoder::Create(extra.options.get(), info));
+		extra.stats.Reset();
+		extra.encoder->SetInputDoneCallback([&extra](void *) {
+			if (!extra.queue.TryPop())
+				throw std::runtime_error("no " + extra.stream_name + " buffer available to return");
+		});
+		extra.encoder->SetOutputReadyCallback(extra.callback);
+	}
+
+	void stopExtraEncoder(ExtraEncoder &extra)
+	{
+		extra.encoder.reset();
+		while (extra.queue.TryPop())
+			;
+	}
+
+	void encodeExtraBuffer(ExtraEncoder &extra, CompletedRequestPtr &completed_request)
+	{
+		Stream *stream = GetStream(extra.stream_name);
+		if (!extra.encoder || !stream)
+			return;
+
+		std::size_t depth = extra.queue.Size();
+		if (depth >= ExtraQueueDepth)
+		{
+			extra.stats.dropped++;
+			return;
+		}
+		extra.stats.Depth(depth + 1);
+
+		StreamInfo info = GetStreamInfo(stream);
+		FrameBuffer *buffer = completed_request->buffers[stream];
+		if (!buffer)
+			throw std::runtime_error("no " + extra.stream_name + " buffer to encode");
+		BufferReadSync r(this, buffer);
+		libcamera::Span span = r.Get()[0];
+		auto ts = completed_request->metadata.get(controls::FrameWallClock);
+		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+		if (!extra.queue.TryPush(completed_request))
+			throw std::runtime_error(extra.stream_name + " encode buffer queue full");
+		extra.encoder->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), span.data(), info, timestamp_ns / 1000);
+	}
+
 	void encodeBufferDone(void *mem)
 	{
 		// If non-NULL, mem would indicate which buffer has been completed, but
@@ -98,19 +499,51 @@ private:
 		// handle this by replacing the queue with a vector of <mem, completed_request>
 		// pairs.)
 		assert(mem == nullptr);
+		std::optional<CompletedRequestPtr> completed_request = encode_buffer_queue_.TryPop();
+		if (!completed_request)
+			throw std::runtime_error("no buffer available to return");
+		encode_space_.Notify();
+		if (metadata_ready_callback_ &&
+			(!GetOptions()->Get().metadata.empty() || !GetOptions()->Get().save_pts.empty()))
+			metadata_ready_callback_((*completed_request)->metadata, (*completed_request)->sequence);
+		// The shared_ptr reference is dropped here.
+	}
+
+	void waitForEncodeSpace(std::size_t max_depth)
+	{
+		while (encode_buffer_queue_.Size() >= max_depth)
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
-				throw std::runtime_error("no buffer available to return");
-			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
-			if (metadata_ready_callback_ && !GetOptions()->Get().metadata.empty())
-				metadata_ready_callback_(completed_request->metadata);
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			encode_space_.PrepareWait();
+			if (encode_buffer_queue_.Size() < max_depth)
+			{
+				encode_space_.CancelWait();
+				break;
+			}
+			encode_space_.Wait();
 		}
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
-	std::mutex encode_buffer_queue_mutex_;
+	SpscRing<CompletedRequestPtr> encode_buffer_queue_;
+	// Under the blocking queue policy, EncodeBuffer sleeps on this until the codec returns a buffer.
+	EventNotifier encode_space_;
+	QueueStats encode_queue_stats_;
+	std::atomic<uint64_t> output_bytes_ = 0;
+	// Only touched by the stats server thread.
+	mutable std::chrono::steady_clock::time_point last_stats_time_;
+	mutable uint64_t last_stats_bytes_ = 0;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
 	MetadataReadyCallback metadata_ready_callback_;
+	std::vector<std::unique_ptr<ExtraEncoder>> extra_encoders_;
+	std::atomic<uint32_t> requested_bitrate_ = 0;
+	std::atomic<unsigned int> requested_qp_range_ = 0; // max << 8 | min
+	std::atomic<bool> keyframe_requested_ = false;
+	// Kept to save allocating the list every frame.
+	std::vector<EncodeRegion> regions_;
+	bool regions_warned_ = false;
+	// Only touched by the thread calling EncodeBuffer.
+	std::optional<MetadataTag> idle_tag_;
+	bool active_;
+	bool idle_;
+	int64_t last_active_ns_;
+	int64_t last_idle_frame_ns_;
 };
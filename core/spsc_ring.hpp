@@ -0,0 +1,124 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * spsc_ring.hpp - Bounded lock-free single-producer/single-consumer ring.
+ */
+
+#pragma once
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+// A fixed-capacity ring for handing items from exactly one producer thread to exactly one
+// consumer thread without taking any locks. The capacity is rounded up to a power of two.
+template <typename T>
+class SpscRing
+{
+public:
+	explicit SpscRing(std::size_t capacity) : head_(0), tail_(0)
+	{
+		std::size_t size = 1;
+		while (size < capacity)
+			size <<= 1;
+		slots_.resize(size);
+		mask_ = size - 1;
+	}
+
+	SpscRing(SpscRing const &) = delete;
+	SpscRing &operator=(SpscRing const &) = delete;
+
+	// Producer only. Returns false, without consuming the item, if the ring is full.
+	template <typename U>
+	bool TryPush(U &&item)
+	{
+		std::size_t tail = tail_.load(std::memory_order_relaxed);
+		if (tail - head_.load(std::memory_order_acquire) > mask_)
+			return false;
+		slots_[tail & mask_] = std::forward<U>(item);
+		tail_.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Consumer only. The slot is emptied so that it does not keep the item alive.
+	std::optional<T> TryPop()
+	{
+		std::size_t head = head_.load(std::memory_order_relaxed);
+		if (head == tail_.load(std::memory_order_acquire))
+			return std::nullopt;
+		std::optional<T> item = std::move(slots_[head & mask_]);
+		slots_[head & mask_].reset();
+		head_.store(head + 1, std::memory_order_release);
+		return item;
+	}
+
+	// Either thread may call these, though the answer may be out of date immediately.
+	bool Empty() const { return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire); }
+	std::size_t Size() const { return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_acquire); }
+	std::size_t Capacity() const { return mask_ + 1; }
+
+private:
+	std::vector<std::optional<T>> slots_;
+	std::size_t mask_;
+	// Keep the two indices on separate cache lines so the threads don't fight over them.
+	alignas(64) std::atomic<std::size_t> head_;
+	alignas(64) std::atomic<std::size_t> tail_;
+};
+
+// An eventfd-based wakeup for a consumer that sleeps while its queues are empty. The consumer
+// sets itself as waiting, re-checks its queues and only then calls Wait(), so that producers need
+// make a system call only when somebody is actually asleep.
+class EventNotifier
+{
+public:
+	EventNotifier() : waiting_(false)
+	{
+		fd_ = eventfd(0, EFD_CLOEXEC);
+		if (fd_ < 0)
+			throw std::runtime_error("failed to create eventfd");
+	}
+
+	~EventNotifier() { close(fd_); }
+
+	EventNotifier(EventNotifier const &) = delete;
+	EventNotifier &operator=(EventNotifier const &) = delete;
+
+	// Called by producers after publishing an item.
+	void Notify()
+	{
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiting_.load(std::memory_order_relaxed))
+		{
+			uint64_t one = 1;
+			[[maybe_unused]] ssize_t ret = ::write(fd_, &one, sizeof(one));
+		}
+	}
+
+	// Called by the consumer before its final check of the queues.
+	void PrepareWait()
+	{
+		waiting_.store(true, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+	}
+
+	void CancelWait() { waiting_.store(false, std::memory_order_relaxed); }
+
+	void Wait()
+	{
+		uint64_t count;
+		while (::read(fd_, &count, sizeof(count)) < 0 && errno == EINTR)
+			;
+		waiting_.store(false, std::memory_order_relaxed);
+	}
+
+private:
+	int fd_;
+	std::atomic<bool> waiting_;
+};
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * startup_cache.cpp - Small on-disk caches that speed up application start-up.
+ */
+
+#include <unistd.h>
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "core/logging.hpp"
+#include "core/startup_cache.hpp"
+
+namespace fs = std::filesystem;
+
+static fs::path cache_dir()
+{
+	char const *xdg = getenv("XDG_CACHE_HOME");
+	char const *home = getenv("HOME");
+	if (xdg && xdg[0])
+		return fs::path(xdg) / "rpicam-apps";
+	else if (home && home[0])
+		return fs::path(home) / ".cache" / "rpicam-apps";
+	return {};
+}
+
+bool startup_cache_read(std::string const &name, std::string &contents)
+{
+	fs::path dir = cache_dir();
+	if (dir.empty())
+		return false;
+
+	std::ifstream in(dir / name);
+	if (!in)
+		return false;
+
+	std::stringstream ss;
+	ss << in.rdbuf();
+	contents = ss.str();
+	return true;
+}
+
+void startup_cache_write(std::string const &name, std::string const &contents)
+{
+	fs::path dir = cache_dir();
+	if (dir.empty())
+		return;
+
+	std::error_code ec;
+	fs::create_directories(dir, ec);
+	if (ec)
+		return;
+
+	// Write a temporary file and rename it, so that another process starting at the same time
+	// never reads a half-written cache.
+	fs::path file = dir / name;
+	fs::path tmp = file;
+	tmp += "." + std::to_string(getpid());
+	{
+		std::ofstream out(tmp);
+		if (!out)
+			return;
+		out << contents;
+		if (!out)
+		{
+			fs::remove(tmp, ec);
+			return;
+		}
+	}
+	fs::rename(tmp, file, ec);
+	if (ec)
+		fs::remove(tmp, ec);
+	else
+		LOG(2, "Updated start-up cache " << file.string());
+}
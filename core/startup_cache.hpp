@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * startup_cache.hpp - Small on-disk caches that speed up application start-up.
+ */
+
+#pragma once
+
+#include <string>
+
+// The cache files live under $XDG_CACHE_HOME/rpicam-apps, or ~/.cache/rpicam-apps. If there is
+// nowhere to put them, reads simply fail and writes do nothing, so callers fall back to doing the
+// work in full.
+bool startup_cache_read(std::string const &name, std::string &contents);
+void startup_cache_write(std::string const &name, std::string const &contents);
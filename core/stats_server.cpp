@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * stats_server.cpp - Serve pipeline statistics over a UNIX socket.
+ */
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/stats_server.hpp"
+#include "core/thread_config.hpp"
+
+StatsServer::StatsServer(std::string const &path, SnapshotFunction snapshot)
+	: path_(path), snapshot_(std::move(snapshot)), abort_(false)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path_.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("stats socket path too long: " + path_);
+	strcpy(addr.sun_path, path_.c_str());
+
+	fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd_ < 0)
+		throw std::runtime_error("unable to open stats socket");
+
+	// A socket left behind by an earlier run would stop us binding.
+	unlink(path_.c_str());
+	if (bind(fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd_, 4) < 0)
+	{
+		close(fd_);
+		throw std::runtime_error("unable to listen on stats socket " + path_ + ": " + strerror(errno));
+	}
+
+	thread_ = std::thread(&StatsServer::serverThread, this);
+	LOG(2, "Serving statistics on " << path_);
+}
+
+StatsServer::~StatsServer()
+{
+	abort_ = true;
+	thread_.join();
+	close(fd_);
+	unlink(path_.c_str());
+}
+
+void StatsServer::serverThread()
+{
+	ThreadConfig::Get().Apply("server");
+	while (!abort_)
+	{
+		pollfd p = { fd_, POLLIN, 0 };
+		int ret = poll(&p, 1, 200);
+		if (ret <= 0 || !(p.revents & POLLIN))
+			continue;
+
+		int client = accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+		if (client < 0)
+			continue;
+
+		std::string snapshot = snapshot_();
+		size_t done = 0;
+		while (done < snapshot.size())
+		{
+			ssize_t n = send(client, snapshot.data() + done, snapshot.size() - done, MSG_NOSIGNAL);
+			if (n <= 0)
+				break;
+			done += n;
+		}
+		close(client);
+	}
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * stats_server.hpp - Serve pipeline statistics over a UNIX socket.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+// Listens on a UNIX stream socket and, for each client that connects, writes the string that
+// the snapshot function returns and closes the connection. The snapshot function runs on the
+// server's own thread, so it should only read counters that the pipeline updates lock-free.
+class StatsServer
+{
+public:
+	using SnapshotFunction = std::function<std::string()>;
+
+	StatsServer(std::string const &path, SnapshotFunction snapshot);
+	~StatsServer();
+
+private:
+	void serverThread();
+
+	std::string path_;
+	SnapshotFunction snapshot_;
+	int fd_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+};
@@ -24,6 +24,9 @@ struct StillOptions : public Options
 			 "Add these extra EXIF tags to the output file")
 			("timelapse", value<std::string>(&v_->timelapse_)->default_value("0ms"),
 			 "Time interval between timelapse captures. If no units are provided default to ms.")
+			("timelapse-warmup", value<std::string>(&v_->timelapse_warmup_)->default_value("0ms"),
+			 "Stop the camera between timelapse captures, starting it again this long before each one so that "
+			 "AE and AWB can settle. If no units are provided default to ms. (0 = keep the camera running)")
 			("framestart", value<uint32_t>(&v_->framestart)->default_value(0),
 			 "Initial frame counter value for timelapse captures")
 			("datetime", value<bool>(&v_->datetime)->default_value(false)->implicit_value(true),
@@ -40,8 +43,19 @@ struct StillOptions : public Options
 			 "Set thumbnail parameters as width:height:quality, or none")
 			("encoding,e", value<std::string>(&v_->encoding)->default_value("jpg"),
 			 "Set the desired output encoding, either jpg, png, rgb/rgb24, rgb48, bmp or yuv420")
+			("png-filter", value<std::string>(&v_->png_filter)->default_value("avg"),
+			 "Row filter for png files, either none, sub, up, avg, paeth or adaptive (the best for each row, "
+			 "which is slowest)")
+			("png-level", value<int>(&v_->png_level)->default_value(1),
+			 "zlib compression level for png files, from 0 (fastest) to 9 (smallest)")
+			("write-method", value<std::string>(&v_->write_method)->default_value("copy"),
+			 "How yuv420 and rgb files are written, either copy (through a buffer, in large writes), writev "
+			 "(gathering the rows straight from the camera buffer) or mmap (into a preallocated, mapped file)")
 			("raw,r", value<bool>(&v_->raw)->default_value(false)->implicit_value(true),
 			 "Also save raw file in DNG format")
+			("raw-format", value<std::string>(&v_->raw_format)->default_value("dng"),
+			 "Format for the --raw file, either dng, or rpiraw to store the camera's (possibly compressed) "
+			 "raw buffer as-is for converting later with rpicam-raw2dng")
 			("latest", value<std::string>(&v_->latest),
 			 "Create a symbolic link with this name to most recent saved file")
 			("immediate", value<bool>(&v_->immediate)->default_value(false)->implicit_value(true),
@@ -50,6 +64,12 @@ struct StillOptions : public Options
 			 "Switch to AfModeAuto and trigger a scan just before capturing a still")
 			("zsl", value<bool>(&v_->zsl)->default_value(false)->implicit_value(true),
 			 "Switch to AfModeAuto and trigger a scan just before capturing a still")
+			("save-queue", value<unsigned int>(&v_->save_queue)->default_value(0),
+			 "Number of captures that may wait to be saved in the background while the camera carries on "
+			 "(0 = finish saving each capture before continuing)")
+			("burst", value<unsigned int>(&v_->burst)->default_value(0),
+			 "Capture this many consecutive full resolution frames for each still, saving them in the background. "
+			 "The --output needs a frame counter, e.g. burst%04d.jpg")
 			;
 		// clang-format on
 	}
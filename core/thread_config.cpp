@@ -0,0 +1,178 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * thread_config.cpp - CPU affinity, scheduling policy and names for the pipeline threads.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/thread_config.hpp"
+
+ThreadConfig &ThreadConfig::Get()
+{
+	static ThreadConfig config;
+	return config;
+}
+
+std::map<std::string, std::string> const &ThreadConfig::Classes()
+{
+	// Thread names are limited to 15 characters. The event loop runs on the main thread, whose name
+	// is also the process name, so that is left alone unless asked for.
+	static const std::map<std::string, std::string> classes = {
+		{ "event", "" },
+		{ "callback", "rpicam-callback" },
+		{ "preview", "rpicam-preview" },
+		{ "post-process", "rpicam-postproc" },
+		{ "post-output", "rpicam-postout" },
+		{ "encoder", "rpicam-encode" },
+		{ "encoder-poll", "rpicam-encpoll" },
+		{ "encoder-output", "rpicam-encout" },
+		{ "tee-output", "rpicam-tee" },
+		{ "file-writer", "rpicam-writer" },
+		{ "audio", "rpicam-audio" },
+		{ "server", "rpicam-server" },
+		{ "log", "rpicam-log" },
+	};
+	return classes;
+}
+
+static std::vector<unsigned int> parse_cpus(std::string const &list)
+{
+	std::vector<unsigned int> cpus;
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ','))
+	{
+		unsigned int first, last;
+		char dash;
+		std::stringstream rs(range);
+		if (!(rs >> first))
+			throw std::runtime_error("bad CPU list " + list);
+		last = first;
+		if (rs >> dash && (dash != '-' || !(rs >> last) || last < first))
+			throw std::runtime_error("bad CPU list " + list);
+		if (last >= CPU_SETSIZE)
+			throw std::runtime_error("CPU number out of range in " + list);
+		for (unsigned int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+	}
+	if (cpus.empty())
+		throw std::runtime_error("empty CPU list");
+	return cpus;
+}
+
+static int parse_priority(std::string const &value)
+{
+	int priority = std::stoi(value);
+	if (priority < 1 || priority > 99)
+		throw std::runtime_error("real-time priority must be between 1 and 99");
+	return priority;
+}
+
+void ThreadConfig::Configure(std::vector<std::string> const &settings)
+{
+	settings_.clear();
+
+	for (std::string const &setting : settings)
+	{
+		std::size_t colon = setting.find(':');
+		std::string thread_class = setting.substr(0, colon);
+		if (Classes().count(thread_class) == 0)
+			throw std::runtime_error("unknown thread class " + thread_class + " in --thread " + setting);
+
+		Settings &s = settings_[thread_class];
+		std::stringstream ss(colon == std::string::npos ? "" : setting.substr(colon + 1));
+		std::string field;
+		while (std::getline(ss, field, ':'))
+		{
+			std::size_t equals = field.find('=');
+			if (equals == std::string::npos)
+				throw std::runtime_error("expected key=value in --thread " + setting);
+			std::string key = field.substr(0, equals), value = field.substr(equals + 1);
+
+			try
+			{
+				if (key == "cpus")
+					s.cpus = parse_cpus(value);
+				else if (key == "fifo" || key == "rr")
+				{
+					s.policy = key == "fifo" ? SCHED_FIFO : SCHED_RR;
+					s.priority = parse_priority(value);
+				}
+				else if (key == "nice")
+				{
+					s.policy = SCHED_OTHER;
+					s.nice_set = true;
+					s.nice = std::stoi(value);
+				}
+				else if (key == "name")
+				{
+					if (value.empty() || value.size() > 15)
+						throw std::runtime_error("thread names must be 1 to 15 characters");
+					s.name = value;
+				}
+				else
+					throw std::runtime_error("unknown field " + key);
+			}
+			catch (std::logic_error const &)
+			{
+				// From std::stoi.
+				throw std::runtime_error("bad value for " + key + " in --thread " + setting);
+			}
+			catch (std::runtime_error const &e)
+			{
+				throw std::runtime_error(std::string(e.what()) + " in --thread " + setting);
+			}
+		}
+	}
+}
+
+void ThreadConfig::Apply(char const *thread_class) const
+{
+	auto it = settings_.find(thread_class);
+	std::string name = Classes().at(thread_class);
+	if (it != settings_.end() && !it->second.name.empty())
+		name = it->second.name;
+	if (!name.empty())
+		pthread_setname_np(pthread_self(), name.c_str());
+
+	if (it == settings_.end())
+		return;
+	Settings const &s = it->second;
+
+	if (!s.cpus.empty())
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (unsigned int cpu : s.cpus)
+			CPU_SET(cpu, &set);
+		int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (ret)
+			LOG_ERROR("WARNING: failed to set CPU affinity of " << name << " thread: " << strerror(ret));
+	}
+
+	if (s.policy >= 0)
+	{
+		sched_param param = {};
+		param.sched_priority = s.policy == SCHED_OTHER ? 0 : s.priority;
+		int ret = pthread_setschedparam(pthread_self(), s.policy, &param);
+		if (ret)
+			LOG_ERROR("WARNING: failed to set scheduling policy of " << name << " thread: " << strerror(ret));
+		// The nice value is per-thread on Linux, using the thread id.
+		if (s.nice_set && setpriority(PRIO_PROCESS, syscall(SYS_gettid), s.nice))
+			LOG_ERROR("WARNING: failed to set nice value of " << name << " thread: " << strerror(errno));
+	}
+
+	LOG(2, "Configured " << thread_class << " thread " << name);
+}
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * thread_config.hpp - CPU affinity, scheduling policy and names for the pipeline threads.
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Each thread in the pipeline belongs to a class, such as "encoder-output" or "post-process",
+ * and calls ThreadConfig::Get().Apply() with that class when it starts. Every thread is given
+ * a name (visible in top -H, ps and debuggers), and any settings given for its class with
+ * --thread are applied. A setting is the class followed by colon-separated fields, like
+ *   encoder-output:cpus=2,3:fifo=50
+ * where the fields are:
+ *   cpus=<list>  CPUs the thread may run on, e.g. 3 or 0,1 or 2-3
+ *   fifo=<prio>  run as SCHED_FIFO with this priority (1 to 99)
+ *   rr=<prio>    run as SCHED_RR with this priority (1 to 99)
+ *   nice=<n>     run as SCHED_OTHER with this nice value
+ *   name=<name>  use this thread name instead of the default
+ * The real-time policies need CAP_SYS_NICE or a suitable RLIMIT_RTPRIO.
+ */
+class ThreadConfig
+{
+public:
+	static ThreadConfig &Get();
+
+	// The thread classes, and the default thread names that go with them.
+	static std::map<std::string, std::string> const &Classes();
+
+	// Throws std::runtime_error if any of the settings cannot be parsed.
+	void Configure(std::vector<std::string> const &settings);
+	// Configure the calling thread, which belongs to the named class.
+	void Apply(char const *thread_class) const;
+
+private:
+	struct Settings
+	{
+		std::vector<unsigned int> cpus;
+		int policy = -1;
+		int priority = 0;
+		bool nice_set = false;
+		int nice = 0;
+		std::string name;
+	};
+
+	ThreadConfig() = default;
+
+	std::map<std::string, Settings> settings_;
+};
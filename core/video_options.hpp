@@ -38,10 +38,24 @@ struct VideoOptions : public Options
 			 "Set a custom location for the encoder library .so files")
 			("save-pts", value<std::string>(&v_->save_pts),
 			 "Save a timestamp file with this name")
+			("pts-format", value<std::string>(&v_->pts_format)->default_value("v2"),
+			 "Format of the --save-pts file: v2 (mkvmerge timecodes), txt (adding the sensor and wall clock "
+			 "timestamps and sequence numbers) or bin")
 			("quality,q", value<int>(&v_->quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
+			("mjpeg-slices", value<unsigned int>(&v_->mjpeg_slices)->default_value(0)->implicit_value(4),
+			 "Split each MJPEG frame into this many bands, encoded at the same time, to reduce the latency "
+			 "(0 = each frame is encoded on a single thread)")
+			("mjpeg-optimise", value<bool>(&v_->mjpeg_optimise)->default_value(false)->implicit_value(true),
+			 "Use Huffman tables optimised for the first MJPEG frame, which makes frames smaller at no extra cost "
+			 "per frame, though by less if the scene changes a lot")
+			("h264-slices", value<unsigned int>(&v_->h264_slices)->default_value(0),
+			 "Encode each H.264 frame as this many slices, and pass each slice to a network output as soon as "
+			 "it is ready (0 = one slice per frame, h264 only)")
 			("listen,l", value<bool>(&v_->listen)->default_value(false)->implicit_value(true),
-			 "Listen for an incoming client network connection before sending data to the client")
+			 "Serve a tcp:// output to any number of clients that connect, rather than connecting to one")
+			("mtu", value<unsigned int>(&v_->mtu)->default_value(1500),
+			 "Largest IP packet to send for rtp:// and rtsp:// outputs, which split the stream into RTP packets to fit")
 			("keypress,k", value<bool>(&v_->keypress)->default_value(false)->implicit_value(true),
 			 "Pause or resume video recording when ENTER pressed")
 			("signal,s", value<bool>(&v_->signal)->default_value(false)->implicit_value(true),
@@ -52,8 +66,30 @@ struct VideoOptions : public Options
 			 "Create a new output file every time recording is paused and then resumed")
 			("segment", value<uint32_t>(&v_->segment)->default_value(0),
 			 "Break the recording into files of approximately this many milliseconds")
+			("hls", value<std::string>(&v_->hls),
+			 "With --segment, write the h264 segments as fragmented MP4 and keep an HLS playlist of them in this "
+			 "file, with the shared init.mp4 next to it. Needs the hardware h264 encoder, so not on Pi 5")
+			("hls-list-size", value<unsigned int>(&v_->hls_list_size)->default_value(6),
+			 "Number of segments the HLS playlist lists, or 0 to list them all")
 			("circular", value<size_t>(&v_->circular)->default_value(0)->implicit_value(4),
 			 "Write output to a circular buffer of the given size (in MB) which is saved on exit")
+			("write-buffer", value<size_t>(&v_->write_buffer)->default_value(8),
+			 "Size (in MB) of the buffer between the encoder and a thread that writes the output file, or 0 to "
+			 "write from the encoder's own thread. What happens when it is full follows --queue-policy")
+			("direct-io", value<bool>(&v_->direct_io)->default_value(false)->implicit_value(true),
+			 "Write output files with O_DIRECT, bypassing the page cache")
+			("circular-file", value<std::string>(&v_->circular_file),
+			 "Keep the --circular buffer in this file, for example on tmpfs or an SSD, rather than in memory")
+			("clip-output", value<std::string>(&v_->clip_output),
+			 "With --circular, save a clip from the buffer to a new file with this name each time recording "
+			 "is triggered, by ENTER, a signal, a \"clip\" control socket command or the --clip-trigger. "
+			 "Include a directive such as %04d for the clip number")
+			("clip-pre", value<std::string>(&v_->clip_pre_)->default_value("5s"),
+			 "How much video from before the trigger goes into each clip. If no units are provided, default to ms.")
+			("clip-post", value<std::string>(&v_->clip_post_)->default_value("5s"),
+			 "How much video after the last trigger goes into each clip. If no units are provided, default to ms.")
+			("clip-trigger", value<std::string>(&v_->clip_trigger),
+			 "Name of a true/false metadata item, such as motion_detect.result, that triggers a clip when true")
 			("frames", value<unsigned int>(&v_->frames)->default_value(0),
 			 "Run for the exact number of frames specified. This will override any timeout set.")
 			("libav-video-codec", value<std::string>(&v_->libav_video_codec)->default_value("h264_v4l2m2m"),
@@ -91,8 +127,54 @@ struct VideoOptions : public Options
 			("av-sync", value<std::string>(&v_->av_sync_)->default_value("0us"),
 			 "Add a time offset (in microseconds if no units provided) to the audio stream, relative to the video stream. "
 			 "The offset value can be either positive or negative.")
+			("audio-period", value<std::string>(&v_->audio_period_)->default_value("0us"),
+			 "Capture audio in fragments of this length (in microseconds if no units provided), trading CPU time "
+			 "for less audio latency. Only the pulse source can be asked for this; 0 leaves it to the device.")
 			("low-latency", value<bool>(&v_->low_latency)->default_value(false)->implicit_value(true),
 			 "Enables the libav/libx264 low latency presets for video encoding.")
+			("control-socket", value<std::string>(&v_->control_socket),
+			 "Accept commands on this UNIX socket to change the resolution, lores stream or framerate while "
+			 "running, e.g. \"resolution 1280x720 framerate 15\" or \"lores off\", or to turn a post-processing "
+			 "stage on or off, e.g. \"disable hailo_yolo_inference\", or to pan and zoom the main or lores "
+			 "stream, e.g. \"lores-roi 0.5,0.25,0.25,0.25\"")
+			("server-dir", value<std::string>(&v_->server_dir)->default_value("/tmp/rpicam-server"),
+			 "Directory in which rpicam-server creates the sockets that its clients connect to")
+			("server-credits", value<unsigned int>(&v_->server_credits)->default_value(2),
+			 "Number of frames that each rpicam-server client may hold on to at once. Held frames are "
+			 "unavailable to the camera, so --buffer-count may need raising to match")
+			("raw-headers", value<bool>(&v_->raw_headers)->default_value(false)->implicit_value(true),
+			 "Precede each raw frame from rpicam-raw with a header describing it, so that the output is an "
+			 ".rpiraw file that rpicam-raw2dng can convert")
+			("raw-write-behind", value<unsigned int>(&v_->raw_write_behind)->default_value(0),
+			 "Have rpicam-raw write frames from a thread of its own, queueing up to this many of them. Frames "
+			 "are written straight from the camera buffers, or copied when the camera runs short, and any that "
+			 "don't fit are dropped and reported (0 = write through the encoder and --output as usual)")
+			("raw-index", value<bool>(&v_->raw_index)->default_value(false)->implicit_value(true),
+			 "With --raw-write-behind, also write a .idx file listing the offset, size and timestamp of each frame")
+			("adaptive-bitrate", value<bool>(&v_->adaptive_bitrate)->default_value(false)->implicit_value(true),
+			 "Lower the bitrate (down to a quarter of --bitrate) while a network output is congested, and "
+			 "raise it again as the congestion clears")
+			("lores-output", value<std::string>(&v_->lores_output),
+			 "Also encode the lores stream (see --lores-width and --lores-height) to this output")
+			("lores-codec", value<std::string>(&v_->lores_codec)->default_value("mjpeg"),
+			 "Codec for the lores output, either mjpeg, h264 or yuv420")
+			("lores-bitrate", value<std::string>(&v_->lores_bitrate_)->default_value("0bps"),
+			 "Set the bitrate for the lores output. If no units are provided, default to bits/second.")
+			("tee-output", value<std::vector<std::string>>(&v_->tee_output),
+			 "Also send the encoded stream to this output, alongside --output. May be given more than once. "
+			 "Each runs on its own thread and drops frames, rather than hold up the others, if it falls behind. "
+			 "Prefix with circular: for a circular buffer of --circular MB (4 if not given), saved on exit")
+			("region-quality", value<float>(&v_->region_quality)->default_value(0),
+			 "Encode objects found by the object_detect or motion_detect stages at a higher quality than the "
+			 "background, by this amount between 0 and 1 (0 = off). Only libx264 supports this")
+			("idle-key", value<std::string>(&v_->idle_key),
+			 "Name of a true/false metadata item, such as motion_detect.result, that says whether anything "
+			 "is happening. While it stays false, frames are only encoded at the --idle-framerate")
+			("idle-framerate", value<float>(&v_->idle_framerate)->default_value(1),
+			 "Rate at which to encode frames while the --idle-key is false")
+			("idle-hold", value<std::string>(&v_->idle_hold_)->default_value("2s"),
+			 "Keep encoding at the full rate for this long after the --idle-key was last true. If no units "
+			 "are provided, default to ms.")
 #ifndef DISABLE_RPI_FEATURES
 			 ("sync", value<std::string>(&v_->sync_)->default_value("off"),
 			  "Whether to synchronise with another camera. Use \"off\", \"server\" or \"client\".")
@@ -109,6 +191,14 @@ struct VideoOptions : public Options
 		return v_->ParseVideo();
 	}
 
+	// A copy of these options, for an encoder or output that needs some settings of its own.
+	std::unique_ptr<VideoOptions> Clone() const
+	{
+		auto clone = std::make_unique<VideoOptions>();
+		clone->copyFrom(*this);
+		return clone;
+	}
+
 	virtual void Print() const override
 	{
 		Options::Print();
@@ -9,12 +9,25 @@
 
 #include <functional>
 #include <map>
+#include <vector>
+
+#include <libcamera/geometry.h>
 
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
 typedef std::function<void(void *)> InputDoneCallback;
-typedef std::function<void(void *, size_t, int64_t, bool)> OutputReadyCallback;
+// Arguments are the data, its size, timestamp, whether it's a keyframe and whether it is only part of
+// the frame (a slice), with the rest to follow in further calls with the same timestamp.
+typedef std::function<void(void *, size_t, int64_t, bool, bool)> OutputReadyCallback;
+
+// Part of a frame to encode at a different quality. The offset runs from -1 (much better) to
+// 1 (much worse) relative to the rest of the frame.
+struct EncodeRegion
+{
+	libcamera::Rectangle box;
+	float offset;
+};
 
 class Encoder
 {
@@ -33,6 +46,17 @@ public:
 	// Encode the given buffer. The buffer is specified both by an fd and size
 	// describing a DMABUF, and by a mmapped userland pointer.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) = 0;
+	// Change the encoding while it runs. These may be called from any thread and take effect within
+	// a frame or two. They return false if the encoder can't make the change.
+	virtual bool SetBitrate([[maybe_unused]] uint32_t bps) { return false; }
+	virtual bool SetQpRange([[maybe_unused]] unsigned int min_qp, [[maybe_unused]] unsigned int max_qp)
+	{
+		return false;
+	}
+	virtual bool RequestKeyframe() { return false; }
+	// Regions for the next frame given to EncodeBuffer, from the same thread, in that frame's
+	// coordinates. Where they overlap, the earlier region wins.
+	virtual bool SetRegions([[maybe_unused]] std::vector<EncodeRegion> const &regions) { return false; }
 
 protected:
 	InputDoneCallback input_done_callback_;
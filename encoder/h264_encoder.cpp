@@ -15,6 +15,9 @@
 #include <chrono>
 #include <iostream>
 
+#include "core/frame_trace.hpp"
+#include "core/thread_config.hpp"
+
 #include "h264_encoder.hpp"
 
 static int xioctl(int fd, unsigned long ctl, void *arg)
@@ -38,8 +41,38 @@ static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
 	return V4L2_COLORSPACE_SMPTE170M;
 }
 
+static bool set_control(int fd, uint32_t id, int32_t value, char const *name)
+{
+	v4l2_control ctrl = {};
+	ctrl.id = id;
+	ctrl.value = value;
+	if (xioctl(fd, VIDIOC_S_CTRL, &ctrl) < 0)
+	{
+		LOG_ERROR("WARNING: H264: failed to set " << name);
+		return false;
+	}
+	return true;
+}
+
+// Count the coded slices (NAL unit types 1 and 5) in a buffer of Annex B H.264.
+static unsigned int count_slices(uint8_t const *data, size_t size)
+{
+	unsigned int slices = 0;
+	for (size_t i = 0; i + 3 < size; i++)
+	{
+		if (data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)
+		{
+			unsigned int type = data[i + 3] & 0x1f;
+			slices += type == 1 || type == 5;
+			i += 3;
+		}
+	}
+	return slices;
+}
+
 H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
-	: Encoder(options), abortPoll_(false), abortOutput_(false)
+	: Encoder(options), abortPoll_(false), abortOutput_(false), slices_per_frame_(1), slices_seen_(0),
+	  slice_timestamp_(-1)
 {
 	// First open the encoder device. Maybe we should double-check its "caps".
 
@@ -102,6 +135,18 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 			throw std::runtime_error("failed to set inline headers");
 	}
 
+	if (options->Get().h264_slices > 1)
+	{
+		unsigned int mbs = ((info.width + 15) / 16) * ((info.height + 15) / 16);
+		unsigned int max_mbs = (mbs + options->Get().h264_slices - 1) / options->Get().h264_slices;
+		// Carry on with whole frames if the driver can't do this.
+		if (set_control(fd_, V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MODE, V4L2_MPEG_VIDEO_MULTI_SLICE_MODE_MAX_MB,
+						"slice mode") &&
+			set_control(fd_, V4L2_CID_MPEG_VIDEO_MULTI_SLICE_MAX_MB, max_mbs, "macroblocks per slice"))
+			slices_per_frame_ = (mbs + max_mbs - 1) / max_mbs;
+		LOG(2, "H264: " << slices_per_frame_ << " slices per frame");
+	}
+
 	// Set the output and capture formats. We know exactly what they will be.
 
 	v4l2_format fmt = {};
@@ -272,8 +317,26 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 		throw std::runtime_error("failed to queue input to codec");
 }
 
+bool H264Encoder::SetBitrate(uint32_t bps)
+{
+	LOG(2, "H264: bitrate now " << bps);
+	return set_control(fd_, V4L2_CID_MPEG_VIDEO_BITRATE, bps, "bitrate");
+}
+
+bool H264Encoder::SetQpRange(unsigned int min_qp, unsigned int max_qp)
+{
+	return set_control(fd_, V4L2_CID_MPEG_VIDEO_H264_MIN_QP, min_qp, "minimum QP") &&
+		   set_control(fd_, V4L2_CID_MPEG_VIDEO_H264_MAX_QP, max_qp, "maximum QP");
+}
+
+bool H264Encoder::RequestKeyframe()
+{
+	return set_control(fd_, V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME, 1, "key frame");
+}
+
 void H264Encoder::pollThread()
 {
+	ThreadConfig::Get().Apply("encoder-poll");
 	while (true)
 	{
 		pollfd p = { fd_, POLLIN, 0 };
@@ -322,11 +385,22 @@ void H264Encoder::pollThread()
 				// application can take its time with the data without blocking the
 				// encode process.
 				int64_t timestamp_us = (buf.timestamp.tv_sec * (int64_t)1000000) + buf.timestamp.tv_usec;
+				if (FrameTrace::Get().Enabled())
+					FrameTrace::Get().Record("encode-dequeue", "encoder", FrameTrace::NO_ID, timestamp_us);
+				bool partial = false;
+				if (slices_per_frame_ > 1)
+				{
+					if (timestamp_us != slice_timestamp_)
+						slices_seen_ = 0, slice_timestamp_ = timestamp_us;
+					slices_seen_ += count_slices((uint8_t *)buffers_[buf.index].mem, buf.m.planes[0].bytesused);
+					partial = slices_seen_ < slices_per_frame_;
+				}
 				OutputItem item = { buffers_[buf.index].mem,
 									buf.m.planes[0].bytesused,
 									buf.m.planes[0].length,
 									buf.index,
 									!!(buf.flags & V4L2_BUF_FLAG_KEYFRAME),
+									partial,
 									timestamp_us };
 				std::lock_guard<std::mutex> lock(output_mutex_);
 				output_queue_.push(item);
@@ -338,6 +412,7 @@ void H264Encoder::pollThread()
 
 void H264Encoder::outputThread()
 {
+	ThreadConfig::Get().Apply("encoder-output");
 	OutputItem item;
 	while (true)
 	{
@@ -362,7 +437,9 @@ void H264Encoder::outputThread()
 			}
 		}
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe);
+		static PerfTotals *perf = PerfCounters::Totals("encoder/h264-output");
+		FrameTraceScope trace("h264-output", "encoder", FrameTrace::NO_ID, item.timestamp_us, perf);
+		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe, item.partial);
 		v4l2_buffer buf = {};
 		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
 		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
@@ -21,6 +21,10 @@ public:
 	~H264Encoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// These go straight to the V4L2 controls, which the driver applies from the next frame.
+	bool SetBitrate(uint32_t bps) override;
+	bool SetQpRange(unsigned int min_qp, unsigned int max_qp) override;
+	bool RequestKeyframe() override;
 
 private:
 	// We want at least as many output buffers as there are in the camera queue
@@ -43,6 +47,11 @@ private:
 	bool abortPoll_;
 	bool abortOutput_;
 	int fd_;
+	// When encoding in slices, the driver may return a frame in several buffers. The poll thread
+	// counts the slices for each timestamp to tell which buffer completes the frame.
+	unsigned int slices_per_frame_;
+	unsigned int slices_seen_;
+	int64_t slice_timestamp_;
 	struct BufferDescription
 	{
 		void *mem;
@@ -60,6 +69,7 @@ private:
 		size_t length;
 		unsigned int index;
 		bool keyframe;
+		bool partial;
 		int64_t timestamp_us;
 	};
 	std::queue<OutputItem> output_queue_;
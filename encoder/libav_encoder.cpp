@@ -16,6 +16,10 @@
 
 #include <chrono>
 #include <iostream>
+#include <optional>
+
+#include "core/frame_trace.hpp"
+#include "core/thread_config.hpp"
 
 #include "libav_encoder.hpp"
 
@@ -274,6 +278,23 @@ void LibAvEncoder::initAudioInCodec(VideoOptions const *options, StreamInfo cons
 	if (options->Get().audio_channels != 0)
 		ret = av_dict_set_int(&format_opts, "channels", options->Get().audio_channels, 0);
 
+	if (options->Get().audio_period)
+	{
+		// Pulse delivers its default 48kHz 16-bit samples in fragments and packets of the sizes given. The
+		// alsa source has no such options, and reads a period at a time as the device is set up.
+		if (options->Get().audio_source == "pulse")
+		{
+			int64_t channels = options->Get().audio_channels ? options->Get().audio_channels : 2;
+			int64_t bytes = options->Get().audio_period.get<std::chrono::microseconds>() * 48 * channels * 2 / 1000;
+			bytes = std::max<int64_t>(bytes / (channels * 2), 1) * channels * 2;
+			av_dict_set_int(&format_opts, "fragment_size", bytes, 0);
+			av_dict_set_int(&format_opts, "frame_size", bytes, 0);
+		}
+		// Don't keep the packets read while probing the stream, which would only be a backlog to catch up on.
+		in_fmt_ctx_ = avformat_alloc_context();
+		in_fmt_ctx_->flags |= AVFMT_FLAG_NOBUFFER;
+	}
+
 	ret = avformat_open_input(&in_fmt_ctx_, options->Get().audio_device.c_str(), input_fmt, &format_opts);
 	if (ret < 0)
 	{
@@ -358,9 +379,11 @@ void LibAvEncoder::initAudioOutCodec(VideoOptions const *options, StreamInfo con
 }
 
 LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
-	: Encoder(options), output_ready_(false), abort_video_(false), abort_audio_(false), video_start_ts_(0),
-	  in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr), output_file_(options->Get().output), output_initialised_(false),
-	  elementary_stream_(false)
+	: Encoder(options), output_ready_(false), requested_bitrate_(0), keyframe_requested_(false), abort_video_(false),
+	  abort_audio_(false), video_start_ts_(0), audio_full_(AUDIO_CHUNKS), audio_free_(AUDIO_CHUNKS),
+	  audio_capture_done_(false), in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr), drm_desc_pool_(nullptr),
+	  abort_mux_(false), mux_waiting_keyframe_(false), mux_dropped_(0), output_file_(options->Get().output),
+	  output_initialised_(false), elementary_stream_(false)
 {
 	avdevice_register_all();
 
@@ -368,6 +391,13 @@ LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 		av_log_set_level(AV_LOG_VERBOSE);
 
 	initVideoCodec(options, info);
+	if (codec_ctx_[Video]->pix_fmt == AV_PIX_FMT_DRM_PRIME)
+	{
+		drm_desc_pool_ = av_buffer_pool_init(sizeof(AVDRMFrameDescriptor), av_buffer_allocz);
+		if (!drm_desc_pool_)
+			throw std::runtime_error("libav: could not allocate DRM descriptor pool");
+	}
+
 	if (options->Get().libav_audio)
 	{
 		initAudioInCodec(options, info);
@@ -379,10 +409,17 @@ LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 
 	LOG(2, "libav: codec init completed");
 
+	mux_thread_ = std::thread(&LibAvEncoder::muxThread, this);
 	video_thread_ = std::thread(&LibAvEncoder::videoThread, this);
 
 	if (options->Get().libav_audio)
+	{
+		audio_chunks_.resize(AUDIO_CHUNKS);
+		for (unsigned int i = 0; i < AUDIO_CHUNKS; i++)
+			audio_free_.TryPush(i);
 		audio_thread_ = std::thread(&LibAvEncoder::audioThread, this);
+		audio_capture_thread_ = std::thread(&LibAvEncoder::audioCaptureThread, this);
+	}
 }
 
 LibAvEncoder::~LibAvEncoder()
@@ -390,7 +427,14 @@ LibAvEncoder::~LibAvEncoder()
 	if (options_->Get().libav_audio)
 	{
 		abort_audio_ = true;
+		audio_capture_thread_.join();
 		audio_thread_.join();
+		for (AudioChunk &chunk : audio_chunks_)
+		{
+			if (chunk.samples)
+				av_freep(&chunk.samples[0]);
+			av_freep(&chunk.samples);
+		}
 	}
 
 	abort_video_ = true;
@@ -399,6 +443,11 @@ LibAvEncoder::~LibAvEncoder()
 	avformat_free_context(out_fmt_ctx_);
 	avcodec_free_context(&codec_ctx_[Video]);
 
+	for (AVFrame *frame : free_frames_)
+		av_frame_free(&frame);
+	// Any descriptors still referenced are freed when their last reference goes.
+	av_buffer_pool_uninit(&drm_desc_pool_);
+
 	if (options_->Get().libav_audio)
 	{
 		avformat_free_context(in_fmt_ctx_);
@@ -411,7 +460,17 @@ LibAvEncoder::~LibAvEncoder()
 
 void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
-	AVFrame *frame = av_frame_alloc();
+	AVFrame *frame = nullptr;
+	{
+		std::scoped_lock<std::mutex> lock(video_mutex_);
+		if (!free_frames_.empty())
+		{
+			frame = free_frames_.back();
+			free_frames_.pop_back();
+		}
+	}
+	if (!frame)
+		frame = av_frame_alloc();
 	if (!frame)
 		throw std::runtime_error("libav: could not allocate AVFrame");
 
@@ -429,14 +488,28 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	frame->pts = timestamp_us - video_start_ts_ +
 				 (options_->Get().av_sync.value < 0us ? -options_->Get().av_sync.get<std::chrono::microseconds>() : 0);
 
+	// The capture buffer itself is only ever referenced, never copied, and is handed back through
+	// releaseBuffer once the codec drops its last reference to the frame.
+	AVBufferRef *capture_buf = av_buffer_create((uint8_t *)mem, size, &LibAvEncoder::releaseBuffer, this, 0);
+	if (!capture_buf)
+	{
+		av_frame_free(&frame);
+		throw std::runtime_error("libav: could not wrap capture buffer");
+	}
+
 	if (codec_ctx_[Video]->pix_fmt == AV_PIX_FMT_DRM_PRIME)
 	{
-		std::scoped_lock<std::mutex> lock(drm_queue_lock_);
-		drm_frame_queue_.emplace(std::make_unique<AVDRMFrameDescriptor>());
-		frame->buf[0] = av_buffer_create((uint8_t *)drm_frame_queue_.back().get(), sizeof(AVDRMFrameDescriptor),
-										 &LibAvEncoder::releaseBuffer, this, 0);
+		frame->buf[0] = av_buffer_pool_get(drm_desc_pool_);
+		if (!frame->buf[0])
+		{
+			av_buffer_unref(&capture_buf);
+			av_frame_free(&frame);
+			throw std::runtime_error("libav: could not allocate DRM descriptor");
+		}
+		frame->buf[1] = capture_buf;
 		frame->data[0] = frame->buf[0]->data;
 
+		// Descriptors come back from the pool as they were last used, so set everything we rely on.
 		AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
 		desc->nb_objects = 1;
 		desc->objects[0].fd = fd;
@@ -458,9 +531,31 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	}
 	else
 	{
-		frame->buf[0] = av_buffer_create((uint8_t *)mem, size, &LibAvEncoder::releaseBuffer, this, 0);
+		// Software encoders such as libx264 only read the input, so there is no need to make the
+		// frame writable, which would copy it whenever the buffer is shared.
+		frame->buf[0] = capture_buf;
 		av_image_fill_pointers(frame->data, AV_PIX_FMT_YUV420P, frame->height, frame->buf[0]->data, frame->linesize);
-		av_frame_make_writable(frame);
+	}
+
+	if (!regions_.empty())
+	{
+		AVFrameSideData *side_data = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST,
+															 regions_.size() * sizeof(AVRegionOfInterest));
+		if (side_data)
+		{
+			AVRegionOfInterest *roi = (AVRegionOfInterest *)side_data->data;
+			for (auto const &region : regions_)
+			{
+				roi->self_size = sizeof(AVRegionOfInterest);
+				roi->top = region.box.y;
+				roi->bottom = region.box.y + region.box.height;
+				roi->left = region.box.x;
+				roi->right = region.box.x + region.box.width;
+				roi->qoffset = av_d2q(region.offset, 100);
+				roi++;
+			}
+		}
+		regions_.clear();
 	}
 
 	std::scoped_lock<std::mutex> lock(video_mutex_);
@@ -548,43 +643,144 @@ void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
 		// Rescale from the codec timebase to the stream timebase.
 		av_packet_rescale_ts(pkt, codec_ctx_[stream_id]->time_base, out_fmt_ctx_->streams[stream_id]->time_base);
 
-		if (!elementary_stream_)
+		AVPacket *queued = av_packet_alloc();
+		if (!queued)
+			throw std::runtime_error("libav: could not allocate packet");
+		av_packet_move_ref(queued, pkt);
+		queuePacket(queued);
+	}
+}
+
+void LibAvEncoder::queuePacket(AVPacket *pkt)
+{
+	std::scoped_lock<std::mutex> lock(mux_mutex_);
+	uint64_t dropped = mux_dropped_;
+
+	// Losing a video packet breaks every frame up to the next keyframe, so when the output falls this
+	// far behind we discard all the video still waiting and resume at a keyframe. Audio can stay.
+	if (mux_queue_.size() >= MUX_QUEUE_DEPTH)
+	{
+		for (auto it = mux_queue_.begin(); it != mux_queue_.end();)
 		{
-			std::scoped_lock<std::mutex> lock(output_mutex_);
-			// pkt is now blank (av_interleaved_write_frame() takes ownership of
-			// its contents and resets pkt), so that no unreferencing is necessary.
-			// This would be different if one used av_write_frame().
-			ret = av_interleaved_write_frame(out_fmt_ctx_, pkt);
-			if (ret < 0)
+			if ((*it)->stream_index == Video)
 			{
-				char err[AV_ERROR_MAX_STRING_SIZE];
-				av_strerror(ret, err, sizeof(err));
-				throw std::runtime_error("libav: error writing output: " + std::string(err));
+				av_packet_free(&*it);
+				it = mux_queue_.erase(it);
+				mux_dropped_++;
 			}
+			else
+				++it;
+		}
+		mux_waiting_keyframe_ = true;
+		keyframe_requested_ = true;
+	}
+
+	if (pkt->stream_index == Video)
+	{
+		if (mux_waiting_keyframe_ && !(pkt->flags & AV_PKT_FLAG_KEY))
+		{
+			av_packet_free(&pkt);
+			mux_dropped_++;
 		}
 		else
+			mux_waiting_keyframe_ = false;
+	}
+
+	if (pkt)
+	{
+		// Only audio can be left filling the queue now.
+		if (mux_queue_.size() >= MUX_QUEUE_DEPTH)
+		{
+			av_packet_free(&mux_queue_.front());
+			mux_queue_.pop_front();
+			mux_dropped_++;
+		}
+		mux_queue_.push_back(pkt);
+		mux_cv_.notify_one();
+	}
+
+	if (mux_dropped_ != dropped)
+		LOG(1, "libav: output is not keeping up, " << mux_dropped_ << " packets dropped so far");
+}
+
+void LibAvEncoder::writePacket(AVPacket *pkt)
+{
+	if (!elementary_stream_)
+	{
+		// pkt is now blank (av_interleaved_write_frame() takes ownership of
+		// its contents and resets pkt), so that no unreferencing is necessary.
+		// This would be different if one used av_write_frame().
+		int ret = av_interleaved_write_frame(out_fmt_ctx_, pkt);
+		if (ret < 0)
+		{
+			char err[AV_ERROR_MAX_STRING_SIZE];
+			av_strerror(ret, err, sizeof(err));
+			throw std::runtime_error("libav: error writing output: " + std::string(err));
+		}
+	}
+	else
+	{
+		// H.264 elementary streams use the Output class to write encoded data so that they can use features such as
+		// pause/circular/split/metadata, etc.
+		output_ready_callback_(pkt->data, pkt->size, pkt->pts, pkt->flags & AV_PKT_FLAG_KEY, false);
+	}
+}
+
+void LibAvEncoder::muxThread()
+{
+	ThreadConfig::Get().Apply("encoder-output");
+
+	while (true)
+	{
+		AVPacket *pkt;
 		{
-			// H.264 elementary streams use the Output class to write encoded data so that they can use features such as
-			// pause/circular/split/metadata, etc.
-			output_ready_callback_(pkt->data, pkt->size, pkt->pts, pkt->flags & AV_PKT_FLAG_KEY);
+			std::unique_lock<std::mutex> lock(mux_mutex_);
+			mux_cv_.wait(lock, [this] { return abort_mux_ || !mux_queue_.empty(); });
+			// Everything queued before the abort still gets written.
+			if (mux_queue_.empty())
+				break;
+			pkt = mux_queue_.front();
+			mux_queue_.pop_front();
 		}
+
+		writePacket(pkt);
+		av_packet_free(&pkt);
 	}
 }
 
+bool LibAvEncoder::SetRegions(std::vector<EncodeRegion> const &regions)
+{
+	// Of the codecs we use, only libx264 looks at the regions, and then only with adaptive
+	// quantisation on, as it is by default.
+	if (options_->Get().libav_video_codec != "libx264")
+		return false;
+	regions_ = regions;
+	return true;
+}
+
+bool LibAvEncoder::SetBitrate(uint32_t bps)
+{
+	LOG(2, "libav: bitrate now " << bps);
+	requested_bitrate_ = bps;
+	return true;
+}
+
+bool LibAvEncoder::RequestKeyframe()
+{
+	keyframe_requested_ = true;
+	return true;
+}
+
 extern "C" void LibAvEncoder::releaseBuffer(void *opaque, uint8_t *data)
 {
 	LibAvEncoder *enc = static_cast<LibAvEncoder *>(opaque);
 
 	enc->input_done_callback_(nullptr);
-
-	// Pop the entry from the queue to release the AVDRMFrameDescriptor allocation
-	std::scoped_lock<std::mutex> lock(enc->drm_queue_lock_);
-	if (!enc->drm_frame_queue_.empty())
-		enc->drm_frame_queue_.pop();
 }
 
 void LibAvEncoder::videoThread()
 {
+	ThreadConfig::Get().Apply("encoder");
 	AVPacket *pkt = av_packet_alloc();
 	AVFrame *frame = nullptr;
 
@@ -611,79 +807,92 @@ void LibAvEncoder::videoThread()
 			}
 		}
 
+		// The trace identifies the frame by its original timestamp, which is only recovered exactly
+		// when there is no negative A/V sync offset.
+		static PerfTotals *perf = PerfCounters::Totals("encoder/libav-encode");
+		FrameTraceScope trace("libav-encode", "encoder", FrameTrace::NO_ID, frame->pts + video_start_ts_, perf);
+
+		// The libx264 wrapper reconfigures itself when it sees the bitrate change. Other codecs may
+		// not, as libav doesn't promise that it will have any effect once the codec is open.
+		if (uint32_t bps = requested_bitrate_.exchange(0))
+		{
+			codec_ctx_[Video]->bit_rate = bps;
+			if (codec_ctx_[Video]->rc_max_rate)
+				codec_ctx_[Video]->rc_max_rate = bps;
+		}
+		if (keyframe_requested_.exchange(false))
+			frame->pict_type = AV_PICTURE_TYPE_I;
+
 		int ret = avcodec_send_frame(codec_ctx_[Video], frame);
 		if (ret < 0)
 			throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
 
 		encode(pkt, Video);
-		av_frame_free(&frame);
+
+		// Dropping our references here may release the capture buffer, unless the codec
+		// still holds on to it.
+		av_frame_unref(frame);
+		std::scoped_lock<std::mutex> lock(video_mutex_);
+		free_frames_.push_back(frame);
 	}
 
 done:
 	// Flush the encoder
 	avcodec_send_frame(codec_ctx_[Video], nullptr);
 	encode(pkt, Video);
-
 	av_packet_free(&pkt);
+
+	// The audio thread has already finished, so once the mux thread drains the queue we can
+	// write the trailer.
+	{
+		std::scoped_lock<std::mutex> lock(mux_mutex_);
+		abort_mux_ = true;
+		mux_cv_.notify_one();
+	}
+	mux_thread_.join();
 	deinitOutput();
 }
 
-void LibAvEncoder::audioThread()
+void LibAvEncoder::audioCaptureThread()
 {
+	ThreadConfig::Get().Apply("audio");
 	const AVSampleFormat required_fmt = codec_ctx_[AudioOut]->sample_fmt;
+	int out_channels = codec_ctx_[AudioOut]->ch_layout.nb_channels;
 	int ret;
 
-	uint32_t out_channels = codec_ctx_[AudioOut]->ch_layout.nb_channels;
-
 	SwrContext *conv = nullptr;
-	AVAudioFifo *fifo;
-
 	ret = swr_alloc_set_opts2(&conv, &codec_ctx_[AudioOut]->ch_layout, required_fmt,
 							  stream_[AudioOut]->codecpar->sample_rate, &codec_ctx_[AudioIn]->ch_layout,
 							  codec_ctx_[AudioIn]->sample_fmt, codec_ctx_[AudioIn]->sample_rate, 0, nullptr);
 	if (ret < 0)
 		throw std::runtime_error("libav: cannot create swr context");
-
-	// 2 seconds FIFO buffer
-	fifo = av_audio_fifo_alloc(required_fmt, out_channels, codec_ctx_[AudioOut]->sample_rate * 2);
 	swr_init(conv);
 
 	AVPacket *in_pkt = av_packet_alloc();
-	AVPacket *out_pkt = av_packet_alloc();
 	AVFrame *in_frame = av_frame_alloc();
-	uint8_t **samples = nullptr;
-	int sample_linesize = 0;
-
-	int max_output_samples = av_rescale_rnd(codec_ctx_[AudioOut]->frame_size, codec_ctx_[AudioOut]->sample_rate,
-											codec_ctx_[AudioIn]->sample_rate, AV_ROUND_UP);
-	ret = av_samples_alloc_array_and_samples(&samples, &sample_linesize, out_channels, max_output_samples, required_fmt,
-											 0);
-	if (ret < 0)
-		throw std::runtime_error("libav: failed to alloc sample array");
-
-	int64_t audio_start_ts = 0;
-	int64_t audio_samples_processed = 0;
+	// Samples that there's no free chunk for are still converted, to keep the resampler's history, and go here.
+	AudioChunk spare;
+	int64_t samples_captured = 0, samples_dropped = 0;
 
+	// Nothing sleeps here, as any time spent not reading leaves samples waiting in the device.
 	while (!abort_audio_)
 	{
-		// Audio In
 		ret = av_read_frame(in_fmt_ctx_, in_pkt);
 		if (ret < 0)
 			throw std::runtime_error("libav: cannot read audio in frame");
-
-		// Track the first audio timestamp for synchronization
-		if (!audio_start_ts && in_pkt->pts != AV_NOPTS_VALUE)
-		{
-			audio_start_ts = av_rescale_q(in_pkt->pts, stream_[AudioIn]->time_base, { 1, 1000 * 1000 });
-			LOG(2, "libav: Audio start timestamp: " << audio_start_ts << " us");
-		}
+		int64_t capture_us = in_pkt->pts != AV_NOPTS_VALUE
+								 ? av_rescale_q(in_pkt->pts, stream_[AudioIn]->time_base, { 1, 1000 * 1000 })
+								 : av_gettime();
 
 		ret = avcodec_send_packet(codec_ctx_[AudioIn], in_pkt);
+		av_packet_unref(in_pkt);
 		if (ret < 0)
 			throw std::runtime_error("libav: cannot send pkt for decoding audio in");
 
 		ret = avcodec_receive_frame(codec_ctx_[AudioIn], in_frame);
-		if (ret && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+		if (ret == AVERROR(EAGAIN))
+			continue;
+		else if (ret && ret != AVERROR_EOF)
 			throw std::runtime_error("libav: error getting decoded audio in frame");
 
 		// Audio Resample/Conversion
@@ -691,28 +900,120 @@ void LibAvEncoder::audioThread()
 			av_rescale_rnd(swr_get_delay(conv, codec_ctx_[AudioIn]->sample_rate) + in_frame->nb_samples,
 						   codec_ctx_[AudioOut]->sample_rate, codec_ctx_[AudioIn]->sample_rate, AV_ROUND_UP);
 
-		if (num_output_samples > max_output_samples)
+		std::optional<unsigned int> index = audio_free_.TryPop();
+		AudioChunk &chunk = index ? audio_chunks_[*index] : spare;
+		if (num_output_samples > chunk.capacity)
 		{
-			av_freep(&samples[0]);
-			max_output_samples = num_output_samples;
-			ret = av_samples_alloc_array_and_samples(&samples, &sample_linesize, out_channels, max_output_samples,
+			if (chunk.samples)
+				av_freep(&chunk.samples[0]);
+			av_freep(&chunk.samples);
+			int linesize;
+			ret = av_samples_alloc_array_and_samples(&chunk.samples, &linesize, out_channels, num_output_samples,
 													 required_fmt, 0);
 			if (ret < 0)
 				throw std::runtime_error("libav: failed to alloc sample array");
+			chunk.capacity = num_output_samples;
 		}
 
-		ret = swr_convert(conv, samples, num_output_samples, (const uint8_t **)in_frame->extended_data,
+		ret = swr_convert(conv, chunk.samples, num_output_samples, (const uint8_t **)in_frame->extended_data,
 						  in_frame->nb_samples);
+		av_frame_unref(in_frame);
 		if (ret < 0)
 			throw std::runtime_error("libav: swr_convert failed");
 
-		av_audio_fifo_write(fifo, (void **)samples, num_output_samples);
+		chunk.nb_samples = ret;
+		chunk.first_sample = samples_captured;
+		chunk.capture_us = capture_us;
+		samples_captured += ret;
+		if (index)
+		{
+			audio_full_.TryPush(*index);
+			audio_notifier_.Notify();
+		}
+		else
+			samples_dropped += ret;
+	}
 
-		av_frame_unref(in_frame);
-		av_packet_unref(in_pkt);
+	audio_capture_done_ = true;
+	audio_notifier_.Notify();
+	if (samples_dropped)
+		LOG_ERROR("WARNING: libav: audio encoding fell behind, " << samples_dropped
+																  << " samples were replaced by silence");
+
+	swr_free(&conv);
+	if (spare.samples)
+		av_freep(&spare.samples[0]);
+	av_freep(&spare.samples);
+	av_packet_free(&in_pkt);
+	av_frame_free(&in_frame);
+}
+
+void LibAvEncoder::audioThread()
+{
+	ThreadConfig::Get().Apply("audio");
+	const AVSampleFormat required_fmt = codec_ctx_[AudioOut]->sample_fmt;
+	const int sample_rate = codec_ctx_[AudioOut]->sample_rate;
+	int ret;
+
+	uint32_t out_channels = codec_ctx_[AudioOut]->ch_layout.nb_channels;
+
+	// Samples wait here until there are enough for the codec, or while the video hasn't started. It grows
+	// if it needs to.
+	AVAudioFifo *fifo = av_audio_fifo_alloc(required_fmt, out_channels, sample_rate / 4);
+	AVPacket *out_pkt = av_packet_alloc();
+
+	// The sample index and capture time of each chunk in the fifo, to work out when the first sample of
+	// each frame that we encode was captured.
+	std::deque<std::pair<int64_t, int64_t>> capture_times;
+	int64_t audio_start_ts = 0;
+	int64_t audio_samples_processed = 0;
+	int64_t next_sample = 0;
+	int64_t latency_total_us = 0, latency_max_us = 0, latency_count = 0;
+	auto latency_report = std::chrono::steady_clock::now();
+
+	while (true)
+	{
+		std::optional<unsigned int> index = audio_full_.TryPop();
+		if (!index)
+		{
+			// The capture thread is done only after pushing its last chunk, so this can't miss one.
+			if (audio_capture_done_ && audio_full_.Empty())
+				break;
+			audio_notifier_.PrepareWait();
+			if (audio_full_.Empty() && !audio_capture_done_)
+				audio_notifier_.Wait();
+			else
+				audio_notifier_.CancelWait();
+			continue;
+		}
+
+		AudioChunk &chunk = audio_chunks_[*index];
+		// Track the first audio timestamp for synchronization
+		if (!audio_start_ts)
+		{
+			audio_start_ts = chunk.capture_us;
+			LOG(2, "libav: Audio start timestamp: " << audio_start_ts << " us");
+		}
+		// Samples the capture thread had to drop become silence, so that what follows keeps its timing.
+		if (chunk.first_sample > next_sample)
+		{
+			uint8_t **silence = nullptr;
+			int count = chunk.first_sample - next_sample, linesize;
+			if (av_samples_alloc_array_and_samples(&silence, &linesize, out_channels, count, required_fmt, 0) >= 0)
+			{
+				av_samples_set_silence(silence, 0, count, out_channels, required_fmt);
+				av_audio_fifo_write(fifo, (void **)silence, count);
+				av_freep(&silence[0]);
+			}
+			av_freep(&silence);
+		}
+		av_audio_fifo_write(fifo, (void **)chunk.samples, chunk.nb_samples);
+		capture_times.emplace_back(chunk.first_sample, chunk.capture_us);
+		next_sample = chunk.first_sample + chunk.nb_samples;
+		audio_free_.TryPush(*index);
 
 		// Not yet ready to generate encoded audio!
-		if (!output_ready_ || av_audio_fifo_size(fifo) < codec_ctx_[AudioOut]->frame_size)
+		if (!output_ready_)
 			continue;
 
 		// Audio Out
@@ -724,13 +1025,13 @@ void LibAvEncoder::audioThread()
 			av_channel_layout_copy(&out_frame->ch_layout, &codec_ctx_[AudioOut]->ch_layout);
 
 			out_frame->format = required_fmt;
-			out_frame->sample_rate = codec_ctx_[AudioOut]->sample_rate;
+			out_frame->sample_rate = sample_rate;
 
 			av_frame_get_buffer(out_frame, 0);
 			av_audio_fifo_read(fifo, (void **)out_frame->data, codec_ctx_[AudioOut]->frame_size);
 
 			const int64_t sample_time_us =
-				av_rescale_q(audio_samples_processed, { 1, codec_ctx_[AudioOut]->sample_rate }, { 1, 1000 * 1000 });
+				av_rescale_q(audio_samples_processed, { 1, sample_rate }, { 1, 1000 * 1000 });
 
 			// Make the TS relative to the start of recording.
 			const int64_t delta = audio_start_ts - (int64_t)video_start_ts_;
@@ -741,11 +1042,31 @@ void LibAvEncoder::audioThread()
 				(options_->Get().av_sync.value > 0us ? options_->Get().av_sync.get<std::chrono::microseconds>() : 0);
 
 			out_frame->pts = audio_timestamp;
+
+			// The audio path's latency runs from the capture of the frame's first sample to now, when it
+			// goes to the codec.
+			while (capture_times.size() > 1 && capture_times[1].first <= audio_samples_processed)
+				capture_times.pop_front();
+			int64_t captured_us = capture_times.front().second +
+								  av_rescale(audio_samples_processed - capture_times.front().first, 1000 * 1000,
+											 sample_rate);
+			int64_t latency_us = std::max<int64_t>(av_gettime() - captured_us, 0);
 			audio_samples_processed += codec_ctx_[AudioOut]->frame_size;
 
 			// Only encode if we have a +ve timestamp relative to the video stream.
 			if (out_frame->pts >= 0)
 			{
+				latency_total_us += latency_us;
+				latency_max_us = std::max(latency_max_us, latency_us);
+				latency_count++;
+				if (FrameTrace::Get().Enabled())
+				{
+					// The trace's clock is CLOCK_MONOTONIC, so the capture time is worked back from now.
+					uint64_t now = FrameTrace::Now();
+					FrameTrace::Get().Record("audio", "audio", FrameTrace::NO_ID, out_frame->pts,
+											 now - latency_us * 1000, now);
+				}
+
 				ret = avcodec_send_frame(codec_ctx_[AudioOut], out_frame);
 				if (ret < 0)
 					throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
@@ -756,21 +1077,25 @@ void LibAvEncoder::audioThread()
 			av_frame_free(&out_frame);
 		}
 
-		// Avoid spinning this thread.
-		std::this_thread::sleep_for(5ms);
+		if (latency_count && std::chrono::steady_clock::now() - latency_report > 5s)
+		{
+			LOG(2, "libav: audio latency " << latency_total_us / latency_count / 1000.0 << "ms average, "
+										   << latency_max_us / 1000.0 << "ms max");
+			latency_report = std::chrono::steady_clock::now();
+		}
 	}
 
+	if (latency_count)
+		LOG(1, "libav: audio latency from capture to encoding " << latency_total_us / latency_count / 1000.0
+																<< "ms average, " << latency_max_us / 1000.0
+																<< "ms max");
+
 	// Flush the encoder
 	avcodec_send_frame(codec_ctx_[AudioOut], nullptr);
 	encode(out_pkt, AudioOut);
 
-	swr_free(&conv);
-	av_freep(&samples[0]);
 	av_audio_fifo_free(fifo);
-
-	av_packet_free(&in_pkt);
 	av_packet_free(&out_pkt);
-	av_frame_free(&in_frame);
 }
 
 static Encoder *Create(VideoOptions *options, StreamInfo const &info)
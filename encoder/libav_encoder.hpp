@@ -9,10 +9,12 @@
 
 #include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 extern "C"
 {
@@ -25,6 +27,7 @@ extern "C"
 #include "libavutil/hwcontext.h"
 #include "libavutil/hwcontext_drm.h"
 #include "libavutil/imgutils.h"
+#include "libavutil/time.h"
 #include "libavutil/timestamp.h"
 #include "libavutil/version.h"
 #include "libswresample/swresample.h"
@@ -34,6 +37,8 @@ extern "C"
 #endif
 }
 
+#include "core/spsc_ring.hpp"
+
 #include "encoder.hpp"
 
 class LibAvEncoder : public Encoder
@@ -43,6 +48,10 @@ public:
 	~LibAvEncoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// Applied by the video thread before it sends the next frame to the codec.
+	bool SetBitrate(uint32_t bps) override;
+	bool RequestKeyframe() override;
+	bool SetRegions(std::vector<EncodeRegion> const &regions) override;
 
 private:
 	void initVideoCodec(VideoOptions const *options, StreamInfo const &info);
@@ -52,24 +61,63 @@ private:
 	void initOutput();
 	void deinitOutput();
 	void encode(AVPacket *pkt, unsigned int stream_id);
+	void queuePacket(AVPacket *pkt);
+	void writePacket(AVPacket *pkt);
 
 	void videoThread();
+	void audioCaptureThread();
 	void audioThread();
+	void muxThread();
 
 	static void releaseBuffer(void *opaque, uint8_t *data);
 
 	std::atomic<bool> output_ready_;
+	std::atomic<uint32_t> requested_bitrate_;
+	std::atomic<bool> keyframe_requested_;
 	bool abort_video_;
-	bool abort_audio_;
+	std::atomic<bool> abort_audio_;
 	uint64_t video_start_ts_;
+	// Only touched by the thread calling SetRegions and EncodeBuffer.
+	std::vector<EncodeRegion> regions_;
 
 	std::queue<AVFrame *> frame_queue_;
+	// Frames the video thread has finished with, kept for reuse. Protected by video_mutex_.
+	std::vector<AVFrame *> free_frames_;
 	std::mutex video_mutex_;
-	std::mutex output_mutex_;
 	std::condition_variable video_cv_;
 	std::thread video_thread_;
 	std::thread audio_thread_;
 
+	// The capture thread converts the samples it reads into these chunks, and hands them to the audio
+	// thread through a ring of full chunks, which it hands back through a ring of free ones. Should the
+	// audio thread fall behind, the capture thread drops samples rather than let the device buffer them.
+	struct AudioChunk
+	{
+		uint8_t **samples = nullptr;
+		int capacity = 0;
+		int nb_samples = 0;
+		int64_t first_sample = 0; // counted from the start of capture
+		int64_t capture_us = 0; // wall clock time of the first sample, as libavdevice gives it
+	};
+	static constexpr unsigned int AUDIO_CHUNKS = 64;
+	std::vector<AudioChunk> audio_chunks_;
+	SpscRing<unsigned int> audio_full_;
+	SpscRing<unsigned int> audio_free_;
+	EventNotifier audio_notifier_;
+	std::atomic<bool> audio_capture_done_;
+	std::thread audio_capture_thread_;
+
+	// Encoded packets wait here for the mux thread, so that slow output doesn't hold up encoding.
+	// That's a couple of seconds of video with audio; beyond it we start dropping.
+	static constexpr unsigned int MUX_QUEUE_DEPTH = 128;
+	std::deque<AVPacket *> mux_queue_;
+	std::mutex mux_mutex_;
+	std::condition_variable mux_cv_;
+	std::thread mux_thread_;
+	bool abort_mux_;
+	bool mux_waiting_keyframe_;
+	uint64_t mux_dropped_;
+
 	// The ordering in the enum below must not change!
 	enum Context { Video = 0, AudioOut = 1, AudioIn = 2 };
 	AVCodecContext *codec_ctx_[3];
@@ -77,8 +125,8 @@ private:
 	AVFormatContext *in_fmt_ctx_;
 	AVFormatContext *out_fmt_ctx_;
 
-	std::mutex drm_queue_lock_;
-	std::queue<std::unique_ptr<AVDRMFrameDescriptor>> drm_frame_queue_;
+	// Recycles the AVDRMFrameDescriptor that each DRM_PRIME frame carries.
+	AVBufferPool *drm_desc_pool_;
 
 	std::string output_file_;
 	bool output_initialised_;
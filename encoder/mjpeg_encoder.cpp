@@ -5,11 +5,20 @@
  * mjpeg_encoder.cpp - mjpeg video encoder.
  */
 
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cstring>
 #include <iostream>
 
 #include <jpeglib.h>
 
+#include "core/frame_trace.hpp"
+#include "core/memory_report.hpp"
+#include "core/thread_config.hpp"
+
+#include "image/image.hpp"
+
 #include "mjpeg_encoder.hpp"
 
 #if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
@@ -18,8 +27,121 @@ typedef size_t jpeg_mem_len_t;
 typedef unsigned long jpeg_mem_len_t;
 #endif
 
+// Build a Huffman table from symbol frequencies, as in Annex K.2 of the JPEG standard (this
+// follows jpeg_gen_optimal_table in libjpeg, which isn't exported). Every symbol with a non-zero
+// frequency gets a code.
+static void build_huffman_table(JHUFF_TBL *table, std::array<long, 257> freq)
+{
+	constexpr int MAX_CLEN = 32;
+	uint8_t bits[MAX_CLEN + 1] = {};
+	int codesize[257] = {};
+	int others[257];
+	std::fill(std::begin(others), std::end(others), -1);
+
+	// A dummy symbol stops any real code from being all ones.
+	freq[256] = 1;
+	while (true)
+	{
+		int c1 = -1, c2 = -1;
+		for (int i = 0; i <= 256; i++)
+		{
+			if (freq[i] && (c1 < 0 || freq[i] <= freq[c1]))
+				c1 = i;
+		}
+		for (int i = 0; i <= 256; i++)
+		{
+			if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2]))
+				c2 = i;
+		}
+		if (c2 < 0)
+			break;
+
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+		codesize[c1]++;
+		while (others[c1] >= 0)
+			c1 = others[c1], codesize[c1]++;
+		others[c1] = c2;
+		codesize[c2]++;
+		while (others[c2] >= 0)
+			c2 = others[c2], codesize[c2]++;
+	}
+
+	for (int i = 0; i <= 256; i++)
+	{
+		if (codesize[i])
+			bits[codesize[i]]++;
+	}
+	// Codes are limited to 16 bits.
+	int i = MAX_CLEN;
+	for (; i > 16; i--)
+	{
+		while (bits[i] > 0)
+		{
+			int j = i - 2;
+			while (bits[j] == 0)
+				j--;
+			bits[i] -= 2;
+			bits[i - 1]++;
+			bits[j + 1] += 2;
+			bits[j]--;
+		}
+	}
+	// Remove the dummy symbol, which has the longest code.
+	while (bits[i] == 0)
+		i--;
+	bits[i]--;
+
+	memcpy(table->bits, bits, sizeof(table->bits));
+	int p = 0;
+	for (int len = 1; len <= MAX_CLEN; len++)
+	{
+		for (int sym = 0; sym <= 255; sym++)
+		{
+			if (codesize[sym] == len)
+				table->huffval[p++] = sym;
+		}
+	}
+	table->sent_table = FALSE;
+}
+
+// Tables optimised for one frame have no codes for symbols that the frame didn't use, but later
+// frames may need them. So rebuild the table with a code for every symbol, keeping about the same
+// code lengths for those that were used.
+static void complete_huffman_table(JHUFF_TBL *table, bool ac)
+{
+	std::array<long, 257> freq = {};
+	for (int len = 1, p = 0; len <= 16; len++)
+	{
+		for (int n = 0; n < table->bits[len]; n++)
+			freq[table->huffval[p++]] = 1L << (24 - len);
+	}
+
+	auto add = [&freq](int sym) {
+		if (!freq[sym])
+			freq[sym] = 1;
+	};
+	if (ac)
+	{
+		add(0x00); // EOB
+		add(0xf0); // ZRL
+		for (int run = 0; run < 16; run++)
+		{
+			for (int size = 1; size <= 10; size++)
+				add((run << 4) | size);
+		}
+	}
+	else
+	{
+		for (int size = 0; size <= 11; size++)
+			add(size);
+	}
+	build_huffman_table(table, freq);
+}
+
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0),
+	  max_pool_buffers_(options->Get().low_memory ? NUM_ENC_THREADS : MAX_POOL_BUFFERS), largest_frame_(0)
 {
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
 	for (int i = 0; i < NUM_ENC_THREADS; i++)
@@ -34,33 +156,127 @@ MjpegEncoder::~MjpegEncoder()
 		encode_thread_[i].join();
 	abortOutput_ = true;
 	output_thread_.join();
+	for (auto &buffer : buffer_pool_)
+		freeBuffer(buffer);
 	LOG(2, "MjpegEncoder closed");
 }
 
 void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
+	// Bands are whole rows of MCUs, and restart markers end every row so that they can be joined.
+	constexpr unsigned int mcu_height = 16;
+	unsigned int mcu_rows = (info.height + mcu_height - 1) / mcu_height;
+	unsigned int num_bands = std::min(options_->Get().mjpeg_slices, mcu_rows);
+	unsigned int band_height = info.height;
+	if (num_bands > 1)
+	{
+		band_height = (mcu_rows + num_bands - 1) / num_bands * mcu_height;
+		num_bands = (info.height + band_height - 1) / band_height;
+	}
+	else
+		num_bands = 1;
+
 	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, info, timestamp_us, index_++ };
-	encode_queue_.push(item);
+	uint64_t index = index_++;
+	for (unsigned int band = 0; band < num_bands; band++)
+	{
+		unsigned int first_row = band * band_height;
+		EncodeItem item = { mem, info, timestamp_us, index, first_row, std::min(band_height, info.height - first_row),
+							band, num_bands };
+		encode_queue_.push(item);
+	}
 	encode_cond_var_.notify_all();
 }
 
-void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
+MjpegEncoder::OutputBuffer MjpegEncoder::getBuffer()
+{
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex_);
+	size_t size = std::max<size_t>(largest_frame_ + largest_frame_ / 4, 65536);
+	OutputBuffer buffer = { nullptr, 0 };
+	if (!buffer_pool_.empty())
+	{
+		buffer = buffer_pool_.back();
+		buffer_pool_.pop_back();
+		if (buffer.size >= size)
+			return buffer;
+		freeBuffer(buffer);
+	}
+	buffer.mem = (uint8_t *)malloc(size);
+	if (!buffer.mem)
+		throw std::runtime_error("failed to allocate MJPEG buffer");
+	buffer.size = size;
+	MemoryReport::Get().Add(MEMORY_NAME, MemoryReport::Kind::Heap, size);
+	return buffer;
+}
+
+void MjpegEncoder::freeBuffer(OutputBuffer &buffer)
+{
+	MemoryReport::Get().Remove(MEMORY_NAME, MemoryReport::Kind::Heap, buffer.size);
+	free(buffer.mem);
+	buffer = { nullptr, 0 };
+}
+
+void MjpegEncoder::returnBuffer(OutputBuffer buffer)
+{
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex_);
+	if (buffer_pool_.size() < max_pool_buffers_)
+		buffer_pool_.push_back(buffer);
+	else
+		freeBuffer(buffer);
+}
+
+void MjpegEncoder::initJPEG(struct jpeg_compress_struct &cinfo)
 {
 	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
-	cinfo.image_width = item.info.width;
-	cinfo.image_height = item.info.height;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = 0;
 
 	jpeg_set_defaults(&cinfo);
 	cinfo.raw_data_in = TRUE;
+	cinfo.restart_interval = 0;
 	jpeg_set_quality(&cinfo, options_->Get().quality, TRUE);
-	encoded_buffer = nullptr;
-	buffer_len = 0;
-	jpeg_mem_len_t jpeg_mem_len;
+}
+
+void MjpegEncoder::optimiseHuffmanTables(struct jpeg_compress_struct &cinfo, EncodeItem &item)
+{
+	OutputBuffer buffer;
+	size_t bytes_used;
+	cinfo.optimize_coding = TRUE;
+	encodeJPEG(cinfo, item, buffer, bytes_used);
+	cinfo.optimize_coding = FALSE;
+	returnBuffer(buffer);
+
+	// libjpeg leaves the tables it made in cinfo.
+	for (int i = 0; i < 4; i++)
+	{
+		JHUFF_TBL *table = i < 2 ? cinfo.dc_huff_tbl_ptrs[i] : cinfo.ac_huff_tbl_ptrs[i - 2];
+		complete_huffman_table(table, i >= 2);
+		memcpy(huffman_tables_[i].bits, table->bits, sizeof(table->bits));
+		memcpy(huffman_tables_[i].huffval, table->huffval, sizeof(table->huffval));
+	}
+	LOG(2, "MJPEG Huffman tables optimised");
+}
+
+void MjpegEncoder::loadHuffmanTables(struct jpeg_compress_struct &cinfo)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		JHUFF_TBL *table = i < 2 ? cinfo.dc_huff_tbl_ptrs[i] : cinfo.ac_huff_tbl_ptrs[i - 2];
+		memcpy(table->bits, huffman_tables_[i].bits, sizeof(table->bits));
+		memcpy(table->huffval, huffman_tables_[i].huffval, sizeof(table->huffval));
+	}
+}
+
+void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, OutputBuffer &buffer,
+							  size_t &bytes_used)
+{
+	cinfo.image_width = item.info.width;
+	cinfo.image_height = item.rows;
+	cinfo.restart_in_rows = item.num_bands > 1 ? 1 : 0;
+
+	buffer = getBuffer();
+	uint8_t *encoded_buffer = buffer.mem;
+	jpeg_mem_len_t jpeg_mem_len = buffer.size;
 	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
 	jpeg_start_compress(&cinfo, TRUE);
 
@@ -76,7 +292,10 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	JSAMPROW u_rows[8];
 	JSAMPROW v_rows[8];
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.info.height;)
+	// Bands start on a multiple of 16 rows, so at the start of a chroma row too.
+	for (uint8_t *Y_row = Y + item.first_row * item.info.stride, *U_row = U + (item.first_row / 2) * stride2,
+				 *V_row = V + (item.first_row / 2) * stride2;
+		 cinfo.next_scanline < cinfo.image_height;)
 	{
 		for (int i = 0; i < 16; i++, Y_row += item.info.stride)
 			y_rows[i] = std::min(Y_row, Y_max);
@@ -88,15 +307,63 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	}
 
 	jpeg_finish_compress(&cinfo);
-	buffer_len = jpeg_mem_len;
+	bytes_used = jpeg_mem_len;
+	// If the frame didn't fit, libjpeg will have moved it to a bigger buffer of its own.
+	if (encoded_buffer != buffer.mem)
+	{
+		freeBuffer(buffer);
+		buffer = { encoded_buffer, bytes_used };
+		MemoryReport::Get().Add(MEMORY_NAME, MemoryReport::Kind::Heap, bytes_used);
+	}
+
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex_);
+	largest_frame_ = std::max(largest_frame_, bytes_used);
+}
+
+bool MjpegEncoder::addBand(EncodeItem const &item, OutputBuffer &buffer, size_t &bytes_used)
+{
+	BandedFrame frame;
+	{
+		std::lock_guard<std::mutex> lock(band_mutex_);
+		BandedFrame &f = banded_frames_[item.index];
+		f.buffers.resize(item.num_bands);
+		f.bands.resize(item.num_bands);
+		f.buffers[item.band] = buffer;
+		f.bands[item.band] = { buffer.mem, bytes_used };
+		if (++f.done < item.num_bands)
+			return false;
+		frame = std::move(f);
+		banded_frames_.erase(item.index);
+	}
+
+	// The stitched frame is malloc'd, so it can go back to the pool along with the bands.
+	uint8_t *stitched = nullptr;
+	try
+	{
+		stitch_jpeg_strips(frame.bands, item.info.height, stitched, bytes_used);
+	}
+	catch (std::exception const &e)
+	{
+		for (auto &band : frame.buffers)
+			returnBuffer(band);
+		throw;
+	}
+	for (auto &band : frame.buffers)
+		returnBuffer(band);
+	buffer = { stitched, bytes_used };
+	MemoryReport::Get().Add(MEMORY_NAME, MemoryReport::Kind::Heap, bytes_used);
+	return true;
 }
 
 void MjpegEncoder::encodeThread(int num)
 {
+	ThreadConfig::Get().Apply("encoder");
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
+	initJPEG(cinfo);
+	bool huffman_tables_loaded = false;
 	std::chrono::duration<double> encode_time(0);
 	uint32_t frames = 0;
 
@@ -127,28 +394,42 @@ void MjpegEncoder::encodeThread(int num)
 			}
 		}
 
+		if (options_->Get().mjpeg_optimise && !huffman_tables_loaded)
+		{
+			std::call_once(huffman_once_, [&]() { optimiseHuffmanTables(cinfo, encode_item); });
+			loadHuffmanTables(cinfo);
+			huffman_tables_loaded = true;
+		}
+
 		// Encode the buffer.
-		uint8_t *encoded_buffer = nullptr;
-		size_t buffer_len = 0;
+		OutputBuffer buffer;
+		size_t bytes_used = 0;
 		auto start_time = std::chrono::high_resolution_clock::now();
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
+		{
+			static PerfTotals *perf = PerfCounters::Totals("encoder/mjpeg-encode");
+			FrameTraceScope trace("mjpeg-encode", "encoder", FrameTrace::NO_ID, encode_item.timestamp_us, perf);
+			encodeJPEG(cinfo, encode_item, buffer, bytes_used);
+		}
 		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
 		frames++;
+		if (encode_item.num_bands > 1 && !addBand(encode_item, buffer, bytes_used))
+			continue;
 		// Don't return buffers until the output thread as that's where they're
 		// in order again.
 
 		// We push this encoded buffer to another thread so that our
 		// application can take its time with the data without blocking the
 		// encode process.
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
+		OutputItem output_item = { buffer, bytes_used, encode_item.timestamp_us, encode_item.index };
 		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
+		output_queue_[num].push_back(output_item);
 		output_cond_var_.notify_one();
 	}
 }
 
 void MjpegEncoder::outputThread()
 {
+	ThreadConfig::Get().Apply("encoder-output");
 	OutputItem item;
 	uint64_t index = 0;
 	while (true)
@@ -170,10 +451,11 @@ void MjpegEncoder::outputThread()
 					if (abort && !q.empty())
 						abort = false;
 
-					if (!q.empty() && q.front().index == index)
+					auto it = std::find_if(q.begin(), q.end(), [index](OutputItem const &i) { return i.index == index; });
+					if (it != q.end())
 					{
-						item = q.front();
-						q.pop();
+						item = *it;
+						q.erase(it);
 						goto got_item;
 					}
 				}
@@ -186,8 +468,8 @@ void MjpegEncoder::outputThread()
 	got_item:
 		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
+		output_ready_callback_(item.buffer.mem, item.bytes_used, item.timestamp_us, true, false);
+		returnBuffer(item.buffer);
 		index++;
 	}
 }
@@ -8,9 +8,12 @@
 #pragma once
 
 #include <condition_variable>
+#include <deque>
+#include <map>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 #include "encoder.hpp"
 
@@ -25,7 +28,8 @@ public:
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
 
 private:
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
+	// How many threads to use. Whichever thread is idle will pick up the next frame, or with
+	// --mjpeg-slices, the next band of a frame.
 	static const int NUM_ENC_THREADS = 4;
 
 	// These threads do the actual encoding.
@@ -40,27 +44,76 @@ private:
 	bool abortOutput_;
 	uint64_t index_;
 
+	// Either a whole frame, or one of num_bands horizontal bands of it.
 	struct EncodeItem
 	{
 		void *mem;
 		StreamInfo info;
 		int64_t timestamp_us;
 		uint64_t index;
+		unsigned int first_row;
+		unsigned int rows;
+		unsigned int band;
+		unsigned int num_bands;
 	};
 	std::queue<EncodeItem> encode_queue_;
 	std::mutex encode_mutex_;
 	std::condition_variable encode_cond_var_;
 	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	// Frames are encoded straight into malloc'd buffers from a pool, which the output thread puts
+	// back once the application is done with them. New ones are made a little bigger than the
+	// largest frame so far, so that libjpeg should never need to grow them.
+	struct OutputBuffer
+	{
+		uint8_t *mem;
+		size_t size;
+	};
+	// With --low-memory, the pool only keeps one buffer for each encode thread.
+	static constexpr unsigned int MAX_POOL_BUFFERS = 4 * NUM_ENC_THREADS;
+	static constexpr char const *MEMORY_NAME = "mjpeg output";
+	OutputBuffer getBuffer();
+	void returnBuffer(OutputBuffer buffer);
+	void freeBuffer(OutputBuffer &buffer);
+	std::mutex buffer_pool_mutex_;
+	std::vector<OutputBuffer> buffer_pool_;
+	unsigned int max_pool_buffers_;
+	size_t largest_frame_;
+
+	// Set up the parameters and tables once, as they carry over from frame to frame.
+	void initJPEG(struct jpeg_compress_struct &cinfo);
+	// With --mjpeg-optimise, the Huffman tables are optimised for the first frame (or band) to be
+	// encoded and then shared by all the threads, as the bands of a frame must agree.
+	void optimiseHuffmanTables(struct jpeg_compress_struct &cinfo, EncodeItem &item);
+	void loadHuffmanTables(struct jpeg_compress_struct &cinfo);
+	std::once_flag huffman_once_;
+	struct HuffmanTable
+	{
+		uint8_t bits[17];
+		uint8_t huffval[256];
+	};
+	HuffmanTable huffman_tables_[4]; // DC then AC, for luma and chroma
+	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, OutputBuffer &buffer, size_t &bytes_used);
+	// Collect an encoded band, returning true with the whole frame in the buffer once it was the last.
+	bool addBand(EncodeItem const &item, OutputBuffer &buffer, size_t &bytes_used);
+
+	std::mutex band_mutex_;
+	struct BandedFrame
+	{
+		std::vector<OutputBuffer> buffers;
+		std::vector<std::pair<uint8_t *, size_t>> bands;
+		unsigned int done = 0;
+	};
+	std::map<uint64_t, BandedFrame> banded_frames_;
 
 	struct OutputItem
 	{
-		void *mem;
+		OutputBuffer buffer;
 		size_t bytes_used;
 		int64_t timestamp_us;
 		uint64_t index;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
+	// Banded frames can finish out of order on any thread, so the output thread searches these.
+	std::deque<OutputItem> output_queue_[NUM_ENC_THREADS];
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
@@ -9,6 +9,8 @@
 #include <iostream>
 #include <stdexcept>
 
+#include "core/thread_config.hpp"
+
 #include "null_encoder.hpp"
 
 NullEncoder::NullEncoder(VideoOptions const *options) : Encoder(options), abort_(false)
@@ -37,6 +39,7 @@ void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 // of buffers limits the amount of queueing possible here...
 void NullEncoder::outputThread()
 {
+	ThreadConfig::Get().Apply("encoder-output");
 	OutputItem item;
 	while (true)
 	{
@@ -61,7 +64,7 @@ void NullEncoder::outputThread()
 		// This is needed as the metadata queue gets pushed in the former, and popped
 		// in the latter.
 		input_done_callback_(nullptr);
-		output_ready_callback_(item.mem, item.length, item.timestamp_us, true);
+		output_ready_callback_(item.mem, item.length, item.timestamp_us, true, false);
 	}
 }
 
@@ -5,14 +5,20 @@
  * dng.cpp - Save raw image as DNG file.
  */
 
+#include <algorithm>
+#include <cstring>
+#include <future>
 #include <limits>
 #include <map>
+#include <thread>
+#include <vector>
 
 #include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
 
 #include <tiffio.h>
 
+#include "core/cpu_features.hpp"
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
@@ -76,47 +82,119 @@ static const std::map<PixelFormat, BayerFormat> bayer_formats =
 	{ formats::BGGR_PISP_COMP1, { "BGGR-16-PISP", 16, TIFF_BGGR, false, true } },
 };
 
-static void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+// The unpacking functions below each handle the rows [y0, y1) of the image, writing them
+// from the start of dest, so that they can be run over several bands or strips at once.
+
+static void unpack_10bit_generic(uint8_t const *ptr, uint16_t *dest, unsigned int width)
 {
-	unsigned int w_align = info.width & ~3;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	unsigned int w_align = width & ~3, x = 0;
+	for (; x < w_align; x += 4, ptr += 5)
 	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 4, ptr += 5)
-		{
-			*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
-			*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
-			*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
-			*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
-		}
-		for (; x < info.width; x++)
-			*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
+		*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
+		*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
+		*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
+		*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
 	}
+	for (; x < width; x++)
+		*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
 }
 
-static void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+static void unpack_12bit_generic(uint8_t const *ptr, uint16_t *dest, unsigned int width)
 {
-	unsigned int w_align = info.width & ~1;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	unsigned int w_align = width & ~1, x = 0;
+	for (; x < w_align; x += 2, ptr += 3)
 	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 2, ptr += 3)
-		{
-			*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
-			*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
-		}
-		if (x < info.width)
-			*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
+		*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
+		*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+	}
+	if (x < width)
+		*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
+}
+
+#if defined(RPICAM_NEON_KERNELS)
+// 8 pixels from 10 bytes: the top 8 bits of each are in bytes 0-3 and 5-8, and the bottom 2 bits
+// of each group of 4 are in bytes 4 and 9. 16 bytes are loaded each time, so we stop while those
+// loads are still inside the row and leave the rest to the generic version.
+NEON_TARGET static void unpack_10bit_neon(uint8_t const *ptr, uint16_t *dest, unsigned int width)
+{
+	static const uint8_t hi_idx[8] = { 0, 1, 2, 3, 5, 6, 7, 8 };
+	static const uint8_t lo_idx[8] = { 4, 4, 4, 4, 9, 9, 9, 9 };
+	static const int16_t lo_shift[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+
+	unsigned int x = 0;
+	for (; x + 16 <= (width & ~3); x += 8, ptr += 10, dest += 8)
+	{
+		uint8x16_t in = vld1q_u8(ptr);
+		uint8x8x2_t table = { { vget_low_u8(in), vget_high_u8(in) } };
+		uint16x8_t hi = vmovl_u8(vtbl2_u8(table, vld1_u8(hi_idx)));
+		uint16x8_t lo = vmovl_u8(vtbl2_u8(table, vld1_u8(lo_idx)));
+		lo = vandq_u16(vshlq_u16(lo, vld1q_s16(lo_shift)), vdupq_n_u16(3));
+		vst1q_u16(dest, vorrq_u16(vshlq_n_u16(hi, 2), lo));
 	}
+	unpack_10bit_generic(ptr, dest, width - x);
 }
 
-static void unpack_16bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+// 8 pixels from 12 bytes: the top 8 bits of each pair are in bytes 0-1, 3-4, 6-7 and 9-10, with
+// the bottom 4 bits of each pair in bytes 2, 5, 8 and 11.
+NEON_TARGET static void unpack_12bit_neon(uint8_t const *ptr, uint16_t *dest, unsigned int width)
+{
+	static const uint8_t hi_idx[8] = { 0, 1, 3, 4, 6, 7, 9, 10 };
+	static const uint8_t lo_idx[8] = { 2, 2, 5, 5, 8, 8, 11, 11 };
+	static const int16_t lo_shift[8] = { 0, -4, 0, -4, 0, -4, 0, -4 };
+
+	unsigned int x = 0;
+	for (; x + 16 <= (width & ~1); x += 8, ptr += 12, dest += 8)
+	{
+		uint8x16_t in = vld1q_u8(ptr);
+		uint8x8x2_t table = { { vget_low_u8(in), vget_high_u8(in) } };
+		uint16x8_t hi = vmovl_u8(vtbl2_u8(table, vld1_u8(hi_idx)));
+		uint16x8_t lo = vmovl_u8(vtbl2_u8(table, vld1_u8(lo_idx)));
+		lo = vandq_u16(vshlq_u16(lo, vld1q_s16(lo_shift)), vdupq_n_u16(15));
+		vst1q_u16(dest, vorrq_u16(vshlq_n_u16(hi, 4), lo));
+	}
+	unpack_12bit_generic(ptr, dest, width - x);
+}
+#endif
+
+using UnpackRow = void (*)(uint8_t const *, uint16_t *, unsigned int);
+
+static UnpackRow const unpack_10bit_row = SelectKernel<UnpackRow>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, unpack_10bit_neon },
+#endif
+	{ CpuLevel::Generic, unpack_10bit_generic },
+});
+
+static UnpackRow const unpack_12bit_row = SelectKernel<UnpackRow>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, unpack_12bit_neon },
+#endif
+	{ CpuLevel::Generic, unpack_12bit_generic },
+});
+
+static void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest, unsigned int y0,
+						 unsigned int y1)
+{
+	src += y0 * info.stride;
+	for (unsigned int y = y0; y < y1; y++, src += info.stride, dest += info.width)
+		unpack_10bit_row(src, dest, info.width);
+}
+
+static void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest, unsigned int y0,
+						 unsigned int y1)
+{
+	src += y0 * info.stride;
+	for (unsigned int y = y0; y < y1; y++, src += info.stride, dest += info.width)
+		unpack_12bit_row(src, dest, info.width);
+}
+
+static void unpack_16bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest, unsigned int y0,
+						 unsigned int y1)
 {
 	/* Assume the pixels in memory are already in native byte order */
 	unsigned int w = info.width;
-	for (unsigned int y = 0; y < info.height; y++)
+	src += y0 * info.stride;
+	for (unsigned int y = y0; y < y1; y++)
 	{
 		memcpy(dest, src, 2 * w);
 		dest += w;
@@ -124,6 +202,29 @@ static void unpack_16bit(uint8_t const *src, StreamInfo const &info, uint16_t *d
 	}
 }
 
+// Run fn over horizontal bands of the image, one per core.
+template <typename F>
+static void for_each_band(unsigned int height, F const &fn)
+{
+	unsigned int num_bands = std::min(std::max(std::thread::hardware_concurrency(), 1u), height);
+	if (num_bands <= 1)
+	{
+		fn(0, height);
+		return;
+	}
+
+	unsigned int band_height = (height + num_bands - 1) / num_bands;
+	std::vector<std::thread> threads;
+	for (unsigned int y0 = band_height; y0 < height; y0 += band_height)
+		threads.emplace_back(fn, y0, std::min(y0 + band_height, height));
+	fn(0, band_height);
+	for (auto &t : threads)
+		t.join();
+}
+
+// The main image is unpacked and written this many rows at a time.
+static constexpr unsigned int STRIP_ROWS = 128;
+
 // We always use these compression parameters.
 #define COMPRESS_OFFSET 2048
 #define COMPRESS_MODE 1
@@ -215,13 +316,14 @@ static void subBlockFunction(uint16_t *d, uint32_t w)
 	d[6] = dequantize(q[3], qmode);
 }
 
-static void uncompress(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+static void uncompress(uint8_t const *src, StreamInfo const &info, uint16_t *dest, unsigned int y0,
+					   unsigned int y1)
 {
 	// In all cases, the *decompressed* image must be a multiple of 8 columns wide.
 	unsigned int buf_stride_pixels = (info.width + 7) & ~7;
-	for (unsigned int y = 0; y < info.height; ++y)
+	for (unsigned int y = y0; y < y1; ++y)
 	{
-		uint16_t *dp = dest + y * buf_stride_pixels;
+		uint16_t *dp = dest + (y - y0) * buf_stride_pixels;
 		uint8_t const *sp = src + y * info.stride;
 
 		for (unsigned int x = 0; x < info.width; x+=8)
@@ -296,40 +398,68 @@ Matrix(float m0, float m1, float m2,
 	}
 };
 
-void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info, ControlList const &metadata,
-			  std::string const &filename, std::string const &cam_model, StillOptions const *options)
+typedef void (*UnpackFunction)(uint8_t const *, StreamInfo const &, uint16_t *, unsigned int, unsigned int);
+
+// Find the function that unpacks this Bayer format to u16, and how many pixels apart it leaves
+// the rows. Note that decompression will require rows that are 8 pixels aligned.
+static UnpackFunction get_unpack(BayerFormat const &bayer_format, StreamInfo const &info, unsigned int &unpack_stride)
 {
-	// Check the Bayer format and unpack it to u16.
+	unpack_stride = info.width;
+	if (bayer_format.compressed)
+	{
+		unpack_stride = (info.width + 7) & ~7;
+		return uncompress;
+	}
+	else if (bayer_format.packed)
+		return bayer_format.bits == 10 ? unpack_10bit : unpack_12bit;
+	return unpack_16bit;
+}
 
+static BayerFormat const &get_bayer_format(StreamInfo const &info)
+{
 	auto it = bayer_formats.find(info.pixel_format);
 	if (it == bayer_formats.end())
 		throw std::runtime_error("unsupported Bayer format");
-	BayerFormat const &bayer_format = it->second;
-	LOG(1, "Bayer format is " << bayer_format.name);
+	return it->second;
+}
 
-	// Decompression will require a buffer that's 8 pixels aligned.
-	unsigned int buf_stride_pixels = info.width;
-	unsigned int buf_stride_pixels_padded = (buf_stride_pixels + 7) & ~7;
-	std::vector<uint16_t> buf(buf_stride_pixels_padded * info.height);
-	if (bayer_format.compressed)
-	{
-		uncompress(mem[0].data(), info, &buf[0]);
-		buf_stride_pixels = buf_stride_pixels_padded;
-	}
-	else if (bayer_format.packed)
+// Unpack rows y0 to y1 of the image into dest, with the rows packed tightly as TIFF wants them.
+static void unpack_rows(UnpackFunction unpack, unsigned int unpack_stride, uint8_t const *src,
+						StreamInfo const &info, uint16_t *dest, unsigned int y0, unsigned int y1)
+{
+	for_each_band(y1 - y0, [&](unsigned int b0, unsigned int b1)
+				  { unpack(src, info, dest + b0 * unpack_stride, y0 + b0, y0 + b1); });
+	// Squeeze out any padding.
+	if (unpack_stride != info.width)
 	{
-		switch (bayer_format.bits)
-		{
-		case 10:
-			unpack_10bit(mem[0].data(), info, &buf[0]);
-			break;
-		case 12:
-			unpack_12bit(mem[0].data(), info, &buf[0]);
-			break;
-		}
+		for (unsigned int y = 1; y < y1 - y0; y++)
+			memmove(dest + y * info.width, dest + y * unpack_stride, info.width * sizeof(uint16_t));
 	}
-	else
-		unpack_16bit(mem[0].data(), info, &buf[0]);
+}
+
+void dng_unpack(uint8_t const *src, StreamInfo const &info, std::vector<uint16_t> &dest)
+{
+	unsigned int unpack_stride;
+	UnpackFunction unpack = get_unpack(get_bayer_format(info), info, unpack_stride);
+	// The rows are only squeezed together once they have all been unpacked.
+	dest.resize(info.height * unpack_stride);
+	unpack_rows(unpack, unpack_stride, src, info, dest.data(), 0, info.height);
+	dest.resize(info.height * info.width);
+}
+
+void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info, ControlList const &metadata,
+			  std::string const &filename, std::string const &cam_model, StillOptions const *options)
+{
+	// Check the Bayer format and unpack it to u16.
+
+	BayerFormat const &bayer_format = get_bayer_format(info);
+	LOG(1, "Bayer format is " << bayer_format.name);
+
+	// The image is unpacked a strip at a time as it is written, rather than all at once.
+	unsigned int unpack_stride;
+	UnpackFunction unpack = get_unpack(bayer_format, info, unpack_stride);
+	auto unpack_strip = [&](uint16_t *dest, unsigned int y0, unsigned int y1)
+	{ unpack_rows(unpack, unpack_stride, mem[0].data(), info, dest, y0, y1); };
 
 	// We need to fish out some metadata values for the DNG.
 	float black = 4096 * (1 << bayer_format.bits) / 65536.0;
@@ -437,16 +567,18 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		TIFFSetField(tif, TIFFTAG_SUBIFD, 1, &offset_subifd);
 		TIFFSetField(tif, TIFFTAG_EXIFIFD, offset_exififd);
 
-		// Make a small greyscale thumbnail, just to give some clue what's in here.
+		// Make a small greyscale thumbnail, just to give some clue what's in here. Only the two rows
+		// that each thumbnail row samples need unpacking.
 		std::vector<uint8_t> thumb_buf((info.width >> 4) * 3);
+		std::vector<uint16_t> rows(2 * unpack_stride);
 
 		for (unsigned int y = 0; y < (info.height >> 4); y++)
 		{
+			unpack(mem[0].data(), info, &rows[0], y << 4, (y << 4) + 2);
 			for (unsigned int x = 0; x < (info.width >> 4); x++)
 			{
-				unsigned int off = (y * buf_stride_pixels + x) << 4;
-				uint32_t grey =
-					buf[off] + buf[off + 1] + buf[off + buf_stride_pixels] + buf[off + buf_stride_pixels + 1];
+				unsigned int off = x << 4;
+				uint32_t grey = rows[off] + rows[off + 1] + rows[off + unpack_stride] + rows[off + unpack_stride + 1];
 				grey = (grey << 14) >> bayer_format.bits;
 				grey = sqrt((double)grey); // simple "gamma correction"
 				thumb_buf[3 * x] = thumb_buf[3 * x + 1] = thumb_buf[3 * x + 2] = grey;
@@ -475,10 +607,28 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		const uint16_t black_level_repeat_dim[] = { 2, 2 };
 		TIFFSetField(tif, TIFFTAG_BLACKLEVELREPEATDIM, &black_level_repeat_dim);
 		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 4, &black_levels);
+		TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, STRIP_ROWS);
+
+		// Each strip is unpacked while the one before it is being written.
+		std::vector<uint16_t> strip_buf[2];
+		for (auto &b : strip_buf)
+			b.resize(STRIP_ROWS * unpack_stride);
+		unsigned int num_strips = (info.height + STRIP_ROWS - 1) / STRIP_ROWS;
+		unpack_strip(&strip_buf[0][0], 0, std::min(STRIP_ROWS, info.height));
 
-		for (unsigned int y = 0; y < info.height; y++)
+		for (unsigned int strip = 0; strip < num_strips; strip++)
 		{
-			if (TIFFWriteScanline(tif, &buf[buf_stride_pixels * y], y, 0) != 1)
+			unsigned int y0 = strip * STRIP_ROWS, y1 = std::min(y0 + STRIP_ROWS, info.height);
+			std::future<void> next;
+			if (strip + 1 < num_strips)
+				next = std::async(std::launch::async, unpack_strip, &strip_buf[(strip + 1) & 1][0], y1,
+								  std::min(y1 + STRIP_ROWS, info.height));
+
+			tsize_t ret =
+				TIFFWriteEncodedStrip(tif, strip, &strip_buf[strip & 1][0], (y1 - y0) * info.width * sizeof(uint16_t));
+			if (next.valid())
+				next.wait();
+			if (ret < 0)
 				throw std::runtime_error("error writing DNG image data");
 		}
 
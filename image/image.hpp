@@ -7,7 +7,9 @@
 
 #pragma once
 
+#include <cstdio>
 #include <string>
+#include <vector>
 
 #include <libcamera/base/span.h>
 
@@ -18,9 +20,26 @@
 struct StillOptions;
 
 // In jpeg.cpp:
+// A smaller version of the same capture, such as the lores stream, that the EXIF thumbnail can be made from
+// instead of the full image, if it's at least the thumbnail size.
+struct ThumbnailImage
+{
+	libcamera::Span<uint8_t> mem;
+	StreamInfo info;
+};
+
 void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_model,
-			   StillOptions const *options);
+			   StillOptions const *options, ThumbnailImage const *thumbnail = nullptr);
+
+// Encode a YUV420 image as a JPEG of the same size, with no EXIF. The result is allocated with malloc.
+void yuv420_to_jpeg(const uint8_t *input, StreamInfo const &info, int quality, unsigned int restart,
+					uint8_t *&jpeg_buffer, size_t &jpeg_len);
+
+// Join JPEGs of consecutive horizontal strips of an image, each encoded with a restart marker after
+// every row of MCUs, into one JPEG of the full height. The result is allocated with malloc.
+void stitch_jpeg_strips(std::vector<std::pair<uint8_t *, size_t>> const &strips, unsigned int height,
+						uint8_t *&jpeg_buffer, size_t &jpeg_len);
 
 // In yuv.cpp:
 void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
@@ -30,6 +49,8 @@ void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			  libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_model,
 			  StillOptions const *options);
+// Unpack a whole raw image to 16 bits per pixel, as dng_save would, with the rows packed tightly.
+void dng_unpack(uint8_t const *src, StreamInfo const &info, std::vector<uint16_t> &dest);
 
 // In png.cpp:
 void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
@@ -38,3 +59,13 @@ void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 // In bmp.cpp:
 void bmp_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			  std::string const &filename, StillOptions const *options);
+
+// In rpiraw.cpp:
+void rpiraw_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+				 libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_model);
+// The header for one frame of an .rpiraw file, to be followed by payload_size bytes of raw data.
+std::vector<uint8_t> rpiraw_header(StreamInfo const &info, libcamera::ControlList const &metadata,
+								   std::string const &cam_model, std::size_t payload_size);
+// Read the next frame from an .rpiraw file, returning false at the end of the file.
+bool rpiraw_read(FILE *fp, StreamInfo &info, libcamera::ControlList &metadata, std::string &cam_model,
+				 std::vector<uint8_t> &payload);
@@ -6,12 +6,16 @@
  */
 
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 
 #include <algorithm>
+#include <cmath>
+#include <exception>
 #include <iostream>
 #include <map>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
 #include <libcamera/control_ids.h>
@@ -23,6 +27,8 @@
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+#include "image/image.hpp"
+
 #ifndef MAKE_STRING
 #define MAKE_STRING "Raspberry Pi"
 #endif
@@ -253,9 +259,13 @@ void exif_read_tag(ExifData *exif, char const *str)
 	}
 }
 
-static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
-						 const unsigned int output_width, const unsigned int output_height,
-						 const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+// Compress one JPEG of the given size, calling write_rows to feed it the image, starting from the
+// row first_row of the whole image. When in_rows is set there is a restart marker after every row
+// of MCUs, otherwise restart gives the restart interval as usual.
+template <typename WriteRows>
+static void compress_jpeg(unsigned int width, unsigned int height, unsigned int first_row, const int quality,
+						  const unsigned int restart, bool in_rows, bool raw_data, WriteRows const &write_rows,
+						  uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
 {
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
@@ -263,74 +273,246 @@ static void YUYV_to_JPEG(const uint8_t *input, StreamInfo const &info,
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
 
-	cinfo.image_width = output_width;
-	cinfo.image_height = output_height;
+	cinfo.image_width = width;
+	cinfo.image_height = height;
 	cinfo.input_components = 3;
 	cinfo.in_color_space = JCS_YCbCr;
 	cinfo.restart_interval = restart;
 
 	jpeg_set_defaults(&cinfo);
+	cinfo.raw_data_in = raw_data;
+	if (in_rows)
+		cinfo.restart_in_rows = 1;
 	jpeg_set_quality(&cinfo, quality, TRUE);
 	jpeg_buffer = NULL;
 	jpeg_len = 0;
 	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
 	jpeg_start_compress(&cinfo, TRUE);
 
-	const unsigned int output_width3 = 3 * output_width;
-	std::vector<uint8_t> tmp_row(output_width3);
-	JSAMPROW jrow[1];
-	jrow[0] = &tmp_row[0];
+	write_rows(cinfo, first_row);
+
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+}
 
-	// Pre-calculate the horizontal offsets to speed up the main loop.
-	std::vector<unsigned int> h_offset(output_width3);
-	for (unsigned int i = 0, k = 0; i < output_width; i++)
+// Join JPEGs of consecutive horizontal strips of an image, each with a restart marker after every
+// row of MCUs, into a single JPEG. Each strip's entropy-coded data starts at a restart boundary
+// (the DC predictors are reset and the bit buffer is byte aligned), so the strips can be joined
+// with one more restart marker between them, once the markers are renumbered to run on in
+// sequence. The headers are taken from the first strip, with the height updated.
+void stitch_jpeg_strips(std::vector<std::pair<uint8_t *, size_t>> const &strips, unsigned int height,
+						uint8_t *&jpeg_buffer, size_t &jpeg_len)
+{
+	auto find_scan = [](uint8_t const *data, size_t len, size_t *sof) {
+		size_t pos = 2; // skip SOI
+		while (pos + 4 <= len && data[pos] == 0xff)
+		{
+			uint8_t marker = data[pos + 1];
+			size_t seg_len = (data[pos + 2] << 8) | data[pos + 3];
+			if (marker == 0xc0 && sof)
+				*sof = pos;
+			pos += 2 + seg_len;
+			if (marker == 0xda)
+				return pos;
+		}
+		throw std::runtime_error("failed to find scan in JPEG strip");
+	};
+
+	size_t sof = 0;
+	size_t header_len = find_scan(strips[0].first, strips[0].second, &sof);
+
+	size_t total = header_len + 2;
+	for (auto const &[data, len] : strips)
+		total += len + 2; // enough for the entropy data plus a restart marker
+	jpeg_buffer = (uint8_t *)malloc(total);
+	if (!jpeg_buffer)
+		throw std::runtime_error("failed to allocate JPEG buffer");
+
+	memcpy(jpeg_buffer, strips[0].first, header_len);
+	jpeg_buffer[sof + 5] = height >> 8;
+	jpeg_buffer[sof + 6] = height & 0xff;
+
+	uint8_t *out = jpeg_buffer + header_len;
+	unsigned int restart = 0;
+	for (std::size_t i = 0; i < strips.size(); i++)
 	{
-		unsigned int off = (i * info.width) / output_width * 2;
-		unsigned int off_align = off & ~3;
-		h_offset[k++] = off;
-		h_offset[k++] = off_align + 1;
-		h_offset[k++] = off_align + 3;
+		uint8_t const *data = strips[i].first;
+		size_t len = strips[i].second;
+		size_t pos = i ? find_scan(data, len, nullptr) : header_len;
+		size_t end = len - 2; // EOI
+
+		if (i)
+		{
+			*out++ = 0xff;
+			*out++ = 0xd0 + (restart++ & 7);
+		}
+
+		// In entropy-coded data a 0xff is always followed by a stuffed zero or by a restart marker.
+		while (pos < end)
+		{
+			uint8_t const *ff = (uint8_t const *)memchr(data + pos, 0xff, end - pos);
+			size_t run = ff ? ff - (data + pos) : end - pos;
+			memcpy(out, data + pos, run);
+			out += run;
+			pos += run;
+			if (!ff)
+				break;
+			uint8_t next = pos + 1 < end ? data[pos + 1] : 0;
+			*out++ = 0xff;
+			*out++ = (next >= 0xd0 && next <= 0xd7) ? 0xd0 + (restart++ & 7) : next;
+			pos += 2;
+		}
 	}
-	while (cinfo.next_scanline < output_height)
+
+	*out++ = 0xff;
+	*out++ = 0xd9;
+	jpeg_len = out - jpeg_buffer;
+}
+
+// Encode the image on all the available cores by splitting it into horizontal strips of whole MCU
+// rows, compressing each as a separate JPEG and then stitching them back together. Images too
+// small to split, or for which a specific restart interval was asked for, are encoded in one go.
+template <typename WriteRows>
+static void encode_jpeg(unsigned int width, unsigned int height, const int quality, const unsigned int restart,
+						bool raw_data, WriteRows const &write_rows, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+{
+	constexpr unsigned int mcu_height = 16; // we always use 4:2:0 chroma subsampling
+	unsigned int mcu_rows = (height + mcu_height - 1) / mcu_height;
+	unsigned int num_strips = std::min(std::max(std::thread::hardware_concurrency(), 1u), mcu_rows);
+
+	if (num_strips <= 1 || restart)
+	{
+		compress_jpeg(width, height, 0, quality, restart, false, raw_data, write_rows, jpeg_buffer, jpeg_len);
+		return;
+	}
+
+	unsigned int strip_height = (mcu_rows + num_strips - 1) / num_strips * mcu_height;
+	num_strips = (height + strip_height - 1) / strip_height;
+
+	std::vector<std::pair<uint8_t *, jpeg_mem_len_t>> strips(num_strips, { nullptr, 0 });
+	std::vector<std::thread> threads;
+	for (unsigned int i = 1; i < num_strips; i++)
+	{
+		unsigned int first_row = i * strip_height;
+		unsigned int rows = std::min(strip_height, height - first_row);
+		threads.emplace_back([&, i, first_row, rows]()
+							 { compress_jpeg(width, rows, first_row, quality, 0, true, raw_data, write_rows,
+											 strips[i].first, strips[i].second); });
+	}
+	compress_jpeg(width, strip_height, 0, quality, 0, true, raw_data, write_rows, strips[0].first, strips[0].second);
+	for (auto &t : threads)
+		t.join();
+
+	try
+	{
+		size_t len;
+		stitch_jpeg_strips(std::vector<std::pair<uint8_t *, size_t>>(strips.begin(), strips.end()), height,
+						   jpeg_buffer, len);
+		jpeg_len = len;
+	}
+	catch (std::exception const &e)
+	{
+		for (auto &strip : strips)
+			free(strip.first);
+		throw;
+	}
+	for (auto &strip : strips)
+		free(strip.first);
+	LOG(2, "JPEG encoded in " << num_strips << " strips");
+}
+
+// Point sample the image at another size, one row of interleaved YCbCr at a time.
+class RowSampler
+{
+public:
+	RowSampler(const uint8_t *input, StreamInfo const &info, unsigned int output_width, unsigned int output_height)
+		: input_(input), info_(info), output_height_(output_height), yuyv_(info.pixel_format == formats::YUYV),
+		  h_offset_(3 * output_width)
 	{
-		unsigned int offset = ((cinfo.next_scanline * info.height) / output_height) * info.stride;
-		for (unsigned int k = 0; k < output_width3; k += 3)
+		if (!yuyv_ && info.pixel_format != formats::YUV420)
+			throw std::runtime_error("unsupported YUV format in JPEG encode");
+
+		// Pre-calculate the horizontal offsets to speed up the main loop.
+		for (unsigned int i = 0, k = 0; i < output_width; i++)
 		{
-			tmp_row[k] = input[offset + h_offset[k]];
-			tmp_row[k + 1] = input[offset + h_offset[k + 1]];
-			tmp_row[k + 2] = input[offset + h_offset[k + 2]];
+			if (yuyv_)
+			{
+				unsigned int off = (i * info.width) / output_width * 2;
+				unsigned int off_align = off & ~3;
+				h_offset_[k++] = off;
+				h_offset_[k++] = off_align + 1;
+				h_offset_[k++] = off_align + 3;
+			}
+			else
+			{
+				unsigned int off = (i * info.width) / output_width;
+				h_offset_[k++] = off;
+				h_offset_[k++] = off / 2;
+				h_offset_[k++] = off / 2;
+			}
 		}
-		jpeg_write_scanlines(&cinfo, jrow, 1);
 	}
 
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
-}
+	void operator()(unsigned int row, uint8_t *dest) const
+	{
+		unsigned int offset = ((row * info_.height) / output_height_) * info_.stride;
+		if (yuyv_)
+		{
+			for (unsigned int k = 0; k < h_offset_.size(); k += 3)
+			{
+				dest[k] = input_[offset + h_offset_[k]];
+				dest[k + 1] = input_[offset + h_offset_[k + 1]];
+				dest[k + 2] = input_[offset + h_offset_[k + 2]];
+			}
+			return;
+		}
 
-static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
-								const int quality, const unsigned int restart,
-								uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+		const uint8_t *Y = input_;
+		const uint8_t *U = Y + info_.stride * info_.height;
+		const uint8_t *V = U + (info_.stride / 2) * (info_.height / 2);
+		unsigned int offset_uv = (((row / 2) * info_.height) / output_height_) * (info_.stride / 2);
+		for (unsigned int k = 0; k < h_offset_.size(); k += 3)
+		{
+			dest[k] = Y[offset + h_offset_[k]];
+			dest[k + 1] = U[offset_uv + h_offset_[k + 1]];
+			dest[k + 2] = V[offset_uv + h_offset_[k + 2]];
+		}
+	}
+
+private:
+	const uint8_t *input_;
+	StreamInfo info_;
+	unsigned int output_height_;
+	bool yuyv_;
+	std::vector<unsigned int> h_offset_;
+};
+
+static void scaled_to_JPEG(const uint8_t *input, StreamInfo const &info, const unsigned int output_width,
+						   const unsigned int output_height, const int quality, const unsigned int restart,
+						   uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
 {
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
+	RowSampler sampler(input, info, output_width, output_height);
 
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
+	auto write_rows = [&](jpeg_compress_struct &cinfo, unsigned int first_row)
+	{
+		std::vector<uint8_t> tmp_row(3 * output_width);
+		JSAMPROW jrow[1];
+		jrow[0] = &tmp_row[0];
 
-	cinfo.image_width = info.width;
-	cinfo.image_height = info.height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
+		while (cinfo.next_scanline < cinfo.image_height)
+		{
+			sampler(first_row + cinfo.next_scanline, &tmp_row[0]);
+			jpeg_write_scanlines(&cinfo, jrow, 1);
+		}
+	};
 
-	jpeg_set_defaults(&cinfo);
-	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
-	jpeg_start_compress(&cinfo, TRUE);
+	encode_jpeg(output_width, output_height, quality, restart, false, write_rows, jpeg_buffer, jpeg_len);
+}
 
+static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
+								const int quality, const unsigned int restart,
+								uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+{
 	int stride2 = info.stride / 2;
 	uint8_t *Y = (uint8_t *)input;
 	uint8_t *U = (uint8_t *)Y + info.stride * info.height;
@@ -339,105 +521,114 @@ static void YUV420_to_JPEG_fast(const uint8_t *input, StreamInfo const &info,
 	uint8_t *U_max = V - stride2;
 	uint8_t *V_max = U_max + stride2 * (info.height / 2);
 
-	JSAMPROW y_rows[16];
-	JSAMPROW u_rows[8];
-	JSAMPROW v_rows[8];
-
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < info.height;)
+	// Strips always start on a multiple of 16 rows, so at the start of a chroma row too.
+	auto write_rows = [&](jpeg_compress_struct &cinfo, unsigned int first_row)
 	{
-		for (int i = 0; i < 16; i++, Y_row += info.stride)
-			y_rows[i] = std::min(Y_row, Y_max);
-		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
-			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
+		JSAMPROW y_rows[16];
+		JSAMPROW u_rows[8];
+		JSAMPROW v_rows[8];
 
-		JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
-		jpeg_write_raw_data(&cinfo, rows, 16);
-	}
+		for (uint8_t *Y_row = Y + first_row * info.stride, *U_row = U + (first_row / 2) * stride2,
+					 *V_row = V + (first_row / 2) * stride2;
+			 cinfo.next_scanline < cinfo.image_height;)
+		{
+			for (int i = 0; i < 16; i++, Y_row += info.stride)
+				y_rows[i] = std::min(Y_row, Y_max);
+			for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
+				u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
 
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+			JSAMPARRAY rows[] = { y_rows, u_rows, v_rows };
+			jpeg_write_raw_data(&cinfo, rows, 16);
+		}
+	};
+
+	encode_jpeg(info.width, info.height, quality, restart, true, write_rows, jpeg_buffer, jpeg_len);
 }
 
-static void YUV420_to_JPEG(const uint8_t *input, StreamInfo const &info,
-						   const unsigned int output_width, const unsigned int output_height,
-						   const int quality, const unsigned int restart, uint8_t *&jpeg_buffer,
-						   jpeg_mem_len_t &jpeg_len)
+void yuv420_to_jpeg(const uint8_t *input, StreamInfo const &info, int quality, unsigned int restart,
+					uint8_t *&jpeg_buffer, size_t &jpeg_len)
 {
-	if (info.width == output_width && info.height == output_height)
-	{
-		YUV420_to_JPEG_fast(input, info, quality, restart, jpeg_buffer, jpeg_len);
-		return;
-	}
-
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-
-	cinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_compress(&cinfo);
-
-	cinfo.image_width = output_width;
-	cinfo.image_height = output_height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
-	cinfo.restart_interval = restart;
+	jpeg_mem_len_t len = 0;
+	YUV420_to_JPEG_fast(input, info, quality, restart, jpeg_buffer, len);
+	jpeg_len = len;
+}
 
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, quality, TRUE);
-	jpeg_buffer = NULL;
-	jpeg_len = 0;
-	jpeg_mem_dest(&cinfo, &jpeg_buffer, &jpeg_len);
-	jpeg_start_compress(&cinfo, TRUE);
+static void YUV_to_JPEG(const uint8_t *input, StreamInfo const &info, const int output_width, const int output_height,
+						const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
+{
+	if (info.pixel_format == libcamera::formats::YUV420 && info.width == (unsigned int)output_width &&
+		info.height == (unsigned int)output_height)
+		YUV420_to_JPEG_fast(input, info, quality, restart, jpeg_buffer, jpeg_len);
+	else
+		scaled_to_JPEG(input, info, output_width, output_height, quality, restart, jpeg_buffer, jpeg_len);
+}
 
-	const unsigned int output_width3 = 3 * output_width;
-	std::vector<uint8_t> tmp_row(output_width3);
-	JSAMPROW jrow[1];
-	jrow[0] = &tmp_row[0];
+// libjpeg scales its quantisation tables by this percentage for each quality, and back again.
+static double quality_to_scale(int quality)
+{
+	return quality < 50 ? 5000.0 / quality : std::max(200.0 - 2 * quality, 1.0);
+}
 
-	const uint8_t *Y = input;
-	const uint8_t *U = Y + info.stride * info.height;
-	const uint8_t *V = U + (info.stride / 2) * (info.height / 2);
+static int scale_to_quality(double scale)
+{
+	return scale > 100 ? 5000 / scale : (200 - scale) / 2;
+}
 
-	// Pre-calculate the horizontal offsets to speed up the main loop.
-	std::vector<unsigned int> h_offset(output_width3);
-	for (unsigned int i = 0, k = 0; i < output_width; i++)
+// Make the thumbnail from the smaller image when we have one that's big enough, scaling the image down
+// only once however many qualities we try. Should the first be too big, we guess the next from how the
+// size goes with the quantiser step (about as its -0.7th power), aiming a little under the limit, so that
+// one more encode normally does it.
+static void make_thumbnail(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+						   ThumbnailImage const *thumbnail, StillOptions const *options, size_t max_len,
+						   uint8_t *&thumb_buffer, jpeg_mem_len_t &thumb_len)
+{
+	unsigned int width = options->Get().thumb_width, height = options->Get().thumb_height;
+	const uint8_t *input = mem[0].data();
+	StreamInfo const *input_info = &info;
+	if (thumbnail && thumbnail->info.width >= width && thumbnail->info.height >= height &&
+		(thumbnail->info.pixel_format == formats::YUV420 || thumbnail->info.pixel_format == formats::YUYV))
 	{
-		unsigned int off = (i * info.width) / output_width;
-		h_offset[k++] = off;
-		h_offset[k++] = off / 2;
-		h_offset[k++] = off / 2;
+		input = thumbnail->mem.data();
+		input_info = &thumbnail->info;
+		LOG(2, "Thumbnail made from the " << input_info->width << "x" << input_info->height << " stream");
 	}
-	while (cinfo.next_scanline < output_height)
+
+	std::vector<uint8_t> image(3 * width * height);
+	RowSampler sampler(input, *input_info, width, height);
+	for (unsigned int row = 0; row < height; row++)
+		sampler(row, &image[3 * width * row]);
+
+	auto write_rows = [&](jpeg_compress_struct &cinfo, unsigned int)
 	{
-		unsigned int offset = ((cinfo.next_scanline * info.height) / output_height) * info.stride;
-		unsigned int offset_uv = (((cinfo.next_scanline / 2) * info.height) / output_height) * (info.stride / 2);
-		for (unsigned int k = 0; k < output_width3; k += 3)
+		while (cinfo.next_scanline < cinfo.image_height)
 		{
-			tmp_row[k] = Y[offset + h_offset[k]];
-			tmp_row[k + 1] = U[offset_uv + h_offset[k + 1]];
-			tmp_row[k + 2] = V[offset_uv + h_offset[k + 2]];
+			JSAMPROW jrow[1] = { &image[3 * width * cinfo.next_scanline] };
+			jpeg_write_scanlines(&cinfo, jrow, 1);
 		}
-		jpeg_write_scanlines(&cinfo, jrow, 1);
-	}
+	};
 
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
-}
+	int q = options->Get().thumb_quality;
+	while (true)
+	{
+		// The thumbnail is too small to be worth splitting over the cores.
+		compress_jpeg(width, height, 0, q, 0, false, false, write_rows, thumb_buffer, thumb_len);
+		LOG(2, "Thumbnail size " << thumb_len << " at quality " << q);
+		if (thumb_len <= max_len)
+			return;
+		free(thumb_buffer);
+		thumb_buffer = nullptr;
+		if (q <= 1)
+			throw std::runtime_error("failed to make acceptable thumbnail");
 
-static void YUV_to_JPEG(const uint8_t *input, StreamInfo const &info, const int output_width, const int output_height,
-						const int quality, const unsigned int restart, uint8_t *&jpeg_buffer, jpeg_mem_len_t &jpeg_len)
-{
-	if (info.pixel_format == libcamera::formats::YUYV)
-		YUYV_to_JPEG(input, info, output_width, output_height, quality, restart, jpeg_buffer, jpeg_len);
-	else if (info.pixel_format == libcamera::formats::YUV420)
-		YUV420_to_JPEG(input, info, output_width, output_height, quality, restart, jpeg_buffer, jpeg_len);
-	else
-		throw std::runtime_error("unsupported YUV format in JPEG encode");
+		double scale = quality_to_scale(q) * std::pow((double)thumb_len / (0.9 * max_len), 1 / 0.7);
+		q = std::clamp(scale_to_quality(scale), 1, q - 1);
+	}
 }
 
 static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 							 ControlList const &metadata, std::string const &cam_model, StillOptions const *options,
-							 uint8_t *&exif_buffer, unsigned int &exif_len, uint8_t *&thumb_buffer,
-							 jpeg_mem_len_t &thumb_len)
+							 ThumbnailImage const *thumbnail, uint8_t *&exif_buffer, unsigned int &exif_len,
+							 uint8_t *&thumb_buffer, jpeg_mem_len_t &thumb_len)
 {
 	exif_buffer = nullptr;
 	ExifData *exif = nullptr;
@@ -531,19 +722,10 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			// Next create the JPEG for the thumbnail, we need to do this now so that we can
 			// go back and fill in the correct values for the thumbnail offsets/length.
 
-			int q = options->Get().thumb_quality;
-			for (; q > 0; q -= 5)
-			{
-				YUV_to_JPEG((uint8_t *)(mem[0].data()), info, options->Get().thumb_width, options->Get().thumb_height,
-							q, 0, thumb_buffer, thumb_len);
-				if (thumb_len < 60000) // entire EXIF data must be < 65536, so this should be safe
-					break;
-				free(thumb_buffer);
-				thumb_buffer = nullptr;
-			}
-			LOG(2, "Thumbnail size " << thumb_len);
-			if (q <= 0)
-				throw std::runtime_error("failed to make acceptable thumbnail");
+			// The whole APP1 segment, whose length includes its own two bytes, must fit in 65535 bytes.
+			if (exif_len >= 65533)
+				throw std::runtime_error("EXIF data too big for a thumbnail");
+			make_thumbnail(mem, info, thumbnail, options, 65533 - exif_len, thumb_buffer, thumb_len);
 
 			// Now fill in the correct offsets and length.
 
@@ -562,16 +744,17 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 	{
 		if (exif)
 			exif_data_unref(exif);
-		if (exif_buffer)
-			free(exif_buffer);
-		if (thumb_buffer)
-			free(thumb_buffer);
+		free(exif_buffer);
+		exif_buffer = nullptr;
+		free(thumb_buffer);
+		thumb_buffer = nullptr;
 		throw;
 	}
 }
 
 void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info, ControlList const &metadata,
-			   std::string const &filename, std::string const &cam_model, StillOptions const *options)
+			   std::string const &filename, std::string const &cam_model, StillOptions const *options,
+			   ThumbnailImage const *thumbnail)
 {
 	FILE *fp = nullptr;
 	uint8_t *thumb_buffer = nullptr;
@@ -587,16 +770,43 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 
 		// Make all the EXIF data, which includes the thumbnail.
 
+		// This doesn't depend on the full size JPEG, so it is made on a thread of its own while that is encoded,
+		// and making the thumbnail, which may take several tries, costs no extra time.
+
 		jpeg_mem_len_t thumb_len = 0; // stays zero if no thumbnail
 		unsigned int exif_len;
-		create_exif_data(mem, info, metadata, cam_model, options, exif_buffer, exif_len, thumb_buffer, thumb_len);
+		std::exception_ptr exif_error;
+		std::thread exif_thread(
+			[&]()
+			{
+				try
+				{
+					create_exif_data(mem, info, metadata, cam_model, options, thumbnail, exif_buffer, exif_len,
+									 thumb_buffer, thumb_len);
+				}
+				catch (...)
+				{
+					exif_error = std::current_exception();
+				}
+			});
 
 		// Make the full size JPEG (could probably be more efficient if we had
 		// YUV422 or YUV420 planar format).
 
 		jpeg_mem_len_t jpeg_len;
-		YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->Get().quality,
-					options->Get().restart, jpeg_buffer, jpeg_len);
+		try
+		{
+			YUV_to_JPEG((uint8_t *)(mem[0].data()), info, info.width, info.height, options->Get().quality,
+						options->Get().restart, jpeg_buffer, jpeg_len);
+		}
+		catch (...)
+		{
+			exif_thread.join();
+			throw;
+		}
+		exif_thread.join();
+		if (exif_error)
+			std::rethrow_exception(exif_error);
 		LOG(2, "JPEG size is " << jpeg_len);
 
 		// Write everything out.
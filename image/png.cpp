@@ -5,22 +5,252 @@
  * png.cpp - Encode image as png and write to file.
  */
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
 #include <string>
+#include <thread>
 
 #include <libcamera/formats.h>
 
 #include <png.h>
+#include <zlib.h>
 
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
+// The PNG row filters, in the order of their type bytes, then the per-row choice among them.
+enum Filter
+{
+	FILTER_NONE,
+	FILTER_SUB,
+	FILTER_UP,
+	FILTER_AVG,
+	FILTER_PAETH,
+	FILTER_ADAPTIVE
+};
+
+static Filter parse_filter(std::string const &name)
+{
+	static const char *names[] = { "none", "sub", "up", "avg", "paeth", "adaptive" };
+	for (unsigned int i = 0; i <= FILTER_ADAPTIVE; i++)
+	{
+		if (name == names[i])
+			return (Filter)i;
+	}
+	throw std::runtime_error("unknown png filter " + name);
+}
+
+static constexpr unsigned int BPP = 3;
+// Strips any shorter than this aren't worth a thread.
+static constexpr unsigned int MIN_STRIP_ROWS = 64;
+// The most that a deflate stream can refer back to.
+static constexpr unsigned int DEFLATE_WINDOW = 32768;
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+}
+
+// Write the filter type byte and the filtered row to out. The row above is all zeros for the first one.
+static void filter_row(uint8_t *out, uint8_t const *row, uint8_t const *prev, unsigned int len, Filter filter)
+{
+	if (filter == FILTER_ADAPTIVE)
+	{
+		// As libpng does, try them all and keep the one whose bytes, taken as signed, have the lowest
+		// sum of magnitudes.
+		std::vector<uint8_t> trial(len + 1);
+		unsigned long best_sum = ~0UL;
+		Filter best = FILTER_NONE;
+		for (unsigned int f = FILTER_NONE; f <= FILTER_PAETH; f++)
+		{
+			filter_row(trial.data(), row, prev, len, (Filter)f);
+			unsigned long sum = 0;
+			for (unsigned int i = 1; i <= len; i++)
+				sum += abs((int8_t)trial[i]);
+			if (sum < best_sum)
+			{
+				best_sum = sum;
+				best = (Filter)f;
+			}
+		}
+		filter_row(out, row, prev, len, best);
+		return;
+	}
+
+	*out++ = filter;
+	for (unsigned int i = 0; i < len; i++)
+	{
+		int a = i >= BPP ? row[i - BPP] : 0;
+		int b = prev ? prev[i] : 0;
+		int c = prev && i >= BPP ? prev[i - BPP] : 0;
+		switch (filter)
+		{
+		case FILTER_SUB:
+			out[i] = row[i] - a;
+			break;
+		case FILTER_UP:
+			out[i] = row[i] - b;
+			break;
+		case FILTER_AVG:
+			out[i] = row[i] - ((a + b) >> 1);
+			break;
+		case FILTER_PAETH:
+			out[i] = row[i] - paeth(a, b, c);
+			break;
+		default:
+			out[i] = row[i];
+		}
+	}
+}
+
+struct PngStrip
+{
+	std::vector<uint8_t> data;
+	uLong adler;
+	uLong length; // of the uncompressed, filtered, rows
+};
+
+// Filter and deflate the rows [first, first + rows) as a raw deflate stream. Every strip but the last ends
+// on a byte boundary with a sync flush, so that the strips can simply be joined. So as not to lose much
+// compression at the joins, each strip is primed with the filtered data just before it.
+static void deflate_strip(uint8_t const *image, unsigned int stride, unsigned int row_bytes, unsigned int first,
+						  unsigned int rows, bool last, int level, Filter filter, PngStrip &strip)
+{
+	unsigned int filtered_bytes = row_bytes + 1;
+	unsigned int dict_rows = first ? std::min(first, (DEFLATE_WINDOW + filtered_bytes - 1) / filtered_bytes) : 0;
+	std::vector<uint8_t> filtered((dict_rows + rows) * filtered_bytes);
+	for (unsigned int y = first - dict_rows, i = 0; y < first + rows; y++, i++)
+		filter_row(&filtered[i * filtered_bytes], image + y * stride, y ? image + (y - 1) * stride : nullptr,
+				   row_bytes, filter);
+
+	z_stream zs = {};
+	if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("failed to initialise deflate");
+	uint8_t *input = filtered.data() + dict_rows * filtered_bytes;
+	strip.length = rows * filtered_bytes;
+	if (dict_rows)
+	{
+		unsigned int dict_len = std::min<unsigned int>(dict_rows * filtered_bytes, DEFLATE_WINDOW);
+		deflateSetDictionary(&zs, input - dict_len, dict_len);
+	}
+
+	strip.data.resize(deflateBound(&zs, strip.length) + 16);
+	zs.next_in = input;
+	zs.avail_in = strip.length;
+	int ret;
+	do
+	{
+		if (zs.total_out == strip.data.size())
+			strip.data.resize(strip.data.size() * 2);
+		zs.next_out = strip.data.data() + zs.total_out;
+		zs.avail_out = strip.data.size() - zs.total_out;
+		ret = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+	} while (ret == Z_OK && (last || zs.avail_out == 0));
+	strip.data.resize(zs.total_out);
+	deflateEnd(&zs);
+	// Asking for the flush again, once it's all been written, makes no progress, which is no error.
+	if (last ? ret != Z_STREAM_END : (ret != Z_OK && ret != Z_BUF_ERROR))
+		throw std::runtime_error("deflate failed");
+
+	strip.adler = adler32(1, input, strip.length);
+}
+
+static void write_chunk(FILE *fp, char const *type, uint8_t const *data, uint32_t len)
+{
+	uint8_t header[8] = { (uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len,
+						  (uint8_t)type[0],	  (uint8_t)type[1],		(uint8_t)type[2],	 (uint8_t)type[3] };
+	uLong crc = crc32(0, header + 4, 4);
+	if (len) // a null data pointer would reset the crc instead
+		crc = crc32(crc, data, len);
+	uint8_t trailer[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+	if (fwrite(header, sizeof(header), 1, fp) != 1 || (len && fwrite(data, len, 1, fp) != 1) ||
+		fwrite(trailer, sizeof(trailer), 1, fp) != 1)
+		throw std::runtime_error("failed to write png file");
+}
+
+// Compress horizontal strips of the image on all the cores and stitch the results into one zlib stream,
+// written as an IDAT chunk for each strip.
+static void write_png_strips(FILE *fp, uint8_t const *image, StreamInfo const &info, int level, Filter filter,
+							 unsigned int num_strips)
+{
+	unsigned int row_bytes = info.width * BPP;
+	unsigned int strip_height = (info.height + num_strips - 1) / num_strips;
+	num_strips = (info.height + strip_height - 1) / strip_height;
+
+	std::vector<PngStrip> strips(num_strips);
+	std::vector<std::thread> threads;
+	std::vector<std::exception_ptr> errors(num_strips);
+	for (unsigned int i = 0; i < num_strips; i++)
+	{
+		unsigned int first = i * strip_height;
+		unsigned int rows = std::min(strip_height, info.height - first);
+		threads.emplace_back([&, i, first, rows]() {
+			try
+			{
+				deflate_strip(image, info.stride, row_bytes, first, rows, i == num_strips - 1, level, filter,
+							  strips[i]);
+			}
+			catch (...)
+			{
+				errors[i] = std::current_exception();
+			}
+		});
+	}
+	for (auto &t : threads)
+		t.join();
+	for (auto &error : errors)
+	{
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+	static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	if (fwrite(signature, sizeof(signature), 1, fp) != 1)
+		throw std::runtime_error("failed to write png file");
+	uint8_t ihdr[13] = { (uint8_t)(info.width >> 24),
+						 (uint8_t)(info.width >> 16),
+						 (uint8_t)(info.width >> 8),
+						 (uint8_t)info.width,
+						 (uint8_t)(info.height >> 24),
+						 (uint8_t)(info.height >> 16),
+						 (uint8_t)(info.height >> 8),
+						 (uint8_t)info.height,
+						 8, // bit depth
+						 PNG_COLOR_TYPE_RGB,
+						 PNG_COMPRESSION_TYPE_DEFAULT,
+						 PNG_FILTER_TYPE_DEFAULT,
+						 PNG_INTERLACE_NONE };
+	write_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+
+	// The zlib header goes in front of the first strip, and the checksum of everything after the last.
+	uint8_t zlib_header[2] = { 0x78, (uint8_t)(level < 2 ? 0x01 : level < 6 ? 0x5e : level == 6 ? 0x9c : 0xda) };
+	uLong adler = strips[0].adler;
+	for (unsigned int i = 1; i < num_strips; i++)
+		adler = adler32_combine(adler, strips[i].adler, strips[i].length);
+	strips[0].data.insert(strips[0].data.begin(), zlib_header, zlib_header + 2);
+	uint8_t adler_bytes[4] = { (uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler };
+	strips.back().data.insert(strips.back().data.end(), adler_bytes, adler_bytes + 4);
+
+	for (auto const &strip : strips)
+		write_chunk(fp, "IDAT", strip.data.data(), strip.data.size());
+	write_chunk(fp, "IEND", nullptr, 0);
+	LOG(2, "PNG compressed in " << num_strips << " strips");
+}
+
 void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			  std::string const &filename, StillOptions const *options)
 {
 	if (info.pixel_format != libcamera::formats::BGR888)
 		throw std::runtime_error("pixel format for png should be BGR");
 
+	Filter filter = parse_filter(options->Get().png_filter);
+	int level = options->Get().png_level;
+	unsigned int num_strips =
+		std::min(std::max(std::thread::hardware_concurrency(), 1u), info.height / MIN_STRIP_ROWS);
+
 	FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "wb");
 	png_structp png_ptr = NULL;
 	png_infop info_ptr = NULL;
@@ -28,6 +258,24 @@ void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 	if (fp == NULL)
 		throw std::runtime_error("failed to open file " + filename);
 
+	if (num_strips > 1)
+	{
+		try
+		{
+			write_png_strips(fp, mem[0].data(), info, level, filter, num_strips);
+			LOG(2, "Wrote PNG file of " << ftell(fp) << " bytes");
+			if (fp != stdout)
+				fclose(fp);
+		}
+		catch (std::exception const &e)
+		{
+			if (fp != stdout)
+				fclose(fp);
+			throw;
+		}
+		return;
+	}
+
 	try
 	{
 		// Open everything up.
@@ -45,9 +293,10 @@ void png_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		// Set image attributes.
 		png_set_IHDR(png_ptr, info_ptr, info.width, info.height, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
 					 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-		// These settings get us most of the compression, but are much faster.
-		png_set_filter(png_ptr, 0, PNG_FILTER_AVG);
-		png_set_compression_level(png_ptr, 1);
+		static const int png_filters[] = { PNG_FILTER_NONE, PNG_FILTER_SUB,	PNG_FILTER_UP,
+										   PNG_FILTER_AVG,	PNG_FILTER_PAETH, PNG_ALL_FILTERS };
+		png_set_filter(png_ptr, 0, png_filters[filter]);
+		png_set_compression_level(png_ptr, level);
 
 		// Set up the image data.
 		png_byte **row_ptrs = (png_byte **)png_malloc(png_ptr, info.height * sizeof(png_byte *));
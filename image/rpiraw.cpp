@@ -0,0 +1,165 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rpiraw.cpp - Store raw frames verbatim, with what is needed to make a DNG later.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include <libcamera/control_ids.h>
+
+#include "core/logging.hpp"
+
+#include "image/image.hpp"
+
+/*
+ * A .rpiraw file is a sequence of records with everything little-endian:
+ *   char     magic[8]       "RPIRAW1\0"
+ *   uint32_t header_size    bytes from the start of the record to the payload
+ *   uint32_t payload_size
+ *   uint32_t width, height, stride
+ *   uint32_t fourcc
+ *   uint64_t modifier
+ *   uint32_t model_size, then the camera model
+ *   uint32_t num_controls, then for each control:
+ *     uint32_t id, type, is_array, num_elements, data_size, then the data
+ * followed by payload_size bytes of the buffer exactly as the camera produced it. rpicam-still
+ * writes a single record, whereas rpicam-raw writes one per frame.
+ */
+
+static const char rpiraw_magic[8] = { 'R', 'P', 'I', 'R', 'A', 'W', '1', 0 };
+
+static void put32(std::vector<uint8_t> &buf, uint32_t value)
+{
+	for (int i = 0; i < 4; i++)
+		buf.push_back(value >> (8 * i));
+}
+
+static void put_bytes(std::vector<uint8_t> &buf, void const *data, std::size_t size)
+{
+	uint8_t const *p = static_cast<uint8_t const *>(data);
+	buf.insert(buf.end(), p, p + size);
+}
+
+std::vector<uint8_t> rpiraw_header(StreamInfo const &info, libcamera::ControlList const &metadata,
+								   std::string const &cam_model, std::size_t payload_size)
+{
+	std::vector<uint8_t> buf;
+	put_bytes(buf, rpiraw_magic, sizeof(rpiraw_magic));
+	put32(buf, 0); // header size, filled in below
+	put32(buf, payload_size);
+	put32(buf, info.width);
+	put32(buf, info.height);
+	put32(buf, info.stride);
+	put32(buf, info.pixel_format.fourcc());
+	put32(buf, info.pixel_format.modifier());
+	put32(buf, info.pixel_format.modifier() >> 32);
+	put32(buf, cam_model.size());
+	put_bytes(buf, cam_model.data(), cam_model.size());
+
+	put32(buf, metadata.size());
+	for (auto const &[id, value] : metadata)
+	{
+		libcamera::Span<const uint8_t> data = value.data();
+		put32(buf, id);
+		put32(buf, value.type());
+		put32(buf, value.isArray());
+		put32(buf, value.numElements());
+		put32(buf, data.size());
+		put_bytes(buf, data.data(), data.size());
+	}
+
+	uint32_t header_size = buf.size();
+	for (int i = 0; i < 4; i++)
+		buf[sizeof(rpiraw_magic) + i] = header_size >> (8 * i);
+	return buf;
+}
+
+void rpiraw_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+				 libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_model)
+{
+	if (mem.size() != 1)
+		throw std::runtime_error("only single plane raw supported");
+
+	std::vector<uint8_t> header = rpiraw_header(info, metadata, cam_model, mem[0].size());
+	FILE *fp = fopen(filename.c_str(), "w");
+	if (!fp)
+		throw std::runtime_error("failed to open file " + filename);
+
+	bool ok = fwrite(header.data(), header.size(), 1, fp) == 1 && fwrite(mem[0].data(), mem[0].size(), 1, fp) == 1;
+	if (fclose(fp) || !ok)
+		throw std::runtime_error("failed to write file " + filename);
+	LOG(2, "Saved raw " << info.width << " x " << info.height << " to file " << filename);
+}
+
+bool rpiraw_read(FILE *fp, StreamInfo &info, libcamera::ControlList &metadata, std::string &cam_model,
+				 std::vector<uint8_t> &payload)
+{
+	char magic[sizeof(rpiraw_magic)];
+	uint8_t size_bytes[4];
+	std::size_t n = fread(magic, 1, sizeof(magic), fp);
+	if (n == 0 && feof(fp))
+		return false;
+	if (n != sizeof(magic) || memcmp(magic, rpiraw_magic, sizeof(magic)) || fread(size_bytes, 4, 1, fp) != 1)
+		throw std::runtime_error("not an rpiraw file");
+
+	uint32_t header_size = size_bytes[0] | (size_bytes[1] << 8) | (size_bytes[2] << 16) | (size_bytes[3] << 24);
+	if (header_size < sizeof(magic) + 4)
+		throw std::runtime_error("bad rpiraw header");
+	std::vector<uint8_t> header(header_size - sizeof(magic) - 4);
+	if (fread(header.data(), header.size(), 1, fp) != 1)
+		throw std::runtime_error("truncated rpiraw header");
+
+	std::size_t pos = 0;
+	auto get32 = [&]() {
+		if (pos + 4 > header.size())
+			throw std::runtime_error("truncated rpiraw header");
+		uint32_t value = header[pos] | (header[pos + 1] << 8) | (header[pos + 2] << 16) | (header[pos + 3] << 24);
+		pos += 4;
+		return value;
+	};
+	auto get_bytes = [&](std::size_t size) {
+		if (pos + size > header.size())
+			throw std::runtime_error("truncated rpiraw header");
+		pos += size;
+		return header.data() + pos - size;
+	};
+
+	uint32_t payload_size = get32();
+	info.width = get32();
+	info.height = get32();
+	info.stride = get32();
+	uint32_t fourcc = get32();
+	uint64_t modifier = get32();
+	modifier |= static_cast<uint64_t>(get32()) << 32;
+	info.pixel_format = libcamera::PixelFormat(fourcc, modifier);
+	uint32_t model_size = get32();
+	uint8_t const *model = get_bytes(model_size);
+	cam_model.assign(model, model + model_size);
+
+	metadata = libcamera::ControlList(libcamera::controls::controls);
+	for (uint32_t num_controls = get32(); num_controls; num_controls--)
+	{
+		uint32_t id = get32();
+		libcamera::ControlType type = static_cast<libcamera::ControlType>(get32());
+		bool is_array = get32();
+		uint32_t num_elements = get32();
+		uint32_t data_size = get32();
+		uint8_t const *data = get_bytes(data_size);
+
+		libcamera::ControlValue value;
+		value.reserve(type, is_array, num_elements);
+		if (value.data().size() != data_size)
+			throw std::runtime_error("bad control in rpiraw header");
+		memcpy(value.data().data(), data, data_size);
+		metadata.set(id, value);
+	}
+
+	payload.resize(payload_size);
+	if (fread(payload.data(), payload_size, 1, fp) != 1)
+		throw std::runtime_error("truncated rpiraw payload");
+	return true;
+}
@@ -5,55 +5,295 @@
  * yuv.cpp - dummy stills encoder to save uncompressed data
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+
 #include <libcamera/formats.h>
 
+#include "core/cpu_features.hpp"
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
-static void yuv420_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
-						std::string const &filename, StillOptions const *options)
+// The camera's buffers may well be uncached, so the rows are read from them as few times, and written out
+// in as few calls, as we can manage. Planes whose rows are packed together go out in a single write. With
+// the "copy" method anything else is gathered into a (cached) buffer first, "writev" hands the rows to the
+// kernel straight from the camera buffer, and "mmap" copies them into a mapping of the preallocated file.
+namespace
 {
-	if (options->Get().encoding == "yuv420")
+
+class RawWriter
+{
+public:
+	RawWriter(std::string const &filename, size_t size, std::string const &method) : filename_(filename)
 	{
-		unsigned w = info.width, h = info.height, stride = info.stride;
-		if ((w & 1) || (h & 1))
-			throw std::runtime_error("both width and height must be even");
-		if (mem.size() != 1)
-			throw std::runtime_error("incorrect number of planes in YUV420 data");
-		FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "w");
-		if (!fp)
-			throw std::runtime_error("failed to open file " + filename);
-		try
+		if (filename == "-")
 		{
-			uint8_t *Y = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < h; j++)
-			{
-				if (fwrite(Y + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			uint8_t *U = Y + stride * h;
-			h /= 2, w /= 2, stride /= 2;
-			for (unsigned int j = 0; j < h; j++)
+			fflush(stdout);
+			fd_ = STDOUT_FILENO;
+		}
+		else
+		{
+			fd_ = open(filename.c_str(), (method == "mmap" ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			if (fd_ < 0)
+				throw std::runtime_error("failed to open file " + filename);
+		}
+
+		// Only a file we opened ourselves (and truncated) gets reserved and mapped. Whatever stdout is, it may
+		// not be open for reading, or be at the start of the file, so it always gets written to in order.
+		struct stat st;
+		bool own_file = fd_ != STDOUT_FILENO && fstat(fd_, &st) == 0 && S_ISREG(st.st_mode);
+		// Reserving the whole file up front saves the filesystem allocating it a bit at a time. We don't use
+		// posix_fallocate, which writes zeros everywhere that fallocate isn't supported. A mapping needs the
+		// blocks to be really there, as a full disk would otherwise only show up as a SIGBUS.
+		bool reserved = own_file && fallocate(fd_, 0, 0, size) == 0;
+
+		if (method == "mmap" && reserved)
+		{
+			void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+			if (map == MAP_FAILED)
+				throw std::runtime_error("failed to map file " + filename);
+			map_ = (uint8_t *)map;
+			map_size_ = size;
+		}
+		else
+			// Pipes, stdout and files we can't reserve get the next best thing.
+			writev_ = method == "writev" || method == "mmap";
+	}
+
+	~RawWriter()
+	{
+		if (map_)
+			munmap(map_, map_size_);
+		if (fd_ != STDOUT_FILENO)
+			close(fd_);
+	}
+
+	// Write rows of row_bytes bytes, each stride bytes after the last.
+	void Rows(uint8_t const *src, unsigned int row_bytes, unsigned int rows, unsigned int stride)
+	{
+		if (map_)
+		{
+			uint8_t *dest = Next((size_t)row_bytes * rows);
+			if (stride == row_bytes)
+				memcpy(dest, src, (size_t)row_bytes * rows);
+			else
+				for (unsigned int j = 0; j < rows; j++, src += stride, dest += row_bytes)
+					memcpy(dest, src, row_bytes);
+		}
+		else if (stride == row_bytes)
+		{
+			flush();
+			writeAll(src, (size_t)row_bytes * rows);
+		}
+		else if (writev_)
+		{
+			flushBounce();
+			for (unsigned int j = 0; j < rows; j++, src += stride)
 			{
-				if (fwrite(U + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
+				iov_.push_back({ (void *)src, row_bytes });
+				if (iov_.size() == IOV_MAX)
+					flushIov();
 			}
-			uint8_t *V = U + stride * h;
-			for (unsigned int j = 0; j < h; j++)
+		}
+		else
+		{
+			// Only take whole rows at a time from the camera buffer, which is what it reads best.
+			for (unsigned int j = 0; j < rows; j++, src += stride)
+				memcpy(Next(row_bytes), src, row_bytes);
+		}
+	}
+
+	// Return where the next bytes of the file go. They must be filled in before anything else is written.
+	uint8_t *Next(size_t bytes)
+	{
+		if (map_)
+		{
+			if (offset_ + bytes > map_size_)
+				throw std::runtime_error("RawWriter: writing past the end of " + filename_);
+			uint8_t *dest = map_ + offset_;
+			offset_ += bytes;
+			return dest;
+		}
+
+		flushIov();
+		if (used_ + bytes > bounce_.size())
+		{
+			flushBounce();
+			if (bytes > bounce_.size())
+				bounce_.resize(std::max(bytes, BOUNCE_SIZE));
+		}
+		uint8_t *dest = bounce_.data() + used_;
+		used_ += bytes;
+		return dest;
+	}
+
+	void Finish()
+	{
+		flush();
+		if (map_)
+		{
+			munmap(map_, map_size_);
+			map_ = nullptr;
+		}
+		if (fd_ != STDOUT_FILENO)
+		{
+			int fd = fd_;
+			fd_ = STDOUT_FILENO;
+			if (close(fd) < 0)
+				throw std::runtime_error("failed to write file " + filename_);
+		}
+	}
+
+private:
+	static constexpr size_t BOUNCE_SIZE = 1 << 20;
+
+	void flush()
+	{
+		flushIov();
+		flushBounce();
+	}
+
+	void flushBounce()
+	{
+		writeAll(bounce_.data(), used_);
+		used_ = 0;
+	}
+
+	void flushIov()
+	{
+		size_t done = 0;
+		while (done < iov_.size())
+		{
+			ssize_t ret = writev(fd_, &iov_[done], iov_.size() - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				throw std::runtime_error("failed to write file " + filename_);
+			// Short writes leave us part way through a row.
+			while (done < iov_.size() && (size_t)ret >= iov_[done].iov_len)
+				ret -= iov_[done++].iov_len;
+			if (ret)
 			{
-				if (fwrite(V + j * stride, w, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
+				iov_[done].iov_base = (uint8_t *)iov_[done].iov_base + ret;
+				iov_[done].iov_len -= ret;
 			}
-			if (fp != stdout)
-				fclose(fp);
 		}
-		catch (std::exception const &e)
+		iov_.clear();
+	}
+
+	void writeAll(uint8_t const *src, size_t bytes)
+	{
+		while (bytes)
 		{
-			if (fp != stdout)
-				fclose(fp);
-			throw;
+			ssize_t ret = write(fd_, src, bytes);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			if (ret <= 0)
+				throw std::runtime_error("failed to write file " + filename_);
+			src += ret;
+			bytes -= ret;
 		}
 	}
+
+	std::string filename_;
+	int fd_ = STDOUT_FILENO;
+	bool writev_ = false;
+	std::vector<uint8_t> bounce_;
+	size_t used_ = 0;
+	std::vector<iovec> iov_;
+	uint8_t *map_ = nullptr;
+	size_t map_size_ = 0;
+	size_t offset_ = 0;
+};
+
+} // namespace
+
+static void yuyv_luma_generic(uint8_t const *src, uint8_t *y, unsigned int width)
+{
+	for (unsigned int i = 0; i < width; i++)
+		y[i] = src[i << 1];
+}
+
+static void yuyv_chroma_generic(uint8_t const *src, uint8_t *u, uint8_t *v, unsigned int width)
+{
+	for (unsigned int i = 0; i < width / 2; i++)
+	{
+		u[i] = src[(i << 2) + 1];
+		v[i] = src[(i << 2) + 3];
+	}
+}
+
+#if defined(RPICAM_NEON_KERNELS)
+// 32 pixels at a time, which vld4 splits into the even luma, U, odd luma and V samples.
+NEON_TARGET static void yuyv_luma_neon(uint8_t const *src, uint8_t *y, unsigned int width)
+{
+	unsigned int x = 0;
+	for (; x + 32 <= width; x += 32, src += 64, y += 32)
+	{
+		uint8x16x4_t in = vld4q_u8(src);
+		uint8x16x2_t out = { { in.val[0], in.val[2] } };
+		vst2q_u8(y, out);
+	}
+	yuyv_luma_generic(src, y, width - x);
+}
+
+NEON_TARGET static void yuyv_chroma_neon(uint8_t const *src, uint8_t *u, uint8_t *v, unsigned int width)
+{
+	unsigned int x = 0;
+	for (; x + 32 <= width; x += 32, src += 64, u += 16, v += 16)
+	{
+		uint8x16x4_t in = vld4q_u8(src);
+		vst1q_u8(u, in.val[1]);
+		vst1q_u8(v, in.val[3]);
+	}
+	yuyv_chroma_generic(src, u, v, width - x);
+}
+#endif
+
+using LumaRow = void (*)(uint8_t const *, uint8_t *, unsigned int);
+using ChromaRow = void (*)(uint8_t const *, uint8_t *, uint8_t *, unsigned int);
+
+static LumaRow const yuyv_luma_row = SelectKernel<LumaRow>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, yuyv_luma_neon },
+#endif
+	{ CpuLevel::Generic, yuyv_luma_generic },
+});
+
+static ChromaRow const yuyv_chroma_row = SelectKernel<ChromaRow>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, yuyv_chroma_neon },
+#endif
+	{ CpuLevel::Generic, yuyv_chroma_generic },
+});
+
+static void yuv420_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+						std::string const &filename, StillOptions const *options)
+{
+	if (options->Get().encoding == "yuv420")
+	{
+		unsigned w = info.width, h = info.height, stride = info.stride;
+		if ((w & 1) || (h & 1))
+			throw std::runtime_error("both width and height must be even");
+		if (mem.size() != 1)
+			throw std::runtime_error("incorrect number of planes in YUV420 data");
+		RawWriter writer(filename, (size_t)w * h * 3 / 2, options->Get().write_method);
+		uint8_t *Y = (uint8_t *)mem[0].data();
+		writer.Rows(Y, w, h, stride);
+		uint8_t *U = Y + stride * h;
+		h /= 2, w /= 2, stride /= 2;
+		writer.Rows(U, w, h, stride);
+		uint8_t *V = U + stride * h;
+		writer.Rows(V, w, h, stride);
+		writer.Finish();
+	}
 	else
 		throw std::runtime_error("output format " + options->Get().encoding + " not supported");
 }
@@ -66,47 +306,18 @@ static void yuyv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamIn
 		if ((info.width & 1) || (info.height & 1))
 			throw std::runtime_error("both width and height must be even");
 
-		FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "w");
-		if (!fp)
-			throw std::runtime_error("failed to open file " + filename);
-		try
-		{
-			// We could doubtless do this much quicker. Though starting with
-			// YUV420 planar buffer would have been nice.
-			std::vector<uint8_t> row(info.width);
-			uint8_t *ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j++, ptr += info.stride)
-			{
-				for (unsigned int i = 0; i < info.width; i++)
-					row[i] = ptr[i << 1];
-				if (fwrite(&row[0], info.width, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j += 2, ptr += 2 * info.stride)
-			{
-				for (unsigned int i = 0; i < info.width / 2; i++)
-					row[i] = ptr[(i << 2) + 1];
-				if (fwrite(&row[0], info.width / 2, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			ptr = (uint8_t *)mem[0].data();
-			for (unsigned int j = 0; j < info.height; j += 2, ptr += 2 * info.stride)
-			{
-				for (unsigned int i = 0; i < info.width / 2; i++)
-					row[i] = ptr[(i << 2) + 3];
-				if (fwrite(&row[0], info.width / 2, 1, fp) != 1)
-					throw std::runtime_error("failed to write file " + filename);
-			}
-			if (fp != stdout)
-				fclose(fp);
-		}
-		catch (std::exception const &e)
-		{
-			if (fp != stdout)
-				fclose(fp);
-			throw;
-		}
+		unsigned int w = info.width, h = info.height;
+		size_t chroma_size = (size_t)(w / 2) * (h / 2);
+		RawWriter writer(filename, (size_t)w * h + 2 * chroma_size, options->Get().write_method);
+		uint8_t const *ptr = (uint8_t *)mem[0].data();
+		for (unsigned int j = 0; j < h; j++, ptr += info.stride)
+			yuyv_luma_row(ptr, writer.Next(w), w);
+		// Both chroma planes come from the same reads of the buffer.
+		uint8_t *U = writer.Next(2 * chroma_size), *V = U + chroma_size;
+		ptr = (uint8_t *)mem[0].data();
+		for (unsigned int j = 0; j < h; j += 2, ptr += 2 * info.stride, U += w / 2, V += w / 2)
+			yuyv_chroma_row(ptr, U, V, w);
+		writer.Finish();
 	}
 	else
 		throw std::runtime_error("output format " + options->Get().encoding + " not supported");
@@ -117,29 +328,12 @@ static void rgb_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInf
 {
 	if (options->Get().encoding != "rgb24" && options->Get().encoding != "rgb48")
 		throw std::runtime_error("encoding should be set to rgb");
-	FILE *fp = filename == "-" ? stdout : fopen(filename.c_str(), "w");
-	if (!fp)
-		throw std::runtime_error("failed to open file " + filename);
-	try
-	{
-		uint8_t *ptr = (uint8_t *)mem[0].data();
-		unsigned int wr_stride = 3 * info.width;
-		if (options->Get().encoding == "rgb48")
-			wr_stride *= 2;
-		for (unsigned int j = 0; j < info.height; j++, ptr += info.stride)
-		{
-			if (fwrite(ptr, wr_stride, 1, fp) != 1)
-				throw std::runtime_error("failed to write file " + filename);
-		}
-		if (fp != stdout)
-			fclose(fp);
-	}
-	catch (std::exception const &e)
-	{
-		if (fp != stdout)
-			fclose(fp);
-		throw;
-	}
+	unsigned int wr_stride = 3 * info.width;
+	if (options->Get().encoding == "rgb48")
+		wr_stride *= 2;
+	RawWriter writer(filename, (size_t)wr_stride * info.height, options->Get().write_method);
+	writer.Rows((uint8_t *)mem[0].data(), wr_stride, info.height, info.stride);
+	writer.Finish();
 }
 
 void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * binary_metadata.cpp - Write per-frame metadata in a compact binary form.
+ */
+
+#include <algorithm>
+#include <cstring>
+
+#include "binary_metadata.hpp"
+
+static_assert(sizeof(BinaryMetadataWriter::ChunkHeader) == 16, "ChunkHeader must be 16 bytes");
+static_assert(sizeof(BinaryMetadataWriter::NameEntry) == 64, "NameEntry must be 64 bytes");
+static_assert(sizeof(BinaryMetadataWriter::ValueRecord) == 48, "ValueRecord must be 48 bytes");
+static_assert(sizeof(BinaryMetadataWriter::Trailer) == 24, "Trailer must be 24 bytes");
+
+static uint32_t value_type(libcamera::ControlType type)
+{
+	switch (type)
+	{
+	case libcamera::ControlTypeBool:
+		return BinaryMetadataWriter::TYPE_BOOL;
+	case libcamera::ControlTypeByte:
+		return BinaryMetadataWriter::TYPE_BYTE;
+	case libcamera::ControlTypeInteger32:
+		return BinaryMetadataWriter::TYPE_INT32;
+	case libcamera::ControlTypeInteger64:
+		return BinaryMetadataWriter::TYPE_INT64;
+	case libcamera::ControlTypeFloat:
+		return BinaryMetadataWriter::TYPE_FLOAT;
+	case libcamera::ControlTypeString:
+		return BinaryMetadataWriter::TYPE_STRING;
+	case libcamera::ControlTypeRectangle:
+		return BinaryMetadataWriter::TYPE_RECTANGLE;
+	case libcamera::ControlTypeSize:
+		return BinaryMetadataWriter::TYPE_SIZE;
+	default:
+		return BinaryMetadataWriter::TYPE_OTHER;
+	}
+}
+
+BinaryMetadataWriter::BinaryMetadataWriter(std::streambuf *buf) : buf_(buf), offset_(0)
+{
+	FileHeader header = { { 'R', 'P', 'I', 'M', 'E', 'T', 'A', '1' }, 1, sizeof(ValueRecord) };
+	put(&header, sizeof(header));
+}
+
+BinaryMetadataWriter::~BinaryMetadataWriter()
+{
+	Trailer trailer = { offset_, index_.size(), { 'R', 'P', 'I', 'M', 'I', 'D', 'X', '1' } };
+	ChunkHeader chunk = { CHUNK_INDEX, (uint32_t)index_.size(), 0 };
+	put(&chunk, sizeof(chunk));
+	put(index_.data(), index_.size() * sizeof(IndexEntry));
+	put(&trailer, sizeof(trailer));
+	buf_->pubsync();
+}
+
+void BinaryMetadataWriter::put(void const *data, size_t size)
+{
+	buf_->sputn(static_cast<char const *>(data), size);
+	offset_ += size;
+}
+
+void BinaryMetadataWriter::Write(libcamera::ControlList const &metadata, int64_t timestamp_us)
+{
+	// Names go out the first time we see each control, ahead of the frame that uses them.
+	const libcamera::ControlIdMap *id_map = metadata.idMap();
+	names_.clear();
+	for (auto const &[id, val] : metadata)
+	{
+		if (!named_.insert(id).second)
+			continue;
+		NameEntry &entry = names_.emplace_back();
+		entry = {};
+		entry.id = id;
+		entry.type = value_type(val.type());
+		strncpy(entry.name, id_map->at(id)->name().c_str(), sizeof(entry.name) - 1);
+	}
+	if (!names_.empty())
+	{
+		ChunkHeader chunk = { CHUNK_NAMES, (uint32_t)names_.size(), timestamp_us };
+		put(&chunk, sizeof(chunk));
+		put(names_.data(), names_.size() * sizeof(NameEntry));
+	}
+
+	// The values are copied as they are, with no formatting at all.
+	records_.clear();
+	for (auto const &[id, val] : metadata)
+	{
+		libcamera::Span<const uint8_t> data = val.data();
+		size_t size = data.size();
+		size_t first = std::min(size, sizeof(ValueRecord::data));
+		size_t extra = std::min<size_t>((size - first + sizeof(ValueRecord) - 1) / sizeof(ValueRecord), UINT16_MAX);
+		size = std::min(size, first + extra * sizeof(ValueRecord)); // nothing is ever this big, but just in case
+
+		ValueRecord record = {};
+		record.id = id;
+		record.type = value_type(val.type());
+		record.extra = extra;
+		record.size = size;
+		memcpy(record.data, data.data(), first);
+		records_.push_back(record);
+		for (size_t done = first; done < size; done += sizeof(ValueRecord))
+		{
+			ValueRecord &more = records_.emplace_back();
+			more = {};
+			memcpy(&more, data.data() + done, std::min(sizeof(ValueRecord), size - done));
+		}
+	}
+
+	index_.push_back({ timestamp_us, offset_ });
+	ChunkHeader chunk = { CHUNK_FRAME, (uint32_t)records_.size(), timestamp_us };
+	put(&chunk, sizeof(chunk));
+	put(records_.data(), records_.size() * sizeof(ValueRecord));
+}
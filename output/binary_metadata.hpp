@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * binary_metadata.hpp - Write per-frame metadata in a compact binary form.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <streambuf>
+#include <unordered_set>
+#include <vector>
+
+#include <libcamera/controls.h>
+
+// The file starts with a FileHeader, and is then a sequence of chunks, each a ChunkHeader
+// followed by count fixed-size entries. A names chunk gives the name and type of each control ID
+// the first time it appears. A frame chunk holds one ValueRecord for each control in a frame; a
+// value that doesn't fit in the record carries on over the next "extra" records. At the end, an
+// index chunk lists the timestamp and file offset of every frame chunk, and the Trailer says
+// where the index is, so that a reader can go straight to any frame. Everything is little-endian.
+// utils/metadata_to_json.py reads it back.
+class BinaryMetadataWriter
+{
+public:
+	struct FileHeader
+	{
+		char magic[8]; // "RPIMETA1"
+		uint32_t version;
+		uint32_t record_size;
+	};
+
+	enum ChunkType : uint32_t
+	{
+		CHUNK_NAMES = 1,
+		CHUNK_FRAME = 2,
+		CHUNK_INDEX = 3,
+	};
+
+	struct ChunkHeader
+	{
+		uint32_t type;
+		uint32_t count;
+		int64_t timestamp_us;
+	};
+
+	// The value types are our own, as libcamera's numbering has changed between versions.
+	enum ValueType : uint32_t
+	{
+		TYPE_OTHER = 0,
+		TYPE_BOOL = 1,
+		TYPE_BYTE = 2,
+		TYPE_INT32 = 3,
+		TYPE_INT64 = 4,
+		TYPE_FLOAT = 5,
+		TYPE_STRING = 6,
+		TYPE_RECTANGLE = 7, // int32 x, y, uint32 width, height
+		TYPE_SIZE = 8, // uint32 width, height
+	};
+
+	struct NameEntry
+	{
+		uint32_t id;
+		uint32_t type;
+		char name[56];
+	};
+
+	struct ValueRecord
+	{
+		uint32_t id;
+		uint16_t type;
+		uint16_t extra;
+		uint32_t size;
+		uint8_t data[36];
+	};
+
+	struct IndexEntry
+	{
+		int64_t timestamp_us;
+		uint64_t offset;
+	};
+
+	struct Trailer
+	{
+		uint64_t index_offset;
+		uint64_t count;
+		char magic[8]; // "RPIMIDX1"
+	};
+
+	BinaryMetadataWriter(std::streambuf *buf);
+	// Writes the index, which until now has been kept in memory.
+	~BinaryMetadataWriter();
+
+	void Write(libcamera::ControlList const &metadata, int64_t timestamp_us);
+
+private:
+	void put(void const *data, size_t size);
+
+	std::streambuf *buf_;
+	uint64_t offset_;
+	std::unordered_set<unsigned int> named_;
+	std::vector<NameEntry> names_;
+	std::vector<ValueRecord> records_;
+	std::vector<IndexEntry> index_;
+};
@@ -5,21 +5,78 @@
  * circular_output.cpp - Write output to circular buffer which we save on exit.
  */
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #include "circular_output.hpp"
 
 // We're going to align the frames within the buffer to friendly byte boundaries
 static constexpr int ALIGN = 16; // power of 2, please
 
-struct Header
+CircularBuffer::CircularBuffer(size_t size, std::string const &filename)
+	: size_((size + WRITEBACK_CHUNK - 1) / WRITEBACK_CHUNK * WRITEBACK_CHUNK), buf_(nullptr), rptr_(0), wptr_(0)
 {
-	unsigned int length;
-	bool keyframe;
-	int64_t timestamp;
-};
-static_assert(sizeof(Header) % ALIGN == 0, "Header should have aligned size");
-
-// Size of buffer (options->Get().circular) is given in megabytes.
-CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), cb_(options->Get().circular << 20)
+	fd_ = open(filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd_ < 0)
+		throw std::runtime_error("could not open circular buffer file " + filename);
+
+	// Allocate all the space up front so that we can't run out of it halfway through recording.
+	int ret = posix_fallocate(fd_, 0, size_);
+	if (ret == EOPNOTSUPP || ret == EINVAL)
+		ret = ftruncate(fd_, size_) < 0 ? errno : 0;
+	if (ret == 0)
+	{
+		void *mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+		if (mem != MAP_FAILED)
+			buf_ = static_cast<uint8_t *>(mem);
+	}
+	if (!buf_)
+	{
+		close(fd_);
+		throw std::runtime_error("could not allocate " + std::to_string(size_ >> 20) + "MB circular buffer in " +
+								 filename);
+	}
+	madvise(buf_, size_, MADV_SEQUENTIAL);
+	LOG(2, "Circular buffer of " << (size_ >> 20) << "MB in " << filename);
+}
+
+CircularBuffer::~CircularBuffer()
+{
+	if (fd_ >= 0)
+	{
+		munmap(buf_, size_);
+		close(fd_);
+	}
+}
+
+void CircularBuffer::writeback(size_t chunk)
+{
+	// Writing has just moved into this chunk. Start the one before it on its way to storage, and
+	// drop the one before that from the page cache, which by now should already be written out.
+	// We don't wait for it to be, as this is the output thread; any of its pages still dirty just
+	// stay in the cache until next time round. Frames in it are read back from the file if they are
+	// needed again.
+	size_t num_chunks = size_ / WRITEBACK_CHUNK;
+	size_t full = (chunk + num_chunks - 1) % num_chunks;
+	size_t done = (chunk + num_chunks - 2) % num_chunks;
+	sync_file_range(fd_, full * WRITEBACK_CHUNK, WRITEBACK_CHUNK, SYNC_FILE_RANGE_WRITE);
+	if (num_chunks > 2)
+		posix_fadvise(fd_, done * WRITEBACK_CHUNK, WRITEBACK_CHUNK, POSIX_FADV_DONTNEED);
+}
+
+static CircularBuffer *create_buffer(VideoOptions const *options)
+{
+	// Size of buffer (options->Get().circular) is given in megabytes.
+	size_t size = options->Get().circular << 20;
+	if (options->Get().circular_file.empty())
+		return new CircularBuffer(size);
+	return new CircularBuffer(size, options->Get().circular_file);
+}
+
+CircularOutput::CircularOutput(VideoOptions const *options)
+	: Output(options), cb_(create_buffer(options)), write_pos_(0), first_frame_(0), fp_(nullptr),
+	  clip_requested_(false), clip_active_(false), clip_end_us_(0), clip_count_(0), abort_clips_(false)
 {
 	// Open this now, so that we can get any complaints out of the way
 	if (options_->Get().output == "-")
@@ -28,71 +85,251 @@ CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), c
 	{
 		fp_ = fopen(options_->Get().output.c_str(), "w");
 	}
-	if (!fp_)
+	// When saving clips, there needn't be a file for the buffer to go to at the end.
+	if (!fp_ && (options_->Get().clip_output.empty() || !options_->Get().output.empty()))
 		throw std::runtime_error("could not open output file");
+
+	if (!options_->Get().clip_output.empty())
+		clip_thread_ = std::thread(&CircularOutput::clipThread, this);
 }
 
 CircularOutput::~CircularOutput()
 {
+	if (clip_thread_.joinable())
+	{
+		// Finish any clip that is still going with what we have.
+		if (clip_active_)
+			queueChunk({ clip_count_, 0, 0, {}, true });
+		{
+			std::lock_guard<std::mutex> lock(clip_mutex_);
+			abort_clips_ = true;
+		}
+		clip_cv_.notify_one();
+		clip_thread_.join();
+	}
+
+	if (!fp_)
+		return;
+
 	// We do have to skip to the first I frame before dumping stuff to disk. If there are
 	// no I frames you will get nothing. Caveat emptor, methinks.
 	unsigned int total = 0, frames = 0;
-	bool seen_keyframe = false;
-	Header header;
 	FILE *fp = fp_; // can't capture a class member in a lambda
-	while (!cb_.Empty())
+	uint64_t first = keyframes_.empty() ? first_frame_ + frames_.size() : keyframes_.front();
+	for (uint64_t i = first - first_frame_; i < frames_.size(); i++)
 	{
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		seen_keyframe |= header.keyframe;
-		if (seen_keyframe)
-		{
-			cb_.Read([fp](void *src, int n) { fwrite(src, 1, n, fp); }, header.length);
-			cb_.Skip((ALIGN - header.length) & (ALIGN - 1));
-			total += header.length;
-			if (fp_timestamps_)
-			{
-				Output::timestampReady(header.timestamp);
-			}
-			frames++;
-		}
-		else
-			cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		Frame const &frame = frames_[i];
+		cb_->Peek([fp](void *src, int n) { fwrite(src, 1, n, fp); }, frame.pos, frame.length);
+		total += frame.length;
+		if (timestamps_)
+			Output::timestampReady(frame.times);
+		frames++;
 	}
 	fclose(fp_);
 	LOG(1, "Wrote " << total << " bytes (" << frames << " frames)");
 }
 
+void CircularOutput::Signal()
+{
+	if (!options_->Get().clip_output.empty())
+		Trigger();
+	else
+		Output::Signal();
+}
+
+void CircularOutput::Trigger()
+{
+	if (!options_->Get().clip_output.empty())
+		clip_requested_ = true;
+}
+
 void CircularOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
 	// First make sure there's enough space.
 	int pad = (ALIGN - size) & (ALIGN - 1);
-	while (size + pad + sizeof(Header) > cb_.Available())
+	while (size + pad > cb_->Available())
 	{
-		if (cb_.Empty())
+		if (frames_.empty())
 			throw std::runtime_error("circular buffer too small");
-		Header header;
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		cb_->Skip((frames_.front().length + ALIGN - 1) & ~(ALIGN - 1));
+		if (!keyframes_.empty() && keyframes_.front() == first_frame_)
+			keyframes_.pop_front();
+		frames_.pop_front();
+		first_frame_++;
+	}
+	Frame frame = { write_pos_, static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), timestamp_us, {} };
+	if (frame.keyframe)
+		keyframes_.push_back(first_frame_ + frames_.size());
+	frames_.push_back(frame);
+	protectClips(write_pos_ + size + pad);
+	cb_->Write(mem, size);
+	cb_->Pad(pad);
+	write_pos_ += size + pad;
+
+	if (clip_active_)
+	{
+		// Triggering again while a clip is being saved just makes it longer.
+		if (clip_requested_.exchange(false))
+			clip_end_us_ = timestamp_us + options_->Get().clip_post.get<std::chrono::microseconds>();
+		bool last = timestamp_us >= clip_end_us_;
+		queueChunk({ clip_count_, frame.pos, frame.length, {}, last });
+		clip_active_ = !last;
+	}
+	else if (clip_requested_ && startClip(timestamp_us))
+	{
+		clip_requested_ = false;
+		clip_end_us_ = timestamp_us + options_->Get().clip_post.get<std::chrono::microseconds>();
 	}
-	Header header = { static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), timestamp_us };
-	cb_.Write(&header, sizeof(header));
-	cb_.Write(mem, size);
-	cb_.Pad(pad);
 }
 
-void CircularOutput::timestampReady(int64_t timestamp)
+void CircularOutput::timestampReady(TimestampWriter::Record const &record)
 {
 	// Don't want to save every timestamp as we go along, only outputs them at the end
+	if (!frames_.empty())
+		frames_.back().times = record;
+}
+
+void CircularOutput::protectClips(uint64_t write_end)
+{
+	// Writing up to write_end overwrites everything in cb_ from a whole buffer before it. Any of that
+	// the clip thread hasn't written out yet gets copied out of the way first, which only happens when
+	// saving a clip falls a whole buffer behind.
+	uint64_t size = cb_->Size();
+	if (!clip_thread_.joinable() || write_end <= size)
+		return;
+	uint64_t limit = write_end - size;
+
+	std::unique_lock<std::mutex> lock(clip_mutex_);
+	// The clip thread may be writing out a piece of the oldest chunk, which it has to finish first.
+	clip_cv_.wait(lock, [this, limit] { return !clip_reading_ || clip_queue_.front().pos >= limit; });
+	for (ClipChunk &chunk : clip_queue_)
+	{
+		if (!chunk.length || chunk.pos >= limit)
+			continue;
+		chunk.data.reserve(chunk.length);
+		auto copy = [&chunk](void *src, int n) {
+			chunk.data.insert(chunk.data.end(), (uint8_t *)src, (uint8_t *)src + n);
+		};
+		cb_->Peek(copy, chunk.pos, chunk.length);
+		chunk.length = 0;
+	}
+}
+
+bool CircularOutput::startClip(int64_t timestamp_us)
+{
+	// A clip must begin on a keyframe, so take the last one that gives us all the pre-roll, or
+	// else the oldest we have. Without any, keep trying until one turns up.
+	if (keyframes_.empty())
+		return false;
+
+	int64_t start_us = timestamp_us - options_->Get().clip_pre.get<std::chrono::microseconds>();
+	uint64_t start = keyframes_.front();
+	for (uint64_t keyframe : keyframes_)
+	{
+		if (frames_[keyframe - first_frame_].timestamp > start_us)
+			break;
+		start = keyframe;
+	}
+
+	// The clip thread writes the buffered frames straight out of cb_, rather than have us copy them all now.
+	clip_count_++;
+	{
+		std::lock_guard<std::mutex> lock(clip_mutex_);
+		for (uint64_t i = start - first_frame_; i < frames_.size(); i++)
+			clip_queue_.push_back({ clip_count_, frames_[i].pos, frames_[i].length, {}, false });
+	}
+	clip_cv_.notify_one();
+	LOG(1, "Saving clip " << clip_count_ << " from " << frames_.size() - (start - first_frame_) << " buffered frames");
+	clip_active_ = true;
+	return true;
+}
+
+void CircularOutput::queueChunk(ClipChunk &&chunk)
+{
+	{
+		std::lock_guard<std::mutex> lock(clip_mutex_);
+		clip_queue_.push_back(std::move(chunk));
+	}
+	clip_cv_.notify_one();
+}
+
+void CircularOutput::clipThread()
+{
+	// Frames are written out of cb_ in pieces no bigger than this, so that the output thread never
+	// waits long for one of them to finish.
+	static constexpr size_t PIECE = 1 << 20;
+
+	FILE *fp = nullptr;
+	unsigned int failed_clip = 0;
+	std::unique_lock<std::mutex> lock(clip_mutex_);
+	while (true)
+	{
+		clip_cv_.wait(lock, [this] { return abort_clips_ || !clip_queue_.empty(); });
+		if (clip_queue_.empty())
+			break;
+		// Only we take chunks off the queue, so this stays put while the lock is dropped.
+		ClipChunk &chunk = clip_queue_.front();
+		unsigned int clip = chunk.clip;
+
+		if (!fp && clip != failed_clip)
+		{
+			lock.unlock();
+			char filename[256];
+			snprintf(filename, sizeof(filename), options_->Get().clip_output.c_str(), clip);
+			filename[sizeof(filename) - 1] = 0;
+			fp = fopen(filename, "w");
+			if (!fp)
+			{
+				LOG_ERROR("WARNING: failed to open clip file " << filename);
+				failed_clip = clip;
+			}
+			else
+				LOG(2, "Writing clip to " << filename);
+			lock.lock();
+		}
+
+		bool ok = true;
+		if (!chunk.data.empty())
+		{
+			// The output thread had to copy it out of cb_.
+			std::vector<uint8_t> data = std::move(chunk.data);
+			chunk.data.clear();
+			lock.unlock();
+			if (fp)
+				ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+			lock.lock();
+		}
+		if (chunk.length)
+		{
+			unsigned int n = std::min(chunk.length, (size_t)PIECE);
+			uint64_t pos = chunk.pos;
+			clip_reading_ = true;
+			lock.unlock();
+			if (fp)
+				cb_->Peek([fp, &ok](void *src, int len) { ok &= fwrite(src, 1, len, fp) == (size_t)len; }, pos, n);
+			lock.lock();
+			clip_reading_ = false;
+			chunk.pos += n;
+			chunk.length -= n;
+			clip_cv_.notify_all();
+		}
+		if (!ok)
+			LOG_ERROR("WARNING: failed to write clip " << clip);
+		if (chunk.length || !chunk.data.empty())
+			continue;
+
+		bool last = chunk.last;
+		clip_queue_.pop_front();
+		if (last && fp)
+		{
+			lock.unlock();
+			fclose(fp);
+			fp = nullptr;
+			LOG(1, "Finished clip " << clip);
+			lock.lock();
+		}
+	}
+	lock.unlock();
+	if (fp)
+		fclose(fp);
 }
@@ -7,6 +7,16 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "core/memory_report.hpp"
+
 #include "output.hpp"
 
 // A simple circular buffer implementation used by the CircularOutput class.
@@ -14,7 +24,16 @@
 class CircularBuffer
 {
 public:
-	CircularBuffer(size_t size) : size_(size), buf_(size), rptr_(0), wptr_(0) {}
+	CircularBuffer(size_t size)
+		: size_(size), heap_(size), buf_(heap_.data()), rptr_(0), wptr_(0), fd_(-1),
+		  memory_use_("circular buffer", MemoryReport::Kind::Heap, size)
+	{
+	}
+	// Keep the buffer in a file instead, for pre-roll windows too big for memory. The size gets
+	// rounded up to a whole number of writeback chunks.
+	CircularBuffer(size_t size, std::string const &filename);
+	~CircularBuffer();
+	size_t Size() const { return size_; }
 	bool Empty() const { return rptr_ == wptr_; }
 	size_t Available() const { return wptr_ == rptr_ ? size_ - 1 : (size_ - wptr_ + rptr_) % size_ - 1; }
 	void Skip(unsigned int n) { rptr_ = (rptr_ + n) % size_; }
@@ -30,7 +49,23 @@ public:
 		dst(&buf_[rptr_], n);
 		rptr_ += n;
 	}
-	void Pad(unsigned int n) { wptr_ = (wptr_ + n) % size_; }
+	// Like Read, but from any position in the stream written so far, and leaving it in place.
+	void Peek(std::function<void(void *src, unsigned int n)> dst, uint64_t pos, unsigned int n)
+	{
+		size_t ptr = pos % size_;
+		if (ptr + n >= size_)
+		{
+			dst(&buf_[ptr], size_ - ptr);
+			n -= size_ - ptr;
+			ptr = 0;
+		}
+		dst(&buf_[ptr], n);
+	}
+	void Pad(unsigned int n)
+	{
+		written(wptr_, wptr_ + n);
+		wptr_ = (wptr_ + n) % size_;
+	}
 	void Write(const void *ptr, unsigned int n)
 	{
 		if (wptr_ + n >= size_)
@@ -38,31 +73,93 @@ public:
 			memcpy(&buf_[wptr_], ptr, size_ - wptr_);
 			n -= size_ - wptr_;
 			ptr = static_cast<const uint8_t *>(ptr) + size_ - wptr_;
+			written(wptr_, size_);
 			wptr_ = 0;
 		}
 		memcpy(&buf_[wptr_], ptr, n);
+		written(wptr_, wptr_ + n);
 		wptr_ += n;
 	}
 
 private:
+	void written(size_t from, size_t to)
+	{
+		if (fd_ >= 0 && from / WRITEBACK_CHUNK != to / WRITEBACK_CHUNK)
+			writeback(to / WRITEBACK_CHUNK);
+	}
+	void writeback(size_t chunk);
+
+	// File-backed buffers are flushed and dropped from the page cache in chunks of this size.
+	static constexpr size_t WRITEBACK_CHUNK = 4 << 20;
+
 	const size_t size_;
-	std::vector<uint8_t> buf_;
+	std::vector<uint8_t> heap_;
+	uint8_t *buf_;
 	size_t rptr_, wptr_;
+	int fd_;
+	// Only a buffer in memory is counted; a file-backed one lives in the page cache.
+	MemoryUse memory_use_;
 };
 
-// Write frames to a circular buffer, and dump them to disk when we quit.
+// Write frames to a circular buffer, and dump them to disk when we quit. With --clip-output, a
+// trigger also saves the frames around it to a new file, while recording carries on.
 
 class CircularOutput : public Output
 {
 public:
 	CircularOutput(VideoOptions const *options);
 	~CircularOutput();
+	// In clip mode, ENTER or a signal saves a clip rather than pausing.
+	void Signal() override;
+	void Trigger() override;
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
-	void timestampReady(int64_t timestamp) override;
+	void timestampReady(TimestampWriter::Record const &record) override;
 
 private:
-	CircularBuffer cb_;
+	// Where each frame in cb_ is, oldest first. Positions count every byte ever written to cb_.
+	struct Frame
+	{
+		uint64_t pos;
+		unsigned int length;
+		bool keyframe;
+		int64_t timestamp;
+		TimestampWriter::Record times; // saved for the timestamp file at the end
+	};
+	// A frame (or what's left of it) still in cb_ at pos, unless it had to be copied out into data.
+	struct ClipChunk
+	{
+		unsigned int clip;
+		uint64_t pos;
+		size_t length;
+		std::vector<uint8_t> data;
+		bool last;
+	};
+
+	void protectClips(uint64_t write_end);
+	bool startClip(int64_t timestamp_us);
+	void queueChunk(ClipChunk &&chunk);
+	void clipThread();
+
+	std::unique_ptr<CircularBuffer> cb_;
+	uint64_t write_pos_;
+	std::deque<Frame> frames_;
+	uint64_t first_frame_; // the number of frames_.front()
+	std::deque<uint64_t> keyframes_; // numbers of the keyframes in frames_
 	FILE *fp_;
+
+	// A trigger may come from any thread, and is picked up with the next frame.
+	std::atomic<bool> clip_requested_;
+	bool clip_active_;
+	int64_t clip_end_us_;
+	unsigned int clip_count_;
+	// The writes to disk happen on their own thread, so that they never hold up the encoder.
+	std::deque<ClipChunk> clip_queue_;
+	std::mutex clip_mutex_;
+	std::condition_variable clip_cv_;
+	// Set while the clip thread writes a piece of the front chunk straight from cb_.
+	bool clip_reading_ = false;
+	bool abort_clips_;
+	std::thread clip_thread_;
 };
@@ -5,16 +5,60 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "core/thread_config.hpp"
+
 #include "file_output.hpp"
 
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), fd_(-1), count_(0), file_start_time_ms_(0), staging_(nullptr), staged_(0), write_fd_(-1),
+	  direct_(false), written_(0), preallocated_(false), queued_bytes_(0),
+	  max_queued_(options->Get().write_buffer << 20), waiting_keyframe_(false), abort_writer_(false), stall_time_(0)
 {
+	// O_DIRECT needs the memory it writes from to be aligned too.
+	if (posix_memalign((void **)&staging_, DIRECT_ALIGN, STAGING_SIZE))
+		throw std::runtime_error("failed to allocate file output buffer");
+
+	if (max_queued_)
+		writer_thread_ = std::thread(&FileOutput::writerThread, this);
 }
 
 FileOutput::~FileOutput()
 {
-	closeFile();
+	// Nothing may be thrown from here, so a failed write only gets reported.
+	try
+	{
+		closeFile();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: FileOutput: failed to finish output file: " << e.what());
+	}
+
+	if (writer_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(write_mutex_);
+			abort_writer_ = true;
+		}
+		write_cv_.notify_one();
+		writer_thread_.join();
+		if (!write_error_.empty())
+			LOG_ERROR("ERROR: FileOutput: " << write_error_);
+
+		unsigned int level = stats_.blocked || stats_.dropped ? 1 : 2;
+		LOG(level, "FileOutput: stalled " << stats_.blocked << " times for "
+										  << std::chrono::duration_cast<std::chrono::milliseconds>(stall_time_).count()
+										  << "ms, dropped " << stats_.dropped << " frames, deepest queue "
+										  << stats_.max_depth << " buffers");
+	}
+	free(staging_);
 }
 
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
@@ -22,7 +66,7 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	if (fd_ < 0 ||
 		(options_->Get().segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->Get().segment) ||
 		(options_->Get().split && (flags & FLAG_RESTART)))
@@ -32,19 +76,14 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 	}
 
 	LOG(2, "FileOutput: output buffer " << mem << " size " << size);
-	if (fp_ && size)
-	{
-		if (fwrite(mem, size, 1, fp_) != 1)
-			throw std::runtime_error("failed to write output bytes");
-		if (options_->Get().flush)
-			fflush(fp_);
-	}
+	if (fd_ >= 0 && size)
+		queueWrite(mem, size, flags & FLAG_KEYFRAME, false);
 }
 
 void FileOutput::openFile(int64_t timestamp_us)
 {
 	if (options_->Get().output == "-")
-		fp_ = stdout;
+		fd_ = STDOUT_FILENO;
 	else if (!options_->Get().output.empty())
 	{
 		// Generate the next output file name.
@@ -56,8 +95,17 @@ void FileOutput::openFile(int64_t timestamp_us)
 		if (n < 0)
 			throw std::runtime_error("failed to generate filename");
 
-		fp_ = fopen(filename, "w");
-		if (!fp_)
+		int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+		fd_ = -1;
+		if (options_->Get().direct_io)
+		{
+			fd_ = open(filename, flags | O_DIRECT, 0644);
+			if (fd_ < 0 && errno == EINVAL)
+				LOG_ERROR("WARNING: " << filename << " does not support direct I/O");
+		}
+		if (fd_ < 0)
+			fd_ = open(filename, flags, 0644);
+		if (fd_ < 0)
 			throw std::runtime_error("failed to open output file " + std::string(filename));
 		LOG(2, "FileOutput: opened output file " << filename);
 
@@ -67,12 +115,208 @@ void FileOutput::openFile(int64_t timestamp_us)
 
 void FileOutput::closeFile()
 {
-	if (fp_)
+	if (fd_ >= 0)
+	{
+		queueWrite(nullptr, 0, false, true);
+		fd_ = -1;
+	}
+}
+
+void FileOutput::queueWrite(void *mem, size_t size, bool keyframe, bool last)
+{
+	if (!writer_thread_.joinable())
 	{
-		if (options_->Get().flush)
-			fflush(fp_);
-		if (fp_ != stdout)
-			fclose(fp_);
-		fp_ = nullptr;
+		writeData(fd_, static_cast<uint8_t const *>(mem), size);
+		if (last)
+			finishFile();
+		else if (options_->Get().flush || fd_ == STDOUT_FILENO)
+			flushStaging(false);
+		return;
+	}
+
+	// The error is thrown to whoever writes next, but a file is always closed, even after a failure.
+	std::unique_lock<std::mutex> lock(write_mutex_);
+	if (!write_error_.empty() && !last)
+		throw std::runtime_error(write_error_);
+
+	// Closing a file always gets queued. Otherwise, if the buffer is full, we either wait for
+	// space or drop frames until the next keyframe, so that what reaches the file still decodes.
+	if (!last)
+	{
+		if (waiting_keyframe_ && !keyframe)
+		{
+			stats_.dropped++;
+			return;
+		}
+		waiting_keyframe_ = false;
+
+		auto no_space = [this, size]() { return queued_bytes_ + size > max_queued_ && !write_queue_.empty(); };
+		if (no_space())
+		{
+			if (options_->Get().queue_policy != QueuePolicy::Block)
+			{
+				LOG(2, "FileOutput: write buffer full, dropping frames until the next keyframe");
+				waiting_keyframe_ = true;
+				stats_.dropped++;
+				return;
+			}
+			stats_.blocked++;
+			auto start = std::chrono::steady_clock::now();
+			space_cv_.wait(lock, [&]() { return !no_space() || !write_error_.empty(); });
+			stall_time_ +=
+				std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+			if (!write_error_.empty())
+				throw std::runtime_error(write_error_);
+		}
+	}
+
+	WriteItem item = { fd_, {}, last };
+	if (!free_buffers_.empty())
+	{
+		item.data = std::move(free_buffers_.back());
+		free_buffers_.pop_back();
+	}
+	item.data.assign(static_cast<uint8_t const *>(mem), static_cast<uint8_t const *>(mem) + size);
+	queued_bytes_ += size;
+	write_queue_.push_back(std::move(item));
+	stats_.Depth(write_queue_.size());
+	lock.unlock();
+	write_cv_.notify_one();
+}
+
+void FileOutput::writerThread()
+{
+	ThreadConfig::Get().Apply("file-writer");
+	bool failed = false;
+
+	while (true)
+	{
+		// Normally we only write once a whole staging buffer is full, but anything reading
+		// from stdout or asking for --flush wants to see data as soon as it's here.
+		bool eager = write_fd_ == STDOUT_FILENO || options_->Get().flush;
+		std::unique_lock<std::mutex> lock(write_mutex_);
+		if (write_queue_.empty() && eager && !failed && staged_ >= (direct_ ? DIRECT_ALIGN : 1))
+		{
+			lock.unlock();
+			try
+			{
+				flushStaging(false);
+			}
+			catch (std::exception const &e)
+			{
+				failed = true;
+				std::lock_guard<std::mutex> error_lock(write_mutex_);
+				write_error_ = e.what();
+			}
+			continue;
+		}
+
+		write_cv_.wait(lock, [this]() { return abort_writer_ || !write_queue_.empty(); });
+		if (write_queue_.empty())
+			break;
+		WriteItem item = std::move(write_queue_.front());
+		write_queue_.pop_front();
+		lock.unlock();
+
+		// After a failure, the data gets thrown away but each file still gets closed. The error
+		// comes out on the next frame.
+		try
+		{
+			if (!failed)
+			{
+				writeData(item.fd, item.data.data(), item.data.size());
+				if (item.last)
+					finishFile();
+			}
+			else if (item.last && item.fd != STDOUT_FILENO)
+				close(item.fd);
+		}
+		catch (std::exception const &e)
+		{
+			failed = true;
+			staged_ = 0;
+			if (item.last && item.fd != STDOUT_FILENO)
+				close(item.fd);
+			lock.lock();
+			write_error_ = e.what();
+			lock.unlock();
+		}
+
+		lock.lock();
+		queued_bytes_ -= item.data.size();
+		free_buffers_.push_back(std::move(item.data));
+		lock.unlock();
+		space_cv_.notify_one();
+	}
+}
+
+void FileOutput::writeData(int fd, uint8_t const *mem, size_t size)
+{
+	if (fd != write_fd_)
+	{
+		// Starting on a new file.
+		write_fd_ = fd;
+		written_ = 0;
+		direct_ = fcntl(fd, F_GETFL) & O_DIRECT;
+		preallocated_ = false;
+		// Reserve space for a whole segment, so that the blocks are allocated in one go rather
+		// than while we are writing. Leave some headroom over the nominal bitrate.
+		if (options_->Get().segment && options_->Get().bitrate && fd != STDOUT_FILENO)
+		{
+			off_t length = options_->Get().bitrate.bps() / 8 * options_->Get().segment / 1000 * 5 / 4;
+			preallocated_ = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length) == 0;
+		}
+	}
+
+	while (size)
+	{
+		size_t n = std::min(size, STAGING_SIZE - staged_);
+		memcpy(staging_ + staged_, mem, n);
+		staged_ += n;
+		mem += n;
+		size -= n;
+		if (staged_ == STAGING_SIZE)
+			flushStaging(false);
+	}
+}
+
+void FileOutput::finishFile()
+{
+	if (write_fd_ < 0)
+		return;
+
+	flushStaging(true);
+	// Give back whatever we reserved but didn't use.
+	if (preallocated_ && ftruncate(write_fd_, written_) < 0)
+		LOG_ERROR("WARNING: failed to trim output file");
+	if (write_fd_ != STDOUT_FILENO)
+		close(write_fd_);
+	write_fd_ = -1;
+}
+
+void FileOutput::flushStaging(bool final)
+{
+	// A direct write has to cover whole blocks, so any leftover waits for more data unless this
+	// is the end of the file, when we write it the ordinary way.
+	size_t n = staged_;
+	if (direct_ && !final)
+		n &= ~(DIRECT_ALIGN - 1);
+	else if (direct_)
+	{
+		fcntl(write_fd_, F_SETFL, fcntl(write_fd_, F_GETFL) & ~O_DIRECT);
+		direct_ = false;
+	}
+
+	for (size_t done = 0; done < n;)
+	{
+		ssize_t ret = write(write_fd_, staging_ + done, n - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			throw std::runtime_error("failed to write output bytes");
+		done += ret;
 	}
+	written_ += n;
+	memmove(staging_, staging_ + n, staged_ - n);
+	staged_ -= n;
 }
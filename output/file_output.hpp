@@ -7,8 +7,21 @@
 
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/queue_stats.hpp"
+
 #include "output.hpp"
 
+// With a --write-buffer, the writes to storage happen on a thread of their own, so that a slow
+// card holds up only that thread until the buffer fills.
+
 class FileOutput : public Output
 {
 public:
@@ -19,9 +32,48 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	// Data for a file, which gets closed afterwards if last is set.
+	struct WriteItem
+	{
+		int fd;
+		std::vector<uint8_t> data;
+		bool last;
+	};
+
 	void openFile(int64_t timestamp_us);
 	void closeFile();
-	FILE *fp_;
+	void queueWrite(void *mem, size_t size, bool keyframe, bool last);
+	void writerThread();
+	void writeData(int fd, uint8_t const *mem, size_t size);
+	void finishFile();
+	void flushStaging(bool final);
+
+	int fd_;
 	unsigned int count_;
 	int64_t file_start_time_ms_;
+
+	// Everything below here belongs to whichever thread does the writing.
+	static constexpr size_t STAGING_SIZE = 1 << 20;
+	static constexpr size_t DIRECT_ALIGN = 4096;
+	uint8_t *staging_;
+	size_t staged_;
+	int write_fd_;
+	bool direct_;
+	uint64_t written_;
+	bool preallocated_;
+
+	// The queue of writes waiting for the writer thread, limited to max_queued_ bytes.
+	std::deque<WriteItem> write_queue_;
+	std::vector<std::vector<uint8_t>> free_buffers_;
+	size_t queued_bytes_;
+	size_t max_queued_;
+	bool waiting_keyframe_;
+	bool abort_writer_;
+	std::string write_error_;
+	std::mutex write_mutex_;
+	std::condition_variable write_cv_;
+	std::condition_variable space_cv_;
+	std::thread writer_thread_;
+	QueueStats stats_;
+	std::chrono::microseconds stall_time_;
 };
@@ -0,0 +1,281 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * http_output.cpp - Serve MJPEG over HTTP as multipart/x-mixed-replace.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include "core/thread_config.hpp"
+
+#include "http_output.hpp"
+
+constexpr unsigned int DEFAULT_HTTP_PORT = 8080;
+#define BOUNDARY "rpicamframe"
+
+HttpOutput::HttpOutput(VideoOptions const *options) : Output(options), abort_(false)
+{
+	if (options->Get().codec != "mjpeg")
+		throw std::runtime_error("http output is only supported for mjpeg");
+
+	// The address is http://[host][:port][/path]. We serve on every interface, and answer
+	// requests for any path.
+	std::string url = options->Get().output.substr(strlen("http://"));
+	std::string authority = url.substr(0, url.find('/'));
+	size_t colon = authority.find(':');
+	unsigned int port = colon == std::string::npos ? DEFAULT_HTTP_PORT : atoi(authority.c_str() + colon + 1);
+	if (!port || port > 65535)
+		throw std::runtime_error("bad http address " + options->Get().output);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open http socket");
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt http socket");
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = INADDR_ANY;
+	saddr.sin_port = htons(port);
+	if (bind(listen_fd_, (struct sockaddr *)&saddr, sizeof(saddr)) < 0 || listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("failed to listen on http port " + std::to_string(port));
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("unable to create http server events");
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+	ev.data.fd = event_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+
+	thread_ = std::thread(&HttpOutput::serverThread, this);
+	LOG(1, "HttpOutput: serving on port " << port);
+}
+
+HttpOutput::~HttpOutput()
+{
+	abort_ = true;
+	wake();
+	thread_.join();
+
+	for (auto const &[fd, client] : clients_)
+		close(fd);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+}
+
+void HttpOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		bool streaming = false;
+		for (auto const &[fd, client] : clients_)
+			streaming |= client.streaming;
+		if (!streaming)
+			return;
+	}
+
+	// Make the whole multipart section once, for everyone.
+	std::string part = "--" BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(size) +
+					   "\r\n\r\n";
+	part.reserve(part.size() + size + 2);
+	part.append(static_cast<char const *>(mem), size);
+	part += "\r\n";
+	Buffer buffer = std::make_shared<std::string const>(std::move(part));
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto &[fd, client] : clients_)
+		{
+			if (!client.streaming)
+				continue;
+			if (client.pending)
+				client.skipped++;
+			client.pending = buffer;
+		}
+	}
+	wake();
+}
+
+void HttpOutput::wake()
+{
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		LOG(2, "HttpOutput: failed to wake server thread");
+}
+
+void HttpOutput::serverThread()
+{
+	ThreadConfig::Get().Apply("server");
+	epoll_event events[16];
+	while (!abort_)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, 200);
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::vector<int> closed;
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptClients();
+			else if (fd == event_fd_)
+			{
+				uint64_t count;
+				if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					LOG_ERROR("WARNING: http server event read failed");
+			}
+			else if (events[i].events & (EPOLLHUP | EPOLLERR))
+				closed.push_back(fd);
+			else if ((events[i].events & (EPOLLIN | EPOLLRDHUP)) && !readClient(fd, clients_[fd]))
+				closed.push_back(fd);
+		}
+		for (int fd : closed)
+			closeClient(fd);
+
+		for (auto it = clients_.begin(); it != clients_.end();)
+		{
+			int fd = (it++)->first;
+			if (!flushClient(fd, clients_[fd]))
+				closeClient(fd);
+		}
+	}
+}
+
+void HttpOutput::acceptClients()
+{
+	while (true)
+	{
+		sockaddr_in peer = {};
+		socklen_t len = sizeof(peer);
+		int fd = accept4(listen_fd_, (struct sockaddr *)&peer, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		int enable = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+		epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.fd = fd;
+		epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+
+		Client &client = clients_[fd];
+		client.peer = peer;
+		client.streaming = false;
+		client.offset = 0;
+		client.want_writable = false;
+		client.frames = 0;
+		client.skipped = 0;
+	}
+}
+
+bool HttpOutput::readClient(int fd, Client &client)
+{
+	char buf[4096];
+	while (true)
+	{
+		ssize_t ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR))
+			return false;
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		// Once streaming, anything more the client sends is of no interest.
+		if (ret > 0 && !client.streaming)
+			client.request.append(buf, ret);
+	}
+
+	if (client.streaming)
+		return true;
+	if (client.request.find("\r\n\r\n") == std::string::npos)
+		return client.request.size() < 16384;
+
+	std::string response;
+	if (client.request.compare(0, 4, "GET ") == 0)
+	{
+		response = "HTTP/1.0 200 OK\r\n"
+				   "Content-Type: multipart/x-mixed-replace; boundary=" BOUNDARY "\r\n"
+				   "Cache-Control: no-cache, no-store\r\n"
+				   "Pragma: no-cache\r\n"
+				   "Connection: close\r\n\r\n";
+		client.streaming = true;
+		LOG(1, "HttpOutput: streaming to " << inet_ntoa(client.peer.sin_addr) << " (" << clients_.size()
+										   << " clients)");
+	}
+	else
+		response = "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\nConnection: close\r\n\r\n";
+	client.sending = std::make_shared<std::string const>(std::move(response));
+	client.offset = 0;
+	client.request.clear();
+	return true;
+}
+
+bool HttpOutput::flushClient(int fd, Client &client)
+{
+	while (true)
+	{
+		if (!client.sending)
+		{
+			if (!client.pending)
+				break;
+			client.sending = std::move(client.pending);
+			client.pending = nullptr;
+			client.offset = 0;
+			client.frames++;
+		}
+		ssize_t ret = send(fd, client.sending->data() + client.offset, client.sending->size() - client.offset,
+						   MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		if (ret < 0)
+			return false;
+		client.offset += ret;
+		if (client.offset == client.sending->size())
+		{
+			client.sending = nullptr;
+			// A refused request is finished once the response has gone.
+			if (!client.streaming)
+				return false;
+		}
+	}
+
+	// Only ask to hear that the socket is writable while we have something to write.
+	bool want_writable = client.sending || client.pending;
+	if (want_writable != client.want_writable)
+	{
+		epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP | (want_writable ? (uint32_t)EPOLLOUT : 0);
+		ev.data.fd = fd;
+		epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+		client.want_writable = want_writable;
+	}
+	return true;
+}
+
+void HttpOutput::closeClient(int fd)
+{
+	auto it = clients_.find(fd);
+	if (it == clients_.end())
+		return;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	if (it->second.streaming)
+		LOG(1, "HttpOutput: " << inet_ntoa(it->second.peer.sin_addr) << " disconnected after " << it->second.frames
+							  << " frames (" << it->second.skipped << " skipped)");
+	clients_.erase(it);
+}
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * http_output.hpp - Serve MJPEG over HTTP as multipart/x-mixed-replace.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "output.hpp"
+
+// An HTTP server for http:// outputs, which browsers can show in an <img> tag. Each JPEG is
+// copied once into a buffer that every client shares. A client that is still sending one frame
+// when the next arrives only ever holds on to the newest one, so slow clients skip frames while
+// the others carry on at the full rate.
+class HttpOutput : public Output
+{
+public:
+	HttpOutput(VideoOptions const *options);
+	~HttpOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	using Buffer = std::shared_ptr<std::string const>;
+
+	struct Client
+	{
+		sockaddr_in peer;
+		std::string request;
+		bool streaming;
+		Buffer sending;
+		size_t offset; // how much of sending has gone already
+		Buffer pending;
+		bool want_writable;
+		uint64_t frames;
+		uint64_t skipped;
+	};
+
+	void serverThread();
+	void acceptClients();
+	bool readClient(int fd, Client &client);
+	bool flushClient(int fd, Client &client);
+	void closeClient(int fd);
+	void wake();
+
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_;
+	std::mutex mutex_;
+	std::map<int, Client> clients_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+};
@@ -0,0 +1,609 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * mp4_output.cpp - Write H.264 as fragmented MP4, optionally with an HLS playlist.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "mp4_output.hpp"
+#include "rtp_packetiser.hpp"
+
+// Media time is in the usual 90kHz units.
+static constexpr uint32_t TIMESCALE = 90000;
+static constexpr uint32_t TRACK_ID = 1;
+
+static int64_t to_timescale(int64_t us)
+{
+	return us * TIMESCALE / 1000000;
+}
+
+// Builds ISO BMFF boxes, big-endian, filling in each box's size when it's finished.
+class BoxWriter
+{
+public:
+	void u8(uint8_t v) { data.push_back(v); }
+	void u16(uint16_t v)
+	{
+		u8(v >> 8);
+		u8(v);
+	}
+	void u32(uint32_t v)
+	{
+		u16(v >> 16);
+		u16(v);
+	}
+	void u64(uint64_t v)
+	{
+		u32(v >> 32);
+		u32(v);
+	}
+	void bytes(void const *p, size_t n) { data.insert(data.end(), (uint8_t const *)p, (uint8_t const *)p + n); }
+	void zeros(size_t n) { data.insert(data.end(), n, 0); }
+	void fourcc(char const *s) { bytes(s, 4); }
+	void matrix()
+	{
+		for (uint32_t v : { 0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000 })
+			u32(v);
+	}
+	void patch32(size_t pos, uint32_t v)
+	{
+		for (int i = 0; i < 4; i++)
+			data[pos + i] = v >> (24 - 8 * i);
+	}
+
+	void begin(char const *type)
+	{
+		starts_.push_back(data.size());
+		u32(0);
+		fourcc(type);
+	}
+	void beginFull(char const *type, uint8_t version, uint32_t flags)
+	{
+		begin(type);
+		u32((version << 24) | flags);
+	}
+	void end()
+	{
+		patch32(starts_.back(), data.size() - starts_.back());
+		starts_.pop_back();
+	}
+
+	std::vector<uint8_t> data;
+
+private:
+	std::vector<size_t> starts_;
+};
+
+// Reads the bits of an SPS, with the emulation prevention bytes already taken out.
+class BitReader
+{
+public:
+	BitReader(std::vector<uint8_t> const &data) : data_(data), pos_(0) {}
+	unsigned int bit()
+	{
+		if (pos_ >= data_.size() * 8)
+			throw std::runtime_error("SPS too short");
+		unsigned int b = (data_[pos_ / 8] >> (7 - pos_ % 8)) & 1;
+		pos_++;
+		return b;
+	}
+	unsigned int bits(unsigned int n)
+	{
+		unsigned int v = 0;
+		while (n--)
+			v = (v << 1) | bit();
+		return v;
+	}
+	unsigned int ue()
+	{
+		unsigned int zeros = 0;
+		while (!bit())
+			zeros++;
+		return (1u << zeros) - 1 + bits(zeros);
+	}
+	int se()
+	{
+		unsigned int v = ue();
+		return v & 1 ? (v + 1) / 2 : -(int)(v / 2);
+	}
+
+private:
+	std::vector<uint8_t> const &data_;
+	size_t pos_;
+};
+
+// Work out the picture size from an SPS, which is what players will believe anyway.
+static void sps_size(std::string const &sps, unsigned int &width, unsigned int &height)
+{
+	std::vector<uint8_t> rbsp;
+	for (size_t i = 1; i < sps.size(); i++)
+	{
+		if (i >= 3 && sps[i] == 3 && sps[i - 1] == 0 && sps[i - 2] == 0)
+			continue;
+		rbsp.push_back(sps[i]);
+	}
+
+	BitReader r(rbsp);
+	unsigned int profile = r.bits(8);
+	r.bits(16); // constraint flags and level
+	r.ue(); // sps id
+	unsigned int chroma_format = 1;
+	if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 || profile == 83 ||
+		profile == 86 || profile == 118 || profile == 128 || profile == 138 || profile == 139 || profile == 134 ||
+		profile == 135)
+	{
+		chroma_format = r.ue();
+		if (chroma_format == 3)
+			r.bit();
+		r.ue(); // bit depths
+		r.ue();
+		r.bit();
+		if (r.bit()) // scaling matrices
+		{
+			for (unsigned int i = 0; i < (chroma_format != 3 ? 8u : 12u); i++)
+			{
+				if (!r.bit())
+					continue;
+				int last = 8, next = 8;
+				for (unsigned int j = 0; j < (i < 6 ? 16u : 64u); j++)
+				{
+					if (next)
+						next = (last + r.se() + 256) % 256;
+					last = next ? next : last;
+				}
+			}
+		}
+	}
+	r.ue(); // log2_max_frame_num
+	unsigned int poc_type = r.ue();
+	if (poc_type == 0)
+		r.ue();
+	else if (poc_type == 1)
+	{
+		r.bit();
+		r.se();
+		r.se();
+		for (unsigned int n = r.ue(); n; n--)
+			r.se();
+	}
+	r.ue(); // max_num_ref_frames
+	r.bit();
+	unsigned int width_mbs = r.ue() + 1;
+	unsigned int height_map_units = r.ue() + 1;
+	unsigned int frame_mbs_only = r.bit();
+	if (!frame_mbs_only)
+		r.bit();
+	r.bit();
+	unsigned int crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+	if (r.bit())
+	{
+		crop_left = r.ue();
+		crop_right = r.ue();
+		crop_top = r.ue();
+		crop_bottom = r.ue();
+	}
+
+	unsigned int crop_x = chroma_format == 1 || chroma_format == 2 ? 2 : 1;
+	unsigned int crop_y = (chroma_format == 1 ? 2 : 1) * (2 - frame_mbs_only);
+	width = width_mbs * 16 - (crop_left + crop_right) * crop_x;
+	height = (2 - frame_mbs_only) * height_map_units * 16 - (crop_top + crop_bottom) * crop_y;
+}
+
+Mp4Output::Mp4Output(VideoOptions const *options)
+	: Output(options), fp_(nullptr), file_bytes_(0), count_(0), segment_start_us_(0), width_(0), height_(0),
+	  sequence_(0), last_duration_us_(0), segments_dropped_(0), max_segment_us_(0),
+	  hls_(!options->Get().hls.empty()), init_written_(false)
+{
+	if (options->Get().codec != "h264")
+		throw std::runtime_error("mp4 output is only supported for h264");
+}
+
+Mp4Output::~Mp4Output()
+{
+	// Nothing may be thrown from here, so a failure to finish the file only gets reported.
+	try
+	{
+		int64_t end_us = samples_.empty() ? segment_start_us_ : samples_.back().timestamp_us + last_duration_us_;
+		if (!samples_.empty())
+			writeFragment(end_us);
+		closeSegment(end_us);
+		if (hls_ && !segments_.empty())
+			writePlaylist(true);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: Mp4Output: failed to finish output: " << e.what());
+		if (fp_)
+			fclose(fp_);
+	}
+}
+
+void Mp4Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	uint8_t const *data = static_cast<uint8_t const *>(mem);
+	bool keyframe = flags & FLAG_KEYFRAME;
+	if (keyframe)
+		parseHeaders(data, size);
+	// Nothing can be written until we know the SPS and PPS.
+	if (sps_.empty() || pps_.empty())
+		return;
+
+	// Fragments finish just before each keyframe, and new segments start at them.
+	if (keyframe && !samples_.empty())
+		writeFragment(timestamp_us);
+	if (!fp_ ||
+		(options_->Get().segment && keyframe &&
+		 (timestamp_us - segment_start_us_) / 1000 > options_->Get().segment) ||
+		(options_->Get().split && (flags & FLAG_RESTART)))
+	{
+		if (!keyframe)
+			return;
+		closeSegment(timestamp_us);
+		openSegment(timestamp_us);
+	}
+
+	appendSample(data, size, timestamp_us, keyframe);
+}
+
+bool Mp4Output::parseHeaders(uint8_t const *mem, size_t size)
+{
+	std::vector<std::pair<uint8_t const *, size_t>> nals;
+	split_nals(mem, size, nals);
+	bool found = false;
+	for (auto const &[nal, nal_size] : nals)
+	{
+		unsigned int type = nal[0] & 0x1f;
+		if (type == 7)
+		{
+			std::string sps((char const *)nal, nal_size);
+			if (!sps_.empty() && sps != sps_)
+				LOG_ERROR("WARNING: Mp4Output: the SPS has changed, which the mp4 file won't describe");
+			else if (sps_.empty())
+			{
+				sps_ = sps;
+				sps_size(sps_, width_, height_);
+				LOG(2, "Mp4Output: stream is " << width_ << "x" << height_);
+			}
+			found = true;
+		}
+		else if (type == 8)
+		{
+			if (pps_.empty())
+				pps_.assign((char const *)nal, nal_size);
+			found = true;
+		}
+		else if (type == 1 || type == 5)
+			break;
+	}
+	return found;
+}
+
+void Mp4Output::appendSample(uint8_t const *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	// MP4 wants each NAL unit with its length in front, rather than start codes. The parameter sets
+	// live in the init segment, so we leave them (and access unit delimiters) out.
+	std::vector<std::pair<uint8_t const *, size_t>> nals;
+	split_nals(mem, size, nals);
+	size_t offset = fragment_data_.size();
+	for (auto const &[nal, nal_size] : nals)
+	{
+		unsigned int type = nal[0] & 0x1f;
+		if (type == 7 || type == 8 || type == 9)
+			continue;
+		uint8_t length[4] = { (uint8_t)(nal_size >> 24), (uint8_t)(nal_size >> 16), (uint8_t)(nal_size >> 8),
+							  (uint8_t)nal_size };
+		fragment_data_.insert(fragment_data_.end(), length, length + 4);
+		fragment_data_.insert(fragment_data_.end(), nal, nal + nal_size);
+	}
+	if (fragment_data_.size() > offset)
+		samples_.push_back({ offset, (uint32_t)(fragment_data_.size() - offset), timestamp_us, keyframe });
+}
+
+std::vector<uint8_t> Mp4Output::initSegment() const
+{
+	BoxWriter b;
+	b.begin("ftyp");
+	b.fourcc("isom");
+	b.u32(0x200);
+	for (char const *brand : { "isom", "iso6", "avc1", "mp41" })
+		b.fourcc(brand);
+	b.end();
+
+	b.begin("moov");
+	b.beginFull("mvhd", 0, 0);
+	b.u32(0); // creation and modification times
+	b.u32(0);
+	b.u32(1000);
+	b.u32(0); // duration, which is only in the fragments
+	b.u32(0x00010000); // rate
+	b.u16(0x0100); // volume
+	b.zeros(10);
+	b.matrix();
+	b.zeros(24);
+	b.u32(TRACK_ID + 1);
+	b.end();
+
+	b.begin("trak");
+	b.beginFull("tkhd", 0, 3); // enabled, in movie
+	b.u32(0);
+	b.u32(0);
+	b.u32(TRACK_ID);
+	b.u32(0);
+	b.u32(0);
+	b.zeros(8);
+	b.u16(0); // layer
+	b.u16(0); // alternate group
+	b.u16(0); // volume
+	b.u16(0);
+	b.matrix();
+	b.u32(width_ << 16);
+	b.u32(height_ << 16);
+	b.end();
+
+	b.begin("mdia");
+	b.beginFull("mdhd", 0, 0);
+	b.u32(0);
+	b.u32(0);
+	b.u32(TIMESCALE);
+	b.u32(0);
+	b.u16(0x55c4); // "und"
+	b.u16(0);
+	b.end();
+	b.beginFull("hdlr", 0, 0);
+	b.u32(0);
+	b.fourcc("vide");
+	b.zeros(12);
+	b.bytes("VideoHandler", 13);
+	b.end();
+
+	b.begin("minf");
+	b.beginFull("vmhd", 0, 1);
+	b.zeros(8);
+	b.end();
+	b.begin("dinf");
+	b.beginFull("dref", 0, 0);
+	b.u32(1);
+	b.beginFull("url ", 0, 1); // the data is in this file
+	b.end();
+	b.end();
+	b.end();
+
+	b.begin("stbl");
+	b.beginFull("stsd", 0, 0);
+	b.u32(1);
+	b.begin("avc1");
+	b.zeros(6);
+	b.u16(1); // data reference index
+	b.zeros(16);
+	b.u16(width_);
+	b.u16(height_);
+	b.u32(0x00480000); // 72dpi
+	b.u32(0x00480000);
+	b.u32(0);
+	b.u16(1); // frames per sample
+	b.zeros(32); // compressor name
+	b.u16(0x0018); // depth
+	b.u16(0xffff);
+	b.begin("avcC");
+	b.u8(1);
+	b.bytes(sps_.data() + 1, 3); // profile, compatibility and level
+	b.u8(0xff); // 4 byte NAL lengths
+	b.u8(0xe1); // one SPS
+	b.u16(sps_.size());
+	b.bytes(sps_.data(), sps_.size());
+	b.u8(1); // one PPS
+	b.u16(pps_.size());
+	b.bytes(pps_.data(), pps_.size());
+	b.end();
+	b.end();
+	b.end();
+	// The sample tables are empty, as all the samples are in fragments.
+	for (char const *table : { "stts", "stsc", "stco" })
+	{
+		b.beginFull(table, 0, 0);
+		b.u32(0);
+		b.end();
+	}
+	b.beginFull("stsz", 0, 0);
+	b.u32(0);
+	b.u32(0);
+	b.end();
+	b.end(); // stbl
+	b.end(); // minf
+	b.end(); // mdia
+	b.end(); // trak
+
+	b.begin("mvex");
+	b.beginFull("trex", 0, 0);
+	b.u32(TRACK_ID);
+	b.u32(1); // sample description
+	b.u32(0);
+	b.u32(0);
+	b.u32(0);
+	b.end();
+	b.end();
+	b.end(); // moov
+	return b.data;
+}
+
+void Mp4Output::writeFragment(int64_t end_us)
+{
+	BoxWriter b;
+	b.begin("moof");
+	b.beginFull("mfhd", 0, 0);
+	b.u32(++sequence_);
+	b.end();
+	b.begin("traf");
+	b.beginFull("tfhd", 0, 0x020000); // default-base-is-moof
+	b.u32(TRACK_ID);
+	b.end();
+	b.beginFull("tfdt", 1, 0);
+	b.u64(to_timescale(samples_[0].timestamp_us));
+	b.end();
+	b.beginFull("trun", 0, 0x000701); // data offset, and a duration, size and flags for each sample
+	b.u32(samples_.size());
+	size_t data_offset_pos = b.data.size();
+	b.u32(0);
+	for (size_t i = 0; i < samples_.size(); i++)
+	{
+		// Work from the absolute times so that rounding errors don't build up.
+		int64_t next_us = i + 1 < samples_.size() ? samples_[i + 1].timestamp_us : end_us;
+		if (next_us <= samples_[i].timestamp_us)
+			next_us = samples_[i].timestamp_us + last_duration_us_;
+		else if (i + 1 == samples_.size())
+			last_duration_us_ = next_us - samples_[i].timestamp_us;
+		b.u32(to_timescale(next_us) - to_timescale(samples_[i].timestamp_us));
+		b.u32(samples_[i].size);
+		b.u32(samples_[i].keyframe ? 0x02000000 : 0x01010000); // sync sample, or depends on others
+	}
+	b.end();
+	b.end(); // traf
+	b.end(); // moof
+	b.patch32(data_offset_pos, b.data.size() + 8);
+	b.u32(8 + fragment_data_.size());
+	b.fourcc("mdat");
+
+	fragments_.emplace_back(samples_[0].timestamp_us, file_bytes_);
+	write(b.data);
+	write(fragment_data_);
+	if (options_->Get().flush)
+		fflush(fp_);
+	fragment_data_.clear();
+	samples_.clear();
+}
+
+void Mp4Output::write(std::vector<uint8_t> const &data)
+{
+	if (fwrite(data.data(), 1, data.size(), fp_) != data.size())
+		throw std::runtime_error("failed to write mp4 output");
+	file_bytes_ += data.size();
+}
+
+void Mp4Output::openSegment(int64_t timestamp_us)
+{
+	if (options_->Get().output == "-")
+	{
+		fp_ = stdout;
+		filename_ = "-";
+	}
+	else
+	{
+		char filename[256];
+		int n = snprintf(filename, sizeof(filename), options_->Get().output.c_str(), count_);
+		count_++;
+		if (options_->Get().wrap)
+			count_ = count_ % options_->Get().wrap;
+		if (n < 0)
+			throw std::runtime_error("failed to generate filename");
+		fp_ = fopen(filename, "w");
+		if (!fp_)
+			throw std::runtime_error("failed to open output file " + std::string(filename));
+		filename_ = filename;
+		LOG(2, "Mp4Output: opened output file " << filename_);
+	}
+
+	segment_start_us_ = timestamp_us;
+	file_bytes_ = 0;
+	fragments_.clear();
+
+	// Standalone files each get the init segment, but HLS media segments share one.
+	if (!hls_)
+		write(initSegment());
+	else if (!init_written_)
+	{
+		std::string const &playlist = options_->Get().hls;
+		size_t slash = playlist.rfind('/');
+		std::string init = (slash == std::string::npos ? "" : playlist.substr(0, slash + 1)) + "init.mp4";
+		std::vector<uint8_t> data = initSegment();
+		FILE *fp = fopen(init.c_str(), "w");
+		if (!fp)
+			throw std::runtime_error("failed to open " + init);
+		bool written = fwrite(data.data(), 1, data.size(), fp) == data.size();
+		if (fclose(fp) || !written)
+			throw std::runtime_error("failed to write " + init);
+		init_written_ = true;
+	}
+}
+
+void Mp4Output::closeSegment(int64_t end_us)
+{
+	if (!fp_)
+		return;
+
+	if (!hls_)
+	{
+		// A movie fragment random access box at the end lets players seek without reading the
+		// whole file.
+		BoxWriter b;
+		b.begin("mfra");
+		b.beginFull("tfra", 1, 0);
+		b.u32(TRACK_ID);
+		b.u32(0); // one byte each for the traf, trun and sample numbers
+		b.u32(fragments_.size());
+		for (auto const &[time_us, offset] : fragments_)
+		{
+			b.u64(to_timescale(time_us));
+			b.u64(offset);
+			b.u8(1);
+			b.u8(1);
+			b.u8(1);
+		}
+		b.end();
+		b.beginFull("mfro", 0, 0);
+		b.u32(0);
+		b.end();
+		b.end();
+		b.patch32(b.data.size() - 4, b.data.size());
+		write(b.data);
+	}
+
+	if (fp_ != stdout)
+		fclose(fp_);
+	else
+		fflush(fp_);
+	fp_ = nullptr;
+
+	segments_.push_back({ filename_, segment_start_us_, end_us - segment_start_us_, file_bytes_ });
+	max_segment_us_ = std::max(max_segment_us_, end_us - segment_start_us_);
+	unsigned int list_size = options_->Get().hls_list_size;
+	while (list_size && segments_.size() > list_size)
+	{
+		segments_.pop_front();
+		segments_dropped_++;
+	}
+	if (hls_)
+		writePlaylist(false);
+}
+
+void Mp4Output::writePlaylist(bool ended)
+{
+	// Write a new playlist and rename it over the old one, so that nobody reads half a playlist.
+	std::string const &playlist = options_->Get().hls;
+	std::string tmp = playlist + ".tmp";
+	FILE *fp = fopen(tmp.c_str(), "w");
+	if (!fp)
+	{
+		LOG_ERROR("WARNING: failed to write HLS playlist " << playlist);
+		return;
+	}
+
+	unsigned int target = std::ceil(std::max<int64_t>(max_segment_us_, options_->Get().segment * 1000) / 1e6);
+	fprintf(fp, "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:%u\n", target);
+	fprintf(fp, "#EXT-X-MEDIA-SEQUENCE:%llu\n", (unsigned long long)segments_dropped_);
+	fprintf(fp, "#EXT-X-MAP:URI=\"init.mp4\"\n");
+	for (Segment const &segment : segments_)
+	{
+		size_t slash = segment.filename.rfind('/');
+		std::string name = slash == std::string::npos ? segment.filename : segment.filename.substr(slash + 1);
+		fprintf(fp, "#EXTINF:%.3f,\n%s\n", segment.duration_us / 1e6, name.c_str());
+	}
+	if (ended)
+		fprintf(fp, "#EXT-X-ENDLIST\n");
+	fclose(fp);
+	if (rename(tmp.c_str(), playlist.c_str()) < 0)
+		LOG_ERROR("WARNING: failed to update HLS playlist " << playlist);
+}
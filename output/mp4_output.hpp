@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * mp4_output.hpp - Write H.264 as fragmented MP4, optionally with an HLS playlist.
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "output.hpp"
+
+// A small fragmented MP4 muxer for .mp4 and .m4s outputs of the h264 codec, so that recordings
+// play without being remuxed and without libav. Each GOP becomes one fragment. With --segment,
+// every segment begins with a keyframe, and is a complete MP4 file, unless --hls is given, when
+// the segments share an init.mp4 next to the playlist.
+class Mp4Output : public Output
+{
+public:
+	Mp4Output(VideoOptions const *options);
+	~Mp4Output();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	// A frame waiting in the current fragment, its data being at offset in fragment_data_.
+	struct Sample
+	{
+		size_t offset;
+		uint32_t size;
+		int64_t timestamp_us;
+		bool keyframe;
+	};
+
+	// The segments we have written, for the playlist.
+	struct Segment
+	{
+		std::string filename;
+		int64_t start_us;
+		int64_t duration_us;
+		uint64_t bytes;
+	};
+
+	bool parseHeaders(uint8_t const *mem, size_t size);
+	void appendSample(uint8_t const *mem, size_t size, int64_t timestamp_us, bool keyframe);
+	void openSegment(int64_t timestamp_us);
+	void closeSegment(int64_t end_us);
+	void writeFragment(int64_t end_us);
+	std::vector<uint8_t> initSegment() const;
+	void writePlaylist(bool ended);
+	void write(std::vector<uint8_t> const &data);
+
+	FILE *fp_;
+	std::string filename_;
+	uint64_t file_bytes_;
+	unsigned int count_;
+	int64_t segment_start_us_;
+	std::string sps_;
+	std::string pps_;
+	unsigned int width_;
+	unsigned int height_;
+	std::vector<uint8_t> fragment_data_;
+	std::vector<Sample> samples_;
+	uint32_t sequence_;
+	int64_t last_duration_us_;
+	// The time and file offset of each fragment in the current file, for the mfra box at the end.
+	std::vector<std::pair<int64_t, uint64_t>> fragments_;
+	// Only as many segments as the playlist lists are kept.
+	std::deque<Segment> segments_;
+	uint64_t segments_dropped_;
+	int64_t max_segment_us_;
+	bool hls_;
+	bool init_written_;
+};
@@ -10,7 +10,11 @@
 
 #include "net_output.hpp"
 
-NetOutput::NetOutput(VideoOptions const *options) : Output(options)
+// Bytes of IPv4 and UDP header that come out of the MTU.
+constexpr size_t UDP_OVERHEAD = 28;
+
+NetOutput::NetOutput(VideoOptions const *options)
+	: Output(options), frame_send_time_(0), clients_behind_(false)
 {
 	char protocol[4];
 	int start, end, a, b, c, d, port;
@@ -19,7 +23,14 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 		throw std::runtime_error("bad network address " + options->Get().output);
 	std::string address = options->Get().output.substr(start, end - start);
 
-	if (strcmp(protocol, "udp") == 0)
+	if (strcmp(protocol, "rtp") == 0)
+	{
+		if (options->Get().codec != "h264")
+			throw std::runtime_error("rtp output is only supported for h264");
+		rtp_ = std::make_unique<RtpPacketiser>(options->Get().mtu - UDP_OVERHEAD - RtpPacketiser::HEADER_SIZE);
+	}
+
+	if (strcmp(protocol, "udp") == 0 || rtp_)
 	{
 		saddr_ = {};
 		saddr_.sin_family = AF_INET;
@@ -40,30 +51,8 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 		if (options->Get().listen)
 		{
 			// We are the server.
-			int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-			if (listen_fd < 0)
-				throw std::runtime_error("unable to open listen socket");
-
-			sockaddr_in server_saddr = {};
-			server_saddr.sin_family = AF_INET;
-			server_saddr.sin_addr.s_addr = INADDR_ANY;
-			server_saddr.sin_port = htons(port);
-
-			int enable = 1;
-			if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
-				throw std::runtime_error("failed to setsockopt listen socket");
-
-			if (bind(listen_fd, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
-				throw std::runtime_error("failed to bind listen socket");
-			listen(listen_fd, 1);
-
-			LOG(2, "Waiting for client to connect...");
-			fd_ = accept(listen_fd, (struct sockaddr *)&saddr_, &sockaddr_in_size_);
-			if (fd_ < 0)
-				throw std::runtime_error("accept socket failed");
-			LOG(2, "Client connection accepted");
-
-			close(listen_fd);
+			server_ = std::make_unique<StreamServer>(port);
+			fd_ = -1;
 		}
 		else
 		{
@@ -89,26 +78,74 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 	}
 	else
 		throw std::runtime_error("unrecognised network protocol " + options->Get().output);
+
+	// Half a frame time.
+	congested_send_time_ = std::chrono::microseconds(
+		(int64_t)(500000 / options->Get().framerate.value_or(DEFAULT_FRAMERATE)));
 }
 
 NetOutput::~NetOutput()
 {
-	close(fd_);
+	if (fd_ >= 0)
+		close(fd_);
 }
 
 // Maximum size that sendto will accept.
 constexpr size_t MAX_UDP_SIZE = 65507;
 
-void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
 	LOG(2, "NetOutput: output buffer " << mem << " size " << size);
 	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
-	for (uint8_t *ptr = (uint8_t *)mem; size;)
+	auto start = std::chrono::steady_clock::now();
+	if (server_)
+		clients_behind_ |= server_->Send(mem, size, flags & FLAG_KEYFRAME, flags & FLAG_PARTIAL);
+	else if (rtp_)
+		sendRtp((uint8_t const *)mem, size, timestamp_us, !(flags & FLAG_PARTIAL));
+	else
+	{
+		for (uint8_t *ptr = (uint8_t *)mem; size;)
+		{
+			size_t bytes_to_send = std::min(size, max_size);
+			if (sendto(fd_, ptr, bytes_to_send, 0, saddr_ptr_, sockaddr_in_size_) < 0)
+				throw std::runtime_error("failed to send data on socket");
+			ptr += bytes_to_send;
+			size -= bytes_to_send;
+		}
+	}
+	// Feedback is per frame, however many parts it came in.
+	frame_send_time_ += std::chrono::steady_clock::now() - start;
+	if (flags & FLAG_PARTIAL)
+		return;
+	if (server_ && server_->KeyframeWanted())
+		feedback(Feedback::KeyframeNeeded);
+	bool congested = frame_send_time_ > congested_send_time_ || clients_behind_;
+	frame_send_time_ = {};
+	clients_behind_ = false;
+	feedback(congested ? Feedback::Congested : Feedback::Clear);
+}
+
+void NetOutput::sendRtp(uint8_t const *mem, size_t size, int64_t timestamp_us, bool end_of_frame)
+{
+	std::vector<iovec> const &iov = rtp_->Packetise(mem, size, timestamp_us, end_of_frame);
+
+	// Send the whole lot with as few system calls as we can.
+	rtp_msgs_.resize(iov.size() / 2);
+	for (size_t i = 0; i < rtp_msgs_.size(); i++)
+	{
+		rtp_msgs_[i] = {};
+		rtp_msgs_[i].msg_hdr.msg_name = &saddr_;
+		rtp_msgs_[i].msg_hdr.msg_namelen = sizeof(saddr_);
+		rtp_msgs_[i].msg_hdr.msg_iov = const_cast<iovec *>(&iov[2 * i]);
+		rtp_msgs_[i].msg_hdr.msg_iovlen = 2;
+	}
+	for (size_t sent = 0; sent < rtp_msgs_.size();)
 	{
-		size_t bytes_to_send = std::min(size, max_size);
-		if (sendto(fd_, ptr, bytes_to_send, 0, saddr_ptr_, sockaddr_in_size_) < 0)
+		int ret = sendmmsg(fd_, &rtp_msgs_[sent], rtp_msgs_.size() - sent, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
 			throw std::runtime_error("failed to send data on socket");
-		ptr += bytes_to_send;
-		size -= bytes_to_send;
+		sent += ret;
 	}
 }
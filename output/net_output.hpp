@@ -8,8 +8,15 @@
 #pragma once
 
 #include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <memory>
+#include <vector>
 
 #include "output.hpp"
+#include "rtp_packetiser.hpp"
+#include "stream_server.hpp"
 
 class NetOutput : public Output
 {
@@ -18,11 +25,27 @@ public:
 	~NetOutput();
 
 protected:
+	// Slices go out as soon as we have them, which is the point of encoding in slices.
+	bool wantsPartialFrames() const override { return true; }
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	void sendRtp(uint8_t const *mem, size_t size, int64_t timestamp_us, bool end_of_frame);
+
 	int fd_;
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+	// Sends start to block once the socket buffer fills, so one that takes this long means the link
+	// isn't keeping up.
+	std::chrono::microseconds congested_send_time_;
+	// Time spent sending the parts of the current frame so far.
+	std::chrono::steady_clock::duration frame_send_time_;
+	// With --listen, any number of clients are served from here instead.
+	std::unique_ptr<StreamServer> server_;
+	bool clients_behind_;
+
+	// For rtp:// outputs.
+	std::unique_ptr<RtpPacketiser> rtp_;
+	std::vector<mmsghdr> rtp_msgs_;
 };
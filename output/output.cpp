@@ -5,26 +5,27 @@
  * output.cpp - video stream output base class
  */
 
-#include <cinttypes>
 #include <stdexcept>
 
+#include "core/frame_trace.hpp"
+
 #include "circular_output.hpp"
 #include "file_output.hpp"
+#include "http_output.hpp"
+#include "mp4_output.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
+#include "rtsp_output.hpp"
+#include "tee_output.hpp"
 
-Output::Output(VideoOptions const *options)
-	: options_(options), fp_timestamps_(nullptr), state_(WAITING_KEYFRAME), time_offset_(0), last_timestamp_(0),
+Output::Output(VideoOptions const *options, bool write_files)
+	: options_(options), state_(WAITING_KEYFRAME), write_files_(write_files), time_offset_(0), last_timestamp_(0),
 	  buf_metadata_(std::cout.rdbuf()), of_metadata_()
 {
-	if (!options->Get().save_pts.empty())
-	{
-		fp_timestamps_ = fopen(options->Get().save_pts.c_str(), "w");
-		if (!fp_timestamps_)
-			throw std::runtime_error("Failed to open timestamp file " + options->Get().save_pts);
-		fprintf(fp_timestamps_, "# timecode format v2\n");
-	}
-	if (!options->Get().metadata.empty())
+	if (write_files && !options->Get().save_pts.empty())
+		timestamps_ = std::make_unique<TimestampWriter>(options->Get().save_pts, options->Get().pts_format,
+														options->Get().flush);
+	if (write_files && !options->Get().metadata.empty())
 	{
 		const std::string &filename = options_->Get().metadata;
 
@@ -34,6 +35,8 @@ Output::Output(VideoOptions const *options)
 			buf_metadata_ = of_metadata_.rdbuf();
 			start_metadata_output(buf_metadata_, options_->Get().metadata_format);
 		}
+		if (options_->Get().metadata_format == "bin")
+			bin_metadata_ = std::make_unique<BinaryMetadataWriter>(buf_metadata_);
 	}
 
 	enable_ = !options->Get().pause;
@@ -41,9 +44,9 @@ Output::Output(VideoOptions const *options)
 
 Output::~Output()
 {
-	if (fp_timestamps_)
-		fclose(fp_timestamps_);
-	if (!options_->Get().metadata.empty())
+	timestamps_.reset();
+	bin_metadata_.reset();
+	if (write_files_ && !options_->Get().metadata.empty())
 		stop_metadata_output(buf_metadata_, options_->Get().metadata_format);
 }
 
@@ -52,46 +55,138 @@ void Output::Signal()
 	enable_ = !enable_;
 }
 
-void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe, bool partial)
 {
-	// When output is enabled, we may have to wait for the next keyframe.
-	uint32_t flags = keyframe ? FLAG_KEYFRAME : FLAG_NONE;
-	if (!enable_)
-		state_ = DISABLED;
-	else if (state_ == DISABLED)
-		state_ = WAITING_KEYFRAME;
-	if (state_ == WAITING_KEYFRAME && keyframe)
-		state_ = RUNNING, flags |= FLAG_RESTART;
-	if (state_ != RUNNING)
+	if (wantsPartialFrames())
+	{
+		outputPart(mem, size, timestamp_us, keyframe, partial);
 		return;
+	}
 
-	// Frig the timestamps to be continuous after a pause.
-	if (flags & FLAG_RESTART)
-		time_offset_ = timestamp_us - last_timestamp_;
-	last_timestamp_ = timestamp_us - time_offset_;
+	// A part with a new timestamp means the frame being gathered is complete, even if the encoder
+	// never said so.
+	if (!assembled_.empty() && timestamp_us != assembled_timestamp_)
+		outputAssembled();
+	if (!partial && assembled_.empty())
+	{
+		outputPart(mem, size, timestamp_us, keyframe, false);
+		return;
+	}
 
-	outputBuffer(mem, size, last_timestamp_, flags);
+	// The assembly buffer keeps its capacity, so this only allocates for the first few frames.
+	if (assembled_.empty())
+		assembled_timestamp_ = timestamp_us, assembled_keyframe_ = false;
+	assembled_.insert(assembled_.end(), (uint8_t *)mem, (uint8_t *)mem + size);
+	assembled_keyframe_ |= keyframe;
+	if (!partial)
+		outputAssembled();
+}
 
-	// Save timestamps to a file, if that was requested.
-	if (fp_timestamps_)
+void Output::outputAssembled()
+{
+	outputPart(assembled_.data(), assembled_.size(), assembled_timestamp_, assembled_keyframe_, false);
+	assembled_.clear();
+}
+
+void Output::outputPart(void *mem, size_t size, int64_t timestamp_us, bool keyframe, bool partial)
+{
+	// An encoder that moves on to the next frame must have finished the last one.
+	if (in_frame_ && timestamp_us != frame_timestamp_)
+		endFrame();
+
+	uint32_t flags = partial ? FLAG_PARTIAL : FLAG_NONE;
+	if (!in_frame_)
+	{
+		// Only the first part of a frame decides whether the frame is output, so that an output
+		// never starts on a later slice.
+		in_frame_ = true;
+		frame_timestamp_ = timestamp_us;
+
+		// When output is enabled, we may have to wait for the next keyframe.
+		if (keyframe)
+			flags |= FLAG_KEYFRAME;
+		if (!enable_)
+			state_ = DISABLED;
+		else if (state_ == DISABLED)
+			state_ = WAITING_KEYFRAME, keyframe_requested_ = false;
+		if (state_ == WAITING_KEYFRAME && keyframe)
+			state_ = RUNNING, flags |= FLAG_RESTART;
+		frame_running_ = state_ == RUNNING;
+
+		if (!frame_running_)
+		{
+			// Rather than wait for the end of the GOP, ask for a keyframe now.
+			if (state_ == WAITING_KEYFRAME && !keyframe_requested_)
+			{
+				feedback(Feedback::KeyframeNeeded);
+				keyframe_requested_ = true;
+			}
+		}
+		else
+		{
+			// Frig the timestamps to be continuous after a pause.
+			if (flags & FLAG_RESTART)
+				time_offset_ = timestamp_us - last_timestamp_;
+			last_timestamp_ = timestamp_us - time_offset_;
+		}
+	}
+
+	if (frame_running_)
 	{
-		timestampReady(last_timestamp_);
+		static PerfTotals *perf = PerfCounters::Totals("output/output");
+		FrameTraceScope trace("output", "output", FrameTrace::NO_ID, timestamp_us, perf);
+		outputBuffer(mem, size, last_timestamp_, flags);
 	}
 
-	if (!options_->Get().metadata.empty())
+	if (!partial)
+		endFrame();
+}
+
+void Output::endFrame()
+{
+	in_frame_ = false;
+	// Frames that aren't output still use up their times, so that the queue doesn't grow.
+	TimestampWriter::Record record = { last_timestamp_, 0, 0, 0, 0 };
+	if (timestamps_)
+		takeFrameTimes(record);
+	if (!frame_running_)
+		return;
+
+	// Save timestamps to a file, if that was requested.
+	if (timestamps_)
+		timestampReady(record);
+
+	if (write_files_ && !options_->Get().metadata.empty())
 	{
 		libcamera::ControlList metadata = metadata_queue_.front();
-		write_metadata(buf_metadata_, options_->Get().metadata_format, metadata, !metadata_started_);
+		if (bin_metadata_)
+			bin_metadata_->Write(metadata, last_timestamp_);
+		else
+			write_metadata(buf_metadata_, options_->Get().metadata_format, metadata, !metadata_started_);
 		metadata_started_ = true;
 		metadata_queue_.pop();
 	}
 }
 
-void Output::timestampReady(int64_t timestamp)
+void Output::takeFrameTimes(TimestampWriter::Record &record)
 {
-	fprintf(fp_timestamps_, "%" PRId64 ".%03" PRId64 "\n", timestamp / 1000, timestamp % 1000);
-	if (options_->Get().flush)
-		fflush(fp_timestamps_);
+	// The encoder normally finishes with a frame's buffer before the frame comes out, but if the
+	// times haven't arrived we just write zeros for them.
+	std::lock_guard<std::mutex> lock(frame_times_mutex_);
+	while (!frame_times_.empty() && frame_times_.front().timestamp_us < frame_timestamp_)
+		frame_times_.pop_front();
+	if (!frame_times_.empty() && frame_times_.front().timestamp_us == frame_timestamp_)
+	{
+		record.sensor_ns = frame_times_.front().sensor_ns;
+		record.wallclock_ns = frame_times_.front().wallclock_ns;
+		record.sequence = frame_times_.front().sequence;
+		frame_times_.pop_front();
+	}
+}
+
+void Output::timestampReady(TimestampWriter::Record const &record)
+{
+	timestamps_->Write(record);
 }
 
 void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
@@ -99,25 +194,62 @@ void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t
 	// Supply this so that a vanilla Output gives you an object that outputs no buffers.
 }
 
+static bool ends_with(std::string const &s, char const *suffix)
+{
+	size_t n = strlen(suffix);
+	return s.size() >= n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
 Output *Output::Create(VideoOptions const *options)
+{
+	if (!options->Get().tee_output.empty())
+		return new TeeOutput(options);
+	return CreateSingle(options);
+}
+
+Output *Output::CreateSingle(VideoOptions const *options)
 {
 	bool libav = options->Get().codec == "libav" ||
 				 (options->Get().codec == "h264" && options->GetPlatform() != Platform::VC4);
 	const std::string out_file = options->Get().output;
 
-	if (!libav && (strncmp(out_file.c_str(), "udp://", 6) == 0 || strncmp(out_file.c_str(), "tcp://", 6) == 0))
+	// The libav encoder writes its own output, which knows nothing of HLS.
+	if (libav && !options->Get().hls.empty())
+		throw std::runtime_error("--hls is not supported with the libav encoder");
+
+	if (!libav && (strncmp(out_file.c_str(), "udp://", 6) == 0 || strncmp(out_file.c_str(), "tcp://", 6) == 0 ||
+				   strncmp(out_file.c_str(), "rtp://", 6) == 0))
 		return new NetOutput(options);
+	else if (!libav && strncmp(out_file.c_str(), "rtsp://", 7) == 0)
+		return new RtspOutput(options);
+	else if (strncmp(out_file.c_str(), "http://", 7) == 0)
+		return new HttpOutput(options);
 	else if (options->Get().circular)
 		return new CircularOutput(options);
+	else if (!libav && options->Get().codec == "h264" &&
+			 (!options->Get().hls.empty() || ends_with(out_file, ".mp4") || ends_with(out_file, ".m4s")))
+		return new Mp4Output(options);
 	else if (!out_file.empty())
 		return new FileOutput(options);
 	else
 		return new Output(options);
 }
 
-void Output::MetadataReady(libcamera::ControlList &metadata)
+void Output::MetadataReady(libcamera::ControlList &metadata, unsigned int sequence)
 {
-	if (options_->Get().metadata.empty())
+	if (timestamps_)
+	{
+		// Match the timestamp that EncodeBuffer gives the encoder.
+		auto sensor_ts = metadata.get(libcamera::controls::SensorTimestamp);
+		auto wallclock_ts = metadata.get(libcamera::controls::FrameWallClock);
+		int64_t sensor_ns = sensor_ts ? *sensor_ts : 0;
+		int64_t wallclock_ns = wallclock_ts ? *wallclock_ts : 0;
+		int64_t timestamp_us = (wallclock_ns ? wallclock_ns : sensor_ns) / 1000;
+		std::lock_guard<std::mutex> lock(frame_times_mutex_);
+		frame_times_.push_back({ timestamp_us, sensor_ns, wallclock_ns, sequence });
+	}
+
+	if (!write_files_ || options_->Get().metadata.empty())
 		return;
 
 	metadata_queue_.push(metadata);
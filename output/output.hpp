@@ -10,31 +10,66 @@
 #include <cstdio>
 
 #include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 #include "core/video_options.hpp"
 
+#include "binary_metadata.hpp"
+#include "timestamp_writer.hpp"
+
 class Output
 {
 public:
+	// What an output can tell the encoder about how it is coping. Outputs that report congestion do
+	// so for every buffer they handle, on the encoder's output thread.
+	enum class Feedback
+	{
+		Clear,
+		Congested,
+		KeyframeNeeded, // output is waiting for a keyframe before it can carry on
+	};
+	typedef std::function<void(Feedback)> FeedbackCallback;
+
 	static Output *Create(VideoOptions const *options);
+	// The one output for the options' --output, ignoring any --tee-output.
+	static Output *CreateSingle(VideoOptions const *options);
 
-	Output(VideoOptions const *options);
+	// An output that only passes buffers on to others leaves the metadata and timestamp files to them.
+	Output(VideoOptions const *options, bool write_files = true);
 	virtual ~Output();
 	virtual void Signal(); // a derived class might redefine what this means
-	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
-	void MetadataReady(libcamera::ControlList &metadata);
+	// Ask an output that keeps a history to save some of it. May be called from any thread.
+	virtual void Trigger() {}
+	// A frame may come in several parts, all but the last with partial set, in which case the
+	// keyframe flag may be set on any of the parts.
+	virtual void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe, bool partial);
+	virtual void MetadataReady(libcamera::ControlList &metadata, unsigned int sequence);
+	void SetFeedbackCallback(FeedbackCallback callback) { feedback_callback_ = callback; }
 
 protected:
 	enum Flag
 	{
 		FLAG_NONE = 0,
 		FLAG_KEYFRAME = 1,
-		FLAG_RESTART = 2
+		FLAG_RESTART = 2,
+		FLAG_PARTIAL = 4 // more of this frame follows, and only the first part has the other flags
 	};
+	// Outputs that can send a frame as it arrives, slice by slice, override this. The others are
+	// given each frame in one buffer.
+	virtual bool wantsPartialFrames() const { return false; }
 	virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
-	virtual void timestampReady(int64_t timestamp);
+	virtual void timestampReady(TimestampWriter::Record const &record);
+	void feedback(Feedback feedback)
+	{
+		if (feedback_callback_)
+			feedback_callback_(feedback);
+	}
 	VideoOptions const *options_;
-	FILE *fp_timestamps_;
+	std::unique_ptr<TimestampWriter> timestamps_;
 
 private:
 	enum State
@@ -44,13 +79,41 @@ private:
 		RUNNING = 2
 	};
 	State state_;
+	bool write_files_;
 	std::atomic<bool> enable_;
 	int64_t time_offset_;
 	int64_t last_timestamp_;
 	std::streambuf *buf_metadata_;
 	std::ofstream of_metadata_;
+	std::unique_ptr<BinaryMetadataWriter> bin_metadata_;
 	bool metadata_started_ = false;
 	std::queue<libcamera::ControlList> metadata_queue_;
+	// The camera's own times for each frame the encoder has finished with, for the timestamp file.
+	struct FrameTimes
+	{
+		int64_t timestamp_us; // as the encoder was given it
+		int64_t sensor_ns;
+		int64_t wallclock_ns;
+		unsigned int sequence;
+	};
+	// Filled in on the camera's thread, and emptied on the output's.
+	std::mutex frame_times_mutex_;
+	std::deque<FrameTimes> frame_times_;
+	FeedbackCallback feedback_callback_;
+	bool keyframe_requested_ = false;
+
+	void outputPart(void *mem, size_t size, int64_t timestamp_us, bool keyframe, bool partial);
+	void endFrame();
+	void takeFrameTimes(TimestampWriter::Record &record);
+	void outputAssembled();
+	// The frame whose parts we are part way through, and whether we're passing it on.
+	bool in_frame_ = false;
+	bool frame_running_ = false;
+	int64_t frame_timestamp_ = 0;
+	// Parts gathered into a whole frame, for outputs that don't want them separately.
+	std::vector<uint8_t> assembled_;
+	int64_t assembled_timestamp_ = 0;
+	bool assembled_keyframe_ = false;
 };
 
 void start_metadata_output(std::streambuf *buf, std::string fmt);
@@ -0,0 +1,117 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rtp_packetiser.cpp - Split an H.264 stream into RTP packets (RFC 6184).
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+#include "rtp_packetiser.hpp"
+
+constexpr uint8_t NAL_TYPE_FU_A = 28;
+
+void split_nals(uint8_t const *data, size_t size, std::vector<std::pair<uint8_t const *, size_t>> &nals)
+{
+	nals.clear();
+	uint8_t const *end = data + size, *nal = nullptr;
+	for (uint8_t const *p = data; p + 3 <= end;)
+	{
+		if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+		{
+			if (nal)
+			{
+				// Zeros before a start code belong to it (or are padding), not to the NAL.
+				uint8_t const *nal_end = p;
+				while (nal_end > nal && nal_end[-1] == 0)
+					nal_end--;
+				if (nal_end > nal)
+					nals.emplace_back(nal, nal_end - nal);
+			}
+			p += 3;
+			nal = p;
+		}
+		else
+			p++;
+	}
+	if (nal && nal < end)
+		nals.emplace_back(nal, end - nal);
+	else if (!nal && size)
+		nals.emplace_back(data, size);
+}
+
+RtpPacketiser::RtpPacketiser(size_t max_payload) : max_payload_(max_payload)
+{
+	// Sequence numbers and timestamps start at random values, as RFC 3550 asks.
+	std::random_device random;
+	sequence_ = random();
+	ssrc_ = random();
+	timestamp_offset_ = random();
+}
+
+void RtpPacketiser::addPacket(uint32_t timestamp, uint8_t const *prefix, unsigned int prefix_size,
+							  uint8_t const *payload, size_t payload_size)
+{
+	Packet &packet = packets_.emplace_back();
+	packet.header[0] = 0x80; // version 2, no padding, extensions or CSRCs
+	packet.header[1] = PAYLOAD_TYPE; // the marker bit gets set later on the last packet of a frame
+	packet.header[2] = sequence_ >> 8;
+	packet.header[3] = sequence_;
+	packet.header[4] = timestamp >> 24;
+	packet.header[5] = timestamp >> 16;
+	packet.header[6] = timestamp >> 8;
+	packet.header[7] = timestamp;
+	packet.header[8] = ssrc_ >> 24;
+	packet.header[9] = ssrc_ >> 16;
+	packet.header[10] = ssrc_ >> 8;
+	packet.header[11] = ssrc_;
+	memcpy(packet.header + HEADER_SIZE, prefix, prefix_size);
+	packet.header_size = HEADER_SIZE + prefix_size;
+	packet.payload = payload;
+	packet.payload_size = payload_size;
+	sequence_++;
+}
+
+std::vector<iovec> const &RtpPacketiser::Packetise(uint8_t const *mem, size_t size, int64_t timestamp_us,
+												   bool end_of_frame)
+{
+	// RTP timestamps for video run at 90kHz.
+	uint32_t timestamp = timestamp_offset_ + (uint32_t)(timestamp_us * CLOCK_RATE / 1000000);
+
+	// NAL units that fit go in a packet of their own, and larger ones are split into FU-A
+	// fragments, so nothing gets fragmented by IP.
+	split_nals(mem, size, nals_);
+	packets_.clear();
+	for (auto const &[nal, nal_size] : nals_)
+	{
+		if (nal_size <= max_payload_)
+		{
+			addPacket(timestamp, nullptr, 0, nal, nal_size);
+			continue;
+		}
+
+		size_t fragment_size = max_payload_ - 2;
+		for (size_t offset = 1; offset < nal_size; offset += fragment_size)
+		{
+			size_t n = std::min(fragment_size, nal_size - offset);
+			uint8_t fu[2] = { (uint8_t)((nal[0] & 0xe0) | NAL_TYPE_FU_A), (uint8_t)(nal[0] & 0x1f) };
+			if (offset == 1)
+				fu[1] |= 0x80; // start
+			if (offset + n == nal_size)
+				fu[1] |= 0x40; // end
+			addPacket(timestamp, fu, 2, nal + offset, n);
+		}
+	}
+	if (end_of_frame && !packets_.empty())
+		packets_.back().header[1] |= 0x80;
+
+	iov_.resize(2 * packets_.size());
+	for (size_t i = 0; i < packets_.size(); i++)
+	{
+		iov_[2 * i] = { packets_[i].header, packets_[i].header_size };
+		iov_[2 * i + 1] = { (void *)packets_[i].payload, packets_[i].payload_size };
+	}
+	return iov_;
+}
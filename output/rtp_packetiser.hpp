@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rtp_packetiser.hpp - Split an H.264 stream into RTP packets (RFC 6184).
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Turns each encoded buffer into RTP packets no bigger than the given payload size, using single
+// NAL unit packets where they fit and FU-A fragments where they don't. The packets point into the
+// encoded buffer rather than copying it.
+class RtpPacketiser
+{
+public:
+	static constexpr size_t HEADER_SIZE = 12;
+	// The usual dynamic payload type for H.264, which the receiver's SDP must match.
+	static constexpr uint8_t PAYLOAD_TYPE = 96;
+	static constexpr unsigned int CLOCK_RATE = 90000;
+
+	RtpPacketiser(size_t max_payload);
+
+	// Returns an iovec pair (header, payload) for each packet, valid until the next call. Every
+	// part of a frame must have the same timestamp, and end_of_frame set only on the last one.
+	std::vector<iovec> const &Packetise(uint8_t const *mem, size_t size, int64_t timestamp_us, bool end_of_frame);
+
+	uint16_t NextSequence() const { return sequence_; }
+	uint32_t Ssrc() const { return ssrc_; }
+
+private:
+	struct Packet
+	{
+		uint8_t header[HEADER_SIZE + 2];
+		unsigned int header_size;
+		uint8_t const *payload;
+		size_t payload_size;
+	};
+
+	void addPacket(uint32_t timestamp, uint8_t const *prefix, unsigned int prefix_size, uint8_t const *payload,
+				   size_t payload_size);
+
+	size_t max_payload_;
+	uint16_t sequence_;
+	uint32_t ssrc_;
+	uint32_t timestamp_offset_;
+	std::vector<std::pair<uint8_t const *, size_t>> nals_;
+	std::vector<Packet> packets_;
+	std::vector<iovec> iov_;
+};
+
+// Find the NAL units in an Annex B byte stream, leaving out the start codes.
+void split_nals(uint8_t const *data, size_t size, std::vector<std::pair<uint8_t const *, size_t>> &nals);
@@ -0,0 +1,532 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rtsp_output.cpp - Serve the H.264 stream over RTSP.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/thread_config.hpp"
+
+#include "rtsp_output.hpp"
+
+// Bytes of IPv4 and UDP header that come out of the MTU.
+constexpr size_t UDP_OVERHEAD = 28;
+constexpr unsigned int DEFAULT_RTSP_PORT = 8554;
+
+static std::string base64(std::string const &data)
+{
+	static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (size_t i = 0; i < data.size(); i += 3)
+	{
+		uint32_t n = (uint8_t)data[i] << 16;
+		if (i + 1 < data.size())
+			n |= (uint8_t)data[i + 1] << 8;
+		if (i + 2 < data.size())
+			n |= (uint8_t)data[i + 2];
+		out += table[(n >> 18) & 63];
+		out += table[(n >> 12) & 63];
+		out += i + 1 < data.size() ? table[(n >> 6) & 63] : '=';
+		out += i + 2 < data.size() ? table[n & 63] : '=';
+	}
+	return out;
+}
+
+// Find a header in an RTSP request, returning an empty string if it isn't there.
+static std::string get_header(std::string const &request, char const *name)
+{
+	std::istringstream lines(request);
+	std::string line;
+	std::getline(lines, line); // the request line
+	while (std::getline(lines, line))
+	{
+		size_t colon = line.find(':');
+		if (colon == std::string::npos || strncasecmp(line.c_str(), name, colon) || name[colon])
+			continue;
+		size_t start = line.find_first_not_of(" \t", colon + 1);
+		size_t end = line.find_last_not_of(" \t\r");
+		return start == std::string::npos || end < start ? "" : line.substr(start, end - start + 1);
+	}
+	return "";
+}
+
+// Read the number that follows a key such as "client_port=" in a Transport header.
+static int get_transport_value(std::string const &transport, char const *key, int default_value)
+{
+	size_t pos = transport.find(key);
+	if (pos == std::string::npos)
+		return default_value;
+	return atoi(transport.c_str() + pos + strlen(key));
+}
+
+RtspOutput::RtspOutput(VideoOptions const *options)
+	: Output(options), packetiser_(options->Get().mtu - UDP_OVERHEAD - RtpPacketiser::HEADER_SIZE),
+	  frame_start_(true), keyframe_wanted_(false), abort_(false)
+{
+	if (options->Get().codec != "h264")
+		throw std::runtime_error("rtsp output is only supported for h264");
+
+	// The address is rtsp://[host][:port][/path]. We serve on every interface, and answer
+	// requests for any path.
+	std::string url = options->Get().output.substr(strlen("rtsp://"));
+	std::string authority = url.substr(0, url.find('/'));
+	size_t colon = authority.find(':');
+	unsigned int port = colon == std::string::npos ? DEFAULT_RTSP_PORT : atoi(authority.c_str() + colon + 1);
+	if (!port || port > 65535)
+		throw std::runtime_error("bad rtsp address " + options->Get().output);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open rtsp socket");
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt rtsp socket");
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_addr.s_addr = INADDR_ANY;
+	saddr.sin_port = htons(port);
+	if (bind(listen_fd_, (struct sockaddr *)&saddr, sizeof(saddr)) < 0 || listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("failed to listen on rtsp port " + std::to_string(port));
+
+	// All the UDP clients are sent their RTP from this one socket.
+	rtp_fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	saddr.sin_port = 0;
+	socklen_t len = sizeof(saddr);
+	if (rtp_fd_ < 0 || bind(rtp_fd_, (struct sockaddr *)&saddr, sizeof(saddr)) < 0 ||
+		getsockname(rtp_fd_, (struct sockaddr *)&saddr, &len) < 0)
+		throw std::runtime_error("unable to open rtp socket");
+	rtp_port_ = ntohs(saddr.sin_port);
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("unable to create rtsp server events");
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+	ev.data.fd = event_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+
+	thread_ = std::thread(&RtspOutput::serverThread, this);
+	LOG(1, "RtspOutput: serving on port " << port);
+}
+
+RtspOutput::~RtspOutput()
+{
+	abort_ = true;
+	wake();
+	thread_.join();
+
+	for (auto const &[fd, conn] : connections_)
+		close(fd);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(rtp_fd_);
+	close(listen_fd_);
+}
+
+void RtspOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// Clients can only start at the first part of a keyframe.
+	bool resume = (flags & FLAG_KEYFRAME) && frame_start_;
+	frame_start_ = !(flags & FLAG_PARTIAL);
+	uint8_t const *data = static_cast<uint8_t const *>(mem);
+	std::vector<iovec> const &iov = packetiser_.Packetise(data, size, timestamp_us, frame_start_);
+	size_t num_packets = iov.size() / 2;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (resume)
+			cacheParameterSets(data, size);
+
+		for (auto &[fd, conn] : connections_)
+		{
+			if (!conn.playing)
+				continue;
+			if (conn.waiting_keyframe)
+			{
+				if (!resume)
+					continue;
+				conn.waiting_keyframe = false;
+			}
+
+			if (conn.interleaved)
+			{
+				// Each packet goes on the RTSP connection behind a '$', the channel and its length.
+				std::string interleaved;
+				for (size_t i = 0; i < num_packets; i++)
+				{
+					size_t length = iov[2 * i].iov_len + iov[2 * i + 1].iov_len;
+					char prefix[4] = { '$', (char)conn.channel, (char)(length >> 8), (char)length };
+					interleaved.append(prefix, 4);
+					interleaved.append((char const *)iov[2 * i].iov_base, iov[2 * i].iov_len);
+					interleaved.append((char const *)iov[2 * i + 1].iov_base, iov[2 * i + 1].iov_len);
+				}
+				queueOut(conn, std::move(interleaved));
+				if (conn.out_bytes > MAX_CONNECTION_QUEUE)
+				{
+					// Keep whatever we're halfway through sending, so the framing stays intact.
+					LOG(1, "RtspOutput: client " << inet_ntoa(conn.peer.sin_addr)
+												 << " is too slow, skipping to the next keyframe");
+					std::string front = conn.out_offset ? std::move(conn.out.front()) : std::string();
+					conn.out.clear();
+					conn.out_bytes = 0;
+					if (!front.empty())
+					{
+						conn.out_bytes = front.size() - conn.out_offset;
+						conn.out.push_back(std::move(front));
+					}
+					else
+						conn.out_offset = 0;
+					conn.waiting_keyframe = true;
+				}
+				continue;
+			}
+
+			// Over UDP, anything the socket won't take right now is simply lost.
+			msgs_.resize(num_packets);
+			for (size_t i = 0; i < num_packets; i++)
+			{
+				msgs_[i] = {};
+				msgs_[i].msg_hdr.msg_name = &conn.rtp_addr;
+				msgs_[i].msg_hdr.msg_namelen = sizeof(conn.rtp_addr);
+				msgs_[i].msg_hdr.msg_iov = const_cast<iovec *>(&iov[2 * i]);
+				msgs_[i].msg_hdr.msg_iovlen = 2;
+			}
+			for (size_t sent = 0; sent < num_packets;)
+			{
+				int ret = sendmmsg(rtp_fd_, &msgs_[sent], num_packets - sent, MSG_DONTWAIT);
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret <= 0)
+					break;
+				sent += ret;
+			}
+		}
+	}
+
+	wake();
+	if (keyframe_wanted_.exchange(false))
+		feedback(Feedback::KeyframeNeeded);
+}
+
+void RtspOutput::cacheParameterSets(uint8_t const *mem, size_t size)
+{
+	// Remember the SPS and PPS, which go into the SDP for clients that want them out of band.
+	std::vector<std::pair<uint8_t const *, size_t>> nals;
+	split_nals(mem, size, nals);
+	for (auto const &[nal, nal_size] : nals)
+	{
+		unsigned int type = nal[0] & 0x1f;
+		if (type == 7)
+			sps_.assign((char const *)nal, nal_size);
+		else if (type == 8)
+			pps_.assign((char const *)nal, nal_size);
+		else if (type == 1 || type == 5)
+			break;
+	}
+}
+
+void RtspOutput::wake()
+{
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		LOG(2, "RtspOutput: failed to wake server thread");
+}
+
+void RtspOutput::serverThread()
+{
+	ThreadConfig::Get().Apply("server");
+	epoll_event events[16];
+	while (!abort_)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, 200);
+		std::lock_guard<std::mutex> lock(mutex_);
+		std::vector<int> closed;
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptConnections();
+			else if (fd == event_fd_)
+			{
+				uint64_t count;
+				if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					LOG_ERROR("WARNING: rtsp server event read failed");
+			}
+			else if (events[i].events & (EPOLLHUP | EPOLLERR))
+				closed.push_back(fd);
+			else if ((events[i].events & (EPOLLIN | EPOLLRDHUP)) && !readConnection(fd, connections_[fd]))
+				closed.push_back(fd);
+		}
+		for (int fd : closed)
+			closeConnection(fd);
+
+		for (auto it = connections_.begin(); it != connections_.end();)
+		{
+			int fd = (it++)->first;
+			if (!flushConnection(fd, connections_[fd]))
+				closeConnection(fd);
+		}
+	}
+}
+
+void RtspOutput::acceptConnections()
+{
+	while (true)
+	{
+		sockaddr_in peer = {};
+		socklen_t len = sizeof(peer);
+		int fd = accept4(listen_fd_, (struct sockaddr *)&peer, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		int enable = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+		epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.fd = fd;
+		epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+
+		Connection &conn = connections_[fd];
+		conn.peer = peer;
+		len = sizeof(conn.local);
+		getsockname(fd, (struct sockaddr *)&conn.local, &len);
+		conn.out_offset = 0;
+		conn.out_bytes = 0;
+		conn.want_writable = false;
+		conn.playing = false;
+		conn.waiting_keyframe = false;
+		conn.interleaved = false;
+		conn.channel = 0;
+		conn.rtp_addr = {};
+		LOG(2, "RtspOutput: connection from " << inet_ntoa(peer.sin_addr));
+	}
+}
+
+bool RtspOutput::readConnection(int fd, Connection &conn)
+{
+	char buf[4096];
+	while (true)
+	{
+		ssize_t ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR))
+			return false;
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		if (ret > 0)
+			conn.in.append(buf, ret);
+	}
+
+	while (!conn.in.empty())
+	{
+		// Interleaved clients may send us RTCP on the connection, which we don't need.
+		if (conn.in[0] == '$')
+		{
+			if (conn.in.size() < 4)
+				break;
+			size_t length = 4 + ((uint8_t)conn.in[2] << 8 | (uint8_t)conn.in[3]);
+			if (conn.in.size() < length)
+				break;
+			conn.in.erase(0, length);
+			continue;
+		}
+
+		size_t end = conn.in.find("\r\n\r\n");
+		if (end == std::string::npos)
+			return conn.in.size() < 65536;
+		end += 4;
+		size_t body = atoi(get_header(conn.in.substr(0, end), "Content-Length").c_str());
+		if (conn.in.size() < end + body)
+			break;
+		std::string request = conn.in.substr(0, end);
+		conn.in.erase(0, end + body);
+		handleRequest(conn, request);
+	}
+	return true;
+}
+
+void RtspOutput::handleRequest(Connection &conn, std::string const &request)
+{
+	std::istringstream ss(request);
+	std::string method, url;
+	ss >> method >> url;
+	LOG(2, "RtspOutput: " << method << " " << url);
+
+	std::string status = "200 OK";
+	std::string headers = "CSeq: " + get_header(request, "CSeq") + "\r\n";
+	std::string body;
+
+	if (method == "OPTIONS")
+		headers += "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n";
+	else if (method == "DESCRIBE")
+	{
+		body = describe(conn);
+		headers += "Content-Base: " + url + "/\r\n";
+		headers += "Content-Type: application/sdp\r\n";
+	}
+	else if (method == "SETUP")
+	{
+		std::string transport = get_header(request, "Transport");
+		if (transport.find("multicast") != std::string::npos)
+			status = "461 Unsupported Transport";
+		else if (transport.find("RTP/AVP/TCP") != std::string::npos)
+		{
+			conn.interleaved = true;
+			conn.channel = get_transport_value(transport, "interleaved=", 0);
+			headers += "Transport: RTP/AVP/TCP;unicast;interleaved=" + std::to_string(conn.channel) + "-" +
+					   std::to_string(conn.channel + 1) + "\r\n";
+		}
+		else
+		{
+			int client_port = get_transport_value(transport, "client_port=", 0);
+			if (client_port <= 0 || client_port > 65535)
+				status = "461 Unsupported Transport";
+			else
+			{
+				conn.interleaved = false;
+				conn.rtp_addr = conn.peer;
+				conn.rtp_addr.sin_port = htons(client_port);
+				headers += "Transport: RTP/AVP;unicast;client_port=" + std::to_string(client_port) + "-" +
+						   std::to_string(client_port + 1) + ";server_port=" + std::to_string(rtp_port_) + "-" +
+						   std::to_string(rtp_port_ + 1) + "\r\n";
+			}
+		}
+		if (status == "200 OK")
+		{
+			if (conn.session.empty())
+			{
+				std::random_device random;
+				std::stringstream id;
+				id << std::hex << random() << random();
+				conn.session = id.str();
+			}
+			headers += "Session: " + conn.session + ";timeout=60\r\n";
+		}
+	}
+	else if (method == "PLAY" || method == "PAUSE" || method == "TEARDOWN" || method == "GET_PARAMETER" ||
+			 method == "SET_PARAMETER")
+	{
+		if (conn.session.empty())
+			status = "454 Session Not Found";
+		else
+		{
+			headers += "Session: " + conn.session + "\r\n";
+			if (method == "PLAY")
+			{
+				// Start at the next keyframe, and ask for it now rather than wait for one.
+				headers += "Range: npt=0.000-\r\n";
+				conn.playing = true;
+				conn.waiting_keyframe = true;
+				keyframe_wanted_ = true;
+				LOG(1, "RtspOutput: " << inet_ntoa(conn.peer.sin_addr) << " playing over "
+									  << (conn.interleaved ? "TCP" : "UDP"));
+			}
+			else if (method == "PAUSE")
+				conn.playing = false;
+			else if (method == "TEARDOWN")
+			{
+				conn.playing = false;
+				conn.session.clear();
+			}
+		}
+	}
+	else
+		status = "501 Not Implemented";
+
+	if (!body.empty())
+		headers += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+	queueOut(conn, "RTSP/1.0 " + status + "\r\n" + headers + "\r\n" + body);
+}
+
+std::string RtspOutput::describe(Connection const &conn) const
+{
+	char address[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &conn.local.sin_addr, address, sizeof(address));
+	std::string pt = std::to_string(RtpPacketiser::PAYLOAD_TYPE);
+
+	std::string sdp = "v=0\r\n";
+	sdp += "o=- " + std::to_string(packetiser_.Ssrc()) + " 1 IN IP4 " + address + "\r\n";
+	sdp += "s=rpicam-apps\r\n";
+	sdp += "c=IN IP4 0.0.0.0\r\n";
+	sdp += "t=0 0\r\n";
+	sdp += "a=control:*\r\n";
+	sdp += "m=video 0 RTP/AVP " + pt + "\r\n";
+	sdp += "a=rtpmap:" + pt + " H264/" + std::to_string(RtpPacketiser::CLOCK_RATE) + "\r\n";
+	sdp += "a=fmtp:" + pt + " packetization-mode=1";
+	if (sps_.size() >= 4 && !pps_.empty())
+	{
+		char profile[7];
+		snprintf(profile, sizeof(profile), "%02x%02x%02x", (uint8_t)sps_[1], (uint8_t)sps_[2], (uint8_t)sps_[3]);
+		sdp += std::string(";profile-level-id=") + profile;
+		sdp += ";sprop-parameter-sets=" + base64(sps_) + "," + base64(pps_);
+	}
+	sdp += "\r\n";
+	sdp += "a=control:track0\r\n";
+	return sdp;
+}
+
+void RtspOutput::queueOut(Connection &conn, std::string &&data)
+{
+	conn.out_bytes += data.size();
+	conn.out.push_back(std::move(data));
+}
+
+bool RtspOutput::flushConnection(int fd, Connection &conn)
+{
+	while (!conn.out.empty())
+	{
+		std::string const &data = conn.out.front();
+		ssize_t ret = send(fd, data.data() + conn.out_offset, data.size() - conn.out_offset, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		if (ret < 0)
+			return false;
+		conn.out_offset += ret;
+		conn.out_bytes -= ret;
+		if (conn.out_offset == data.size())
+		{
+			conn.out.pop_front();
+			conn.out_offset = 0;
+		}
+	}
+
+	// Only ask to hear that the socket is writable while we have something to write.
+	bool want_writable = !conn.out.empty();
+	if (want_writable != conn.want_writable)
+	{
+		epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP | (want_writable ? (uint32_t)EPOLLOUT : 0);
+		ev.data.fd = fd;
+		epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+		conn.want_writable = want_writable;
+	}
+	return true;
+}
+
+void RtspOutput::closeConnection(int fd)
+{
+	auto it = connections_.find(fd);
+	if (it == connections_.end())
+		return;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	unsigned int level = it->second.playing ? 1 : 2;
+	LOG(level, "RtspOutput: " << inet_ntoa(it->second.peer.sin_addr) << " disconnected");
+	connections_.erase(it);
+}
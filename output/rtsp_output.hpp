@@ -0,0 +1,85 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * rtsp_output.hpp - Serve the H.264 stream over RTSP.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+#include "rtp_packetiser.hpp"
+
+// A small RTSP server for rtsp:// outputs. Any number of clients can play the stream, with RTP
+// over UDP or interleaved on the RTSP connection, and each one starts at the next keyframe. The
+// packets are made once per buffer and shared by every client.
+class RtspOutput : public Output
+{
+public:
+	RtspOutput(VideoOptions const *options);
+	~RtspOutput();
+
+protected:
+	bool wantsPartialFrames() const override { return true; }
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	// An RTSP connection, which may hold one session.
+	struct Connection
+	{
+		sockaddr_in peer;
+		sockaddr_in local;
+		std::string in;
+		std::deque<std::string> out;
+		size_t out_offset; // how much of out.front() has gone already
+		size_t out_bytes;
+		bool want_writable;
+		std::string session;
+		bool playing;
+		bool waiting_keyframe;
+		bool interleaved;
+		uint8_t channel;
+		sockaddr_in rtp_addr;
+	};
+
+	void serverThread();
+	void acceptConnections();
+	bool readConnection(int fd, Connection &conn);
+	void handleRequest(Connection &conn, std::string const &request);
+	std::string describe(Connection const &conn) const;
+	void queueOut(Connection &conn, std::string &&data);
+	bool flushConnection(int fd, Connection &conn);
+	void closeConnection(int fd);
+	void cacheParameterSets(uint8_t const *mem, size_t size);
+	void wake();
+
+	// Past this amount, an interleaved client is too far behind and skips to the next keyframe.
+	static constexpr size_t MAX_CONNECTION_QUEUE = 8 << 20;
+
+	int listen_fd_;
+	int rtp_fd_;
+	int epoll_fd_;
+	int event_fd_;
+	uint16_t rtp_port_;
+	RtpPacketiser packetiser_;
+	std::vector<mmsghdr> msgs_;
+	std::mutex mutex_;
+	std::map<int, Connection> connections_;
+	std::string sps_;
+	std::string pps_;
+	bool frame_start_;
+	std::atomic<bool> keyframe_wanted_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+};
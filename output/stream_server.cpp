@@ -0,0 +1,333 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * stream_server.cpp - Serve an H.264 stream to any number of TCP or UNIX socket clients.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/thread_config.hpp"
+
+#include "stream_server.hpp"
+
+StreamServer::StreamServer(int port)
+	: gop_bytes_(0), gop_valid_(false), frame_start_(true), keyframe_wanted_(false), abort_(false)
+{
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open listen socket");
+
+	sockaddr_in server_saddr = {};
+	server_saddr.sin_family = AF_INET;
+	server_saddr.sin_addr.s_addr = INADDR_ANY;
+	server_saddr.sin_port = htons(port);
+
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt listen socket");
+
+	if (bind(listen_fd_, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
+		throw std::runtime_error("failed to bind listen socket");
+	if (listen(listen_fd_, 8) < 0)
+		throw std::runtime_error("failed to listen on socket");
+
+	start();
+	LOG(1, "Listening for clients on port " << port);
+}
+
+StreamServer::StreamServer(std::string const &path)
+	: path_(path), gop_bytes_(0), gop_valid_(false), frame_start_(true), keyframe_wanted_(false), abort_(false)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path_.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("stream socket path too long: " + path_);
+	strcpy(addr.sun_path, path_.c_str());
+
+	listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open listen socket");
+
+	unlink(path_.c_str());
+	if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 8) < 0)
+	{
+		close(listen_fd_);
+		throw std::runtime_error("unable to listen on stream socket " + path_ + ": " + strerror(errno));
+	}
+
+	start();
+	LOG(1, "Listening for clients on " << path_);
+}
+
+void StreamServer::start()
+{
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("unable to create stream server events");
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+	ev.data.fd = event_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &ev);
+
+	thread_ = std::thread(&StreamServer::serverThread, this);
+}
+
+StreamServer::~StreamServer()
+{
+	abort_ = true;
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		LOG_ERROR("WARNING: failed to wake stream server");
+	thread_.join();
+
+	for (auto const &[fd, client] : clients_)
+		close(fd);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+	if (!path_.empty())
+		unlink(path_.c_str());
+}
+
+bool StreamServer::Send(void const *mem, size_t size, bool keyframe, bool partial)
+{
+	// Clients can only start, or start again, at the first part of a keyframe.
+	bool resume = keyframe && frame_start_;
+	frame_start_ = !partial;
+	uint8_t const *data = static_cast<uint8_t const *>(mem);
+	Buffer buffer = std::make_shared<std::vector<uint8_t> const>(data, data + size);
+	bool fell_behind = false;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (resume)
+		{
+			cacheHeaders(data, size);
+			gop_.clear();
+			gop_bytes_ = 0;
+			gop_valid_ = true;
+		}
+		if (gop_valid_)
+		{
+			gop_.push_back(buffer);
+			gop_bytes_ += size;
+			if (gop_bytes_ > MAX_GOP_CACHE)
+			{
+				gop_.clear();
+				gop_valid_ = false;
+			}
+		}
+
+		for (auto &[fd, client] : clients_)
+		{
+			if (client.waiting_keyframe)
+			{
+				if (!resume)
+					continue;
+				client.waiting_keyframe = false;
+			}
+			client.queue.push_back(buffer);
+			client.queued += size;
+			if (client.queued > MAX_CLIENT_QUEUE)
+			{
+				// Keep whatever we're halfway through sending, so the stream only breaks between
+				// buffers.
+				LOG(1, "StreamServer: client " << client.name << " is too slow, skipping to the next keyframe");
+				Buffer front = client.offset ? client.queue.front() : nullptr;
+				client.queue.clear();
+				client.queued = 0;
+				if (front)
+				{
+					client.queue.push_back(front);
+					client.queued = front->size() - client.offset;
+				}
+				else
+					client.offset = 0;
+				client.waiting_keyframe = true;
+				fell_behind = true;
+			}
+		}
+	}
+
+	uint64_t one = 1;
+	if (write(event_fd_, &one, sizeof(one)) < 0)
+		LOG(2, "StreamServer: failed to wake server thread");
+	return fell_behind;
+}
+
+void StreamServer::cacheHeaders(uint8_t const *mem, size_t size)
+{
+	// Gather up the SPS and PPS NAL units at the start of a keyframe, which a new client needs if
+	// the stream doesn't repeat them with every keyframe.
+	std::vector<uint8_t> headers;
+	uint8_t const *end = mem + size, *nal = nullptr;
+	for (uint8_t const *p = mem; p + 3 < end; p++)
+	{
+		if (p[0] != 0 || p[1] != 0 || p[2] != 1)
+			continue;
+		if (nal)
+			headers.insert(headers.end(), nal, p[-1] == 0 ? p - 1 : p);
+		unsigned int type = p[3] & 0x1f;
+		if (type != 7 && type != 8)
+		{
+			nal = nullptr;
+			if (type == 1 || type == 5)
+				break; // the headers come before any slices
+		}
+		else
+			nal = p > mem && p[-1] == 0 ? p - 1 : p;
+	}
+	if (nal)
+		headers.insert(headers.end(), nal, end);
+	if (!headers.empty())
+		headers_ = std::make_shared<std::vector<uint8_t> const>(std::move(headers));
+}
+
+void StreamServer::serverThread()
+{
+	ThreadConfig::Get().Apply("server");
+	epoll_event events[16];
+	while (!abort_)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, 200);
+		std::vector<int> closed;
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptClients();
+			else if (fd == event_fd_)
+			{
+				uint64_t count;
+				if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+					LOG_ERROR("WARNING: stream server event read failed");
+			}
+			else if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+			{
+				// Clients have nothing to say to us, so anything readable is them going away.
+				char buf[256];
+				ssize_t ret = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+				if (ret == 0 || (ret < 0 && errno != EAGAIN) || (events[i].events & (EPOLLHUP | EPOLLERR)))
+					closed.push_back(fd);
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (int fd : closed)
+			closeClient(fd);
+		// Then send each client as much as its socket will take.
+		for (auto it = clients_.begin(); it != clients_.end();)
+		{
+			int fd = (it++)->first;
+			if (!flushClient(fd, clients_[fd]))
+				closeClient(fd);
+		}
+	}
+}
+
+void StreamServer::acceptClients()
+{
+	while (true)
+	{
+		sockaddr_in saddr = {};
+		socklen_t len = sizeof(saddr);
+		int fd = accept4(listen_fd_, path_.empty() ? (struct sockaddr *)&saddr : nullptr, path_.empty() ? &len : nullptr,
+						 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+
+		if (path_.empty())
+		{
+			int enable = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+		}
+		epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.fd = fd;
+		epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		Client &client = clients_[fd];
+		// Local clients have no address worth showing, so go by their fd.
+		if (path_.empty())
+			client.name = std::string(inet_ntoa(saddr.sin_addr)) + ":" + std::to_string(ntohs(saddr.sin_port));
+		else
+			client.name = path_ + "#" + std::to_string(fd);
+		client.offset = 0;
+		client.queued = 0;
+		client.want_writable = false;
+		client.waiting_keyframe = !gop_valid_;
+		if (gop_valid_)
+		{
+			if (headers_)
+				client.queue.push_back(headers_);
+			client.queue.insert(client.queue.end(), gop_.begin(), gop_.end());
+			for (auto const &buffer : client.queue)
+				client.queued += buffer->size();
+		}
+		else
+			keyframe_wanted_ = true;
+		LOG(1, "StreamServer: client " << client.name << " connected (" << clients_.size() << " clients)");
+	}
+}
+
+bool StreamServer::flushClient(int fd, Client &client)
+{
+	while (!client.queue.empty())
+	{
+		Buffer const &buffer = client.queue.front();
+		ssize_t ret = send(fd, buffer->data() + client.offset, buffer->size() - client.offset, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		if (ret < 0)
+			return false;
+		client.offset += ret;
+		client.queued -= ret;
+		if (client.offset == buffer->size())
+		{
+			client.queue.pop_front();
+			client.offset = 0;
+		}
+	}
+
+	// Only ask to hear that the socket is writable while we have something to write.
+	bool want_writable = !client.queue.empty();
+	if (want_writable != client.want_writable)
+	{
+		epoll_event ev = {};
+		ev.events = EPOLLIN | EPOLLRDHUP | (want_writable ? (uint32_t)EPOLLOUT : 0);
+		ev.data.fd = fd;
+		epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+		client.want_writable = want_writable;
+	}
+	return true;
+}
+
+void StreamServer::closeClient(int fd)
+{
+	auto it = clients_.find(fd);
+	if (it == clients_.end())
+		return;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	LOG(1, "StreamServer: client " << it->second.name << " disconnected");
+	clients_.erase(it);
+}
@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * stream_server.hpp - Serve an H.264 stream to any number of TCP or UNIX socket clients.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Listens for TCP (or local, UNIX socket) clients and fans the encoded stream out to all of them. Each new client gets
+// the latest SPS/PPS and everything since the last keyframe, so that it can start decoding at
+// once. A client that can't keep up has its queue thrown away and picks up again at the next
+// keyframe, so the encoder is never held up by the network.
+class StreamServer
+{
+public:
+	StreamServer(int port);
+	StreamServer(std::string const &path);
+	~StreamServer();
+
+	// Queue a buffer for every client, without blocking. Returns true if any client fell behind.
+	bool Send(void const *mem, size_t size, bool keyframe, bool partial);
+	// Returns true, once, if a client has joined since the last keyframe we could give it.
+	bool KeyframeWanted() { return keyframe_wanted_.exchange(false); }
+
+private:
+	using Buffer = std::shared_ptr<std::vector<uint8_t> const>;
+
+	struct Client
+	{
+		std::string name;
+		std::deque<Buffer> queue;
+		size_t offset; // how much of queue.front() has gone already
+		size_t queued;
+		bool waiting_keyframe;
+		bool want_writable;
+	};
+
+	void start();
+	void serverThread();
+	void acceptClients();
+	bool flushClient(int fd, Client &client);
+	void closeClient(int fd);
+	void cacheHeaders(uint8_t const *mem, size_t size);
+
+	// Past this amount, a client is too far behind and skips to the next keyframe.
+	static constexpr size_t MAX_CLIENT_QUEUE = 8 << 20;
+	// Stop caching a very long GOP, and make new clients wait for the next keyframe instead.
+	static constexpr size_t MAX_GOP_CACHE = 16 << 20;
+
+	std::string path_; // only for a UNIX socket
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_;
+	std::mutex mutex_;
+	std::map<int, Client> clients_;
+	std::vector<Buffer> gop_;
+	size_t gop_bytes_;
+	bool gop_valid_;
+	Buffer headers_;
+	bool frame_start_;
+	std::atomic<bool> keyframe_wanted_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+};
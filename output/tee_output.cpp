@@ -0,0 +1,229 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * tee_output.cpp - send the encoded stream to several outputs at once.
+ */
+
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/thread_config.hpp"
+
+#include "tee_output.hpp"
+
+TeeOutput::TeeOutput(VideoOptions const *options)
+	: Output(options, false), pool_(std::make_shared<BufferPool>())
+{
+	bool libav = options->Get().codec == "libav" ||
+				 (options->Get().codec == "h264" && options->GetPlatform() != Platform::VC4);
+	if (libav)
+		throw std::runtime_error("TeeOutput: libav writes its own output, so cannot be used with --tee-output");
+
+	addChild(options->Get().output, true);
+	for (auto const &destination : options->Get().tee_output)
+		addChild(destination, false);
+}
+
+TeeOutput::~TeeOutput()
+{
+	for (auto &child : children_)
+	{
+		{
+			std::lock_guard<std::mutex> lock(child->mutex);
+			child->abort = true;
+		}
+		child->cv.notify_all();
+	}
+	for (auto &child : children_)
+		child->thread.join();
+	// The outputs flush and close their files as they go.
+	children_.clear();
+}
+
+void TeeOutput::addChild(std::string const &destination, bool primary)
+{
+	auto child = std::make_unique<Child>();
+	child->options = options_->Clone();
+	VideoOptions &options = *child->options;
+	options.Set().tee_output.clear();
+	options.Set().output = destination;
+
+	// Only the first output writes the metadata and timestamp files, and the others get just the stream.
+	if (!primary)
+	{
+		options.Set().metadata.clear();
+		options.Set().save_pts.clear();
+		options.Set().hls.clear();
+		options.Set().circular = 0;
+		options.Set().circular_file.clear();
+		options.Set().clip_output.clear();
+		if (destination.rfind("circular:", 0) == 0)
+		{
+			options.Set().output = destination.substr(strlen("circular:"));
+			options.Set().circular = options_->Get().circular ? options_->Get().circular : 4;
+			options.Set().circular_file = options_->Get().circular_file;
+			options.Set().clip_output = options_->Get().clip_output;
+		}
+	}
+
+	child->name = options.Get().output.empty() ? "(none)" : options.Get().output;
+	child->output = std::unique_ptr<Output>(Output::CreateSingle(child->options.get()));
+	child->output->SetFeedbackCallback([this](Feedback feedback) { childFeedback(feedback); });
+	child->droppable = !primary;
+	Child &c = *child;
+	children_.push_back(std::move(child));
+	c.thread = std::thread(&TeeOutput::childThread, this, std::ref(c));
+	LOG(2, "TeeOutput: output to " << c.name << (primary ? " (primary)" : ""));
+}
+
+void TeeOutput::Signal()
+{
+	for (auto &child : children_)
+		child->output->Signal();
+}
+
+void TeeOutput::Trigger()
+{
+	for (auto &child : children_)
+		child->output->Trigger();
+}
+
+TeeOutput::Data TeeOutput::makeData(void *mem, size_t size)
+{
+	std::unique_ptr<std::vector<uint8_t>> buffer;
+	{
+		std::lock_guard<std::mutex> lock(pool_->mutex);
+		if (!pool_->free.empty())
+		{
+			buffer = std::move(pool_->free.back());
+			pool_->free.pop_back();
+		}
+	}
+	if (!buffer)
+		buffer = std::make_unique<std::vector<uint8_t>>();
+	buffer->assign(static_cast<uint8_t const *>(mem), static_cast<uint8_t const *>(mem) + size);
+
+	// The buffer goes back to the pool when the last output lets go of it. The pool holds on to
+	// its own memory, so is safe to use even if we've gone by then.
+	std::shared_ptr<BufferPool> pool = pool_;
+	return Data(buffer.release(), [pool](std::vector<uint8_t> const *b) {
+		std::lock_guard<std::mutex> lock(pool->mutex);
+		pool->free.emplace_back(const_cast<std::vector<uint8_t> *>(b));
+	});
+}
+
+void TeeOutput::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe, bool partial)
+{
+	Data data = makeData(mem, size);
+	for (auto &child : children_)
+		queueItem(*child, { data, timestamp_us, keyframe, partial, nullptr, 0 });
+}
+
+void TeeOutput::MetadataReady(libcamera::ControlList &metadata, unsigned int sequence)
+{
+	// Only the first output wants these, for the metadata and timestamp files.
+	queueItem(*children_[0],
+			  { nullptr, 0, false, false, std::make_unique<libcamera::ControlList>(metadata), sequence });
+}
+
+void TeeOutput::queueItem(Child &child, Item &&item)
+{
+	std::unique_lock<std::mutex> lock(child.mutex);
+	if (!child.error.empty())
+		throw std::runtime_error("TeeOutput: " + child.name + ": " + child.error);
+	if (item.metadata)
+	{
+		child.queue.push_back(std::move(item));
+		lock.unlock();
+		child.cv.notify_one();
+		return;
+	}
+
+	// Decide at the start of each frame whether any of it gets queued.
+	size_t size = item.data->size();
+	bool frame_start = !child.in_frame;
+	child.in_frame = item.partial;
+	if (frame_start && child.droppable)
+	{
+		if (child.waiting_keyframe && !item.keyframe)
+			return;
+		child.waiting_keyframe = false;
+		if (child.queued_bytes + size > MAX_QUEUED && !child.queue.empty())
+		{
+			LOG(2, "TeeOutput: " << child.name << " fell behind, dropping frames until the next keyframe");
+			child.waiting_keyframe = true;
+			lock.unlock();
+			childFeedback(Feedback::KeyframeNeeded);
+			return;
+		}
+	}
+	else if (child.waiting_keyframe)
+		return; // the rest of a frame being dropped
+	else if (frame_start)
+	{
+		// Anything the first output is given must be written, so we wait.
+		child.cv.wait(lock, [&]() {
+			return child.queued_bytes + size <= MAX_QUEUED || child.queue.empty() || !child.error.empty();
+		});
+		if (!child.error.empty())
+			throw std::runtime_error("TeeOutput: " + child.name + ": " + child.error);
+	}
+
+	child.queued_bytes += size;
+	child.queue.push_back(std::move(item));
+	lock.unlock();
+	child.cv.notify_one();
+}
+
+void TeeOutput::childThread(Child &child)
+{
+	ThreadConfig::Get().Apply("tee-output");
+	bool failed = false;
+
+	while (true)
+	{
+		std::unique_lock<std::mutex> lock(child.mutex);
+		child.cv.wait(lock, [&]() { return child.abort || !child.queue.empty(); });
+		if (child.queue.empty())
+			break;
+		Item item = std::move(child.queue.front());
+		child.queue.pop_front();
+		lock.unlock();
+
+		// After a failure we just throw the data away. The error comes out with the next frame.
+		if (!failed)
+		{
+			try
+			{
+				if (item.metadata)
+					child.output->MetadataReady(*item.metadata, item.sequence);
+				else
+					child.output->OutputReady(const_cast<uint8_t *>(item.data->data()), item.data->size(),
+											  item.timestamp_us, item.keyframe, item.partial);
+			}
+			catch (std::exception const &e)
+			{
+				failed = true;
+				std::lock_guard<std::mutex> error_lock(child.mutex);
+				child.error = e.what();
+			}
+		}
+
+		lock.lock();
+		if (item.data)
+			child.queued_bytes -= item.data->size();
+		lock.unlock();
+		// Let go of the data before waking anyone waiting for space.
+		item.data.reset();
+		child.cv.notify_all();
+	}
+}
+
+void TeeOutput::childFeedback(Feedback feedback)
+{
+	// The outputs all report from their own threads.
+	std::lock_guard<std::mutex> lock(feedback_mutex_);
+	this->feedback(feedback);
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * tee_output.hpp - send the encoded stream to several outputs at once.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// The TeeOutput passes everything from the encoder on to the --output and to each --tee-output.
+// Each of these is an ordinary Output with its own options, so it keeps its own pause, segment and
+// keyframe handling, and each runs on a thread of its own.
+//
+// Every encoded buffer is copied once, into a pooled buffer that all the outputs share. The first
+// output gets the metadata and timestamps, and never drops anything, waiting for space instead.
+// The others drop frames until the next keyframe when they fall too far behind, so a slow network
+// client never holds up the file being written.
+
+class TeeOutput : public Output
+{
+public:
+	TeeOutput(VideoOptions const *options);
+	~TeeOutput();
+	void Signal() override;
+	void Trigger() override;
+	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe, bool partial) override;
+	void MetadataReady(libcamera::ControlList &metadata, unsigned int sequence) override;
+
+private:
+	typedef std::shared_ptr<std::vector<uint8_t> const> Data;
+
+	struct Item
+	{
+		Data data;
+		int64_t timestamp_us;
+		bool keyframe;
+		bool partial;
+		// Set for metadata, rather than data.
+		std::unique_ptr<libcamera::ControlList> metadata;
+		unsigned int sequence;
+	};
+
+	struct Child
+	{
+		std::string name;
+		std::unique_ptr<VideoOptions> options;
+		std::unique_ptr<Output> output;
+		bool droppable;
+		std::deque<Item> queue;
+		size_t queued_bytes = 0;
+		bool waiting_keyframe = false;
+		bool in_frame = false; // the last part queued was partial
+		bool abort = false;
+		std::string error;
+		std::mutex mutex;
+		std::condition_variable cv;
+		std::thread thread;
+	};
+
+	// Keep this much queued for each output, at most.
+	static constexpr size_t MAX_QUEUED = 8 << 20;
+
+	void addChild(std::string const &destination, bool primary);
+	void queueItem(Child &child, Item &&item);
+	void childThread(Child &child);
+	Data makeData(void *mem, size_t size);
+	void childFeedback(Feedback feedback);
+
+	// Buffers come back here when the last output is done with them.
+	struct BufferPool
+	{
+		std::mutex mutex;
+		std::vector<std::unique_ptr<std::vector<uint8_t>>> free;
+	};
+
+	std::vector<std::unique_ptr<Child>> children_;
+	std::mutex feedback_mutex_;
+	std::shared_ptr<BufferPool> pool_;
+};
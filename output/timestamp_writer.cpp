@@ -0,0 +1,107 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * timestamp_writer.cpp - Write the --save-pts file from a background thread.
+ */
+
+#include <cinttypes>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/thread_config.hpp"
+
+#include "timestamp_writer.hpp"
+
+TimestampWriter::TimestampWriter(std::string const &filename, std::string const &format, bool flush)
+	: format_(format), flush_(flush), abort_(false)
+{
+	fp_ = fopen(filename.c_str(), "w");
+	if (!fp_)
+		throw std::runtime_error("Failed to open timestamp file " + filename);
+
+	if (format_ == "bin")
+	{
+		FileHeader header = {};
+		memcpy(header.magic, "RPIPTS01", sizeof(header.magic));
+		header.version = 1;
+		header.record_size = sizeof(Record);
+		fwrite(&header, sizeof(header), 1, fp_);
+	}
+	else if (format_ == "txt")
+		fprintf(fp_, "# rpicam-apps timestamps v1\n# pts_ms sensor_ns wallclock_ns sequence\n");
+	else
+		fprintf(fp_, "# timecode format v2\n");
+
+	pending_.reserve(BATCH);
+	thread_ = std::thread(&TimestampWriter::writerThread, this);
+}
+
+TimestampWriter::~TimestampWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cv_.notify_one();
+	thread_.join();
+	fclose(fp_);
+}
+
+void TimestampWriter::Write(Record const &record)
+{
+	bool wake;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		pending_.push_back(record);
+		wake = flush_ || pending_.size() >= BATCH;
+	}
+	if (wake)
+		cv_.notify_one();
+}
+
+void TimestampWriter::writerThread()
+{
+	ThreadConfig::Get().Apply("file-writer");
+
+	std::vector<Record> records;
+	records.reserve(BATCH);
+	while (true)
+	{
+		bool done;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cv_.wait(lock, [this] { return abort_ || pending_.size() >= (flush_ ? 1 : BATCH); });
+			records.swap(pending_);
+			done = abort_;
+		}
+		writeRecords(records);
+		records.clear();
+		if (done)
+			break;
+	}
+}
+
+void TimestampWriter::writeRecords(std::vector<Record> const &records)
+{
+	if (records.empty())
+		return;
+
+	if (format_ == "bin")
+		fwrite(records.data(), sizeof(Record), records.size(), fp_);
+	else
+	{
+		for (Record const &r : records)
+		{
+			fprintf(fp_, "%" PRId64 ".%03" PRId64, r.pts_us / 1000, r.pts_us % 1000);
+			if (format_ == "txt")
+				fprintf(fp_, " %" PRId64 " %" PRId64 " %" PRIu32, r.sensor_ns, r.wallclock_ns, r.sequence);
+			fputc('\n', fp_);
+		}
+	}
+	if (flush_)
+		fflush(fp_);
+	if (ferror(fp_))
+		LOG_ERROR("WARNING: failed to write timestamps");
+}
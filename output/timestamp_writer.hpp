@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * timestamp_writer.hpp - Write the --save-pts file from a background thread.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Records are batched up and written by a thread of their own, so the encoder's output thread never
+// waits on the file. The "v2" format is the mkvmerge timecode v2 file we have always written, with
+// only the presentation times. "txt" adds the sensor and wall clock timestamps and the sequence
+// number as further columns, and "bin" writes a FileHeader followed by one Record per frame, in the
+// machine's byte order. utils/timestamp.py reads all three.
+class TimestampWriter
+{
+public:
+	struct FileHeader
+	{
+		char magic[8]; // "RPIPTS01"
+		uint32_t version;
+		uint32_t record_size;
+	};
+
+	struct Record
+	{
+		int64_t pts_us; // as given to the output, so continuous across pauses
+		int64_t sensor_ns; // start of exposure, from the sensor's clock
+		int64_t wallclock_ns; // 0 if libcamera didn't tell us
+		uint32_t sequence;
+		uint32_t reserved;
+	};
+
+	TimestampWriter(std::string const &filename, std::string const &format, bool flush);
+	~TimestampWriter();
+
+	void Write(Record const &record);
+
+private:
+	static constexpr unsigned int BATCH = 64;
+
+	void writerThread();
+	void writeRecords(std::vector<Record> const &records);
+
+	FILE *fp_;
+	std::string format_;
+	bool flush_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::vector<Record> pending_;
+	bool abort_;
+	std::thread thread_;
+};
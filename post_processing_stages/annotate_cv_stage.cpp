@@ -7,8 +7,19 @@
 
 // The text string can include the % directives supported by FrameInfo.
 
+// The text is drawn into a small mask that we keep until the text changes, and each frame we
+// only blend that onto the rows it covers.
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <mutex>
 #include <time.h>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <libcamera/stream.h>
 
 #include "core/frame_info.hpp"
@@ -47,6 +58,17 @@ private:
 	double alpha_;
 	double adjusted_scale_;
 	int adjusted_thickness_;
+	// The text is drawn into the mask (255 where it's on), and the background box covers the
+	// top left box_width x box_height of it. Frames being annotated at the same time can share one.
+	struct Sprite
+	{
+		std::string text;
+		Mat mask;
+		int box_width;
+		int box_height;
+	};
+	std::shared_ptr<Sprite const> sprite_;
+	std::mutex sprite_mutex_;
 };
 
 #define NAME "annotate_cv"
@@ -78,6 +100,35 @@ void AnnotateCvStage::Configure()
 	// rather harshly quantised, not much we can do about that.
 	adjusted_scale_ = scale_ * info_.width / 1200;
 	adjusted_thickness_ = std::max(thickness_ * info_.width / 700, 1u);
+	sprite_.reset();
+}
+
+// Blend the background box over the first blend_n pixels, with alpha having 8 fractional bits,
+// and then set the text pixels to the foreground value.
+
+static void blit_row(uint8_t *dst, uint8_t const *mask, int n, int blend_n, uint8_t fg, uint8_t bg, unsigned int alpha)
+{
+	int x = 0;
+	uint16_t bg_alpha = bg * alpha, inv_alpha = 256 - alpha;
+#if defined(__ARM_NEON)
+	uint8x16_t fg_v = vdupq_n_u8(fg);
+	uint16x8_t bg_v = vdupq_n_u16(bg_alpha);
+	for (; x + 16 <= blend_n; x += 16)
+	{
+		uint8x16_t p = vld1q_u8(dst + x);
+		uint16x8_t lo = vmlaq_n_u16(bg_v, vmovl_u8(vget_low_u8(p)), inv_alpha);
+		uint16x8_t hi = vmlaq_n_u16(bg_v, vmovl_u8(vget_high_u8(p)), inv_alpha);
+		uint8x16_t blend = vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8));
+		vst1q_u8(dst + x, vbslq_u8(vld1q_u8(mask + x), fg_v, blend));
+	}
+#endif
+	for (; x < blend_n; x++)
+		dst[x] = mask[x] ? fg : (bg_alpha + inv_alpha * dst[x]) >> 8;
+	for (; x < n; x++)
+	{
+		if (mask[x])
+			dst[x] = fg;
+	}
 }
 
 bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
@@ -95,20 +146,35 @@ bool AnnotateCvStage::Process(CompletedRequestPtr &completed_request)
 	if (strftime(text_with_date, sizeof(text_with_date), text.c_str(), tm_ptr) != 0)
 		text = std::string(text_with_date);
 
-	uint8_t *ptr = (uint8_t *)buffer.data();
-	Mat im(info_.height, info_.width, CV_8U, ptr, info_.stride);
-	int font = FONT_HERSHEY_SIMPLEX;
-
-	int baseline = 0;
-	Size size = getTextSize(text, font, adjusted_scale_, adjusted_thickness_, &baseline);
-
-	// Can't find a handy "draw rectangle with alpha" function...
-	for (int y = 0; y < size.height + baseline; y++, ptr += info_.stride)
+	std::shared_ptr<Sprite const> sprite;
 	{
-		for (int x = 0; x < size.width; x++)
-			ptr[x] = bg_ * alpha_ + (1 - alpha_) * ptr[x];
+		std::lock_guard<std::mutex> lock(sprite_mutex_);
+		if (!sprite_ || sprite_->text != text)
+		{
+			int font = FONT_HERSHEY_SIMPLEX;
+			int baseline = 0;
+			Size size = getTextSize(text, font, adjusted_scale_, adjusted_thickness_, &baseline);
+
+			// The strokes can stick out of the box by up to their thickness.
+			auto new_sprite = std::make_shared<Sprite>();
+			int width = std::min<int>(size.width + adjusted_thickness_, info_.width);
+			int height = std::min<int>(size.height + baseline + adjusted_thickness_, info_.height);
+			new_sprite->mask = Mat::zeros(std::max(height, 1), std::max(width, 1), CV_8U);
+			putText(new_sprite->mask, text, Point(0, size.height), font, adjusted_scale_, 255, adjusted_thickness_,
+					0);
+			new_sprite->box_width = std::min(size.width, width);
+			new_sprite->box_height = std::min(size.height + baseline, height);
+			new_sprite->text = text;
+			sprite_ = std::move(new_sprite);
+		}
+		sprite = sprite_;
 	}
-	putText(im, text, Point(0, size.height), font, adjusted_scale_, fg_, adjusted_thickness_, 0);
+
+	uint8_t *ptr = (uint8_t *)buffer.data();
+	unsigned int alpha = std::lround(std::clamp(alpha_, 0.0, 1.0) * 256);
+	for (int y = 0; y < sprite->mask.rows; y++, ptr += info_.stride)
+		blit_row(ptr, sprite->mask.ptr<uint8_t>(y), sprite->mask.cols, y < sprite->box_height ? sprite->box_width : 0,
+				 fg_, bg_, alpha);
 
 	return false;
 }
@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * cv_workspace.hpp - Mats that the OpenCV stages keep from one frame to the next.
+ */
+
+#pragma once
+
+#include <sched.h>
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <libcamera/stream.h>
+
+#include "opencv2/core.hpp"
+
+#include "core/stream_info.hpp"
+
+/*
+ * OpenCV functions given an empty (or wrongly sized) output Mat allocate it, so a stage that declares
+ * its intermediates afresh in every Process() call allocates, and page faults in, several frames' worth
+ * of memory each time. Instead a stage keeps a CvWorkspace of some struct of Mats T, and takes one
+ * from it for each frame. The Mats are only allocated the first time, as cv::Mat::create() leaves a Mat
+ * that is already the right size and type alone. As Process() may run on several frames at once, each
+ * call gets a T of its own, so there are only ever as many as the frames in flight. They are kept per
+ * stream, which keeps their sizes steady when a stage works on more than one.
+ */
+template <typename T>
+class CvWorkspace
+{
+public:
+	using Lease = std::unique_ptr<T, std::function<void(T *)>>;
+
+	// A T for the stream that no other caller holds. It goes back to the workspace when the Lease goes,
+	// which must be before the workspace does.
+	Lease Acquire(libcamera::Stream *stream)
+	{
+		std::unique_ptr<T> entry;
+		{
+			std::scoped_lock lock(mutex_);
+			std::vector<std::unique_ptr<T>> &free = free_[stream];
+			if (!free.empty())
+			{
+				entry = std::move(free.back());
+				free.pop_back();
+			}
+		}
+		if (!entry)
+			entry = std::make_unique<T>();
+		return Lease(entry.release(), [this, stream](T *t) {
+			std::scoped_lock lock(mutex_);
+			free_[stream].emplace_back(t);
+		});
+	}
+
+	// Drop everything, for when the streams are being configured again. Nobody may hold a Lease.
+	void Reset()
+	{
+		std::scoped_lock lock(mutex_);
+		free_.clear();
+	}
+
+private:
+	std::mutex mutex_;
+	std::map<libcamera::Stream *, std::vector<std::unique_ptr<T>>> free_;
+};
+
+// The first plane of a stream buffer as an 8 bit Mat. Only the header is made, the pixels stay put.
+inline cv::Mat cv_wrap(void *ptr, StreamInfo const &info)
+{
+	return cv::Mat(info.height, info.width, CV_8U, ptr, info.stride);
+}
+
+// OpenCV starts as many pool threads as there are CPUs, and they inherit the CPU affinity of the thread
+// that first runs something in parallel. With the post processing threads restricted by --thread, that
+// means more pool threads than CPUs to run them on, so the stages call this from Process() to size the
+// pool to the CPUs the calling thread may use. Only the first call does anything.
+inline void cv_bind_threads()
+{
+	static std::once_flag once;
+	std::call_once(once, [] {
+		cpu_set_t set;
+		if (sched_getaffinity(0, sizeof(set), &set) == 0)
+			cv::setNumThreads(CPU_COUNT(&set));
+	});
+}
@@ -13,10 +13,12 @@
 #include <memory>
 #include <vector>
 
+#include <libcamera/formats.h>
 #include <libcamera/geometry.h>
 
 #include "core/rpicam_app.hpp"
 
+#include "post_processing_stages/cv_workspace.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include "opencv2/imgproc.hpp"
@@ -35,6 +37,8 @@ public:
 
 	void Read(boost::property_tree::ptree const &params) override;
 
+	bool GetLoresRequest(LoresRequest &request) override;
+
 	void Configure() override;
 
 	bool Process(CompletedRequestPtr &completed_request) override;
@@ -43,6 +47,7 @@ public:
 
 private:
 	void detectFeatures(cv::CascadeClassifier &cascade);
+	std::vector<cv::Rect> trackFeatures(cv::CascadeClassifier &cascade);
 	void drawFeatures(cv::Mat &img);
 
 	Stream *stream_;
@@ -62,6 +67,13 @@ private:
 	int max_size_;
 	int refresh_rate_;
 	int draw_features_;
+	// Between full scans, we look only around the faces we last found. Only the detection thread
+	// touches these.
+	int full_scan_period_;
+	double track_margin_;
+	libcamera::Size lores_size_;
+	unsigned int detections_;
+	std::vector<cv::Rect> tracked_faces_;
 };
 
 #define NAME "face_detect_cv"
@@ -83,12 +95,26 @@ void FaceDetectCvStage::Read(boost::property_tree::ptree const &params)
 	max_size_ = params.get<int>("max_size", 256);
 	refresh_rate_ = params.get<int>("refresh_rate", 5);
 	draw_features_ = params.get<int>("draw_features", 1);
+	full_scan_period_ = params.get<int>("full_scan_period", 1);
+	track_margin_ = params.get<double>("track_margin", 0.5);
+	// The lores size to ask for, when none is given.
+	lores_size_ = libcamera::Size(params.get<unsigned int>("lores_width", 640),
+								  params.get<unsigned int>("lores_height", 480));
+}
+
+bool FaceDetectCvStage::GetLoresRequest(LoresRequest &request)
+{
+	request.size = lores_size_;
+	request.format = libcamera::formats::YUV420;
+	return true;
 }
 
 void FaceDetectCvStage::Configure()
 {
 	stream_ = nullptr;
 	full_stream_ = nullptr;
+	detections_ = 0;
+	tracked_faces_.clear();
 
 	if (app_->StillStream()) // for stills capture, do nothing
 		return;
@@ -99,6 +125,8 @@ void FaceDetectCvStage::Configure()
 		throw std::runtime_error("FaceDetectCvStage: no low resolution stream");
 	// (the lo res stream can only be YUV420)
 	low_res_info_ = app_->GetStreamInfo(stream_);
+	// The detection thread's copy of the image, allocated the once and copied into thereafter.
+	image_.create(low_res_info_.height, low_res_info_.width, CV_8U);
 
 	// We also expect there to be a "full resolution" stream which defines the output coordinate
 	// system, and we can optionally draw the faces there too.
@@ -123,8 +151,9 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 			BufferReadSync r(app_, completed_request->buffers[stream_]);
 			libcamera::Span<uint8_t> buffer = r.Get()[0];
 			uint8_t *ptr = (uint8_t *)buffer.data();
-			Mat image(low_res_info_.height, low_res_info_.width, CV_8U, ptr, low_res_info_.stride);
-			image_ = image.clone();
+			// The detection thread has finished with image_, so we can copy over it.
+			cv_wrap(ptr, low_res_info_).copyTo(image_);
+			cv_bind_threads();
 
 			future_ptr_ = std::make_unique<std::future<void>>();
 			*future_ptr_ = std::async(std::launch::async, [this] { detectFeatures(cascade_); });
@@ -143,7 +172,7 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 		BufferWriteSync w(app_, completed_request->buffers[full_stream_]);
 		libcamera::Span<uint8_t> buffer = w.Get()[0];
 		uint8_t *ptr = (uint8_t *)buffer.data();
-		Mat image(full_stream_info_.height, full_stream_info_.width, CV_8U, ptr, full_stream_info_.stride);
+		Mat image = cv_wrap(ptr, full_stream_info_);
 		drawFeatures(image);
 	}
 
@@ -154,9 +183,16 @@ void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
 {
 	equalizeHist(image_, image_);
 
+	// Scan the whole image every full_scan_period_ detections, or whenever we've lost track of
+	// everything. The rest of the time, look only where the faces were.
 	std::vector<Rect> temp_faces;
-	cascade.detectMultiScale(image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
-							 Size(min_size_, min_size_), Size(max_size_, max_size_));
+	if (full_scan_period_ <= 1 || tracked_faces_.empty() || detections_ % full_scan_period_ == 0)
+		cascade.detectMultiScale(image_, temp_faces, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
+								 Size(min_size_, min_size_), Size(max_size_, max_size_));
+	else
+		temp_faces = trackFeatures(cascade);
+	detections_++;
+	tracked_faces_ = temp_faces;
 
 	// Scale faces back to the size and location in the full res image.
 	double scale_x = full_stream_info_.width / (double)low_res_info_.width;
@@ -172,6 +208,38 @@ void FaceDetectCvStage::detectFeatures(CascadeClassifier &cascade)
 	faces_ = std::move(temp_faces);
 }
 
+// Search a region around each of the faces we found last time, big enough to catch it having
+// moved by track_margin_ of its size in any direction.
+
+std::vector<Rect> FaceDetectCvStage::trackFeatures(CascadeClassifier &cascade)
+{
+	Rect bounds(0, 0, image_.cols, image_.rows);
+	std::vector<Rect> faces;
+	for (auto const &face : tracked_faces_)
+	{
+		int dx = face.width * track_margin_, dy = face.height * track_margin_;
+		Rect search = Rect(face.x - dx, face.y - dy, face.width + 2 * dx, face.height + 2 * dy) & bounds;
+		int max_size = std::min({ max_size_, search.width, search.height });
+		if (max_size < min_size_)
+			continue;
+
+		std::vector<Rect> found;
+		cascade.detectMultiScale(image_(search), found, scaling_factor_, min_neighbors_, CASCADE_SCALE_IMAGE,
+								 Size(min_size_, min_size_), Size(max_size, max_size));
+
+		// Neighbouring faces have overlapping search regions, so don't report anything twice.
+		for (auto r : found)
+		{
+			r.x += search.x;
+			r.y += search.y;
+			Point centre(r.x + r.width / 2, r.y + r.height / 2);
+			if (std::none_of(faces.begin(), faces.end(), [&centre](Rect const &f) { return f.contains(centre); }))
+				faces.push_back(r);
+		}
+	}
+	return faces;
+}
+
 void FaceDetectCvStage::drawFeatures(Mat &img)
 {
 	const static Scalar colors[] = {
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_cache.hpp - Images made from a frame's buffers, shared between post processing stages.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// One of these lives in each request's post_process_metadata while stages ask for things from it,
+// and goes when the request is re-used. The first stage to ask for something (a copy of a stream,
+// or an RGB version of it at some size) makes it, and any later stages are given the same one.
+// What's returned is shared, so a stage may keep it after the request has gone.
+class FrameCache
+{
+public:
+	template <typename T, typename F>
+	std::shared_ptr<T const> Get(std::string const &key, F &&make)
+	{
+		std::scoped_lock lock(mutex_);
+		std::shared_ptr<void const> &entry = entries_[key];
+		if (!entry)
+			entry = std::make_shared<T const>(make());
+		return std::static_pointer_cast<T const>(entry);
+	}
+
+private:
+	// Making one thing may need another (an RGB image starts from the stream copy, say).
+	std::recursive_mutex mutex_;
+	// Keys say what type the entry has, as well as how it was made.
+	std::map<std::string, std::shared_ptr<void const>> entries_;
+};
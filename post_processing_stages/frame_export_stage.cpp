@@ -0,0 +1,165 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_export_stage.cpp - Share each frame with other processes without copying it.
+ */
+
+// Publishes the dmabuf fd of every frame of the chosen stream over a UNIX socket, along with its
+// format and metadata, so that other processes on the same machine can read frames in place. See
+// core/frame_exporter.hpp for the protocol. A frame stays out of the camera's hands while any
+// client holds it, so the camera needs enough buffers for the clients' credits on top of its own;
+// --buffer-count (or --viewfinder-buffer-count) can add them.
+//
+// Clients see the buffer as soon as it's published, so this must be the last stage in the file. Anything
+// a later stage drew on the frame could turn up in a client's copy half done, or not at all.
+
+#include <sstream>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/stream.h>
+
+#include "core/buffer_sync.hpp"
+#include "core/frame_exporter.hpp"
+#include "core/rpicam_app.hpp"
+
+#include "output/output.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+class FrameExportStage : public PostProcessingStage
+{
+public:
+	FrameExportStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	// Frames go out in the order they arrive.
+	Concurrency GetConcurrency() const override { return Concurrency::Ordered; }
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	void Start() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	void Stop() override;
+
+	void Teardown() override;
+
+private:
+	struct Config
+	{
+		std::string socket;
+		std::string stream;
+		unsigned int credits;
+		unsigned int hold_timeout_ms;
+		unsigned int max_clients;
+		bool metadata;
+	} config_;
+	Stream *stream_ = nullptr;
+	StreamInfo info_;
+	std::unique_ptr<FrameExporter> exporter_;
+	// Frames taken back from the clients when the camera last stopped.
+	std::vector<std::shared_ptr<void>> revoked_;
+};
+
+#define NAME "frame_export"
+
+char const *FrameExportStage::Name() const
+{
+	return NAME;
+}
+
+void FrameExportStage::Read(boost::property_tree::ptree const &params)
+{
+	config_.socket = params.get<std::string>("socket", "/tmp/rpicam-frames.sock");
+	config_.stream = params.get<std::string>("stream", "lores");
+	if (config_.stream != "main" && config_.stream != "lores")
+		throw std::runtime_error("FrameExportStage: stream must be main or lores");
+	config_.credits = std::max(params.get<unsigned int>("credits", 2), 1u);
+	config_.hold_timeout_ms = params.get<unsigned int>("hold_timeout_ms", 1000);
+	config_.max_clients = std::max(params.get<unsigned int>("max_clients", 4), 1u);
+	config_.metadata = params.get<bool>("metadata", true);
+}
+
+void FrameExportStage::Configure()
+{
+	stream_ = config_.stream == "lores" ? app_->LoresStream() : app_->GetMainStream();
+	// Fall back to the main stream when there isn't a lores one.
+	if (!stream_)
+		stream_ = app_->GetMainStream();
+	if (!stream_)
+		return;
+	info_ = app_->GetStreamInfo(stream_);
+
+	// Clients stay connected across camera reconfigurations, though the frames they get may change format.
+	if (!exporter_)
+		exporter_ = std::make_unique<FrameExporter>(config_.socket, config_.credits,
+													std::chrono::milliseconds(config_.hold_timeout_ms),
+													config_.max_clients);
+}
+
+void FrameExportStage::Start()
+{
+	revoked_.clear();
+}
+
+bool FrameExportStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_ || !exporter_ || !exporter_->HasClients())
+		return false;
+
+	auto it = completed_request->buffers.find(stream_);
+	if (it == completed_request->buffers.end())
+		return false;
+
+	FrameExporter::Frame frame;
+	frame.fd = it->second->planes()[0].fd.get();
+	frame.size = stream_->configuration().frameSize;
+	frame.info = info_;
+	frame.sequence = completed_request->sequence;
+	frame.timestamp_us = completed_request->metadata.get(libcamera::controls::SensorTimestamp).value_or(0) / 1000;
+	if (config_.metadata)
+	{
+		std::stringbuf buf;
+		write_metadata(&buf, "json", completed_request->metadata, true);
+		frame.metadata_json = buf.str();
+	}
+	// Holding the request keeps its buffers from being queued back to the camera.
+	frame.hold = completed_request;
+
+	// The earlier stages' writes to the buffer are otherwise only synced once the request leaves the
+	// post-processor, after the clients may already have read it.
+	BufferWriteSync::Flush(app_, it->second);
+
+	exporter_->Publish(frame);
+	return false;
+}
+
+void FrameExportStage::Stop()
+{
+	// Tell the clients to let go of their frames now, but we're called with the camera partway through
+	// stopping, so the requests themselves mustn't be given back until it has finished.
+	if (exporter_)
+		revoked_ = exporter_->RevokeAll();
+}
+
+void FrameExportStage::Teardown()
+{
+	stream_ = nullptr;
+	if (exporter_)
+		exporter_->RevokeAll();
+	revoked_.clear();
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new FrameExportStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
@@ -0,0 +1,342 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * gl_stage.cpp - base class for post-processing stages that run on the GPU
+ */
+
+#include <libdrm/drm_fourcc.h>
+
+#include "core/buffer_sync.hpp"
+#include "core/logging.hpp"
+
+#include "post_processing_stages/gl_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+static const char *vertex_shader = "#version 300 es\n"
+								   "in vec2 pos;\n"
+								   "out vec2 texcoord;\n"
+								   "void main() {\n"
+								   "  gl_Position = vec4(pos, 0.0, 1.0);\n"
+								   "  texcoord = pos * 0.5 + 0.5;\n"
+								   "}\n";
+
+static const char *fragment_prelude = "#version 300 es\n"
+									  "precision highp float;\n"
+									  "in vec2 texcoord;\n"
+									  "uniform sampler2D y_plane;\n"
+									  "uniform sampler2D u_plane;\n"
+									  "uniform sampler2D v_plane;\n"
+									  "uniform int plane;\n"
+									  "uniform vec2 texel;\n"
+									  "out vec4 colour;\n"
+									  "float current(vec2 coord) {\n"
+									  "  if (plane == 0)\n"
+									  "    return texture(y_plane, coord).r;\n"
+									  "  else if (plane == 1)\n"
+									  "    return texture(u_plane, coord).r;\n"
+									  "  return texture(v_plane, coord).r;\n"
+									  "}\n";
+
+static GLuint compile_shader(GLenum target, std::string const &source)
+{
+	GLuint s = glCreateShader(target);
+	char const *src = source.c_str();
+	glShaderSource(s, 1, &src, NULL);
+	glCompileShader(s);
+
+	GLint ok;
+	glGetShaderiv(s, GL_COMPILE_STATUS, &ok);
+	if (!ok)
+	{
+		GLint size;
+		glGetShaderiv(s, GL_INFO_LOG_LENGTH, &size);
+		std::string info(std::max(size, 1), '\0');
+		glGetShaderInfoLog(s, size, NULL, info.data());
+		glDeleteShader(s);
+		throw std::runtime_error("GlStage: failed to compile shader: " + info + "\nsource:\n" + source);
+	}
+
+	return s;
+}
+
+static GLuint link_program(GLuint vs, GLuint fs)
+{
+	GLuint prog = glCreateProgram();
+	glAttachShader(prog, vs);
+	glAttachShader(prog, fs);
+	glBindAttribLocation(prog, 0, "pos");
+	glLinkProgram(prog);
+	glDeleteShader(vs);
+	glDeleteShader(fs);
+
+	GLint ok;
+	glGetProgramiv(prog, GL_LINK_STATUS, &ok);
+	if (!ok)
+	{
+		GLint size;
+		glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &size);
+		std::string info(std::max(size, 1), '\0');
+		glGetProgramInfoLog(prog, size, NULL, info.data());
+		glDeleteProgram(prog);
+		throw std::runtime_error("GlStage: failed to link program: " + info);
+	}
+
+	return prog;
+}
+
+GlStage::GlStage(RPiCamApp *app)
+	: PostProcessingStage(app), stream_(nullptr), display_(EGL_NO_DISPLAY), context_(EGL_NO_CONTEXT), program_(0)
+{
+}
+
+GlStage::~GlStage()
+{
+	if (context_ != EGL_NO_CONTEXT)
+	{
+		if (eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, context_))
+		{
+			deleteBuffers();
+			if (program_)
+				glDeleteProgram(program_);
+			releaseCurrent();
+		}
+		eglDestroyContext(display_, context_);
+	}
+	if (display_ != EGL_NO_DISPLAY)
+		eglTerminate(display_);
+}
+
+// We don't draw to the screen, so we use a surfaceless display and make the context current with
+// no surface at all.
+
+void GlStage::initialise()
+{
+	if (!epoxy_has_egl_extension(EGL_NO_DISPLAY, "EGL_MESA_platform_surfaceless"))
+		throw std::runtime_error("GlStage: EGL_MESA_platform_surfaceless not supported");
+	display_ = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (display_ == EGL_NO_DISPLAY)
+		throw std::runtime_error("GlStage: eglGetPlatformDisplayEXT() failed");
+
+	EGLint egl_major, egl_minor;
+	if (!eglInitialize(display_, &egl_major, &egl_minor))
+		throw std::runtime_error("GlStage: eglInitialize() failed");
+	LOG(2, "GlStage: EGL " << egl_major << "." << egl_minor);
+
+	for (char const *ext : { "EGL_KHR_surfaceless_context", "EGL_KHR_no_config_context",
+							 "EGL_EXT_image_dma_buf_import", "EGL_KHR_fence_sync" })
+	{
+		if (!epoxy_has_egl_extension(display_, ext))
+			throw std::runtime_error(std::string("GlStage: ") + ext + " not supported");
+	}
+
+	eglBindAPI(EGL_OPENGL_ES_API);
+	static const EGLint ctx_attribs[] = { EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 0, EGL_NONE };
+	context_ = eglCreateContext(display_, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, ctx_attribs);
+	if (context_ == EGL_NO_CONTEXT)
+		throw std::runtime_error("GlStage: eglCreateContext() failed");
+
+	makeCurrent();
+	program_ = link_program(compile_shader(GL_VERTEX_SHADER, vertex_shader),
+							compile_shader(GL_FRAGMENT_SHADER, fragment_prelude + fragmentShader()));
+	glUseProgram(program_);
+	glUniform1i(glGetUniformLocation(program_, "y_plane"), 0);
+	glUniform1i(glGetUniformLocation(program_, "u_plane"), 1);
+	glUniform1i(glGetUniformLocation(program_, "v_plane"), 2);
+	plane_location_ = glGetUniformLocation(program_, "plane");
+	texel_location_ = glGetUniformLocation(program_, "texel");
+	releaseCurrent();
+}
+
+void GlStage::makeCurrent()
+{
+	if (!eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, context_))
+		throw std::runtime_error("GlStage: eglMakeCurrent() failed");
+}
+
+void GlStage::releaseCurrent()
+{
+	// Process() may be called from a different thread next time.
+	eglMakeCurrent(display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+Stream *GlStage::getStream() const
+{
+	return app_->GetMainStream();
+}
+
+void GlStage::Configure()
+{
+	stream_ = getStream();
+	if (!stream_)
+		return;
+	if (stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("GlStage: only YUV420 format supported");
+	info_ = app_->GetStreamInfo(stream_);
+
+	if (context_ == EGL_NO_CONTEXT)
+		initialise();
+
+	makeCurrent();
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		Plane &scratch = scratch_[i];
+		deletePlane(scratch);
+		scratch.width = i ? info_.width / 2 : info_.width;
+		scratch.height = i ? info_.height / 2 : info_.height;
+		glGenTextures(1, &scratch.texture);
+		glBindTexture(GL_TEXTURE_2D, scratch.texture);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, scratch.width, scratch.height);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glGenFramebuffers(1, &scratch.fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, scratch.fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, scratch.texture, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			throw std::runtime_error("GlStage: incomplete scratch framebuffer");
+	}
+	releaseCurrent();
+}
+
+void GlStage::deletePlane(Plane &plane)
+{
+	if (plane.fbo)
+		glDeleteFramebuffers(1, &plane.fbo);
+	if (plane.texture)
+		glDeleteTextures(1, &plane.texture);
+	if (plane.image != EGL_NO_IMAGE_KHR)
+		eglDestroyImageKHR(display_, plane.image);
+	plane = Plane();
+}
+
+// Each plane of the buffer is imported as a single channel image that we can both read, to copy
+// it into the scratch texture, and render into.
+
+GlStage::Buffer &GlStage::getBuffer(libcamera::FrameBuffer *fb)
+{
+	auto it = buffers_.find(fb);
+	if (it != buffers_.end())
+		return it->second;
+
+	Buffer &buffer = buffers_[fb];
+	int fd = fb->planes()[0].fd.get();
+	unsigned int offset = 0;
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		Plane &plane = buffer.planes[i];
+		plane.width = i ? info_.width / 2 : info_.width;
+		plane.height = i ? info_.height / 2 : info_.height;
+		unsigned int pitch = i ? info_.stride / 2 : info_.stride;
+
+		EGLint attribs[] = {
+			EGL_WIDTH, static_cast<EGLint>(plane.width),
+			EGL_HEIGHT, static_cast<EGLint>(plane.height),
+			EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_R8,
+			EGL_DMA_BUF_PLANE0_FD_EXT, fd,
+			EGL_DMA_BUF_PLANE0_OFFSET_EXT, static_cast<EGLint>(offset),
+			EGL_DMA_BUF_PLANE0_PITCH_EXT, static_cast<EGLint>(pitch),
+			EGL_NONE
+		};
+		offset += pitch * plane.height;
+
+		plane.image = eglCreateImageKHR(display_, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+		if (plane.image == EGL_NO_IMAGE_KHR)
+			throw std::runtime_error("GlStage: failed to import dma-buf fd " + std::to_string(fd));
+
+		glGenTextures(1, &plane.texture);
+		glBindTexture(GL_TEXTURE_2D, plane.texture);
+		glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, plane.image);
+		glGenFramebuffers(1, &plane.fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, plane.fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, plane.texture, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			throw std::runtime_error("GlStage: cannot render into dma-buf fd " + std::to_string(fd));
+	}
+
+	return buffer;
+}
+
+bool GlStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	// The GPU must see anything that CPU stages before us have drawn.
+	BufferWriteSync::Flush(app_, completed_request->buffers[stream_]);
+
+	makeCurrent();
+	Buffer &buffer = getBuffer(completed_request->buffers[stream_]);
+
+	// Take copies of all the planes first, as a shader drawing U or V may want to look at Y too.
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		Plane const &plane = buffer.planes[i];
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, plane.fbo);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, scratch_[i].fbo);
+		glBlitFramebuffer(0, 0, plane.width, plane.height, 0, 0, plane.width, plane.height, GL_COLOR_BUFFER_BIT,
+						  GL_NEAREST);
+	}
+
+	static const float verts[] = { -1, -1, 1, -1, -1, 1, 1, 1 };
+	glUseProgram(program_);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	glEnableVertexAttribArray(0);
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, scratch_[i].texture);
+	}
+
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		Plane const &plane = buffer.planes[i];
+		glBindFramebuffer(GL_FRAMEBUFFER, plane.fbo);
+		glViewport(0, 0, plane.width, plane.height);
+		glUniform1i(plane_location_, i);
+		glUniform2f(texel_location_, 1.0f / plane.width, 1.0f / plane.height);
+		setUniforms(program_, i);
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+
+	// The buffer can't go on to the encoder or the next stage until the GPU is done with it.
+	EGLSyncKHR fence = eglCreateSyncKHR(display_, EGL_SYNC_FENCE_KHR, NULL);
+	if (fence == EGL_NO_SYNC_KHR)
+		glFinish();
+	else
+	{
+		eglClientWaitSyncKHR(display_, fence, EGL_SYNC_FLUSH_COMMANDS_BIT_KHR, EGL_FOREVER_KHR);
+		eglDestroySyncKHR(display_, fence);
+	}
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	releaseCurrent();
+
+	return false;
+}
+
+void GlStage::Teardown()
+{
+	if (context_ == EGL_NO_CONTEXT)
+		return;
+
+	// The buffers will be different ones after the camera is configured again.
+	makeCurrent();
+	deleteBuffers();
+	releaseCurrent();
+}
+
+void GlStage::deleteBuffers()
+{
+	for (auto &it : buffers_)
+	{
+		for (Plane &plane : it.second.planes)
+			deletePlane(plane);
+	}
+	buffers_.clear();
+	for (Plane &plane : scratch_)
+		deletePlane(plane);
+}
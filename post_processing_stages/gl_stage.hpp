@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * gl_stage.hpp - base class for post-processing stages that run on the GPU
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+
+#include <epoxy/egl.h>
+#include <epoxy/gl.h>
+
+#include <libcamera/stream.h>
+
+#include "core/rpicam_app.hpp"
+#include "core/stream_info.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+
+// The GlStage is a convenient base class for post-processing stages that run a GLES fragment
+// shader on the GPU. The stream's YUV420 buffers are imported as EGLImages, so nothing gets
+// copied by the CPU, and the shader draws the Y, U and V planes in turn straight back into the
+// same buffer. Process() returns once a fence says that the GPU has finished.
+//
+// The shader is GLSL ES 3.00, and what the derived class supplies follows these declarations:
+//
+//   in vec2 texcoord;       // where we are in the plane being drawn, from 0 to 1
+//   uniform sampler2D y_plane, u_plane, v_plane; // the planes as they were before this stage
+//   uniform int plane;      // 0, 1 or 2 for whichever of Y, U or V is being drawn
+//   uniform vec2 texel;     // the size of a pixel in the plane being drawn
+//   out vec4 colour;        // write the new value of the plane to colour.r
+//   float current(vec2 coord); // samples the plane being drawn
+//
+// The GPU doesn't go through the CPU caches, so GL stages should come before any CPU stages that
+// look at the same stream.
+
+class GlStage : public PostProcessingStage
+{
+public:
+	GlStage(RPiCamApp *app);
+
+	~GlStage();
+
+	// Only one thread can use the GL context at a time.
+	Concurrency GetConcurrency() const override { return Concurrency::Serial; }
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+	void Teardown() override;
+
+protected:
+	// Derived classes must provide the body of the fragment shader, including main().
+	virtual std::string fragmentShader() const = 0;
+
+	// Called with the program in use before each plane is drawn, so that derived classes can
+	// set any uniforms of their own.
+	virtual void setUniforms(GLuint program, unsigned int plane) {}
+
+	// The stream to work on. By default this is the main stream.
+	virtual libcamera::Stream *getStream() const;
+
+	libcamera::Stream *stream_;
+	StreamInfo info_;
+
+private:
+	struct Plane
+	{
+		EGLImageKHR image = EGL_NO_IMAGE_KHR;
+		GLuint texture = 0;
+		GLuint fbo = 0;
+		unsigned int width = 0;
+		unsigned int height = 0;
+	};
+
+	struct Buffer
+	{
+		Plane planes[3];
+	};
+
+	void initialise();
+	void makeCurrent();
+	void releaseCurrent();
+	void deletePlane(Plane &plane);
+	void deleteBuffers();
+	Buffer &getBuffer(libcamera::FrameBuffer *fb);
+
+	EGLDisplay display_;
+	EGLContext context_;
+	GLuint program_;
+	GLint plane_location_;
+	GLint texel_location_;
+	// Each plane gets copied here first, so that the shader never reads what it's writing.
+	Plane scratch_[3];
+	std::map<libcamera::FrameBuffer *, Buffer> buffers_;
+};
@@ -8,15 +8,19 @@
 #include <algorithm>
 #include <array>
 #include <cmath>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <vector>
 
 #include <hailo/hailort.hpp>
 
+#include <opencv2/imgproc.hpp>
+
 #include "classification/classification.hpp"
 
 #include "core/rpicam_app.hpp"
+#include "post_processing_stages/object_detect.hpp"
 
 #include "hailo_postprocessing_stage.hpp"
 
@@ -41,12 +45,20 @@ public:
 
 private:
 	std::vector<HailoClassificationPtr> runInference(uint8_t *frame);
+	std::vector<HailoClassificationPtr> interpretOutputs(std::vector<OutTensor> &output_tensors);
+	void classifyDetections(CompletedRequestPtr &completed_request);
 
 	DlLib postproc_;
+	// The most recent results, for requests that don't get their own.
+	std::mutex lock_;
+	std::string latest_label_;
+	std::vector<Detection> latest_results_;
 
 	// Config params
 	float threshold_;
 	bool do_softmax_;
+	bool crop_detections_;
+	unsigned int max_crops_;
 };
 
 HailoClassifier::HailoClassifier(RPiCamApp *app)
@@ -63,6 +75,8 @@ void HailoClassifier::Read(boost::property_tree::ptree const &params)
 {
 	threshold_ = params.get<float>("threshold", 0.5f);
 	do_softmax_ = params.get<bool>("do_softmax", true);
+	crop_detections_ = params.get<bool>("crop_detections", false);
+	max_crops_ = params.get<unsigned int>("max_crops", 8);
 
 	HailoPostProcessingStage::Read(params);
 }
@@ -80,6 +94,22 @@ bool HailoClassifier::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
+	if (!FrameDue())
+	{
+		std::scoped_lock<std::mutex> l(lock_);
+		if (crop_detections_ && latest_results_.size())
+			completed_request->post_process_metadata.Set("classifier.results", latest_results_);
+		else if (!crop_detections_ && !latest_label_.empty())
+			completed_request->post_process_metadata.Set("annotate.text", latest_label_);
+		return false;
+	}
+
+	if (crop_detections_)
+	{
+		classifyDetections(completed_request);
+		return false;
+	}
+
 	BufferReadSync r(app_, completed_request->buffers[low_res_stream_]);
 	libcamera::Span<uint8_t> buffer = r.Get()[0];
 	std::shared_ptr<uint8_t> input;
@@ -95,7 +125,10 @@ bool HailoClassifier::Process(CompletedRequestPtr &completed_request)
 		input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
 		input_ptr = input.get();
 
-		Yuv420ToRgb(input.get(), buffer.data(), low_res_info_, rgb_info);
+		// Other stages on this frame may want the same image.
+		std::shared_ptr<ScratchBuffer const> rgb =
+			GetRgbImage(completed_request, low_res_stream_, low_res_info_, rgb_info);
+		memcpy(input.get(), rgb->data(), rgb->size());
 	}
 	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
 			 low_res_info_.pixel_format == libcamera::formats::BGR888)
@@ -122,15 +155,114 @@ bool HailoClassifier::Process(CompletedRequestPtr &completed_request)
 	}
 
 	std::vector<HailoClassificationPtr> results = runInference(input_ptr);
+	std::string label = results.size() ? results[0]->get_label() : std::string();
 	if (results.size())
 	{
-		LOG(2, "Result: " << results[0]->get_label());
-		completed_request->post_process_metadata.Set("annotate.text", results[0]->get_label());
+		LOG(2, "Result: " << label);
+		completed_request->post_process_metadata.Set("annotate.text", label);
 	}
 
+	std::scoped_lock<std::mutex> l(lock_);
+	latest_label_ = std::move(label);
+
 	return false;
 }
 
+// Classify each of the objects that an earlier stage, such as hailo_yolo_inference, has found, rather than the
+// whole image. All the crops get dispatched before we wait for any, so that the scheduler can batch them up.
+void HailoClassifier::classifyDetections(CompletedRequestPtr &completed_request)
+{
+	std::vector<Detection> detections;
+	completed_request->post_process_metadata.Get("object_detect.results", detections);
+	if (detections.size() > max_crops_)
+		detections.resize(max_crops_);
+
+	BufferReadSync r(app_, completed_request->buffers[low_res_stream_]);
+	std::shared_ptr<ScratchBuffer const> rgb;
+	cv::Mat image;
+
+	if (low_res_info_.pixel_format == libcamera::formats::YUV420)
+	{
+		StreamInfo rgb_info;
+		rgb_info.width = low_res_info_.width;
+		rgb_info.height = low_res_info_.height;
+		rgb_info.stride = rgb_info.width * 3;
+
+		rgb = GetRgbImage(completed_request, low_res_stream_, low_res_info_, rgb_info);
+		image = cv::Mat(rgb_info.height, rgb_info.width, CV_8UC3, const_cast<uint8_t *>(rgb->data()), rgb_info.stride);
+	}
+	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
+			 low_res_info_.pixel_format == libcamera::formats::BGR888)
+		image = cv::Mat(low_res_info_.height, low_res_info_.width, CV_8UC3, r.Get()[0].data(), low_res_info_.stride);
+	else
+	{
+		LOG_ERROR("Unexpected lores format " << low_res_info_.pixel_format);
+		return;
+	}
+
+	struct Crop
+	{
+		Detection *detection;
+		std::shared_ptr<uint8_t> input;
+		hailort::AsyncInferJob job;
+		std::vector<OutTensor> output_tensors;
+	};
+	std::vector<Crop> crops;
+
+	// The detections are in main stream co-ordinates, and we assume the lores stream has the same field of view.
+	const Size &output_size = output_stream_->configuration().size;
+	const Size &tensor_size = InputTensorSize();
+	const cv::Rect bounds(0, 0, image.cols, image.rows);
+
+	for (auto &detection : detections)
+	{
+		cv::Rect box(detection.box.x * image.cols / output_size.width, detection.box.y * image.rows / output_size.height,
+					 detection.box.width * image.cols / output_size.width,
+					 detection.box.height * image.rows / output_size.height);
+		box &= bounds;
+		if (box.empty())
+			continue;
+
+		Crop crop { &detection, allocator_.Allocate(tensor_size.width * tensor_size.height * 3), {}, {} };
+		if (!crop.input)
+			break;
+
+		cv::Mat input(tensor_size.height, tensor_size.width, CV_8UC3, crop.input.get());
+		cv::resize(image(box), input, input.size(), 0, 0, cv::INTER_LINEAR);
+
+		if (HailoPostProcessingStage::DispatchJob(crop.input.get(), crop.job, crop.output_tensors) != HAILO_SUCCESS)
+			break;
+		crops.push_back(std::move(crop));
+	}
+
+	// Each result goes in the box of the object that was classified.
+	std::vector<Detection> results;
+	for (auto &crop : crops)
+	{
+		hailo_status status = crop.job.wait(1s);
+		if (status != HAILO_SUCCESS)
+		{
+			LOG_ERROR("Failed to wait for inference to finish, status = " << status);
+			continue;
+		}
+
+		std::vector<HailoClassificationPtr> classes = interpretOutputs(crop.output_tensors);
+		if (classes.empty() || classes[0]->get_confidence() < threshold_)
+			continue;
+
+		const Detection &d = *crop.detection;
+		results.emplace_back(classes[0]->get_class_id(), classes[0]->get_label(), classes[0]->get_confidence(),
+							 d.box.x, d.box.y, d.box.width, d.box.height);
+		LOG(2, "Crop result: " << results.back().toString());
+	}
+
+	if (results.size())
+		completed_request->post_process_metadata.Set("classifier.results", results);
+
+	std::scoped_lock<std::mutex> l(lock_);
+	latest_results_ = std::move(results);
+}
+
 std::vector<HailoClassificationPtr> HailoClassifier::runInference(uint8_t *frame)
 {
 	hailort::AsyncInferJob job;
@@ -149,6 +281,11 @@ std::vector<HailoClassificationPtr> HailoClassifier::runInference(uint8_t *frame
 		return {};
 	}
 
+	return interpretOutputs(output_tensors);
+}
+
+std::vector<HailoClassificationPtr> HailoClassifier::interpretOutputs(std::vector<OutTensor> &output_tensors)
+{
 	// Postprocess tensor
 	PostProcFuncPtr filter = reinterpret_cast<PostProcFuncPtr>(postproc_.GetSymbol("resnet_v1_50"));
 	if (!filter)
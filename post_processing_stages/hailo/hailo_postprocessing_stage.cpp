@@ -10,6 +10,8 @@
 #include <string>
 #include <sys/mman.h>
 
+#include <libcamera/formats.h>
+
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/opencv.hpp>
@@ -72,7 +74,18 @@ public:
 
 		if (!_vdevice)
 		{
-			Expected<std::unique_ptr<VDevice>> vdevice_exp = VDevice::create();
+			// Every stage configures its own model on this one device, and the model scheduler shares the
+			// device out between them according to their priorities.
+			hailo_vdevice_params_t params;
+			hailo_status status = hailo_init_vdevice_params(&params);
+			if (status != HAILO_SUCCESS)
+			{
+				LOG_ERROR("Failed to init vdevice params, status = " << status);
+				return nullptr;
+			}
+			params.scheduling_algorithm = HAILO_SCHEDULING_ALGORITHM_ROUND_ROBIN;
+
+			Expected<std::unique_ptr<VDevice>> vdevice_exp = VDevice::create(params);
 			if (!vdevice_exp)
 			{
 				LOG_ERROR("Failed create vdevice, status = " << vdevice_exp.status());
@@ -100,14 +113,40 @@ Allocator::~Allocator()
 	Reset();
 }
 
+void Allocator::SetDevice(VDevice *vdevice)
+{
+	Reset();
+	vdevice_ = vdevice;
+}
+
 void Allocator::Reset()
 {
 	std::scoped_lock<std::mutex> l(lock_);
 
 	for (auto &info : alloc_info_)
+	{
+		if (info.mapped)
+			vdevice_->dma_unmap(info.ptr, info.size, HAILO_DMA_BUFFER_DIRECTION_BOTH);
 		munmap(info.ptr, info.size);
+	}
 
 	alloc_info_.clear();
+	free_buffers_.clear();
+	generation_++;
+}
+
+void Allocator::Reserve(unsigned int size, unsigned int count)
+{
+	std::scoped_lock<std::mutex> l(lock_);
+
+	std::vector<uint8_t *> &free_list = free_buffers_[size];
+	while (free_list.size() < count)
+	{
+		uint8_t *ptr = create(size);
+		if (!ptr)
+			break;
+		free_list.push_back(ptr);
+	}
 }
 
 std::shared_ptr<uint8_t> Allocator::Allocate(unsigned int size)
@@ -115,35 +154,47 @@ std::shared_ptr<uint8_t> Allocator::Allocate(unsigned int size)
 	std::scoped_lock<std::mutex> l(lock_);
 	uint8_t *ptr = nullptr;
 
-	auto info = std::find_if(alloc_info_.begin(), alloc_info_.end(),
-							 [size](const AllocInfo &info) { return info.free && info.size == size; });
-	if (info != alloc_info_.end())
+	std::vector<uint8_t *> &free_list = free_buffers_[size];
+	if (!free_list.empty())
 	{
-		info->free = false;
-		ptr = info->ptr;
+		ptr = free_list.back();
+		free_list.pop_back();
 	}
+	else
+		ptr = create(size);
 
 	if (!ptr)
-	{
-		void *addr = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-		if (addr == MAP_FAILED)
-			return {};
+		return {};
 
-		ptr = static_cast<uint8_t *>(addr);
-		alloc_info_.emplace_back(ptr, size, false);
-	}
+	unsigned int generation = generation_;
+	return std::shared_ptr<uint8_t>(ptr,
+									[this, size, generation](uint8_t *ptr) { this->free(ptr, size, generation); });
+}
 
-	return std::shared_ptr<uint8_t>(ptr, [this](uint8_t *ptr) { this->free(ptr); });
+uint8_t *Allocator::create(unsigned int size)
+{
+	// Must be called with lock_ held.
+	void *addr = mmap(NULL, size, PROT_WRITE | PROT_READ, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (addr == MAP_FAILED)
+		return nullptr;
+
+	// A buffer that can't be mapped up front is still usable, HailoRT just maps it on every job.
+	uint8_t *ptr = static_cast<uint8_t *>(addr);
+	bool mapped = vdevice_ && vdevice_->dma_map(ptr, size, HAILO_DMA_BUFFER_DIRECTION_BOTH) == HAILO_SUCCESS;
+	if (vdevice_ && !mapped)
+		LOG(2, "Hailo: unable to map a buffer of " << size << " bytes for the device");
+	alloc_info_.emplace_back(ptr, size, mapped);
+
+	return ptr;
 }
 
-void Allocator::free(uint8_t *ptr)
+void Allocator::free(uint8_t *ptr, unsigned int size, unsigned int generation)
 {
 	std::scoped_lock<std::mutex> l(lock_);
 
-	auto info =	std::find_if(alloc_info_.begin(), alloc_info_.end(),
-							 [ptr](const AllocInfo &info) { return info.ptr == ptr; });
-	if (info != alloc_info_.end())
-		info->free = true;
+	// Buffers from before the last Reset() have already gone.
+	if (generation == generation_)
+		free_buffers_[size].push_back(ptr);
 }
 
 HailoPostProcessingStage::HailoPostProcessingStage(RPiCamApp *app)
@@ -153,6 +204,7 @@ HailoPostProcessingStage::HailoPostProcessingStage(RPiCamApp *app)
 
 HailoPostProcessingStage::~HailoPostProcessingStage()
 {
+	HailoPostProcessingStage::Stop();
 	if (init_)
 		configured_infer_model_->shutdown();
 }
@@ -162,6 +214,31 @@ void HailoPostProcessingStage::Read(boost::property_tree::ptree const &params)
 	hef_file_ = params.get<std::string>("hef_file", "");
 	hef_file_8_ = params.get<std::string>("hef_file_8", "");
 	hef_file_8L_ = params.get<std::string>("hef_file_8L", "");
+	jobs_in_flight_ = std::max(params.get<unsigned int>("jobs_in_flight", 1), 1u);
+
+	// How this model shares the device with any others.
+	scheduler_priority_ = params.get<unsigned int>("scheduler_priority", HAILO_SCHEDULER_PRIORITY_NORMAL);
+	scheduler_priority_ = std::min<unsigned int>(scheduler_priority_, HAILO_SCHEDULER_PRIORITY_MAX);
+	scheduler_timeout_ms_ = params.get<unsigned int>("scheduler_timeout_ms", 0);
+	scheduler_threshold_ = params.get<unsigned int>("scheduler_threshold", 0);
+	batch_size_ = std::max(params.get<unsigned int>("batch_size", 1), 1u);
+	max_fps_ = params.get<float>("max_fps", 0);
+}
+
+bool HailoPostProcessingStage::GetLoresRequest(LoresRequest &request)
+{
+	// The network's input size is only known once the HEF file is loaded.
+	if (!init_ && !configureHailoRT())
+		init_ = true;
+	if (!init_)
+		return false;
+
+	// An RGB lores stream at the network's own size, with its rows packed together as HailoRT wants them,
+	// can go to the device just as it is.
+	request.size = InputTensorSize();
+	request.format = libcamera::formats::BGR888;
+	request.packed = true;
+	return true;
 }
 
 void HailoPostProcessingStage::Configure()
@@ -182,6 +259,54 @@ void HailoPostProcessingStage::Configure()
 
 	allocator_.Reset();
 	last_frame_ = {};
+	next_due_ = {};
+
+	if (low_res_stream_ && low_res_info_.pixel_format != libcamera::formats::YUV420 &&
+		low_res_info_.stride != low_res_info_.width * 3)
+		LOG(1, "Hailo: lores stride of " << low_res_info_.stride << " is padded, each frame will be copied");
+
+	// There's no point queueing more jobs than the NPU will take.
+	if (init_ && jobs_in_flight_ > 1)
+	{
+		Expected<size_t> queue_size_exp = configured_infer_model_->get_async_queue_size();
+		if (queue_size_exp && queue_size_exp.value() < jobs_in_flight_)
+		{
+			LOG(1, "Hailo: limiting jobs_in_flight to the async queue size of " << queue_size_exp.value());
+			jobs_in_flight_ = std::max<unsigned int>(queue_size_exp.value(), 1);
+		}
+	}
+
+	// Every job in flight needs its own output buffers, and perhaps a copy of the input, plus one more
+	// set for the frame being dispatched.
+	if (init_)
+	{
+		unsigned int count = jobs_in_flight_ + 1;
+		allocator_.Reserve(infer_model_->inputs()[0].get_frame_size(), count);
+		for (auto const &output_name : infer_model_->get_output_names())
+			allocator_.Reserve(infer_model_->output(output_name)->get_frame_size(), count);
+	}
+}
+
+void HailoPostProcessingStage::Start()
+{
+	if (jobs_in_flight_ > 1)
+	{
+		quit_ = false;
+		completion_thread_ = std::thread(&HailoPostProcessingStage::completionThread, this);
+	}
+}
+
+void HailoPostProcessingStage::Stop()
+{
+	if (completion_thread_.joinable())
+	{
+		{
+			std::scoped_lock<std::mutex> l(pending_mutex_);
+			quit_ = true;
+		}
+		pending_cv_.notify_all();
+		completion_thread_.join();
+	}
 }
 
 int HailoPostProcessingStage::configureHailoRT()
@@ -192,6 +317,7 @@ int HailoPostProcessingStage::configureHailoRT()
 		LOG_ERROR("Failed to get a vdevice instance.");
 		return -1;
 	}
+	allocator_.SetDevice(vdevice_);
 
 	// Pull the device id.
 	auto devices = vdevice_->get_physical_devices().release();
@@ -220,6 +346,8 @@ int HailoPostProcessingStage::configureHailoRT()
 	}
 	infer_model_ = infer_model_exp.release();
 	infer_model_->set_hw_latency_measurement_flags(HAILO_LATENCY_MEASURE);
+	// The scheduler can gather this many frames from us before running them through together.
+	infer_model_->set_batch_size(batch_size_);
 
 	// Configure the infer model
 	//infer_model_->output()->set_format_type(HAILO_FORMAT_TYPE_FLOAT32);
@@ -231,6 +359,14 @@ int HailoPostProcessingStage::configureHailoRT()
 	}
 	configured_infer_model_ = std::make_shared<ConfiguredInferModel>(configured_infer_model_exp.release());
 
+	hailo_status status = configured_infer_model_->set_scheduler_priority(scheduler_priority_);
+	if (status == HAILO_SUCCESS && scheduler_timeout_ms_)
+		status = configured_infer_model_->set_scheduler_timeout(std::chrono::milliseconds(scheduler_timeout_ms_));
+	if (status == HAILO_SUCCESS && scheduler_threshold_)
+		status = configured_infer_model_->set_scheduler_threshold(scheduler_threshold_);
+	if (status != HAILO_SUCCESS)
+		LOG_ERROR("WARNING: Failed to set the scheduler parameters, status = " << status);
+
 	// Create infer bindings
 	Expected<ConfiguredInferModel::Bindings> bindings_exp = configured_infer_model_->create_bindings();
 	if (!bindings_exp)
@@ -246,6 +382,24 @@ int HailoPostProcessingStage::configureHailoRT()
 	return 0;
 }
 
+bool HailoPostProcessingStage::FrameDue()
+{
+	if (max_fps_ <= 0)
+		return true;
+
+	std::scoped_lock<std::mutex> l(lock_);
+	const auto interval =
+		std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / max_fps_));
+	std::chrono::time_point<std::chrono::steady_clock> now = std::chrono::steady_clock::now();
+
+	// Allow half an interval's slack, or frame timing jitter would make us skip twice as many as we should.
+	if (now + interval / 2 < next_due_)
+		return false;
+
+	next_due_ = std::max(next_due_, now - interval / 2) + interval;
+	return true;
+}
+
 hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncInferJob &job,
 												   std::vector<OutTensor> &output_tensors)
 {
@@ -272,7 +426,7 @@ hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncIn
 		if (!output_buffer)
 		{
 			LOG_ERROR("Could not allocate an output buffer!");
-			return status;
+			return HAILO_OUT_OF_HOST_MEMORY;
 		}
 
 		status = bindings_.output(output_name)->set_buffer(MemoryView(output_buffer.get(), output_size));
@@ -327,6 +481,54 @@ hailo_status HailoPostProcessingStage::DispatchJob(const uint8_t *input, AsyncIn
 	return status;
 }
 
+hailo_status HailoPostProcessingStage::QueueJob(const uint8_t *input, std::shared_ptr<uint8_t> input_buffer,
+												  JobCallback callback)
+{
+	std::unique_lock<std::mutex> l(pending_mutex_);
+	pending_cv_.wait(l, [this] { return pending_jobs_.size() < jobs_in_flight_; });
+
+	// Dispatching with the lock held keeps the queue in the same order as the jobs on the NPU.
+	PendingJob pending { std::move(input_buffer), {}, {}, std::move(callback) };
+	hailo_status status = DispatchJob(input, pending.job, pending.output_tensors);
+	if (status != HAILO_SUCCESS)
+		return status;
+
+	std::sort(pending.output_tensors.begin(), pending.output_tensors.end(), OutTensor::SortFunction);
+	pending_jobs_.push_back(std::move(pending));
+	l.unlock();
+	pending_cv_.notify_all();
+
+	return status;
+}
+
+void HailoPostProcessingStage::completionThread()
+{
+	while (true)
+	{
+		std::unique_lock<std::mutex> l(pending_mutex_);
+		pending_cv_.wait(l, [this] { return quit_ || !pending_jobs_.empty(); });
+
+		// Any jobs still on the NPU are finished off before we quit.
+		if (pending_jobs_.empty())
+			break;
+
+		// Only this thread removes jobs, so the front one stays put while we wait for it.
+		PendingJob &pending = pending_jobs_.front();
+		l.unlock();
+
+		hailo_status status = pending.job.wait(1s);
+		if (status != HAILO_SUCCESS)
+			LOG_ERROR("Failed to wait for inference to finish, status = " << status);
+		else
+			pending.callback(pending.output_tensors);
+
+		l.lock();
+		pending_jobs_.pop_front();
+		l.unlock();
+		pending_cv_.notify_all();
+	}
+}
+
 HailoROIPtr HailoPostProcessingStage::MakeROI(const std::vector<OutTensor> &output_tensors) const
 {
 	HailoROIPtr roi = std::make_shared<HailoROI>(HailoROI(HailoBBox(0.0f, 0.0f, 1.0f, 1.0f)));
@@ -8,7 +8,10 @@
 #pragma once
 
 #include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -26,32 +29,44 @@
 
 #include "hailo_postproc_lib.h"
 
+// A pool of page aligned buffers for inference inputs and outputs. Each buffer is mapped for the
+// device when it's created, so that jobs using it don't have to map it again every time, and free
+// buffers are handed out again to any request of the same size.
 class Allocator
 {
 public:
 	Allocator();
 	~Allocator();
 
+	void SetDevice(hailort::VDevice *vdevice);
+
 	void Reset();
 
+	// Create enough buffers of this size up front that Allocate() needn't make any while streaming.
+	void Reserve(unsigned int size, unsigned int count);
+
 	std::shared_ptr<uint8_t> Allocate(unsigned int size);
 
 private:
-	void free(uint8_t *ptr);
+	uint8_t *create(unsigned int size);
+	void free(uint8_t *ptr, unsigned int size, unsigned int generation);
 
 	struct AllocInfo
 	{
-		AllocInfo(uint8_t *_ptr, unsigned int _size, bool _free)
-			: ptr(_ptr), size(_size), free(_free)
+		AllocInfo(uint8_t *_ptr, unsigned int _size, bool _mapped)
+			: ptr(_ptr), size(_size), mapped(_mapped)
 		{
 		}
 
 		uint8_t *ptr;
 		unsigned int size;
-		bool free;
+		bool mapped;
 	};
 
 	std::vector<AllocInfo> alloc_info_;
+	std::map<unsigned int, std::vector<uint8_t *>> free_buffers_;
+	hailort::VDevice *vdevice_ = nullptr;
+	unsigned int generation_ = 0;
 	std::mutex lock_;
 };
 
@@ -152,8 +167,20 @@ public:
 
 	void Read(boost::property_tree::ptree const &params) override;
 
+	bool GetLoresRequest(LoresRequest &request) override;
+
 	void Configure() override;
 
+	void Start() override;
+
+	void Stop() override;
+
+	// Pipelined inference hands out its results in the order the requests arrived.
+	Concurrency GetConcurrency() const override
+	{
+		return jobs_in_flight_ > 1 ? Concurrency::Ordered : Concurrency::Reentrant;
+	}
+
 protected:
 	bool Ready() const
 	{
@@ -173,6 +200,30 @@ protected:
 	hailo_status DispatchJob(const uint8_t *input, hailort::AsyncInferJob &job, std::vector<OutTensor> &output_tensors);
 	HailoROIPtr MakeROI(const std::vector<OutTensor> &output_tensors) const;
 
+	// Pipelined inference. Instead of dispatching a job and waiting for it, a stage can queue it up
+	// and carry on, so that the NPU works on one frame while we prepare the next and post-process the
+	// last. Up to JobsInFlight() jobs may be running, after which QueueJob() waits for the oldest to
+	// finish. The callback runs on the completion thread once the job is done, for each job in the
+	// order it was queued, and the job holds on to its input buffer until then, which must own the
+	// input. The job doesn't keep the request, so that its camera buffers go back as soon as the stages
+	// are done with them; anything the callback needs from it has to be captured when the job is
+	// queued. The results can only go on later requests, as this one will have moved on by then.
+	using JobCallback = std::function<void(std::vector<OutTensor> &output_tensors)>;
+	hailo_status QueueJob(const uint8_t *input, std::shared_ptr<uint8_t> input_buffer, JobCallback callback);
+	unsigned int JobsInFlight() const
+	{
+		return jobs_in_flight_;
+	}
+
+	// Whether to run the model on this frame at all, if it has a max_fps budget. Other frames should reuse
+	// the last results, leaving the device free for any other models.
+	bool FrameDue();
+
+	unsigned int BatchSize() const
+	{
+		return batch_size_;
+	}
+
 	libcamera::Rectangle ConvertInferenceCoordinates(const std::vector<float> &coords,
 													 const std::vector<libcamera::Rectangle> &scaler_crops) const;
 
@@ -192,12 +243,34 @@ protected:
 private:
 	int configureHailoRT();
 	void displayThread();
+	void completionThread();
+
+	struct PendingJob
+	{
+		std::shared_ptr<uint8_t> input_buffer;
+		hailort::AsyncInferJob job;
+		std::vector<OutTensor> output_tensors;
+		JobCallback callback;
+	};
 
 	std::mutex lock_;
 	bool init_ = false;
 	std::string hef_file_, hef_file_8_, hef_file_8L_;
 	hailort::ConfiguredInferModel::Bindings bindings_;
 	std::chrono::time_point<std::chrono::steady_clock> last_frame_;
+	std::chrono::time_point<std::chrono::steady_clock> next_due_;
 	libcamera::Size input_tensor_size_;
 	hailo_device_identity_t device_id_;
+
+	unsigned int jobs_in_flight_ = 1;
+	unsigned int scheduler_priority_;
+	unsigned int scheduler_timeout_ms_;
+	unsigned int scheduler_threshold_;
+	unsigned int batch_size_ = 1;
+	float max_fps_ = 0;
+	std::deque<PendingJob> pending_jobs_;
+	std::mutex pending_mutex_;
+	std::condition_variable pending_cv_;
+	std::thread completion_thread_;
+	bool quit_ = false;
 };
@@ -18,12 +18,12 @@
 
 #include "core/rpicam_app.hpp"
 #include "post_processing_stages/object_detect.hpp"
+#include "post_processing_stages/object_tracker.hpp"
 
 #include "detection/yolo_hailortpp.hpp"
 
 #include "hailo_postprocessing_stage.hpp"
 
-using Size = libcamera::Size;
 using PostProcFuncPtrNms = void (*)(HailoROIPtr, YoloParamsNMS *);
 using InitFuncPtr = YoloParamsNMS *(*)(std::string, std::string);
 using FreeFuncPtr = void (*)(void *);
@@ -51,17 +51,13 @@ public:
 
 private:
 	std::vector<Detection> runInference(const uint8_t *frame, const std::vector<libcamera::Rectangle> &scaler_crops);
-	void filterOutputObjects(std::vector<Detection> &objects);
+	std::vector<Detection> interpretOutputs(std::vector<OutTensor> &output_tensors,
+											const std::vector<libcamera::Rectangle> &scaler_crops);
+	void applyTemporalFilter(std::vector<Detection> &objects);
 
-	struct LtObject
-	{
-		Detection params;
-		unsigned int visible;
-		unsigned int hidden;
-		bool matched;
-	};
-
-	std::vector<LtObject> lt_objects_;
+	ObjectTracker tracker_;
+	// The most recent results, for requests that don't get their own.
+	std::vector<Detection> latest_objects_;
 	std::mutex lock_;
 	DlLib postproc_nms_;
 	YoloParamsNMS *yolo_params_ = nullptr;
@@ -72,12 +68,30 @@ private:
 	unsigned int max_detections_;
 	float threshold_;
 	bool temporal_filtering_;
-	float tolerance_;
-	float factor_;
-	unsigned int visible_frames_;
-	unsigned int hidden_frames_;
 };
 
+// The main and low res scaler crops that the inference co-ordinates are converted through.
+static std::vector<Rectangle> getScalerCrops(CompletedRequestPtr &completed_request)
+{
+	std::vector<Rectangle> scaler_crops;
+	auto scaler_crop = completed_request->metadata.get(controls::ScalerCrop);
+	auto rpi_scaler_crop = completed_request->metadata.get(controls::rpi::ScalerCrops);
+
+	if (rpi_scaler_crop)
+	{
+		for (unsigned int i = 0; i < rpi_scaler_crop->size(); i++)
+			scaler_crops.push_back(rpi_scaler_crop->data()[i]);
+	}
+	else if (scaler_crop)
+	{
+		// Push-back twice, once for main, once for low res.
+		scaler_crops.push_back(*scaler_crop);
+		scaler_crops.push_back(*scaler_crop);
+	}
+
+	return scaler_crops;
+}
+
 YoloInference::YoloInference(RPiCamApp *app)
 	: HailoPostProcessingStage(app), postproc_nms_(PostProcLibDir(POSTPROC_LIB_NMS))
 {
@@ -103,16 +117,9 @@ void YoloInference::Read(boost::property_tree::ptree const &params)
 	max_detections_ = params.get<unsigned int>("max_detections");
 	threshold_ = params.get<float>("threshold", 0.5f);
 
-	if (params.find("temporal_filter") != params.not_found())
-	{
-		temporal_filtering_ = true;
-		tolerance_ = params.get<float>("temporal_filter.tolerance", 0.05);
-		factor_ = params.get<float>("temporal_filter.factor", 0.2);
-		visible_frames_ = params.get<unsigned int>("temporal_filter.visible_frames", 5);
-		hidden_frames_ = params.get<unsigned int>("temporal_filter.hidden_frames", 2);
-	}
-	else
-		temporal_filtering_ = false;
+	temporal_filtering_ = params.find("temporal_filter") != params.not_found();
+	if (temporal_filtering_)
+		tracker_.SetConfig(ObjectTracker::ReadConfig(params));
 
 	InitFuncPtr init = reinterpret_cast<InitFuncPtr>(postproc_nms_.GetSymbol("init"));
 	const std::string config_file = params.get<std::string>("hailopp_config_file", {});
@@ -129,6 +136,8 @@ void YoloInference::Read(boost::property_tree::ptree const &params)
 void YoloInference::Configure()
 {
 	HailoPostProcessingStage::Configure();
+	if (output_stream_)
+		tracker_.Reset(output_stream_->configuration().size);
 }
 
 bool YoloInference::Process(CompletedRequestPtr &completed_request)
@@ -145,6 +154,14 @@ bool YoloInference::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
+	if (!FrameDue())
+	{
+		std::scoped_lock<std::mutex> l(lock_);
+		if (latest_objects_.size())
+			completed_request->post_process_metadata.Set("object_detect.results", latest_objects_);
+		return false;
+	}
+
 	BufferReadSync r(app_, completed_request->buffers[low_res_stream_]);
 	libcamera::Span<uint8_t> buffer = r.Get()[0];
 	std::shared_ptr<uint8_t> input;
@@ -157,10 +174,12 @@ bool YoloInference::Process(CompletedRequestPtr &completed_request)
 		rgb_info.height = InputTensorSize().height;
 		rgb_info.stride = rgb_info.width * 3;
 
-		input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
+		// Other stages on this frame may want the same image. HailoRT only reads the input, so can use it
+		// as it is, and the input pointer keeps it alive for as long as the job needs.
+		std::shared_ptr<ScratchBuffer const> rgb =
+			GetRgbImage(completed_request, low_res_stream_, low_res_info_, rgb_info);
+		input = std::shared_ptr<uint8_t>(rgb, const_cast<uint8_t *>(rgb->data()));
 		input_ptr = input.get();
-
-		Yuv420ToRgb(input.get(), buffer.data(), low_res_info_, rgb_info);
 	}
 	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
 			 low_res_info_.pixel_format == libcamera::formats::BGR888)
@@ -186,50 +205,57 @@ bool YoloInference::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
-	std::vector<Rectangle> scaler_crops;
-	auto scaler_crop = completed_request->metadata.get(controls::ScalerCrop);
-	auto rpi_scaler_crop = completed_request->metadata.get(controls::rpi::ScalerCrops);
-
-	if (rpi_scaler_crop)
-	{
-		for (unsigned int i = 0; i < rpi_scaler_crop->size(); i++)
-			scaler_crops.push_back(rpi_scaler_crop->data()[i]);
-	}
-	else if (scaler_crop)
-	{
-		// Push-back twice, once for main, once for low res.
-		scaler_crops.push_back(*scaler_crop);
-		scaler_crops.push_back(*scaler_crop);
-	}
-
-	std::vector<Detection> objects = runInference(input_ptr, scaler_crops);
-	if (objects.size())
+	if (JobsInFlight() > 1)
 	{
-		if (temporal_filtering_)
+		// The job doesn't hold on to the request, so that the camera can have its buffers back while the
+		// NPU is busy. If we were going to read the lores buffer itself, it gets copied out first.
+		if (!input)
 		{
-			// Process() can be concurrently called through different threads for consecutive CompletedRequests if
-			// things are running behind.  So protect access to the inference state.
-			std::scoped_lock<std::mutex> l(lock_);
-
-			filterOutputObjects(objects);
-			if (lt_objects_.size())
-			{
-				objects.clear();
-				for (auto const &obj : lt_objects_)
-				{
-					if (!obj.hidden)
-						objects.push_back(obj.params);
-				}
-			}
+			unsigned int size = low_res_info_.width * 3 * low_res_info_.height;
+			input = allocator_.Allocate(size);
+			memcpy(input.get(), input_ptr, size);
+			input_ptr = input.get();
 		}
+		std::vector<Rectangle> scaler_crops = getScalerCrops(completed_request);
+		HailoPostProcessingStage::QueueJob(input_ptr, std::move(input),
+										   [this, scaler_crops](std::vector<OutTensor> &output_tensors)
+										   {
+											   std::vector<Detection> objects =
+												   interpretOutputs(output_tensors, scaler_crops);
+											   applyTemporalFilter(objects);
+											   std::scoped_lock<std::mutex> l(lock_);
+											   latest_objects_ = std::move(objects);
+										   });
+
+		std::scoped_lock<std::mutex> l(lock_);
+		if (latest_objects_.size())
+			completed_request->post_process_metadata.Set("object_detect.results", latest_objects_);
 
-		if (objects.size())
-			completed_request->post_process_metadata.Set("object_detect.results", objects);
+		return false;
 	}
 
+	std::vector<Detection> objects = runInference(input_ptr, getScalerCrops(completed_request));
+	applyTemporalFilter(objects);
+	if (objects.size())
+		completed_request->post_process_metadata.Set("object_detect.results", objects);
+
+	std::scoped_lock<std::mutex> l(lock_);
+	latest_objects_ = std::move(objects);
+
 	return false;
 }
 
+void YoloInference::applyTemporalFilter(std::vector<Detection> &objects)
+{
+	if (!objects.size() || !temporal_filtering_)
+		return;
+
+	// Process() can be concurrently called through different threads for consecutive CompletedRequests if
+	// things are running behind.  So protect access to the inference state.
+	std::scoped_lock<std::mutex> l(lock_);
+	tracker_.Update(objects);
+}
+
 std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const std::vector<Rectangle> &scaler_crops)
 {
 	hailort::AsyncInferJob job;
@@ -251,6 +277,12 @@ std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const s
 		return {};
 	}
 
+	return interpretOutputs(output_tensors, scaler_crops);
+}
+
+std::vector<Detection> YoloInference::interpretOutputs(std::vector<OutTensor> &output_tensors,
+													   const std::vector<Rectangle> &scaler_crops)
+{
 	HailoROIPtr roi = MakeROI(output_tensors);
 	PostProcFuncPtrNms filter = reinterpret_cast<PostProcFuncPtrNms>(postproc_nms_.GetSymbol("filter"));
 
@@ -261,6 +293,7 @@ std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const s
 
 	// Translate results to the rpicam-apps Detection objects
 	std::vector<Detection> results;
+	unsigned int num_detections = 0;
 	for (auto const &d : detections)
 	{
 		if (d->get_confidence() < threshold_)
@@ -276,7 +309,7 @@ std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const s
 		results.emplace_back(d->get_class_id(), d->get_label(), d->get_confidence(), r.x, r.y, r.width, r.height);
 		LOG(2, "Object: " << results.back().toString());
 
-		if (--max_detections_ == 0)
+		if (++num_detections == max_detections_)
 			break;
 	}
 
@@ -285,65 +318,6 @@ std::vector<Detection> YoloInference::runInference(const uint8_t *frame, const s
 	return results;
 }
 
-void YoloInference::filterOutputObjects(std::vector<Detection> &objects)
-{
-	const Size isp_output_size = output_stream_->configuration().size;
-
-	for (auto &lt_obj : lt_objects_)
-		lt_obj.matched = false;
-
-	for (auto const &object : objects)
-	{
-		bool matched = false;
-		for (auto &lt_obj : lt_objects_)
-		{
-			// Try and match a detected object in our long term list.
-			if (object.category == lt_obj.params.category &&
-				std::abs(object.box.x - lt_obj.params.box.x) < tolerance_ * isp_output_size.width &&
-				std::abs(object.box.y - lt_obj.params.box.y) < tolerance_ * isp_output_size.height &&
-				std::abs((int)object.box.width - (int)lt_obj.params.box.width) < tolerance_ * isp_output_size.width &&
-				std::abs((int)object.box.height - (int)lt_obj.params.box.height) < tolerance_ * isp_output_size.height)
-			{
-				lt_obj.matched = matched = true;
-				lt_obj.params.confidence = object.confidence;
-				lt_obj.params.box.x = factor_ * object.box.x + (1 - factor_) * lt_obj.params.box.x;
-				lt_obj.params.box.y = factor_ * object.box.y + (1 - factor_) * lt_obj.params.box.y;
-				lt_obj.params.box.width = factor_ * object.box.width + (1 - factor_) * lt_obj.params.box.width;
-				lt_obj.params.box.height = factor_ * object.box.height + (1 - factor_) * lt_obj.params.box.height;
-				// Reset the visibility counter for when the object next disappears.
-				lt_obj.visible = visible_frames_;
-				// Decrement the hidden counter until the object becomes visible in the list.
-				lt_obj.hidden = std::max(0, (int)lt_obj.hidden - 1);
-				break;
-			}
-		}
-
-		// Add the object to the long term list if not found.  This object will remain hidden for hidden_frames_
-		// consecutive frames.
-		if (!matched)
-			lt_objects_.push_back({ object, visible_frames_, hidden_frames_, 1 });
-	}
-
-	for (auto &lt_obj : lt_objects_)
-	{
-		if (!lt_obj.matched)
-		{
-			// If a non matched object in the long term list is still hidden, set visible count to 0 so that it must be
-			// matched for hidden_frames_ consecutive frames before becoming visible. Otherwise, decrement the visible
-			// count of unmatched objects in the long term list.
-			if (lt_obj.hidden)
-				lt_obj.visible = 0;
-			else
-				lt_obj.visible--;
-		}
-	}
-
-	// Remove now invisible objects from the long term list.
-	lt_objects_.erase(std::remove_if(lt_objects_.begin(), lt_objects_.end(),
-									 [](const LtObject &obj) { return !obj.matched && !obj.visible; }),
-					  lt_objects_.end());
-}
-
 static PostProcessingStage *Create(RPiCamApp *app)
 {
 	return new YoloInference(app);
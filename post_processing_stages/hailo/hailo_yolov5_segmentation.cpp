@@ -37,13 +37,6 @@ namespace fs = std::filesystem;
 namespace
 {
 
-enum overlay_status_t
-{
-	OVERLAY_STATUS_UNINITIALIZED = -1,
-	OVERLAY_STATUS_OK,
-
-};
-
 const std::vector<cv::Scalar> color_table = {
 	cv::Scalar(255, 0, 0),	 cv::Scalar(0, 255, 0),	  cv::Scalar(0, 0, 255),	cv::Scalar(255, 255, 0),
 	cv::Scalar(0, 255, 255), cv::Scalar(255, 0, 255), cv::Scalar(255, 170, 0),	cv::Scalar(255, 0, 170),
@@ -57,113 +50,45 @@ cv::Scalar indexToColor(size_t index)
 	return color_table[index % color_table.size()];
 }
 
-class Parallel_pixel_opencv : public cv::ParallelLoopBody
-{
-protected:
-	cv::Vec3b *p;
-	float transparency;
-	int image_cols;
-	int roi_cols;
-
-public:
-	Parallel_pixel_opencv(uint8_t *ptr, float transparency, int image_cols, int roi_cols)
-		: p((cv::Vec3b *)ptr), transparency(transparency), image_cols(image_cols), roi_cols(roi_cols)
-	{
-	}
-};
-
-class ParallelPixelClassConfMask : public Parallel_pixel_opencv
-{
-private:
-	float *mask_data;
-	cv::Scalar mask_color;
-
-public:
-	ParallelPixelClassConfMask(uint8_t *ptr, uint8_t *mask_data, float transparency, int image_cols, int roi_cols,
-							   cv::Scalar mask_color)
-		: Parallel_pixel_opencv(ptr, transparency, image_cols, roi_cols), mask_data((float *)mask_data),
-		  mask_color(mask_color)
-	{
-	}
-
-	virtual void operator()(const cv::Range &r) const
-	{
-		constexpr float CONFIDENCE = 0.5;
-
-		for (int i = r.start; i != r.end; ++i)
-		{
-			if (mask_data[i] > CONFIDENCE) // confidence is above threshold
-			{
-				// i the index inside the full image, convert it to the index inside the ROI
-				int index = i / roi_cols * image_cols + i % roi_cols;
-
-				p[index][0] = p[index][0] * (1 - transparency) + mask_color[0] * transparency;
-				p[index][1] = p[index][1] * (1 - transparency) + mask_color[1] * transparency;
-				p[index][2] = p[index][2] * (1 - transparency) + mask_color[2] * transparency;
-			}
-		}
-	}
-};
-
-template <typename T>
-void calc_destination_roi_and_resize_mask(cv::Mat &destinationROI, cv::Mat &image_planes, HailoROIPtr roi,
-										  HailoMaskPtr mask, cv::Mat &resized_mask_data, T data_ptr, int cv_type)
+// Blend the mask's class colour into the pixels of the detection's box where it's above 0.5 confidence.
+void draw_conf_class_mask(cv::Mat &image, HailoConfClassMaskPtr mask, HailoROIPtr roi)
 {
 	HailoBBox bbox = roi->get_bbox();
-	int roi_xmin = bbox.xmin() * image_planes.cols;
-	int roi_ymin = bbox.ymin() * image_planes.rows;
-	int roi_width = image_planes.cols * bbox.width();
-	int roi_height = image_planes.rows * bbox.height();
-
-	// clamp the region of interest so it is inside the image planes
-	roi_xmin = std::clamp(roi_xmin, 0, image_planes.cols);
-	roi_ymin = std::clamp(roi_ymin, 0, image_planes.rows);
-	roi_width = std::clamp(roi_width, 0, image_planes.cols - roi_xmin);
-	roi_height = std::clamp(roi_height, 0, image_planes.rows - roi_ymin);
-
-	cv::Mat mat_data = cv::Mat(mask->get_height(), mask->get_width(), cv_type, (uint8_t *)data_ptr.data());
+	int roi_xmin = bbox.xmin() * image.cols;
+	int roi_ymin = bbox.ymin() * image.rows;
+	int roi_width = image.cols * bbox.width();
+	int roi_height = image.rows * bbox.height();
+
+	// clamp the region of interest so it is inside the image
+	roi_xmin = std::clamp(roi_xmin, 0, image.cols);
+	roi_ymin = std::clamp(roi_ymin, 0, image.rows);
+	roi_width = std::clamp(roi_width, 0, image.cols - roi_xmin);
+	roi_height = std::clamp(roi_height, 0, image.rows - roi_ymin);
+
+	// The blend works on 8 bit confidences, and the mask is far smaller than the box it's scaled up to.
+	std::vector<float> const &data = mask->get_data();
+	std::vector<uint8_t> confidence(data.size());
+	for (unsigned int i = 0; i < data.size(); i++)
+		confidence[i] = std::clamp(std::lround(data[i] * 255), 0l, 255l);
 
-	cv::resize(mat_data, resized_mask_data, cv::Size(roi_width, roi_height), 0, 0, cv::INTER_LINEAR);
-
-	cv::Rect roi_rect(cv::Point(roi_xmin, roi_ymin), cv::Size(roi_width, roi_height));
-	destinationROI = image_planes(roi_rect);
-}
-
-overlay_status_t draw_conf_class_mask(cv::Mat &image_planes, HailoConfClassMaskPtr mask, HailoROIPtr roi,
-									  const uint mask_overlay_n_threads)
-{
-	cv::Mat resized_mask_data;
-	cv::Mat destinationROI;
-
-	calc_destination_roi_and_resize_mask(destinationROI, image_planes, roi, mask, resized_mask_data, mask->get_data(),
-										 CV_32F);
 	cv::Scalar mask_color = indexToColor(mask->get_class_id());
-
-	if (mask_overlay_n_threads > 0)
-		cv::setNumThreads(mask_overlay_n_threads);
-
-	// perform efficient parallel matrix iteration and color every pixel its class color
-	cv::parallel_for_(cv::Range(0, destinationROI.rows * destinationROI.cols),
-					  ParallelPixelClassConfMask(destinationROI.data, resized_mask_data.data, mask->get_transparency(),
-												 image_planes.cols, destinationROI.cols, mask_color));
-
-	return OVERLAY_STATUS_OK;
+	uint8_t colour[3] = { (uint8_t)mask_color[0], (uint8_t)mask_color[1], (uint8_t)mask_color[2] };
+	libcamera::Rectangle rect(roi_xmin, roi_ymin, roi_width, roi_height);
+	PostProcessingStage::BlendMask(image.data, image.step, rect, confidence.data(), mask->get_width(),
+								   mask->get_height(), 127, colour, mask->get_transparency());
 }
 
-overlay_status_t draw_all(cv::Mat &mat, HailoROIPtr roi, const uint mask_overlay_n_threads)
+void draw_all(cv::Mat &mat, HailoROIPtr roi)
 {
-	overlay_status_t ret = OVERLAY_STATUS_UNINITIALIZED;
 	for (auto &obj : roi->get_objects())
 	{
 		if (obj->get_type() == HAILO_CONF_CLASS_MASK)
 		{
 			HailoConfClassMaskPtr mask = std::dynamic_pointer_cast<HailoConfClassMask>(obj);
 			if (mask->get_height() != 0 && mask->get_width() != 0)
-				draw_conf_class_mask(mat, mask, roi, mask_overlay_n_threads);
+				draw_conf_class_mask(mat, mask, roi);
 		}
 	}
-	ret = OVERLAY_STATUS_OK;
-	return ret;
 }
 
 } // namespace
@@ -263,7 +188,10 @@ bool YoloSegmentation::Process(CompletedRequestPtr &completed_request)
 		rgb_info.stride = rgb_info.width * 3;
 
 		input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
-		Yuv420ToRgb(input.get(), low_res_buffer.data(), low_res_info_, rgb_info);
+		// Other stages on this frame may want the same image.
+		std::shared_ptr<ScratchBuffer const> rgb =
+			GetRgbImage(completed_request, low_res_stream_, low_res_info_, rgb_info);
+		memcpy(input.get(), rgb->data(), rgb->size());
 	}
 	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
 			 low_res_info_.pixel_format == libcamera::formats::BGR888)
@@ -344,7 +272,7 @@ bool YoloSegmentation::runInference(uint8_t *input, uint32_t *output)
 										 bbox.ymax() * float(InputTensorSize().height)),
 					  cv::Scalar(0, 0, 255), 1);
 
-		draw_all(image, detection, 0);
+		draw_all(image, detection);
 	}
 
 	return true;
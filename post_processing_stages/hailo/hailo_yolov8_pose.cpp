@@ -97,7 +97,10 @@ bool YoloPose::Process(CompletedRequestPtr &completed_request)
 		input = allocator_.Allocate(rgb_info.stride * rgb_info.height);
 		input_ptr = input.get();
 
-		Yuv420ToRgb(input.get(), low_res_buffer.data(), low_res_info_, rgb_info);
+		// Other stages on this frame may want the same image.
+		std::shared_ptr<ScratchBuffer const> rgb =
+			GetRgbImage(completed_request, low_res_stream_, low_res_info_, rgb_info);
+		memcpy(input.get(), rgb->data(), rgb->size());
 	}
 	else if (low_res_info_.pixel_format == libcamera::formats::RGB888 ||
 			 low_res_info_.pixel_format == libcamera::formats::BGR888)
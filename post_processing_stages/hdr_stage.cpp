@@ -22,8 +22,14 @@
 // pixel manipulations, especially when it comes to colour, are a bit random. You have
 // been warned. Enjoy!
 
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
 #include <libcamera/stream.h>
 
+#include "core/cpu_features.hpp"
+#include "core/memory_report.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
@@ -40,6 +46,7 @@ struct LpFilterConfig
 {
 	double strength; // smaller value actually smoothes more
 	Pwl threshold; // defines the level of pixel differences that will be smoothed over
+	int halo; // rows of overlap between the bands that are filtered in parallel
 };
 
 // A TonemapPoint gives a target value within the full dynamic range where we would like
@@ -85,6 +92,27 @@ struct HdrConfig
 	std::string jpeg_filename; // set this if you want individual jpegs saved as well
 };
 
+// The fixed point tables made from the configuration, which the stage keeps from one HDR capture to
+// the next so that they are only made again when the configuration changes.
+
+static constexpr int NUM_WEIGHTS = 31;
+
+struct LpFilterLuts
+{
+	std::vector<uint32_t> scale; // 10 / threshold, with 8 fractional bits
+	uint32_t weights[NUM_WEIGHTS]; // e^(-x^2) for 0 <= x <= 3
+	uint32_t strength;
+	uint64_t threshold_version = 0;
+	void Update(LpFilterConfig const &config);
+};
+
+struct TonemapLuts
+{
+	PwlLut<int16_t> tonemap;
+	PwlLut<int16_t> pos_strength { 8 };
+	PwlLut<int16_t> neg_strength { 8 };
+};
+
 struct HdrImage
 {
 	HdrImage() : width(0), height(0), dynamic_range(0) {}
@@ -97,87 +125,138 @@ struct HdrImage
 	int16_t P(unsigned int offset) const { return pixels[offset]; }
 	void Clear() { std::fill(pixels.begin(), pixels.end(), 0); }
 	void Accumulate(uint8_t const *src, int stride);
-	HdrImage LpFilter(LpFilterConfig const &config) const;
+	HdrImage LpFilter(LpFilterConfig const &config, LpFilterLuts &luts) const;
 	Pwl CreateTonemap(GlobalTonemapConfig const &config) const;
-	void Tonemap(HdrImage const &lp, HdrConfig const &config);
+	void Tonemap(HdrImage const &lp, HdrConfig const &config, TonemapLuts &luts);
 	void Extract(uint8_t *dest, int stride) const;
 	Histogram CalculateHistogram() const;
 	void Scale(double factor);
 };
 
-static void add_Y_pixels(int16_t *dest, uint8_t const *src, int width, int stride, int height)
+// The image is processed in bands of rows, one per core. Band boundaries fall on multiples of
+// align rows, and no band is shorter than min_rows (except when the image itself is).
+
+template <typename F>
+static void for_each_band(int height, int align, int min_rows, F &&fn)
 {
-	for (int y = 0; y < height; y++, src += stride)
+	int num_bands = std::max(std::min<int>(std::thread::hardware_concurrency(), height / std::max(min_rows, 1)), 1);
+	int band_height = ((height + num_bands - 1) / num_bands + align - 1) / align * align;
+	std::vector<std::thread> threads;
+	for (int y0 = band_height; y0 < height; y0 += band_height)
+		threads.emplace_back(fn, y0, std::min(y0 + band_height, height));
+	fn(0, std::min(band_height, height));
+	for (auto &t : threads)
+		t.join();
+}
+
+static void add_row_generic(int16_t *dest, uint8_t const *src, int n, int bias)
+{
+	for (int x = 0; x < n; x++)
+		dest[x] += src[x] - bias;
+}
+
+#if defined(RPICAM_NEON_KERNELS)
+NEON_TARGET static void add_row_neon(int16_t *dest, uint8_t const *src, int n, int bias)
+{
+	int x = 0;
+	int16x8_t b = vdupq_n_s16(bias);
+	for (; x + 16 <= n; x += 16)
 	{
-		for (int x = 0; x < width; x++)
-			*(dest++) += src[x];
+		uint8x16_t s = vld1q_u8(src + x);
+		int16x8_t lo = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(s))), b);
+		int16x8_t hi = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(s))), b);
+		vst1q_s16(dest + x, vaddq_s16(vld1q_s16(dest + x), lo));
+		vst1q_s16(dest + x + 8, vaddq_s16(vld1q_s16(dest + x + 8), hi));
 	}
+	add_row_generic(dest + x, src + x, n - x, bias);
 }
+#endif
+
+using AddRow = void (*)(int16_t *, uint8_t const *, int, int);
+static AddRow const add_row = SelectKernel<AddRow>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, add_row_neon },
+#endif
+	{ CpuLevel::Generic, add_row_generic },
+});
 
 // Add the new image buffer to this "accumulator" image. We just add them as
 // we don't have the horsepower to do any fancy alignment or anything.
-// Actually, spreading it across a few threads doesn't seem to help much, though
-// compiling with "gcc -mfpu=neon-fp-armv8 -ftree-vectorize" gives a big
-// improvement.
 
 void HdrImage::Accumulate(uint8_t const *src, int stride)
 {
-	int16_t *dest = &P(0);
 	int width2 = width / 2, stride2 = stride / 2;
-	std::thread thread1(add_Y_pixels, dest, src, width, stride, height);
-
-	dest += width * height;
-	src += stride * height;
+	int16_t *dest_Y = &P(0), *dest_UV = dest_Y + width * height;
+	uint8_t const *src_UV = src + stride * height;
 
-	// U and V components
-	for (int y = 0; y < height; y++, src += stride2)
-	{
-		for (int x = 0; x < width2; x++)
-			*(dest++) += src[x] - 128;
-	}
+	// The U and V planes together have as many (half width) rows as the Y plane, so each band just
+	// takes the same rows of both.
+	for_each_band(height, 1, 64, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++)
+		{
+			add_row(dest_Y + y * width, src + y * stride, width, 0);
+			add_row(dest_UV + y * width2, src_UV + y * stride2, width2, 128);
+		}
+	});
 
 	dynamic_range += 256;
-
-	thread1.join();
 }
 
-// Forward pass of the IIR low pass filter.
+// The low pass filter works in fixed point. Filtered pixels have 4 fractional bits, weights have 12
+// and are kept to 8 fractional bits between the passes, so everything fits in 16 bits. The
+// strength is capped so that weight sums can't overflow; filtering barely happens beyond that anyway.
 
-static void forward_pass(std::vector<double> &fwd_pixels, std::vector<double> &fwd_weight_sums, HdrImage const &in,
-						 std::vector<double> &weights, std::vector<double> &threshold, int width, int height, int size,
-						 double strength)
+static constexpr double MAX_LP_STRENGTH = 64;
 
+void LpFilterLuts::Update(LpFilterConfig const &config)
 {
-	// (Should probably initialise the top/left elements of fwd_pixels/fwd_weight_sums...)
-	for (int y = size; y < height; y++)
+	// Computing the thresholds for every pixel would be slow, and the curve rarely changes.
+	if (scale.empty() || config.threshold.Version() != threshold_version)
 	{
-		unsigned int off = y * width + size;
-		for (int x = size; x < width; x++, off++)
+		std::vector<double> threshold = config.threshold.GenerateLut<double>();
+		scale.resize(threshold.size());
+		for (unsigned int i = 0; i < threshold.size(); i++)
+			scale[i] = std::lround(10 / threshold[i] * 256);
+		for (int d = 0; d < NUM_WEIGHTS; d++)
+			weights[d] = std::lround(exp(-d * d / 100.0) * 4096);
+		threshold_version = config.threshold.Version();
+	}
+	strength = std::lround(std::clamp(config.strength, 0.0, MAX_LP_STRENGTH) * 4096);
+}
+
+// One pass of the IIR low pass filter, forwards (dir = 1) from the top left or in reverse (dir = -1)
+// from the bottom right of the rows given. The first row and column it comes to are left at zero.
+
+static void lp_filter_pass(uint16_t *pixels, uint16_t *weight_sums, int16_t const *in, int width, int rows, int dir,
+						   LpFilterLuts const &luts)
+{
+	std::fill(pixels, pixels + width * rows, 0);
+	std::fill(weight_sums, weight_sums + width * rows, 0);
+	int row_step = dir * width;
+	for (int r = 1; r < rows; r++)
+	{
+		int off = dir > 0 ? r * width + 1 : (rows - 1 - r) * width + width - 2;
+		for (int x = 1; x < width; x++, off += dir)
 		{
-			int pixel = in.P(off);
-			double scale = 10 / threshold[pixel];
-			double pixel_wt_sum = pixel * strength, wt_sum = strength;
-
-			// Compiler generates faster code from this:
-			unsigned int p[4], idx[4];
-			double wt[4];
-			p[0] = fwd_pixels[off - width - 1];
-			p[1] = fwd_pixels[off - width];
-			p[2] = fwd_pixels[off - width + 1];
-			p[3] = fwd_pixels[off - 1];
-			idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
-			idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
-			idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
-			idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
-			wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
-			wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
-			wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
-			wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
-			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
-			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
-
-			fwd_pixels[off] = pixel_wt_sum / wt_sum;
-			fwd_weight_sums[off] = wt_sum;
+			int pixel = in[off];
+			uint32_t scale = luts.scale[pixel];
+			uint32_t wt_sum = luts.strength;
+			uint64_t pixel_wt_sum = (uint64_t)(pixel << 4) * luts.strength;
+
+			unsigned int p[4] = { pixels[off - row_step - dir], pixels[off - row_step], pixels[off - row_step + dir],
+								  pixels[off - dir] };
+			for (int i = 0; i < 4; i++)
+			{
+				unsigned int idx = (std::abs(static_cast<int>(p[i] >> 4) - pixel) * scale) >> 8;
+				uint32_t wt = idx < NUM_WEIGHTS ? luts.weights[idx] : 0;
+				// Neighbours only count to whole pixel precision, which is what the thresholds
+				// were tuned with.
+				pixel_wt_sum += wt * (p[i] & ~15u);
+				wt_sum += wt;
+			}
+
+			pixels[off] = (pixel_wt_sum + wt_sum / 2) / wt_sum;
+			weight_sums[off] = wt_sum >> 4;
 		}
 	}
 }
@@ -186,78 +265,42 @@ static void forward_pass(std::vector<double> &fwd_pixels, std::vector<double> &f
 // the results to get a smoothed but vaguely edge-preserving version of the
 // accumulator image. You could imagine implementing alternative (more sophisticated)
 // filters.
+//
+// Each band of rows is filtered on its own core, starting the forward pass "halo" rows above the
+// band and the reverse pass the same distance below it. The filter forgets where it started long
+// before it gets back to the band, so the bands join up invisibly.
 
-HdrImage HdrImage::LpFilter(LpFilterConfig const &config) const
+HdrImage HdrImage::LpFilter(LpFilterConfig const &config, LpFilterLuts &luts) const
 {
-	// Cache threshold values, computing them would be slow.
-	std::vector<double> threshold = config.threshold.GenerateLut<double>();
-
-	// Cache values of e^(-x^2) for 0 <= x <= 3, it will be much quicker
-	std::vector<double> weights(31);
-	for (int d = 0; d <= 30; d++)
-		weights[d] = exp(-d * d / 100.0);
-
-	int size = 1;
-	double strength = config.strength;
-
-	// Forward pass.
-	std::vector<double> fwd_weight_sums(width * height);
-	std::vector<double> fwd_pixels(width * height);
+	luts.Update(config);
 
 	HdrImage out(width, height, width * height);
 	out.dynamic_range = dynamic_range;
 
-	// Run the forward pass in other thread, so that the two passes run in parallel.
-	std::thread fwd_pass(forward_pass, std::ref(fwd_pixels), std::ref(fwd_weight_sums), std::ref(*this),
-						 std::ref(weights), std::ref(threshold), width, height, size, strength);
+	int halo = config.halo;
+	for_each_band(height, 1, std::max(halo, 64), [&](int y0, int y1) {
+		int fwd_start = std::max(y0 - halo, 0), fwd_rows = y1 - fwd_start;
+		int rev_end = std::min(y1 + halo, height), rev_rows = rev_end - y0;
+		std::vector<uint16_t> fwd_pixels(fwd_rows * width), fwd_weight_sums(fwd_rows * width);
+		std::vector<uint16_t> rev_pixels(rev_rows * width), rev_weight_sums(rev_rows * width);
 
-	// Reverse pass, but otherwise the same as the forward pass. There could be a small
-	// saving in omitting it, but it's not huge given that they run in parallel.
-	std::vector<double> rev_weight_sums(width * height);
-	std::vector<double> rev_pixels(width * height);
-	// (Should probably initialise the bottom/right elements of rev_pixels/rev_weight_sums...)
-	for (int y = height - 1 - size; y >= 0; y--)
-	{
-		unsigned int off = y * width + width - 1 - size;
-		for (int x = width - 1 - size; x >= 0; x--, off--)
+		lp_filter_pass(fwd_pixels.data(), fwd_weight_sums.data(), pixels.data() + fwd_start * width, width, fwd_rows, 1, luts);
+		lp_filter_pass(rev_pixels.data(), rev_weight_sums.data(), pixels.data() + y0 * width, width, rev_rows, -1, luts);
+
+		// Combine. Pixels that neither pass reached (two of the corners) stay as they were.
+		unsigned int fwd_off = (y0 - fwd_start) * width, rev_off = 0;
+		for (unsigned int off = y0 * width; off < (unsigned int)(y1 * width); off++, fwd_off++, rev_off++)
 		{
-			int pixel = P(off);
-			double scale = 10 / threshold[pixel];
-			double pixel_wt_sum = pixel * strength, wt_sum = strength;
-
-			// Compiler generates faster code from this:
-			unsigned int p[4], idx[4];
-			double wt[4];
-			p[0] = rev_pixels[off + width + 1];
-			p[1] = rev_pixels[off + width];
-			p[2] = rev_pixels[off + width - 1];
-			p[3] = rev_pixels[off + 1];
-			idx[0] = std::abs(static_cast<int>(p[0]) - pixel) * scale;
-			idx[1] = std::abs(static_cast<int>(p[1]) - pixel) * scale;
-			idx[2] = std::abs(static_cast<int>(p[2]) - pixel) * scale;
-			idx[3] = std::abs(static_cast<int>(p[3]) - pixel) * scale;
-			wt[0] = idx[0] >= weights.size() ? 0.0 : weights[idx[0]];
-			wt[1] = idx[1] >= weights.size() ? 0.0 : weights[idx[1]];
-			wt[2] = idx[2] >= weights.size() ? 0.0 : weights[idx[2]];
-			wt[3] = idx[3] >= weights.size() ? 0.0 : weights[idx[3]];
-			pixel_wt_sum += wt[0] * p[0] + wt[1] * p[1] + wt[2] * p[2] + wt[3] * p[3];
-			wt_sum += wt[0] + wt[1] + wt[2] + wt[3];
-
-			rev_pixels[off] = pixel_wt_sum / wt_sum;
-			rev_weight_sums[off] = wt_sum;
+			uint32_t fwd_wt = fwd_weight_sums[fwd_off], rev_wt = rev_weight_sums[rev_off];
+			uint32_t wt_sum = (fwd_wt + rev_wt) << 4;
+			if (!wt_sum)
+				out.P(off) = P(off);
+			else
+				out.P(off) = ((uint64_t)fwd_pixels[fwd_off] * fwd_wt + (uint64_t)rev_pixels[rev_off] * rev_wt +
+							  wt_sum / 2) /
+							 wt_sum;
 		}
-	}
-
-	fwd_pass.join();
-
-	// Combine.
-	unsigned int off = 0;
-	for (int y = 0; y < height; y++)
-	{
-		for (int x = 0; x < width; x++, off++)
-			out.P(off) = (fwd_pixels[off] * fwd_weight_sums[off] + rev_pixels[off] * rev_weight_sums[off]) /
-						 (fwd_weight_sums[off] + rev_weight_sums[off]);
-	}
+	});
 
 	return out;
 }
@@ -295,82 +338,194 @@ Pwl HdrImage::CreateTonemap(GlobalTonemapConfig const &config) const
 	return tonemap;
 }
 
-// Tonemap the low pass image according to the global tone curve, and add back the high pass
-// detail (given by the original pixel minus the low pass equivalent).
+// Add the high pass detail (the original pixel minus the low pass one) back to the tonemapped low pass
+// pixel, scaled by the local contrast strength for whether it is brighter or darker than its
+// neighbourhood. The strengths have 8 fractional bits.
 
-void HdrImage::Tonemap(HdrImage const &lp, HdrConfig const &config)
+static void local_contrast_generic(int16_t *Y, int16_t const *Y_lp, int16_t const *mapped, int16_t const *pos,
+								   int16_t const *neg, int n, int maxval)
 {
-	Pwl tonemap = CreateTonemap(config.global_tonemap);
+	for (int x = 0; x < n; x++)
+	{
+		int Y_hp = Y[x] - Y_lp[x];
+		int strength = Y_hp > 0 ? pos[x] : neg[x];
+		Y[x] = std::clamp(mapped[x] + ((strength * Y_hp + 128) >> 8), 0, maxval);
+	}
+}
+
+#if defined(RPICAM_NEON_KERNELS)
+NEON_TARGET static void local_contrast_neon(int16_t *Y, int16_t const *Y_lp, int16_t const *mapped,
+											int16_t const *pos, int16_t const *neg, int n, int maxval)
+{
+	int x = 0;
+	int32x4_t zero = vdupq_n_s32(0), max = vdupq_n_s32(maxval);
+	for (; x + 8 <= n; x += 8)
+	{
+		int16x8_t y = vld1q_s16(Y + x), lp = vld1q_s16(Y_lp + x), m = vld1q_s16(mapped + x);
+		int16x8_t strength = vbslq_s16(vcgtq_s16(y, lp), vld1q_s16(pos + x), vld1q_s16(neg + x));
+		int32x4_t hp_lo = vsubl_s16(vget_low_s16(y), vget_low_s16(lp));
+		int32x4_t hp_hi = vsubl_s16(vget_high_s16(y), vget_high_s16(lp));
+		int32x4_t lo = vrshrq_n_s32(vmulq_s32(vmovl_s16(vget_low_s16(strength)), hp_lo), 8);
+		int32x4_t hi = vrshrq_n_s32(vmulq_s32(vmovl_s16(vget_high_s16(strength)), hp_hi), 8);
+		lo = vminq_s32(vmaxq_s32(vaddw_s16(lo, vget_low_s16(m)), zero), max);
+		hi = vminq_s32(vmaxq_s32(vaddw_s16(hi, vget_high_s16(m)), zero), max);
+		vst1q_s16(Y + x, vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)));
+	}
+	local_contrast_generic(Y + x, Y_lp + x, mapped + x, pos + x, neg + x, n - x, maxval);
+}
+#endif
 
-	// Make LUTs for the all the Pwls, it'll be much quicker.
-	std::vector<int> tonemap_lut = tonemap.GenerateLut<int>();
-	std::vector<double> pos_strength_lut = config.local_tonemap.pos_strength.GenerateLut<double>();
-	std::vector<double> neg_strength_lut = config.local_tonemap.neg_strength.GenerateLut<double>();
-	double colour_scale = config.local_tonemap.colour_scale;
+using LocalContrast = void (*)(int16_t *, int16_t const *, int16_t const *, int16_t const *, int16_t const *, int,
+							   int);
+static LocalContrast const local_contrast = SelectKernel<LocalContrast>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, local_contrast_neon },
+#endif
+	{ CpuLevel::Generic, local_contrast_generic },
+});
+
+// Tonemap the low pass image according to the global tone curve, and add back the high pass
+// detail. Each row's curve values are looked up first, so that the arithmetic can be done in
+// vectors. The colour scale is applied with 12 fractional bits.
+
+void HdrImage::Tonemap(HdrImage const &lp, HdrConfig const &config, TonemapLuts &luts)
+{
+	// The tone curve follows the image, but the local contrast strengths stay as configured.
+	luts.tonemap.Update(CreateTonemap(config.global_tonemap));
+	luts.pos_strength.Update(config.local_tonemap.pos_strength);
+	luts.neg_strength.Update(config.local_tonemap.neg_strength);
+	int64_t colour_scale = std::lround(config.local_tonemap.colour_scale * 4096);
 
 	int maxval = dynamic_range - 1;
-	for (int y = 0; y < height; y++)
-	{
-		unsigned int off_Y = y * width;
-		unsigned int off_U = y * width / 4 + width * height;
-		unsigned int off_V = off_U + width * height / 4;
-		for (int x = 0; x < width; x++, off_Y++)
+	// Bands start on even rows so that each one owns complete rows of U and V.
+	for_each_band(height, 2, 64, [&](int y0, int y1) {
+		std::vector<int16_t> mapped(width), pos(width), neg(width);
+		for (int y = y0; y < y1; y++)
 		{
-			int Y_lp_orig = lp.P(off_Y), Y_hp = P(off_Y) - Y_lp_orig;
-			int Y_lp_mapped = tonemap_lut[Y_lp_orig];
-			double strength = (Y_hp > 0 ? pos_strength_lut : neg_strength_lut)[Y_lp_orig];
-			int Y_final = std::clamp(Y_lp_mapped + (int)(strength * Y_hp), 0, maxval);
-			P(off_Y) = Y_final;
-			if (!(x & 1) && !(y & 1))
+			int16_t *Y = &P(y * width);
+			int16_t const *Y_lp = lp.pixels.data() + y * width;
+			luts.tonemap.Gather(mapped.data(), Y_lp, width);
+			luts.pos_strength.Gather(pos.data(), Y_lp, width);
+			luts.neg_strength.Gather(neg.data(), Y_lp, width);
+			local_contrast(Y, Y_lp, mapped.data(), pos.data(), neg.data(), width, maxval);
+			if (y & 1)
+				continue;
+
+			unsigned int off_U = y * width / 4 + width * height;
+			unsigned int off_V = off_U + width * height / 4;
+			for (int x = 0; x < width; x += 2, off_U++, off_V++)
 			{
-				double f = (Y_final + 1) / (double)(Y_lp_orig + 1);
-				// The values here are non-linear to colours can come out slightly saturated.
-				// The colour_scale allows us to tweak that a little if we want.
-				f = (f - 1) * colour_scale + 1;
-				int U = P(off_U), V = P(off_V);
-				P(off_U) = U * f;
-				P(off_V) = V * f;
-				off_U++, off_V++;
+				// The colour gain is f = (Y_final + 1) / (Y_lp_orig + 1), but the values here
+				// are non-linear so colours can come out slightly saturated. The colour_scale
+				// allows us to tweak that a little if we want, using (f - 1) * colour_scale + 1.
+				int Y_final = Y[x], Y_lp_orig = Y_lp[x];
+				int64_t num = (Y_final + 1) * colour_scale + (Y_lp_orig + 1) * (4096 - colour_scale);
+				int64_t den = (Y_lp_orig + 1) * 4096;
+				P(off_U) = std::clamp<int64_t>(P(off_U) * num / den, INT16_MIN, INT16_MAX);
+				P(off_V) = std::clamp<int64_t>(P(off_V) * num / den, INT16_MIN, INT16_MAX);
 			}
 		}
-	}
+	});
 }
 
-// Write image back out to 8-bit buffer with given stride.
+// Write image back out to 8-bit buffer with given stride. The divisor is a constant in the rows' loops
+// for the usual frame counts (0 leaves it to the argument), which lets the compiler turn the divisions
+// into shifts and vectorise them.
+
+template <int fixed_ratio>
+static void extract_luma_row(int16_t const *src, uint8_t *dest, int n, int ratio)
+{
+	if constexpr (fixed_ratio != 0)
+		ratio = fixed_ratio;
+	for (int x = 0; x < n; x++)
+		dest[x] = src[x] / ratio;
+}
+
+template <int fixed_ratio>
+static void extract_chroma_row(int16_t const *src, uint8_t *dest, int n, int ratio)
+{
+	if constexpr (fixed_ratio != 0)
+		ratio = fixed_ratio;
+	for (int x = 0; x < n; x++)
+		dest[x] = std::clamp(src[x] / ratio + 128, 0, 255);
+}
 
 void HdrImage::Extract(uint8_t *dest, int stride) const
 {
-	double ratio = dynamic_range / 256;
+	int ratio = std::max(dynamic_range / 256, 1);
+	using ExtractRow = void (*)(int16_t const *, uint8_t *, int, int);
+	ExtractRow luma_row = extract_luma_row<0>, chroma_row = extract_chroma_row<0>;
+	switch (ratio)
+	{
+	case 1:
+		luma_row = extract_luma_row<1>, chroma_row = extract_chroma_row<1>;
+		break;
+	case 2:
+		luma_row = extract_luma_row<2>, chroma_row = extract_chroma_row<2>;
+		break;
+	case 4:
+		luma_row = extract_luma_row<4>, chroma_row = extract_chroma_row<4>;
+		break;
+	case 8:
+		luma_row = extract_luma_row<8>, chroma_row = extract_chroma_row<8>;
+		break;
+	case 16:
+		luma_row = extract_luma_row<16>, chroma_row = extract_chroma_row<16>;
+		break;
+	}
+
 	const int16_t *Y_ptr = &pixels[0];
 	const int16_t *U_ptr = Y_ptr + width * height, *V_ptr = U_ptr + width * height / 4;
 	uint8_t *dest_y = dest;
 	uint8_t *dest_u = dest_y + stride * height, *dest_v = dest_u + stride * height / 4;
+	int w = width / 2, s = stride / 2;
 
-	for (int y = 0; y < height; y++, dest_y += stride)
-	{
-		for (int x = 0; x < width; x++)
-			dest_y[x] = *(Y_ptr++) / ratio;
-	}
+	for_each_band(height, 2, 64, [&](int y0, int y1) {
+		for (int y = y0; y < y1; y++)
+			luma_row(Y_ptr + y * width, dest_y + y * stride, width, ratio);
 
-	int w = width / 2, h = height / 2, s = stride / 2;
-	for (int y = 0; y < h; y++, dest_u += s, dest_v += s)
-	{
-		for (int x = 0; x < w; x++)
+		for (int y = y0 / 2; y < y1 / 2; y++)
 		{
-			int U = *(U_ptr++) / ratio;
-			int V = *(V_ptr++) / ratio;
-			dest_u[x] = std::clamp(U + 128, 0, 255);
-			dest_v[x] = std::clamp(V + 128, 0, 255);
+			chroma_row(U_ptr + y * w, dest_u + y * s, w, ratio);
+			chroma_row(V_ptr + y * w, dest_v + y * s, w, ratio);
 		}
+	});
+}
+
+// Apply simple scaling to all pixels, using a factor with 16 fractional bits.
+
+static void scale_generic(int16_t *p, int n, int32_t f)
+{
+	for (int i = 0; i < n; i++)
+		p[i] = std::clamp<int32_t>((p[i] * f + 32768) >> 16, INT16_MIN, INT16_MAX);
+}
+
+#if defined(RPICAM_NEON_KERNELS)
+NEON_TARGET static void scale_neon(int16_t *p, int n, int32_t f)
+{
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		int16x8_t v = vld1q_s16(p + i);
+		int32x4_t lo = vrshrq_n_s32(vmulq_n_s32(vmovl_s16(vget_low_s16(v)), f), 16);
+		int32x4_t hi = vrshrq_n_s32(vmulq_n_s32(vmovl_s16(vget_high_s16(v)), f), 16);
+		vst1q_s16(p + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
 	}
+	scale_generic(p + i, n - i, f);
 }
+#endif
 
-// Apply simple scaling to all pixels.
+using ScalePixels = void (*)(int16_t *, int, int32_t);
+static ScalePixels const scale_pixels = SelectKernel<ScalePixels>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, scale_neon },
+#endif
+	{ CpuLevel::Generic, scale_generic },
+});
 
 void HdrImage::Scale(double factor)
 {
-	for (unsigned int i = 0; i < pixels.size(); i++)
-		pixels[i] *= factor;
+	scale_pixels(pixels.data(), pixels.size(), std::lround(factor * 65536));
 	dynamic_range *= factor;
 }
 
@@ -381,6 +536,9 @@ public:
 
 	char const *Name() const override;
 
+	// Frames must be accumulated one at a time, and the final one is the one we output.
+	Concurrency GetConcurrency() const override { return Concurrency::Ordered; }
+
 	void AdjustConfig(std::string const &use_case, StreamConfiguration *config) override;
 
 	void Read(boost::property_tree::ptree const &params) override;
@@ -395,7 +553,10 @@ private:
 	HdrConfig config_;
 	unsigned int frame_num_;
 	std::mutex mutex_;
-	HdrImage acc_, lp_;
+	HdrImage acc_;
+	MemoryUse acc_memory_;
+	LpFilterLuts lp_luts_;
+	TonemapLuts tonemap_luts_;
 };
 
 #define NAME "hdr"
@@ -411,6 +572,7 @@ void HdrStage::Read(boost::property_tree::ptree const &params)
 
 	config_.lp_filter.strength = params.get<double>("lp_filter_strength");
 	config_.lp_filter.threshold.Read(params.get_child("lp_filter_threshold"));
+	config_.lp_filter.halo = params.get<int>("lp_filter_halo", 128);
 
 	for (auto &p : params.get_child("global_tonemap_points"))
 	{
@@ -459,7 +621,7 @@ void HdrStage::Configure()
 	frame_num_ = 0;
 	acc_ = HdrImage(info_.width, info_.height, info_.width * info_.height * 3 / 2);
 	acc_.Clear();
-	lp_ = HdrImage(info_.width, info_.height, info_.width * info_.height);
+	acc_memory_ = MemoryUse("hdr", MemoryReport::Kind::Heap, acc_.pixels.size() * sizeof(int16_t));
 }
 
 bool HdrStage::Process(CompletedRequestPtr &completed_request)
@@ -507,12 +669,17 @@ bool HdrStage::Process(CompletedRequestPtr &completed_request)
 	LOG(1, "Doing HDR processing...");
 	acc_.Scale(16.0 / config_.num_frames);
 
-	lp_ = acc_.LpFilter(config_.lp_filter);
-	acc_.Tonemap(lp_, config_);
+	HdrImage lp = acc_.LpFilter(config_.lp_filter, lp_luts_);
+	MemoryUse lp_memory("hdr", MemoryReport::Kind::Heap, lp.pixels.size() * sizeof(int16_t));
+	acc_.Tonemap(lp, config_, tonemap_luts_);
 
 	acc_.Extract(image, info_.stride);
 	LOG(1, "HDR done!");
 
+	// Nothing more is accumulated until the stage is configured again, so the images can go now.
+	acc_ = HdrImage();
+	acc_memory_.reset();
+
 	return false;
 }
 
@@ -13,15 +13,16 @@
 
 #include <libcamera/control_ids.h>
 #include <libcamera/geometry.h>
+#include <libcamera/base/span.h>
 
 #include "core/rpicam_app.hpp"
 #include "post_processing_stages/object_detect.hpp"
+#include "post_processing_stages/object_tracker.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include "imx500_post_processing_stage.hpp"
 
 using Rectangle = libcamera::Rectangle;
-using Size = libcamera::Size;
 namespace controls = libcamera::controls;
 
 #define NAME "imx500_object_detection"
@@ -56,19 +57,14 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	int processOutputTensor(std::vector<Detection> &objects, const std::vector<float> &output_tensor,
-							const CnnOutputTensorInfo &output_tensor_info, const Rectangle &scaler_crop) const;
-	void filterOutputObjects(std::vector<Detection> &objects);
-
-	struct LtObject
-	{
-		Detection params;
-		unsigned int visible;
-		unsigned int hidden;
-		bool matched;
-	};
-
-	std::vector<LtObject> lt_objects_;
+	int processOutputTensor(std::vector<Detection> &objects, libcamera::Span<const float> output_tensor,
+							const CnnOutputTensorInfo &output_tensor_info, const Rectangle &scaler_crop);
+
+	ObjectTracker tracker_;
+	// The last results when not temporal filtering, for frames that have no output tensor.
+	std::vector<Detection> last_objects_;
+	// Scratch space for decoding the output tensor, kept to save reallocating it each frame.
+	ObjectDetectionOutput output_;
 	std::mutex lt_lock_;
 
 	// Config params
@@ -76,10 +72,6 @@ private:
 	float threshold_;
 	std::vector<std::string> classes_;
 	bool temporal_filtering_;
-	float tolerance_;
-	float factor_;
-	unsigned int visible_frames_;
-	unsigned int hidden_frames_;
 	bool started_ = false;
 };
 
@@ -94,24 +86,19 @@ void ObjectDetection::Read(boost::property_tree::ptree const &params)
 	threshold_ = params.get<float>("threshold", 0.5f);
 	classes_ = PostProcessingStage::GetJsonArray<std::string>(params, "classes");
 
-	if (params.find("temporal_filter") != params.not_found())
-	{
-		temporal_filtering_ = true;
-		tolerance_ = params.get<float>("temporal_filter.tolerance", 0.05);
-		factor_ = params.get<float>("temporal_filter.factor", 0.2);
-		visible_frames_ = params.get<unsigned int>("temporal_filter.visible_frames", 5);
-		hidden_frames_ = params.get<unsigned int>("temporal_filter.hidden_frames", 2);
-	}
-	else
-		temporal_filtering_ = false;
+	temporal_filtering_ = params.find("temporal_filter") != params.not_found();
+	if (temporal_filtering_)
+		tracker_.SetConfig(ObjectTracker::ReadConfig(params));
 
 	IMX500PostProcessingStage::Read(params);
 }
 
 void ObjectDetection::Configure()
 {
-	lt_objects_.clear();
 	IMX500PostProcessingStage::Configure();
+	last_objects_.clear();
+	if (output_stream_)
+		tracker_.Reset(output_stream_->configuration().size);
 	if (!started_)
 	{
 		IMX500PostProcessingStage::ShowFwProgressBar();
@@ -133,46 +120,25 @@ bool ObjectDetection::Process(CompletedRequestPtr &completed_request)
 	std::vector<Detection> objects;
 
 	// Process() can be concurrently called through different threads for consecutive CompletedRequests if
-	// things are running behind.  So protect access to the lt_objects_ state object.
+	// things are running behind.  So protect access to the tracker and the scratch output.
 	std::scoped_lock<std::mutex> l(lt_lock_);
 
 	if (output && info)
 	{
-		std::vector<float> output_tensor(output->data(), output->data() + output->size());
-		CnnOutputTensorInfo output_tensor_info = *reinterpret_cast<const CnnOutputTensorInfo *>(info->data());
+		// The tensor can be read where it is in the request's metadata.
+		const CnnOutputTensorInfo &output_tensor_info = *reinterpret_cast<const CnnOutputTensorInfo *>(info->data());
 
-		processOutputTensor(objects, output_tensor, output_tensor_info, *scaler_crop);
+		processOutputTensor(objects, *output, output_tensor_info, *scaler_crop);
 
 		if (temporal_filtering_)
-		{
-			filterOutputObjects(objects);
-			if (lt_objects_.size())
-			{
-				objects.clear();
-				for (auto const &obj : lt_objects_)
-				{
-					if (!obj.hidden)
-						objects.push_back(obj.params);
-				}
-			}
-		}
+			tracker_.Update(objects);
 		else
-		{
-			// If no temporal filtering, make sure we fill lt_objects_ with the current result as it may be used if
-			// there is no output tensor on subsequent frames.
-			lt_objects_.clear();
-			for (auto const &obj : objects)
-				lt_objects_.push_back({ obj, 0, 0, 0 });
-		}
+			last_objects_ = objects;
 	}
 	else
 	{
-		// No output tensor, so simply reuse the results from the lt_objects_.
-		for (auto const &obj : lt_objects_)
-		{
-			if (!obj.hidden)
-				objects.push_back(obj.params);
-		}
+		// No output tensor, so simply reuse the last results.
+		objects = temporal_filtering_ ? tracker_.Objects() : last_objects_;
 	}
 
 	if (objects.size())
@@ -181,39 +147,31 @@ bool ObjectDetection::Process(CompletedRequestPtr &completed_request)
 	return IMX500PostProcessingStage::Process(completed_request);
 }
 
-static int createObjectDetectionData(ObjectDetectionOutput &output, const std::vector<float> &data,
+static int createObjectDetectionData(ObjectDetectionOutput &output, libcamera::Span<const float> data,
 									 unsigned int total_detections)
 {
-	unsigned int count = 0;
+	// The caller has checked that data holds 6 values per detection, plus the count.
+	const float *coords = data.data();
+	const float *scores = coords + 4 * total_detections;
+	const float *classes = scores + total_detections;
 
 	// Extract bounding box co-ordinates
+	output.bboxes.resize(total_detections);
 	for (unsigned int i = 0; i < total_detections; i++)
 	{
-		Bbox bbox;
-		bbox.y0 = data.at(count + i);
-		bbox.x0 = data.at(count + i + (1 * total_detections));
-		bbox.y1 = data.at(count + i + (2 * total_detections));
-		bbox.x1 = data.at(count + i + (3 * total_detections));
-		output.bboxes.push_back(bbox);
+		Bbox &bbox = output.bboxes[i];
+		bbox.y0 = coords[i];
+		bbox.x0 = coords[i + (1 * total_detections)];
+		bbox.y1 = coords[i + (2 * total_detections)];
+		bbox.x1 = coords[i + (3 * total_detections)];
 	}
-	count += (total_detections * 4);
 
-	// Extract scores
-	for (unsigned int i = 0; i < total_detections; i++)
-	{
-		output.scores.push_back(data.at(count));
-		count++;
-	}
-
-	// Extract class indices
-	for (unsigned int i = 0; i < total_detections; i++)
-	{
-		output.classes.push_back(data.at(count));
-		count++;
-	}
+	// Extract scores and class indices
+	output.scores.assign(scores, scores + total_detections);
+	output.classes.assign(classes, classes + total_detections);
 
 	// Extract number of detections
-	unsigned int num_detections = data.at(count);
+	unsigned int num_detections = data[6 * total_detections];
 	if (num_detections > total_detections)
 	{
 		LOG(1, "Unexpected value for num_detections: " << num_detections << ", setting it to " << total_detections);
@@ -224,9 +182,8 @@ static int createObjectDetectionData(ObjectDetectionOutput &output, const std::v
 	return 0;
 }
 
-int ObjectDetection::processOutputTensor(std::vector<Detection> &objects, const std::vector<float> &output_tensor,
-										 const CnnOutputTensorInfo &output_tensor_info,
-										 const Rectangle &scaler_crop) const
+int ObjectDetection::processOutputTensor(std::vector<Detection> &objects, libcamera::Span<const float> output_tensor,
+										 const CnnOutputTensorInfo &output_tensor_info, const Rectangle &scaler_crop)
 {
 	if (output_tensor_info.num_tensors != 4)
 	{
@@ -235,7 +192,7 @@ int ObjectDetection::processOutputTensor(std::vector<Detection> &objects, const
 	}
 
 	const unsigned int total_detections = output_tensor_info.info[0].tensor_data_num / 4;
-	ObjectDetectionOutput output;
+	ObjectDetectionOutput &output = output_;
 
 	// 4x coords + 1x labels + 1x confidences + 1 total detections
 	if (output_tensor.size() != 6 * total_detections + 1)
@@ -277,69 +234,6 @@ int ObjectDetection::processOutputTensor(std::vector<Detection> &objects, const
 	return 0;
 }
 
-void ObjectDetection::filterOutputObjects(std::vector<Detection> &objects)
-{
-	const Size isp_output_size = output_stream_->configuration().size;
-	bool empty = lt_objects_.empty();
-
-	for (auto &lt_obj : lt_objects_)
-		lt_obj.matched = false;
-
-	for (auto const &object : objects)
-	{
-		bool matched = false;
-		for (auto &lt_obj : lt_objects_)
-		{
-			// Try and match a detected object in our long term list.
-			if (object.category == lt_obj.params.category &&
-				std::abs(object.box.x - lt_obj.params.box.x) < tolerance_ * isp_output_size.width &&
-				std::abs(object.box.y - lt_obj.params.box.y) < tolerance_ * isp_output_size.height &&
-				std::abs((int)object.box.width - (int)lt_obj.params.box.width) < tolerance_ * isp_output_size.width &&
-				std::abs((int)object.box.height - (int)lt_obj.params.box.height) < tolerance_ * isp_output_size.height)
-			{
-				lt_obj.matched = matched = true;
-				lt_obj.params.confidence = object.confidence;
-				lt_obj.params.box.x = factor_ * object.box.x + (1 - factor_) * lt_obj.params.box.x;
-				lt_obj.params.box.y = factor_ * object.box.y + (1 - factor_) * lt_obj.params.box.y;
-				lt_obj.params.box.width = factor_ * object.box.width + (1 - factor_) * lt_obj.params.box.width;
-				lt_obj.params.box.height = factor_ * object.box.height + (1 - factor_) * lt_obj.params.box.height;
-				// Reset the visibility counter for when the object next disappears.
-				lt_obj.visible = visible_frames_;
-				// Decrement the hidden counter until the object becomes visible in the list.
-				lt_obj.hidden = std::max(0, (int)lt_obj.hidden - 1);
-				break;
-			}
-		}
-
-		// Add the object to the long term list if not found.  This object will remain hidden for hidden_frames_
-		// consecutive frames unless the long term list started out empty.
-		if (!matched)
-		{
-			const unsigned int hidden_frames = empty ? 0 : hidden_frames_;
-			lt_objects_.push_back({ object, visible_frames_, hidden_frames, 1 });
-		}
-	}
-
-	for (auto &lt_obj : lt_objects_)
-	{
-		if (!lt_obj.matched)
-		{
-			// If a non matched object in the long term list is still hidden, set visible count to 0 so that it must be
-			// matched for hidden_frames_ consecutive frames before becoming visible. Otherwise, decrement the visible
-			// count of unmatched objects in the long term list.
-			if (lt_obj.hidden)
-				lt_obj.visible = 0;
-			else
-				lt_obj.visible--;
-		}
-	}
-
-	// Remove now invisible objects from the long term list.
-	lt_objects_.erase(std::remove_if(lt_objects_.begin(), lt_objects_.end(),
-						[] (const LtObject &obj) { return !obj.matched && !obj.visible; }),
-					  lt_objects_.end());
-}
-
 static PostProcessingStage *Create(RPiCamApp *app)
 {
 	return new ObjectDetection(app);
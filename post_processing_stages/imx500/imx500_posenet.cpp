@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <array>
 #include <cmath>
+#include <functional>
 #include <limits>
 #include <mutex>
 #include <numeric>
@@ -15,6 +16,10 @@
 #include <string>
 #include <vector>
 
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #include <libcamera/control_ids.h>
 #include <libcamera/geometry.h>
 
@@ -166,23 +171,26 @@ float squared_distance(const Point &a, const Point &b)
 	return dy * dy + dx * dx;
 }
 
-std::vector<float> format_tensor(const float *data, unsigned int size, unsigned int div)
+// Reorder the tensor from channels first to channels last, writing it into the given vector so that its storage
+// can be reused from frame to frame. We walk the output in order, as scattered reads are cheaper than scattered
+// writes.
+void format_tensor(std::vector<float> &tensor, const float *data, unsigned int size, unsigned int div)
 {
-	std::vector<float> tensor(size * MAP_SIZE.width * MAP_SIZE.height);
+	constexpr unsigned int plane_size = MAP_SIZE.width * MAP_SIZE.height;
+	const float scale = 1.0f / div;
+
+	tensor.resize(size * plane_size);
+	float *dst = tensor.data();
 
-	for (unsigned int i = 0; i < size; i++)
+	for (unsigned int k = 0; k < MAP_SIZE.height; k++)
 	{
 		for (unsigned int j = 0; j < MAP_SIZE.width; j++)
 		{
-			for (unsigned int k = 0; k < MAP_SIZE.height; k++)
-			{
-				tensor[(size * MAP_SIZE.width * k) + (size * j) + i] =
-					data[(MAP_SIZE.width * MAP_SIZE.height * i) + (j * MAP_SIZE.height) + k] / div;
-			}
+			const float *src = data + j * MAP_SIZE.height + k;
+			for (unsigned int i = 0; i < size; i++)
+				*dst++ = src[plane_size * i] * scale;
 		}
 	}
-
-	return tensor;
 }
 
 // Build an adjacency list of the pose graph.
@@ -201,8 +209,8 @@ AdjacencyList build_agency_list()
 	return adjacency_list;
 }
 
-bool pass_keypoint_nms(std::vector<PoseKeypoints> poses, const size_t num_poses, const KeypointWithScore &keypoint,
-					   const float squared_nms_radius)
+bool pass_keypoint_nms(const std::vector<PoseKeypoints> &poses, const size_t num_poses,
+					   const KeypointWithScore &keypoint, const float squared_nms_radius)
 {
 	for (unsigned int i = 0; i < num_poses; ++i)
 	{
@@ -260,14 +268,14 @@ void build_bilinear_interpolation(const Point point, const unsigned int num_chan
 	*bottom_right = (y_ceil * MAP_SIZE.width + x_ceil) * num_channels;
 }
 
-// Sample the input tensor values at position (x, y) and at multiple channels.
+// Sample the input tensor values at position (x, y) and at a pair of channels.
 // The input tensor has shape [height, width, num_channels]. We bilinearly
-// sample its value at tensor(y, x, c), for c in the channels specified. This
-// is faster than calling the single channel interpolation function multiple
-// times because the computation of the positions needs to be done only once.
-std::vector<float> sample_tensor_at_multiple_channels(const std::vector<float> &tensor, const Point &point,
-													  const std::vector<int> &result_channels,
-													  unsigned int num_channels)
+// sample its value at tensor(y, x, c0) and tensor(y, x, c1). This is faster
+// than calling the single channel interpolation function twice because the
+// computation of the positions needs to be done only once. The offsets all
+// come in (y, x) pairs, so we never need more channels than this.
+std::array<float, 2> sample_tensor_at_two_channels(const std::vector<float> &tensor, const Point &point, const int c0,
+												   const int c1, unsigned int num_channels)
 {
 	int top_left, top_right, bottom_left, bottom_right;
 	float y_lerp, x_lerp;
@@ -275,11 +283,13 @@ std::vector<float> sample_tensor_at_multiple_channels(const std::vector<float> &
 	build_bilinear_interpolation(point, num_channels, &top_left, &top_right, &bottom_left, &bottom_right, &y_lerp,
 								 &x_lerp);
 
-	std::vector<float> result;
-	for (auto &c : result_channels)
+	std::array<float, 2> result;
+	const int channels[2] = { c0, c1 };
+	for (unsigned int i = 0; i < 2; i++)
 	{
-		result.push_back((1 - y_lerp) * ((1 - x_lerp) * tensor[top_left + c] + x_lerp * tensor[top_right + c]) +
-						 y_lerp * ((1 - x_lerp) * tensor[bottom_left + c] + x_lerp * tensor[bottom_right + c]));
+		const int c = channels[i];
+		result[i] = (1 - y_lerp) * ((1 - x_lerp) * tensor[top_left + c] + x_lerp * tensor[top_right + c]) +
+					y_lerp * ((1 - x_lerp) * tensor[bottom_left + c] + x_lerp * tensor[bottom_right + c]);
 	}
 
 	return result;
@@ -291,64 +301,75 @@ std::vector<float> sample_tensor_at_multiple_channels(const std::vector<float> &
 float sample_tensor_at_single_channel(const std::vector<float> &tensor, const Point &point, unsigned int num_channels,
 									  const int c)
 {
-	std::vector<float> result = sample_tensor_at_multiple_channels(tensor, point, std::vector<int> { c }, num_channels);
-	return result[0];
+	int top_left, top_right, bottom_left, bottom_right;
+	float y_lerp, x_lerp;
+
+	build_bilinear_interpolation(point, num_channels, &top_left, &top_right, &bottom_left, &bottom_right, &y_lerp,
+								 &x_lerp);
+
+	return (1 - y_lerp) * ((1 - x_lerp) * tensor[top_left + c] + x_lerp * tensor[top_right + c]) +
+		   y_lerp * ((1 - x_lerp) * tensor[bottom_left + c] + x_lerp * tensor[bottom_right + c]);
+}
+
+// Each row of the score map holds MAP_SIZE.width pixels of NUM_KEYPOINTS scores.
+constexpr unsigned int SCORE_ROW_SIZE = MAP_SIZE.width * NUM_KEYPOINTS;
+
+// The maximum of each pair of rows, so a, b and dst each hold n floats.
+void max_rows(float *dst, const float *a, const float *b, unsigned int n)
+{
+	unsigned int i = 0;
+#if defined(__ARM_NEON)
+	for (; i + 4 <= n; i += 4)
+		vst1q_f32(dst + i, vmaxq_f32(vld1q_f32(a + i), vld1q_f32(b + i)));
+#endif
+	for (; i < n; i++)
+		dst[i] = std::max(a[i], b[i]);
 }
 
-KeypointQueue build_keypoint_queue(const std::vector<float> &scores, const std::vector<float> &short_offsets,
-								   const float score_threshold)
+// Find the root candidates: keypoints whose score reaches the threshold and is the maximum in its 3x3
+// neighbourhood. Rather than search every candidate's neighbourhood, we take the maximum of each row with the
+// rows above and below, and then of each pixel with its left and right neighbours (NUM_KEYPOINTS floats either
+// side), so that a score is a local maximum exactly when it equals the result. These passes are all over
+// contiguous floats, so vectorise nicely. The candidates are sorted into decreasing score order.
+void find_keypoint_candidates(std::vector<KeypointWithScore> &candidates, const std::vector<float> &scores,
+							  const std::vector<float> &short_offsets, const float score_threshold)
 {
-	constexpr unsigned int local_maximum_radius = 1;
-	unsigned int score_index = 0;
-	KeypointQueue queue;
+	std::array<float, SCORE_ROW_SIZE> column_max, window_max;
 
+	candidates.clear();
 	for (unsigned int y = 0; y < MAP_SIZE.height; ++y)
 	{
-		for (unsigned int x = 0; x < MAP_SIZE.width; ++x)
+		const float *row = scores.data() + y * SCORE_ROW_SIZE;
+		const float *above = y > 0 ? row - SCORE_ROW_SIZE : row;
+		const float *below = y + 1 < MAP_SIZE.height ? row + SCORE_ROW_SIZE : row;
+
+		max_rows(column_max.data(), above, below, SCORE_ROW_SIZE);
+		max_rows(column_max.data(), column_max.data(), row, SCORE_ROW_SIZE);
+
+		// The first and last pixels have only one neighbour in the row.
+		constexpr unsigned int n = NUM_KEYPOINTS, interior = SCORE_ROW_SIZE - 2 * NUM_KEYPOINTS;
+		max_rows(window_max.data(), column_max.data(), column_max.data() + n, n);
+		max_rows(window_max.data() + n, column_max.data(), column_max.data() + 2 * n, interior);
+		max_rows(window_max.data() + n, window_max.data() + n, column_max.data() + n, interior);
+		max_rows(window_max.data() + n + interior, column_max.data() + interior, column_max.data() + n + interior, n);
+
+		for (unsigned int i = 0; i < SCORE_ROW_SIZE; i++)
 		{
-			unsigned int offset_index = 2 * score_index;
-			for (unsigned int j = 0; j < NUM_KEYPOINTS; ++j)
-			{
-				const float score = scores[score_index];
-				if (score >= score_threshold)
-				{
-					// Only consider keypoints whose score is maximum in a local window.
-					bool local_maximum = true;
-					const unsigned int y_start = std::max((int)y - (int)local_maximum_radius, 0);
-					const unsigned int y_end = std::min(y + local_maximum_radius + 1, MAP_SIZE.height);
-					for (unsigned int y_current = y_start; y_current < y_end; ++y_current)
-					{
-						const unsigned int x_start = std::max((int)x - (int)local_maximum_radius, 0);
-						const unsigned int x_end = std::min(x + local_maximum_radius + 1, MAP_SIZE.width);
-						for (unsigned int x_current = x_start; x_current < x_end; ++x_current)
-						{
-							if (scores[y_current * MAP_SIZE.width * NUM_KEYPOINTS + x_current * NUM_KEYPOINTS + j] >
-									score)
-							{
-								local_maximum = false;
-								break;
-							}
-						}
-						if (!local_maximum)
-							break;
-					}
-					if (local_maximum)
-					{
-						const float dy = short_offsets[offset_index];
-						const float dx = short_offsets[offset_index + NUM_KEYPOINTS];
-						const float y_refined = std::clamp(y + dy, 0.0f, MAP_SIZE.height - 1.0f);
-						const float x_refined = std::clamp(x + dx, 0.0f, MAP_SIZE.width - 1.0f);
-						queue.emplace(Point { y_refined, x_refined }, j, score);
-					}
-				}
+			const float score = row[i];
+			if (score < score_threshold || score < window_max[i])
+				continue;
 
-				++score_index;
-				++offset_index;
-			}
+			const unsigned int x = i / NUM_KEYPOINTS, j = i % NUM_KEYPOINTS;
+			const unsigned int offset_index = 2 * (y * SCORE_ROW_SIZE + x * NUM_KEYPOINTS) + j;
+			const float dy = short_offsets[offset_index];
+			const float dx = short_offsets[offset_index + NUM_KEYPOINTS];
+			const float y_refined = std::clamp(y + dy, 0.0f, MAP_SIZE.height - 1.0f);
+			const float x_refined = std::clamp(x + dx, 0.0f, MAP_SIZE.width - 1.0f);
+			candidates.emplace_back(Point { y_refined, x_refined }, j, score);
 		}
 	}
 
-	return queue;
+	std::sort(candidates.begin(), candidates.end(), std::greater<KeypointWithScore>());
 }
 
 // Follows the mid-range offsets, and then refines the position by the short-
@@ -360,19 +381,17 @@ Point find_displaced_position(const std::vector<float> &short_offsets, const std
 	float y = source.y, x = source.x;
 
 	// Follow the mid-range offsets.
-	std::vector<int> channels = { edge_id, NUM_EDGES + edge_id };
-
 	// Total size of mid_offsets is height x width x 2*2*num_edges
-	std::vector<float> offsets = sample_tensor_at_multiple_channels(mid_offsets, source, channels, 2 * 2 * NUM_EDGES);
+	std::array<float, 2> offsets =
+		sample_tensor_at_two_channels(mid_offsets, source, edge_id, NUM_EDGES + edge_id, 2 * 2 * NUM_EDGES);
 	y = std::clamp(y + offsets[0], 0.0f, MAP_SIZE.height - 1.0f);
 	x = std::clamp(x + offsets[1], 0.0f, MAP_SIZE.width - 1.0f);
 
 	// Refine by the short-range offsets.
-	channels[0] = target_id;
-	channels[1] = NUM_KEYPOINTS + target_id;
 	for (int i = 0; i < offset_refinement_steps; ++i)
 	{
-		offsets = sample_tensor_at_multiple_channels(short_offsets, Point { y, x }, channels, 2 * NUM_KEYPOINTS);
+		offsets = sample_tensor_at_two_channels(short_offsets, Point { y, x }, target_id, NUM_KEYPOINTS + target_id,
+												2 * NUM_KEYPOINTS);
 		y = std::clamp(y + offsets[0], 0.0f, MAP_SIZE.height - 1.0f);
 		x = std::clamp(x + offsets[1], 0.0f, MAP_SIZE.width - 1.0f);
 	}
@@ -385,7 +404,7 @@ void backtrack_decode_pose(const std::vector<float> &scores, const std::vector<f
 						   const AdjacencyList &adjacency_list, PoseKeypoints &pose_keypoints,
 						   PoseKeypointScores &keypoint_scores, unsigned int offset_refinement_steps)
 {
-	const float root_score = sample_tensor_at_single_channel(scores, root.point, root.id, NUM_KEYPOINTS);
+	const float root_score = sample_tensor_at_single_channel(scores, root.point, NUM_KEYPOINTS, root.id);
 
 	// Used in order to put candidate keypoints in a priority queue w.r.t. their
 	// score. Keypoints with higher score have higher priority and will be
@@ -394,7 +413,7 @@ void backtrack_decode_pose(const std::vector<float> &scores, const std::vector<f
 	decode_queue.push(KeypointWithScore(root.point, root.id, root_score));
 
 	// Keeps track of the keypoints whose position has already been decoded.
-	std::vector<bool> keypoint_decoded(NUM_KEYPOINTS, false);
+	std::array<bool, NUM_KEYPOINTS> keypoint_decoded {};
 
 	while (!decode_queue.empty())
 	{
@@ -519,12 +538,23 @@ private:
 	};
 
 	std::vector<LtResults> lt_results_;
+	// The reordered output tensors, kept to save reallocating them each frame.
+	std::vector<float> scores_;
+	std::vector<float> short_offsets_;
+	std::vector<float> mid_offsets_;
+	// Decoding scratch space, also kept from frame to frame.
+	std::vector<KeypointWithScore> candidates_;
+	std::vector<PoseKeypoints> scratch_poses_;
+	std::vector<PoseKeypointScores> scratch_keypoint_scores_;
+	std::vector<float> all_instance_scores_;
+	std::vector<int> decreasing_indices_;
 	std::mutex lt_lock_;
 
 	// Config params:
 	float threshold_;
 	unsigned int max_detections_;
 	unsigned int offset_refinement_steps_;
+	unsigned int max_candidates_;
 	float nms_radius_;
 	bool temporal_filtering_;
 
@@ -545,6 +575,8 @@ void PoseNet::Read(boost::property_tree::ptree const &params)
 	max_detections_ = params.get<unsigned int>("max_detections", 10);
 	threshold_ = params.get<float>("threshold", 0.5f);
 	offset_refinement_steps_ = params.get<unsigned int>("offset_refinement_steps", 5);
+	// Give up after this many root candidates, even if we haven't found max_detections poses. 0 means no limit.
+	max_candidates_ = params.get<unsigned int>("max_candidates", 0);
 	nms_radius_ = params.get<float>("nms_radius", 10) / STRIDE;
 
 	if (params.find("temporal_filter") != params.not_found())
@@ -594,14 +626,19 @@ bool PoseNet::Process(CompletedRequestPtr &completed_request)
 		return false;
 	}
 
-	std::vector<float> scores =
-		format_tensor((float *)output->data(), NUM_HEATMAPS / (MAP_SIZE.width * MAP_SIZE.height), 1);
-	std::vector<float> short_offsets = format_tensor((float *)output->data() + NUM_HEATMAPS,
-													 NUM_SHORT_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
-	std::vector<float> mid_offsets = format_tensor((float *)output->data() + NUM_HEATMAPS + NUM_SHORT_OFFSETS,
-												   NUM_MID_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
+	// Process() can be concurrently called through different threads for consecutive CompletedRequests if
+	// things are running behind.  So protect access to the lt_results_ state object and the scratch tensors.
+	std::scoped_lock<std::mutex> l(lt_lock_);
+
+	// The tensor is read straight out of the request's metadata.
+	const float *data = output->data();
+	format_tensor(scores_, data, NUM_HEATMAPS / (MAP_SIZE.width * MAP_SIZE.height), 1);
+	format_tensor(short_offsets_, data + NUM_HEATMAPS, NUM_SHORT_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height),
+				  STRIDE);
+	format_tensor(mid_offsets_, data + NUM_HEATMAPS + NUM_SHORT_OFFSETS,
+				  NUM_MID_OFFSETS / (MAP_SIZE.width * MAP_SIZE.height), STRIDE);
 
-	std::vector<PoseResults> results = decodeAllPoses(scores, short_offsets, mid_offsets);
+	std::vector<PoseResults> results = decodeAllPoses(scores_, short_offsets_, mid_offsets_);
 	translateCoordinates(results, *scaler_crop);
 
 	std::vector<std::vector<libcamera::Point>> locations;
@@ -609,10 +646,6 @@ bool PoseNet::Process(CompletedRequestPtr &completed_request)
 
 	if (temporal_filtering_)
 	{
-		// Process() can be concurrently called through different threads for consecutive CompletedRequests if
-		// things are running behind.  So protect access to the lt_results_ state object.
-		std::scoped_lock<std::mutex> l(lt_lock_);
-
 		filterOutputObjects(results);
 		for (auto const &lt_r : lt_results_)
 		{
@@ -673,33 +706,35 @@ std::vector<PoseResults> PoseNet::decodeAllPoses(const std::vector<float> &score
 												 const std::vector<float> &mid_offsets)
 {
 	const float min_score_logit = log_odds(threshold_);
+	static const AdjacencyList adjacency_list = build_agency_list();
 
-	KeypointQueue queue = build_keypoint_queue(scores, short_offsets, min_score_logit);
-	AdjacencyList adjacency_list = build_agency_list();
+	find_keypoint_candidates(candidates_, scores, short_offsets, min_score_logit);
 
 	std::vector<int> indices(NUM_KEYPOINTS);
 
 	// Generate at most max_detections object instances per image in decreasing
 	// root part score order.
-	std::vector<float> all_instance_scores;
-
-	std::vector<PoseKeypoints> scratch_poses(NUM_KEYPOINTS);
-	std::vector<PoseKeypointScores> scratch_keypoint_scores(max_detections_);
+	all_instance_scores_.clear();
+	scratch_poses_.resize(max_detections_);
+	scratch_keypoint_scores_.resize(max_detections_);
 
 	unsigned int pose_counter = 0;
-	while (pose_counter < max_detections_ && !queue.empty())
+	unsigned int num_candidates = candidates_.size();
+	if (max_candidates_)
+		num_candidates = std::min(num_candidates, max_candidates_);
+
+	for (unsigned int c = 0; c < num_candidates && pose_counter < max_detections_; c++)
 	{
-		// The top element in the queue is the next root candidate.
-		const KeypointWithScore root = queue.top();
-		queue.pop();
+		// The candidates are in decreasing score order, so this is the next root.
+		const KeypointWithScore &root = candidates_[c];
 
 		// Reject a root candidate if it is within a disk of nms_radius_ pixels
 		// from the corresponding part of a previously detected instance.
-		if (!pass_keypoint_nms(scratch_poses, pose_counter, root, nms_radius_ * nms_radius_))
+		if (!pass_keypoint_nms(scratch_poses_, pose_counter, root, nms_radius_ * nms_radius_))
 			continue;
 
-		auto &next_pose = scratch_poses[pose_counter];
-		auto &next_scores = scratch_keypoint_scores[pose_counter];
+		auto &next_pose = scratch_poses_[pose_counter];
+		auto &next_scores = scratch_keypoint_scores_[pose_counter];
 		for (unsigned int k = 0; k < NUM_KEYPOINTS; ++k)
 		{
 			next_pose[k].x = -1.0f;
@@ -727,27 +762,27 @@ std::vector<PoseResults> PoseNet::decodeAllPoses(const std::vector<float> &score
 		if (instance_score >= threshold_)
 		{
 			pose_counter++;
-			all_instance_scores.push_back(instance_score);
+			all_instance_scores_.push_back(instance_score);
 		}
 	}
 
 	// Sort the detections in decreasing order of their instance-level scores.
-	std::vector<int> decreasing_indices;
-	decreasing_arg_sort(decreasing_indices, all_instance_scores);
+	decreasing_arg_sort(decreasing_indices_, all_instance_scores_);
 
 	// Keypoint-level soft non-maximum suppression and instance-level rescoring as
 	// the average of the top-k keypoints in terms of their keypoint-level scores.
-	perform_soft_keypoint_NMS(all_instance_scores, decreasing_indices, scratch_poses, scratch_keypoint_scores,
+	perform_soft_keypoint_NMS(all_instance_scores_, decreasing_indices_, scratch_poses_, scratch_keypoint_scores_,
 							  nms_radius_ * nms_radius_);
 
 	// Sort the detections in decreasing order of their final instance-level
 	// scores. Usually the order does not change but this is not guaranteed.
-	decreasing_arg_sort(decreasing_indices, all_instance_scores);
+	decreasing_arg_sort(decreasing_indices_, all_instance_scores_);
 
 	std::vector<PoseResults> results;
-	for (int index : decreasing_indices)
+	results.reserve(decreasing_indices_.size());
+	for (int index : decreasing_indices_)
 	{
-		if (all_instance_scores[index] < threshold_)
+		if (all_instance_scores_[index] < threshold_)
 			break;
 
 		// New result.
@@ -756,13 +791,13 @@ std::vector<PoseResults> PoseNet::decodeAllPoses(const std::vector<float> &score
 		// Rescale keypoint coordinates into pixel space (much more useful for user).
 		for (unsigned int k = 0; k < NUM_KEYPOINTS; ++k)
 		{
-			results.back().pose_keypoints[k].y = scratch_poses[index][k].y * STRIDE;
-			results.back().pose_keypoints[k].x = scratch_poses[index][k].x * STRIDE;
+			results.back().pose_keypoints[k].y = scratch_poses_[index][k].y * STRIDE;
+			results.back().pose_keypoints[k].x = scratch_poses_[index][k].x * STRIDE;
 		}
 
-		std::copy(scratch_keypoint_scores[index].begin(), scratch_keypoint_scores[index].end(),
+		std::copy(scratch_keypoint_scores_[index].begin(), scratch_keypoint_scores_[index].end(),
 				  results.back().pose_keypoint_scores.begin());
-		results.back().pose_score = all_instance_scores[index];
+		results.back().pose_score = all_instance_scores_[index];
 	}
 
 	return results;
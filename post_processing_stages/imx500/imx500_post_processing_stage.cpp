@@ -6,14 +6,17 @@
  */
 #include <chrono>
 #include <cmath>
+#include <cstdlib>
 #include <fcntl.h>
 #include <filesystem>
 #include <linux/videodev2.h>
 #include <sstream>
 #include <string>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <thread>
 #include <unistd.h>
+#include <utility>
 
 #include <boost/property_tree/ptree.hpp>
 
@@ -46,6 +49,67 @@ inline int16_t conv_reg_signed(int16_t reg)
 		return -((~reg + 1) & ROT_DNN_NORM_MASK);
 }
 
+// What identifies the network a run gave the driver: the file, as it was then, and the boot, since the
+// driver starts without one. Empty if the file can't be looked at.
+std::string network_marker(std::string const &network_file)
+{
+	std::error_code ec;
+	fs::path path = fs::canonical(network_file, ec);
+	struct stat st;
+	if (ec || stat(path.c_str(), &st))
+		return {};
+
+	std::ifstream boot("/proc/sys/kernel/random/boot_id");
+	std::string boot_id;
+	boot >> boot_id;
+	std::ostringstream marker;
+	marker << boot_id << " " << path.string() << " " << st.st_size << " " << st.st_mtim.tv_sec << "."
+		   << st.st_mtim.tv_nsec;
+	return marker.str();
+}
+
+// In a runtime directory, so that it goes with the boot, and can only be written by whoever wrote it. Only
+// root can write to /run itself, so anyone else keeps their own.
+fs::path marker_path(std::string const &device_id)
+{
+	std::string name = "rpicam-imx500-network-" + device_id;
+	if (access("/run", W_OK) == 0)
+		return fs::path("/run") / name;
+	char const *runtime_dir = getenv("XDG_RUNTIME_DIR");
+	return runtime_dir && *runtime_dir ? fs::path(runtime_dir) / name : fs::path();
+}
+
+// The recorded marker, but only from a regular file of our own that nobody else can write.
+std::string read_marker(fs::path const &path)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return {};
+	struct stat st;
+	std::string marker;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH)))
+	{
+		char buf[1024];
+		ssize_t len = read(fd, buf, sizeof(buf));
+		if (len > 0)
+			marker.assign(buf, len);
+	}
+	close(fd);
+	std::size_t end = marker.find('\n');
+	return end == std::string::npos ? std::string() : marker.substr(0, end);
+}
+
+std::vector<unsigned int> split(std::stringstream &stream)
+{
+	std::vector<unsigned int> result;
+	unsigned int n;
+
+	while (stream >> n)
+		result.push_back(n);
+
+	return result;
+}
+
 } // namespace
 
 
@@ -72,6 +136,7 @@ IMX500PostProcessingStage::IMX500PostProcessingStage(RPiCamApp *app)
 				assert(pos != std::string::npos);
 
 				const std::string imx500_device_id = test_dir_str.substr(pos);
+				device_id_ = imx500_device_id;
 				std::string spi_device_id = imx500_device_id;
 				const std::size_t rep = spi_device_id.find("001a");
 				spi_device_id.replace(rep, 4, "0040");
@@ -79,6 +144,7 @@ IMX500PostProcessingStage::IMX500PostProcessingStage(RPiCamApp *app)
 				const fs::path imx500_progress { "/sys/kernel/debug/imx500-fw:" + imx500_device_id + "/fw_progress" };
 				const fs::path spi_progress { "/sys/kernel/debug/rp2040-spi:" + spi_device_id + "/transfer_progress" };
 
+				fw_progress_path_ = imx500_progress.string();
 				fw_progress_.open(imx500_progress.c_str(), std::ios_base::in);
 				fw_progress_chunk_.open(spi_progress.c_str(), std::ios_base::in);
 
@@ -95,6 +161,15 @@ IMX500PostProcessingStage::IMX500PostProcessingStage(RPiCamApp *app)
 
 IMX500PostProcessingStage::~IMX500PostProcessingStage()
 {
+	if (network_thread_.joinable())
+		network_thread_.join();
+	{
+		std::lock_guard<std::mutex> lock(marker_mutex_);
+		marker_abort_ = true;
+	}
+	marker_cv_.notify_one();
+	if (marker_thread_.joinable())
+		marker_thread_.join();
 	if (device_fd_ >= 0)
 		close(device_fd_);
 }
@@ -120,22 +195,105 @@ void IMX500PostProcessingStage::Read(boost::property_tree::ptree const &params)
 	if (!fs::exists(network_file))
 		throw std::runtime_error(network_file + " not found!");
 
-	int fd = open(network_file.c_str(), O_RDONLY, 0);
+	// The driver keeps the last network it was given until the system restarts. When told it may, and the
+	// same file was the last one given to it, we leave it with that rather than pay for the upload again.
+	std::string marker = network_marker(network_file);
+	if (params.get<bool>("reuse_network", false) && !marker.empty() && !marker_path(device_id_).empty())
+	{
+		if (read_marker(marker_path(device_id_)) == marker)
+		{
+			LOG(1, "IMX500: " << network_file << " is already loaded, not uploading it again");
+			network_reused_ = true;
+			return;
+		}
+	}
 
+	// The driver reads the whole file when it's given it, so that happens while the rest of the pipeline is
+	// set up, and Configure() waits for it to finish.
+	network_thread_ = std::thread(
+		[this, network_file, marker]()
+		{
+			try
+			{
+				loadNetwork(network_file, marker);
+			}
+			catch (...)
+			{
+				network_error_ = std::current_exception();
+			}
+		});
+
+	LOG(1, "\n------------------------------------------------------------------------------------------------------------------\n"
+		"NOTE: Loading network firmware onto the IMX500 can take several minutes, please do not close down the application."
+		"\n------------------------------------------------------------------------------------------------------------------\n");
+}
+
+void IMX500PostProcessingStage::loadNetwork(std::string const &network_file, std::string const &marker)
+{
+	// Until the sensor has the new network, the old marker would be a lie.
+	fs::path path = marker_path(device_id_);
+	std::error_code ec;
+	if (!path.empty())
+		fs::remove(path, ec);
+
+	int fd = open(network_file.c_str(), O_RDONLY, 0);
 	v4l2_control ctrl { NETWORK_FW_CTRL_ID, fd };
 	int ret = ioctl(device_fd_, VIDIOC_S_CTRL, &ctrl);
+	close(fd);
 	if (ret)
 		throw std::runtime_error("failed to set network fw ioctl");
 
-	close(fd);
+	// The driver only now starts sending the network to the sensor, which goes on after the camera starts.
+	// Without the progress to tell us it got there, we can't say that it did.
+	if (marker.empty() || path.empty() || fw_progress_path_.empty())
+		return;
+	if (marker_thread_.joinable())
+		marker_thread_.join();
+	marker_thread_ = std::thread(&IMX500PostProcessingStage::recordNetwork, this, marker);
+}
 
-	LOG(1, "\n------------------------------------------------------------------------------------------------------------------\n"
-		"NOTE: Loading network firmware onto the IMX500 can take several minutes, please do not close down the application."
-		"\n------------------------------------------------------------------------------------------------------------------\n");
+void IMX500PostProcessingStage::recordNetwork(std::string const &marker)
+{
+	std::ifstream fw_progress(fw_progress_path_);
+	std::unique_lock<std::mutex> lock(marker_mutex_);
+	while (!marker_abort_)
+	{
+		fw_progress.clear();
+		fw_progress.seekg(0);
+		std::stringstream progress_str;
+		progress_str << fw_progress.rdbuf();
+		std::vector<unsigned int> progress = split(progress_str);
+		// As for doProgressBar(): [0] == FW state, [1] == current size, [2] == total size.
+		if (progress.size() == 3 && progress[0] == 2 && progress[2] && progress[1] == progress[2])
+			break;
+		marker_cv_.wait_for(lock, 500ms);
+	}
+	if (marker_abort_)
+		return;
+	lock.unlock();
+
+	fs::path path = marker_path(device_id_);
+	int marker_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (marker_fd < 0)
+	{
+		LOG(1, "IMX500: unable to record the network in " << path);
+		return;
+	}
+	std::string line = marker + "\n";
+	std::error_code ec;
+	if (write(marker_fd, line.data(), line.size()) != (ssize_t)line.size())
+		fs::remove(path, ec);
+	close(marker_fd);
+	LOG(2, "IMX500: recorded the network in " << path);
 }
 
 void IMX500PostProcessingStage::Configure()
 {
+	if (network_thread_.joinable())
+		network_thread_.join();
+	if (network_error_)
+		std::rethrow_exception(std::exchange(network_error_, nullptr));
+
 	output_stream_ = app_->GetMainStream();
 	raw_stream_ = app_->RawStream();
 	save_frames_ = num_input_tensors_saved_;
@@ -227,24 +385,13 @@ void IMX500PostProcessingStage::SetInferenceRoiAuto(const unsigned int width, co
 
 void IMX500PostProcessingStage::ShowFwProgressBar()
 {
-	if (fw_progress_.is_open() && fw_progress_chunk_.is_open())
+	if (!network_reused_ && fw_progress_.is_open() && fw_progress_chunk_.is_open())
 	{
 		std::thread progress_thread { &IMX500PostProcessingStage::doProgressBar, this };
 		progress_thread.detach();
 	}
 }
 
-std::vector<unsigned int> split(std::stringstream &stream)
-{
-	std::vector<unsigned int> result;
-	unsigned int n;
-
-	while (stream >> n)
-		result.push_back(n);
-
-	return result;
-}
-
 void IMX500PostProcessingStage::doProgressBar()
 {
 	while (1)
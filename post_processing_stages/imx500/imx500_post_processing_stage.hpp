@@ -7,8 +7,12 @@
 
 #pragma once
 
+#include <condition_variable>
+#include <exception>
 #include <fstream>
 #include <mutex>
+#include <string>
+#include <thread>
 
 #include <boost/property_tree/ptree.hpp>
 
@@ -62,8 +66,21 @@ protected:
 
 private:
 	void doProgressBar();
+	void loadNetwork(std::string const &network_file, std::string const &marker);
+	void recordNetwork(std::string const &marker);
 
 	int device_fd_;
+	std::string device_id_;
+	// The network is handed to the driver on this thread, and Configure() waits for it.
+	std::thread network_thread_;
+	std::exception_ptr network_error_;
+	bool network_reused_ = false;
+	// Once the driver reports the upload to the sensor complete, this thread records which network it has.
+	std::thread marker_thread_;
+	std::mutex marker_mutex_;
+	std::condition_variable marker_cv_;
+	bool marker_abort_ = false;
+	std::string fw_progress_path_;
 	std::ifstream fw_progress_;
 	std::ifstream fw_progress_chunk_;
 
@@ -0,0 +1,26 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * motion_detect.hpp - motion detector activity map
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <libcamera/geometry.h>
+
+// Published by the motion_detect stage as "motion_detect.activity". The watched area is divided
+// into a grid of cells, and the cells are listed a row at a time from the top left.
+struct MotionActivity
+{
+	unsigned int grid_width = 0;
+	unsigned int grid_height = 0;
+	// The fraction of each cell's pixels that differ from the background.
+	std::vector<float> changed;
+	// The mean absolute difference from the background in each cell, in pixel levels.
+	std::vector<float> difference;
+	// Where each cell is, in main image coordinates.
+	std::vector<libcamera::Rectangle> cells;
+};
@@ -7,11 +7,15 @@
 
 // A simple motion detector. It needs to be given a low resolution image and it
 // compares pixels in the current low res image against the value in the corresponding
-// location in the previous one. If it exceeds a threshold it gets counted as
+// location of a background image. If it exceeds a threshold it gets counted as
 // "different". If enough pixels are different, that indicates "motion".
 // A low res image of something like 128x96 is probably more than enough, and you
 // can always subsample with hskip and vksip.
 
+// The background is a running average of the frames we've looked at, moving towards
+// each new one by background_rate (rounded to a power of 2, down to 1/128). A
+// background_rate of 1 just compares each frame against the previous one.
+
 // Because this gets run in parallel by the post-processing framework, it means
 // the "previous frame" is not totally guaranteed to be the actual previous one,
 // though in practice it is, and it doesn't actually matter even if it wasn't.
@@ -19,11 +23,20 @@
 // The stage adds "motion_detect.result" to the metadata. When this claims motion,
 // the application can take that as true immediately. To be sure there's no motion,
 // an application should probably wait for "a few frames" of "no motion".
+// The area being watched is divided into a grid of cells and "motion_detect.activity"
+// says how much each one has changed (see motion_detect.hpp).
+// While there is motion, "motion_detect.regions" holds the cells where it is, in main
+// image coordinates, so that the encoder can favour them (see --region-quality).
+
+#include <algorithm>
+#include <cmath>
 
 #include <libcamera/stream.h>
 
+#include "core/cpu_features.hpp"
 #include "core/rpicam_app.hpp"
 
+#include "post_processing_stages/motion_detect.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 using Stream = libcamera::Stream;
@@ -35,6 +48,9 @@ public:
 
 	char const *Name() const override;
 
+	// Each frame is compared against the previous one.
+	Concurrency GetConcurrency() const override { return Concurrency::Ordered; }
+
 	void Read(boost::property_tree::ptree const &params) override;
 
 	void Configure() override;
@@ -54,6 +70,9 @@ private:
 		int frame_period;
 		bool verbose;
 		std::string region_name;
+		unsigned int grid_width, grid_height;
+		float cell_threshold;
+		float background_rate;
 	} config_;
 	Stream *stream_;
 	unsigned lores_stride_;
@@ -62,14 +81,28 @@ private:
 	unsigned int roi_x_, roi_y_;
 	unsigned int roi_width_, roi_height_;
 	unsigned int region_threshold_;
-	std::vector<uint8_t> previous_frame_;
+	// Cell boundaries in the subsampled image, relative to the roi.
+	std::vector<unsigned int> cell_x_, cell_y_;
+	// The difference threshold as a fraction with 8 fractional bits, and a constant.
+	unsigned int difference_m_, difference_c_;
+	// The background moves 1 / 2^background_shift_ of the way to each new frame.
+	int background_shift_;
+	libcamera::Rectangle main_roi_;
+	// The background has 7 fractional bits.
+	std::vector<int16_t> background_;
 	bool first_time_;
 	bool motion_detected_;
+	MotionActivity activity_;
+	std::vector<libcamera::Rectangle> regions_;
 	std::mutex mutex_;
 };
 
 #define NAME "motion_detect"
 
+static const MetadataTag result_tag("motion_detect.result");
+static const MetadataTag activity_tag("motion_detect.activity");
+static const MetadataTag regions_tag("motion_detect.regions");
+
 char const *MotionDetectStage::Name() const
 {
 	return NAME;
@@ -89,6 +122,10 @@ void MotionDetectStage::Read(boost::property_tree::ptree const &params)
 	config_.frame_period = params.get<int>("frame_period", 5);
 	config_.verbose = params.get<int>("verbose", 0);
 	config_.region_name = params.get<std::string>("region_name", "");
+	config_.grid_width = std::max(params.get<unsigned int>("grid_width", 1), 1u);
+	config_.grid_height = std::max(params.get<unsigned int>("grid_height", 1), 1u);
+	config_.cell_threshold = params.get<float>("cell_threshold", config_.region_threshold);
+	config_.background_rate = std::clamp(params.get<float>("background_rate", 0.25), 0.0f, 1.0f);
 }
 
 void MotionDetectStage::Configure()
@@ -122,24 +159,185 @@ void MotionDetectStage::Configure()
 		LOG(1, "Lores: " << info.width << "x" << info.height << " roi: (" << roi_x_ << "," << roi_y_ << ") "
 						 << roi_width_ << "x" << roi_height_ << " threshold: " << region_threshold_);
 
-	previous_frame_.resize(roi_width_ * roi_height_);
+	// Share the roi out evenly between the cells, though there can't be more cells than pixels.
+	unsigned int grid_width = std::clamp(config_.grid_width, 1u, std::max(roi_width_, 1u));
+	unsigned int grid_height = std::clamp(config_.grid_height, 1u, std::max(roi_height_, 1u));
+	cell_x_.resize(grid_width + 1);
+	cell_y_.resize(grid_height + 1);
+	for (unsigned int i = 0; i <= grid_width; i++)
+		cell_x_[i] = i * roi_width_ / grid_width;
+	for (unsigned int i = 0; i <= grid_height; i++)
+		cell_y_[i] = i * roi_height_ / grid_height;
+
+	// Differences are only compared in 16 bits, so difference_m can't go above 1.
+	difference_m_ = std::lround(std::clamp(config_.difference_m, 0.0f, 1.0f) * 256);
+	difference_c_ = std::clamp(config_.difference_c, 0, 255);
+	background_shift_ =
+		config_.background_rate > 0 ? std::clamp<int>(std::lround(-std::log2(config_.background_rate)), 0, 7) : 7;
+
+	// The lores image is a scaled copy of the main one, so the same fractions apply.
+	main_roi_ = libcamera::Rectangle();
+	if (Stream *main_stream = app_->GetMainStream())
+	{
+		StreamInfo main_info = app_->GetStreamInfo(main_stream);
+		main_roi_ = libcamera::Rectangle(config_.roi_x * main_info.width, config_.roi_y * main_info.height,
+										 config_.roi_width * main_info.width, config_.roi_height * main_info.height);
+	}
+
+	activity_ = MotionActivity();
+	activity_.grid_width = grid_width;
+	activity_.grid_height = grid_height;
+	activity_.changed.assign(grid_width * grid_height, 0);
+	activity_.difference.assign(grid_width * grid_height, 0);
+	for (unsigned int j = 0; j < grid_height && roi_width_ && roi_height_; j++)
+	{
+		for (unsigned int i = 0; i < grid_width; i++)
+		{
+			int x0 = main_roi_.x + (int64_t)main_roi_.width * cell_x_[i] / roi_width_;
+			int x1 = main_roi_.x + (int64_t)main_roi_.width * cell_x_[i + 1] / roi_width_;
+			int y0 = main_roi_.y + (int64_t)main_roi_.height * cell_y_[j] / roi_height_;
+			int y1 = main_roi_.y + (int64_t)main_roi_.height * cell_y_[j + 1] / roi_height_;
+			activity_.cells.emplace_back(x0, y0, x1 - x0, y1 - y0);
+		}
+	}
+
+	background_.resize(roi_width_ * roi_height_);
 	first_time_ = true;
 	motion_detected_ = false;
+	regions_.clear();
+}
+
+static inline int rounding_shift(int x, int shift)
+{
+	return shift ? (x + (1 << (shift - 1))) >> shift : x;
 }
 
+// Compare a run of pixels against the background, moving the background towards them as we go.
+// Returns the number of pixels whose difference exceeds m (with 8 fractional bits) times the
+// background plus c, and adds up all the absolute differences in sad.
+
+static unsigned int compare_pixels_generic(uint8_t const *src, int hskip, int16_t *background, unsigned int n,
+										   unsigned int m, unsigned int c, int shift, uint32_t &sad)
+{
+	unsigned int changed = 0;
+	for (unsigned int x = 0; x < n; x++)
+	{
+		int pixel = src[x * hskip];
+		int bg = background[x];
+		unsigned int bg_int = rounding_shift(bg, 7);
+		unsigned int diff = std::abs(pixel - (int)bg_int);
+		changed += diff > c + ((bg_int * m) >> 8);
+		sad += diff;
+		background[x] = bg + rounding_shift((pixel << 7) - bg, shift);
+	}
+	return changed;
+}
+
+#if defined(RPICAM_NEON_KERNELS)
+NEON_TARGET static unsigned int compare_pixels_neon(uint8_t const *src, int hskip, int16_t *background,
+													unsigned int n, unsigned int m, unsigned int c, int shift,
+													uint32_t &sad)
+{
+	if (hskip != 1)
+		return compare_pixels_generic(src, hskip, background, n, m, c, shift, sad);
+
+	unsigned int x = 0;
+	uint16x8_t m_v = vdupq_n_u16(m), c_v = vdupq_n_u16(c);
+	int16x8_t shift_v = vdupq_n_s16(-shift);
+	uint32x4_t changed_v = vdupq_n_u32(0), sad_v = vdupq_n_u32(0);
+	for (; x + 8 <= n; x += 8)
+	{
+		uint16x8_t pixels = vmovl_u8(vld1_u8(src + x));
+		int16x8_t bg = vld1q_s16(background + x);
+		uint16x8_t bg_int = vreinterpretq_u16_s16(vrshrq_n_s16(bg, 7));
+		uint16x8_t diff = vabdq_u16(pixels, bg_int);
+		uint16x8_t threshold = vaddq_u16(c_v, vshrq_n_u16(vmulq_u16(bg_int, m_v), 8));
+		changed_v = vpadalq_u16(changed_v, vshrq_n_u16(vcgtq_u16(diff, threshold), 15));
+		sad_v = vpadalq_u16(sad_v, diff);
+		int16x8_t target = vreinterpretq_s16_u16(vshlq_n_u16(pixels, 7));
+		vst1q_s16(background + x, vaddq_s16(bg, vrshlq_s16(vsubq_s16(target, bg), shift_v)));
+	}
+	unsigned int changed = vgetq_lane_u32(changed_v, 0) + vgetq_lane_u32(changed_v, 1) +
+						   vgetq_lane_u32(changed_v, 2) + vgetq_lane_u32(changed_v, 3);
+	sad += vgetq_lane_u32(sad_v, 0) + vgetq_lane_u32(sad_v, 1) + vgetq_lane_u32(sad_v, 2) + vgetq_lane_u32(sad_v, 3);
+	return changed + compare_pixels_generic(src + x, hskip, background + x, n - x, m, c, shift, sad);
+}
+#endif
+
+#if defined(RPICAM_DOTPROD_KERNELS)
+// As the NEON version, but 16 pixels at a time, with the differences and the count of changed pixels
+// added up 16 bytes at a time by the dot product instructions.
+DOTPROD_TARGET static unsigned int compare_pixels_dotprod(uint8_t const *src, int hskip, int16_t *background,
+														  unsigned int n, unsigned int m, unsigned int c, int shift,
+														  uint32_t &sad)
+{
+	if (hskip != 1)
+		return compare_pixels_generic(src, hskip, background, n, m, c, shift, sad);
+
+	unsigned int x = 0;
+	uint16x8_t m_v = vdupq_n_u16(m), c_v = vdupq_n_u16(c);
+	int16x8_t shift_v = vdupq_n_s16(-shift);
+	uint8x16_t ones = vdupq_n_u8(1);
+	uint32x4_t changed_v = vdupq_n_u32(0), sad_v = vdupq_n_u32(0);
+	for (; x + 16 <= n; x += 16)
+	{
+		uint8x16_t pixels = vld1q_u8(src + x);
+		int16x8_t bg_lo = vld1q_s16(background + x), bg_hi = vld1q_s16(background + x + 8);
+		// The background's integer part always fits in 8 bits.
+		uint16x8_t bg_int_lo = vreinterpretq_u16_s16(vrshrq_n_s16(bg_lo, 7));
+		uint16x8_t bg_int_hi = vreinterpretq_u16_s16(vrshrq_n_s16(bg_hi, 7));
+		uint8x16_t diff = vabdq_u8(pixels, vcombine_u8(vmovn_u16(bg_int_lo), vmovn_u16(bg_int_hi)));
+		sad_v = vdotq_u32(sad_v, diff, ones);
+
+		uint16x8_t threshold_lo = vaddq_u16(c_v, vshrq_n_u16(vmulq_u16(bg_int_lo, m_v), 8));
+		uint16x8_t threshold_hi = vaddq_u16(c_v, vshrq_n_u16(vmulq_u16(bg_int_hi, m_v), 8));
+		uint8x16_t over = vcombine_u8(vmovn_u16(vcgtq_u16(vmovl_u8(vget_low_u8(diff)), threshold_lo)),
+									  vmovn_u16(vcgtq_u16(vmovl_u8(vget_high_u8(diff)), threshold_hi)));
+		changed_v = vdotq_u32(changed_v, vandq_u8(over, ones), ones);
+
+		int16x8_t target_lo = vreinterpretq_s16_u16(vshll_n_u8(vget_low_u8(pixels), 7));
+		int16x8_t target_hi = vreinterpretq_s16_u16(vshll_n_u8(vget_high_u8(pixels), 7));
+		vst1q_s16(background + x, vaddq_s16(bg_lo, vrshlq_s16(vsubq_s16(target_lo, bg_lo), shift_v)));
+		vst1q_s16(background + x + 8, vaddq_s16(bg_hi, vrshlq_s16(vsubq_s16(target_hi, bg_hi), shift_v)));
+	}
+	sad += vaddvq_u32(sad_v);
+	return vaddvq_u32(changed_v) + compare_pixels_generic(src + x, hskip, background + x, n - x, m, c, shift, sad);
+}
+#endif
+
+using ComparePixels = unsigned int (*)(uint8_t const *, int, int16_t *, unsigned int, unsigned int, unsigned int,
+									   int, uint32_t &);
+static ComparePixels const compare_pixels = SelectKernel<ComparePixels>({
+#if defined(RPICAM_DOTPROD_KERNELS)
+	{ CpuLevel::Dotprod, compare_pixels_dotprod },
+#endif
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, compare_pixels_neon },
+#endif
+	{ CpuLevel::Generic, compare_pixels_generic },
+});
+
 bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 {
 	if (!stream_)
 		return false;
 
 	if (config_.frame_period && completed_request->sequence % config_.frame_period)
+	{
+		// Keep marking the regions on the frames in between, or their quality would flicker.
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!first_time_)
+			completed_request->post_process_metadata.Set(activity_tag, activity_);
+		if (motion_detected_ && !regions_.empty())
+			completed_request->post_process_metadata.Set(regions_tag, regions_);
 		return false;
+	}
 
 	BufferReadSync r(app_, completed_request->buffers[stream_]);
 	libcamera::Span<uint8_t> buffer = r.Get()[0];
 	uint8_t *image = buffer.data();
 
-	// We need to protect access to first_time_, previous_frame_ and motion_detected_.
+	// We need to protect access to first_time_, background_, motion_detected_ and the results.
 	std::lock_guard<std::mutex> lock(mutex_);
 
 	if (first_time_)
@@ -148,41 +346,66 @@ bool MotionDetectStage::Process(CompletedRequestPtr &completed_request)
 		for (unsigned int y = 0; y < roi_height_; y++)
 		{
 			uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
-			uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
+			int16_t *bg_ptr = &background_[0] + y * roi_width_;
 			for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
-				*(old_value_ptr++) = *new_value_ptr;
+				*(bg_ptr++) = *new_value_ptr << 7;
 		}
 
-		completed_request->post_process_metadata.Set("motion_detect.result", motion_detected_);
+		completed_request->post_process_metadata.Set(result_tag, motion_detected_);
 
 		return false;
 	}
 
-	bool motion_detected = false;
-	unsigned int regions = 0;
-
-	// Count the lores pixels where the difference between the new and previous values
-	// exceeds the threshold. At the same time, update the previous image buffer.
-	for (unsigned int y = 0; y < roi_height_; y++)
+	// Count the lores pixels in each cell where the difference between the new value and the
+	// background exceeds the threshold. At the same time, update the background.
+	unsigned int grid_width = activity_.grid_width, grid_height = activity_.grid_height;
+	std::vector<unsigned int> changed(grid_width * grid_height);
+	std::vector<uint32_t> sad(grid_width * grid_height);
+	for (unsigned int j = 0; j < grid_height; j++)
 	{
-		uint8_t *new_value_ptr = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
-		uint8_t *old_value_ptr = &previous_frame_[0] + y * roi_width_;
-		for (unsigned int x = 0; x < roi_width_; x++, new_value_ptr += config_.hskip)
+		for (unsigned int y = cell_y_[j]; y < cell_y_[j + 1]; y++)
 		{
-			int new_value = *new_value_ptr;
-			int old_value = *old_value_ptr;
-			*(old_value_ptr++) = new_value;
-			regions += std::abs(new_value - old_value) > config_.difference_m * old_value + config_.difference_c;
-			motion_detected = regions >= region_threshold_;
+			uint8_t *row = image + (roi_y_ + y) * lores_stride_ + roi_x_ * config_.hskip;
+			int16_t *bg_row = &background_[0] + y * roi_width_;
+			for (unsigned int i = 0; i < grid_width; i++)
+			{
+				unsigned int x0 = cell_x_[i], n = cell_x_[i + 1] - x0;
+				changed[j * grid_width + i] +=
+					compare_pixels(row + x0 * config_.hskip, config_.hskip, bg_row + x0, n, difference_m_,
+								   difference_c_, background_shift_, sad[j * grid_width + i]);
+			}
 		}
 	}
 
+	unsigned int regions = 0;
+	std::vector<libcamera::Rectangle> cells;
+	for (unsigned int k = 0; k < changed.size(); k++)
+	{
+		unsigned int pixels = (cell_x_[k % grid_width + 1] - cell_x_[k % grid_width]) *
+							  (cell_y_[k / grid_width + 1] - cell_y_[k / grid_width]);
+		activity_.changed[k] = pixels ? (float)changed[k] / pixels : 0;
+		activity_.difference[k] = pixels ? (float)sad[k] / pixels : 0;
+		regions += changed[k];
+		if (pixels && activity_.changed[k] >= config_.cell_threshold && k < activity_.cells.size() &&
+			!activity_.cells[k].isNull())
+			cells.push_back(activity_.cells[k]);
+	}
+	bool motion_detected = regions >= region_threshold_;
+
 	if (config_.verbose && motion_detected != motion_detected_)
 		LOG(1, "Motion " << (motion_detected ? "detected" : "stopped")
 						 << (config_.region_name.empty() ? "" : " in region " + config_.region_name));
 
+	// If the motion is spread too thinly for any one cell to notice, favour the whole roi.
+	if (cells.empty() && !main_roi_.isNull())
+		cells.push_back(main_roi_);
+
 	motion_detected_ = motion_detected;
-	completed_request->post_process_metadata.Set("motion_detect.result", motion_detected);
+	regions_ = std::move(cells);
+	completed_request->post_process_metadata.Set(result_tag, motion_detected);
+	completed_request->post_process_metadata.Set(activity_tag, activity_);
+	if (motion_detected && !regions_.empty())
+		completed_request->post_process_metadata.Set(regions_tag, regions_);
 
 	return false;
 }
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * negate_gl_stage.cpp - image negate effect, on the GPU
+ */
+
+// The same as the negate stage, but done with a shader. Mostly this is a simple example of
+// how to write a GlStage.
+
+#include "post_processing_stages/gl_stage.hpp"
+
+class NegateGlStage : public GlStage
+{
+public:
+	NegateGlStage(RPiCamApp *app) : GlStage(app) {}
+
+	char const *Name() const override;
+
+	void Read(boost::property_tree::ptree const &params) override {}
+
+protected:
+	std::string fragmentShader() const override;
+};
+
+#define NAME "negate_gl"
+
+char const *NegateGlStage::Name() const
+{
+	return NAME;
+}
+
+std::string NegateGlStage::fragmentShader() const
+{
+	return "void main() {\n"
+		   "  colour = vec4(1.0 - current(texcoord));\n"
+		   "}\n";
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new NegateGlStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
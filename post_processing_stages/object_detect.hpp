@@ -21,6 +21,8 @@ struct Detection
 	std::string name;
 	float confidence;
 	libcamera::Rectangle box;
+	// Non-zero when an ObjectTracker is following the object, and the same on every frame it's seen.
+	unsigned int id = 0;
 	std::string toString() const
 	{
 		std::stringstream output;
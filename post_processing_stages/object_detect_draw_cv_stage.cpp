@@ -9,6 +9,7 @@
 
 #include "core/rpicam_app.hpp"
 
+#include "post_processing_stages/cv_workspace.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include "object_detect.hpp"
@@ -69,7 +70,7 @@ bool ObjectDetectDrawCvStage::Process(CompletedRequestPtr &completed_request)
 
 	completed_request->post_process_metadata.Get("object_detect.results", detections);
 
-	Mat image(info.height, info.width, CV_8U, ptr, info.stride);
+	Mat image = cv_wrap(ptr, info);
 	Scalar colour = Scalar(255, 255, 255);
 	int font = FONT_HERSHEY_SIMPLEX;
 
@@ -78,7 +79,10 @@ bool ObjectDetectDrawCvStage::Process(CompletedRequestPtr &completed_request)
 		Rect r(detection.box.x, detection.box.y, detection.box.width, detection.box.height);
 		rectangle(image, r, colour, line_thickness_);
 		std::stringstream text_stream;
-		text_stream << detection.name << " " << (int)(detection.confidence * 100) << "%";
+		text_stream << detection.name;
+		if (detection.id)
+			text_stream << " #" << detection.id;
+		text_stream << " " << (int)(detection.confidence * 100) << "%";
 		std::string text = text_stream.str();
 		int baseline = 0;
 		Size size = getTextSize(text, font, font_size_, 2, &baseline);
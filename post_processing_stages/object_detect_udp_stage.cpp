@@ -11,7 +11,11 @@
 
 #include "object_detect.hpp"
 
+#include <algorithm>
 #include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
 #include <string>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -20,11 +24,12 @@
 #include <iostream>
 #include <string>
 #include <vector>
-#include <sstream>
 
+#include <libcamera/control_ids.h>
 
 using Rectange = libcamera::Rectangle;
 using Stream = libcamera::Stream;
+namespace controls = libcamera::controls;
 
 // Define the start delimiter for our binary protocol
 constexpr static uint32_t START_DELIMITER = 0xDDCCBBAA; // little-endian representation of 0xAA, 0xBB, 0xCC, 0xDD
@@ -32,6 +37,48 @@ constexpr static uint32_t START_DELIMITER = 0xDDCCBBAA; // little-endian represe
 #define UDP_IP "127.0.0.1"
 #define UDP_PORT 12347
 
+// The "frame" format sends every detection in a frame together, in fixed size records, and can batch several
+// frames into each datagram. All the fields are little-endian. A datagram is a DatagramHeader followed by
+// frame_count frames, each of which is a FrameHeader followed by detection_count DetectionRecords. A frame with
+// too many detections for one datagram is split across several, all but the last having FRAME_FLAG_MORE set.
+constexpr static uint32_t FRAME_DELIMITER = 0xEECCBBAA; // little-endian representation of 0xAA, 0xBB, 0xCC, 0xEE
+constexpr static uint8_t FRAME_VERSION = 1;
+constexpr static uint8_t FRAME_FLAG_MORE = 1;
+// Room for a UDP payload in a 1500 byte Ethernet frame, so that datagrams don't get fragmented.
+#define MAX_DATAGRAM_SIZE 1472
+
+struct DatagramHeader
+{
+	uint32_t delimiter;
+	uint8_t version;
+	uint8_t frame_count;
+	uint16_t reserved;
+};
+
+struct FrameHeader
+{
+	uint32_t sequence;
+	uint8_t flags;
+	uint8_t reserved;
+	uint16_t detection_count;
+	int64_t timestamp; // sensor timestamp in nanoseconds
+};
+
+struct DetectionRecord
+{
+	int32_t x;
+	int32_t y;
+	uint32_t width;
+	uint32_t height;
+	float confidence;
+	int32_t category;
+	uint32_t id; // non-zero if the object is being tracked
+	char name[16]; // zero padded, and not terminated if it's all used
+};
+
+static_assert(sizeof(DatagramHeader) == 8 && sizeof(FrameHeader) == 16 && sizeof(DetectionRecord) == 44,
+			  "UDP frame format records must not be padded");
+
 class ObjectDetectUDPStage : public PostProcessingStage
 {
 public:
@@ -41,18 +88,38 @@ public:
 
 	void Read(boost::property_tree::ptree const &params) override;
 
+	// Frames are sent in the order they arrive.
+	Concurrency GetConcurrency() const override { return Concurrency::Ordered; }
+
 	void Configure() override;
-	
+
 	bool Process(CompletedRequestPtr &completed_request) override;
 
+	void Stop() override;
+
 	virtual ~ObjectDetectUDPStage() override;
-	
+
 private:
+	void sendDetections(std::vector<Detection> const &detections);
+	void addFrame(uint32_t sequence, int64_t timestamp, std::vector<Detection> const &detections);
+	void appendFrame(uint32_t sequence, int64_t timestamp, uint8_t flags, Detection const *detections,
+					 unsigned int count);
+	void flush();
+	void send(std::vector<char> const &data);
+
 	Stream *stream_;
 	std::string udp_broadcast_address = "127.0.0.1";
 	u_int16_t udp_broadcast_port = 12345;
+	bool frame_format_ = false;
+	unsigned int batch_frames_ = 1;
+	unsigned int max_datagram_size_ = MAX_DATAGRAM_SIZE;
+	int multicast_ttl_ = 1;
+	std::string multicast_interface_;
 	int sockfd_;
 	struct sockaddr_in servaddr_;
+	// The datagram being built, and the number of frames in it.
+	std::vector<char> datagram_;
+	unsigned int frames_ = 0;
 };
 
 #define NAME "object_detect_udp"
@@ -76,7 +143,13 @@ ObjectDetectUDPStage::~ObjectDetectUDPStage()
 void ObjectDetectUDPStage::Configure()
 {
 	stream_ = app_->GetMainStream();
-	
+
+	// We may be reconfigured, in which case start again with a new socket.
+	if (sockfd_ != -1)
+		close(sockfd_);
+	datagram_.clear();
+	frames_ = 0;
+
 	// Initialize UDP socket
 	sockfd_ = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sockfd_ < 0)
@@ -99,6 +172,20 @@ void ObjectDetectUDPStage::Configure()
 		return;
 	}
 
+	if (IN_MULTICAST(ntohl(servaddr_.sin_addr.s_addr)))
+	{
+		if (setsockopt(sockfd_, IPPROTO_IP, IP_MULTICAST_TTL, &multicast_ttl_, sizeof(multicast_ttl_)) < 0)
+			LOG_ERROR("WARNING: ObjectDetectUDPStage: failed to set multicast TTL: " << strerror(errno));
+
+		if (!multicast_interface_.empty())
+		{
+			struct in_addr interface;
+			if (inet_pton(AF_INET, multicast_interface_.c_str(), &interface) <= 0 ||
+				setsockopt(sockfd_, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) < 0)
+				LOG_ERROR("WARNING: ObjectDetectUDPStage: failed to use multicast interface " << multicast_interface_);
+		}
+	}
+
 	std::cerr
 		<< "UDP socket initialized for IP: " << udp_broadcast_address << ", Port: " << udp_broadcast_port << std::endl;
 }
@@ -107,6 +194,21 @@ void ObjectDetectUDPStage::Read(boost::property_tree::ptree const &params)
 {
 	udp_broadcast_address = params.get<std::string>("ip", UDP_IP);
 	udp_broadcast_port = params.get<u_int16_t>("port", UDP_PORT);
+
+	const std::string format = params.get<std::string>("format", "detection");
+	if (format == "frame")
+		frame_format_ = true;
+	else if (format != "detection")
+		throw std::runtime_error("ObjectDetectUDPStage: unknown format " + format);
+
+	batch_frames_ = std::clamp(params.get<unsigned int>("batch_frames", 1), 1u, 255u);
+	max_datagram_size_ = params.get<unsigned int>("max_datagram_size", MAX_DATAGRAM_SIZE);
+	if (max_datagram_size_ < sizeof(DatagramHeader) + sizeof(FrameHeader) + sizeof(DetectionRecord) ||
+		max_datagram_size_ > 65507)
+		throw std::runtime_error("ObjectDetectUDPStage: max_datagram_size out of range");
+
+	multicast_ttl_ = params.get<int>("multicast_ttl", 1);
+	multicast_interface_ = params.get<std::string>("multicast_interface", "");
 }
 
 template <typename T>
@@ -129,15 +231,32 @@ bool ObjectDetectUDPStage::Process(CompletedRequestPtr &completed_request)
 	if (sockfd_ == -1)
 		return false;
 
+	if (frame_format_)
+	{
+		const int64_t timestamp = completed_request->metadata.get(controls::SensorTimestamp).value_or(0);
+		addFrame(completed_request->sequence, timestamp, detections);
+	}
+	else
+		sendDetections(detections);
+
+	return false;
+}
+
+void ObjectDetectUDPStage::Stop()
+{
+	// Don't leave a part filled batch behind.
+	if (sockfd_ != -1 && frames_)
+		flush();
+}
+
+void ObjectDetectUDPStage::sendDetections(std::vector<Detection> const &detections)
+{
+	// Each detection goes in a separate message, one after the other in this buffer.
+	std::vector<char> &udp_data_buffer = datagram_;
+
 	for (auto &detection : detections)
 	{
-		// Draw rectangle and text on the image
-		std::stringstream text_stream;
-		text_stream << detection.name << " " << (int)(detection.confidence * 100) << "%";
-		std::string text = text_stream.str();
-		
-		// Use a vector to dynamically build the binary message
-		std::vector<char> udp_data_buffer;
+		udp_data_buffer.clear();
 
 		// 1. Add start delimiter (4 bytes)
 		append(udp_data_buffer, START_DELIMITER);
@@ -157,23 +276,97 @@ bool ObjectDetectUDPStage::Process(CompletedRequestPtr &completed_request)
 		constexpr uint8_t name_length = 255;
 		udp_data_buffer.push_back(static_cast<char>(name_length));
 
-		std::array<uint8_t, name_length> name;
-		memcpy(name.data(), detection.name.c_str(), name_length - 2);
-		name[name_length - 1] = '\0';
+		std::array<uint8_t, name_length> name {};
+		memcpy(name.data(), detection.name.c_str(), std::min<size_t>(detection.name.size(), name_length - 1));
 		append(udp_data_buffer, name);
 
 		// 4. Add confidence (4 bytes)
 		const float confidence = detection.confidence;
 		append(udp_data_buffer, confidence);
 
-		// Send data via UDP
-		const ssize_t bytes_sent = sendto(sockfd_, udp_data_buffer.data(), udp_data_buffer.size(), 0,
-										  (const struct sockaddr *)&servaddr_, sizeof(servaddr_));
-		if (bytes_sent < 0)
-			perror("Failed to send UDP message");
+		send(udp_data_buffer);
 	}
+}
 
-	return false;
+void ObjectDetectUDPStage::addFrame(uint32_t sequence, int64_t timestamp, std::vector<Detection> const &detections)
+{
+	unsigned int done = 0;
+
+	do
+	{
+		// Start a new datagram if this one can't take even the frame header and a detection.
+		const size_t need = sizeof(FrameHeader) + (done < detections.size() ? sizeof(DetectionRecord) : 0);
+		if (frames_ && (datagram_.size() + need > max_datagram_size_ || frames_ == 255))
+			flush();
+
+		const size_t header_size = datagram_.empty() ? sizeof(DatagramHeader) : datagram_.size();
+		const unsigned int room = (max_datagram_size_ - header_size - sizeof(FrameHeader)) / sizeof(DetectionRecord);
+		const unsigned int count = std::min<unsigned int>(room, detections.size() - done);
+		const bool more = done + count < detections.size();
+
+		// Rather than split a frame that would fit in a datagram of its own, send what we've got first.
+		if (more && frames_)
+		{
+			flush();
+			continue;
+		}
+
+		appendFrame(sequence, timestamp, more ? FRAME_FLAG_MORE : 0, detections.data() + done, count);
+		done += count;
+
+		if (more)
+			flush();
+	} while (done < detections.size());
+
+	if (frames_ >= batch_frames_)
+		flush();
+}
+
+void ObjectDetectUDPStage::appendFrame(uint32_t sequence, int64_t timestamp, uint8_t flags,
+									   Detection const *detections, unsigned int count)
+{
+	if (datagram_.empty())
+	{
+		DatagramHeader header = { FRAME_DELIMITER, FRAME_VERSION, 0, 0 };
+		append(datagram_, header);
+	}
+
+	FrameHeader frame = { sequence, flags, 0, static_cast<uint16_t>(count), timestamp };
+	append(datagram_, frame);
+
+	for (unsigned int i = 0; i < count; i++)
+	{
+		Detection const &detection = detections[i];
+		DetectionRecord record = { detection.box.x,
+								   detection.box.y,
+								   detection.box.width,
+								   detection.box.height,
+								   detection.confidence,
+								   detection.category,
+								   detection.id,
+								   {} };
+		memcpy(record.name, detection.name.c_str(), std::min(detection.name.size(), sizeof(record.name)));
+		append(datagram_, record);
+	}
+
+	frames_++;
+}
+
+void ObjectDetectUDPStage::flush()
+{
+	datagram_[offsetof(DatagramHeader, frame_count)] = frames_;
+	send(datagram_);
+	datagram_.clear();
+	frames_ = 0;
+}
+
+void ObjectDetectUDPStage::send(std::vector<char> const &data)
+{
+	// Send data via UDP
+	const ssize_t bytes_sent =
+		sendto(sockfd_, data.data(), data.size(), 0, (const struct sockaddr *)&servaddr_, sizeof(servaddr_));
+	if (bytes_sent < 0)
+		perror("Failed to send UDP message");
 }
 
 static PostProcessingStage *Create(RPiCamApp *app)
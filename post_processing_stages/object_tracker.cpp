@@ -0,0 +1,179 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * object_tracker.cpp - follows detected objects from frame to frame
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "post_processing_stages/object_tracker.hpp"
+
+using Rectangle = libcamera::Rectangle;
+
+ObjectTracker::Config ObjectTracker::ReadConfig(boost::property_tree::ptree const &params)
+{
+	Config config;
+	config.tolerance = params.get<float>("temporal_filter.tolerance", config.tolerance);
+	config.factor = params.get<float>("temporal_filter.factor", config.factor);
+	config.visible_frames = params.get<unsigned int>("temporal_filter.visible_frames", config.visible_frames);
+	config.hidden_frames = params.get<unsigned int>("temporal_filter.hidden_frames", config.hidden_frames);
+	config.min_iou = params.get<float>("temporal_filter.min_iou", config.min_iou);
+	return config;
+}
+
+void ObjectTracker::Reset(libcamera::Size const &image_size)
+{
+	image_size_ = image_size;
+	tracks_.clear();
+
+	// Cells at least the size of the tolerance mean that anything close enough to match is in a neighbouring cell.
+	const unsigned int cells = config_.tolerance > 0 ? std::floor(1 / config_.tolerance) : 1;
+	grid_width_ = std::clamp(cells, 1u, std::max(image_size.width, 1u));
+	grid_height_ = std::clamp(cells, 1u, std::max(image_size.height, 1u));
+	grid_.assign(grid_width_ * grid_height_, {});
+}
+
+static float intersection_over_union(const Rectangle &a, const Rectangle &b)
+{
+	const Rectangle intersection = a.boundedTo(b);
+	if (intersection.isNull())
+		return 0;
+
+	const float i = (float)intersection.width * intersection.height;
+	return i / ((float)a.width * a.height + (float)b.width * b.height - i);
+}
+
+void ObjectTracker::Update(std::vector<Detection> &objects)
+{
+	const bool empty = tracks_.empty();
+	const float width = std::max(image_size_.width, 1u), height = std::max(image_size_.height, 1u);
+	const float max_dx = config_.tolerance * width, max_dy = config_.tolerance * height;
+
+	auto cell_of = [this, width, height](const Rectangle &box, int &cx, int &cy) {
+		cx = std::clamp<int>(box.x * grid_width_ / width, 0, grid_width_ - 1);
+		cy = std::clamp<int>(box.y * grid_height_ / height, 0, grid_height_ - 1);
+	};
+
+	// Predict where each object has got to, and bucket the predictions.
+	for (auto &cell : grid_)
+		cell.clear();
+	predicted_.resize(tracks_.size());
+	for (unsigned int t = 0; t < tracks_.size(); t++)
+	{
+		Track &track = tracks_[t];
+		track.matched = false;
+		predicted_[t] = track.object.box.translatedBy(libcamera::Point(std::lround(track.vx), std::lround(track.vy)));
+
+		int cx, cy;
+		cell_of(predicted_[t], cx, cy);
+		grid_[cy * grid_width_ + cx].push_back(t);
+	}
+
+	// Find every pairing that's close enough, looking only in the neighbouring cells.
+	matches_.clear();
+	for (unsigned int d = 0; d < objects.size(); d++)
+	{
+		const Detection &object = objects[d];
+		int cx, cy;
+		cell_of(object.box, cx, cy);
+
+		for (int y = std::max(cy - 1, 0); y <= std::min<int>(cy + 1, grid_height_ - 1); y++)
+		{
+			for (int x = std::max(cx - 1, 0); x <= std::min<int>(cx + 1, grid_width_ - 1); x++)
+			{
+				for (unsigned int t : grid_[y * grid_width_ + x])
+				{
+					const Rectangle &p = predicted_[t];
+					const float dx = std::abs(object.box.x - p.x), dy = std::abs(object.box.y - p.y);
+					const float dw = std::abs((int)object.box.width - (int)p.width);
+					const float dh = std::abs((int)object.box.height - (int)p.height);
+
+					if (object.category != tracks_[t].object.category || dx >= max_dx || dy >= max_dy ||
+						dw >= max_dx || dh >= max_dy)
+						continue;
+					if (config_.min_iou > 0 && intersection_over_union(object.box, p) < config_.min_iou)
+						continue;
+
+					matches_.push_back({ dx / width + dy / height + dw / width + dh / height, d, t });
+				}
+			}
+		}
+	}
+
+	// The closest pairs get first pick.
+	std::sort(matches_.begin(), matches_.end(), [](const Match &a, const Match &b) { return a.cost < b.cost; });
+	detection_matched_.assign(objects.size(), false);
+	const float f = config_.factor;
+
+	for (const Match &match : matches_)
+	{
+		Track &track = tracks_[match.track];
+		if (detection_matched_[match.detection] || track.matched)
+			continue;
+
+		const Detection &object = objects[match.detection];
+		Rectangle &box = track.object.box;
+		const Rectangle &p = predicted_[match.track];
+
+		track.vx = f * (object.box.x - box.x) + (1 - f) * track.vx;
+		track.vy = f * (object.box.y - box.y) + (1 - f) * track.vy;
+		box.x = f * object.box.x + (1 - f) * p.x;
+		box.y = f * object.box.y + (1 - f) * p.y;
+		box.width = f * object.box.width + (1 - f) * p.width;
+		box.height = f * object.box.height + (1 - f) * p.height;
+		track.object.confidence = object.confidence;
+
+		// Reset the visibility counter for when the object next disappears, and count down the frames until
+		// it can be shown.
+		track.visible = config_.visible_frames;
+		track.hidden = track.hidden ? track.hidden - 1 : 0;
+		track.matched = true;
+		detection_matched_[match.detection] = true;
+	}
+
+	for (unsigned int t = 0; t < tracks_.size(); t++)
+	{
+		Track &track = tracks_[t];
+		if (track.matched)
+			continue;
+
+		// An object that's still hidden must be matched again from scratch. Otherwise it coasts along at the
+		// speed it was going until it's forgotten.
+		if (track.hidden)
+			track.visible = 0;
+		else if (track.visible)
+			track.visible--;
+		track.object.box = predicted_[t];
+	}
+
+	// Remove now invisible objects.
+	tracks_.erase(std::remove_if(tracks_.begin(), tracks_.end(),
+								 [](const Track &track) { return !track.matched && !track.visible; }),
+				  tracks_.end());
+
+	// Start following new objects. These stay hidden for hidden_frames consecutive frames, unless we weren't
+	// following anything before, in which case we might as well show them straight away.
+	for (unsigned int d = 0; d < objects.size(); d++)
+	{
+		if (detection_matched_[d])
+			continue;
+
+		tracks_.push_back({ objects[d], 0, 0, config_.visible_frames, empty ? 0 : config_.hidden_frames, true });
+		tracks_.back().object.id = next_id_++;
+	}
+
+	objects = Objects();
+}
+
+std::vector<Detection> ObjectTracker::Objects() const
+{
+	std::vector<Detection> objects;
+	for (auto const &track : tracks_)
+	{
+		if (!track.hidden)
+			objects.push_back(track.object);
+	}
+	return objects;
+}
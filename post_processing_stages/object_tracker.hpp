@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * object_tracker.hpp - follows detected objects from frame to frame
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <boost/property_tree/ptree.hpp>
+
+#include <libcamera/geometry.h>
+
+#include "post_processing_stages/object_detect.hpp"
+
+// The ObjectTracker smooths the output of an object detector over time. Each new detection is matched to the
+// object whose predicted position is closest, and a matched object has its box blended with the detection and
+// keeps its id. Objects must be seen for a number of frames before being reported, and are remembered for a few
+// frames after they were last seen.
+//
+// Objects are predicted to carry on at the speed they were last going. To keep matching cheap when there are
+// a lot of objects, they're bucketed into a grid whose cells are the match tolerance in size, so a detection only
+// needs to look at objects in the cells next to its own. Each detection pairs with at most one object, the
+// closest pairs going first.
+
+class ObjectTracker
+{
+public:
+	struct Config
+	{
+		// How far, as a fraction of the image size, an object can be from its prediction and still match.
+		float tolerance = 0.05;
+		// How much of each new detection goes into the object's box and velocity.
+		float factor = 0.2;
+		// The number of frames an object is remembered for after it disappears.
+		unsigned int visible_frames = 5;
+		// The number of frames an object must be seen for before it's reported.
+		unsigned int hidden_frames = 2;
+		// If non-zero, matches must also overlap the prediction by at least this intersection over union.
+		float min_iou = 0;
+	};
+
+	// Read the config from a stage's "temporal_filter" parameters.
+	static Config ReadConfig(boost::property_tree::ptree const &params);
+
+	void SetConfig(Config const &config) { config_ = config; }
+
+	// Forget all the objects, and set the size of the image that the detections are in.
+	void Reset(libcamera::Size const &image_size);
+
+	// Match this frame's detections to the objects, replacing them with the objects that should now be shown.
+	// Every object tracked gets a non-zero id that stays with it.
+	void Update(std::vector<Detection> &objects);
+
+	// The objects being shown now, with no new detections.
+	std::vector<Detection> Objects() const;
+
+	bool Empty() const { return tracks_.empty(); }
+
+private:
+	struct Track
+	{
+		Detection object;
+		// Velocity of the box in pixels per update.
+		float vx, vy;
+		unsigned int visible;
+		unsigned int hidden;
+		bool matched;
+	};
+
+	struct Match
+	{
+		float cost;
+		unsigned int detection;
+		unsigned int track;
+	};
+
+	Config config_;
+	libcamera::Size image_size_;
+	unsigned int next_id_ = 1;
+	std::vector<Track> tracks_;
+
+	// Scratch space, kept to save reallocating it every frame.
+	unsigned int grid_width_ = 1, grid_height_ = 1;
+	std::vector<std::vector<unsigned int>> grid_;
+	std::vector<libcamera::Rectangle> predicted_;
+	std::vector<Match> matches_;
+	std::vector<bool> detection_matched_;
+};
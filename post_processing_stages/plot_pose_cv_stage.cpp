@@ -17,6 +17,7 @@
 
 #include "core/rpicam_app.hpp"
 
+#include "post_processing_stages/cv_workspace.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include "opencv2/imgproc.hpp"
@@ -62,7 +63,7 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
-	void drawFeatures(cv::Mat &img, std::vector<Point> locations, std::vector<float> confidences);
+	void drawFeatures(cv::Mat &img, std::vector<Point> const &locations, std::vector<float> const &confidences);
 
 	Stream *stream_;
 	float confidence_threshold_;
@@ -100,31 +101,28 @@ bool PlotPoseCvStage::Process(CompletedRequestPtr &completed_request)
 	completed_request->post_process_metadata.Get("pose_estimation.locations", lib_locations);
 	completed_request->post_process_metadata.Get("pose_estimation.confidences", confidences);
 
-	unsigned int i = 0;
-	for (auto const &loc : lib_locations)
+	Mat image = cv_wrap(ptr, info);
+	// One vector for all the poses, rather than one each.
+	std::vector<Point> cv_locations;
+	cv_locations.reserve(FEATURE_SIZE);
+	for (unsigned int i = 0; i < lib_locations.size() && i < confidences.size(); i++)
 	{
-		std::vector<cv::Rect> rects;
-		std::vector<Point> cv_locations;
-
-		std::vector<float> &conf = confidences[i];
+		std::vector<libcamera::Point> const &loc = lib_locations[i];
+		std::vector<float> const &conf = confidences[i];
 
 		if (!conf.empty() && !loc.empty())
 		{
-			Mat image(info.height, info.width, CV_8U, ptr, info.stride);
+			cv_locations.clear();
 			for (libcamera::Point lib_location : loc)
-			{
-				Point cv_location;
-				cv_location.x = lib_location.x;
-				cv_location.y = lib_location.y;
-				cv_locations.push_back(cv_location);
-			}
+				cv_locations.emplace_back(lib_location.x, lib_location.y);
 			drawFeatures(image, cv_locations, conf);
 		}
 	}
 	return false;
 }
 
-void PlotPoseCvStage::drawFeatures(Mat &img, std::vector<cv::Point> locations, std::vector<float> confidences)
+void PlotPoseCvStage::drawFeatures(Mat &img, std::vector<cv::Point> const &locations,
+								   std::vector<float> const &confidences)
 {
 	Scalar colour = Scalar(255, 255, 255);
 	int radius = 5;
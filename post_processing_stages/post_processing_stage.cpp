@@ -5,6 +5,19 @@
  * post_processing_stage.cpp - Post processing stage base class implementation.
  */
 
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "core/buffer_sync.hpp"
+#include "core/cpu_features.hpp"
+#include "core/rpicam_app.hpp"
+
 #include "post_processing_stage.hpp"
 
 PostProcessingStage::PostProcessingStage(RPiCamApp *app) : app_(app)
@@ -15,6 +28,11 @@ PostProcessingStage::~PostProcessingStage()
 {
 }
 
+PostProcessingStage::Concurrency PostProcessingStage::GetConcurrency() const
+{
+	return Concurrency::Reentrant;
+}
+
 void PostProcessingStage::Read(boost::property_tree::ptree const &params)
 {
 }
@@ -23,6 +41,11 @@ void PostProcessingStage::AdjustConfig(std::string const &, StreamConfiguration
 {
 }
 
+bool PostProcessingStage::GetLoresRequest(LoresRequest &)
+{
+	return false;
+}
+
 void PostProcessingStage::Configure()
 {
 }
@@ -41,6 +64,465 @@ void PostProcessingStage::Teardown()
 {
 }
 
+// Below here is the YUV420 to RGB conversion. Each destination row is made on its own: the Y, U and
+// V planes are resampled to the destination width, converted to R, G and B, and then written out
+// in whatever layout was asked for. That lets us share the rows out over several threads.
+
+// Row bands are only worth their threads in images with at least this many pixels.
+static constexpr unsigned int MIN_BAND_PIXELS = 128 * 128;
+static constexpr unsigned int MAX_BANDS = 4;
+
+// The threads the row bands are shared out to. They're started the first time they're needed and then
+// kept, as starting threads on every frame costs more than converting the smaller images. One caller
+// has them at a time; anyone else meanwhile does all their own bands.
+class BandWorkers
+{
+public:
+	static BandWorkers &Get()
+	{
+		static BandWorkers workers;
+		return workers;
+	}
+
+	// Run work(0) to work(n - 1), the first on the calling thread, and return once they're all done.
+	void Run(unsigned int n, std::function<void(unsigned int)> const &work)
+	{
+		std::unique_lock<std::mutex> busy(busy_, std::try_to_lock);
+		if (!busy || n <= 1)
+		{
+			for (unsigned int i = 0; i < n; i++)
+				work(i);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			work_ = &work;
+			next_ = 1;
+			count_ = n;
+			pending_ = n - 1;
+		}
+		work_cv_.notify_all();
+		work(0);
+		std::unique_lock<std::mutex> lock(mutex_);
+		done_cv_.wait(lock, [this] { return pending_ == 0; });
+		work_ = nullptr;
+	}
+
+private:
+	BandWorkers()
+	{
+		for (unsigned int i = 1; i < MAX_BANDS; i++)
+			threads_.emplace_back(&BandWorkers::thread, this);
+	}
+
+	~BandWorkers()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			abort_ = true;
+		}
+		work_cv_.notify_all();
+		for (auto &t : threads_)
+			t.join();
+	}
+
+	void thread()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		while (true)
+		{
+			work_cv_.wait(lock, [this] { return abort_ || (work_ && next_ < count_); });
+			if (abort_)
+				break;
+			std::function<void(unsigned int)> const *work = work_;
+			unsigned int i = next_++;
+			lock.unlock();
+			(*work)(i);
+			lock.lock();
+			if (--pending_ == 0)
+				done_cv_.notify_one();
+		}
+	}
+
+	std::mutex busy_;
+	std::mutex mutex_;
+	std::condition_variable work_cv_;
+	std::condition_variable done_cv_;
+	std::function<void(unsigned int)> const *work_ = nullptr;
+	unsigned int next_ = 0;
+	unsigned int count_ = 0;
+	unsigned int pending_ = 0;
+	bool abort_ = false;
+	std::vector<std::thread> threads_;
+};
+
+// The conversion matrix, in 64ths. Y is scaled first, so the full range case costs nothing extra. The
+// kernels are instantiated for each matrix, so that the coefficients are constants in their loops.
+struct YuvMatrix
+{
+	int16_t y_offset, y_scale, vr, ug, vg, ub;
+};
+
+// The full range BT.601 coefficients are 1.402, 0.345, 0.714 and 1.771.
+static constexpr YuvMatrix JPEG_MATRIX = { 0, 64, 90, 22, 46, 113 };
+static constexpr YuvMatrix SMPTE170M_MATRIX = { 16, 75, 102, 25, 52, 129 };
+static constexpr YuvMatrix REC709_MATRIX = { 16, 75, 115, 14, 34, 135 };
+
+template <YuvMatrix const &m>
+static void yuv_to_rgb_generic(uint8_t const *Y, uint8_t const *U, uint8_t const *V, unsigned int n, uint8_t *R,
+							   uint8_t *G, uint8_t *B)
+{
+	for (unsigned int x = 0; x < n; x++)
+	{
+		int y = ((Y[x] - m.y_offset) * m.y_scale + 32) >> 6, u = U[x] - 128, v = V[x] - 128;
+		R[x] = std::clamp(y + ((m.vr * v + 32) >> 6), 0, 255);
+		G[x] = std::clamp(y - ((m.ug * u + m.vg * v + 32) >> 6), 0, 255);
+		B[x] = std::clamp(y + ((m.ub * u + 32) >> 6), 0, 255);
+	}
+}
+
+static void interleave_generic(uint8_t const *A, uint8_t const *B, uint8_t const *C, unsigned int n, uint8_t *dst)
+{
+	for (unsigned int x = 0; x < n; x++)
+	{
+		dst[3 * x] = A[x];
+		dst[3 * x + 1] = B[x];
+		dst[3 * x + 2] = C[x];
+	}
+}
+
+#if defined(RPICAM_NEON_KERNELS)
+// 8 pixels at a time, using the same fixed point arithmetic as the generic version.
+template <YuvMatrix const &m>
+NEON_TARGET static void yuv_to_rgb_neon(uint8_t const *Y, uint8_t const *U, uint8_t const *V, unsigned int n,
+										uint8_t *R, uint8_t *G, uint8_t *B)
+{
+	unsigned int x = 0;
+	int16x8_t bias = vdupq_n_s16(128), y_offset = vdupq_n_s16(m.y_offset);
+	for (; x + 8 <= n; x += 8)
+	{
+		int16x8_t y = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(Y + x))), y_offset);
+		int16x8_t u = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(U + x))), bias);
+		int16x8_t v = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(V + x))), bias);
+		y = vrshrq_n_s16(vmulq_n_s16(y, m.y_scale), 6);
+		vst1_u8(R + x, vqmovun_s16(vaddq_s16(y, vrshrq_n_s16(vmulq_n_s16(v, m.vr), 6))));
+		vst1_u8(G + x, vqmovun_s16(vsubq_s16(y, vrshrq_n_s16(vmlaq_n_s16(vmulq_n_s16(u, m.ug), v, m.vg), 6))));
+		vst1_u8(B + x, vqmovun_s16(vaddq_s16(y, vrshrq_n_s16(vmulq_n_s16(u, m.ub), 6))));
+	}
+	yuv_to_rgb_generic<m>(Y + x, U + x, V + x, n - x, R + x, G + x, B + x);
+}
+
+NEON_TARGET static void interleave_neon(uint8_t const *A, uint8_t const *B, uint8_t const *C, unsigned int n,
+										uint8_t *dst)
+{
+	unsigned int x = 0;
+	for (; x + 16 <= n; x += 16)
+	{
+		uint8x16x3_t pixels = { { vld1q_u8(A + x), vld1q_u8(B + x), vld1q_u8(C + x) } };
+		vst3q_u8(dst + 3 * x, pixels);
+	}
+	interleave_generic(A + x, B + x, C + x, n - x, dst + 3 * x);
+}
+#endif
+
+using YuvToRgbRow = void (*)(uint8_t const *, uint8_t const *, uint8_t const *, unsigned int, uint8_t *, uint8_t *,
+							 uint8_t *);
+template <YuvMatrix const &m>
+static YuvToRgbRow const yuv_to_rgb_row = SelectKernel<YuvToRgbRow>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, yuv_to_rgb_neon<m> },
+#endif
+	{ CpuLevel::Generic, yuv_to_rgb_generic<m> },
+});
+
+// Chosen once per image, for its colour space.
+static YuvToRgbRow yuv_to_rgb_kernel(StreamInfo const &info, PostProcessingStage::RgbConversion const &conversion)
+{
+	if (!conversion.use_colour_space || !info.colour_space)
+		return yuv_to_rgb_row<JPEG_MATRIX>;
+	else if (*info.colour_space == libcamera::ColorSpace::Smpte170m)
+		return yuv_to_rgb_row<SMPTE170M_MATRIX>;
+	else if (*info.colour_space == libcamera::ColorSpace::Rec709)
+		return yuv_to_rgb_row<REC709_MATRIX>;
+	return yuv_to_rgb_row<JPEG_MATRIX>;
+}
+
+using InterleaveRow = void (*)(uint8_t const *, uint8_t const *, uint8_t const *, unsigned int, uint8_t *);
+static InterleaveRow const interleave_row = SelectKernel<InterleaveRow>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, interleave_neon },
+#endif
+	{ CpuLevel::Generic, interleave_generic },
+});
+
+// Where each destination column (or row) comes from in one source plane. Bilinear sampling blends
+// pixels index and index + 1, giving the second weight / 256. Area sampling averages count pixels
+// starting at index. Point sampling just takes the pixel at index.
+struct Taps
+{
+	std::vector<unsigned int> index;
+	std::vector<unsigned int> weight;
+	std::vector<unsigned int> count;
+	bool identity = true; // just copies the pixels from index[0] onwards
+	bool nearest = true; // every weight is 0
+	bool area = false;
+	unsigned int first = 0, end = 0; // the source pixels used, [first, end)
+
+	// Map n destination pixels onto the source span [start, start + length) of a plane with size pixels.
+	Taps(unsigned int n, double start, double length, unsigned int size, bool use_area, bool point)
+		: index(n), weight(n, 0), count(n, 1), area(use_area && !point)
+	{
+		double ratio = length / n;
+		identity = ratio == 1.0 && start == (unsigned int)start;
+		// Chroma for an unscaled crop has exactly 2 pixels for each one of its own, which we just repeat.
+		bool repeat = ratio == 0.5 && start == (unsigned int)start;
+		for (unsigned int i = 0; i < n; i++)
+		{
+			if (identity)
+				index[i] = start + i;
+			else if (repeat)
+				index[i] = std::min<unsigned int>(start + i / 2, size - 1);
+			else if (point)
+				index[i] = std::min<unsigned int>(start + (i + 0.5) * ratio, size - 1);
+			else if (area)
+			{
+				unsigned int begin = std::min<unsigned int>(start + i * ratio, size - 1);
+				unsigned int finish = std::clamp<unsigned int>(start + (i + 1) * ratio, begin + 1, size);
+				index[i] = begin;
+				count[i] = finish - begin;
+			}
+			else
+			{
+				double pos = std::clamp(start + (i + 0.5) * ratio - 0.5, 0.0, size - 1.0);
+				index[i] = std::min<unsigned int>(pos, size > 1 ? size - 2 : 0);
+				weight[i] = size > 1 ? std::lround((pos - index[i]) * 256) : 0;
+				count[i] = size > 1 ? 2 : 1;
+			}
+		}
+		nearest = identity || repeat || point || (!area && size == 1);
+		first = index[0];
+		end = index[n - 1] + count[n - 1];
+	}
+};
+
+// Make one row of a plane, resampled to the destination width. acc needs room for xt's span.
+static void resample_row(uint8_t const *plane, unsigned int stride, Taps const &xt, Taps const &yt, unsigned int y,
+						 uint32_t *acc, uint8_t *out)
+{
+	unsigned int n = xt.index.size();
+	uint8_t const *row0 = plane + yt.index[y] * stride;
+	if (yt.nearest || (!yt.area && yt.weight[y] == 0))
+	{
+		if (xt.identity)
+		{
+			memcpy(out, row0 + xt.first, n);
+			return;
+		}
+		else if (xt.nearest)
+		{
+			for (unsigned int x = 0; x < n; x++)
+				out[x] = row0[xt.index[x]];
+			return;
+		}
+	}
+
+	// First combine the source rows over the span of columns we need, which vectorises well...
+	unsigned int span = xt.end - xt.first;
+	row0 += xt.first;
+	unsigned int rows = yt.area ? yt.count[y] : 1;
+	if (yt.area)
+	{
+		std::fill(acc, acc + span, 0);
+		for (unsigned int r = 0; r < rows; r++, row0 += stride)
+		{
+			for (unsigned int i = 0; i < span; i++)
+				acc[i] += row0[i];
+		}
+	}
+	else
+	{
+		uint8_t const *row1 = yt.weight[y] ? row0 + stride : row0;
+		unsigned int w1 = yt.weight[y], w0 = 256 - w1;
+		for (unsigned int i = 0; i < span; i++)
+			acc[i] = row0[i] * w0 + row1[i] * w1;
+		rows = 256;
+	}
+
+	// ...and then across.
+	uint32_t const *a = acc - xt.first;
+	if (xt.nearest && !yt.area)
+	{
+		for (unsigned int x = 0; x < n; x++)
+			out[x] = (a[xt.index[x]] + 128) >> 8;
+	}
+	else if (xt.nearest)
+	{
+		for (unsigned int x = 0; x < n; x++)
+			out[x] = (a[xt.index[x]] + rows / 2) / rows;
+	}
+	else if (xt.area)
+	{
+		for (unsigned int x = 0; x < n; x++)
+		{
+			uint32_t sum = 0;
+			for (unsigned int i = 0; i < xt.count[x]; i++)
+				sum += a[xt.index[x] + i];
+			unsigned int total = xt.count[x] * rows;
+			out[x] = (sum + total / 2) / total;
+		}
+	}
+	else
+	{
+		// Bilinear both ways (area sampling is always used in both directions together).
+		for (unsigned int x = 0; x < n; x++)
+		{
+			uint32_t v = a[xt.index[x]] * (256 - xt.weight[x]) + a[xt.index[x] + 1] * xt.weight[x];
+			out[x] = (v + 32768) >> 16;
+		}
+	}
+}
+
+// The output layout is chosen once per image too, rather than on every row.
+template <bool planar>
+static void store_row(uint8_t *dst, uint8_t const *const ch[3], unsigned int width, unsigned int y,
+					  StreamInfo const &dst_info, PostProcessingStage::RgbConversion const &)
+{
+	if constexpr (planar)
+	{
+		for (unsigned int c = 0; c < 3; c++)
+			memcpy(dst + (c * dst_info.height + y) * width, ch[c], width);
+	}
+	else
+		interleave_row(ch[0], ch[1], ch[2], width, dst + y * dst_info.stride);
+}
+
+// All these loops run over contiguous memory, so that the compiler can vectorise them.
+static void normalise(uint8_t const *src, unsigned int n, float offset, float scale, float *dst)
+{
+	for (unsigned int i = 0; i < n; i++)
+		dst[i] = (src[i] - offset) * scale;
+}
+
+// Interleaving as it normalises, each channel with its own constants, which the compiler turns into
+// structure stores.
+static void normalise_interleaved(uint8_t const *const ch[3], unsigned int n, float const offset[3],
+								  float const scale[3], float *dst)
+{
+	uint8_t const *A = ch[0], *B = ch[1], *C = ch[2];
+	float o0 = offset[0], o1 = offset[1], o2 = offset[2];
+	float s0 = 1.0f / scale[0], s1 = 1.0f / scale[1], s2 = 1.0f / scale[2];
+	for (unsigned int x = 0; x < n; x++)
+	{
+		dst[3 * x] = (A[x] - o0) * s0;
+		dst[3 * x + 1] = (B[x] - o1) * s1;
+		dst[3 * x + 2] = (C[x] - o2) * s2;
+	}
+}
+
+template <bool planar>
+static void store_row(float *dst, uint8_t const *const ch[3], unsigned int width, unsigned int y,
+					  StreamInfo const &dst_info, PostProcessingStage::RgbConversion const &conversion)
+{
+	float const *offset = conversion.offset, *scale = conversion.scale;
+	if constexpr (planar)
+	{
+		for (unsigned int c = 0; c < 3; c++)
+			normalise(ch[c], width, offset[c], 1.0f / scale[c], dst + (c * dst_info.height + y) * width);
+	}
+	else
+		normalise_interleaved(ch, width, offset, scale, dst + y * width * 3);
+}
+
+template <typename T>
+static void yuv420_to_rgb(T *dst, const uint8_t *src, StreamInfo const &src_info, StreamInfo const &dst_info,
+						  PostProcessingStage::RgbConversion const &conversion)
+{
+	using Resize = PostProcessingStage::RgbConversion::Resize;
+	unsigned int dst_w = dst_info.width, dst_h = dst_info.height;
+	if (!dst_w || !dst_h || !src_info.width || !src_info.height)
+		return;
+
+	// Work out which part of the source goes into which part of the destination.
+	double src_x = 0, src_y = 0, src_w = src_info.width, src_h = src_info.height;
+	unsigned int out_x = 0, out_y = 0, out_w = dst_w, out_h = dst_h;
+	Resize resize = conversion.resize;
+	if (resize == Resize::Crop && (src_info.width < dst_w || src_info.height < dst_h))
+		resize = Resize::Fill;
+	if (resize == Resize::Crop)
+	{
+		src_x = ((src_info.width - dst_w) / 2) & ~1, src_y = ((src_info.height - dst_h) / 2) & ~1;
+		src_w = dst_w, src_h = dst_h;
+	}
+	else if (resize == Resize::Fill)
+	{
+		double scale = std::max(dst_w / src_w, dst_h / src_h);
+		src_x = (src_w - dst_w / scale) / 2, src_y = (src_h - dst_h / scale) / 2;
+		src_w = dst_w / scale, src_h = dst_h / scale;
+	}
+	else if (resize == Resize::Letterbox)
+	{
+		double scale = std::min(dst_w / src_w, dst_h / src_h);
+		out_w = std::clamp<unsigned int>(std::lround(src_w * scale), 1, dst_w);
+		out_h = std::clamp<unsigned int>(std::lround(src_h * scale), 1, dst_h);
+		out_x = (dst_w - out_w) / 2, out_y = (dst_h - out_h) / 2;
+	}
+
+	// Shrinking by a factor of 2 or more averages whole areas, as bilinear sampling would alias.
+	bool area = src_w >= 2 * out_w || src_h >= 2 * out_h;
+	unsigned int chroma_w = std::max(src_info.width / 2, 1u), chroma_h = std::max(src_info.height / 2, 1u);
+	bool point = conversion.nearest;
+	Taps y_xt(out_w, src_x, src_w, src_info.width, area, point);
+	Taps y_yt(out_h, src_y, src_h, src_info.height, area, point);
+	Taps c_xt(out_w, src_x / 2, src_w / 2, chroma_w, area, point);
+	Taps c_yt(out_h, src_y / 2, src_h / 2, chroma_h, area, point);
+	const YuvToRgbRow yuv_to_rgb = yuv_to_rgb_kernel(src_info, conversion);
+	using StoreRow = void (*)(T *, uint8_t const *const[3], unsigned int, unsigned int, StreamInfo const &,
+							  PostProcessingStage::RgbConversion const &);
+	const StoreRow store = conversion.planar ? StoreRow(store_row<true>) : StoreRow(store_row<false>);
+
+	uint8_t const *src_Y = src;
+	uint8_t const *src_U = src + src_info.height * src_info.stride;
+	uint8_t const *src_V = src_U + chroma_h * (src_info.stride / 2);
+	unsigned int chroma_stride = src_info.stride / 2;
+	unsigned int r = conversion.bgr ? 2 : 0, b = conversion.bgr ? 0 : 2;
+
+	auto band = [&](unsigned int y0, unsigned int y1) {
+		std::vector<uint8_t> scratch(3 * out_w + 3 * dst_w, conversion.pad);
+		uint8_t *Y = scratch.data(), *U = Y + out_w, *V = U + out_w;
+		uint8_t *ch[3] = { V + out_w, V + out_w + dst_w, V + out_w + 2 * dst_w };
+		std::vector<uint32_t> acc(std::max(y_xt.end - y_xt.first, c_xt.end - c_xt.first));
+		for (unsigned int y = y0; y < y1; y++)
+		{
+			bool content = y >= out_y && y < out_y + out_h;
+			if (content)
+			{
+				unsigned int row = y - out_y;
+				resample_row(src_Y, src_info.stride, y_xt, y_yt, row, acc.data(), Y);
+				resample_row(src_U, chroma_stride, c_xt, c_yt, row, acc.data(), U);
+				resample_row(src_V, chroma_stride, c_xt, c_yt, row, acc.data(), V);
+				yuv_to_rgb(Y, U, V, out_w, ch[r] + out_x, ch[1] + out_x, ch[b] + out_x);
+			}
+			else
+			{
+				// A letterbox bar, so the rows are all padding.
+				for (unsigned int c = 0; c < 3; c++)
+					memset(ch[c], conversion.pad, dst_w);
+			}
+			store(dst, ch, dst_w, y, dst_info, conversion);
+		}
+	};
+
+	// Share the rows out over a few threads, when there are enough of them.
+	unsigned int num_bands =
+		std::min({ std::max(std::thread::hardware_concurrency(), 1u), MAX_BANDS, dst_h,
+				   std::max(dst_w * dst_h / MIN_BAND_PIXELS, 1u) });
+	unsigned int band_height = (dst_h + num_bands - 1) / num_bands;
+	BandWorkers::Get().Run(num_bands, [&](unsigned int i) {
+		band(std::min(i * band_height, dst_h), std::min((i + 1) * band_height, dst_h));
+	});
+}
+
 std::vector<uint8_t> PostProcessingStage::Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info)
 {
 	std::vector<uint8_t> output(dst_info.height * dst_info.stride);
@@ -50,203 +532,198 @@ std::vector<uint8_t> PostProcessingStage::Yuv420ToRgb(const uint8_t *src, Stream
 
 void PostProcessingStage::Yuv420ToRgb(uint8_t *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info)
 {
-	assert(src_info.width >= dst_info.width && src_info.height >= dst_info.height);
-	int off_x = ((src_info.width - dst_info.width) / 2) & ~1, off_y = ((src_info.height - dst_info.height) / 2) & ~1;
-	int src_Y_size = src_info.height * src_info.stride, src_U_size = (src_info.height / 2) * (src_info.stride / 2);
+	yuv420_to_rgb(dst, src, src_info, dst_info, RgbConversion());
+}
+
+void PostProcessingStage::Yuv420ToRgb(uint8_t *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info,
+									  RgbConversion const &conversion)
+{
+	yuv420_to_rgb(dst, src, src_info, dst_info, conversion);
+}
+
+void PostProcessingStage::Yuv420ToRgb(float *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info,
+									  RgbConversion const &conversion)
+{
+	yuv420_to_rgb(dst, src, src_info, dst_info, conversion);
+}
+
+PostProcessingStage::RgbConversion::Resize PostProcessingStage::RgbConversion::ParseResize(std::string const &name)
+{
+	if (name == "crop")
+		return Resize::Crop;
+	else if (name == "scale")
+		return Resize::Scale;
+	else if (name == "fill")
+		return Resize::Fill;
+	else if (name == "letterbox")
+		return Resize::Letterbox;
+	throw std::runtime_error("unknown resize mode " + name + ", expected crop, scale, fill or letterbox");
+}
 
-	// We're going to process 4x2 pixel blocks, as far as alignment allows.
-	unsigned int dst_h_aligned = dst_info.height & ~1, dst_w_aligned = dst_info.width & ~3;
+// Below here is the mask blending. Each row of the rectangle is made in two steps: the mask is scaled
+// to it (bilinearly, in 8 bit fixed point) as a row of coverage values, and then the colour is blended
+// into the pixels whose coverage passes the threshold.
 
-	unsigned int y = 0;
-	for (; y < dst_h_aligned; y += 2)
+static void blend_row_generic(uint8_t *dst, uint8_t const *coverage, unsigned int n, uint8_t threshold,
+							  uint8_t const colour[3], unsigned int alpha)
+{
+	for (unsigned int x = 0; x < n; x++, dst += 3)
 	{
-		const uint8_t *src_Y0 = src + (y + off_y) * src_info.stride + off_x;
-		const uint8_t *src_U = src + src_Y_size + ((y + off_y) / 2) * (src_info.stride / 2) + off_x / 2;
-		const uint8_t *src_V = src_U + src_U_size;
-		const uint8_t *src_Y1 = src_Y0 + src_info.stride;
-		uint8_t *dst0 = &dst[y * dst_info.stride];
-		uint8_t *dst1 = dst0 + dst_info.stride;
-
-		unsigned int x = 0;
-		for (; x < dst_w_aligned; x += 4)
-		{
-			int Y0 = *(src_Y0++);
-			int U0 = *(src_U++);
-			int V0 = *(src_V++);
-			int Y1 = *(src_Y0++);
-			int Y2 = *(src_Y0++);
-			int U2 = *(src_U++);
-			int V2 = *(src_V++);
-			int Y3 = *(src_Y0++);
-			int Y4 = *(src_Y1++);
-			int Y5 = *(src_Y1++);
-			int Y6 = *(src_Y1++);
-			int Y7 = *(src_Y1++);
-
-			U0 -= 128;
-			V0 -= 128;
-			U2 -= 128;
-			V2 -= 128;
-			int U1 = U0;
-			int V1 = V0;
-			int U4 = U0;
-			int V4 = V0;
-			int U5 = U0;
-			int V5 = V0;
-			int U3 = U2;
-			int V3 = V2;
-			int U6 = U2;
-			int V6 = V2;
-			int U7 = U2;
-			int V7 = V2;
-
-			int R0 = Y0 + 1.402 * V0;
-			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
-			int B0 = Y0 + 1.771 * U0;
-			int R1 = Y1 + 1.402 * V1;
-			int G1 = Y1 - 0.345 * U1 - 0.714 * V1;
-			int B1 = Y1 + 1.771 * U1;
-			int R2 = Y2 + 1.402 * V2;
-			int G2 = Y2 - 0.345 * U2 - 0.714 * V2;
-			int B2 = Y2 + 1.771 * U2;
-			int R3 = Y3 + 1.402 * V3;
-			int G3 = Y3 - 0.345 * U3 - 0.714 * V3;
-			int B3 = Y3 + 1.771 * U3;
-			int R4 = Y4 + 1.402 * V4;
-			int G4 = Y4 - 0.345 * U4 - 0.714 * V4;
-			int B4 = Y4 + 1.771 * U4;
-			int R5 = Y5 + 1.402 * V5;
-			int G5 = Y5 - 0.345 * U5 - 0.714 * V5;
-			int B5 = Y5 + 1.771 * U5;
-			int R6 = Y6 + 1.402 * V6;
-			int G6 = Y6 - 0.345 * U6 - 0.714 * V6;
-			int B6 = Y6 + 1.771 * U6;
-			int R7 = Y7 + 1.402 * V7;
-			int G7 = Y7 - 0.345 * U7 - 0.714 * V7;
-			int B7 = Y7 + 1.771 * U7;
-
-			R0 = std::clamp(R0, 0, 255);
-			G0 = std::clamp(G0, 0, 255);
-			B0 = std::clamp(B0, 0, 255);
-			R1 = std::clamp(R1, 0, 255);
-			G1 = std::clamp(G1, 0, 255);
-			B1 = std::clamp(B1, 0, 255);
-			R2 = std::clamp(R2, 0, 255);
-			G2 = std::clamp(G2, 0, 255);
-			B2 = std::clamp(B2, 0, 255);
-			R3 = std::clamp(R3, 0, 255);
-			G3 = std::clamp(G3, 0, 255);
-			B3 = std::clamp(B3, 0, 255);
-			R4 = std::clamp(R4, 0, 255);
-			G4 = std::clamp(G4, 0, 255);
-			B4 = std::clamp(B4, 0, 255);
-			R5 = std::clamp(R5, 0, 255);
-			G5 = std::clamp(G5, 0, 255);
-			B5 = std::clamp(B5, 0, 255);
-			R6 = std::clamp(R6, 0, 255);
-			G6 = std::clamp(G6, 0, 255);
-			B6 = std::clamp(B6, 0, 255);
-			R7 = std::clamp(R7, 0, 255);
-			G7 = std::clamp(G7, 0, 255);
-			B7 = std::clamp(B7, 0, 255);
-
-			*(dst0++) = R0;
-			*(dst0++) = G0;
-			*(dst0++) = B0;
-			*(dst0++) = R1;
-			*(dst0++) = G1;
-			*(dst0++) = B1;
-			*(dst0++) = R2;
-			*(dst0++) = G2;
-			*(dst0++) = B2;
-			*(dst0++) = R3;
-			*(dst0++) = G3;
-			*(dst0++) = B3;
-			*(dst1++) = R4;
-			*(dst1++) = G4;
-			*(dst1++) = B4;
-			*(dst1++) = R5;
-			*(dst1++) = G5;
-			*(dst1++) = B5;
-			*(dst1++) = R6;
-			*(dst1++) = G6;
-			*(dst1++) = B6;
-			*(dst1++) = R7;
-			*(dst1++) = G7;
-			*(dst1++) = B7;
-		}
-		// Straggling pixel columns - we must still do both rows.
-		for (; x < dst_info.width; x++)
+		if (coverage[x] <= threshold)
+			continue;
+		for (unsigned int c = 0; c < 3; c++)
+			dst[c] = (dst[c] * (256 - alpha) + colour[c] * alpha + 128) >> 8;
+	}
+}
+
+#if defined(RPICAM_NEON_KERNELS)
+// 16 pixels at a time, blending them all and keeping the result only where the mask passes.
+NEON_TARGET static void blend_row_neon(uint8_t *dst, uint8_t const *coverage, unsigned int n, uint8_t threshold,
+									   uint8_t const colour[3], unsigned int alpha)
+{
+	unsigned int x = 0;
+	uint8x8_t keep = vdup_n_u8(256 - alpha); // alpha is never 0
+	uint8x16_t limit = vdupq_n_u8(threshold);
+	uint16x8_t tint[3];
+	for (unsigned int c = 0; c < 3; c++)
+		tint[c] = vdupq_n_u16(colour[c] * alpha + 128);
+	for (; x + 16 <= n; x += 16)
+	{
+		uint8x16_t inside = vcgtq_u8(vld1q_u8(coverage + x), limit);
+		uint64x2_t any = vreinterpretq_u64_u8(inside);
+		if (!(vgetq_lane_u64(any, 0) | vgetq_lane_u64(any, 1)))
+			continue;
+		uint8x16x3_t pixels = vld3q_u8(dst + 3 * x);
+		for (unsigned int c = 0; c < 3; c++)
 		{
-			int Y0 = *(src_Y0++);
-			int U0 = *(src_U);
-			int V0 = *(src_V);
-			int Y4 = *(src_Y1++);
-			src_U += (x & 1);
-			src_V += (x & 1);
-
-			U0 -= 128;
-			V0 -= 128;
-			int U4 = U0;
-			int V4 = V0;
-
-			int R0 = Y0 + 1.402 * V0;
-			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
-			int B0 = Y0 + 1.771 * U0;
-			int R4 = Y4 + 1.402 * V4;
-			int G4 = Y4 - 0.345 * U4 - 0.714 * V4;
-			int B4 = Y4 + 1.771 * U4;
-
-			R0 = std::clamp(R0, 0, 255);
-			G0 = std::clamp(G0, 0, 255);
-			B0 = std::clamp(B0, 0, 255);
-			R4 = std::clamp(R4, 0, 255);
-			G4 = std::clamp(G4, 0, 255);
-			B4 = std::clamp(B4, 0, 255);
-
-			*(dst0++) = R0;
-			*(dst0++) = G0;
-			*(dst0++) = B0;
-			*(dst1++) = R4;
-			*(dst1++) = G4;
-			*(dst1++) = B4;
+			uint8x8_t lo = vshrn_n_u16(vmlal_u8(tint[c], vget_low_u8(pixels.val[c]), keep), 8);
+			uint8x8_t hi = vshrn_n_u16(vmlal_u8(tint[c], vget_high_u8(pixels.val[c]), keep), 8);
+			pixels.val[c] = vbslq_u8(inside, vcombine_u8(lo, hi), pixels.val[c]);
 		}
+		vst3q_u8(dst + 3 * x, pixels);
 	}
-	// Any straggling final row is done with extreme steam power.
-	for (; y < dst_info.height; y++)
+	blend_row_generic(dst + 3 * x, coverage + x, n - x, threshold, colour, alpha);
+}
+#endif
+
+using BlendRow = void (*)(uint8_t *, uint8_t const *, unsigned int, uint8_t, uint8_t const[3], unsigned int);
+static BlendRow const blend_row = SelectKernel<BlendRow>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, blend_row_neon },
+#endif
+	{ CpuLevel::Generic, blend_row_generic },
+});
+
+// Where a destination pixel's centre falls in the source, as the pixel before it and the weight (in 256ths)
+// of the one after, as cv::resize's INTER_LINEAR has it.
+static void linear_tap(unsigned int i, unsigned int src_size, unsigned int dst_size, unsigned int &index,
+					   unsigned int &weight)
+{
+	int64_t pos = ((2 * i + 1) * (int64_t)src_size * 128) / dst_size - 128;
+	if (pos <= 0)
+		index = 0, weight = 0;
+	else if ((unsigned int)(pos >> 8) >= src_size - 1)
+		index = src_size - 1, weight = 0;
+	else
+		index = pos >> 8, weight = pos & 255;
+}
+
+void PostProcessingStage::BlendMask(uint8_t *image, unsigned int stride, libcamera::Rectangle const &rect,
+									uint8_t const *mask, unsigned int mask_width, unsigned int mask_height,
+									uint8_t threshold, uint8_t const colour[3], float alpha)
+{
+	unsigned int a = std::clamp<int>(std::lround(alpha * 256), 0, 256);
+	if (!rect.width || !rect.height || !mask_width || !mask_height || !a)
+		return;
+
+	std::vector<unsigned int> x_index(rect.width), x_weight(rect.width);
+	for (unsigned int x = 0; x < rect.width; x++)
+		linear_tap(x, mask_width, rect.width, x_index[x], x_weight[x]);
+
+	std::vector<uint16_t> column(mask_width); // the mask blended between two of its rows, in 256ths
+	std::vector<uint8_t> coverage(rect.width);
+	for (unsigned int y = 0; y < rect.height; y++)
 	{
-		const uint8_t *src_Y0 = src + (y + off_y) * src_info.stride + off_x;
-		const uint8_t *src_U = src + src_Y_size + ((y + off_y) / 2) * (src_info.stride / 2) + off_x / 2;
-		const uint8_t *src_V = src_U + src_U_size;
-		uint8_t *dst0 = &dst[y * dst_info.stride];
+		unsigned int index, weight;
+		linear_tap(y, mask_height, rect.height, index, weight);
+		uint8_t const *row0 = mask + index * mask_width;
+		uint8_t const *row1 = weight ? row0 + mask_width : row0;
+		for (unsigned int x = 0; x < mask_width; x++)
+			column[x] = row0[x] * (256 - weight) + row1[x] * weight;
 
-		unsigned int x = 0;
-		for (; x < dst_info.width; x++)
+		for (unsigned int x = 0; x < rect.width; x++)
 		{
-			int Y0 = *(src_Y0++);
-			int U0 = *(src_U);
-			int V0 = *(src_V);
-			src_U += (x & 1);
-			src_V += (x & 1);
-
-			U0 -= 128;
-			V0 -= 128;
-
-			int R0 = Y0 + 1.402 * V0;
-			int G0 = Y0 - 0.345 * U0 - 0.714 * V0;
-			int B0 = Y0 + 1.771 * U0;
-
-			R0 = std::clamp(R0, 0, 255);
-			G0 = std::clamp(G0, 0, 255);
-			B0 = std::clamp(B0, 0, 255);
-
-			*(dst0++) = R0;
-			*(dst0++) = G0;
-			*(dst0++) = B0;
+			unsigned int i = x_index[x], w = x_weight[x];
+			unsigned int next = w ? column[i + 1] : 0;
+			coverage[x] = (column[i] * (256 - w) + next * w + 32768) >> 16;
 		}
+
+		blend_row(image + (rect.y + y) * stride + 3 * rect.x, coverage.data(), rect.width, threshold, colour, a);
 	}
 }
 
+static std::shared_ptr<FrameCache> frame_cache(CompletedRequestPtr &completed_request)
+{
+	static const MetadataTag cache_tag("post_process.frame_cache");
+	Metadata &metadata = completed_request->post_process_metadata;
+	std::scoped_lock lock(metadata);
+	if (auto cache = metadata.GetLocked<std::shared_ptr<FrameCache>>(cache_tag))
+		return *cache;
+	std::shared_ptr<FrameCache> cache = std::make_shared<FrameCache>();
+	metadata.SetLocked(cache_tag, cache);
+	return cache;
+}
+
+std::shared_ptr<ScratchBuffer const> PostProcessingStage::GetStreamCopy(CompletedRequestPtr &completed_request,
+																			   libcamera::Stream *stream)
+{
+	char key[64];
+	snprintf(key, sizeof(key), "copy %p", (void *)stream);
+	using Scratch = std::shared_ptr<ScratchBuffer>;
+	std::shared_ptr<Scratch const> copy = frame_cache(completed_request)->Get<Scratch>(key, [&]() {
+		BufferReadSync r(app_, completed_request->buffers[stream]);
+		libcamera::Span<uint8_t> buffer = r.Get()[0];
+		Scratch data = GetScratch(buffer.size());
+		std::copy(buffer.begin(), buffer.end(), data->begin());
+		return data;
+	});
+	return std::shared_ptr<ScratchBuffer const>(copy, copy->get());
+}
+
+std::shared_ptr<ScratchBuffer const> PostProcessingStage::GetRgbImage(CompletedRequestPtr &completed_request,
+																			 libcamera::Stream *stream,
+																			 StreamInfo &src_info, StreamInfo &dst_info)
+{
+	return GetRgbImage(completed_request, stream, src_info, dst_info, RgbConversion());
+}
+
+std::shared_ptr<ScratchBuffer const> PostProcessingStage::GetRgbImage(CompletedRequestPtr &completed_request,
+																			 libcamera::Stream *stream,
+																			 StreamInfo &src_info, StreamInfo &dst_info,
+																			 RgbConversion const &conversion)
+{
+	char key[128];
+	snprintf(key, sizeof(key), "rgb %p %ux%u/%u %d %d %d %u %d %d", (void *)stream, dst_info.width, dst_info.height,
+			 dst_info.stride, (int)conversion.resize, conversion.bgr, conversion.planar, conversion.pad,
+			 conversion.nearest, conversion.use_colour_space);
+	using Scratch = std::shared_ptr<ScratchBuffer>;
+	std::shared_ptr<Scratch const> image = frame_cache(completed_request)->Get<Scratch>(key, [&]() {
+		// Converting from the copy is quicker than reading the buffer itself, and the copy may well
+		// be wanted again.
+		std::shared_ptr<ScratchBuffer const> copy = GetStreamCopy(completed_request, stream);
+		Scratch data = GetScratch(conversion.planar ? dst_info.width * dst_info.height * 3
+													: dst_info.stride * dst_info.height);
+		Yuv420ToRgb(data->data(), copy->data(), src_info, dst_info, conversion);
+		return data;
+	});
+	return std::shared_ptr<ScratchBuffer const>(image, image->get());
+}
+
+std::shared_ptr<ScratchBuffer> PostProcessingStage::GetScratch(std::size_t size)
+{
+	return app_->GetPostProcessor().GetScratchPool().Get(size);
+}
+
 static std::map<std::string, StageCreateFunc> &stages()
 {
 	static std::map<std::string, StageCreateFunc> stages;
@@ -18,9 +18,15 @@
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
+#include <libcamera/geometry.h>
+#include <libcamera/pixel_format.h>
+
 #include "core/completed_request.hpp"
 #include "core/stream_info.hpp"
 
+#include "post_processing_stages/frame_cache.hpp"
+#include "post_processing_stages/scratch_pool.hpp"
+
 namespace libcamera
 {
 struct StreamConfiguration;
@@ -39,10 +45,39 @@ public:
 
 	virtual char const *Name() const = 0;
 
+	// How the post-processor may schedule calls to Process() across its worker threads.
+	enum class Concurrency
+	{
+		// Process() may run on several requests at once, in any order.
+		Reentrant,
+		// Process() runs on one request at a time, in the order the requests arrived.
+		Ordered,
+		// Process() runs on one request at a time, in no particular order.
+		Serial,
+	};
+
+	virtual Concurrency GetConcurrency() const;
+
 	virtual void Read(boost::property_tree::ptree const &params);
 
+	// Called with use_case "still", "video" or "viewfinder" for the main stream, and "lores" for the low
+	// resolution stream, before the configuration is validated.
 	virtual void AdjustConfig(std::string const &use_case, StreamConfiguration *config);
 
+	// What a stage would like of the lores stream. An empty size or format means it doesn't mind.
+	struct LoresRequest
+	{
+		libcamera::Size size;
+		libcamera::PixelFormat format;
+		unsigned int stride_alignment = 0; // in bytes
+		bool packed = false; // no padding at the end of the rows, so the buffer can be used as it is
+	};
+
+	// Return true, filling in the request, if this stage wants a lores stream. Called once the stages have
+	// all been read, so that when no lores size was given one can be chosen that the ISP scales to, rather
+	// than the stages resizing on the CPU.
+	virtual bool GetLoresRequest(LoresRequest &request);
+
 	virtual void Configure();
 
 	virtual void Start();
@@ -56,10 +91,46 @@ public:
 
 	// Below here are some helpers provided for the convenience of derived classes.
 
+	// How Yuv420ToRgb fits the source image into the destination, and how it lays out the result.
+	struct RgbConversion
+	{
+		enum class Resize
+		{
+			Crop, // the middle of the source, unscaled (as Fill if the source is the smaller)
+			Scale, // all of the source, stretched to the destination size
+			Fill, // scaled to cover the destination, cropping what's left over
+			Letterbox, // scaled to fit inside the destination, padding the rest
+		};
+		// Accepts "crop", "scale", "fill" or "letterbox".
+		static Resize ParseResize(std::string const &name);
+
+		Resize resize = Resize::Crop;
+		bool bgr = false;
+		bool planar = false; // NCHW: all the first channel, then the second, then the third
+		uint8_t pad = 0; // colour of the letterbox bars
+		bool nearest = false; // point sample, reading as little of the source as possible, rather than filter
+		bool use_colour_space = false; // use src_info's colour space, rather than always full range BT.601
+		// Float outputs are (value - offset) / scale, for each channel in output order.
+		float offset[3] = { 0, 0, 0 };
+		float scale[3] = { 1, 1, 1 };
+	};
+
 	// Convert YUV420 image to RGB. We crop from the centre of the image if the src
-	// image is larger than the destination.
+	// image is larger than the destination. Interleaved uint8 rows are dst_info.stride
+	// bytes apart, while planar and float outputs are packed.
 	static std::vector<uint8_t> Yuv420ToRgb(const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
 	static void Yuv420ToRgb(uint8_t *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info);
+	static void Yuv420ToRgb(uint8_t *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info,
+							RgbConversion const &conversion);
+	static void Yuv420ToRgb(float *dst, const uint8_t *src, StreamInfo &src_info, StreamInfo &dst_info,
+							RgbConversion const &conversion);
+
+	// Blend colour, with weight alpha, into the pixels of rect in an interleaved 3 byte per pixel image
+	// wherever the mask (0 to 255), scaled bilinearly to the size of rect, is above threshold. This does
+	// the scaling, the threshold and the blend together, in one pass over just those rows.
+	static void BlendMask(uint8_t *image, unsigned int stride, libcamera::Rectangle const &rect, uint8_t const *mask,
+						  unsigned int mask_width, unsigned int mask_height, uint8_t threshold,
+						  uint8_t const colour[3], float alpha);
 
 protected:
 	// Helper to calculate the execution time of any callable object and return it in as a std::chrono::duration.
@@ -92,6 +163,22 @@ protected:
 		return vec;
 	}
 
+	// The stream's image copied into ordinary memory, which is much quicker to read, made once per
+	// frame however many stages ask for it.
+	std::shared_ptr<ScratchBuffer const> GetStreamCopy(CompletedRequestPtr &completed_request,
+															  libcamera::Stream *stream);
+	// A YUV420 stream converted with Yuv420ToRgb, also shared by all the stages asking for the same
+	// stream, size and conversion on a frame.
+	std::shared_ptr<ScratchBuffer const> GetRgbImage(CompletedRequestPtr &completed_request,
+															libcamera::Stream *stream, StreamInfo &src_info,
+															StreamInfo &dst_info);
+	std::shared_ptr<ScratchBuffer const> GetRgbImage(CompletedRequestPtr &completed_request,
+															libcamera::Stream *stream, StreamInfo &src_info,
+															StreamInfo &dst_info, RgbConversion const &conversion);
+	// A buffer of this size from the post-processor's pool, holding whatever was last left in it, for
+	// work that's done afresh on every frame. It goes back to the pool when the pointer does.
+	std::shared_ptr<ScratchBuffer> GetScratch(std::size_t size);
+
 	RPiCamApp *app_;
 };
 
@@ -5,13 +5,21 @@
  * pwl.cpp - piecewise linear functions
  */
 
+#include <atomic>
 #include <cassert>
 #include <stdexcept>
 
 #include "pwl.hpp"
 
+uint64_t Pwl::nextVersion()
+{
+	static std::atomic<uint64_t> version = 0;
+	return ++version;
+}
+
 void Pwl::Read(boost::property_tree::ptree const &params)
 {
+	version_ = nextVersion();
 	for (auto it = params.begin(); it != params.end(); it++) {
 		double x = it->second.get_value<double>();
 		assert(it == params.begin() || x > points_.back().x);
@@ -24,14 +32,18 @@ void Pwl::Read(boost::property_tree::ptree const &params)
 
 void Pwl::Append(double x, double y, const double eps)
 {
-	if (points_.empty() || points_.back().x + eps < x)
+	if (points_.empty() || points_.back().x + eps < x) {
 		points_.push_back(Point(x, y));
+		version_ = nextVersion();
+	}
 }
 
 void Pwl::Prepend(double x, double y, const double eps)
 {
-	if (points_.empty() || points_.front().x - eps > x)
+	if (points_.empty() || points_.front().x - eps > x) {
 		points_.insert(points_.begin(), Point(x, y));
+		version_ = nextVersion();
+	}
 }
 
 Pwl::Interval Pwl::Domain() const
@@ -194,6 +206,7 @@ Pwl &Pwl::operator*=(double d)
 {
 	for (auto &pt : points_)
 		pt.y *= d;
+	version_ = nextVersion();
 	return *this;
 }
 
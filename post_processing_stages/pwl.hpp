@@ -8,7 +8,11 @@
 
 #include <math.h>
 
+#include <algorithm>
+#include <cstdint>
 #include <functional>
+#include <limits>
+#include <type_traits>
 #include <vector>
 
 #include <boost/property_tree/ptree.hpp>
@@ -35,8 +39,8 @@ public:
 		double Len2() const { return x * x + y * y; }
 		double Len() const { return sqrt(Len2()); }
 	};
-	Pwl() {}
-	Pwl(std::vector<Point> const &points) : points_(points) {}
+	Pwl() : version_(nextVersion()) {}
+	Pwl(std::vector<Point> const &points) : points_(points), version_(nextVersion()) {}
 	void Read(boost::property_tree::ptree const &params);
 	void Append(double x, double y, const double eps = 1e-6);
 	void Prepend(double x, double y, const double eps = 1e-6);
@@ -87,8 +91,60 @@ public:
 	}
 	Pwl &operator*=(double d);
 	void Debug(FILE *fp = stderr) const;
+	// Changes whenever the points do, and is shared only with copies, so a LUT made from a Pwl can tell
+	// whether it is still up to date.
+	uint64_t Version() const { return version_; }
 
 private:
+	static uint64_t nextVersion();
 	int findSpan(double x, int span) const;
 	std::vector<Point> points_;
+	uint64_t version_;
+};
+
+// A Pwl tabulated at each integer x across its domain, in fixed point with the given number of
+// fractional bits and saturated to T. Update only regenerates the table when the Pwl has changed, so
+// a stage can call it on every frame. Lookups outside the domain give its first or last value.
+template <typename T>
+class PwlLut
+{
+	static_assert(std::is_integral_v<T>, "PwlLut tables are fixed point");
+
+public:
+	PwlLut(int fraction_bits = 0) : fraction_bits_(fraction_bits), version_(0) {}
+
+	// Returns true if the table had to be regenerated.
+	bool Update(Pwl const &pwl)
+	{
+		if (pwl.Version() == version_ && !values_.empty())
+			return false;
+		int end = pwl.Domain().end + 1, span = 0;
+		double scale = 1 << fraction_bits_;
+		values_.resize(std::max(end, 1));
+		for (int x = 0; x < end; x++)
+			values_[x] = std::clamp<double>(lround(pwl.Eval(x, &span) * scale), std::numeric_limits<T>::min(),
+											std::numeric_limits<T>::max());
+		version_ = pwl.Version();
+		return true;
+	}
+
+	T operator[](int x) const { return values_[std::clamp<int>(x, 0, values_.size() - 1)]; }
+	// The gather the ALUs can't do for us, kept tight so that the arithmetic on what it fetches can be
+	// vectorised separately.
+	template <typename Index>
+	void Gather(T *dest, Index const *indices, int n) const
+	{
+		T const *values = values_.data();
+		int last = values_.size() - 1;
+		for (int i = 0; i < n; i++)
+			dest[i] = values[std::clamp<int>(indices[i], 0, last)];
+	}
+
+	int FractionBits() const { return fraction_bits_; }
+	unsigned int Size() const { return values_.size(); }
+
+private:
+	int fraction_bits_;
+	uint64_t version_;
+	std::vector<T> values_;
 };
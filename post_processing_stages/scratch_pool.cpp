@@ -0,0 +1,96 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * scratch_pool.cpp - Reusable buffers for the post processing stages' per-frame work.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "core/logging.hpp"
+
+#include "scratch_pool.hpp"
+
+// The size of an Arm64 transparent huge page with 4K pages. Smaller buffers aren't worth it.
+static constexpr std::size_t HUGE_PAGE_SIZE = ScratchAllocator<uint8_t>::HUGE_PAGE_SIZE;
+// Idle buffers kept of any one size. The stages hold at most a few frames' worth at once.
+static constexpr unsigned int MAX_FREE_PER_SIZE = 8;
+
+ScratchPool::ScratchPool() : state_(std::make_shared<State>())
+{
+}
+
+ScratchPool::~ScratchPool()
+{
+	LOG(2, "Scratch pool: " << state_->made << " buffers made, " << state_->reused << " reused");
+}
+
+void ScratchPool::SetHugePages(bool enable)
+{
+	std::lock_guard<std::mutex> lock(state_->mutex);
+	state_->huge_pages = enable;
+}
+
+std::shared_ptr<ScratchBuffer> ScratchPool::Get(std::size_t size)
+{
+	std::unique_ptr<Buffer> buffer;
+	bool huge_pages;
+	{
+		std::lock_guard<std::mutex> lock(state_->mutex);
+		auto it = state_->free.find(size);
+		if (it != state_->free.end())
+		{
+			buffer = std::move(it->second);
+			state_->free.erase(it);
+			state_->reused++;
+		}
+		else
+			state_->made++;
+		huge_pages = state_->huge_pages;
+	}
+
+	if (!buffer)
+	{
+		buffer = std::make_unique<Buffer>();
+		buffer->data.resize(size);
+		buffer->memory = MemoryUse("post-process scratch", MemoryReport::Kind::Heap, size);
+		// Nothing has touched the buffer yet, so the advice comes before any of it is faulted in. Big
+		// buffers start on a huge page, but only the whole huge pages inside them can be backed by them.
+		// The advice is just that, so it doesn't matter if the kernel was built without them.
+		uintptr_t start = ((uintptr_t)buffer->data.data() + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+		uintptr_t end = ((uintptr_t)buffer->data.data() + size) & ~(HUGE_PAGE_SIZE - 1);
+		if (huge_pages && end > start)
+			madvise((void *)start, end - start, MADV_HUGEPAGE);
+		// Now fault it all in, here rather than in the middle of whatever the stage does with it.
+		std::size_t page_size = sysconf(_SC_PAGESIZE);
+		for (std::size_t offset = 0; offset < size; offset += page_size)
+			buffer->data[offset] = 0;
+	}
+
+	std::weak_ptr<State> state = state_;
+	Buffer *ptr = buffer.release();
+	return std::shared_ptr<ScratchBuffer>(&ptr->data, [state, ptr](ScratchBuffer *)
+												 { release(state, ptr); });
+}
+
+void ScratchPool::Trim()
+{
+	std::multimap<std::size_t, std::unique_ptr<Buffer>> free;
+	{
+		std::lock_guard<std::mutex> lock(state_->mutex);
+		free.swap(state_->free);
+	}
+}
+
+void ScratchPool::release(std::weak_ptr<State> const &weak_state, Buffer *buffer)
+{
+	std::unique_ptr<Buffer> owned(buffer);
+	std::shared_ptr<State> state = weak_state.lock();
+	if (!state)
+		return;
+
+	std::lock_guard<std::mutex> lock(state->mutex);
+	if (state->free.count(owned->data.size()) < MAX_FREE_PER_SIZE)
+		state->free.emplace(owned->data.size(), std::move(owned));
+}
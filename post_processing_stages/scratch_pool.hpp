@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * scratch_pool.hpp - Reusable buffers for the post processing stages' per-frame work.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+#include "core/memory_report.hpp"
+
+// Memory for the scratch buffers. Anything of a huge page or more is aligned to one, so that all of it can
+// be backed by them, and resizing leaves the bytes alone instead of zeroing them, which would fault every
+// page in before the pool could ask for huge pages.
+template <typename T>
+struct ScratchAllocator
+{
+	using value_type = T;
+	static constexpr std::size_t HUGE_PAGE_SIZE = 2 << 20;
+
+	ScratchAllocator() = default;
+	template <typename U>
+	ScratchAllocator(ScratchAllocator<U> const &)
+	{
+	}
+
+	T *allocate(std::size_t n)
+	{
+		std::size_t size = n * sizeof(T);
+		void *ptr;
+		if (size >= HUGE_PAGE_SIZE)
+			ptr = aligned_alloc(HUGE_PAGE_SIZE, (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+		else
+			ptr = malloc(size);
+		if (!ptr)
+			throw std::bad_alloc();
+		return static_cast<T *>(ptr);
+	}
+	void deallocate(T *ptr, std::size_t) { free(ptr); }
+
+	template <typename U>
+	void construct(U *ptr)
+	{
+		::new ((void *)ptr) U;
+	}
+	template <typename U, typename... Args>
+	void construct(U *ptr, Args &&...args)
+	{
+		::new ((void *)ptr) U(std::forward<Args>(args)...);
+	}
+
+	template <typename U>
+	bool operator==(ScratchAllocator<U> const &) const
+	{
+		return true;
+	}
+	template <typename U>
+	bool operator!=(ScratchAllocator<U> const &) const
+	{
+		return false;
+	}
+};
+
+using ScratchBuffer = std::vector<uint8_t, ScratchAllocator<uint8_t>>;
+
+// The stream copies and RGB images that the stages make on every frame are all the same few sizes, so
+// rather than go back to the system allocator (and take fresh page faults) each time, the buffers are
+// kept here once the last holder lets them go and handed out again. Buffers of a couple of megabytes
+// or more can ask the kernel for transparent huge pages, which saves TLB misses on the big images.
+class ScratchPool
+{
+public:
+	ScratchPool();
+	~ScratchPool();
+
+	void SetHugePages(bool enable);
+
+	// A buffer of exactly size bytes, holding whatever was last left in it. It goes back to the pool when
+	// the last copy of the pointer does, even if that's after the pool itself has gone.
+	std::shared_ptr<ScratchBuffer> Get(std::size_t size);
+
+	// Free the buffers nobody is using, for when the sizes are about to change.
+	void Trim();
+
+private:
+	struct Buffer
+	{
+		ScratchBuffer data;
+		MemoryUse memory;
+	};
+
+	// Shared with the buffers handed out, so that they know whether there's still a pool to go back to.
+	struct State
+	{
+		std::mutex mutex;
+		std::multimap<std::size_t, std::unique_ptr<Buffer>> free;
+		bool huge_pages = false;
+		uint64_t made = 0;
+		uint64_t reused = 0;
+	};
+
+	static void release(std::weak_ptr<State> const &state, Buffer *buffer);
+
+	std::shared_ptr<State> state_;
+};
@@ -9,6 +9,7 @@
 
 #include "core/rpicam_app.hpp"
 
+#include "post_processing_stages/cv_workspace.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include "opencv2/core.hpp"
@@ -32,8 +33,17 @@ public:
 	bool Process(CompletedRequestPtr &completed_request) override;
 
 private:
+	// The intermediate images, kept so that they're only allocated once.
+	struct Mats
+	{
+		Mat blurred;
+		Mat grad_x, grad_y;
+		Mat abs_grad_x, abs_grad_y;
+	};
+
 	Stream *stream_;
 	int ksize_ = 3;
+	CvWorkspace<Mats> workspace_;
 };
 
 #define NAME "sobel_cv"
@@ -53,6 +63,16 @@ void SobelCvStage::Configure()
 	stream_ = app_->GetMainStream();
 	if (!stream_ || stream_->configuration().pixelFormat != libcamera::formats::YUV420)
 		throw std::runtime_error("SobelCvStage: only YUV420 format supported");
+
+	// Allocate one set of images now, rather than on the first frame.
+	StreamInfo info = app_->GetStreamInfo(stream_);
+	workspace_.Reset();
+	CvWorkspace<Mats>::Lease mats = workspace_.Acquire(stream_);
+	mats->blurred.create(info.height, info.width, CV_8U);
+	mats->grad_x.create(info.height, info.width, CV_16S);
+	mats->grad_y.create(info.height, info.width, CV_16S);
+	mats->abs_grad_x.create(info.height, info.width, CV_8U);
+	mats->abs_grad_y.create(info.height, info.width, CV_8U);
 }
 
 bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
@@ -66,29 +86,30 @@ bool SobelCvStage::Process(CompletedRequestPtr &completed_request)
 
 	uint8_t value = 128;
 	int num = (info.stride * info.height) / 2;
-	Mat src = Mat(info.height, info.width, CV_8U, ptr, info.stride);
+	Mat src = cv_wrap(ptr, info);
 	int scale = 1;
 	int delta = 0;
 	int ddepth = CV_16S;
 
+	cv_bind_threads();
+	CvWorkspace<Mats>::Lease mats = workspace_.Acquire(stream_);
+
 	memset(ptr + info.stride * info.height, value, num);
 
 	// Remove noise by blurring with a Gaussian filter ( kernal size = 3 )
-	GaussianBlur(src, src, Size(3, 3), 0, 0, BORDER_DEFAULT);
-
-	Mat grad_x, grad_y;
+	GaussianBlur(src, mats->blurred, Size(3, 3), 0, 0, BORDER_DEFAULT);
 
 	//Scharr(src_gray, grad_x, ddepth, 1, 0, scale, delta, BORDER_DEFAULT);
-	Sobel(src, grad_x, ddepth, 1, 0, ksize_, scale, delta, BORDER_DEFAULT);
+	Sobel(mats->blurred, mats->grad_x, ddepth, 1, 0, ksize_, scale, delta, BORDER_DEFAULT);
 	//Scharr(src_gray, grad_y, ddepth, 0, 1, scale, delta, BORDER_DEFAULT);
-	Sobel(src, grad_y, ddepth, 0, 1, ksize_, scale, delta, BORDER_DEFAULT);
+	Sobel(mats->blurred, mats->grad_y, ddepth, 0, 1, ksize_, scale, delta, BORDER_DEFAULT);
 
-	// converting back to CV_8U
-	convertScaleAbs(grad_x, grad_x);
-	convertScaleAbs(grad_y, grad_y);
+	// converting back to CV_8U, into Mats of their own so that the gradients keep their type
+	convertScaleAbs(mats->grad_x, mats->abs_grad_x);
+	convertScaleAbs(mats->grad_y, mats->abs_grad_y);
 
 	//weight the x and y gradients and add their magnitudes
-	addWeighted(grad_x, 0.5, grad_y, 0.5, 0, src);
+	addWeighted(mats->abs_grad_x, 0.5, mats->abs_grad_y, 0.5, 0, src);
 
 	return false;
 }
@@ -0,0 +1,210 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * temporal_denoise_stage.cpp - motion-gated multi-frame denoise
+ */
+
+// A temporal denoise for video. We keep a ring of the last few frames and replace each pixel
+// with the average over all of them. Where a past frame's pixel differs from the current one by
+// more than a threshold, we take it that something moved and use the current pixel in its place,
+// so moving things don't leave trails. Static parts of the scene get the full benefit and noise
+// there drops by roughly the square root of the number of frames.
+
+// By default this works on the main stream, which is what gets encoded, but it can be pointed
+// at the lores stream instead. Either way, the stream needs to be YUV420.
+
+#include <algorithm>
+#include <cstring>
+
+#include <libcamera/formats.h>
+#include <libcamera/stream.h>
+
+#include "core/cpu_features.hpp"
+#include "core/rpicam_app.hpp"
+#include "core/stream_info.hpp"
+
+#include "post_processing_stages/post_processing_stage.hpp"
+
+using Stream = libcamera::Stream;
+
+class TemporalDenoiseStage : public PostProcessingStage
+{
+public:
+	TemporalDenoiseStage(RPiCamApp *app) : PostProcessingStage(app) {}
+
+	char const *Name() const override;
+
+	// Each frame is averaged with the ones before it.
+	Concurrency GetConcurrency() const override { return Concurrency::Ordered; }
+
+	void Read(boost::property_tree::ptree const &params) override;
+
+	void Configure() override;
+
+	bool Process(CompletedRequestPtr &completed_request) override;
+
+private:
+	struct Config
+	{
+		unsigned int num_frames;
+		unsigned int threshold;
+		unsigned int chroma_threshold;
+		std::string stream;
+	} config_;
+	Stream *stream_;
+	StreamInfo info_;
+	// The raw frames, most recent at ring_[next_ - 1].
+	std::vector<std::vector<uint8_t>> ring_;
+	unsigned int next_;
+	bool first_time_;
+};
+
+#define NAME "temporal_denoise"
+
+static constexpr unsigned int MAX_FRAMES = 8;
+
+char const *TemporalDenoiseStage::Name() const
+{
+	return NAME;
+}
+
+void TemporalDenoiseStage::Read(boost::property_tree::ptree const &params)
+{
+	config_.num_frames = std::clamp(params.get<unsigned int>("num_frames", 4), 2u, MAX_FRAMES);
+	config_.threshold = std::min(params.get<unsigned int>("threshold", 12), 255u);
+	config_.chroma_threshold = std::min(params.get<unsigned int>("chroma_threshold", 8), 255u);
+	config_.stream = params.get<std::string>("stream", "main");
+	if (config_.stream != "main" && config_.stream != "lores")
+		throw std::runtime_error("TemporalDenoiseStage: stream must be main or lores");
+}
+
+void TemporalDenoiseStage::Configure()
+{
+	stream_ = config_.stream == "lores" ? app_->LoresStream() : app_->GetMainStream();
+	if (!stream_)
+		return;
+	info_ = app_->GetStreamInfo(stream_);
+	if (stream_->configuration().pixelFormat != libcamera::formats::YUV420)
+		throw std::runtime_error("TemporalDenoiseStage: only supports YUV420");
+
+	ring_.assign(config_.num_frames, std::vector<uint8_t>(info_.stride * info_.height * 3 / 2));
+	next_ = 0;
+	first_time_ = true;
+}
+
+// Average the current pixels with the past ones, using the current value in place of any past one
+// that differs from it by more than threshold. The sum is divided by the number of frames using
+// recip, which is that number's reciprocal with 16 fractional bits.
+
+static void denoise_from(unsigned int x, uint8_t *dst, uint8_t const *cur, uint8_t const *const *past,
+						 unsigned int num_past, unsigned int n, unsigned int threshold, uint32_t recip)
+{
+	for (; x < n; x++)
+	{
+		unsigned int c = cur[x], sum = c;
+		for (unsigned int i = 0; i < num_past; i++)
+		{
+			unsigned int p = past[i][x];
+			sum += (p > c ? p - c : c - p) <= threshold ? p : c;
+		}
+		dst[x] = std::min((sum * recip + 32768) >> 16, 255u);
+	}
+}
+
+static void denoise_generic(uint8_t *dst, uint8_t const *cur, uint8_t const *const *past, unsigned int num_past,
+							unsigned int n, unsigned int threshold, uint32_t recip)
+{
+	denoise_from(0, dst, cur, past, num_past, n, threshold, recip);
+}
+
+#if defined(RPICAM_NEON_KERNELS)
+NEON_TARGET static void denoise_neon(uint8_t *dst, uint8_t const *cur, uint8_t const *const *past,
+									 unsigned int num_past, unsigned int n, unsigned int threshold, uint32_t recip)
+{
+	unsigned int x = 0;
+	uint8x16_t thr = vdupq_n_u8(threshold);
+	for (; x + 16 <= n; x += 16)
+	{
+		uint8x16_t c = vld1q_u8(cur + x);
+		uint16x8_t sum_lo = vmovl_u8(vget_low_u8(c)), sum_hi = vmovl_u8(vget_high_u8(c));
+		for (unsigned int i = 0; i < num_past; i++)
+		{
+			uint8x16_t p = vld1q_u8(past[i] + x);
+			uint8x16_t v = vbslq_u8(vcleq_u8(vabdq_u8(p, c), thr), p, c);
+			sum_lo = vaddw_u8(sum_lo, vget_low_u8(v));
+			sum_hi = vaddw_u8(sum_hi, vget_high_u8(v));
+		}
+		uint16x8_t lo = vcombine_u16(vrshrn_n_u32(vmull_n_u16(vget_low_u16(sum_lo), recip), 16),
+									 vrshrn_n_u32(vmull_n_u16(vget_high_u16(sum_lo), recip), 16));
+		uint16x8_t hi = vcombine_u16(vrshrn_n_u32(vmull_n_u16(vget_low_u16(sum_hi), recip), 16),
+									 vrshrn_n_u32(vmull_n_u16(vget_high_u16(sum_hi), recip), 16));
+		vst1q_u8(dst + x, vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi)));
+	}
+	denoise_from(x, dst, cur, past, num_past, n, threshold, recip);
+}
+#endif
+
+using Denoise = void (*)(uint8_t *, uint8_t const *, uint8_t const *const *, unsigned int, unsigned int,
+						 unsigned int, uint32_t);
+static Denoise const denoise = SelectKernel<Denoise>({
+#if defined(RPICAM_NEON_KERNELS)
+	{ CpuLevel::Neon, denoise_neon },
+#endif
+	{ CpuLevel::Generic, denoise_generic },
+});
+
+bool TemporalDenoiseStage::Process(CompletedRequestPtr &completed_request)
+{
+	if (!stream_)
+		return false;
+
+	BufferWriteSync w(app_, completed_request->buffers[stream_]);
+	libcamera::Span<uint8_t> buffer = w.Get()[0];
+	uint8_t *image = buffer.data();
+	unsigned int luma_size = info_.stride * info_.height;
+	unsigned int size = std::min<unsigned int>(ring_[0].size(), buffer.size());
+
+	// Copying the frame out first is much quicker than reading the uncached buffer several times.
+	uint8_t const *cur = ring_[next_].data();
+	memcpy(ring_[next_].data(), image, size);
+
+	// Until we have seen enough frames, pretend the first one was repeated.
+	if (first_time_)
+	{
+		first_time_ = false;
+		for (auto &frame : ring_)
+			memcpy(frame.data(), cur, size);
+	}
+
+	uint8_t const *past[MAX_FRAMES];
+	unsigned int num_past = 0;
+	for (unsigned int i = 0; i < ring_.size(); i++)
+	{
+		if (i != next_)
+			past[num_past++] = ring_[i].data();
+	}
+	next_ = (next_ + 1) % ring_.size();
+
+	uint32_t recip = (65536 + ring_.size() / 2) / ring_.size();
+	unsigned int offsets[2] = { 0, std::min(luma_size, size) };
+	unsigned int ends[2] = { offsets[1], size };
+	unsigned int thresholds[2] = { config_.threshold, config_.chroma_threshold };
+	for (unsigned int plane = 0; plane < 2; plane++)
+	{
+		uint8_t const *plane_past[MAX_FRAMES];
+		for (unsigned int i = 0; i < num_past; i++)
+			plane_past[i] = past[i] + offsets[plane];
+		denoise(image + offsets[plane], cur + offsets[plane], plane_past, num_past, ends[plane] - offsets[plane],
+				thresholds[plane], recip);
+	}
+
+	return false;
+}
+
+static PostProcessingStage *Create(RPiCamApp *app)
+{
+	return new TemporalDenoiseStage(app);
+}
+
+static RegisterStage reg(NAME, &Create);
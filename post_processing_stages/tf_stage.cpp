@@ -6,6 +6,20 @@
  */
 #include "tf_stage.hpp"
 
+// Which delegates are available depends on how TFLite was built.
+#if __has_include("tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h")
+#include "tensorflow/lite/delegates/xnnpack/xnnpack_delegate.h"
+#define HAVE_XNNPACK_DELEGATE 1
+#endif
+#if __has_include("tensorflow/lite/delegates/gpu/delegate.h")
+#include "tensorflow/lite/delegates/gpu/delegate.h"
+#define HAVE_GPU_DELEGATE 1
+#endif
+#if __has_include("tensorflow/lite/delegates/external/external_delegate.h")
+#include "tensorflow/lite/delegates/external/external_delegate.h"
+#define HAVE_EXTERNAL_DELEGATE 1
+#endif
+
 TfStage::TfStage(RPiCamApp *app, int tf_w, int tf_h) : PostProcessingStage(app), tf_w_(tf_w), tf_h_(tf_h)
 {
 	if (tf_w_ <= 0 || tf_h_ <= 0)
@@ -16,10 +30,18 @@ void TfStage::Read(boost::property_tree::ptree const &params)
 {
 	config_->number_of_threads = params.get<int>("number_of_threads", 2);
 	config_->refresh_rate = params.get<int>("refresh_rate", 5);
+	config_->number_of_interpreters = std::max(params.get<unsigned int>("number_of_interpreters", 1), 1u);
 	config_->model_file = params.get<std::string>("model_file", "");
 	config_->verbose = params.get<int>("verbose", 0);
 	config_->normalisation_offset = params.get<float>("normalisation_offset", 127.5);
 	config_->normalisation_scale = params.get<float>("normalisation_scale", 127.5);
+	config_->delegate = params.get<std::string>("delegate", "none");
+	config_->delegate_library = params.get<std::string>("delegate_library", "");
+	if (auto options = params.get_child_optional("delegate_options"))
+	{
+		for (auto const &[key, value] : *options)
+			config_->delegate_options[key] = value.get_value<std::string>();
+	}
 
 	initialise();
 
@@ -33,16 +55,27 @@ void TfStage::initialise()
 		throw std::runtime_error("TfStage: Failed to load model");
 	LOG(1, "TfStage: Loaded model " << config_->model_file);
 
+	// The interpreters all share the one model.
 	tflite::ops::builtin::BuiltinOpResolver resolver;
-	tflite::InterpreterBuilder(*model_, resolver)(&interpreter_);
-	if (!interpreter_)
-		throw std::runtime_error("TfStage: Failed to construct interpreter");
+	workers_.resize(config_->number_of_interpreters);
+	for (Worker &worker : workers_)
+	{
+		tflite::InterpreterBuilder(*model_, resolver)(&worker.interpreter);
+		if (!worker.interpreter)
+			throw std::runtime_error("TfStage: Failed to construct interpreter");
 
-	if (config_->number_of_threads != -1)
-		interpreter_->SetNumThreads(config_->number_of_threads);
+		if (config_->number_of_threads != -1)
+			worker.interpreter->SetNumThreads(config_->number_of_threads);
 
-	if (interpreter_->AllocateTensors() != kTfLiteOk)
-		throw std::runtime_error("TfStage: Failed to allocate tensors");
+		if (config_->delegate != "none")
+			applyDelegate(worker);
+
+		if (worker.interpreter->AllocateTensors() != kTfLiteOk)
+			throw std::runtime_error("TfStage: Failed to allocate tensors");
+	}
+	interpreter_ = workers_[0].interpreter.get();
+	if (workers_.size() > 1)
+		LOG(1, "TfStage: Using " << workers_.size() << " interpreters");
 
 	// Make an attempt to verify that the model expects this size of input.
 	int input = interpreter_->inputs()[0];
@@ -60,6 +93,65 @@ void TfStage::initialise()
 		throw std::runtime_error("TfStage: Input tensor size mismatch");
 }
 
+void TfStage::applyDelegate(Worker &worker)
+{
+	std::string const &name = config_->delegate;
+	TfLiteDelegate *delegate = nullptr;
+	void (*destroy)(TfLiteDelegate *) = nullptr;
+
+	if (name == "xnnpack")
+	{
+#ifdef HAVE_XNNPACK_DELEGATE
+		TfLiteXNNPackDelegateOptions options = TfLiteXNNPackDelegateOptionsDefault();
+		if (config_->number_of_threads > 0)
+			options.num_threads = config_->number_of_threads;
+		delegate = TfLiteXNNPackDelegateCreate(&options);
+		destroy = TfLiteXNNPackDelegateDelete;
+#endif
+	}
+	else if (name == "gpu")
+	{
+#ifdef HAVE_GPU_DELEGATE
+		TfLiteGpuDelegateOptionsV2 options = TfLiteGpuDelegateOptionsV2Default();
+		delegate = TfLiteGpuDelegateV2Create(&options);
+		destroy = TfLiteGpuDelegateV2Delete;
+#endif
+	}
+	else if (name == "external")
+	{
+#ifdef HAVE_EXTERNAL_DELEGATE
+		if (config_->delegate_library.empty())
+			throw std::runtime_error("TfStage: the external delegate needs a delegate_library");
+		// The options only point at our strings, which live as long as the config.
+		TfLiteExternalDelegateOptions options = TfLiteExternalDelegateOptionsDefault(config_->delegate_library.c_str());
+		for (auto const &[key, value] : config_->delegate_options)
+			options.insert(&options, key.c_str(), value.c_str());
+		delegate = TfLiteExternalDelegateCreate(&options);
+		destroy = TfLiteExternalDelegateDelete;
+#endif
+	}
+	else
+		throw std::runtime_error("TfStage: unknown delegate " + name);
+
+	if (!delegate)
+		throw std::runtime_error("TfStage: the " + name + " delegate is not available");
+	worker.delegate = decltype(worker.delegate)(delegate, destroy);
+
+	// Parts of the model the delegate can't handle still run on the CPU.
+	if (worker.interpreter->ModifyGraphWithDelegate(delegate) != kTfLiteOk)
+		LOG_ERROR("TfStage: WARNING: failed to apply the " << name << " delegate, running on the CPU");
+	else if (&worker == &workers_[0])
+		LOG(1, "TfStage: using the " << name << " delegate");
+}
+
+bool TfStage::GetLoresRequest(LoresRequest &request)
+{
+	// The model's input size, so the lores image can go straight to RGB without being cropped or scaled.
+	request.size = libcamera::Size(tf_w_, tf_h_);
+	request.format = libcamera::formats::YUV420;
+	return true;
+}
+
 void TfStage::Configure()
 {
 	lores_stream_ = app_->LoresStream();
@@ -97,24 +189,31 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 
 	{
 		std::unique_lock<std::mutex> lck(future_mutex_);
-		if (config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
-			(!future_ || future_->wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+		// Frames go to the interpreters in turn, skipping any that are still busy.
+		for (unsigned int i = 0; config_->refresh_rate && completed_request->sequence % config_->refresh_rate == 0 &&
+								 i < workers_.size();
+			 i++)
 		{
-			BufferReadSync r(app_, completed_request->buffers[lores_stream_]);
-			libcamera::Span<uint8_t> buffer = r.Get()[0];
+			unsigned int index = (next_worker_ + i) % workers_.size();
+			Worker &worker = workers_[index];
+			if (worker.future.valid() && worker.future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+				continue;
 
 			// Copy the lores image here and let the asynchronous thread convert it to RGB.
 			// Doing the "extra" copy is in fact hugely beneficial because it turns uncacned
-			// memory into cached memory, which is then *much* quicker.
-			lores_copy_.assign(buffer.data(), buffer.data() + buffer.size());
+			// memory into cached memory, which is then *much* quicker. Other stages may
+			// share the same copy.
+			worker.lores_copy = GetStreamCopy(completed_request, lores_stream_);
 
-			future_ = std::make_unique<std::future<void>>();
-			*future_ = std::async(std::launch::async, [this] {
-				auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this).count();
+			uint64_t ticket = next_ticket_++;
+			worker.future = std::async(std::launch::async, [this, &worker, ticket] {
+				auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this, worker, ticket).count();
 
 				if (config_->verbose)
 					LOG(1, "TfStage: Inference time: " << time_taken << " ms");
 			});
+			next_worker_ = (index + 1) % workers_.size();
+			break;
 		}
 	}
 
@@ -124,35 +223,52 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 	return false;
 }
 
-void TfStage::runInference()
+void TfStage::runInference(Worker &worker, uint64_t ticket)
 {
-	int input = interpreter_->inputs()[0];
+	tflite::Interpreter *interpreter = worker.interpreter.get();
+	int input = interpreter->inputs()[0];
 	StreamInfo tf_info;
 	tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
-	std::vector<uint8_t> rgb_image = Yuv420ToRgb(lores_copy_.data(), lores_info_, tf_info);
 
-	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
+	// Convert straight into the input tensor, normalising as we go for float models.
+	if (interpreter->tensor(input)->type == kTfLiteUInt8)
+		Yuv420ToRgb(interpreter->typed_tensor<uint8_t>(input), worker.lores_copy->data(), lores_info_, tf_info);
+	else if (interpreter->tensor(input)->type == kTfLiteFloat32)
 	{
-		uint8_t *tensor = interpreter_->typed_tensor<uint8_t>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = rgb_image[i];
+		RgbConversion conversion;
+		for (unsigned int c = 0; c < 3; c++)
+		{
+			conversion.offset[c] = config_->normalisation_offset;
+			conversion.scale[c] = config_->normalisation_scale;
+		}
+		Yuv420ToRgb(interpreter->typed_tensor<float>(input), worker.lores_copy->data(), lores_info_, tf_info,
+					conversion);
 	}
-	else if (interpreter_->tensor(input)->type == kTfLiteFloat32)
+
+	worker.lores_copy.reset();
+	bool ok = interpreter->Invoke() == kTfLiteOk;
+
+	// Wait for any inference started before this one, so that results never go backwards. A
+	// failed inference still has to take its turn, or the later ones would wait forever.
+	std::unique_lock<std::mutex> lock(output_mutex_);
+	output_cv_.wait(lock, [this, ticket] { return next_output_ == ticket; });
+	if (ok)
 	{
-		float *tensor = interpreter_->typed_tensor<float>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = (rgb_image[i] - config_->normalisation_offset) / config_->normalisation_scale;
+		interpreter_ = interpreter;
+		interpretOutputs();
 	}
+	next_output_++;
+	output_cv_.notify_all();
 
-	if (interpreter_->Invoke() != kTfLiteOk)
+	if (!ok)
 		throw std::runtime_error("TfStage: Failed to invoke TFLite");
-
-	std::unique_lock<std::mutex> lock(output_mutex_);
-	interpretOutputs();
 }
 
 void TfStage::Stop()
 {
-	if (future_)
-		future_->wait();
+	for (Worker &worker : workers_)
+	{
+		if (worker.future.valid())
+			worker.future.wait();
+	}
 }
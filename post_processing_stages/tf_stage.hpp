@@ -7,8 +7,13 @@
 
 #pragma once
 
+#include <algorithm>
+#include <condition_variable>
+#include <future>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <string>
 #include <vector>
 
 #include <libcamera/stream.h>
@@ -31,10 +36,17 @@ struct TfConfig
 {
 	int number_of_threads = 3;
 	int refresh_rate = 5;
+	// Each interpreter can be running on a different frame at the same time.
+	unsigned int number_of_interpreters = 1;
 	std::string model_file;
 	bool verbose = false;
 	float normalisation_offset = 127.5;
 	float normalisation_scale = 127.5;
+	// Where TFLite may send the model: "none", "xnnpack", "gpu" or "external" (which loads
+	// delegate_library and gives it the delegate_options).
+	std::string delegate = "none";
+	std::string delegate_library;
+	std::map<std::string, std::string> delegate_options;
 };
 
 class TfStage : public PostProcessingStage
@@ -50,6 +62,8 @@ public:
 
 	void Read(boost::property_tree::ptree const &params) override;
 
+	bool GetLoresRequest(LoresRequest &request) override;
+
 	void Configure() override;
 
 	bool Process(CompletedRequestPtr &completed_request) override;
@@ -92,14 +106,30 @@ protected:
 	StreamInfo main_stream_info_;
 
 	std::unique_ptr<tflite::FlatBufferModel> model_;
-	std::unique_ptr<tflite::Interpreter> interpreter_;
+	// While interpretOutputs runs, this is the interpreter whose outputs it should read. At other
+	// times it's just the first interpreter.
+	tflite::Interpreter *interpreter_ = nullptr;
 
 private:
+	struct Worker
+	{
+		// The delegate has to outlive the interpreter that uses it.
+		std::unique_ptr<TfLiteDelegate, void (*)(TfLiteDelegate *)> delegate { nullptr, nullptr };
+		std::unique_ptr<tflite::Interpreter> interpreter;
+		std::future<void> future;
+		std::shared_ptr<ScratchBuffer const> lores_copy;
+	};
+
 	void initialise();
-	void runInference();
+	void applyDelegate(Worker &worker);
+	void runInference(Worker &worker, uint64_t ticket);
 
+	std::vector<Worker> workers_;
 	std::mutex future_mutex_;
-	std::unique_ptr<std::future<void>> future_;
-	std::vector<uint8_t> lores_copy_;
+	unsigned int next_worker_ = 0;
+	uint64_t next_ticket_ = 0;
 	std::mutex output_mutex_;
+	// Inferences hand their outputs over in the order they were started.
+	std::condition_variable output_cv_;
+	uint64_t next_output_ = 0;
 };
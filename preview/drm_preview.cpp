@@ -5,6 +5,16 @@
  * drm_preview.cpp - DRM-based preview window.
  */
 
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
 #include <drm.h>
 #include <drm_fourcc.h>
 #include <drm_mode.h>
@@ -26,6 +36,8 @@ public:
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() override;
+	// The overlay goes on an ARGB plane of its own, above the image, so the camera buffers are never touched.
+	virtual void SetOverlay(PreviewOverlay const &overlay) override { overlay_ = overlay; }
 	// Return the maximum image size allowed.
 	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const override
 	{
@@ -46,6 +58,15 @@ private:
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
 	void findCrtc();
 	void findPlane();
+	void findOverlayPlane();
+	void setupAtomic();
+	bool drawOverlay(unsigned int x, unsigned int y, unsigned int w, unsigned int h);
+	void destroyOverlay();
+	void showAtomic(int fd, Buffer const &buffer, unsigned int x, unsigned int y, unsigned int w, unsigned int h);
+	void eventThread();
+	void flipDone();
+	static void pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+								void *user_data);
 	int drmfd_;
 	int conId_;
 	uint32_t crtcId_;
@@ -63,6 +84,33 @@ private:
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
 	bool first_time_;
+
+	// With atomic modesetting, plane updates are committed without waiting for them. Each buffer goes back
+	// when the page flip event says that the next one has replaced it on the screen.
+	bool atomic_;
+	std::map<std::string, uint32_t> plane_props_;
+	std::mutex flip_mutex_;
+	std::condition_variable flip_cond_var_;
+	int pending_fd_; // committed, but not yet on the screen
+	int quit_fd_;
+	std::thread event_thread_;
+
+	// The overlay plane covers the whole preview window. Only the box outlines get drawn and erased, so
+	// there's very little for the CPU to do.
+	struct OverlayRect
+	{
+		int x, y, w, h;
+	};
+	uint32_t overlay_plane_id_ = 0;
+	std::map<std::string, uint32_t> overlay_props_;
+	uint32_t overlay_handle_ = 0;
+	uint32_t overlay_fb_ = 0;
+	uint32_t overlay_pitch_ = 0;
+	size_t overlay_size_ = 0;
+	uint32_t *overlay_map_ = nullptr;
+	bool overlay_shown_ = false;
+	PreviewOverlay overlay_;
+	std::vector<OverlayRect> overlay_drawn_;
 };
 
 #define ERRSTR strerror(errno)
@@ -242,7 +290,101 @@ void DrmPreview::findPlane()
 	drmModeFreePlaneResources(planes);
 }
 
-DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
+static void get_plane_props(int fd, uint32_t plane_id, std::map<std::string, uint32_t> &props,
+							std::map<std::string, uint64_t> *values = nullptr)
+{
+	drmModeObjectPropertiesPtr properties = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!properties)
+		throw std::runtime_error("drmModeObjectGetProperties failed: " + std::string(ERRSTR));
+	for (unsigned int i = 0; i < properties->count_props; i++)
+	{
+		drmModePropertyPtr prop = drmModeGetProperty(fd, properties->props[i]);
+		if (!prop)
+			continue;
+		props[prop->name] = prop->prop_id;
+		if (values)
+			(*values)[prop->name] = properties->prop_values[i];
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(properties);
+}
+
+void DrmPreview::findOverlayPlane()
+{
+	drmModePlaneResPtr planes = drmModeGetPlaneResources(drmfd_);
+	if (!planes)
+		throw std::runtime_error("drmModeGetPlaneResources failed: " + std::string(ERRSTR));
+
+	for (unsigned int i = 0; i < planes->count_planes && !overlay_plane_id_; ++i)
+	{
+		drmModePlanePtr plane = drmModeGetPlane(drmfd_, planes->planes[i]);
+		if (!plane)
+			continue;
+		if (plane->plane_id != planeId_ && (plane->possible_crtcs & (1 << crtcIdx_)))
+		{
+			for (unsigned int j = 0; j < plane->count_formats; ++j)
+			{
+				if (plane->formats[j] == DRM_FORMAT_ARGB8888)
+				{
+					overlay_plane_id_ = plane->plane_id;
+					break;
+				}
+			}
+		}
+		drmModeFreePlane(plane);
+	}
+	drmModeFreePlaneResources(planes);
+
+	if (!overlay_plane_id_)
+	{
+		LOG(2, "DrmPreview: no plane for overlays");
+		return;
+	}
+
+	// Make sure the overlay goes on top of the image, where the planes let us choose.
+	std::map<std::string, uint32_t> image_props;
+	std::map<std::string, uint64_t> image_values;
+	get_plane_props(drmfd_, planeId_, image_props, &image_values);
+	get_plane_props(drmfd_, overlay_plane_id_, overlay_props_);
+	if (image_props.count("zpos") && overlay_props_.count("zpos"))
+		drmModeObjectSetProperty(drmfd_, overlay_plane_id_, DRM_MODE_OBJECT_PLANE, overlay_props_["zpos"],
+								 image_values["zpos"] + 1);
+}
+
+void DrmPreview::setupAtomic()
+{
+	// Only now, as this exposes the primary and cursor planes too, and findPlane() wants an overlay.
+	if (drmSetClientCap(drmfd_, DRM_CLIENT_CAP_ATOMIC, 1))
+	{
+		LOG(2, "DrmPreview: no atomic modesetting, using legacy plane updates");
+		return;
+	}
+
+	get_plane_props(drmfd_, planeId_, plane_props_);
+	if (overlay_plane_id_)
+		get_plane_props(drmfd_, overlay_plane_id_, overlay_props_);
+
+	for (char const *name : { "FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H", "CRTC_X", "CRTC_Y", "CRTC_W",
+							  "CRTC_H" })
+	{
+		if (!plane_props_.count(name))
+		{
+			LOG(1, "DrmPreview: plane has no " << name << " property, using legacy plane updates");
+			return;
+		}
+	}
+
+	quit_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (quit_fd_ < 0)
+		throw std::runtime_error("eventfd failed: " + std::string(ERRSTR));
+
+	atomic_ = true;
+	event_thread_ = std::thread(&DrmPreview::eventThread, this);
+	LOG(2, "DrmPreview: using atomic modesetting");
+}
+
+DrmPreview::DrmPreview(Options const *options)
+	: Preview(options), last_fd_(-1), first_time_(true), atomic_(false), pending_fd_(-1), quit_fd_(-1)
 {
 	drmfd_ = drmOpen("vc4", NULL);
 	if (drmfd_ < 0)
@@ -264,6 +406,8 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 		findCrtc();
 		out_fourcc_ = DRM_FORMAT_YUV420;
 		findPlane();
+		findOverlayPlane();
+		setupAtomic();
 	}
 	catch (std::exception const &e)
 	{
@@ -283,9 +427,152 @@ DrmPreview::DrmPreview(Options const *options) : Preview(options), last_fd_(-1),
 
 DrmPreview::~DrmPreview()
 {
+	if (event_thread_.joinable())
+	{
+		uint64_t one = 1;
+		if (write(quit_fd_, &one, sizeof(one)) != sizeof(one))
+			LOG_ERROR("DrmPreview: failed to stop event thread");
+		event_thread_.join();
+	}
+	if (quit_fd_ >= 0)
+		close(quit_fd_);
+	destroyOverlay();
 	close(drmfd_);
 }
 
+static void draw_outline(uint32_t *map, unsigned int stride, unsigned int width, unsigned int height, int x, int y,
+						 int w, int h, uint32_t colour)
+{
+	constexpr int THICKNESS = 2;
+	int x0 = std::clamp(x, 0, (int)width), x1 = std::clamp(x + w, 0, (int)width);
+	int y0 = std::clamp(y, 0, (int)height), y1 = std::clamp(y + h, 0, (int)height);
+	for (int j = y0; j < y1; j++)
+	{
+		uint32_t *row = map + j * stride;
+		if (j < y + THICKNESS || j >= y + h - THICKNESS)
+			std::fill(row + x0, row + x1, colour);
+		else
+		{
+			for (int i = x0; i < std::min(x + THICKNESS, x1); i++)
+				row[i] = colour;
+			for (int i = std::max(x + w - THICKNESS, x0); i < x1; i++)
+				row[i] = colour;
+		}
+	}
+}
+
+bool DrmPreview::drawOverlay(unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+	if (!overlay_plane_id_ || (overlay_.boxes.empty() && overlay_drawn_.empty()))
+		return false;
+
+	if (!overlay_map_)
+	{
+		drm_mode_create_dumb create = {};
+		create.width = width_;
+		create.height = height_;
+		create.bpp = 32;
+		if (drmIoctl(drmfd_, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0)
+		{
+			LOG_ERROR("WARNING: DrmPreview: couldn't make overlay buffer, overlays disabled");
+			overlay_plane_id_ = 0;
+			return false;
+		}
+		overlay_handle_ = create.handle;
+		overlay_pitch_ = create.pitch;
+		overlay_size_ = create.size;
+
+		uint32_t handles[4] = { overlay_handle_ }, pitches[4] = { overlay_pitch_ }, offsets[4] = { 0 };
+		drm_mode_map_dumb map = {};
+		map.handle = overlay_handle_;
+		if (drmModeAddFB2(drmfd_, width_, height_, DRM_FORMAT_ARGB8888, handles, pitches, offsets, &overlay_fb_, 0) ||
+			drmIoctl(drmfd_, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0)
+			throw std::runtime_error("DrmPreview: failed to set up overlay buffer: " + std::string(ERRSTR));
+		void *mem = mmap(0, overlay_size_, PROT_READ | PROT_WRITE, MAP_SHARED, drmfd_, map.offset);
+		if (mem == MAP_FAILED)
+			throw std::runtime_error("DrmPreview: failed to map overlay buffer: " + std::string(ERRSTR));
+		overlay_map_ = static_cast<uint32_t *>(mem);
+		memset(overlay_map_, 0, overlay_size_);
+	}
+
+	// Rub out the last boxes and draw the new ones, relative to where the image is in the window.
+	unsigned int stride = overlay_pitch_ / 4;
+	for (auto const &r : overlay_drawn_)
+		draw_outline(overlay_map_, stride, width_, height_, r.x, r.y, r.w, r.h, 0);
+	overlay_drawn_.clear();
+	for (auto const &box : overlay_.boxes)
+	{
+		OverlayRect r = { (int)(x - x_ + box.x * w), (int)(y - y_ + box.y * h), (int)(box.width * w),
+						  (int)(box.height * h) };
+		draw_outline(overlay_map_, stride, width_, height_, r.x, r.y, r.w, r.h, 0xff00ff00);
+		overlay_drawn_.push_back(r);
+	}
+
+	// The plane only needs attaching once, after which it just shows whatever is in the buffer.
+	return !overlay_shown_;
+}
+
+void DrmPreview::destroyOverlay()
+{
+	if (overlay_map_)
+		munmap(overlay_map_, overlay_size_);
+	if (overlay_fb_)
+		drmModeRmFB(drmfd_, overlay_fb_);
+	if (overlay_handle_)
+	{
+		drm_mode_destroy_dumb destroy = {};
+		destroy.handle = overlay_handle_;
+		drmIoctl(drmfd_, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+	}
+	overlay_map_ = nullptr;
+	overlay_fb_ = overlay_handle_ = 0;
+}
+
+void DrmPreview::eventThread()
+{
+	drmEventContext context = {};
+	context.version = 2;
+	context.page_flip_handler = &DrmPreview::pageFlipHandler;
+	pollfd fds[2] = { { drmfd_, POLLIN, 0 }, { quit_fd_, POLLIN, 0 } };
+
+	while (true)
+	{
+		if (poll(fds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("DrmPreview: poll failed: " << ERRSTR);
+			return;
+		}
+		if (fds[1].revents)
+			return;
+		if (fds[0].revents & POLLIN)
+			drmHandleEvent(drmfd_, &context);
+	}
+}
+
+void DrmPreview::pageFlipHandler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec,
+								 void *user_data)
+{
+	static_cast<DrmPreview *>(user_data)->flipDone();
+}
+
+void DrmPreview::flipDone()
+{
+	int release;
+	{
+		std::lock_guard<std::mutex> lock(flip_mutex_);
+		release = last_fd_;
+		last_fd_ = pending_fd_;
+		pending_fd_ = -1;
+	}
+	flip_cond_var_.notify_all();
+
+	// The buffer that was being shown has now been replaced on the screen.
+	if (release >= 0)
+		done_callback_(release);
+}
+
 // DRM doesn't seem to have userspace definitions of its enums, but the properties
 // contain enum-name-to-value tables. So the code below ends up using strings and
 // searching for name matches. I suppose it works...
@@ -402,6 +689,22 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	else
 		w = height_ * info.width / info.height, x_off = (width_ - w) / 2;
 
+	bool attach_overlay = drawOverlay(x_off + x_, y_off + y_, w, h);
+
+	if (atomic_)
+	{
+		showAtomic(fd, buffer, x_off + x_, y_off + y_, w, h);
+		return;
+	}
+
+	if (attach_overlay)
+	{
+		if (drmModeSetPlane(drmfd_, overlay_plane_id_, crtcId_, overlay_fb_, 0, x_, y_, width_, height_, 0, 0,
+							width_ << 16, height_ << 16))
+			LOG(1, "DrmPreview: failed to show overlay plane: " << ERRSTR);
+		overlay_shown_ = true;
+	}
+
 	if (drmModeSetPlane(drmfd_, planeId_, crtcId_, buffer.fb_handle, 0, x_off + x_, y_off + y_, w, h, 0, 0,
 						buffer.info.width << 16, buffer.info.height << 16))
 		throw std::runtime_error("drmModeSetPlane failed: " + std::string(ERRSTR));
@@ -410,8 +713,93 @@ void DrmPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &i
 	last_fd_ = fd;
 }
 
+void DrmPreview::showAtomic(int fd, Buffer const &buffer, unsigned int x, unsigned int y, unsigned int w,
+							unsigned int h)
+{
+	bool busy;
+	{
+		std::lock_guard<std::mutex> lock(flip_mutex_);
+		// Rather than wait for the last frame to reach the screen, skip this one, so that we never hold up
+		// the frames behind it.
+		busy = pending_fd_ >= 0;
+		if (!busy)
+			pending_fd_ = fd;
+	}
+	if (busy)
+	{
+		done_callback_(fd);
+		return;
+	}
+
+	drmModeAtomicReqPtr req = drmModeAtomicAlloc();
+	if (!req)
+		throw std::runtime_error("drmModeAtomicAlloc failed");
+	auto add = [this, req](char const *name, uint64_t value) {
+		drmModeAtomicAddProperty(req, planeId_, plane_props_[name], value);
+	};
+	add("FB_ID", buffer.fb_handle);
+	add("CRTC_ID", crtcId_);
+	add("SRC_X", 0);
+	add("SRC_Y", 0);
+	add("SRC_W", buffer.info.width << 16);
+	add("SRC_H", buffer.info.height << 16);
+	add("CRTC_X", x);
+	add("CRTC_Y", y);
+	add("CRTC_W", w);
+	add("CRTC_H", h);
+
+	// Attach the overlay plane along with the image, the first time there's anything on it.
+	bool attach_overlay = !overlay_shown_ && overlay_fb_ && overlay_props_.count("FB_ID");
+	if (attach_overlay)
+	{
+		auto add_overlay = [this, req](char const *name, uint64_t value) {
+			drmModeAtomicAddProperty(req, overlay_plane_id_, overlay_props_[name], value);
+		};
+		add_overlay("FB_ID", overlay_fb_);
+		add_overlay("CRTC_ID", crtcId_);
+		add_overlay("SRC_X", 0);
+		add_overlay("SRC_Y", 0);
+		add_overlay("SRC_W", width_ << 16);
+		add_overlay("SRC_H", height_ << 16);
+		add_overlay("CRTC_X", x_);
+		add_overlay("CRTC_Y", y_);
+		add_overlay("CRTC_W", width_);
+		add_overlay("CRTC_H", height_);
+	}
+
+	int ret = drmModeAtomicCommit(drmfd_, req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, this);
+	int error = errno;
+	drmModeAtomicFree(req);
+	if (!ret && attach_overlay)
+		overlay_shown_ = true;
+
+	if (ret)
+	{
+		{
+			std::lock_guard<std::mutex> lock(flip_mutex_);
+			pending_fd_ = -1;
+		}
+		// Busy only means the display hasn't caught up, so drop the frame.
+		if (error == EBUSY)
+		{
+			done_callback_(fd);
+			return;
+		}
+		throw std::runtime_error("drmModeAtomicCommit failed: " + std::string(strerror(error)));
+	}
+}
+
 void DrmPreview::Reset()
 {
+	if (atomic_)
+	{
+		// Don't remove framebuffers that a commit is still waiting to put on the screen.
+		std::unique_lock<std::mutex> lock(flip_mutex_);
+		if (!flip_cond_var_.wait_for(lock, std::chrono::seconds(1), [this] { return pending_fd_ < 0; }))
+			LOG(1, "DrmPreview: timed out waiting for page flip");
+		pending_fd_ = -1;
+	}
+
 	for (auto &it : buffers_)
 	{
 		drmModeRmFB(drmfd_, it.second.fb_handle);
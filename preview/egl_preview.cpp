@@ -5,8 +5,15 @@
  * egl_preview.cpp - X/EGL-based preview window.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 // Include libcamera stuff before X11, as X11 #defines both Status and None
 // which upsets the libcamera headers.
@@ -32,9 +39,14 @@ public:
 	EglPreview(Options const *options);
 	~EglPreview();
 	virtual void SetInfoText(const std::string &text) override;
+	virtual bool ShowsInfoText() const override { return true; }
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) override;
+	// Import the buffer ahead of time, so that the first time it's shown is no slower.
+	virtual void Prepare(int fd, size_t size, StreamInfo const &info) override;
+	// The overlay is drawn by the GPU after the image, straight into the window.
+	virtual void SetOverlay(PreviewOverlay const &overlay) override;
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() override;
@@ -56,8 +68,20 @@ private:
 		StreamInfo info;
 		GLuint texture;
 	};
+	struct Frame
+	{
+		int fd = -1;
+		size_t size = 0;
+		StreamInfo info;
+		PreviewOverlay overlay;
+	};
 	void makeWindow(char const *name);
 	void makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer &buffer);
+	void renderThread();
+	void draw(Frame const &frame);
+	void drawOverlay(PreviewOverlay const &overlay);
+	void handleEvents();
+	void resetBuffers();
 	::Display *display_;
 	EGLDisplay egl_display_;
 	Window window_;
@@ -67,6 +91,9 @@ private:
 	int last_fd_;
 	bool first_time_;
 	Atom wm_delete_window_;
+	GLint image_program_;
+	GLint overlay_program_;
+	float quad_[8]; // where the image goes in the window
 	// size of preview window
 	int x_;
 	int y_;
@@ -74,6 +101,20 @@ private:
 	int height_;
 	unsigned int max_image_width_;
 	unsigned int max_image_height_;
+
+	// Everything that touches X or GL happens on the render thread, so a slow eglSwapBuffers never holds
+	// up the caller. Show() just leaves the frame in a one-deep mailbox, replacing (and returning) any
+	// frame that hasn't been drawn yet. So at most three buffers are held: on screen, being drawn and waiting.
+	std::thread render_thread_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	bool abort_ = false;
+	bool reset_ = false;
+	Frame pending_;
+	PreviewOverlay next_overlay_;
+	std::vector<Frame> imports_;
+	std::string info_text_;
+	std::atomic<bool> quit_ { false };
 };
 
 static GLint compile_shader(GLenum target, const char *source)
@@ -106,6 +147,8 @@ static GLint link_program(GLint vs, GLint fs)
 	GLint prog = glCreateProgram();
 	glAttachShader(prog, vs);
 	glAttachShader(prog, fs);
+	// All our vertex shaders take their vertices in "pos".
+	glBindAttribLocation(prog, 0, "pos");
 	glLinkProgram(prog);
 
 	GLint ok;
@@ -130,7 +173,7 @@ static GLint link_program(GLint vs, GLint fs)
 	return prog;
 }
 
-static void gl_setup(int width, int height, int window_width, int window_height)
+static GLint gl_setup(int width, int height, int window_width, int window_height, float verts[8])
 {
 	float w_factor = width / (float)window_width;
 	float h_factor = height / (float)window_height;
@@ -162,9 +205,24 @@ static void gl_setup(int width, int height, int window_width, int window_height)
 
 	glUseProgram(prog);
 
-	static const float verts[] = { -w_factor, -h_factor, w_factor, -h_factor, w_factor, h_factor, -w_factor, h_factor };
+	float const quad[] = { -w_factor, -h_factor, w_factor, -h_factor, w_factor, h_factor, -w_factor, h_factor };
+	std::copy(quad, quad + 8, verts);
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
 	glEnableVertexAttribArray(0);
+	return prog;
+}
+
+static GLint overlay_setup()
+{
+	const char *vs = "attribute vec4 pos;\n"
+					 "void main() {\n"
+					 "  gl_Position = pos;\n"
+					 "}\n";
+	const char *fs = "precision mediump float;\n"
+					 "void main() {\n"
+					 "  gl_FragColor = vec4(0.0, 1.0, 0.0, 1.0);\n"
+					 "}\n";
+	return link_program(compile_shader(GL_VERTEX_SHADER, vs), compile_shader(GL_FRAGMENT_SHADER, fs));
 }
 
 EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1), first_time_(true)
@@ -188,12 +246,19 @@ EglPreview::EglPreview(Options const *options) : Preview(options), last_fd_(-1),
 	height_ = options_->Get().preview_height;
 	makeWindow("rpicam-app");
 
-	// gl_setup() has to happen later, once we're sure we're in the display thread.
+	// gl_setup() has to happen later, once we're in the render thread.
+	render_thread_ = std::thread(&EglPreview::renderThread, this);
 }
 
 EglPreview::~EglPreview()
 {
 	EglPreview::Reset();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_all();
+	render_thread_.join();
 	eglDestroyContext(egl_display_, egl_context_);
 }
 
@@ -364,7 +429,8 @@ void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 		// This stuff has to be delayed until we know we're in the thread doing the display.
 		if (!eglMakeCurrent(egl_display_, egl_surface_, egl_surface_, egl_context_))
 			throw std::runtime_error("eglMakeCurrent failed");
-		gl_setup(info.width, info.height, width_, height_);
+		overlay_program_ = overlay_setup();
+		image_program_ = gl_setup(info.width, info.height, width_, height_, quad_);
 		first_time_ = false;
 	}
 
@@ -408,46 +474,168 @@ void EglPreview::makeBuffer(int fd, size_t size, StreamInfo const &info, Buffer
 
 void EglPreview::SetInfoText(const std::string &text)
 {
-	if (!text.empty())
-		XStoreName(display_, window_, text.c_str());
+	if (text.empty())
+		return;
+	std::lock_guard<std::mutex> lock(mutex_);
+	info_text_ = text;
 }
 
 void EglPreview::Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info)
 {
-	Buffer &buffer = buffers_[fd];
+	int dropped = -1;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		dropped = pending_.fd;
+		pending_.fd = fd;
+		pending_.size = span.size();
+		pending_.info = info;
+		pending_.overlay = std::move(next_overlay_);
+		next_overlay_ = PreviewOverlay();
+	}
+	cond_var_.notify_all();
+
+	// Latest frame wins, so one that never got drawn can go straight back.
+	if (dropped >= 0)
+		done_callback_(dropped);
+}
+
+void EglPreview::SetOverlay(PreviewOverlay const &overlay)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	next_overlay_ = overlay;
+}
+
+void EglPreview::Prepare(int fd, size_t size, StreamInfo const &info)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		imports_.push_back({ fd, size, info });
+	}
+	cond_var_.notify_all();
+}
+
+void EglPreview::Reset()
+{
+	// The render thread does the work, and once it's done no more buffers will be handed back.
+	std::unique_lock<std::mutex> lock(mutex_);
+	reset_ = true;
+	cond_var_.notify_all();
+	cond_var_.wait(lock, [this] { return !reset_; });
+}
+
+bool EglPreview::Quit()
+{
+	return quit_;
+}
+
+void EglPreview::renderThread()
+{
+	while (true)
+	{
+		Frame frame;
+		std::vector<Frame> imports;
+		std::string info_text;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			// Wake up now and again to see if the window has been closed.
+			cond_var_.wait_for(lock, std::chrono::milliseconds(100),
+							   [this] { return abort_ || reset_ || pending_.fd >= 0 || !imports_.empty(); });
+			if (reset_)
+			{
+				// Any frame still waiting gets forgotten along with the others.
+				pending_ = Frame();
+				imports_.clear();
+				resetBuffers();
+				reset_ = false;
+				cond_var_.notify_all();
+				continue;
+			}
+			if (abort_)
+				return;
+			std::swap(frame, pending_);
+			std::swap(imports, imports_);
+			std::swap(info_text, info_text_);
+		}
+
+		for (Frame const &import : imports)
+		{
+			// These buffers might never be shown, so failing to import one isn't fatal here.
+			if (buffers_.count(import.fd))
+				continue;
+			try
+			{
+				Buffer buffer;
+				makeBuffer(import.fd, import.size, import.info, buffer);
+				buffers_[import.fd] = buffer;
+			}
+			catch (std::exception const &e)
+			{
+				LOG(1, "EglPreview: couldn't prepare buffer: " << e.what());
+			}
+		}
+		if (!info_text.empty())
+			XStoreName(display_, window_, info_text.c_str());
+		if (frame.fd >= 0)
+			draw(frame);
+		handleEvents();
+	}
+}
+
+void EglPreview::draw(Frame const &frame)
+{
+	Buffer &buffer = buffers_[frame.fd];
 	if (buffer.fd == -1)
-		makeBuffer(fd, span.size(), info, buffer);
+		makeBuffer(frame.fd, frame.size, frame.info, buffer);
 
 	glClearColor(0, 0, 0, 0);
 	glClear(GL_COLOR_BUFFER_BIT);
 
 	glBindTexture(GL_TEXTURE_EXTERNAL_OES, buffer.texture);
 	glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+	if (!frame.overlay.boxes.empty())
+		drawOverlay(frame.overlay);
 	EGLBoolean success [[maybe_unused]] = eglSwapBuffers(egl_display_, egl_surface_);
 	if (last_fd_ >= 0)
 		done_callback_(last_fd_);
-	last_fd_ = fd;
+	last_fd_ = frame.fd;
 }
 
-void EglPreview::Reset()
+void EglPreview::drawOverlay(PreviewOverlay const &overlay)
 {
-	for (auto &it : buffers_)
-		glDeleteTextures(1, &it.second.texture);
-	buffers_.clear();
-	last_fd_ = -1;
-	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
-	first_time_ = true;
+	// Map fractions of the image onto the quad it was drawn in.
+	float w_factor = quad_[2], h_factor = quad_[5];
+	glUseProgram(overlay_program_);
+	glLineWidth(2);
+	for (auto const &box : overlay.boxes)
+	{
+		float x0 = (2 * box.x - 1) * w_factor, x1 = (2 * (box.x + box.width) - 1) * w_factor;
+		float y0 = (1 - 2 * box.y) * h_factor, y1 = (1 - 2 * (box.y + box.height)) * h_factor;
+		float const verts[] = { x0, y0, x1, y0, x1, y1, x0, y1 };
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
+		glDrawArrays(GL_LINE_LOOP, 0, 4);
+	}
+	glUseProgram(image_program_);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, quad_);
 }
 
-bool EglPreview::Quit()
+void EglPreview::handleEvents()
 {
 	XEvent event;
 	while (XCheckTypedWindowEvent(display_, window_, ClientMessage, &event))
 	{
 		if (static_cast<Atom>(event.xclient.data.l[0]) == wm_delete_window_)
-			return true;
+			quit_ = true;
 	}
-	return false;
+}
+
+void EglPreview::resetBuffers()
+{
+	for (auto &it : buffers_)
+		glDeleteTextures(1, &it.second.texture);
+	buffers_.clear();
+	last_fd_ = -1;
+	eglMakeCurrent(egl_display_, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	first_time_ = true;
 }
 
 static Preview *Create(Options const *options)
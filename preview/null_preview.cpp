@@ -26,6 +26,7 @@ public:
 	virtual void MaxImageSize(unsigned int &w, unsigned int &h) const override { w = h = 0; }
 
 	void SetInfoText(const std::string &text) override { LOG(1, text); }
+	bool ShowsInfoText() const override { return true; }
 
 private:
 };
@@ -20,6 +20,17 @@
 struct Options;
 class DlLib;
 
+// Things drawn over the image in the preview window only, so they never touch the camera buffers.
+struct PreviewOverlay
+{
+	// Outlines, given as fractions of the image width and height.
+	struct Box
+	{
+		float x, y, width, height;
+	};
+	std::vector<Box> boxes;
+};
+
 class Preview
 {
 public:
@@ -31,9 +42,15 @@ public:
 	// is no longer displaying the buffer and it can be safely recycled.
 	void SetDoneCallback(DoneCallback callback) { done_callback_ = callback; }
 	virtual void SetInfoText(const std::string &text) {}
+	// Whether the text given to SetInfoText ends up anywhere that it can be seen.
+	virtual bool ShowsInfoText() const { return false; }
 	// Display the buffer. You get given the fd back in the BufferDoneCallback
 	// once its available for re-use.
 	virtual void Show(int fd, libcamera::Span<uint8_t> span, StreamInfo const &info) = 0;
+	// Optionally get ready to show this buffer, so that showing it the first time is no slower.
+	virtual void Prepare(int fd, size_t size, StreamInfo const &info) {}
+	// Set what to draw over the next frame shown. Previews that can't draw overlays ignore this.
+	virtual void SetOverlay(PreviewOverlay const &overlay) {}
 	// Reset the preview window, clearing the current buffers and being ready to
 	// show new ones.
 	virtual void Reset() = 0;
@@ -0,0 +1,111 @@
+#!/usr/bin/python3
+#
+# rpicam-apps binary metadata converter
+# Copyright (C) 2025, Raspberry Pi Ltd.
+#
+# Reads the files that --metadata-format bin writes (see output/binary_metadata.hpp) and prints
+# them as JSON, either all the frames or just the ones asked for.
+import argparse
+import bisect
+import json
+import struct
+
+FILE_HEADER = struct.Struct('<8sII')
+CHUNK_HEADER = struct.Struct('<IIq')
+NAME_ENTRY = struct.Struct('<II56s')
+VALUE_RECORD = struct.Struct('<IHHI36s')
+INDEX_ENTRY = struct.Struct('<qQ')
+TRAILER = struct.Struct('<QQ8s')
+
+CHUNK_NAMES, CHUNK_FRAME, CHUNK_INDEX = 1, 2, 3
+
+# Element formats for each value type, and how many elements make up one value.
+VALUE_FORMATS = {1: ('?', 1), 2: ('B', 1), 3: ('i', 1), 4: ('q', 1), 5: ('f', 1), 7: ('iiII', 4), 8: ('II', 2)}
+
+
+class MetadataFile:
+    def __init__(self, filename):
+        with open(filename, 'rb') as f:
+            self.data = f.read()
+        magic, version, record_size = FILE_HEADER.unpack_from(self.data, 0)
+        if magic != b'RPIMETA1' or record_size != VALUE_RECORD.size:
+            raise RuntimeError(f'{filename} is not a binary metadata file')
+        self.names = {}
+        self.index = self.read_index()
+
+    def read_index(self):
+        # Use the index at the end if it's there. A file that was never finished won't have one,
+        # so then we find the frames by walking through the chunks.
+        if len(self.data) >= FILE_HEADER.size + TRAILER.size:
+            offset, count, magic = TRAILER.unpack_from(self.data, len(self.data) - TRAILER.size)
+            if magic == b'RPIMIDX1':
+                self.read_names()
+                start = offset + CHUNK_HEADER.size
+                return [INDEX_ENTRY.unpack_from(self.data, start + i * INDEX_ENTRY.size) for i in range(count)]
+        return self.read_names()
+
+    def read_names(self):
+        index = []
+        offset = FILE_HEADER.size
+        while offset + CHUNK_HEADER.size <= len(self.data):
+            chunk_type, count, timestamp = CHUNK_HEADER.unpack_from(self.data, offset)
+            body = offset + CHUNK_HEADER.size
+            if chunk_type == CHUNK_NAMES:
+                for i in range(count):
+                    id, value_type, name = NAME_ENTRY.unpack_from(self.data, body + i * NAME_ENTRY.size)
+                    self.names[id] = (name.rstrip(b'\0').decode(), value_type)
+                offset = body + count * NAME_ENTRY.size
+            elif chunk_type == CHUNK_FRAME:
+                index.append((timestamp, offset))
+                offset = body + count * VALUE_RECORD.size
+            else:
+                break
+        return index
+
+    def frame(self, n):
+        timestamp, offset = self.index[n]
+        chunk_type, count, _ = CHUNK_HEADER.unpack_from(self.data, offset)
+        record = offset + CHUNK_HEADER.size
+        end = record + count * VALUE_RECORD.size
+        values = {}
+        while record < end:
+            id, value_type, extra, size, _ = VALUE_RECORD.unpack_from(self.data, record)
+            start = record + VALUE_RECORD.size - 36
+            raw = self.data[start:start + size]
+            name = self.names.get(id, (f'0x{id:x}', value_type))[0]
+            values[name] = decode(value_type, raw)
+            record += (1 + extra) * VALUE_RECORD.size
+        return {'timestamp_us': timestamp, 'metadata': values}
+
+    def find(self, timestamp_us):
+        # The frame at or just before the given time.
+        return max(0, bisect.bisect_right([t for t, _ in self.index], timestamp_us) - 1)
+
+
+def decode(value_type, raw):
+    if value_type == 6:
+        return raw.decode(errors='replace')
+    if value_type not in VALUE_FORMATS:
+        return raw.hex()
+    fmt, n = VALUE_FORMATS[value_type]
+    size = struct.calcsize('<' + fmt)
+    items = [struct.unpack_from('<' + fmt, raw, i * size) for i in range(len(raw) // size)]
+    items = [item[0] if n == 1 else list(item) for item in items]
+    return items[0] if len(items) == 1 else items
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description='rpicam-apps binary metadata converter')
+    parser.add_argument('filename', help='Metadata file written with --metadata-format bin', type=str)
+    parser.add_argument('--frame', help='Print only this frame number', type=int)
+    parser.add_argument('--time', help='Print only the frame at this timestamp (in microseconds)', type=int)
+    args = parser.parse_args()
+
+    md = MetadataFile(args.filename)
+    if args.frame is not None:
+        frames = [md.frame(args.frame)]
+    elif args.time is not None:
+        frames = [md.frame(md.find(args.time))]
+    else:
+        frames = [md.frame(i) for i in range(len(md.index))]
+    print(json.dumps(frames, indent=4))
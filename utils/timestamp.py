@@ -5,6 +5,7 @@
 #
 import argparse
 import json
+import struct
 import subprocess
 
 try:
@@ -15,10 +16,17 @@ except ImportError:
 
 
 def read_times_pts(file):
-    with open(file) as f:
-        if f.readline().strip() != '# timecode format v2':
-            raise RuntimeError('PTS file format unknown')
-        return [float(line) for line in f.readlines()]
+    # Any of the --pts-format files. The first column of the text ones is always the PTS in ms.
+    with open(file, 'rb') as f:
+        data = f.read()
+    if data.startswith(b'RPIPTS01'):
+        _, _, record_size = struct.unpack_from('<8sII', data, 0)
+        return [struct.unpack_from('<q', data, offset)[0] / 1000
+                for offset in range(16, len(data) - record_size + 1, record_size)]
+    lines = data.decode().splitlines()
+    if lines[0].strip() not in ('# timecode format v2', '# rpicam-apps timestamps v1'):
+        raise RuntimeError('PTS file format unknown')
+    return [float(line.split()[0]) for line in lines[1:] if line and not line.startswith('#')]
 
 
 def read_times_container(file):
@@ -67,13 +75,13 @@ def plot_pts(diffs, avg, title, narrow):
 
 if __name__ == '__main__':
     parser = argparse.ArgumentParser(description='rpicam-apps timestamp analysis tool')
-    parser.add_argument('filename', help='PTS file generated from rpicam-vid (with a .txt or .pts extension)'
+    parser.add_argument('filename', help='PTS file generated from rpicam-vid (with a .txt, .pts or .bin extension)'
                                          ' or an avi/mkv/mp4 container file', type=str)
     parser.add_argument('--plot', help='Plot timestamp graph', action='store_true')
     parser.add_argument('--narrow', help='Narrow the y-axis by hiding outliers', action='store_true')
     args = parser.parse_args()
 
-    if args.filename.lower().endswith(('.txt', '.pts')):
+    if args.filename.lower().endswith(('.txt', '.pts', '.bin')):
         times = read_times_pts(args.filename)
     elif args.filename.lower().endswith(('.avi', '.mkv', '.mp4')):
         times = read_times_container(args.filename)
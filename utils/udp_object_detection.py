@@ -6,9 +6,9 @@
 #
 # udp_object_detection.py - This utility file implements a UDP receiver
 # designed to process object detection information. It's specifically
-# tailored to receive data sent by `object_detect_udp_stage.cpp`,
-# but can also be used with generic UDP senders like `nc -ulp 12347`
-# for debugging raw data.
+# tailored to receive data sent by `object_detect_udp_stage.cpp`, in either
+# its "detection" or "frame" format, but can also be used with generic UDP
+# senders like `nc -ulp 12347` for debugging raw data.
 
 import socket
 import struct
@@ -27,6 +27,17 @@ class ParsedDetection:
     height: int
     name: str
     confidence: float
+    category: int = -1
+    id: int = 0
+
+
+@dataclass
+class ParsedFrame:
+    """All the detections for one frame, as sent in the "frame" format."""
+    sequence: int
+    timestamp: int
+    detections: list
+    more: bool
 
 # --- UDP_AI_Receiver Class Definition ---
 
@@ -36,7 +47,8 @@ class UDP_AI_Receiver:
     The UDP_AI_Receiver class handles the establishment of a UDP socket,
     receiving incoming data, and parsing it into the ParsedDetection format.
     """
-    MAX_BUFFER_SIZE = 1024
+    MAX_BUFFER_SIZE = 65536
+    FRAME_DELIMITER_LE = 0xEECCBBAA
 
     def __init__(self, port: int):
         """
@@ -73,6 +85,63 @@ class UDP_AI_Receiver:
             print(f"Failed to receive UDP message: {e}", file=sys.stderr)
             return None
 
+    def receive(self) -> list:
+        """
+        Method to receive a packet in either format.
+        :return: A list of ParsedFrame objects for a "frame" format datagram,
+                 or of one ParsedDetection for the "detection" format.
+        """
+        try:
+            buffer, addr = self.sock.recvfrom(self.MAX_BUFFER_SIZE)
+        except socket.error as e:
+            print(f"Failed to receive UDP message: {e}", file=sys.stderr)
+            return []
+
+        if len(buffer) >= 4 and struct.unpack('<I', buffer[0:4])[0] == self.FRAME_DELIMITER_LE:
+            return self._parse_frames(buffer)
+        detection = self._parse_detection(buffer)
+        return [detection] if detection else []
+
+    @staticmethod
+    def _parse_frames(buffer: bytes) -> list:
+        """
+        Helper method to parse a "frame" format datagram into ParsedFrame objects.
+        :param buffer: A byte string containing the received data.
+        :return: The frames in the datagram, empty if it was malformed.
+        """
+        # Delimiter (4), version (1), frame count (1), reserved (2).
+        DATAGRAM_HEADER = struct.Struct('<IBBH')
+        # Sequence (4), flags (1), reserved (1), detection count (2), timestamp (8).
+        FRAME_HEADER = struct.Struct('<IBBHq')
+        # x, y, width, height, confidence, category, id, name.
+        DETECTION = struct.Struct('<iiIIfiI16s')
+
+        try:
+            _, version, frame_count, _ = DATAGRAM_HEADER.unpack_from(buffer, 0)
+            if version != 1:
+                print(f"Unsupported frame format version {version}.", file=sys.stderr)
+                return []
+
+            offset = DATAGRAM_HEADER.size
+            frames = []
+            for _ in range(frame_count):
+                sequence, flags, _, count, timestamp = FRAME_HEADER.unpack_from(buffer, offset)
+                offset += FRAME_HEADER.size
+
+                detections = []
+                for _ in range(count):
+                    x, y, width, height, confidence, category, id, name = DETECTION.unpack_from(buffer, offset)
+                    offset += DETECTION.size
+                    name = name.rstrip(b'\0').decode('utf-8', errors='replace')
+                    detections.append(ParsedDetection(x, y, width, height, name, confidence, category, id))
+
+                frames.append(ParsedFrame(sequence, timestamp, detections, bool(flags & 1)))
+            return frames
+
+        except struct.error as e:
+            print(f"Error unpacking packet data: {e}", file=sys.stderr)
+            return []
+
     @staticmethod
     def _parse_detection(buffer: bytes) -> ParsedDetection | None:
         """
@@ -115,7 +184,7 @@ class UDP_AI_Receiver:
                 return None
 
             # Unpack the name string.
-            name = buffer[offset:offset + name_length].decode('utf-8')
+            name = buffer[offset:offset + name_length].rstrip(b'\0').decode('utf-8')
             offset += name_length
 
             # Unpack the confidence score.
@@ -137,11 +206,18 @@ if __name__ == "__main__":
 
     # Enter an infinite loop to continuously receive and process detection packets.
     while True:
-        detection = receiver.receive_detection()
-        if detection:
-            # If a packet was successfully received and parsed, print its contents.
-            print("Received Detection:")
-            print(
-                f"  Box: ({detection.x}, {detection.y}, {detection.width}, {detection.height})")
-            print(f"  Name: {detection.name}")
-            print(f"  Confidence: {detection.confidence}")
+        for item in receiver.receive():
+            # Print the contents of each frame or detection that was successfully received and parsed.
+            if isinstance(item, ParsedFrame):
+                print(f"Received Frame {item.sequence} @ {item.timestamp} ns:")
+                detections = item.detections
+            else:
+                detections = [item]
+            for detection in detections:
+                print("Received Detection:")
+                print(
+                    f"  Box: ({detection.x}, {detection.y}, {detection.width}, {detection.height})")
+                print(f"  Name: {detection.name}")
+                if detection.id:
+                    print(f"  Id: {detection.id}")
+                print(f"  Confidence: {detection.confidence}")